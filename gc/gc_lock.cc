@@ -14,8 +14,12 @@
 #include <boost/interprocess/sync/scoped_lock.hpp>
 #include <boost/static_assert.hpp>
 #include <sys/mman.h>
+#include <sys/syscall.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
 #include <iostream>
 
 using namespace std;
@@ -36,6 +40,8 @@ int32_t gcLockStartingEpoch = 0;
 
 int32_t SpeculativeThreshold = 5;
 
+bool GcLockTimeSharedSections = false;
+
 /** A safe comparaison of epochs that deals with potential overflows.
     \todo So many possible bit twiddling hacks... Must resist...
 */
@@ -67,10 +73,335 @@ compareEpochs (T a, T b)
 }
 
 
+/*****************************************************************************/
+/* GC LOCK HISTOGRAM                                                         */
+/*****************************************************************************/
+
+GcLockHistogram::
+GcLockHistogram()
+{
+    std::fill(buckets, buckets + NUM_BUCKETS, 0);
+}
+
+uint64_t
+GcLockHistogram::
+count() const
+{
+    uint64_t result = 0;
+    for (unsigned i = 0;  i < NUM_BUCKETS;  ++i)
+        result += buckets[i];
+    return result;
+}
+
+double
+GcLockHistogram::
+percentile(double p) const
+{
+    uint64_t total = count();
+    if (total == 0) return 0.0;
+
+    uint64_t rank = std::max<uint64_t>(1, std::ceil(p * total));
+    uint64_t seen = 0;
+    unsigned i = 0;
+    for (;  i < NUM_BUCKETS - 1;  ++i) {
+        seen += buckets[i];
+        if (seen >= rank) break;
+    }
+
+    return (1ULL << i) * 1e-6;
+}
+
+int
+GcLockHistogram::
+bucketOf(double seconds)
+{
+    uint64_t us = seconds * 1e6;
+    if (us == 0) return 0;
+    int bucket = 64 - __builtin_clzll(us);
+    return std::min<int>(bucket, NUM_BUCKETS - 1);
+}
+
+GcLockHistogram
+GcLockHistogram::
+operator - (const GcLockHistogram & other) const
+{
+    GcLockHistogram result;
+    for (unsigned i = 0;  i < NUM_BUCKETS;  ++i)
+        result.buckets[i] = buckets[i] - other.buckets[i];
+    return result;
+}
+
+
+/*****************************************************************************/
+/* GC LOCK STATS                                                             */
+/*****************************************************************************/
+
+GcLockStats::Counts::
+Counts()
+    : sharedSections(0), sharedSeconds(0), maxSharedSeconds(0),
+      sharedBlocked(0), sharedBlockedSeconds(0), epochsStarted(0),
+      exclusiveSections(0), exclusiveWaitSeconds(0),
+      maxExclusiveWaitSeconds(0), exclusiveSeconds(0),
+      barriers(0), barrierWaitSeconds(0), maxBarrierWaitSeconds(0)
+{
+}
+
+void
+GcLockStats::Counts::
+add(const Counts & other)
+{
+    sharedSections += other.sharedSections;
+    sharedSeconds += other.sharedSeconds;
+    maxSharedSeconds = std::max(maxSharedSeconds, other.maxSharedSeconds);
+    sharedBlocked += other.sharedBlocked;
+    sharedBlockedSeconds += other.sharedBlockedSeconds;
+    epochsStarted += other.epochsStarted;
+    exclusiveSections += other.exclusiveSections;
+    exclusiveWaitSeconds += other.exclusiveWaitSeconds;
+    maxExclusiveWaitSeconds = std::max(maxExclusiveWaitSeconds,
+                                       other.maxExclusiveWaitSeconds);
+    exclusiveSeconds += other.exclusiveSeconds;
+    barriers += other.barriers;
+    barrierWaitSeconds += other.barrierWaitSeconds;
+    maxBarrierWaitSeconds = std::max(maxBarrierWaitSeconds,
+                                     other.maxBarrierWaitSeconds);
+}
+
+GcLockStats::Thread::
+Thread()
+    : tid(0)
+{
+}
+
+GcLockStats::
+GcLockStats()
+    : epoch(0), visibleEpoch(0),
+      deferredQueued(0), deferredRun(0), deferredEntries(0),
+      deferredBytes(0), deferredEpochs(0), maxDeferredEntries(0),
+      oldestDeferredSeconds(0)
+{
+}
+
+void
+GcLockStats::
+logToCallback(const LogCallback & cb,
+              const GcLockStats & last,
+              const GcLockStats & cur,
+              const std::string & prefix)
+{
+    string p = !prefix.empty() ? prefix + "." : "";
+
+    const Counts & c = cur.total;
+    const Counts & l = last.total;
+
+    cb(p + "sharedSections", c.sharedSections - l.sharedSections);
+    cb(p + "sharedSeconds", c.sharedSeconds - l.sharedSeconds);
+    cb(p + "sharedBlocked", c.sharedBlocked - l.sharedBlocked);
+    cb(p + "sharedBlockedSeconds",
+       c.sharedBlockedSeconds - l.sharedBlockedSeconds);
+    cb(p + "epochsStarted", c.epochsStarted - l.epochsStarted);
+
+    cb(p + "exclusiveSections", c.exclusiveSections - l.exclusiveSections);
+    cb(p + "exclusiveWaitSeconds",
+       c.exclusiveWaitSeconds - l.exclusiveWaitSeconds);
+    cb(p + "exclusiveSeconds", c.exclusiveSeconds - l.exclusiveSeconds);
+
+    cb(p + "barriers", c.barriers - l.barriers);
+    cb(p + "barrierWaitSeconds", c.barrierWaitSeconds - l.barrierWaitSeconds);
+
+    // The thread which spent the most time in shared sections over the
+    // period, which is the one most likely to hold the others up
+    double busiest = 0.0;
+    for (const Thread & thread: cur.threads) {
+        double seconds = thread.sharedSeconds;
+        for (const Thread & before: last.threads) {
+            if (before.tid == thread.tid) {
+                seconds -= before.sharedSeconds;
+                break;
+            }
+        }
+        busiest = std::max(busiest, seconds);
+    }
+    cb(p + "sharedSecondsBusiestThread", busiest);
+    cb(p + "threads", cur.threads.size());
+
+    cb(p + "epochLag", cur.epoch - cur.visibleEpoch);
+
+    cb(p + "deferredQueued", cur.deferredQueued - last.deferredQueued);
+    cb(p + "deferredRun", cur.deferredRun - last.deferredRun);
+    cb(p + "deferredEntries", cur.deferredEntries);
+    cb(p + "deferredBytes", cur.deferredBytes);
+    cb(p + "deferredEpochs", cur.deferredEpochs);
+    cb(p + "deferredOldestSeconds", cur.oldestDeferredSeconds);
+
+    auto logHistogram = [&] (const string & name,
+                             const GcLockHistogram & histogram)
+        {
+            cb(p + name + ".count", histogram.count());
+            cb(p + name + ".p50", histogram.percentile(0.5));
+            cb(p + name + ".p90", histogram.percentile(0.9));
+            cb(p + name + ".p99", histogram.percentile(0.99));
+            cb(p + name + ".max", histogram.percentile(1.0));
+        };
+
+    logHistogram("exclusiveWaits", cur.exclusiveWaits - last.exclusiveWaits);
+    logHistogram("barrierWaits", cur.barrierWaits - last.barrierWaits);
+    logHistogram("deferLatency", cur.deferLatency - last.deferLatency);
+}
+
+
 /*****************************************************************************/
 /* GC LOCK BASE                                                              */
 /*****************************************************************************/
 
+namespace {
+
+double ticksToSeconds(uint64_t ticks)
+{
+    return ticks / ticks_per_second;
+}
+
+/** Histogram updated concurrently by the threads using a lock */
+struct LiveHistogram {
+    LiveHistogram()
+    {
+        for (unsigned i = 0;  i < GcLockHistogram::NUM_BUCKETS;  ++i)
+            buckets[i] = 0;
+    }
+
+    void record(uint64_t ticks)
+    {
+        int bucket = GcLockHistogram::bucketOf(ticksToSeconds(ticks));
+        buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    GcLockHistogram snapshot() const
+    {
+        GcLockHistogram result;
+        for (unsigned i = 0;  i < GcLockHistogram::NUM_BUCKETS;  ++i)
+            result.buckets[i] = buckets[i].load(std::memory_order_relaxed);
+        return result;
+    }
+
+    std::atomic<uint64_t> buckets[GcLockHistogram::NUM_BUCKETS];
+};
+
+} // file scope
+
+/** Counters of one thread for one lock.  Only that thread writes them, so
+    they are updated with plain loads and stores rather than locked
+    instructions; the atomics only make it safe for stats() to read them
+    at the same time.
+*/
+struct GcLockBase::ThreadMetrics {
+    enum Counter {
+        SHARED_SECTIONS,
+        SHARED_TICKS,
+        MAX_SHARED_TICKS,
+        SHARED_BLOCKED,
+        SHARED_BLOCKED_TICKS,
+        EPOCHS_STARTED,
+        EXCLUSIVE_SECTIONS,
+        EXCLUSIVE_WAIT_TICKS,
+        MAX_EXCLUSIVE_WAIT_TICKS,
+        EXCLUSIVE_TICKS,
+        BARRIERS,
+        BARRIER_WAIT_TICKS,
+        MAX_BARRIER_WAIT_TICKS,
+        NUM_COUNTERS
+    };
+
+    ThreadMetrics()
+        : tid(syscall(SYS_gettid)), sectionStart(0)
+    {
+        for (unsigned i = 0;  i < NUM_COUNTERS;  ++i)
+            counters[i] = 0;
+    }
+
+    void add(Counter counter, uint64_t value)
+    {
+        std::atomic<uint64_t> & c = counters[counter];
+        c.store(c.load(std::memory_order_relaxed) + value,
+                std::memory_order_relaxed);
+    }
+
+    void raise(Counter counter, uint64_t value)
+    {
+        std::atomic<uint64_t> & c = counters[counter];
+        if (value > c.load(std::memory_order_relaxed))
+            c.store(value, std::memory_order_relaxed);
+    }
+
+    void addTiming(Counter count, Counter total, Counter max, uint64_t ticks)
+    {
+        add(count, 1);
+        add(total, ticks);
+        raise(max, ticks);
+    }
+
+    uint64_t get(Counter counter) const
+    {
+        return counters[counter].load(std::memory_order_relaxed);
+    }
+
+    double seconds(Counter counter) const
+    {
+        return ticksToSeconds(get(counter));
+    }
+
+    GcLockStats::Counts counts() const
+    {
+        GcLockStats::Counts result;
+        result.sharedSections = get(SHARED_SECTIONS);
+        result.sharedSeconds = seconds(SHARED_TICKS);
+        result.maxSharedSeconds = seconds(MAX_SHARED_TICKS);
+        result.sharedBlocked = get(SHARED_BLOCKED);
+        result.sharedBlockedSeconds = seconds(SHARED_BLOCKED_TICKS);
+        result.epochsStarted = get(EPOCHS_STARTED);
+        result.exclusiveSections = get(EXCLUSIVE_SECTIONS);
+        result.exclusiveWaitSeconds = seconds(EXCLUSIVE_WAIT_TICKS);
+        result.maxExclusiveWaitSeconds = seconds(MAX_EXCLUSIVE_WAIT_TICKS);
+        result.exclusiveSeconds = seconds(EXCLUSIVE_TICKS);
+        result.barriers = get(BARRIERS);
+        result.barrierWaitSeconds = seconds(BARRIER_WAIT_TICKS);
+        result.maxBarrierWaitSeconds = seconds(MAX_BARRIER_WAIT_TICKS);
+        return result;
+    }
+
+    const int tid;
+    uint64_t sectionStart;      ///< When the current CS was entered
+    std::atomic<uint64_t> counters[NUM_COUNTERS];
+};
+
+/// Instrumentation shared by all of the threads of a lock
+struct GcLockBase::Metrics {
+    mutable ML::Spinlock lock;
+    std::vector<std::shared_ptr<ThreadMetrics> > threads;
+    GcLockStats::Counts exited;     ///< Counts of the threads that exited
+
+    /** Fold the counters of the threads that exited into the totals, so
+        that they don't accumulate.  Must be called with the lock held.
+    */
+    void pruneExited()
+    {
+        auto isExited = [&] (const std::shared_ptr<ThreadMetrics> & thread)
+            {
+                // Only we hold the counters once the thread has exited
+                if (thread.use_count() > 1)
+                    return false;
+                exited.add(thread->counts());
+                return true;
+            };
+        threads.erase(std::remove_if(threads.begin(), threads.end(),
+                                     isExited),
+                      threads.end());
+    }
+
+    LiveHistogram exclusiveWaits;
+    LiveHistogram barrierWaits;
+    LiveHistogram deferLatency;
+};
+
 struct DeferredEntry1 {
     DeferredEntry1(void (fn) (void *) = 0, void * data = 0)
         : fn(fn), data(data)
@@ -127,6 +458,7 @@ struct DeferredEntry3 {
 /// Data about each epoch
 struct GcLockBase::DeferredList {
     DeferredList()
+        : created(ticks())
     {
     }
 
@@ -158,6 +490,7 @@ struct GcLockBase::DeferredList {
     std::vector<DeferredEntry2> deferred2;
     std::vector<DeferredEntry3> deferred3;
     //mutable ML::Spinlock lock;
+    uint64_t created;   ///< When the first work was deferred to the epoch
 
     bool addDeferred(int forEpoch, void (fn) (void *), void * data)
     {
@@ -188,6 +521,13 @@ struct GcLockBase::DeferredList {
         return deferred1.size() + deferred2.size() + deferred3.size();
     }
 
+    size_t bytes() const
+    {
+        return deferred1.size() * sizeof(DeferredEntry1)
+            + deferred2.size() * sizeof(DeferredEntry2)
+            + deferred3.size() * sizeof(DeferredEntry3);
+    }
+
     void runAll()
     {
         // Spinlock should be unnecessary...
@@ -223,10 +563,22 @@ struct GcLockBase::DeferredList {
 };
 
 struct GcLockBase::Deferred {
+    Deferred()
+        : numQueued(0), numRun(0), numEntries(0), numBytes(0), maxEntries(0)
+    {
+    }
+
     mutable ML::Spinlock lock;
     std::map<int32_t, DeferredList *> entries;
     std::vector<DeferredList *> spares;
 
+    // Accounting of the entries, protected by the lock
+    uint64_t numQueued;
+    uint64_t numRun;
+    uint64_t numEntries;
+    uint64_t numBytes;
+    uint64_t maxEntries;
+
     bool empty() const
     {
         std::lock_guard<ML::Spinlock> guard(lock);
@@ -331,6 +683,7 @@ GcLockBase::
 GcLockBase()
 {
     deferred = new Deferred();
+    metrics = new Metrics();
 }
 
 GcLockBase::
@@ -341,6 +694,20 @@ GcLockBase::
     }
 
     delete deferred;
+    delete metrics;
+}
+
+std::shared_ptr<GcLockBase::ThreadMetrics>
+GcLockBase::
+registerThread()
+{
+    auto result = std::make_shared<ThreadMetrics>();
+
+    // Locks used by short-lived threads may never have stats() called
+    std::lock_guard<ML::Spinlock> guard(metrics->lock);
+    metrics->pruneExited();
+    metrics->threads.push_back(result);
+    return result;
 }
 
 bool
@@ -421,6 +788,13 @@ checkDefers()
 
             ExcAssert(it->second);
             result.push_back(it->second);
+
+            DeferredList & list = *it->second;
+            deferred->numEntries -= list.size();
+            deferred->numBytes -= list.bytes();
+            deferred->numRun += list.size();
+            metrics->deferLatency.record(ticks() - list.created);
+
             //it->second->runAll();
             auto toDelete = it;
             it = boost::next(it);
@@ -453,17 +827,21 @@ enterCS(ThreadGcInfoEntry * entry, RunDefer runDefer)
 #endif // optimistic
 
     Data current = *data;
+    uint64_t blockedSince = 0;
+    bool newEpoch = false;
 
     for (;;) {
         Data newValue = current;
 
         if (newValue.exclusive) {
+            if (!blockedSince) blockedSince = ticks();
             futex_wait(data->exclusive, 1);
             current = *data;
             continue;
         }
 
-        if (newValue.inOld() == 0) {
+        newEpoch = newValue.inOld() == 0;
+        if (newEpoch) {
             // We're entering a new epoch
             newValue.epoch += 1;
             newValue.setIn(newValue.epoch, 1);
@@ -477,6 +855,21 @@ enterCS(ThreadGcInfoEntry * entry, RunDefer runDefer)
             
         if (updateData(current, newValue, runDefer)) break;
     }
+
+    // Only the sections that started an epoch or were blocked are
+    // accounted for, unless the sections are being timed
+    if (newEpoch || blockedSince || GcLockTimeSharedSections) {
+        ThreadMetrics & m = *entry->metrics;
+        uint64_t now = (blockedSince || GcLockTimeSharedSections
+                        ? ticks() : 0);
+        m.sectionStart = GcLockTimeSharedSections ? now : 0;
+        if (newEpoch)
+            m.add(ThreadMetrics::EPOCHS_STARTED, 1);
+        if (blockedSince) {
+            m.add(ThreadMetrics::SHARED_BLOCKED, 1);
+            m.add(ThreadMetrics::SHARED_BLOCKED_TICKS, now - blockedSince);
+        }
+    }
 }
 
 void
@@ -488,6 +881,18 @@ exitCS(ThreadGcInfoEntry * entry, RunDefer runDefer /* = true */)
 
     ExcCheck(entry->inEpoch == 0 || entry->inEpoch == 1,
             "Invalid inEpoch");
+
+    if (GcLockTimeSharedSections) {
+        ThreadMetrics & m = *entry->metrics;
+        if (m.sectionStart) {
+            m.addTiming(ThreadMetrics::SHARED_SECTIONS,
+                        ThreadMetrics::SHARED_TICKS,
+                        ThreadMetrics::MAX_SHARED_TICKS,
+                        ticks() - m.sectionStart);
+            m.sectionStart = 0;
+        }
+    }
+
     // Fast path
     if (__sync_fetch_and_add(data->in + entry->inEpoch, -1) > 1) {
         entry->inEpoch = -1;
@@ -516,6 +921,7 @@ enterCSExclusive(ThreadGcInfoEntry * entry)
 {
     ExcAssertEqual(entry->inEpoch, -1);
 
+    uint64_t start = ticks();
     Data current = *data, newValue;
 
     for (;;) {
@@ -547,7 +953,7 @@ enterCSExclusive(ThreadGcInfoEntry * entry)
     int startEpoch = current.epoch;
     
 #if 1
-    visibleBarrier();
+    waitVisible();
 #else
 
     for (unsigned i = 0;  ;  ++i, current = *data) {
@@ -591,6 +997,14 @@ enterCSExclusive(ThreadGcInfoEntry * entry)
     ExcAssertEqual(data->epoch, startEpoch);
 
     entry->inEpoch = startEpoch & 1;
+
+    ThreadMetrics & m = *entry->metrics;
+    m.sectionStart = ticks();
+    m.addTiming(ThreadMetrics::EXCLUSIVE_SECTIONS,
+                ThreadMetrics::EXCLUSIVE_WAIT_TICKS,
+                ThreadMetrics::MAX_EXCLUSIVE_WAIT_TICKS,
+                m.sectionStart - start);
+    metrics->exclusiveWaits.record(m.sectionStart - start);
 }
 
 void
@@ -615,6 +1029,10 @@ exitCSExclusive(ThreadGcInfoEntry * entry)
     }
 #endif
 
+    ThreadMetrics & m = *entry->metrics;
+    m.add(ThreadMetrics::EXCLUSIVE_TICKS, ticks() - m.sectionStart);
+    m.sectionStart = 0;
+
     ML::memory_barrier();
 
     int old = 1;
@@ -639,6 +1057,21 @@ visibleBarrier()
         throw ML::Exception("visibleBarrier called in critical section will "
                             "deadlock");
 
+    uint64_t start = ticks();
+    waitVisible();
+    uint64_t waited = ticks() - start;
+
+    entry.metrics->addTiming(ThreadMetrics::BARRIERS,
+                             ThreadMetrics::BARRIER_WAIT_TICKS,
+                             ThreadMetrics::MAX_BARRIER_WAIT_TICKS,
+                             waited);
+    metrics->barrierWaits.record(waited);
+}
+
+void
+GcLockBase::
+waitVisible()
+{
     Data current = *data;
     int startEpoch = data->epoch;
     //int startVisible = data.visibleEpoch;
@@ -801,8 +1234,15 @@ doDefer(void (fn) (Args...), Args... args)
         }
         
         DeferredList & list = *epochIt->second;
+        size_t bytesBefore = list.bytes();
         list.addDeferred(newestVisibleEpoch, fn, std::forward<Args>(args)...);
 
+        deferred->numQueued += 1;
+        deferred->numEntries += 1;
+        deferred->numBytes += list.bytes() - bytesBefore;
+        deferred->maxEntries = std::max(deferred->maxEntries,
+                                        deferred->numEntries);
+
         // TODO: we only need to do this if the newestVisibleEpoch has
         // changed since we last calculated it...
         //checkDefers();
@@ -858,6 +1298,57 @@ dump()
     cerr << endl;
 }
 
+GcLockStats
+GcLockBase::
+stats() const
+{
+    GcLockStats result;
+
+    Data current = *data;
+    result.epoch = current.epoch;
+    result.visibleEpoch = current.visibleEpoch;
+
+    {
+        std::lock_guard<ML::Spinlock> guard(deferred->lock);
+        result.deferredQueued = deferred->numQueued;
+        result.deferredRun = deferred->numRun;
+        result.deferredEntries = deferred->numEntries;
+        result.deferredBytes = deferred->numBytes;
+        result.deferredEpochs = deferred->entries.size();
+        result.maxDeferredEntries = deferred->maxEntries;
+
+        uint64_t now = ticks();
+        for (auto & e: deferred->entries) {
+            double age = ticksToSeconds(now - e.second->created);
+            result.oldestDeferredSeconds
+                = std::max(result.oldestDeferredSeconds, age);
+        }
+    }
+
+    {
+        std::lock_guard<ML::Spinlock> guard(metrics->lock);
+
+        metrics->pruneExited();
+        for (auto & m: metrics->threads) {
+            GcLockStats::Thread thread;
+            static_cast<GcLockStats::Counts &>(thread) = m->counts();
+            thread.tid = m->tid;
+            result.threads.push_back(thread);
+        }
+
+        result.total = metrics->exited;
+    }
+
+    for (auto & thread: result.threads)
+        result.total.add(thread);
+
+    result.exclusiveWaits = metrics->exclusiveWaits.snapshot();
+    result.barrierWaits = metrics->barrierWaits.snapshot();
+    result.deferLatency = metrics->deferLatency.snapshot();
+
+    return result;
+}
+
 
 /*****************************************************************************/
 /* GC LOCK                                                                   */
@@ -15,6 +15,8 @@
 #include "jml/utils/exc_assert.h"
 #include "jml/arch/atomic_ops.h"
 #include "jml/arch/thread_specific.h"
+#include <memory>
+#include <string>
 #include <vector>
 #include <iostream>
 
@@ -52,6 +54,122 @@ namespace Datacratic {
 
 extern int32_t SpeculativeThreshold;
 
+/** Whether the shared critical sections are counted and timed, for the
+    shared section figures of GcLockBase::stats().  Timing adds two reads of
+    the time stamp counter to every section, which is significant on the
+    hottest paths, so it is off by default.
+*/
+extern bool GcLockTimeSharedSections;
+
+
+/*****************************************************************************/
+/* GC LOCK HISTOGRAM                                                         */
+/*****************************************************************************/
+
+/** Distribution of durations in power of two buckets: bucket 0 counts the
+    durations under a microsecond and bucket i those between 2^(i-1) and
+    2^i microseconds.
+*/
+
+struct GcLockHistogram {
+    GcLockHistogram();
+
+    enum { NUM_BUCKETS = 32 };
+
+    uint64_t buckets[NUM_BUCKETS];
+
+    uint64_t count() const;
+
+    /** Upper bound in seconds of the bucket containing the "p" quantile
+        (0 to 1), or 0 when the histogram is empty.
+    */
+    double percentile(double p) const;
+
+    static int bucketOf(double seconds);
+
+    /** Durations counted in this histogram but not in "other" */
+    GcLockHistogram operator - (const GcLockHistogram & other) const;
+};
+
+
+/*****************************************************************************/
+/* GC LOCK STATS                                                             */
+/*****************************************************************************/
+
+/** Snapshot of the instrumentation of a GcLock, as returned by
+    GcLockBase::stats().  Counters are cumulative since the creation of the
+    lock; logToCallback() reports the difference between two snapshots.
+*/
+
+struct GcLockStats {
+    GcLockStats();
+
+    /** Activity of one thread, or of all of them */
+    struct Counts {
+        Counts();
+
+        uint64_t sharedSections;      ///< Shared critical sections timed
+        double sharedSeconds;         ///< Time spent in them
+        double maxSharedSeconds;      ///< Longest of them
+        uint64_t sharedBlocked;       ///< Entries held up by an exclusive CS
+        double sharedBlockedSeconds;  ///< Time they were held up for
+        uint64_t epochsStarted;       ///< Entries which started a new epoch
+
+        uint64_t exclusiveSections;   ///< Exclusive critical sections entered
+        double exclusiveWaitSeconds;  ///< Time waiting for shared CS to exit
+        double maxExclusiveWaitSeconds;
+        double exclusiveSeconds;      ///< Time spent holding the lock
+
+        uint64_t barriers;            ///< Calls to visibleBarrier()
+        double barrierWaitSeconds;
+        double maxBarrierWaitSeconds;
+
+        void add(const Counts & other);
+    };
+
+    struct Thread : public Counts {
+        Thread();
+
+        int tid;
+    };
+
+    Counts total;                     ///< Including the exited threads
+    std::vector<Thread> threads;      ///< Threads still running
+
+    int32_t epoch;
+    int32_t visibleEpoch;
+
+    uint64_t deferredQueued;          ///< Work queued until an epoch ends
+    uint64_t deferredRun;             ///< Queued work that has been run
+    uint64_t deferredEntries;         ///< Work currently queued
+    uint64_t deferredBytes;           ///< Memory used by that work
+    uint64_t deferredEpochs;          ///< Epochs with work queued
+    uint64_t maxDeferredEntries;      ///< Most work ever queued at once
+    double oldestDeferredSeconds;     ///< Age of the oldest queued work
+
+    /** Time taken by lockExclusive() to wait for the shared sections */
+    GcLockHistogram exclusiveWaits;
+
+    /** Time spent in visibleBarrier() */
+    GcLockHistogram barrierWaits;
+
+    /** Time between the queuing of deferred work and the end of its epoch,
+        which is how long it takes for the epochs to advance.
+    */
+    GcLockHistogram deferLatency;
+
+    typedef std::function<void(std::string, double)> LogCallback;
+
+    /** Calls "cb" with the name and value of each metric over the period
+        between "last" and "cur", so that they can be sent to the stats
+        system.
+    */
+    static void logToCallback(const LogCallback & cb,
+                              const GcLockStats & last,
+                              const GcLockStats & cur,
+                              const std::string & prefix = "");
+};
+
 /*****************************************************************************/
 /* GC LOCK BASE                                                              */
 /*****************************************************************************/
@@ -62,6 +180,9 @@ struct GcLockBase {
 
 public:
 
+    /** Counters of a thread for the lock, defined in gc_lock.cc */
+    struct ThreadMetrics;
+
     /** Enum for type safe specification of whether or not we run deferrals on
         entry or exit to a critical sections.  Thoss places that are latency
         sensitive should use RD_NO.
@@ -106,9 +227,14 @@ public:
 
         GcLockBase *owner;
 
+        /** Shared with the lock, so that it outlives either of them */
+        std::shared_ptr<ThreadMetrics> metrics;
+
         void init(const GcLockBase * const self) {
-            if (!owner) 
+            if (!owner) {
                 owner = const_cast<GcLockBase *>(self);
+                metrics = owner->registerThread();
+            }
         }
                 
 
@@ -559,16 +685,30 @@ public:
 
     void dump();
 
+    /** Snapshot of the instrumentation of the lock.  The counters of each
+        thread are only written by that thread, so reading them is cheap
+        and doesn't disturb the critical sections.
+    */
+    GcLockStats stats() const;
+
 protected:
     Data* data;
 
 private:
     struct Deferred;
     struct DeferredList;
+    struct Metrics;
 
     GcInfo gcInfo;
 
     Deferred * deferred;   ///< Deferred workloads (hidden structure)
+    Metrics * metrics;     ///< Instrumentation (hidden structure)
+
+    /** Counters of the calling thread, created when it first uses the lock */
+    std::shared_ptr<ThreadMetrics> registerThread();
+
+    /** Wait until the epoch of the call is no longer visible. */
+    void waitVisible();
 
     /** Update with the new value after first checking that the current
         value is the same as the old value.  Returns true if it
@@ -0,0 +1,223 @@
+/* gc_lock_stress_bench.cc
+   Copyright (c) 2014 Datacratic.  All rights reserved.
+
+   Runs a mix of readers, writers, exclusive lockers and barriers against a
+   GcLock and reports the contention metrics of the lock while it does.
+
+   Usage: gc_lock_stress_bench --readers 4 --writers 1 --exclusive 1 ...
+*/
+
+#include <unistd.h>
+#include <stdio.h>
+#include <atomic>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#include <boost/program_options/cmdline.hpp>
+#include <boost/program_options/options_description.hpp>
+#include <boost/program_options/parsers.hpp>
+#include <boost/program_options/variables_map.hpp>
+
+#include "jml/arch/tick_counter.h"
+#include "soa/gc/gc_lock.h"
+
+using namespace std;
+using namespace ML;
+using namespace Datacratic;
+
+
+namespace {
+
+/* Keeps the CPU busy for the given number of microseconds */
+void spin(double us)
+{
+    if (us <= 0) return;
+    uint64_t end = ticks() + us * 1e-6 * ticks_per_second;
+    while (ticks() < end) ;
+}
+
+void sleepUs(double us)
+{
+    if (us > 0) ::usleep(us);
+}
+
+void printStats(const GcLockStats & last, const GcLockStats & cur)
+{
+    auto print = [] (string name, double value)
+        {
+            printf("    %-32s %14.6g\n", name.c_str(), value);
+        };
+    GcLockStats::logToCallback(print, last, cur, "gc");
+}
+
+} // file scope
+
+
+int main(int argc, char ** argv)
+{
+    using namespace boost::program_options;
+
+    int numReaders = 4;
+    int numWriters = 1;
+    int numExclusive = 0;
+    int numBarriers = 0;
+    double readUs = 1;
+    double writeUs = 1;
+    double exclusiveUs = 10;
+    double pauseUs = 100;
+    int defersPerWrite = 1;
+    bool speculative = false;
+    double seconds = 5.0;
+    double interval = 1.0;
+
+    options_description options("Options");
+    options.add_options()
+        ("readers,r", value(&numReaders),
+         "threads running shared critical sections")
+        ("writers,w", value(&numWriters),
+         "threads replacing the shared data and deferring its deletion")
+        ("exclusive,x", value(&numExclusive),
+         "threads running exclusive critical sections")
+        ("barriers,b", value(&numBarriers),
+         "threads calling visibleBarrier()")
+        ("read-us", value(&readUs),
+         "time spent by readers in each shared section")
+        ("write-us", value(&writeUs),
+         "time spent by writers in each shared section")
+        ("exclusive-us", value(&exclusiveUs),
+         "time spent in each exclusive section")
+        ("pause-us", value(&pauseUs),
+         "pause of the exclusive and barrier threads between operations")
+        ("defers", value(&defersPerWrite),
+         "deletions deferred by each write")
+        ("speculative", value(&speculative)->zero_tokens(),
+         "readers use speculative sections")
+        ("time-shared", value(&GcLockTimeSharedSections)->zero_tokens(),
+         "count and time the shared sections")
+        ("seconds,s", value(&seconds), "duration of the run")
+        ("interval,i", value(&interval), "period of the reports")
+        ("help,h", "print this message");
+
+    variables_map vm;
+    store(command_line_parser(argc, argv).options(options).run(), vm);
+    notify(vm);
+
+    if (vm.count("help")) {
+        cerr << options << endl;
+        return 1;
+    }
+
+    GcLock gc;
+    std::atomic<bool> finished(false);
+    std::atomic<int *> shared(new int(0));
+    std::atomic<uint64_t> numReads(0), numWrites(0);
+
+    auto reader = [&] ()
+        {
+            uint64_t reads = 0;
+            while (!finished) {
+                if (speculative) {
+                    GcLock::SpeculativeGuard guard(gc);
+                    spin(readUs);
+                    reads += *shared.load() >= 0;
+                }
+                else {
+                    GcLock::SharedGuard guard(gc);
+                    spin(readUs);
+                    reads += *shared.load() >= 0;
+                }
+            }
+            gc.forceUnlock();
+            numReads += reads;
+        };
+
+    auto writer = [&] ()
+        {
+            uint64_t writes = 0;
+            while (!finished) {
+                GcLock::SharedGuard guard(gc);
+                spin(writeUs);
+                for (int i = 0;  i < defersPerWrite;  ++i) {
+                    int * old = shared.exchange(new int(writes));
+                    gc.deferDelete(old);
+                }
+                ++writes;
+            }
+            numWrites += writes;
+        };
+
+    auto exclusive = [&] ()
+        {
+            while (!finished) {
+                {
+                    GcLock::ExclusiveGuard guard(gc);
+                    spin(exclusiveUs);
+                }
+                sleepUs(pauseUs);
+            }
+        };
+
+    auto barrier = [&] ()
+        {
+            while (!finished) {
+                gc.visibleBarrier();
+                sleepUs(pauseUs);
+            }
+        };
+
+    printf("%d readers (%gus%s), %d writers (%gus, %d defers), "
+           "%d exclusive (%gus), %d barriers, pause %gus\n",
+           numReaders, readUs, speculative ? ", speculative" : "",
+           numWriters, writeUs, defersPerWrite,
+           numExclusive, exclusiveUs, numBarriers, pauseUs);
+
+    vector<std::thread> threads;
+    for (int i = 0;  i < numReaders;  ++i)
+        threads.emplace_back(reader);
+    for (int i = 0;  i < numWriters;  ++i)
+        threads.emplace_back(writer);
+    for (int i = 0;  i < numExclusive;  ++i)
+        threads.emplace_back(exclusive);
+    for (int i = 0;  i < numBarriers;  ++i)
+        threads.emplace_back(barrier);
+
+    GcLockStats start = gc.stats();
+    GcLockStats last = start;
+    for (double elapsed = 0;  elapsed < seconds;  elapsed += interval) {
+        sleepUs(interval * 1e6);
+        GcLockStats cur = gc.stats();
+        printf("\nafter %.1fs\n", elapsed + interval);
+        printStats(last, cur);
+        last = cur;
+    }
+
+    // Take the per thread counters before the threads exit
+    GcLockStats end = gc.stats();
+
+    finished = true;
+    for (auto & thread: threads)
+        thread.join();
+    gc.deferBarrier();
+
+    printf("\n%-8s %12s %10s %10s %12s %10s %12s %10s\n",
+           "tid", "shared", "shared s", "max us", "blocked s",
+           "exclusive", "wait s", "max us");
+    for (auto & thread: end.threads) {
+        printf("%-8d %12lld %10.3f %10.1f %12.3f %10lld %12.3f %10.1f\n",
+               thread.tid,
+               (long long)thread.sharedSections, thread.sharedSeconds,
+               thread.maxSharedSeconds * 1e6, thread.sharedBlockedSeconds,
+               (long long)thread.exclusiveSections,
+               thread.exclusiveWaitSeconds,
+               thread.maxExclusiveWaitSeconds * 1e6);
+    }
+
+    printf("\noverall: %.0f reads/s, %.0f writes/s\n",
+           numReads / seconds, numWrites / seconds);
+    printStats(start, end);
+
+    delete shared.load();
+
+    return 0;
+}
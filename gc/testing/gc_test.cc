@@ -23,6 +23,7 @@
 #include <boost/test/unit_test.hpp>
 #include <iostream>
 #include <atomic>
+#include <map>
 
 
 
@@ -64,6 +65,76 @@ BOOST_AUTO_TEST_CASE ( test_gc )
     BOOST_CHECK(deferred);
 }
 
+BOOST_AUTO_TEST_CASE ( test_gc_lock_stats )
+{
+    GcLockTimeSharedSections = true;
+
+    GcLock gc;
+    int deferred = 0;
+    auto increment = [] (int * val) { ++*val; };
+
+    // Work deferred from within a critical section is queued until the
+    // section exits
+    gc.lockShared();
+    gc.defer(+increment, &deferred);
+    gc.defer(+increment, &deferred);
+
+    GcLockStats before = gc.stats();
+    BOOST_CHECK_EQUAL(before.threads.size(), 1);
+    BOOST_CHECK_EQUAL(before.total.sharedSections, 0);
+    BOOST_CHECK_EQUAL(before.total.epochsStarted, 1);
+    BOOST_CHECK_EQUAL(before.deferredQueued, 2);
+    BOOST_CHECK_EQUAL(before.deferredEntries, 2);
+    BOOST_CHECK_GT(before.deferredBytes, 0);
+    BOOST_CHECK_EQUAL(before.deferredEpochs, 1);
+
+    gc.unlockShared();
+    BOOST_CHECK_EQUAL(deferred, 2);
+
+    gc.lockExclusive();
+    gc.unlockExclusive();
+    gc.visibleBarrier();
+
+    // A thread that has exited is still part of the totals
+    std::thread([&] () { GcLock::SharedGuard guard(gc); }).join();
+
+    GcLockStats after = gc.stats();
+    BOOST_CHECK_EQUAL(after.threads.size(), 1);
+    BOOST_CHECK_EQUAL(after.total.sharedSections, 2);
+    BOOST_CHECK_EQUAL(after.threads[0].sharedSections, 1);
+    BOOST_CHECK_EQUAL(after.total.exclusiveSections, 1);
+    BOOST_CHECK_EQUAL(after.total.barriers, 1);
+    BOOST_CHECK_EQUAL(after.deferredRun, 2);
+    BOOST_CHECK_EQUAL(after.deferredEntries, 0);
+    BOOST_CHECK_EQUAL(after.deferredBytes, 0);
+    BOOST_CHECK_EQUAL(after.maxDeferredEntries, 2);
+    BOOST_CHECK_EQUAL(after.deferLatency.count(), 1);
+    BOOST_CHECK_EQUAL(after.exclusiveWaits.count(), 1);
+    BOOST_CHECK_EQUAL(after.barrierWaits.count(), 1);
+
+    map<string, double> logged;
+    GcLockStats::logToCallback([&] (string name, double value)
+                               {
+                                   logged[name] = value;
+                               },
+                               before, after, "gc");
+    BOOST_CHECK_EQUAL(logged["gc.sharedSections"], 2);
+    BOOST_CHECK_EQUAL(logged["gc.deferredRun"], 2);
+    BOOST_CHECK_EQUAL(logged["gc.deferredEntries"], 0);
+    BOOST_CHECK_EQUAL(logged["gc.exclusiveWaits.count"], 1);
+
+    BOOST_CHECK_EQUAL(GcLockHistogram::bucketOf(0.0000005), 0);
+    BOOST_CHECK_EQUAL(GcLockHistogram::bucketOf(0.000003), 2);
+    BOOST_CHECK_EQUAL(GcLockHistogram::bucketOf(100000.0),
+                      GcLockHistogram::NUM_BUCKETS - 1);
+
+    GcLockHistogram histogram;
+    histogram.buckets[1] = 90;
+    histogram.buckets[10] = 10;
+    BOOST_CHECK_EQUAL(histogram.percentile(0.5), 0.000002);
+    BOOST_CHECK_EQUAL(histogram.percentile(0.99), 0.001024);
+}
+
 BOOST_AUTO_TEST_CASE(test_mutual_exclusion)
 {
     cerr << "testing mutual exclusion" << endl;
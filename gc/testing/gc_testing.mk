@@ -8,4 +8,4 @@
 
 $(eval $(call test,gc_test,gc,boost))
 $(eval $(call test,rcu_protected_test,gc,boost timed))
-
+$(eval $(call program,gc_lock_stress_bench,gc boost_program_options))
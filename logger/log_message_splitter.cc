@@ -0,0 +1,106 @@
+/* log_message_splitter.cc
+   Copyright (c) 2014 Datacratic.  All rights reserved.
+
+   Columnar splitting of batches of log records.
+*/
+
+#include <limits>
+#include "log_message_splitter.h"
+
+using namespace std;
+
+
+namespace Datacratic {
+
+
+/*****************************************************************************/
+/* LOG BATCH SPLITTER                                                        */
+/*****************************************************************************/
+
+LogBatchSplitter::
+LogBatchSplitter(int numColumns, char fieldSplit, char recordSplit)
+    : numColumns(numColumns), fieldSplit(fieldSplit), recordSplit(recordSplit)
+{
+    if (numColumns < 1)
+        throw ML::Exception("log batch splitter needs at least one column");
+    if (fieldSplit == recordSplit)
+        throw ML::Exception("log batch splitter needs distinct delimiters");
+}
+
+size_t
+LogBatchSplitter::
+split(const char * data, size_t length, LogBatch & batch, bool final) const
+{
+    if (length > std::numeric_limits<uint32_t>::max())
+        throw ML::Exception("log batch of %zd bytes is too long", length);
+
+    batch.clear();
+    batch.data = data;
+    batch.columns.resize(numColumns);
+
+    // Reserve from a guess of the record length, so that the first batches
+    // don't keep reallocating the arrays
+    size_t guess = length / 128 + 1;
+    batch.recordStarts.reserve(guess);
+    batch.numFields.reserve(guess);
+    for (auto & column: batch.columns) {
+        column.starts.reserve(guess);
+        column.lengths.reserve(guess);
+    }
+
+    LogBatch::Column * columns = &batch.columns[0];
+
+    uint32_t recordStart = 0;
+    uint32_t fieldStart = 0;
+    int field = 0;
+
+    // The columns that a record doesn't have are empty fields at its end
+    auto endRecord = [&] (uint32_t end)
+        {
+            if (field < numColumns) {
+                columns[field].starts.push_back(fieldStart);
+                columns[field].lengths.push_back(end - fieldStart);
+            }
+            batch.recordStarts.push_back(recordStart);
+            batch.numFields.push_back(field + 1);
+            for (int i = field + 1;  i < numColumns;  ++i) {
+                columns[i].starts.push_back(end);
+                columns[i].lengths.push_back(0);
+            }
+            recordStart = fieldStart = end + 1;
+            field = 0;
+        };
+
+    forEachDelimiter(data, length, fieldSplit, recordSplit,
+                     [&] (size_t pos, char c)
+                     {
+                         if (c == recordSplit) {
+                             endRecord(pos);
+                             return true;
+                         }
+                         if (field < numColumns) {
+                             columns[field].starts.push_back(fieldStart);
+                             columns[field].lengths.push_back(pos - fieldStart);
+                         }
+                         ++field;
+                         fieldStart = pos + 1;
+                         return true;
+                     });
+
+    if (final && recordStart < length) {
+        endRecord(length);
+        return length;
+    }
+
+    // Drop the fields of the unterminated record at the end, which has not
+    // been counted
+    size_t numRecords = batch.recordStarts.size();
+    for (int i = 0;  i < numColumns;  ++i) {
+        columns[i].starts.resize(numRecords);
+        columns[i].lengths.resize(numRecords);
+    }
+
+    return recordStart;
+}
+
+} // namespace Datacratic
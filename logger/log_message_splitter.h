@@ -8,6 +8,11 @@
 
 #include <cstring>
 #include <string>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
 #include "jml/arch/exception.h"
 
@@ -55,36 +60,145 @@ inline std::ostream & operator << (std::ostream & stream, const Field & field)
 }
 
 
+/*****************************************************************************/
+/* FOR EACH DELIMITER                                                        */
+/*****************************************************************************/
+
+/** Call onMatch(position) for each occurrence of c in the given range, in
+    order, for as long as it returns true.  Returns false if onMatch stopped
+    the scan.
+
+    The range is compared 16 bytes at a time with SSE2, or 32 at a time when
+    compiled with AVX2, and the matches are taken out of the resulting bit
+    masks, so that the cost doesn't depend on how many delimiters there are.
+*/
+template<typename OnMatch>
+bool forEachDelimiter(const char * data, size_t length, char c,
+                      OnMatch && onMatch)
+{
+    size_t i = 0;
+
+#if defined(__AVX2__)
+    const __m256i needle = _mm256_set1_epi8(c);
+    for (;  i + 32 <= length;  i += 32) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i *)(data + i));
+        uint32_t mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, needle));
+        for (;  mask;  mask &= mask - 1) {
+            if (!onMatch(i + __builtin_ctz(mask)))
+                return false;
+        }
+    }
+#endif
+
+#if defined(__SSE2__)
+    const __m128i needle16 = _mm_set1_epi8(c);
+    for (;  i + 16 <= length;  i += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)(data + i));
+        uint32_t mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, needle16));
+        for (;  mask;  mask &= mask - 1) {
+            if (!onMatch(i + __builtin_ctz(mask)))
+                return false;
+        }
+    }
+#else
+    for (;;) {
+        const char * found = (const char *)memchr(data + i, c, length - i);
+        if (!found)
+            return true;
+        i = found - data;
+        if (!onMatch(i))
+            return false;
+        ++i;
+    }
+#endif
+
+    for (;  i < length;  ++i) {
+        if (data[i] == c && !onMatch(i))
+            return false;
+    }
+
+    return true;
+}
+
+/** Same as forEachDelimiter, but for either of two characters, with the
+    character found passed to onMatch(position, c).
+*/
+template<typename OnMatch>
+bool forEachDelimiter(const char * data, size_t length, char c1, char c2,
+                      OnMatch && onMatch)
+{
+    size_t i = 0;
+
+#if defined(__AVX2__)
+    const __m256i needle1 = _mm256_set1_epi8(c1);
+    const __m256i needle2 = _mm256_set1_epi8(c2);
+    for (;  i + 32 <= length;  i += 32) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i *)(data + i));
+        uint32_t mask = _mm256_movemask_epi8
+            (_mm256_or_si256(_mm256_cmpeq_epi8(chunk, needle1),
+                             _mm256_cmpeq_epi8(chunk, needle2)));
+        for (;  mask;  mask &= mask - 1) {
+            size_t pos = i + __builtin_ctz(mask);
+            if (!onMatch(pos, data[pos]))
+                return false;
+        }
+    }
+#endif
+
+#if defined(__SSE2__)
+    const __m128i needle16_1 = _mm_set1_epi8(c1);
+    const __m128i needle16_2 = _mm_set1_epi8(c2);
+    for (;  i + 16 <= length;  i += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)(data + i));
+        uint32_t mask = _mm_movemask_epi8
+            (_mm_or_si128(_mm_cmpeq_epi8(chunk, needle16_1),
+                          _mm_cmpeq_epi8(chunk, needle16_2)));
+        for (;  mask;  mask &= mask - 1) {
+            size_t pos = i + __builtin_ctz(mask);
+            if (!onMatch(pos, data[pos]))
+                return false;
+        }
+    }
+#endif
+
+    for (;  i < length;  ++i) {
+        if ((data[i] == c1 || data[i] == c2) && !onMatch(i, data[i]))
+            return false;
+    }
+
+    return true;
+}
+
+
 /*****************************************************************************/
 /* LOG MESSAGE SPLITTER                                                      */
 /*****************************************************************************/
 
+/** Splits a line into at most maxFields fields.  Any fields past those are
+    ignored.
+
+    The splitter doesn't copy the line, which needs to outlive it.
+*/
+
 template<int maxFields>
 struct LogMessageSplitter {
 
-    LogMessageSplitter(const std::string & str, char split = '\t')
-        : str(str), data(this->str.c_str()), numFields(0)
+    LogMessageSplitter(const char * start, const char * end,
+                       char split = '\t')
+        : data(start), numFields(0)
     {
-        numFields = 0;
-        for (unsigned i = 0;  i <= maxFields;  ++i)
-            offsets[i] = -1;
-
-        const char * start = data;
-        const char * end = start + str.size();
-
-        while (start <= end && numFields < maxFields) {
-            offsets[numFields++] = start - data;
-            while (start < end && *start != split)
-                ++start;
-            if (start == end) break;
-            ++start;  // skip delimiter
-        }
+        init(end - start, split);
+    }
 
-        if (start == end)
-            offsets[numFields] = end - data + 1;
-        else offsets[numFields] = (start - data);
+    LogMessageSplitter(const std::string & str, char split = '\t')
+        : data(str.data()), numFields(0)
+    {
+        init(str.size(), split);
     }
 
+    /** The string would be gone before the fields are used. */
+    LogMessageSplitter(std::string && str, char split = '\t') = delete;
+
     Field operator [] (int index) const
     {
         if (!(index >= 0) || index >= numFields || index >= maxFields)
@@ -97,15 +211,129 @@ struct LogMessageSplitter {
 
     size_t size() const { return numFields; }
 
-    std::string str;
     const char * data;
     int numFields;
+
+    /** Start of each field, and one past the end of the last one plus one,
+        so that field i ends at offsets[i + 1] - 1.
+    */
     int offsets[maxFields + 1];
 
+private:
+    void init(size_t length, char split)
+    {
+        static_assert(maxFields > 0, "need at least one field");
+
+        int n = 1;
+        offsets[0] = 0;
+
+        bool complete = forEachDelimiter
+            (data, length, split, [&] (size_t pos)
+             {
+                 // The delimiter ending the last field is still needed
+                 offsets[n] = pos + 1;
+                 if (n == maxFields)
+                     return false;
+                 ++n;
+                 return true;
+             });
+
+        numFields = n;
+        if (complete)
+            offsets[n] = length + 1;
+    }
 };
 
-} // namespace Datacratic
 
-#endif /* __logger__log_message_splitter_h__ */
+/*****************************************************************************/
+/* LOG BATCH                                                                 */
+/*****************************************************************************/
+
+/** Fields of a batch of records, stored by column so that a column can be
+    processed with a simple loop over its arrays.  The offsets are relative
+    to the data of the batch, which isn't copied.
+*/
 
+struct LogBatch {
 
+    struct Column {
+        std::vector<uint32_t> starts;
+        std::vector<uint32_t> lengths;
+    };
+
+    LogBatch()
+        : data(nullptr)
+    {
+    }
+
+    const char * data;
+
+    /** Start of each record. */
+    std::vector<uint32_t> recordStarts;
+
+    /** Number of fields in each record, which can be more or less than the
+        number of columns.  The columns that a record doesn't have are
+        empty.
+    */
+    std::vector<uint32_t> numFields;
+
+    std::vector<Column> columns;
+
+    size_t size() const
+    {
+        return recordStarts.size();
+    }
+
+    Field field(size_t record, int column) const
+    {
+        const Column & col = columns.at(column);
+        Field result;
+        result.start = data + col.starts.at(record);
+        result.end = result.start + col.lengths[record];
+        return result;
+    }
+
+    void clear()
+    {
+        data = nullptr;
+        recordStarts.clear();
+        numFields.clear();
+        for (auto & column: columns) {
+            column.starts.clear();
+            column.lengths.clear();
+        }
+    }
+};
+
+
+/*****************************************************************************/
+/* LOG BATCH SPLITTER                                                        */
+/*****************************************************************************/
+
+/** Splits a buffer of records into a LogBatch in a single pass over the
+    data, keeping the first numColumns fields of each record.
+*/
+
+struct LogBatchSplitter {
+
+    LogBatchSplitter(int numColumns,
+                     char fieldSplit = '\t',
+                     char recordSplit = '\n');
+
+    /** Split the records of the given buffer, which can be up to 4GB, into
+        the batch, replacing what it contained.  Only records terminated by
+        recordSplit are taken unless final is true, in which case whatever
+        follows the last one is a record too.  Returns the number of bytes
+        taken, so that the rest can be carried over to the next buffer.
+    */
+    size_t split(const char * data, size_t length, LogBatch & batch,
+                 bool final = false) const;
+
+    int numColumns;
+    char fieldSplit;
+    char recordSplit;
+};
+
+} // namespace Datacratic
+
+#endif /* __logger__log_message_splitter_h__ */
@@ -6,30 +6,182 @@
 */
 
 #include "multi_output.h"
-#include "log_message_splitter.h"
 #include "file_output.h"
+#include "soa/service/mpsc_queue.h"
+#include <string.h>
 
 using namespace std;
 
 
+namespace {
+
+/** FNV-1a, which can be computed over the pieces of a key. */
+const uint64_t HashInit = 14695981039346656037ULL;
+
+inline uint64_t hashAppend(uint64_t hash, const char * p, size_t length)
+{
+    for (const char * e = p + length;  p != e;  ++p) {
+        hash ^= (unsigned char)*p;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+/** Messages written from an output in one go before the worker moves on to
+    the next ready output. */
+const int MaxBatch = 1024;
+
+/** Messages can wait for up to this period before being written, unless
+    more than WakeupBacklog outputs are waiting for a worker. */
+const std::chrono::milliseconds WakeupPeriod(10);
+const size_t WakeupBacklog = 64;
+
+} // file scope
+
+
 namespace Datacratic {
 
 
+/*****************************************************************************/
+/* OUTPUT ENTRY                                                              */
+/*****************************************************************************/
+
+struct MultiOutput::QueuedMessage : public MpscQueueNode {
+    QueuedMessage(const std::string & channel, const std::string & message)
+        : channel(channel), message(message)
+    {
+    }
+
+    std::string channel;
+    std::string message;
+};
+
+struct MultiOutput::OutputEntry {
+    OutputEntry(uint64_t hash, std::string key)
+        : hash(hash), key(std::move(key)), scheduled(false), numMessages(0)
+    {
+    }
+
+    ~OutputEntry()
+    {
+        while (QueuedMessage * msg = queue.pop())
+            delete msg;
+    }
+
+    bool matches(uint64_t hash, const std::vector<KeyPiece> & pieces) const
+    {
+        if (hash != this->hash)
+            return false;
+        const char * p = key.c_str();
+        const char * e = p + key.size();
+        for (auto & piece: pieces) {
+            if (piece.length > size_t(e - p)
+                || memcmp(p, piece.start, piece.length) != 0)
+                return false;
+            p += piece.length;
+        }
+        return p == e;
+    }
+
+    bool idle() const
+    {
+        return !scheduled && queue.empty();
+    }
+
+    uint64_t hash;
+    std::string key;
+    std::shared_ptr<LogOutput> output;
+
+    /** Messages waiting for a worker. */
+    MpscQueue<QueuedMessage> queue;
+
+    /** Set while the output is waiting for or owned by a worker. */
+    std::atomic<bool> scheduled;
+
+    /** Serializes the writes when there is no worker. */
+    std::mutex writeLock;
+
+    /** Only updated by the thread writing to the output. */
+    std::atomic<uint64_t> numMessages;
+};
+
+
+/*****************************************************************************/
+/* OUTPUT TABLE                                                              */
+/*****************************************************************************/
+
+/** Open addressing hash table, which is never modified once published:
+    adding an output replaces the whole table of the shard.
+*/
+struct MultiOutput::OutputTable {
+    OutputTable(size_t capacity = 16)
+        : slots(capacity), size(0)
+    {
+    }
+
+    std::vector<std::shared_ptr<OutputEntry> > slots;
+    size_t size;
+
+    const std::shared_ptr<OutputEntry> *
+    find(uint64_t hash, const std::vector<KeyPiece> & pieces) const
+    {
+        size_t mask = slots.size() - 1;
+        for (size_t i = hash & mask;;  i = (i + 1) & mask) {
+            auto & slot = slots[i];
+            if (!slot)
+                return nullptr;
+            if (slot->matches(hash, pieces))
+                return &slot;
+        }
+    }
+
+    void insert(std::shared_ptr<OutputEntry> entry)
+    {
+        size_t mask = slots.size() - 1;
+        size_t i = entry->hash & mask;
+        while (slots[i])
+            i = (i + 1) & mask;
+        slots[i] = std::move(entry);
+        ++size;
+    }
+};
+
+struct MultiOutput::Shard {
+    Shard(GcLock & gcLock)
+        : table(gcLock)
+    {
+    }
+
+    RcuProtected<OutputTable> table;
+
+    /** Held when adding an output. */
+    std::mutex lock;
+};
+
+
 /*****************************************************************************/
 /* MULTI OUTPUT                                                              */
 /*****************************************************************************/
 
 MultiOutput::
-MultiOutput()
+MultiOutput(int numWorkers)
+    : channels(gcLock),
+      numIdleWorkers(0),
+      shutdown(false),
+      closed(false),
+      numOutputsCreated(0)
 {
+    for (unsigned i = 0;  i < NUM_SHARDS;  ++i)
+        shards.emplace_back(new Shard(gcLock));
+
+    for (int i = 0;  i < numWorkers;  ++i)
+        workers.emplace_back([=] () { this->runWorker(); });
 }
 
 MultiOutput::
 ~MultiOutput()
 {
-    for (auto &output : outputs) {
-        output.second->close();
-    }
+    close();
 }
 
 void
@@ -100,6 +252,12 @@ parse(const std::string & tmplate)
 
     pushLiteral();
 
+    numFields = 0;
+    for (auto & token: tokens) {
+        if (token.type == TOK_FIELD)
+            numFields = std::max(numFields, token.field + 1);
+    }
+
     //cerr << "parsing " << tmplate << " we got " << tokens.size() << " tokens"
     //     << endl;
     for (auto token: tokens) {
@@ -108,36 +266,59 @@ parse(const std::string & tmplate)
     }
 }
 
-std::string
+uint64_t
 MultiOutput::ChannelEntry::
 apply(const std::string & channel,
-      const std::string & message) const
+      const std::string & message,
+      std::vector<KeyPiece> & pieces) const
 {
-    string result;
+    // Fields used by the pattern, found without copying the message
+    static thread_local std::vector<KeyPiece> fields;
+    fields.resize(numFields);
+    const char * p = message.c_str();
+    const char * e = p + message.size();
+    for (int i = 0;  i < numFields;  ++i) {
+        if (p > e)
+            throw ML::Exception("invalid index");
+        const char * end = (const char *)memchr(p, '\t', e - p);
+        if (!end)
+            end = e;
+        fields[i].start = p;
+        fields[i].length = end - p;
+        p = end + 1;
+    }
 
-    LogMessageSplitter<128> split(message);
+    pieces.clear();
+    uint64_t hash = HashInit;
+
+    for (auto & token: tokens) {
+        KeyPiece piece;
 
-    for (auto token: tokens) {
         switch (token.type) {
 
         case TOK_LITERAL:
-            result += token.literal;
+            piece.start = token.literal.c_str();
+            piece.length = token.literal.size();
             break;
 
         case TOK_CHANNEL:
-            result += channel;
+            piece.start = channel.c_str();
+            piece.length = channel.size();
             break;
 
         case TOK_FIELD:
-            result += split[token.field];
+            piece = fields[token.field];
             break;
 
         default:
             throw ML::Exception("unknown token");
         }
+
+        pieces.push_back(piece);
+        hash = hashAppend(hash, piece.start, piece.length);
     }
 
-    return result;
+    return hash;
 }
 
 void
@@ -145,37 +326,161 @@ MultiOutput::
 logMessage(const std::string & channel,
            const std::string & message)
 {
-    std::unique_lock<std::mutex> guard(lock);
-    auto it = channels.find(channel);
-    if (it == channels.end())
-        it = channels.find("");
-    if (it == channels.end())
+    // Reused from one message to the next to avoid allocating
+    static thread_local std::vector<KeyPiece> pieces;
+
+    GcLock::SharedGuard guard(gcLock);
+    if (closed.load(std::memory_order_acquire))
         return;
 
+    // The guard keeps the channels and the output tables alive, so they are
+    // used directly rather than through another RCU lock each
+    const Channels & chans = *channels.unsafePtr();
+    auto it = chans.find(channel);
+    if (it == chans.end())
+        it = chans.find("");
+    if (it == chans.end())
+        return;
 
     //cerr << "got entry " << it->first << endl;
 
-    auto & channelEntry = it->second;
+    auto & channelEntry = *it->second;
 
     // 1.  Find which key the message should be logged to
-    std::string messageKey = channelEntry.apply(channel, message);
-    
-    //cerr << "logging " << channel << " to " << it->first
-    //     << " with messageKey " << messageKey << endl;
-    //cerr << "messageKey = " << messageKey << endl;
+    uint64_t hash = channelEntry.apply(channel, message, pieces);
 
     // 2.  Get the logger under the key; create if necessary
-    std::shared_ptr<LogOutput> output;
-    auto jt = outputs.find(messageKey);
-    if (jt == outputs.end()) {
-        cerr << "creating " << messageKey << endl;
-        jt = outputs.insert(make_pair(messageKey,
-                                      channelEntry.createLogger(messageKey))).first;
+    const std::shared_ptr<OutputEntry> & entry
+        = getOutput(channelEntry, hash, pieces);
+
+    if (workers.empty()) {
+        write(*entry, channel, message);
+        return;
+    }
+
+    entry->queue.push(new QueuedMessage(channel, message));
+    if (!entry->scheduled.exchange(true))
+        schedule(entry);
+}
+
+const std::shared_ptr<MultiOutput::OutputEntry> &
+MultiOutput::
+getOutput(const ChannelEntry & channelEntry,
+          uint64_t hash, const std::vector<KeyPiece> & pieces)
+{
+    Shard & shard = *shards[hash >> 58];
+    static_assert(NUM_SHARDS == 64, "shard index taken from 6 bits");
+
+    // Called within a critical section, which keeps the table alive
+    auto found = shard.table.unsafePtr()->find(hash, pieces);
+    if (found)
+        return *found;
+
+    std::unique_lock<std::mutex> guard(shard.lock);
+
+    // Someone else may have created it in the meantime
+    const OutputTable * table = shard.table.unsafePtr();
+    found = table->find(hash, pieces);
+    if (found)
+        return *found;
+
+    string messageKey;
+    for (auto & piece: pieces)
+        messageKey.append(piece.start, piece.length);
+
+    cerr << "creating " << messageKey << endl;
+    auto entry = std::make_shared<OutputEntry>(hash, messageKey);
+    entry->output = channelEntry.createLogger(messageKey);
+    numOutputsCreated += 1;
+
+    size_t capacity = table->slots.size();
+    if ((table->size + 1) * 2 > capacity)
+        capacity *= 2;
+
+    std::unique_ptr<OutputTable> newTable(new OutputTable(capacity));
+    for (auto & slot: table->slots) {
+        if (slot)
+            newTable->insert(slot);
     }
-    output = jt->second;
-    guard.unlock();
+    newTable->insert(entry);
+    found = newTable->find(hash, pieces);
+
+    shard.table.replace(newTable.release());
+
+    return *found;
+}
+
+void
+MultiOutput::
+write(OutputEntry & entry, const std::string & channel,
+      const std::string & message)
+{
+    std::unique_lock<std::mutex> guard(entry.writeLock);
+    if (!entry.output)
+        return;  // closed
+    entry.output->logMessage(channel, message);
+    entry.numMessages.store(entry.numMessages + 1, std::memory_order_relaxed);
+}
+
+void
+MultiOutput::
+schedule(std::shared_ptr<OutputEntry> entry)
+{
+    std::unique_lock<std::mutex> guard(readyLock);
+    ready.emplace_back(std::move(entry));
+
+    // Idle workers wake up by themselves regularly, so only wake them up
+    // early when outputs pile up
+    if (numIdleWorkers && ready.size() >= WakeupBacklog)
+        readyCond.notify_one();
+}
+
+void
+MultiOutput::
+runWorker()
+{
+    for (;;) {
+        std::shared_ptr<OutputEntry> entry;
+        {
+            std::unique_lock<std::mutex> guard(readyLock);
+            while (ready.empty() && !shutdown) {
+                ++numIdleWorkers;
+                readyCond.wait_for(guard, WakeupPeriod);
+                --numIdleWorkers;
+            }
+            if (ready.empty())
+                return;
+            entry = std::move(ready.front());
+            ready.pop_front();
+        }
+
+        // This worker now owns the output until it clears the flag
+        int n = 0;
+        for (;  n < MaxBatch;  ++n) {
+            QueuedMessage * msg = entry->queue.pop();
+            if (!msg)
+                break;
+            try {
+                write(*entry, msg->channel, msg->message);
+            } catch (const std::exception & exc) {
+                cerr << "error writing to " << entry->key << ": "
+                     << exc.what() << endl;
+            }
+            delete msg;
+        }
+
+        // Give a chance to the other outputs before continuing with this one
+        if (n == MaxBatch) {
+            schedule(std::move(entry));
+            continue;
+        }
 
-    output->logMessage(channel, message);
+        // Messages pushed before the flag is cleared would otherwise be
+        // left behind, as their producer saw it set
+        entry->scheduled.exchange(false);
+        if (!entry->queue.empty() && !entry->scheduled.exchange(true))
+            schedule(std::move(entry));
+    }
 }
 
 void
@@ -184,26 +489,94 @@ logTo(const std::string & channel,
       const std::string & pattern,
       const CreateLogger & createLogger)
 {
-    ChannelEntry entry;
-    entry.createLogger = createLogger;
-    entry.parse(pattern);
+    auto entry = std::make_shared<ChannelEntry>();
+    entry->createLogger = createLogger;
+    entry->parse(pattern);
     
-    std::unique_lock<std::mutex> guard(lock);
-    channels[channel] = entry;
+    std::unique_lock<std::mutex> guard(channelsLock);
+    auto chans = channels();
+    std::unique_ptr<Channels> newChannels(new Channels(*chans));
+    chans.unlock();
+    (*newChannels)[channel] = entry;
+    channels.replace(newChannels.release());
+}
+
+void
+MultiOutput::
+forEachOutput(const std::function<void (OutputEntry &)> & onOutput) const
+{
+    for (auto & shard: shards) {
+        auto table = shard->table();
+        for (auto & slot: table->slots) {
+            if (slot)
+                onOutput(*slot);
+        }
+    }
+}
+
+void
+MultiOutput::
+flush()
+{
+    for (;;) {
+        bool idle = true;
+        forEachOutput([&] (OutputEntry & entry) {
+                if (!entry.idle())
+                    idle = false;
+            });
+        if (idle)
+            return;
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
 }
 
 void
 MultiOutput::
 close()
 {
-    throw ML::Exception("MultiOutput::close() needs implementation");
+    if (closed.exchange(true))
+        return;
+
+    // Wait for the messages that got past the check to be queued
+    gcLock.visibleBarrier();
+
+    if (!workers.empty()) {
+        flush();
+        {
+            std::unique_lock<std::mutex> guard(readyLock);
+            shutdown = true;
+            readyCond.notify_all();
+        }
+        for (auto & worker: workers)
+            worker.join();
+        workers.clear();
+    }
+
+    forEachOutput([&] (OutputEntry & entry) {
+            std::unique_lock<std::mutex> guard(entry.writeLock);
+            if (entry.output) {
+                entry.output->close();
+                entry.output.reset();
+            }
+        });
 }
 
 Json::Value
 MultiOutput::
 stats() const
 {
-    return Json::Value();
+    Json::Value result;
+
+    uint64_t numMessages = 0, numQueued = 0;
+    forEachOutput([&] (OutputEntry & entry) {
+            numMessages += entry.numMessages.load(std::memory_order_relaxed);
+            numQueued += !entry.idle();
+        });
+
+    result["outputs"] = (Json::UInt)numOutputsCreated.load();
+    result["messagesWritten"] = (Json::UInt)numMessages;
+    result["outputsBusy"] = (Json::UInt)numQueued;
+    return result;
 }
 
 void
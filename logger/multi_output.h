@@ -10,6 +10,10 @@
 
 #include "logger.h"
 #include "rotating_output.h"
+#include "soa/gc/rcu_protected.h"
+#include <atomic>
+#include <condition_variable>
+#include <deque>
 #include <unordered_map>
 #include <mutex>
 #include <thread>
@@ -21,21 +25,43 @@ namespace Datacratic {
 /* MULTI OUTPUT                                                              */
 /*****************************************************************************/
 
-/** Class that writes its output to multiple places. */
+/** Class that writes its output to multiple places.
+
+    Logging a message to an output that already exists takes no lock: the
+    key of the message is hashed from the pieces of the pattern without
+    building the string, and looked up in a table that is sharded by hash
+    and protected by RCU, so that only the creation of a new output locks
+    (the shard that it goes to).
+
+    By default the messages are written by the thread that logs them.
+    Given worker threads, they are instead queued on their output and
+    written by the pool, each output being written by a single worker at a
+    time and in the order in which the messages were logged.  A slow output
+    then only holds up its own messages, at the cost of a queueing and a
+    hand-off for every message, so the workers only pay off when some of
+    the outputs can block.
+*/
 
 struct MultiOutput : public LogOutput {
     /** Function that creates a logger from a given timestamp. */
     typedef std::function<std::shared_ptr<LogOutput> (std::string)> CreateLogger;
 
-    MultiOutput();
+    MultiOutput(int numWorkers = 0);
 
     virtual ~MultiOutput();
 
     virtual void logMessage(const std::string & channel,
                             const std::string & message);
 
+    /** Wait for the queued messages to be written, stop the workers and
+        close all the outputs.  Messages logged once close() has started
+        are dropped.
+    */
     virtual void close();
 
+    /** Wait until all the queued messages have been written. */
+    void flush();
+
     /** Set up the output class to log messages of the given type to files
         with the given pattern.
 
@@ -59,6 +85,13 @@ struct MultiOutput : public LogOutput {
 
 private:
 
+    /** Part of a message key, pointing into the pattern, the channel or the
+        message. */
+    struct KeyPiece {
+        const char * start;
+        size_t length;
+    };
+
     struct ChannelEntry {
         
         std::string tmplate;
@@ -81,22 +114,72 @@ private:
         };
 
         std::vector<Token> tokens;
+        int numFields;   ///< number of fields of the message used
 
         CreateLogger createLogger;
 
         void parse(const std::string & tmplate);
 
-        std::string apply(const std::string & channel,
-                          const std::string & message) const;
+        /** Split the key of the message into pieces, and return its hash. */
+        uint64_t apply(const std::string & channel,
+                       const std::string & message,
+                       std::vector<KeyPiece> & pieces) const;
     };
 
-    mutable std::mutex lock;
-    
-    /** A key for each channel */
-    std::unordered_map<std::string, ChannelEntry> channels;
+    typedef std::unordered_map<std::string, std::shared_ptr<ChannelEntry> >
+        Channels;
+
+    struct QueuedMessage;
+    struct OutputEntry;
+    struct OutputTable;
+    struct Shard;
+
+    enum {
+        NUM_SHARDS = 64
+    };
+
+    /** Return the output for the key, creating it if needed.  Must be
+        called within a critical section of gcLock, for as long as the
+        reference is used.
+    */
+    const std::shared_ptr<OutputEntry> &
+    getOutput(const ChannelEntry & channelEntry,
+              uint64_t hash, const std::vector<KeyPiece> & pieces);
+
+    void write(OutputEntry & entry, const std::string & channel,
+               const std::string & message);
+
+    void schedule(std::shared_ptr<OutputEntry> entry);
+    void runWorker();
+
+    /** Call onOutput for every output created so far. */
+    void forEachOutput(const std::function<void (OutputEntry &)> & onOutput)
+        const;
+
+    GcLock gcLock;
+
+    /** Rules for each channel, replaced whenever one is added. */
+    RcuProtected<Channels> channels;
+    std::mutex channelsLock;
+
+    /** Outputs, one per output key, sharded by the hash of the key. */
+    std::vector<std::unique_ptr<Shard> > shards;
+
+    /* worker pool */
+    std::vector<std::thread> workers;
+    std::mutex readyLock;
+    std::condition_variable readyCond;
+    std::deque<std::shared_ptr<OutputEntry> > ready;
+    int numIdleWorkers;
+    bool shutdown;
+
+    /** Set by close(); logMessage() checks it from within a critical
+        section of gcLock, so that close() can wait for the messages that
+        it let through with a barrier.
+    */
+    std::atomic<bool> closed;
 
-    /** Outputs, one per output key. */
-    std::unordered_map<std::string, std::shared_ptr<LogOutput> > outputs;
+    std::atomic<uint64_t> numOutputsCreated;
 };
 
 
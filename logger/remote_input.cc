@@ -6,10 +6,6 @@
 */
 
 #include "remote_input.h"
-#include <boost/iostreams/categories.hpp>
-#include <boost/iostreams/filtering_stream.hpp>
-#include <boost/iostreams/filter/bzip2.hpp>
-#include <boost/iostreams/filter/gzip.hpp>
 
 using namespace std;
 
@@ -22,27 +18,19 @@ namespace Datacratic {
 
 struct RemoteInputConnection : public PassiveConnectionHandler {
 
-    RemoteInputConnection()
-        : bytes_in(0)
+    RemoteInputConnection(RemoteInput * input)
+        : input(input), bytes_in(0)
     {
-#if 0
-        using namespace boost::iostreams;
-
-        auto_ptr<filtering_ostream> new_stream
-            (new filtering_ostream());
-
-        bool gzip = true;
-        bool bzip2 = false;
-
-        if (gzip)
-            new_stream->push(gzip_decompressor());
-        else if (bzip2)
-            new_stream->push(bzip2_decompressor());
-    
-        new_stream->push(ConnectionSink(this));
-
-        stream.reset(new_stream.release());
-#endif
+        reader.onBatch = [=] (const RemoteLogFrameHeader & header,
+                              const std::vector<RemoteLogFrameReader::Message>
+                                  & messages)
+            {
+                this->input->handleBatch(header, messages);
+
+                std::string ack
+                    = RemoteLogFrameReader::ack(header.stream, header.sequence);
+                this->send(ack.data(), ack.size(), NEXT_CONTINUE);
+            };
     }
 
     ~RemoteInputConnection()
@@ -59,10 +47,15 @@ struct RemoteInputConnection : public PassiveConnectionHandler {
 
     virtual void handleData(const std::string & data)
     {
-        // We shouldn't get anything back on this (yet)
-        //cerr << "warning: input handleData: shouldn't have received anything"
-        //     << " but got " << data.size() << " bytes" << endl;
         bytes_in += data.size();
+        if (input->onData)
+            input->onData(data);
+
+        try {
+            reader.feed(data);
+        } catch (const std::exception & exc) {
+            doError("invalid data from remote output: " + string(exc.what()));
+        }
     }
 
     virtual void handleError(const std::string & error)
@@ -83,44 +76,9 @@ struct RemoteInputConnection : public PassiveConnectionHandler {
         closeWhenHandlerFinished();
     }
 
+    RemoteInput * input;
+    RemoteLogFrameReader reader;
     uint64_t bytes_in;
-
-#if 0
-    void logMessage(const std::string & channel,
-                    const std::string & message)
-    {
-        //cerr << "remoteOutputConnection::logMessage()" << endl;
-        (*stream) << channel << '\t' << message << flush;
-        //this->send(channel + "-" + message, NEXT_CONTINUE, onSendFinished);
-    }
-
-    boost::scoped_ptr<std::ostream> stream;
-
-    // TODO: how to deal with dropped messages?
-    struct ConnectionSink : public boost::iostreams::sink {
-        ConnectionSink(RemoteOutputConnection * connection)
-            : connection(connection)
-        {
-        }
-        
-        RemoteOutputConnection * connection;
-
-        std::streamsize write(const char * s, std::streamsize n)
-        {
-            auto onSendFinished = [=] ()
-                {
-                    cerr << "finished sending remote log message" << endl;
-                    abort();
-                };
-            
-            connection->send(std::string(s, n),
-                             NEXT_CONTINUE,
-                             onSendFinished);
-
-            return n;
-        }
-    };
-#endif    
 };
 
 
@@ -131,7 +89,11 @@ struct RemoteInputConnection : public PassiveConnectionHandler {
 
 RemoteInput::
 RemoteInput()
-    : endpoint("RemoteInput")
+    : streamIdleTimeout(3600.0),
+      endpoint("RemoteInput"),
+      lastExpiry(Date::now()),
+      numMessages(0),
+      numDuplicates(0)
 {
 }
 
@@ -152,7 +114,7 @@ listen(int port,
     endpoint.onMakeNewHandler
         = [=] () -> std::shared_ptr<ConnectionHandler>
         {
-            return ML::make_std_sp(new RemoteInputConnection());
+            return ML::make_std_sp(new RemoteInputConnection(this));
         };
 
     endpoint.onAcceptError = [=] (const std::string & str)
@@ -172,13 +134,54 @@ listen(int port,
     this->onShutdown = onShutdown;
 }
 
+void
+RemoteInput::
+handleBatch(const RemoteLogFrameHeader & header,
+            const std::vector<RemoteLogFrameReader::Message> & messages)
+{
+    {
+        std::unique_lock<std::mutex> guard(streamsLock);
+        Date now = Date::now();
+        Delivered & last = lastDelivered[header.stream];
+        last.when = now;
+        if (header.sequence <= last.sequence) {
+            ++numDuplicates;
+            return;
+        }
+        last.sequence = header.sequence;
+
+        if (now.secondsSince(lastExpiry) >= streamIdleTimeout / 2)
+            expireStreams(now);
+    }
+
+    numMessages += messages.size();
+
+    if (!onMessage)
+        return;
+
+    for (auto & message: messages)
+        onMessage(message.channelStr(), message.messageStr());
+}
+
+void
+RemoteInput::
+expireStreams(Date now)
+{
+    for (auto it = lastDelivered.begin();  it != lastDelivered.end();) {
+        if (now.secondsSince(it->second.when) > streamIdleTimeout)
+            it = lastDelivered.erase(it);
+        else ++it;
+    }
+    lastExpiry = now;
+}
+
 void
 RemoteInput::
 shutdown()
 {
     if (onShutdown) {
         onShutdown();
-        onShutdown.clear();
+        onShutdown = nullptr;
     }
     endpoint.shutdown();
 }
@@ -8,11 +8,24 @@
 #pragma once
 
 #include "logger.h"
+#include "remote_log_protocol.h"
 #include "soa/service/passive_endpoint.h"
+#include "soa/types/date.h"
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
 
 
 namespace Datacratic {
 
+struct RemoteInputConnection;
+
+/** Receives the batches of messages sent by RemoteOutput, delivers their
+    messages and acknowledges them.  A batch that was already delivered,
+    which happens when a RemoteOutput sends again what wasn't acknowledged
+    before it lost its connection, is acknowledged but not delivered again.
+*/
+
 struct RemoteInput {
     
     RemoteInput();
@@ -36,9 +49,61 @@ struct RemoteInput {
     /** Function used to respond to having data. */
     std::function<void (const std::string &)> onData;
 
+    /** Called for each message received, from the thread of its
+        connection.
+    */
+    std::function<void (const std::string & channel,
+                        const std::string & message)> onMessage;
+
+    uint64_t numMessagesReceived() const
+    {
+        return numMessages;
+    }
+
+    uint64_t numDuplicateBatches() const
+    {
+        return numDuplicates;
+    }
+
+    /** Seconds after which a stream that hasn't sent anything is
+        forgotten.  A batch that it sends again after that would be
+        delivered twice, so it needs to be well over the time that an
+        output takes to reconnect.
+    */
+    double streamIdleTimeout;
+
 private:
+    friend struct RemoteInputConnection;
+
     PassiveEndpointT<SocketTransport> endpoint;
     std::function<void ()> onShutdown;
+
+    /** Deliver the messages of a batch unless it was already. */
+    void handleBatch(const RemoteLogFrameHeader & header,
+                     const std::vector<RemoteLogFrameReader::Message> & messages);
+
+    /** Last batch delivered for each stream, and when. */
+    struct Delivered {
+        Delivered()
+            : sequence(0)
+        {
+        }
+
+        uint64_t sequence;
+        Date when;
+    };
+
+    std::mutex streamsLock;
+    std::unordered_map<uint64_t, Delivered> lastDelivered;
+    Date lastExpiry;
+
+    /** Forget the streams that have been idle for longer than
+        streamIdleTimeout.  Must be called with streamsLock held.
+    */
+    void expireStreams(Date now);
+
+    std::atomic<uint64_t> numMessages;
+    std::atomic<uint64_t> numDuplicates;
 };
 
 } // namespace Datacratic
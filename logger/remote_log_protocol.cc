@@ -0,0 +1,324 @@
+/* remote_log_protocol.cc
+   Copyright (c) 2014 Datacratic.  All rights reserved.
+
+   Wire protocol between RemoteOutput and RemoteInput.
+*/
+
+#include "remote_log_protocol.h"
+#include "jml/arch/exception.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+using namespace std;
+
+
+namespace Datacratic {
+
+
+/*****************************************************************************/
+/* REMOTE LOG BATCH WRITER                                                   */
+/*****************************************************************************/
+
+RemoteLogBatchWriter::
+RemoteLogBatchWriter()
+    : numMessages_(0)
+{
+}
+
+void
+RemoteLogBatchWriter::
+add(const std::string & channel, const std::string & message)
+{
+    uint32_t channelLength = channel.size();
+    uint32_t messageLength = message.size();
+
+    payload.append((const char *)&channelLength, sizeof(channelLength));
+    payload.append(channel);
+    payload.append((const char *)&messageLength, sizeof(messageLength));
+    payload.append(message);
+    ++numMessages_;
+}
+
+std::string
+RemoteLogBatchWriter::
+seal(uint64_t stream, uint64_t sequence, bool compress)
+{
+    RemoteLogFrameHeader header;
+    header.type = RemoteLogFrameHeader::BATCH;
+    header.flags = 0;
+    header.stream = stream;
+    header.sequence = sequence;
+    header.numMessages = numMessages_;
+    header.rawLength = payload.size();
+
+    std::string frame;
+
+    if (compress && !payload.empty()) {
+        uLongf compressedLength = compressBound(payload.size());
+        frame.resize(sizeof(header) + compressedLength);
+        int res = compress2((Bytef *)&frame[sizeof(header)], &compressedLength,
+                            (const Bytef *)payload.data(), payload.size(),
+                            Z_BEST_SPEED);
+        if (res != Z_OK)
+            throw ML::Exception("compress2 failed: %d", res);
+
+        if (compressedLength < payload.size()) {
+            header.flags |= RemoteLogFrameHeader::COMPRESSED;
+            header.length = compressedLength;
+            frame.resize(sizeof(header) + compressedLength);
+        }
+    }
+
+    if (!(header.flags & RemoteLogFrameHeader::COMPRESSED)) {
+        header.length = payload.size();
+        frame.resize(sizeof(header));
+        frame.append(payload);
+    }
+
+    memcpy(&frame[0], &header, sizeof(header));
+
+    payload.clear();
+    numMessages_ = 0;
+
+    return frame;
+}
+
+
+/*****************************************************************************/
+/* REMOTE LOG FRAME READER                                                   */
+/*****************************************************************************/
+
+RemoteLogFrameReader::
+RemoteLogFrameReader(size_t maxFrameLength)
+    : maxFrameLength(maxFrameLength)
+{
+}
+
+void
+RemoteLogFrameReader::
+feed(const char * data, size_t length)
+{
+    // Complete the frame that was left over from the last call first
+    if (!buffer.empty()) {
+        size_t needed = sizeof(RemoteLogFrameHeader);
+        if (buffer.size() >= needed) {
+            RemoteLogFrameHeader header;
+            memcpy(&header, buffer.data(), sizeof(header));
+            needed += header.length;
+        }
+
+        size_t toCopy = std::min(needed - buffer.size(), length);
+        buffer.append(data, toCopy);
+        data += toCopy;
+        length -= toCopy;
+
+        size_t used;
+        if (!decode(buffer.data(), buffer.size(), used)) {
+            // Still incomplete; we may only have completed the header
+            if (length)
+                feed(data, length);
+            return;
+        }
+        buffer.clear();
+    }
+
+    // Then decode straight out of the received data
+    while (length > 0) {
+        size_t used;
+        if (!decode(data, length, used)) {
+            buffer.assign(data, length);
+            return;
+        }
+        data += used;
+        length -= used;
+    }
+}
+
+bool
+RemoteLogFrameReader::
+decode(const char * data, size_t length, size_t & used)
+{
+    RemoteLogFrameHeader header;
+    if (length < sizeof(header))
+        return false;
+    memcpy(&header, data, sizeof(header));
+
+    if (header.length > maxFrameLength || header.rawLength > maxFrameLength)
+        throw ML::Exception("remote log frame of %d bytes is too long",
+                            (int)header.length);
+    if (length < sizeof(header) + header.length)
+        return false;
+
+    used = sizeof(header) + header.length;
+
+    switch (header.type) {
+    case RemoteLogFrameHeader::BATCH:
+        decodeBatch(header, data + sizeof(header));
+        break;
+    case RemoteLogFrameHeader::ACK:
+        if (onAck)
+            onAck(header);
+        break;
+    default:
+        throw ML::Exception("unknown remote log frame type %d",
+                            (int)header.type);
+    }
+
+    return true;
+}
+
+void
+RemoteLogFrameReader::
+decodeBatch(const RemoteLogFrameHeader & header, const char * payload)
+{
+    const char * p = payload;
+    const char * e = payload + header.length;
+
+    if (header.flags & RemoteLogFrameHeader::COMPRESSED) {
+        raw.resize(header.rawLength);
+        uLongf rawLength = header.rawLength;
+        int res = uncompress((Bytef *)&raw[0], &rawLength,
+                             (const Bytef *)payload, header.length);
+        if (res != Z_OK || rawLength != header.rawLength)
+            throw ML::Exception("couldn't decompress remote log batch");
+        p = raw.data();
+        e = p + rawLength;
+    }
+
+    messages.clear();
+
+    auto readPiece = [&] (const char * & start, size_t & length)
+        {
+            uint32_t len;
+            if (e - p < (ssize_t)sizeof(len))
+                throw ML::Exception("truncated remote log batch");
+            memcpy(&len, p, sizeof(len));
+            p += sizeof(len);
+            if ((size_t)(e - p) < len)
+                throw ML::Exception("truncated remote log batch");
+            start = p;
+            length = len;
+            p += len;
+        };
+
+    for (unsigned i = 0;  i < header.numMessages;  ++i) {
+        Message message;
+        readPiece(message.channel, message.channelLength);
+        readPiece(message.message, message.messageLength);
+        messages.push_back(message);
+    }
+
+    if (p != e)
+        throw ML::Exception("extra data at the end of a remote log batch");
+
+    if (onBatch)
+        onBatch(header, messages);
+}
+
+std::string
+RemoteLogFrameReader::
+ack(uint64_t stream, uint64_t sequence)
+{
+    RemoteLogFrameHeader header;
+    memset(&header, 0, sizeof(header));
+    header.type = RemoteLogFrameHeader::ACK;
+    header.stream = stream;
+    header.sequence = sequence;
+    return std::string((const char *)&header, sizeof(header));
+}
+
+
+/*****************************************************************************/
+/* REMOTE LOG SPOOL                                                          */
+/*****************************************************************************/
+
+RemoteLogSpool::
+RemoteLogSpool(const std::string & path, size_t maxBytes)
+    : fd(-1), maxBytes(maxBytes),
+      readOffset(0), writeOffset(0), numDropped_(0)
+{
+    if (path.empty()) {
+        char tmpl[] = "/tmp/remote_log_spool.XXXXXX";
+        fd = mkstemp(tmpl);
+        if (fd != -1)
+            unlink(tmpl);
+    }
+    else fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+
+    if (fd == -1)
+        throw ML::Exception(errno, "opening remote log spool " + path);
+}
+
+RemoteLogSpool::
+~RemoteLogSpool()
+{
+    ::close(fd);
+}
+
+bool
+RemoteLogSpool::
+push(const std::string & frame)
+{
+    if (bytes() + frame.size() > maxBytes) {
+        ++numDropped_;
+        return false;
+    }
+
+    // Move what is left to the start of the file rather than letting it
+    // grow past the maximum size
+    if (writeOffset + frame.size() > maxBytes) {
+        char buf[65536];
+        size_t done = 0, todo = bytes();
+        while (done < todo) {
+            ssize_t res = pread(fd, buf, std::min(sizeof(buf), todo - done),
+                                readOffset + done);
+            if (res <= 0)
+                throw ML::Exception(errno, "reading remote log spool");
+            if (pwrite(fd, buf, res, done) != res)
+                throw ML::Exception(errno, "writing remote log spool");
+            done += res;
+        }
+        readOffset = 0;
+        writeOffset = todo;
+        if (ftruncate(fd, writeOffset) == -1)
+            throw ML::Exception(errno, "truncating remote log spool");
+    }
+
+    ssize_t res = pwrite(fd, frame.data(), frame.size(), writeOffset);
+    if (res != (ssize_t)frame.size())
+        throw ML::Exception(errno, "writing remote log spool");
+    writeOffset += frame.size();
+
+    return true;
+}
+
+bool
+RemoteLogSpool::
+pop(std::string & frame)
+{
+    if (empty())
+        return false;
+
+    RemoteLogFrameHeader header;
+    if (pread(fd, &header, sizeof(header), readOffset) != sizeof(header))
+        throw ML::Exception(errno, "reading remote log spool");
+
+    frame.resize(sizeof(header) + header.length);
+    ssize_t res = pread(fd, &frame[0], frame.size(), readOffset);
+    if (res != (ssize_t)frame.size())
+        throw ML::Exception(errno, "reading remote log spool");
+    readOffset += frame.size();
+
+    if (empty()) {
+        readOffset = writeOffset = 0;
+        if (ftruncate(fd, 0) == -1)
+            throw ML::Exception(errno, "truncating remote log spool");
+    }
+
+    return true;
+}
+
+} // namespace Datacratic
@@ -0,0 +1,230 @@
+/* remote_log_protocol.h                                           -*- C++ -*-
+   Copyright (c) 2014 Datacratic.  All rights reserved.
+
+   Wire protocol between RemoteOutput and RemoteInput.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <functional>
+#include <string>
+#include <vector>
+
+
+namespace Datacratic {
+
+
+/*****************************************************************************/
+/* REMOTE LOG FRAME                                                          */
+/*****************************************************************************/
+
+/** Everything that goes over a remote logging connection is a frame: a
+    fixed header, in the byte order of the host, followed by `length` bytes
+    of payload.
+
+    The output sends BATCH frames, whose payload is made of numMessages
+    messages packed back to back, each one being
+
+        uint32_t channelLength, char channel[channelLength],
+        uint32_t messageLength, char message[messageLength]
+
+    and which can be compressed as a whole with zlib, in which case rawLength
+    is the length of the payload before compression.
+
+    The input answers with an ACK frame, with no payload, once it has
+    delivered the batch with the given sequence number.  The output keeps
+    the batches until they are acknowledged and sends them again over the
+    next connection if the current one goes down, so delivery is at least
+    once; the input discards the batches of a stream that it has already
+    delivered, so that a batch resent to the same input is only delivered
+    once.
+*/
+
+struct RemoteLogFrameHeader {
+    enum Type {
+        BATCH = 1,
+        ACK = 2
+    };
+
+    enum Flags {
+        COMPRESSED = 1
+    };
+
+    uint32_t length;       ///< bytes of payload following the header
+    uint16_t type;         ///< one of Type
+    uint16_t flags;        ///< combination of Flags
+    uint64_t stream;       ///< identifies the sending RemoteOutput
+    uint64_t sequence;     ///< sequence number of the batch in the stream
+    uint32_t numMessages;  ///< number of messages in the batch
+    uint32_t rawLength;    ///< length of the payload once decompressed
+} __attribute__((__packed__));
+
+static_assert(sizeof(RemoteLogFrameHeader) == 32,
+              "RemoteLogFrameHeader has an unexpected size");
+
+
+/*****************************************************************************/
+/* REMOTE LOG BATCH WRITER                                                   */
+/*****************************************************************************/
+
+/** Accumulates messages into a batch and turns it into a BATCH frame. */
+
+struct RemoteLogBatchWriter {
+
+    RemoteLogBatchWriter();
+
+    /** Append a message to the batch. */
+    void add(const std::string & channel, const std::string & message);
+
+    /** Bytes of payload accumulated so far. */
+    size_t size() const
+    {
+        return payload.size();
+    }
+
+    size_t numMessages() const
+    {
+        return numMessages_;
+    }
+
+    bool empty() const
+    {
+        return numMessages_ == 0;
+    }
+
+    /** Return the batch as a frame, compressing it if asked to and if that
+        makes it smaller, and start a new batch.
+    */
+    std::string seal(uint64_t stream, uint64_t sequence, bool compress);
+
+private:
+    std::string payload;
+    size_t numMessages_;
+};
+
+
+/*****************************************************************************/
+/* REMOTE LOG FRAME READER                                                   */
+/*****************************************************************************/
+
+/** Decodes the frames out of the data received on a connection, which can
+    be split arbitrarily.
+*/
+
+struct RemoteLogFrameReader {
+
+    /** Message of a decoded batch, pointing into the reader's buffers and
+        only valid until the onBatch callback returns.
+    */
+    struct Message {
+        const char * channel;
+        size_t channelLength;
+        const char * message;
+        size_t messageLength;
+
+        std::string channelStr() const
+        {
+            return std::string(channel, channelLength);
+        }
+
+        std::string messageStr() const
+        {
+            return std::string(message, messageLength);
+        }
+    };
+
+    RemoteLogFrameReader(size_t maxFrameLength = 64 * 1024 * 1024);
+
+    /** Feed data received.  Calls the callbacks for each complete frame,
+        and throws if the data isn't a valid stream of frames.
+    */
+    void feed(const char * data, size_t length);
+
+    void feed(const std::string & data)
+    {
+        feed(data.c_str(), data.size());
+    }
+
+    typedef std::function<void (const RemoteLogFrameHeader & header,
+                                const std::vector<Message> & messages)>
+        OnBatch;
+    OnBatch onBatch;
+
+    typedef std::function<void (const RemoteLogFrameHeader & header)> OnAck;
+    OnAck onAck;
+
+    /** Frame with no payload acknowledging a batch. */
+    static std::string ack(uint64_t stream, uint64_t sequence);
+
+private:
+    size_t maxFrameLength;
+
+    /** Data of a frame that was only partially received. */
+    std::string buffer;
+
+    /** Reused for the decompressed batches and their messages. */
+    std::string raw;
+    std::vector<Message> messages;
+
+    /** Decode the frame, returning false if it isn't complete. */
+    bool decode(const char * data, size_t length, size_t & used);
+    void decodeBatch(const RemoteLogFrameHeader & header,
+                     const char * payload);
+};
+
+
+/*****************************************************************************/
+/* REMOTE LOG SPOOL                                                          */
+/*****************************************************************************/
+
+/** Bounded, first-in first-out store of the frames that can't be sent yet,
+    kept in a file rather than in memory.  Frames that would take the spool
+    over its maximum size are dropped.  Not thread-safe.
+*/
+
+struct RemoteLogSpool {
+
+    /** Spool into the given file, which is truncated, or into an anonymous
+        temporary file if the path is empty.
+    */
+    RemoteLogSpool(const std::string & path = "",
+                   size_t maxBytes = 256 * 1024 * 1024);
+
+    ~RemoteLogSpool();
+
+    /** Store a frame at the back of the spool.  Returns false if it was
+        dropped because the spool is full.
+    */
+    bool push(const std::string & frame);
+
+    /** Take the frame at the front of the spool, or return false if it is
+        empty.
+    */
+    bool pop(std::string & frame);
+
+    bool empty() const
+    {
+        return readOffset == writeOffset;
+    }
+
+    /** Bytes of frames currently in the spool. */
+    size_t bytes() const
+    {
+        return writeOffset - readOffset;
+    }
+
+    size_t numDropped() const
+    {
+        return numDropped_;
+    }
+
+private:
+    int fd;
+    size_t maxBytes;
+    size_t readOffset;
+    size_t writeOffset;
+    size_t numDropped_;
+};
+
+} // namespace Datacratic
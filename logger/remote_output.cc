@@ -4,17 +4,13 @@
 
 */
 
+#include <string.h>
 #include <functional>
+#include <random>
 #include "remote_output.h"
-#include <boost/iostreams/categories.hpp>
-#include <boost/iostreams/filtering_stream.hpp>
-#include <boost/iostreams/filter/bzip2.hpp>
-#include <boost/iostreams/filter/gzip.hpp>
-#include "filter.h"
 
 using namespace std;
 using namespace ML;
-using namespace boost::iostreams;
 
 namespace Datacratic {
 
@@ -27,16 +23,13 @@ namespace Datacratic {
 struct RemoteOutputConnection
     : public PassiveConnectionHandler {
 
-    RemoteOutputConnection()
-        : messageSerial(0), messageWritten(0)
+    RemoteOutputConnection(RemoteOutput * output)
+        : output(output)
     {
-        std::shared_ptr<ZlibCompressor> filter
-            (new ZlibCompressor());
-        filter->onOutput = bind(&RemoteOutputConnection::write,
-                                this,
-                                placeholders::_1, placeholders::_2,
-                                placeholders::_4);
-        this->filter = filter;
+        reader.onAck = [=] (const RemoteLogFrameHeader & header)
+            {
+                this->output->onAck(header.stream, header.sequence);
+            };
     }
 
     ~RemoteOutputConnection()
@@ -52,9 +45,12 @@ struct RemoteOutputConnection
 
     virtual void handleData(const std::string & data)
     {
-        // We shouldn't get anything back on this (yet)
-        cerr << "warning: handleData: shouldn't have received anything"
-             << " but got " << data << endl;
+        // Only acknowledgements come back
+        try {
+            reader.feed(data);
+        } catch (const std::exception & exc) {
+            doError("invalid data from remote input: " + string(exc.what()));
+        }
     }
 
     virtual void handleError(const std::string & error)
@@ -74,59 +70,8 @@ struct RemoteOutputConnection
         closeWhenHandlerFinished();
     }
 
-    void logMessage(const std::string & channel,
-                    const std::string & message,
-                    std::function<void ()> onMessageDone)
-    {
-        string buf = format("%s\t%s\n\r", channel.c_str(), message.c_str());
-        filter->process(buf, FLUSH_SYNC, onMessageDone);
-    }
-
-    void flush(FlushLevel level = FLUSH_FULL,
-               std::function<void ()> onFlushDone
-                   = std::function<void ()>())
-    {
-        filter->flush(level, onFlushDone);
-    }
-
-    void close(std::function<void ()> onCloseDone
-                   = std::function<void ()>())
-    {
-        cerr << "closing" << endl;
-        filter->flush(FLUSH_FINISH, onCloseDone);
-    }
-
-    size_t messageSerial;
-    size_t messageWritten;
-
-    std::shared_ptr<Filter> filter;
-
-    // TODO: how to deal with dropped messages?
-    std::streamsize write(const char * s, size_t n,
-                          std::function<void ()> onWriteFinished)
-    {
-        size_t serial JML_UNUSED = ++messageSerial;
-        //cerr << "sending " << n << " bytes" << endl;
-
-        std::string toSend(s, n);
-        
-        auto onSendFinished = [=] ()
-            {
-                ++messageWritten;
-                if (onWriteFinished)
-                    onWriteFinished();
-            };
-        
-        auto doSend = [=] ()
-            {
-                this->send(toSend, NEXT_CONTINUE, onSendFinished);
-            };
-        
-        doAsync(doSend, "doSendLog");
-        
-        return n;
-    }
-    
+    RemoteOutput * output;
+    RemoteLogFrameReader reader;
 };
 
 
@@ -136,9 +81,28 @@ struct RemoteOutputConnection
 
 RemoteOutput::
 RemoteOutput()
-    : ActiveEndpointT<SocketTransport>("remoteOutput")
+    : ActiveEndpointT<SocketTransport>("remoteOutput"),
+      batchSize(65536),
+      maxBatchDelay(0.05),
+      compress(true),
+      maxInFlightBytes(4 * 1024 * 1024),
+      maxSpoolBytes(256 * 1024 * 1024),
+      ackTimeout(60.0),
+      maxReconnectDelay(5.0),
+      timeout(10.0),
+      nextSequence(1),
+      inFlightBytes(0),
+      stopFlusher(false),
+      reconnectAt(Date::notADate()),
+      reconnectDelay(0.0),
+      numBatchesSent(0),
+      numBytesSent(0),
+      numMessagesLogged(0)
 {
     shuttingDown = false;
+
+    std::random_device device;
+    stream = (uint64_t(device()) << 32) ^ device();
 }
 
 RemoteOutput::
@@ -175,6 +139,14 @@ connect(int port, const std::string & hostname, double timeout)
 
     guard.release();
 
+    {
+        std::unique_lock<std::mutex> sendGuard(sendLock);
+        if (!flusher.joinable()) {
+            stopFlusher = false;
+            flusher = std::thread([=] () { this->runFlusher(); });
+        }
+    }
+
     reconnect(onConnectionDone, onConnectionError, timeout);
     sem.acquire();
     
@@ -206,11 +178,20 @@ setupConnection(std::shared_ptr<TransportBase> transport,
         {
             try {
                 std::shared_ptr<RemoteOutputConnection> connection
-                    (new RemoteOutputConnection());
+                    (new RemoteOutputConnection(this));
                 transport->associate(connection);
 
-                Guard guard(this->lock);
+                std::unique_lock<std::mutex> guard(this->sendLock);
                 this->connection = connection;
+                this->reconnectDelay = 0.0;
+
+                // What wasn't acknowledged over the last connection is
+                // sent again first, to keep the batches in order
+                for (auto & entry: inFlight)
+                    sendFrame(entry.second);
+                sendSpooled();
+                guard.unlock();
+
                 if (onFinished) onFinished();
             } catch (const std::exception & exc) {
                 onError("setupConnection: error: " + string(exc.what()));
@@ -223,107 +204,209 @@ setupConnection(std::shared_ptr<TransportBase> transport,
 
 void
 RemoteOutput::
-barrier()
+sealBatch()
 {
-    Guard guard(lock);
-
-    ACE_Semaphore sem(0);
+    if (batch.empty())
+        return;
 
-    auto onBarrierDone = [&] ()
-        {
-            sem.release();
-        };
+    uint64_t sequence = nextSequence++;
+    auto frame = std::make_shared<std::string>
+        (batch.seal(stream, sequence, compress));
 
-    auto finishBarrier = [&] ()
-        {
-            this->connection->flush(FLUSH_NONE, onBarrierDone);
-        };
+    if (connection && (!spool || spool->empty())
+        && inFlightBytes < maxInFlightBytes) {
+        inFlight.emplace_back(sequence, frame);
+        inFlightBytes += frame->size();
+        sendFrame(frame);
+        return;
+    }
 
-    connection->doAsync(finishBarrier, "finishBarrier");
-    
-    sem.acquire();
+    if (!spool)
+        spool.reset(new RemoteLogSpool(spoolPath, maxSpoolBytes));
+    if (!spool->push(*frame))
+        cerr << "remote log spool is full; dropping batch of "
+             << frame->size() << " bytes" << endl;
 }
 
 void
 RemoteOutput::
-sync()
+sendSpooled()
 {
-    Guard guard(lock);
+    if (!spool)
+        return;
 
-    ACE_Semaphore sem(0);
+    std::string frame;
+    while (connection && inFlightBytes < maxInFlightBytes
+           && spool->pop(frame)) {
+        RemoteLogFrameHeader header;
+        memcpy(&header, frame.data(), sizeof(header));
+        uint64_t sequence = header.sequence;  // packed; can't bind to it
+
+        auto toSend = std::make_shared<std::string>();
+        toSend->swap(frame);
+        inFlight.emplace_back(sequence, toSend);
+        inFlightBytes += toSend->size();
+        sendFrame(toSend);
+    }
+}
 
-    auto onSyncDone = [&] ()
-        {
-            sem.release();
-        };
+void
+RemoteOutput::
+sendFrame(const std::shared_ptr<std::string> & frame)
+{
+    ++numBatchesSent;
+    numBytesSent += frame->size();
 
-    auto finishSync = [&] ()
+    // One asynchronous call per batch rather than per message
+    auto connection = this->connection;
+    auto doSend = [=] ()
         {
-            this->connection->flush(FLUSH_SYNC, onSyncDone);
+            connection->send(frame->data(), frame->size(),
+                             PassiveConnectionHandler::NEXT_CONTINUE);
         };
-
-    connection->doAsync(finishSync, "finishSync");
-    
-    sem.acquire();
+    connection->doAsync(doSend, "sendLogBatch");
 }
 
 void
 RemoteOutput::
-flush()
+onAck(uint64_t stream, uint64_t sequence)
 {
-    Guard guard(lock);
+    std::unique_lock<std::mutex> guard(sendLock);
 
-    ACE_Semaphore sem(0);
+    if (stream != this->stream)
+        return;
 
-    auto onFlushDone = [&] ()
-        {
-            sem.release();
-        };
+    while (!inFlight.empty() && inFlight.front().first <= sequence) {
+        inFlightBytes -= inFlight.front().second->size();
+        inFlight.pop_front();
+    }
 
-    auto finishFlush = [&] ()
-        {
-            this->connection->flush(FLUSH_FULL, onFlushDone);
-        };
+    sendSpooled();
 
-    connection->doAsync(finishFlush, "finishFlush");
-    
-    sem.acquire();
+    acknowledged.notify_all();
 }
 
 void
 RemoteOutput::
-close()
+waitUntilAcknowledged(const char * operation)
 {
-    Guard guard(lock);
+    std::unique_lock<std::mutex> guard(sendLock);
+
+    sealBatch();
+
+    auto limit = std::chrono::microseconds(int64_t(ackTimeout * 1000000));
+    bool done = acknowledged.wait_for(guard, limit, [&] ()
+                     {
+                         return inFlight.empty()
+                             && (!spool || spool->empty());
+                     });
+    if (!done)
+        throw Exception("RemoteOutput::%s(): %zu batches in flight and "
+                        "%zu bytes spooled still not acknowledged after "
+                        "%.1fs%s",
+                        operation, inFlight.size(),
+                        spool ? spool->bytes() : (size_t)0,
+                        ackTimeout,
+                        connection ? "" : " (not connected)");
+}
 
-    ACE_Semaphore sem(0);
+void
+RemoteOutput::
+runFlusher()
+{
+    std::unique_lock<std::mutex> guard(sendLock);
 
-    auto onCloseDone = [&] ()
+    auto onConnectDone = [=] ()
         {
-            sem.release();
+            cerr << "new connection done" << endl;
         };
 
-    auto finishClose = [&] ()
+    auto onConnectError = [=] (const std::string & error)
         {
-            this->connection->close(onCloseDone);
+            cerr << "reconnection had error: " << error << endl;
+            if (this->onConnectionError)
+                this->onConnectionError(error);
         };
 
-    connection->doAsync(finishClose, "finishClose");
-    
-    sem.acquire();
+    while (!stopFlusher) {
+        double delay = maxBatchDelay / 2;
+        if (reconnectAt.isADate())
+            delay = std::min(delay, Date::now().secondsUntil(reconnectAt));
+        flusherWakeup.wait_for
+            (guard, std::chrono::microseconds(int64_t(delay * 1000000) + 1));
+
+        Date now = Date::now();
+
+        if (!batch.empty() && now.secondsSince(batchStart) >= maxBatchDelay)
+            sealBatch();
+
+        if (reconnectAt.isADate() && now >= reconnectAt && !stopFlusher) {
+            reconnectAt = Date::notADate();
+            guard.unlock();
+            reconnect(onConnectDone, onConnectError, timeout);
+            guard.lock();
+        }
+    }
+}
+
+void
+RemoteOutput::
+barrier()
+{
+    waitUntilAcknowledged("barrier");
+}
+
+void
+RemoteOutput::
+sync()
+{
+    waitUntilAcknowledged("sync");
+}
+
+void
+RemoteOutput::
+flush()
+{
+    waitUntilAcknowledged("flush");
+}
+
+void
+RemoteOutput::
+close()
+{
+    waitUntilAcknowledged("close");
 }
 
 void
 RemoteOutput::
 shutdown()
 {
-    shuttingDown = true;
+    {
+        std::unique_lock<std::mutex> guard(sendLock);
+        shuttingDown = true;
+
+        // Give the remote input a chance to get what is pending
+        sealBatch();
+        if (connection) {
+            acknowledged.wait_for
+                (guard, std::chrono::microseconds(int64_t(timeout * 1000000)),
+                 [&] () { return inFlight.empty()
+                              && (!spool || spool->empty()); });
+        }
+
+        stopFlusher = true;
+        flusherWakeup.notify_all();
+    }
 
-    if (connection)
-        connection->flush();
+    if (flusher.joinable())
+        flusher.join();
 
     ActiveEndpointT<SocketTransport>::shutdown();
 
+    std::unique_lock<std::mutex> guard(sendLock);
+    connection.reset();
+    reconnectAt = Date::notADate();
+    reconnectDelay = 0.0;
     shuttingDown = false;
 }
 
@@ -332,27 +415,43 @@ RemoteOutput::
 logMessage(const std::string & channel,
            const std::string & message)
 {
-    Guard guard(lock);
+    std::unique_lock<std::mutex> guard(sendLock);
 
     if (shuttingDown)
         throw Exception("attempt to log message whilst shutting down");
 
-    if (!connection) {
-        cerr << "adding to backlog; currently " << backlog.size()
-             << " messages" << endl;
-        backlog.push_back(make_pair(channel, message));
-        return;
-    }
+    if (batch.empty())
+        batchStart = Date::now();
+
+    batch.add(channel, message);
+    ++numMessagesLogged;
 
-    auto onMessageLogged = [] () {};
+    if (batch.size() >= batchSize)
+        sealBatch();
+}
+
+Json::Value
+RemoteOutput::
+stats() const
+{
+    std::unique_lock<std::mutex> guard(sendLock);
+
+    Json::Value result;
+    result["messagesLogged"] = (Json::UInt)numMessagesLogged;
+    result["batchesSent"] = (Json::UInt)numBatchesSent;
+    result["bytesSent"] = (Json::UInt)numBytesSent;
+    result["bytesInFlight"] = (Json::UInt)inFlightBytes;
+    result["bytesSpooled"] = (Json::UInt)(spool ? spool->bytes() : 0);
+    result["batchesDropped"] = (Json::UInt)(spool ? spool->numDropped() : 0);
+    return result;
+}
 
-    // Safe to call from any thread on the connection
-    connection->doAsync(std::bind(&RemoteOutputConnection::logMessage,
-                                  connection,
-                                  channel,
-                                  message,
-                                  onMessageLogged),
-                        "logMessage");
+void
+RemoteOutput::
+clearStats()
+{
+    std::unique_lock<std::mutex> guard(sendLock);
+    numMessagesLogged = numBatchesSent = numBytesSent = 0;
 }
 
 void
@@ -363,25 +462,19 @@ notifyCloseTransport(const std::shared_ptr<TransportBase> & transport)
 
     ActiveEndpointT<SocketTransport>::notifyCloseTransport(transport);
 
+    // The batches in flight stay there until they are acknowledged
+    std::unique_lock<std::mutex> sendGuard(sendLock);
     this->connection.reset();
+    if (shuttingDown || reconnectAt.isADate()) return;
 
-    if (shuttingDown) return;
-
-    cerr << "transport was closed; reconnecting" << endl;
-
-    auto onConnectDone = [=] ()
-        {
-            cerr << "new connection done" << endl;
-        };
-
-    auto onConnectError = [=] (const std::string & error)
-        {
-            cerr << "reconnection had error: " << error << endl;
-            if (this->onConnectionError)
-                this->onConnectionError(error);
-        };
+    cerr << "transport was closed; reconnecting in " << reconnectDelay
+         << "s" << endl;
 
-    reconnect(onConnectDone, onConnectError, timeout);
+    // The flusher makes the connection
+    reconnectAt = Date::now().plusSeconds(reconnectDelay);
+    reconnectDelay = std::min(std::max(reconnectDelay * 2, 0.01),
+                              maxReconnectDelay);
+    flusherWakeup.notify_all();
 }
 
 } // namespace Datacratic
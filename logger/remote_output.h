@@ -10,7 +10,12 @@
 #pragma once
 
 #include "logger.h"
+#include "remote_log_protocol.h"
 #include "soa/service/active_endpoint.h"
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
 
 
 namespace Datacratic {
@@ -24,7 +29,23 @@ struct RemoteOutputConnection;
 /*****************************************************************************/
 
 /** Logging output class that establishes a connection to another machine and
-    sends zipped versions of the log file to that machine.
+    sends it the log messages.
+
+    Messages are packed into batches of up to batchSize bytes, which are
+    sent as a single frame (see remote_log_protocol.h), optionally
+    compressed.  A batch that isn't full is sent once it has been waiting
+    for maxBatchDelay seconds.
+
+    Batches are kept until the remote input acknowledges them, and are sent
+    again over the next connection if the current one is lost.  When more
+    than maxInFlightBytes are waiting for an acknowledgement, or while there
+    is no connection, batches are stored in a bounded spool file; if that
+    is full, they are dropped.  barrier(), flush(), sync() and close() all
+    wait for every message logged so far to be acknowledged, and throw if
+    that takes more than ackTimeout seconds.
+
+    A lost connection is retried straight away, then with a delay that
+    doubles with each failed attempt up to maxReconnectDelay seconds.
 */
 
 struct RemoteOutput
@@ -58,6 +79,10 @@ struct RemoteOutput
     virtual void logMessage(const std::string & channel,
                             const std::string & message);
 
+    virtual Json::Value stats() const;
+
+    virtual void clearStats();
+
     /** Notification that a connection was closed.  This can be used to give a
         new set of data.
     */
@@ -69,7 +94,19 @@ struct RemoteOutput
     */
     std::function<void (const std::string)> onConnectionError;
 
+    /* Options, to be set before connecting. */
+    size_t batchSize;            ///< bytes of messages per batch
+    double maxBatchDelay;        ///< seconds before sending a partial batch
+    bool compress;               ///< compress the batches with zlib
+    size_t maxInFlightBytes;     ///< unacknowledged bytes before spooling
+    std::string spoolPath;       ///< spool file; empty for a temporary one
+    size_t maxSpoolBytes;        ///< size over which batches are dropped
+    double ackTimeout;           ///< seconds to wait for acknowledgements
+    double maxReconnectDelay;    ///< longest wait between reconnections
+
 private:
+    friend struct RemoteOutputConnection;
+
     /** Internal helper function used to reconnect to the remote server. */
     void reconnect(std::function<void ()> onFinished,
                    std::function<void (const std::string &)> onError,
@@ -83,14 +120,67 @@ private:
                          std::function<void ()> onFinished,
                          std::function<void (const std::string &)> onError);
 
+    /* The following must be called with sendLock held. */
+
+    /** Turn the current batch into a frame and send or spool it. */
+    void sealBatch();
+
+    /** Send frames from the spool as long as there is room in flight. */
+    void sendSpooled();
+
+    void sendFrame(const std::shared_ptr<std::string> & frame);
+
+    /* And these take it. */
+
+    /** Called by the connection when the remote input acknowledged the
+        batches up to the given one. */
+    void onAck(uint64_t stream, uint64_t sequence);
+
+    /** Wait until every batch logged so far was acknowledged, or throw
+        after ackTimeout seconds. */
+    void waitUntilAcknowledged(const char * operation);
+
+    /** Thread sending the partial batches and reconnecting. */
+    void runFlusher();
+
     int port;
     std::string hostname;
     double timeout;
     std::shared_ptr<RemoteOutputConnection> connection;
     bool shuttingDown;
 
-    /** Backlog of messages to send whilst connection is down. */
-    std::vector<std::pair<std::string, std::string> > backlog;
+    mutable std::mutex sendLock;
+    std::condition_variable acknowledged;
+
+    /** Identifies this output to the remote input. */
+    uint64_t stream;
+    uint64_t nextSequence;
+
+    RemoteLogBatchWriter batch;
+    Date batchStart;
+
+    /** Batches sent and waiting for an acknowledgement. */
+    std::deque<std::pair<uint64_t, std::shared_ptr<std::string> > > inFlight;
+    size_t inFlightBytes;
+
+    /** Batches waiting to be sent. */
+    std::unique_ptr<RemoteLogSpool> spool;
+
+    std::thread flusher;
+    std::condition_variable flusherWakeup;
+    bool stopFlusher;
+
+    /** When the flusher is to reconnect, or notADate.  Failed attempts
+        double the delay up to maxReconnectDelay, so that an input that
+        is down isn't hammered with connections.
+    */
+    Date reconnectAt;
+    double reconnectDelay;
+
+    /* stats */
+    uint64_t numBatchesSent;
+    uint64_t numBytesSent;
+    uint64_t numMessagesLogged;
 };
 
 } // namespace Datacratic
@@ -0,0 +1,140 @@
+/* log_message_splitter_bench.cc
+   Copyright (c) 2014 Datacratic.  All rights reserved.
+
+   Rate, in GB/s, at which a buffer of tab separated log records is split
+   into fields: line by line with a copy of each line and a byte at a time
+   scan, as the splitter used to do, line by line with LogMessageSplitter,
+   and in a single pass with LogBatchSplitter.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <random>
+#include <string>
+
+#include "soa/logger/log_message_splitter.h"
+#include "soa/types/date.h"
+
+using namespace std;
+using namespace Datacratic;
+
+
+namespace {
+
+const int NumColumns = 12;
+
+/* records looking like the ones of a bid request log: a dozen fields of
+   various lengths, one of them being a long JSON blob */
+string makeRecords(size_t bytes)
+{
+    mt19937 rng(1);
+    uniform_int_distribution<int> shortLength(1, 24);
+    uniform_int_distribution<int> longLength(100, 800);
+
+    string result;
+    result.reserve(bytes + 1024);
+    while (result.size() < bytes) {
+        for (int i = 0;  i < NumColumns;  ++i) {
+            if (i)
+                result += '\t';
+            int length = (i == 7 ? longLength(rng) : shortLength(rng));
+            result.append(length, 'a' + i);
+        }
+        result += '\n';
+    }
+    return result;
+}
+
+/* what LogMessageSplitter used to do */
+template<int maxFields>
+struct CopyingSplitter {
+    CopyingSplitter(const std::string & str, char split = '\t')
+        : str(str), numFields(0)
+    {
+        const char * data = this->str.c_str();
+        const char * start = data;
+        const char * end = start + str.size();
+
+        while (start <= end && numFields < maxFields) {
+            offsets[numFields++] = start - data;
+            while (start < end && *start != split)
+                ++start;
+            if (start == end) break;
+            ++start;
+        }
+        offsets[numFields] = end - data + 1;
+    }
+
+    std::string str;
+    int numFields;
+    int offsets[maxFields + 1];
+};
+
+template<typename Fn>
+void run(const char * name, const string & records, Fn && fn)
+{
+    const int numIterations = 10;
+
+    size_t check = 0;
+    Date start = Date::now();
+    for (int i = 0;  i < numIterations;  ++i)
+        check += fn();
+    double elapsed = Date::now().secondsSince(start);
+
+    double bytes = double(records.size()) * numIterations;
+    ::printf("%-20s %8.3f GB/s  (%zd)\n",
+             name, bytes / elapsed / 1e9, check / numIterations);
+}
+
+} // file scope
+
+
+int main(int argc, char ** argv)
+{
+    size_t megabytes = argc > 1 ? atoi(argv[1]) : 256;
+    string records = makeRecords(megabytes * 1024 * 1024);
+
+    /* the number of fields found is printed, to check that they agree */
+    run("copy per line", records, [&] ()
+        {
+            size_t numFields = 0;
+            size_t start = 0;
+            for (size_t end;
+                 (end = records.find('\n', start)) != string::npos;
+                 start = end + 1) {
+                CopyingSplitter<NumColumns> split
+                    (records.substr(start, end - start));
+                numFields += split.numFields;
+            }
+            return numFields;
+        });
+
+    run("split per line", records, [&] ()
+        {
+            size_t numFields = 0;
+            const char * data = records.data();
+            const char * start = data;
+            forEachDelimiter(data, records.size(), '\n', [&] (size_t pos)
+                             {
+                                 LogMessageSplitter<NumColumns> split
+                                     (start, data + pos);
+                                 numFields += split.size();
+                                 start = data + pos + 1;
+                                 return true;
+                             });
+            return numFields;
+        });
+
+    LogBatchSplitter splitter(NumColumns);
+    LogBatch batch;
+    run("batch", records, [&] ()
+        {
+            splitter.split(records.data(), records.size(), batch);
+            size_t numFields = 0;
+            for (unsigned n: batch.numFields)
+                numFields += n;
+            return numFields;
+        });
+
+    return 0;
+}
@@ -0,0 +1,178 @@
+/* log_message_splitter_test.cc
+   Copyright (c) 2014 Datacratic.  All rights reserved.
+
+   Tests of the splitting of log messages into fields.
+*/
+
+#define BOOST_TEST_MAIN
+#define BOOST_TEST_DYN_LINK
+
+#include <boost/test/unit_test.hpp>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "jml/arch/exception.h"
+#include "soa/logger/log_message_splitter.h"
+
+using namespace std;
+using namespace Datacratic;
+
+
+namespace {
+
+vector<string> naiveSplit(const string & str, char split)
+{
+    vector<string> result(1);
+    for (char c: str) {
+        if (c == split)
+            result.emplace_back();
+        else result.back() += c;
+    }
+    return result;
+}
+
+/* records made of short and long fields, so that the delimiters fall on
+   both sides of the boundaries of the chunks that are scanned */
+string randomRecords(mt19937 & rng, int numRecords)
+{
+    uniform_int_distribution<int> numFields(1, 8);
+    uniform_int_distribution<int> fieldLength(0, 40);
+    string result;
+    for (int i = 0;  i < numRecords;  ++i) {
+        int n = numFields(rng);
+        for (int j = 0;  j < n;  ++j) {
+            if (j)
+                result += '\t';
+            result += string(fieldLength(rng), 'a' + j);
+        }
+        result += '\n';
+    }
+    return result;
+}
+
+} // file scope
+
+
+BOOST_AUTO_TEST_CASE( test_for_each_delimiter )
+{
+    string str(100, 'x');
+    vector<size_t> positions = { 0, 15, 16, 31, 32, 33, 64, 99 };
+    for (size_t pos: positions)
+        str[pos] = '\t';
+
+    vector<size_t> found;
+    BOOST_CHECK(forEachDelimiter(str.data(), str.size(), '\t',
+                                 [&] (size_t pos)
+                                 {
+                                     found.push_back(pos);
+                                     return true;
+                                 }));
+    BOOST_CHECK_EQUAL_COLLECTIONS(found.begin(), found.end(),
+                                  positions.begin(), positions.end());
+
+    found.clear();
+    BOOST_CHECK(!forEachDelimiter(str.data(), str.size(), '\t',
+                                  [&] (size_t pos)
+                                  {
+                                      found.push_back(pos);
+                                      return found.size() < 3;
+                                  }));
+    BOOST_CHECK_EQUAL(found.size(), 3);
+}
+
+BOOST_AUTO_TEST_CASE( test_log_message_splitter )
+{
+    string line = "one\ttwo\t\tfour";
+    LogMessageSplitter<8> split(line);
+    BOOST_CHECK_EQUAL(split.size(), 4);
+    BOOST_CHECK_EQUAL(split[0], "one");
+    BOOST_CHECK_EQUAL(split[1], "two");
+    BOOST_CHECK_EQUAL(string(split[2]), "");
+    BOOST_CHECK_EQUAL(split[3], "four");
+    BOOST_CHECK_THROW(split[4], ML::Exception);
+
+    /* fields past the maximum are ignored */
+    LogMessageSplitter<2> split2(line.data(), line.data() + line.size());
+    BOOST_CHECK_EQUAL(split2.size(), 2);
+    BOOST_CHECK_EQUAL(string(split2[1]), "two");
+
+    /* compare with a naive split over lines of all lengths */
+    mt19937 rng(1);
+    string records = randomRecords(rng, 1000);
+    size_t start = 0;
+    for (size_t end; (end = records.find('\n', start)) != string::npos;
+         start = end + 1) {
+        string line(records, start, end - start);
+        vector<string> expected = naiveSplit(line, '\t');
+        LogMessageSplitter<16> split(line);
+        BOOST_REQUIRE_EQUAL(split.size(), expected.size());
+        for (unsigned i = 0;  i < expected.size();  ++i)
+            BOOST_CHECK_EQUAL(string(split[i]), expected[i]);
+    }
+}
+
+BOOST_AUTO_TEST_CASE( test_log_batch_splitter )
+{
+    mt19937 rng(2);
+    string records = randomRecords(rng, 1000);
+    vector<string> lines = naiveSplit(records, '\n');
+    lines.pop_back();
+
+    /* give it all but the end of the last record */
+    LogBatchSplitter splitter(4);
+    LogBatch batch;
+    size_t used = splitter.split(records.data(), records.size() - 1, batch);
+    BOOST_CHECK_EQUAL(used, records.size() - lines.back().size() - 1);
+    BOOST_CHECK_EQUAL(batch.size(), lines.size() - 1);
+
+    used = splitter.split(records.data(), records.size(), batch);
+    BOOST_CHECK_EQUAL(used, records.size());
+    BOOST_REQUIRE_EQUAL(batch.size(), lines.size());
+
+    size_t recordStart = 0;
+    for (unsigned i = 0;  i < lines.size();  ++i) {
+        vector<string> fields = naiveSplit(lines[i], '\t');
+        BOOST_CHECK_EQUAL(batch.recordStarts[i], recordStart);
+        BOOST_CHECK_EQUAL(batch.numFields[i], fields.size());
+        for (unsigned j = 0;  j < 4;  ++j) {
+            string expected = j < fields.size() ? fields[j] : "";
+            BOOST_CHECK_EQUAL(string(batch.field(i, j)), expected);
+        }
+        recordStart += lines[i].size() + 1;
+    }
+
+    /* a record without its delimiter is only taken at the end */
+    string last = "x\ty";
+    BOOST_CHECK_EQUAL(splitter.split(last.data(), last.size(), batch), 0);
+    BOOST_CHECK_EQUAL(batch.size(), 0);
+    BOOST_CHECK_EQUAL(splitter.split(last.data(), last.size(), batch, true),
+                      last.size());
+    BOOST_CHECK_EQUAL(batch.size(), 1);
+    BOOST_CHECK_EQUAL(batch.field(0, 1), "y");
+    BOOST_CHECK_EQUAL(batch.columns[2].lengths[0], 0);
+}
+
+BOOST_AUTO_TEST_CASE( test_log_batch_splitter_partial )
+{
+    /* the fields of an unterminated record are not left in the columns */
+    LogBatchSplitter splitter(2);
+    LogBatch batch;
+    string records = "a\tb\nc\td";
+    size_t used = splitter.split(records.data(), records.size(), batch);
+    BOOST_CHECK_EQUAL(used, 4);
+    BOOST_REQUIRE_EQUAL(batch.size(), 1);
+    for (auto & column: batch.columns) {
+        BOOST_CHECK_EQUAL(column.starts.size(), 1);
+        BOOST_CHECK_EQUAL(column.lengths.size(), 1);
+    }
+    BOOST_CHECK_EQUAL(batch.field(0, 0), "a");
+    BOOST_CHECK_EQUAL(batch.field(0, 1), "b");
+
+    /* nor are those of a record that has more fields than columns */
+    records = "a\tb\nc\td\te\tf";
+    splitter.split(records.data(), records.size(), batch);
+    BOOST_REQUIRE_EQUAL(batch.size(), 1);
+    for (auto & column: batch.columns)
+        BOOST_CHECK_EQUAL(column.starts.size(), 1);
+}
@@ -1,6 +1,7 @@
 $(eval $(call nodejs_test,logger_js_test,logger,,,manual))
 $(eval $(call nodejs_test,remote_logger_test,logger))
 $(eval $(call test,remote_logger_test2,logger,boost))
+$(eval $(call program,remote_output_bench,logger))
 $(eval $(call nodejs_test,filter_js_test,logger sync))
 $(eval $(call test,json_filter_test,logger,boost manual))
 
@@ -8,4 +9,7 @@ $(eval $(call vowscoffee_test,logger_fs_test,logger))
 $(eval $(call test,logger_deadlock_test,logger,boost manual))
 
 $(eval $(call test,multi_output_logger_test,logger,boost))
+$(eval $(call program,multi_output_bench,logger))
+$(eval $(call test,log_message_splitter_test,logger,boost))
+$(eval $(call program,log_message_splitter_bench,logger))
 $(eval $(call test,rotating_file_logger_test,logger,manual boost))
@@ -0,0 +1,114 @@
+/* multi_output_bench.cc
+   Copyright (c) 2014 Datacratic.  All rights reserved.
+
+   Rate at which the logging threads get through MultiOutput::logMessage
+   when fanning out to 10k distinct keys, with the outputs written by the
+   logging threads or by workers, and with or without one output stalling
+   for 10ms on each of its messages.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "soa/logger/multi_output.h"
+#include "soa/types/date.h"
+
+using namespace std;
+using namespace Datacratic;
+
+
+namespace {
+
+struct NullOutput : public LogOutput {
+    NullOutput(bool stalled = false)
+        : stalled(stalled)
+    {
+    }
+
+    virtual void logMessage(const std::string & channel,
+                            const std::string & message)
+    {
+        if (stalled)
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        numMessages++;
+    }
+
+    virtual void close()
+    {
+    }
+
+    bool stalled;
+    std::atomic<size_t> numMessages { 0 };
+};
+
+/** Returns the number of messages per second logged by the threads. */
+double logMessages(int numWorkers, int numThreads, int numKeys,
+                   size_t numMessages, bool stalled)
+{
+    MultiOutput output(numWorkers);
+    output.logTo("", "campaign-$(1)/$(0)-$(2).log",
+                 [&] (string key)
+                 {
+                     return make_shared<NullOutput>
+                         (stalled && key == "campaign-0/BID-0.log");
+                 });
+
+    /* pre-format the messages, so that only the logging is timed */
+    vector<string> messages;
+    for (int i = 0;  i < numKeys;  ++i) {
+        messages.push_back(to_string(i % 100) + "\t" + to_string(i)
+                           + "\tsome payload for the message");
+    }
+
+    /* create the outputs */
+    for (auto & message: messages)
+        output.logMessage("BID", message);
+    output.flush();
+
+    vector<thread> threads;
+    Date start = Date::now();
+    for (int i = 0;  i < numThreads;  ++i) {
+        threads.emplace_back([&, i] () {
+                for (size_t j = 0;  j < numMessages;  ++j) {
+                    output.logMessage("BID",
+                                      messages[(i * 7919 + j) % numKeys]);
+                }
+            });
+    }
+    for (auto & th: threads)
+        th.join();
+
+    double rate = numThreads * numMessages / Date::now().secondsSince(start);
+    output.close();
+    return rate;
+}
+
+} // file scope
+
+
+int main(int argc, char ** argv)
+{
+    size_t numMessages = 1000000;
+    if (argc > 1)
+        numMessages = atoi(argv[1]);
+
+    int numKeys = 10000;
+
+    ::printf("workers,threads,keys,stalled,messages/s\n");
+
+    for (bool stalled: { false, true }) {
+        for (int numWorkers: { 0, 4 }) {
+            for (int numThreads: { 1, 2, 4, 8 }) {
+                ::printf("%d,%d,%d,%d,%.0f\n",
+                         numWorkers, numThreads, numKeys, stalled,
+                         logMessages(numWorkers, numThreads, numKeys,
+                                     numMessages / numThreads, stalled));
+            }
+        }
+    }
+
+    return 0;
+}
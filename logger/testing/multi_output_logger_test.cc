@@ -17,6 +17,10 @@
 #include "jml/utils/testing/watchdog.h"
 #include "jml/utils/testing/fd_exhauster.h"
 #include "jml/arch/timers.h"
+#include "soa/types/date.h"
+#include <atomic>
+#include <map>
+#include <thread>
 
 using namespace std;
 using namespace ML;
@@ -71,3 +75,157 @@ BOOST_AUTO_TEST_CASE( test_remote_logger )
     input.shutdown();
 #endif
 }
+
+namespace {
+
+struct CountingOutput : public LogOutput {
+    CountingOutput(double delay = 0.0)
+        : delay(delay), numMessages(0), closed(false)
+    {
+    }
+
+    virtual void logMessage(const std::string & channel,
+                            const std::string & message)
+    {
+        if (delay > 0.0)
+            ML::sleep(delay);
+        std::unique_lock<std::mutex> guard(lock);
+        messages.push_back(message);
+        ++numMessages;
+    }
+
+    virtual void close()
+    {
+        closed = true;
+    }
+
+    double delay;
+    std::mutex lock;
+    std::vector<std::string> messages;
+    std::atomic<int> numMessages;
+    std::atomic<bool> closed;
+};
+
+} // file scope
+
+BOOST_AUTO_TEST_CASE( test_multi_output_workers )
+{
+    std::mutex lock;
+    std::map<string, std::shared_ptr<CountingOutput> > created;
+
+    MultiOutput output(4);
+
+    output.logTo("", "$(0)-$(2)",
+                 [&] (string key) -> std::shared_ptr<LogOutput>
+                 {
+                     std::unique_lock<std::mutex> guard(lock);
+                     BOOST_CHECK(!created.count(key));
+                     auto result = make_shared<CountingOutput>
+                         (key == "SLOW-0" ? 0.5 : 0.0);
+                     created[key] = result;
+                     return result;
+                 });
+
+    // One slow output must not hold up the others
+    output.logMessage("SLOW", "x\t0");
+
+    int numThreads = 4, numKeys = 100, numMessages = 1000;
+    vector<std::thread> threads;
+    for (int i = 0;  i < numThreads;  ++i) {
+        threads.emplace_back([&, i] () {
+                for (int j = 0;  j < numMessages;  ++j) {
+                    output.logMessage("FAST", to_string(i) + "\t"
+                                      + to_string(j % numKeys) + "\t"
+                                      + to_string(j));
+                }
+            });
+    }
+    for (auto & th: threads)
+        th.join();
+
+    Date start = Date::now();
+    while (Date::now().secondsSince(start) < 0.4) {
+        int total = 0;
+        for (int i = 0;  i < numKeys;  ++i)
+            total += created["FAST-" + to_string(i)]->numMessages;
+        if (total == numThreads * numMessages)
+            break;
+        ML::sleep(0.001);
+    }
+    BOOST_CHECK_EQUAL(created["SLOW-0"]->numMessages, 0);
+
+    output.flush();
+    BOOST_CHECK_EQUAL(created.size(), numKeys + 1);
+    BOOST_CHECK_EQUAL(created["SLOW-0"]->numMessages, 1);
+
+    // Messages of each thread reach their output in order
+    for (int i = 0;  i < numKeys;  ++i) {
+        auto & messages = created["FAST-" + to_string(i)]->messages;
+        BOOST_CHECK_EQUAL(messages.size(), numThreads * numMessages / numKeys);
+        vector<int> last(numThreads, -1);
+        for (auto & message: messages) {
+            int th, key, n;
+            sscanf(message.c_str(), "%d\t%d\t%d", &th, &key, &n);
+            BOOST_CHECK_EQUAL(key, i);
+            BOOST_CHECK_GT(n, last[th]);
+            last[th] = n;
+        }
+    }
+
+    BOOST_CHECK_THROW(output.logMessage("FAST", "nofield"), ML::Exception);
+
+    output.close();
+    for (auto & entry: created)
+        BOOST_CHECK(entry.second->closed);
+}
+
+/* Messages logged while the output is closed are either written before
+   their output is closed, or dropped */
+BOOST_AUTO_TEST_CASE( test_multi_output_close_while_logging )
+{
+    std::mutex lock;
+    vector<std::shared_ptr<CountingOutput> > created;
+
+    MultiOutput output(4);
+
+    output.logTo("", "$(0)-$(1)",
+                 [&] (string key) -> std::shared_ptr<LogOutput>
+                 {
+                     std::unique_lock<std::mutex> guard(lock);
+                     auto result = make_shared<CountingOutput>();
+                     created.push_back(result);
+                     return result;
+                 });
+
+    auto numWritten = [&] ()
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            int result = 0;
+            for (auto & counting: created)
+                result += counting->numMessages;
+            return result;
+        };
+
+    std::atomic<bool> stop(false);
+    vector<std::thread> threads;
+    for (int i = 0;  i < 4;  ++i) {
+        threads.emplace_back([&] () {
+                for (int j = 0;  !stop;  ++j)
+                    output.logMessage("FAST", to_string(j % 10));
+            });
+    }
+
+    ML::sleep(0.05);
+    output.close();
+    int numWrittenOnClose = numWritten();
+    BOOST_CHECK_GT(numWrittenOnClose, 0);
+
+    ML::sleep(0.05);
+    stop = true;
+    for (auto & th: threads)
+        th.join();
+
+    BOOST_CHECK_EQUAL(numWritten(), numWrittenOnClose);
+    for (auto & counting: created)
+        BOOST_CHECK(counting->closed);
+}
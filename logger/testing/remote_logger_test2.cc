@@ -17,6 +17,8 @@
 #include "jml/utils/testing/watchdog.h"
 #include "jml/utils/testing/fd_exhauster.h"
 #include "jml/arch/timers.h"
+#include <atomic>
+#include <mutex>
 
 using namespace std;
 using namespace ML;
@@ -34,6 +36,14 @@ BOOST_AUTO_TEST_CASE( test_remote_logger )
 
     cerr << "port = " << port << endl;
 
+    std::atomic<int> numReceived(0);
+    input.onMessage = [&] (const string & channel, const string & message)
+        {
+            BOOST_CHECK_EQUAL(channel, "channelname");
+            BOOST_CHECK_EQUAL(message, "blah blah this is another message");
+            ++numReceived;
+        };
+
     RemoteOutput output;
     output.connect(port, "localhost");
 
@@ -41,9 +51,207 @@ BOOST_AUTO_TEST_CASE( test_remote_logger )
         output.logMessage("channelname", "blah blah this is another message");
         output.barrier();
     }
+
+    BOOST_CHECK_EQUAL(numReceived, 1000);
+
+    // Batched
+    for (int i = 0;  i < 100000;  ++i)
+        output.logMessage("channelname", "blah blah this is another message");
+    output.barrier();
+
+    BOOST_CHECK_EQUAL(numReceived, 101000);
+    BOOST_CHECK_EQUAL(input.numDuplicateBatches(), 0);
     
     //output.close();
 
     output.shutdown();
     input.shutdown();
 }
+
+/* barrier() gives up when nothing acknowledges the batches */
+BOOST_AUTO_TEST_CASE( test_remote_logger_ack_timeout )
+{
+    RemoteInput input;
+    input.listen(-1, "localhost");
+
+    RemoteOutput output;
+    output.ackTimeout = 0.2;
+    output.connect(input.port(), "localhost");
+    input.shutdown();
+
+    output.logMessage("channelname", "never acknowledged");
+    Date start = Date::now();
+    BOOST_CHECK_THROW(output.barrier(), ML::Exception);
+    BOOST_CHECK_LT(Date::now().secondsSince(start), 5.0);
+
+    output.shutdown();
+}
+
+/* Batches logged while the input is down are spooled, and sent in order
+   over the connection made once it is back on the same port. */
+BOOST_AUTO_TEST_CASE( test_remote_logger_spool_reconnect )
+{
+    ML::Watchdog watchdog(60.0);
+
+    std::mutex receivedLock;
+    vector<int> received;
+
+    auto onMessage = [&] (const string & channel, const string & message)
+        {
+            std::unique_lock<std::mutex> guard(receivedLock);
+            BOOST_CHECK_EQUAL(channel, "channelname");
+            received.push_back(std::stoi(message));
+        };
+
+    unique_ptr<RemoteInput> input(new RemoteInput());
+    input->onMessage = onMessage;
+    input->listen(-1, "localhost");
+    int port = input->port();
+
+    RemoteOutput output;
+    output.batchSize = 1024;
+    output.maxInFlightBytes = 4096;
+    output.ackTimeout = 10.0;
+    output.connect(port, "localhost");
+
+    int numMessages = 0;
+    auto logMessages = [&] (int n)
+        {
+            for (int i = 0;  i < n;  ++i, ++numMessages)
+                output.logMessage("channelname",
+                                  to_string(numMessages)
+                                  + " padding to make the message longer");
+        };
+
+    logMessages(1000);
+    output.barrier();
+    BOOST_CHECK_EQUAL(input->numMessagesReceived(), 1000);
+
+    // Stop the input; what is logged from now on has nowhere to go
+    input.reset();
+
+    Date start = Date::now();
+    while (output.stats()["bytesSpooled"].asUInt() == 0
+           && Date::now().secondsSince(start) < 10.0) {
+        logMessages(100);
+        ML::sleep(0.01);
+    }
+    logMessages(5000);
+
+    Json::Value stats = output.stats();
+    BOOST_CHECK_GT(stats["bytesSpooled"].asUInt(), 0);
+    BOOST_CHECK_EQUAL(stats["batchesDropped"].asUInt(), 0);
+
+    // Bring it back up; the output reconnects and replays the spool
+    input.reset(new RemoteInput());
+    input->onMessage = onMessage;
+    input->listen(port, "localhost");
+
+    output.barrier();
+
+    BOOST_CHECK_EQUAL(output.stats()["bytesSpooled"].asUInt(), 0);
+    BOOST_CHECK_EQUAL(input->numDuplicateBatches(), 0);
+
+    // Every message arrived once, in the order it was logged
+    std::unique_lock<std::mutex> guard(receivedLock);
+    BOOST_REQUIRE_EQUAL(received.size(), numMessages);
+    for (int i = 0;  i < numMessages;  ++i)
+        if (received[i] != i)
+            BOOST_REQUIRE_EQUAL(received[i], i);
+    guard.unlock();
+
+    output.shutdown();
+    input->shutdown();
+}
+
+BOOST_AUTO_TEST_CASE( test_remote_log_frames )
+{
+    for (bool compress: { false, true }) {
+        RemoteLogBatchWriter writer;
+        string frames;
+
+        for (int batch = 1;  batch <= 3;  ++batch) {
+            for (int i = 0;  i < 100;  ++i)
+                writer.add("channel" + to_string(batch),
+                           "message " + to_string(i));
+            writer.add("", "");
+            frames += writer.seal(42, batch, compress);
+            BOOST_CHECK(writer.empty());
+        }
+        frames += RemoteLogFrameReader::ack(42, 3);
+
+        // Split the data at every possible place
+        for (size_t split: { (size_t)1, (size_t)7, (size_t)31, (size_t)32,
+                    (size_t)1000, frames.size() }) {
+            RemoteLogFrameReader reader;
+            int numBatches = 0, numAcks = 0;
+
+            reader.onBatch = [&] (const RemoteLogFrameHeader & header,
+                                  const vector<RemoteLogFrameReader::Message>
+                                      & messages)
+                {
+                    ++numBatches;
+                    BOOST_CHECK_EQUAL(header.stream, 42);
+                    BOOST_CHECK_EQUAL(header.sequence, numBatches);
+                    BOOST_CHECK_EQUAL(!!(header.flags
+                                         & RemoteLogFrameHeader::COMPRESSED),
+                                      compress);
+                    BOOST_REQUIRE_EQUAL(messages.size(), 101);
+                    BOOST_CHECK_EQUAL(messages[5].channelStr(),
+                                      "channel" + to_string(numBatches));
+                    BOOST_CHECK_EQUAL(messages[5].messageStr(), "message 5");
+                    BOOST_CHECK_EQUAL(messages[100].channelStr(), "");
+                    BOOST_CHECK_EQUAL(messages[100].messageStr(), "");
+                };
+
+            reader.onAck = [&] (const RemoteLogFrameHeader & header)
+                {
+                    ++numAcks;
+                    BOOST_CHECK_EQUAL(header.sequence, 3);
+                };
+
+            for (size_t i = 0;  i < frames.size();  i += split)
+                reader.feed(frames.data() + i,
+                            std::min(split, frames.size() - i));
+
+            BOOST_CHECK_EQUAL(numBatches, 3);
+            BOOST_CHECK_EQUAL(numAcks, 1);
+        }
+    }
+
+    RemoteLogFrameReader reader;
+    string garbage(64, 'x');
+    BOOST_CHECK_THROW(reader.feed(garbage), ML::Exception);
+}
+
+BOOST_AUTO_TEST_CASE( test_remote_log_spool )
+{
+    RemoteLogBatchWriter writer;
+    writer.add("channel", string(1000, 'a'));
+    string frame = writer.seal(1, 1, false);
+
+    // Room for 10 frames
+    RemoteLogSpool spool("", frame.size() * 10);
+    string popped;
+    BOOST_CHECK(!spool.pop(popped));
+
+    for (int i = 0;  i < 10;  ++i)
+        BOOST_CHECK(spool.push(frame));
+    BOOST_CHECK(!spool.push(frame));
+    BOOST_CHECK_EQUAL(spool.numDropped(), 1);
+
+    // Taking frames off the front makes room at the back
+    for (int round = 0;  round < 100;  ++round) {
+        BOOST_CHECK(spool.pop(popped));
+        BOOST_CHECK_EQUAL(popped, frame);
+        BOOST_CHECK(spool.push(frame));
+        BOOST_CHECK_EQUAL(spool.bytes(), frame.size() * 10);
+    }
+
+    for (int i = 0;  i < 10;  ++i) {
+        BOOST_CHECK(spool.pop(popped));
+        BOOST_CHECK_EQUAL(popped, frame);
+    }
+    BOOST_CHECK(spool.empty());
+    BOOST_CHECK(!spool.pop(popped));
+}
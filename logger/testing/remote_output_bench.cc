@@ -0,0 +1,69 @@
+/* remote_output_bench.cc
+   Copyright (c) 2014 Datacratic.  All rights reserved.
+
+   Messages per second shipped from a RemoteOutput to a RemoteInput over
+   loopback, counting until the last batch has been acknowledged.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <atomic>
+
+#include "soa/logger/remote_input.h"
+#include "soa/logger/remote_output.h"
+#include "soa/types/date.h"
+
+using namespace std;
+using namespace Datacratic;
+
+
+int main(int argc, char ** argv)
+{
+    size_t numMessages = 1000000;
+    if (argc > 1)
+        numMessages = atoi(argv[1]);
+
+    RemoteInput input;
+    std::atomic<size_t> numReceived(0);
+    input.onMessage = [&] (const string & channel, const string & message)
+        {
+            ++numReceived;
+        };
+    input.listen(-1, "localhost");
+
+    string message = "2014-06-12-13:00:01.123\tBID\tsome-campaign\t"
+        "some-creative\t{\"bid\":1234,\"user\":\"0123456789abcdef\"}";
+
+    ::printf("compress,batch size,messages/s,bytes/message\n");
+
+    for (bool compress: { false, true }) {
+        for (size_t batchSize: { 4096, 65536, 1048576 }) {
+            RemoteOutput output;
+            output.compress = compress;
+            output.batchSize = batchSize;
+            output.connect(input.port(), "localhost");
+
+            size_t received = numReceived;
+            Date start = Date::now();
+            for (size_t i = 0;  i < numMessages;  ++i)
+                output.logMessage("BID", message);
+            output.barrier();
+            double elapsed = Date::now().secondsSince(start);
+
+            if (numReceived - received != numMessages)
+                ::fprintf(stderr, "received %zd messages out of %zd\n",
+                          numReceived - received, numMessages);
+
+            Json::Value stats = output.stats();
+            ::printf("%d,%zd,%.0f,%.1f\n", compress, batchSize,
+                     numMessages / elapsed,
+                     stats["bytesSent"].asDouble() / numMessages);
+
+            output.shutdown();
+        }
+    }
+
+    input.shutdown();
+
+    return 0;
+}
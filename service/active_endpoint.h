@@ -339,8 +339,9 @@ struct ConnectorT : public Connector {
                     // Set up a timeout
                     t->scheduleTimerRelative(timeout);
                     
-                    // Ready to write
+                    // Ready to write, which is when the connect is done
                     t->startWriting();
+                    t->watchConnect();
                 };
             
             // Call the rest in a handler context
@@ -0,0 +1,156 @@
+/* admission_control.cc
+   Copyright (c) 2014 Datacratic.  All rights reserved.
+
+   Load shedding driven by the time that messages spend in a queue.
+*/
+
+#include <pthread.h>
+#include "jml/arch/exception.h"
+#include "admission_control.h"
+
+using namespace std;
+
+
+namespace {
+
+/** Weight of the last message in the moving average of the shed rate. */
+const double ShedRateWeight = 1.0 / 64;
+
+/** Cheap per-thread generator, so that producers don't share any state. */
+double random01()
+{
+    static __thread uint64_t state = 0;
+    if (!state) {
+        state = (uint64_t(pthread_self()) | 1) * 0x9e3779b97f4a7c15ULL;
+    }
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return (state >> 11) * (1.0 / 9007199254740992.0);
+}
+
+} // file scope
+
+
+namespace Datacratic {
+
+/*****************************************************************************/
+/* ADMISSION CONTROL                                                         */
+/*****************************************************************************/
+
+AdmissionControl::Config::
+Config()
+    : target(0.005),
+      interval(0.1),
+      numClasses(1),
+      classTargetFactor(2.0)
+{
+}
+
+AdmissionControl::
+AdmissionControl(const Config & config)
+    : config(config),
+      lastDequeue_(0.0),
+      lastSojourn_(0.0)
+{
+    if (config.numClasses < 1) {
+        throw ML::Exception("admission control needs at least one class");
+    }
+    if (config.target <= 0.0 || config.interval < config.target) {
+        throw ML::Exception("admission control needs 0 < target <= interval");
+    }
+    if (config.classTargetFactor < 1.0) {
+        throw ML::Exception("the targets of the classes can't decrease");
+    }
+
+    classes.reset(new Class[config.numClasses]);
+
+    double target = config.target;
+    for (int i = 0;  i < config.numClasses;  ++i) {
+        classes[i].target = target;
+        target *= config.classTargetFactor;
+    }
+}
+
+bool
+AdmissionControl::
+onDequeue(double enqueued, int priority, double now)
+{
+    if (priority < 0 || priority >= config.numClasses) {
+        throw ML::Exception("invalid priority class %d", priority);
+    }
+
+    double sojourn = now - enqueued;
+    double lastDequeue = lastDequeue_.exchange(now, std::memory_order_relaxed);
+    lastSojourn_.store(sojourn, std::memory_order_relaxed);
+
+    /* no class sheds until it stood above its target for an interval */
+    if (lastDequeue == 0.0) {
+        for (int i = 0;  i < config.numClasses;  ++i) {
+            classes[i].lastBelowTarget.store(now, std::memory_order_relaxed);
+        }
+    }
+
+    /* the queue is the same for all the classes, so every message tells
+       each of them whether it is standing above its target */
+    for (int i = config.numClasses - 1;  i >= 0;  --i) {
+        if (sojourn < classes[i].target) {
+            classes[i].lastBelowTarget.store(now, std::memory_order_relaxed);
+        }
+        else {
+            break;
+        }
+    }
+
+    Class & cls = classes[priority];
+    double lastBelow = cls.lastBelowTarget.load(std::memory_order_relaxed);
+    bool standing = (now - lastBelow > config.interval);
+    double limit = standing ? cls.target : config.interval;
+
+    bool shed = (sojourn > limit);
+    if (shed) {
+        cls.numShed.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    double rate = cls.shedRate.load(std::memory_order_relaxed);
+    rate += ((shed ? 1.0 : 0.0) - rate) * ShedRateWeight;
+    cls.shedRate.store(rate, std::memory_order_relaxed);
+
+    return shed;
+}
+
+bool
+AdmissionControl::
+shedMessage(int priority, double now) const
+{
+    if (priority < 0 || priority >= config.numClasses) {
+        throw ML::Exception("invalid priority class %d", priority);
+    }
+
+    double lastDequeue = lastDequeue_.load(std::memory_order_relaxed);
+    if (now - lastDequeue > config.interval) {
+        return false;
+    }
+
+    const Class & cls = classes[priority];
+    double lastBelow = cls.lastBelowTarget.load(std::memory_order_relaxed);
+    if (now - lastBelow <= config.interval) {
+        return false;
+    }
+
+    double rate = cls.shedRate.load(std::memory_order_relaxed);
+    return random01() < rate;
+}
+
+uint64_t
+AdmissionControl::
+numShed(int priority) const
+{
+    if (priority < 0 || priority >= config.numClasses) {
+        throw ML::Exception("invalid priority class %d", priority);
+    }
+
+    return classes[priority].numShed.load(std::memory_order_relaxed);
+}
+
+} // namespace Datacratic
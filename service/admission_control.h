@@ -0,0 +1,157 @@
+/* admission_control.h                                             -*- C++ -*-
+   Copyright (c) 2014 Datacratic.  All rights reserved.
+
+   Load shedding driven by the time that messages spend in a queue.
+*/
+
+#pragma once
+
+#include <time.h>
+#include <atomic>
+#include <memory>
+#include <vector>
+
+
+namespace Datacratic {
+
+
+/*****************************************************************************/
+/* ADMISSION CONTROL                                                         */
+/*****************************************************************************/
+
+/** Decides which messages to shed from the sojourn time of the messages
+    going through a queue, in the manner of CoDel.
+
+    A queue that drains regularly has sojourn times that go below the target
+    every so often, and bursts are absorbed by letting messages wait up to
+    the interval.  Once no message has gone through in less than the target
+    for a whole interval, the queue is considered standing and messages that
+    have waited longer than the target are shed, until one goes through in
+    less than the target again.  Unlike LoadStabilizer, whose probability
+    moves by small steps once per update period, both transitions happen on
+    the message that observes them.
+
+    Messages belong to priority classes, 0 being the least important.  The
+    target of each class is that of the class below multiplied by
+    Config::classTargetFactor, so that the least important messages are
+    shed first and the most important ones only under heavier load.
+
+    All the methods are thread-safe and lock-free.  The times are in seconds
+    from AdmissionControl::now().
+*/
+
+struct AdmissionControl {
+
+    struct Config {
+        Config();
+
+        double target;             ///< acceptable standing delay, seconds
+        double interval;           ///< delay allowed to absorb bursts
+        int numClasses;            ///< number of priority classes
+        double classTargetFactor;  ///< target ratio between two classes
+    };
+
+    AdmissionControl(const Config & config = Config());
+
+    /** Monotonic time in seconds, with which messages should be stamped. */
+    static double now()
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec * 0.000000001;
+    }
+
+    /** To be called by the consumer for each message taken off the queue.
+        Returns true if the message should be shed rather than processed.
+    */
+    bool onDequeue(double enqueued, int priority = 0)
+    {
+        return onDequeue(enqueued, priority, now());
+    }
+
+    bool onDequeue(double enqueued, int priority, double now);
+
+    /** To be called by the producers before queueing a message, to reject
+        early the messages that would most likely be shed when dequeued.
+        While the class is shedding, returns true with the probability at
+        which the last messages of the class were shed by onDequeue.  A
+        queue that wasn't dequeued from during the last interval isn't
+        considered to be shedding, so that producers don't keep shedding
+        past an idle period.
+    */
+    bool shedMessage(int priority = 0) const
+    {
+        return shedMessage(priority, now());
+    }
+
+    bool shedMessage(int priority, double now) const;
+
+    /** Number of messages of the given class for which onDequeue returned
+        true.
+    */
+    uint64_t numShed(int priority) const;
+
+    /** Sojourn time of the last message dequeued. */
+    double lastSojourn() const
+    {
+        return lastSojourn_.load(std::memory_order_relaxed);
+    }
+
+    const Config config;
+
+private:
+    struct Class {
+        Class() : lastBelowTarget(0.0), shedRate(0.0), numShed(0) {}
+
+        double target;
+
+        /** Last time a message went through in less than the target. */
+        std::atomic<double> lastBelowTarget;
+
+        /** Moving average of the messages shed by onDequeue. */
+        std::atomic<double> shedRate;
+        std::atomic<uint64_t> numShed;
+    };
+
+    std::unique_ptr<Class[]> classes;
+    std::atomic<double> lastDequeue_;
+    std::atomic<double> lastSojourn_;
+};
+
+
+/*****************************************************************************/
+/* TIMESTAMPED                                                               */
+/*****************************************************************************/
+
+/** Message stamped with its priority class and the time it was queued, for
+    use with TypedMessageSink or TypedMessageQueue and AdmissionControl:
+
+        TypedMessageQueue<Timestamped<Request> > queue;
+        queue.push_back(Timestamped<Request>(std::move(request), priority));
+        ...
+        for (auto & msg: queue.pop_front(0)) {
+            if (!admission.onDequeue(msg.enqueued, msg.priority))
+                process(std::move(msg.message));
+        }
+*/
+
+template<typename Message>
+struct Timestamped {
+    Timestamped()
+        : enqueued(0.0), priority(0)
+    {
+    }
+
+    Timestamped(Message message, int priority = 0)
+        : message(std::move(message)),
+          enqueued(AdmissionControl::now()),
+          priority(priority)
+    {
+    }
+
+    Message message;
+    double enqueued;
+    int priority;
+};
+
+} // namespace Datacratic
@@ -4,10 +4,14 @@
 
 #include <iostream>
 #include <sys/timerfd.h>
+#include <string.h>
+#include <unistd.h>
 #include "jml/arch/exception.h"
 #include "jml/arch/futex.h"
 #include "message_loop.h"
 #include "async_event_source.h"
+#include "timer_service.h"
+#include "cpu_accounting.h"
 
 
 using namespace std;
@@ -48,8 +52,8 @@ PeriodicEventSource::
 PeriodicEventSource()
     : timerFd(-1),
       timePeriodSeconds(0),
-      singleThreaded_(true)
-      
+      singleThreaded_(true),
+      timers_(nullptr), timerId_(0)
 {
 }
 
@@ -58,9 +62,9 @@ PeriodicEventSource(double timePeriodSeconds,
                     std::function<void (uint64_t)> onTimeout,
                     bool singleThreaded)
     : timerFd(-1),
-      timePeriodSeconds(timePeriodSeconds),
-      onTimeout(onTimeout),
-      singleThreaded_(singleThreaded)
+      timePeriodSeconds(0),
+      singleThreaded_(true),
+      timers_(nullptr), timerId_(0)
 {
     init(timePeriodSeconds, onTimeout, singleThreaded);
 }
@@ -71,53 +75,45 @@ init(double timePeriodSeconds,
      std::function<void (uint64_t)> onTimeout,
      bool singleThreaded)
 {
-    if (timerFd != -1)
+    if (this->onTimeout)
         throw ML::Exception("double initialization of periodic event source");
-
-    this->timePeriodSeconds = timePeriodSeconds;
-    this->onTimeout = onTimeout;
-    this->singleThreaded_ = singleThreaded;
+    if (!onTimeout)
+        throw ML::Exception("'onTimeout' cannot be nil");
 
     timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
     if (timerFd == -1)
         throw ML::Exception(errno, "timerfd_create");
 
-    itimerspec spec;
-    
-    int res = clock_gettime(CLOCK_MONOTONIC, &spec.it_value);
-    if (res == -1)
-        throw ML::Exception(errno, "clock_gettime");
-    uint64_t seconds, nanoseconds;
-    seconds = timePeriodSeconds;
-    nanoseconds = (timePeriodSeconds - seconds) * 1000000000;
-
-    spec.it_interval.tv_sec = spec.it_value.tv_sec = seconds;
-    spec.it_interval.tv_nsec = spec.it_value.tv_nsec = nanoseconds;
+    this->timePeriodSeconds = timePeriodSeconds;
+    this->onTimeout = std::make_shared<OnTimeout>(std::move(onTimeout));
+    this->singleThreaded_ = singleThreaded;
 
-#if 0    
-    // Relative to current time, so zero
-    spec.it_value.tv_sec = spec.it_value.tv_nsec = 0;
+    setTimerFd(timePeriodSeconds);
+}
 
-    
-    spec.it_value.tv_nsec += nanoseconds;
-    if (spec.it_value.tv_nsec >= 1000000000) {
-        ++spec.it_value.tv_sec;
-        spec.it_value.tv_nsec -= 1000000000;
+PeriodicEventSource::
+~PeriodicEventSource()
+{
+    if (timerFd != -1) {
+        int res = close(timerFd);
+        if (res == -1)
+            cerr << "warning: close on timerfd: " << strerror(errno) << endl;
     }
-    spec.it_value.tv_sec += seconds;
-#endif
-
-    res = timerfd_settime(timerFd, 0, &spec, 0);
-    if (res == -1)
-        throw ML::Exception(errno, "timerfd_settime");
 }
 
+void
 PeriodicEventSource::
-~PeriodicEventSource()
+setTimerFd(double periodSeconds)
 {
-    int res = close(timerFd);
+    itimerspec spec;
+    uint64_t seconds = periodSeconds;
+    uint64_t nanoseconds = (periodSeconds - seconds) * 1000000000;
+    spec.it_interval.tv_sec = spec.it_value.tv_sec = seconds;
+    spec.it_interval.tv_nsec = spec.it_value.tv_nsec = nanoseconds;
+
+    int res = timerfd_settime(timerFd, 0, &spec, 0);
     if (res == -1)
-        cerr << "warning: close on timerfd: " << strerror(errno) << endl;
+        throw ML::Exception(errno, "timerfd_settime");
 }
 
 int
@@ -131,6 +127,7 @@ bool
 PeriodicEventSource::
 processOne()
 {
+    // Disarmed while attached, so that only the timer of the loop fires
     uint64_t numWakeups = 0;
     for (;;) {
         int res = read(timerFd, &numWakeups, 8);
@@ -142,11 +139,55 @@ processOne()
         else if (res != 8)
             throw ML::Exception("timerfd read: wrong number of bytes: %d",
                                 res);
-        onTimeout(numWakeups);
+        (*onTimeout)(numWakeups);
         break;
     }
     return false;
 }
 
+void
+PeriodicEventSource::
+onAttached(MessageLoop & loop)
+{
+    if (!onTimeout)
+        throw ML::Exception("periodic event source was not initialized");
+
+    TimerService & timers = loop.timers();
+    std::weak_ptr<OnTimeout> weakOnTimeout = onTimeout;
+    auto id = std::make_shared<TimerService::TimerId>(0);
+
+    // Charged to the source rather than to the timers of the loop
+    CpuAccount * account = cpuAccount_;
+
+    auto onTimer = [&timers, weakOnTimeout, id, account] (uint64_t numWakeups)
+        {
+            auto onTimeout = weakOnTimeout.lock();
+            if (onTimeout) {
+                CpuAccountingScope accounting(account);
+                (*onTimeout)(numWakeups);
+            }
+            else timers.cancel(*id);
+        };
+
+    // Timers run in the loop's thread, so it can't fire before we know
+    // its id
+    *id = timerId_ = timers.schedulePeriodic(timePeriodSeconds, onTimer);
+    timers_ = &timers;
+
+    setTimerFd(0);
+}
+
+void
+PeriodicEventSource::
+onDetached(MessageLoop & loop)
+{
+    if (timers_)
+        timers_->cancel(timerId_);
+    timers_ = nullptr;
+
+    if (timerFd != -1)
+        setTimerFd(timePeriodSeconds);
+}
+
 
 } // namespace Datacratic
@@ -8,12 +8,15 @@
 #pragma once
 
 #include <functional>
+#include <memory>
 #include "jml/arch/exception.h"
 
 
 namespace Datacratic {
 
 struct MessageLoop;
+struct TimerService;
+struct CpuAccount;
 
 
 /*****************************************************************************/
@@ -25,12 +28,14 @@ struct AsyncEventSource {
     constexpr static int CONNECTED = 1;
 
     AsyncEventSource()
-        : needsPoll(false), debug_(false), parent_(0), connectionState_(DISCONNECTED)
+        : needsPoll(false), debug_(false), parent_(0), connectionState_(DISCONNECTED),
+          cpuAccount_(nullptr)
     {
     }
 
     AsyncEventSource(AsyncEventSource && other)
-        : needsPoll(other.needsPoll), debug_(other.debug_), parent_(nullptr), connectionState_(other.connectionState_)
+        : needsPoll(other.needsPoll), debug_(other.debug_), parent_(nullptr), connectionState_(other.connectionState_),
+          cpuAccount_(nullptr)
     {
         if (other.parent_ != nullptr) {
             fprintf(stderr,
@@ -110,6 +115,19 @@ struct AsyncEventSource {
         parent_ = parent;
     }
 
+    /** Called from the thread of the message loop once it has added the
+        source, and once it has removed it.  Sources that only need timers
+        schedule them here on the timer service of the loop, rather than
+        owning a file descriptor.
+    */
+    virtual void onAttached(MessageLoop & loop)
+    {
+    }
+
+    virtual void onDetached(MessageLoop & loop)
+    {
+    }
+
     /** Disconnect from the parent message loop. */
     void disconnect();
 
@@ -129,6 +147,11 @@ struct AsyncEventSource {
 
     /** The connection state to the message loop. */
     int connectionState_;
+
+    /** Account charged with the time spent in processOne() by the message
+        loop, named after the source.  Set when the source is added.
+    */
+    CpuAccount * cpuAccount_;
 };
 
 
@@ -144,6 +167,12 @@ struct AsyncEventSource {
 /* PERIODIC EVENT SOURCE                                                     */
 /*****************************************************************************/
 
+/** Calls a function periodically.  Once added to a message loop, the timer
+    lives in the timer service of the loop, from which it is removed with
+    the source.  Until then, and when used on its own, the source runs from
+    a timerfd, which is ready whenever the period has elapsed.
+*/
+
 struct PeriodicEventSource : public AsyncEventSource {
     PeriodicEventSource();
 
@@ -166,11 +195,26 @@ struct PeriodicEventSource : public AsyncEventSource {
         return singleThreaded_;
     }
 
+    virtual void onAttached(MessageLoop & loop);
+
+    virtual void onDetached(MessageLoop & loop);
+
 private:
+    typedef std::function<void (uint64_t)> OnTimeout;
+
+    /** Arm the timerfd with the given period, or disarm it if zero. */
+    void setTimerFd(double periodSeconds);
+
     int timerFd;
     double timePeriodSeconds;
-    std::function<void (uint64_t)> onTimeout;
+
+    /* Shared with the timer, which cancels itself if we were destroyed
+       without having been removed from the loop */
+    std::shared_ptr<OnTimeout> onTimeout;
     bool singleThreaded_;
+
+    TimerService * timers_;
+    uint64_t timerId_;
 };
 
 } // namespace Datacratic
@@ -244,14 +244,25 @@ AwsApi::
 uriEncode(const std::string & str)
 {
     std::string result;
-    for (auto c: str) {
+    appendUriEncoded(str, result);
+    return result;
+}
+
+void
+AwsApi::
+appendUriEncoded(const std::string & str, std::string & output)
+{
+    static const char digits[] = "0123456789ABCDEF";
 
+    for (unsigned char c: str) {
         if (isalnum(c) || c == '-' || c == '_' || c == '.' || c == '~')
-            result += c;
-        else result += ML::format("%%%02X", c);
+            output += c;
+        else {
+            output += '%';
+            output += digits[c >> 4];
+            output += digits[c & 15];
+        }
     }
-
-    return result;
 }
 
 std::string
@@ -418,6 +429,391 @@ addSignatureV4(BasicRequest & request,
 
 
 
+/*****************************************************************************/
+/* AWS PAYLOAD HASH                                                          */
+/*****************************************************************************/
+
+namespace {
+
+/** Append the lowercase hex encoding of the given bytes. */
+void appendHex(const byte * data, size_t size, std::string & output)
+{
+    static const char digits[] = "0123456789abcdef";
+
+    for (size_t i = 0;  i < size;  ++i) {
+        output += digits[data[i] >> 4];
+        output += digits[data[i] & 15];
+    }
+}
+
+/** Hex encoded hash of an empty payload. */
+const char * const emptyPayloadHash
+    = "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855";
+
+} // file scope
+
+struct AwsPayloadHash::Itl {
+    CryptoPP::SHA256 hash;
+};
+
+AwsPayloadHash::
+AwsPayloadHash()
+    : itl(new Itl())
+{
+}
+
+AwsPayloadHash::
+~AwsPayloadHash()
+{
+}
+
+void
+AwsPayloadHash::
+update(const char * data, size_t size)
+{
+    itl->hash.Update((const byte *)data, size);
+}
+
+std::string
+AwsPayloadHash::
+hexDigest()
+{
+    byte digest[CryptoPP::SHA256::DIGESTSIZE];
+    itl->hash.Final(digest);
+
+    std::string result;
+    appendHex(digest, sizeof(digest), result);
+    return result;
+}
+
+
+/*****************************************************************************/
+/* AWS SIGNER V4                                                             */
+/*****************************************************************************/
+
+const std::string
+AwsSignerV4::UNSIGNED_PAYLOAD("UNSIGNED-PAYLOAD");
+
+const std::string
+AwsSignerV4::STREAMING_PAYLOAD("STREAMING-AWS4-HMAC-SHA256-PAYLOAD");
+
+struct AwsSignerV4::Itl {
+    Itl()
+        : lastSecond(-1)
+    {
+    }
+
+    std::mutex lock;
+
+    std::string accessKeyId;
+    std::string accessKey;
+    std::string region;
+    std::string service;
+
+    /** Day (YYYYMMDD) for which the signing key was derived and the
+        credential scope that goes with it.
+    */
+    std::string keyDate;
+    std::string scope;
+
+    /** HMAC keyed with the signing key for keyDate. */
+    CryptoPP::HMAC<CryptoPP::SHA256> hmac;
+    CryptoPP::SHA256 hash;
+
+    /** Last second that was formatted into amzDate. */
+    int64_t lastSecond;
+    std::string amzDate;
+
+    /* Buffers kept between requests so that they don't need to be
+       reallocated. */
+    RestParams headers;
+    std::vector<std::pair<const std::string *, const std::string *> >
+        queryParams;
+    std::string canonicalRequest;
+    std::string signedHeaders;
+    std::string stringToSign;
+    std::string signature;
+
+    void clearKey()
+    {
+        keyDate.clear();
+        scope.clear();
+    }
+
+    /** Make sure that the signing key is the one for the day that starts
+        the given date string.
+    */
+    void updateKey(const std::string & date)
+    {
+        if (!keyDate.empty() && date.compare(0, 8, keyDate) == 0)
+            return;
+
+        keyDate.assign(date, 0, 8);
+        string key = AwsApi::signingKeyV4(accessKey, keyDate, region, service);
+        hmac.SetKey((const byte *)key.c_str(), key.size());
+        scope = keyDate + "/" + region + "/" + service + "/aws4_request";
+    }
+
+    void updateDate(Date now)
+    {
+        int64_t second = now.secondsSinceEpoch();
+        if (second != lastSecond) {
+            amzDate = now.print("%Y%m%dT%H%M%SZ");
+            lastSecond = second;
+        }
+    }
+
+    void appendHash(const char * data, size_t size, std::string & output)
+    {
+        byte digest[CryptoPP::SHA256::DIGESTSIZE];
+        hash.CalculateDigest(digest, (const byte *)data, size);
+        appendHex(digest, sizeof(digest), output);
+    }
+
+    void appendHmac(const std::string & data, std::string & output)
+    {
+        byte digest[CryptoPP::SHA256::DIGESTSIZE];
+        hmac.CalculateDigest(digest, (const byte *)data.c_str(), data.size());
+        appendHex(digest, sizeof(digest), output);
+    }
+
+    /** Set the headers to the canonical (lowercase name and trimmed value)
+        version of the request headers, sorted.
+    */
+    void canonicalizeHeaders(const RestParams & requestHeaders)
+    {
+        headers.resize(requestHeaders.size());
+        for (size_t i = 0;  i < requestHeaders.size();  ++i) {
+            const auto & in = requestHeaders[i];
+            auto & out = headers[i];
+
+            out.first.assign(in.first);
+            for (char & c: out.first)
+                c = tolower(c);
+
+            const char * start = in.second.c_str();
+            const char * end = start + in.second.size();
+            while (start < end && isspace(*start))
+                ++start;
+            while (end > start && isspace(end[-1]))
+                --end;
+            out.second.assign(start, end);
+        }
+        std::sort(headers.begin(), headers.end());
+    }
+};
+
+AwsSignerV4::
+AwsSignerV4()
+    : itl(new Itl())
+{
+}
+
+AwsSignerV4::
+AwsSignerV4(const std::string & accessKeyId,
+            const std::string & accessKey,
+            const std::string & region,
+            const std::string & service)
+    : itl(new Itl())
+{
+    init(accessKeyId, accessKey, region, service);
+}
+
+AwsSignerV4::
+~AwsSignerV4()
+{
+}
+
+void
+AwsSignerV4::
+init(const std::string & accessKeyId,
+     const std::string & accessKey,
+     const std::string & region,
+     const std::string & service)
+{
+    std::unique_lock<std::mutex> guard(itl->lock);
+
+    itl->accessKeyId = accessKeyId;
+    itl->accessKey = accessKey;
+    itl->region = region;
+    itl->service = service;
+    itl->clearKey();
+}
+
+std::string
+AwsSignerV4::
+sign(AwsApi::BasicRequest & request, Date now)
+{
+    AwsPayloadHash payloadHash;
+    payloadHash.update(request.payload);
+    return sign(request, payloadHash.hexDigest(), now);
+}
+
+std::string
+AwsSignerV4::
+sign(AwsApi::BasicRequest & request,
+     const std::string & payloadHash,
+     Date now)
+{
+    std::unique_lock<std::mutex> guard(itl->lock);
+
+    itl->updateDate(now);
+    itl->updateKey(itl->amzDate);
+
+    request.headers.push_back({"X-Amz-Date", itl->amzDate});
+
+    string & canon = itl->canonicalRequest;
+    canon.clear();
+    canon += request.method;
+    canon += "\n/";
+    canon += request.relativeUri;
+    canon += '\n';
+
+    auto & queryParams = itl->queryParams;
+    queryParams.clear();
+    for (auto & p: request.queryParams)
+        queryParams.emplace_back(&p.first, &p.second);
+    std::sort(queryParams.begin(), queryParams.end(),
+              [] (const std::pair<const std::string *, const std::string *> & p1,
+                  const std::pair<const std::string *, const std::string *> & p2)
+              {
+                  int res = p1.first->compare(*p2.first);
+                  return res < 0 || (res == 0 && *p1.second < *p2.second);
+              });
+    for (size_t i = 0;  i < queryParams.size();  ++i) {
+        if (i > 0)
+            canon += '&';
+        AwsApi::appendUriEncoded(*queryParams[i].first, canon);
+        canon += '=';
+        AwsApi::appendUriEncoded(*queryParams[i].second, canon);
+    }
+    canon += '\n';
+
+    itl->canonicalizeHeaders(request.headers);
+    string & signedHeaders = itl->signedHeaders;
+    signedHeaders.clear();
+    for (auto & h: itl->headers) {
+        canon += h.first;
+        canon += ':';
+        canon += h.second;
+        canon += '\n';
+        if (!signedHeaders.empty())
+            signedHeaders += ';';
+        signedHeaders += h.first;
+    }
+    canon += '\n';
+    canon += signedHeaders;
+    canon += '\n';
+    canon += payloadHash;
+
+    string & stringToSign = itl->stringToSign;
+    stringToSign.assign("AWS4-HMAC-SHA256\n");
+    stringToSign += itl->amzDate;
+    stringToSign += '\n';
+    stringToSign += itl->scope;
+    stringToSign += '\n';
+    itl->appendHash(canon.c_str(), canon.size(), stringToSign);
+
+    string signature;
+    signature.reserve(2 * CryptoPP::SHA256::DIGESTSIZE);
+    itl->appendHmac(stringToSign, signature);
+
+    string authHeader;
+    authHeader.reserve(96 + itl->accessKeyId.size() + itl->scope.size()
+                       + signedHeaders.size());
+    authHeader += "AWS4-HMAC-SHA256 Credential=";
+    authHeader += itl->accessKeyId;
+    authHeader += '/';
+    authHeader += itl->scope;
+    authHeader += ", SignedHeaders=";
+    authHeader += signedHeaders;
+    authHeader += ", Signature=";
+    authHeader += signature;
+
+    request.headers.push_back({"Authorization", std::move(authHeader)});
+
+    return signature;
+}
+
+uint64_t
+AwsSignerV4::
+chunkedContentLength(uint64_t payloadSize, size_t chunkSize)
+{
+    if (chunkSize == 0)
+        throw ML::Exception("chunk size must not be zero");
+
+    // <hex size>;chunk-signature=<64 hex chars>\r\n<data>\r\n
+    auto framedLength = [] (uint64_t size)
+        {
+            uint64_t hexDigits = 1;
+            for (uint64_t s = size >> 4;  s;  s >>= 4)
+                ++hexDigits;
+            return hexDigits + 17 + 64 + 2 + size + 2;
+        };
+
+    uint64_t numFullChunks = payloadSize / chunkSize;
+    uint64_t lastChunkSize = payloadSize % chunkSize;
+
+    uint64_t result = numFullChunks * framedLength(chunkSize);
+    if (lastChunkSize > 0)
+        result += framedLength(lastChunkSize);
+    result += framedLength(0);
+
+    return result;
+}
+
+
+/*****************************************************************************/
+/* AWS SIGNER V4 CHUNK SIGNER                                                */
+/*****************************************************************************/
+
+AwsSignerV4::ChunkSigner::
+ChunkSigner(AwsSignerV4 * signer,
+            const std::string & seedSignature,
+            Date requestDate)
+    : signer(signer),
+      previousSignature(seedSignature),
+      amzDate(requestDate.print("%Y%m%dT%H%M%SZ"))
+{
+}
+
+void
+AwsSignerV4::ChunkSigner::
+appendChunk(const char * data, size_t size, std::string & output)
+{
+    Itl & itl = *signer->itl;
+    std::unique_lock<std::mutex> guard(itl.lock);
+
+    itl.updateKey(amzDate);
+
+    string & stringToSign = itl.stringToSign;
+    stringToSign.assign("AWS4-HMAC-SHA256-PAYLOAD\n");
+    stringToSign += amzDate;
+    stringToSign += '\n';
+    stringToSign += itl.scope;
+    stringToSign += '\n';
+    stringToSign += previousSignature;
+    stringToSign += '\n';
+    stringToSign += emptyPayloadHash;
+    stringToSign += '\n';
+    itl.appendHash(data, size, stringToSign);
+
+    previousSignature.clear();
+    itl.appendHmac(stringToSign, previousSignature);
+
+    char sizeStr[20];
+    int sizeLen = ::snprintf(sizeStr, sizeof(sizeStr), "%zx", size);
+
+    output.reserve(output.size() + sizeLen + 17 + 64 + 4 + size);
+    output.append(sizeStr, sizeLen);
+    output += ";chunk-signature=";
+    output += previousSignature;
+    output += "\r\n";
+    output.append(data, size);
+    output += "\r\n";
+}
+
+
 /*****************************************************************************/
 /* AWS BASIC API                                                             */
 /*****************************************************************************/
@@ -477,6 +873,8 @@ setService(const std::string & serviceName,
 
     proxy.init(serviceUri);
     //proxy.debug = true;
+
+    signer.init(accessKeyId, accessKey, region, serviceName);
 }
 
 void
@@ -486,6 +884,8 @@ setCredentials(const std::string & accessKeyId,
 {
     this->accessKeyId = accessKeyId;
     this->accessKey = accessKey;
+
+    signer.init(accessKeyId, accessKey, region, serviceName);
 }
 
 AwsBasicApi::BasicRequest
@@ -512,7 +912,7 @@ signPost(RestParams && params, const std::string & resource)
 
     result.payload = encodedPayload;
     
-    addSignatureV4(result, serviceName, region, accessKeyId, accessKey);
+    signer.sign(result);
 
     return result;
 
@@ -528,7 +928,7 @@ signGet(RestParams && params, const std::string & resource)
     result.headers.push_back({"Host", serviceHost});
     result.queryParams = params;
 
-    addSignatureV4(result, serviceName, region, accessKeyId, accessKey);
+    signer.sign(result);
 
     return result;
 }
@@ -7,6 +7,7 @@
 
 #pragma once
 #include <string>
+#include <memory>
 #include "http_rest_proxy.h"
 
 namespace tinyxml2 {
@@ -85,6 +86,10 @@ struct AwsApi {
     /** URI encode the given string according to RFC 3986 */
     static std::string uriEncode(const std::string & str);
 
+    /** URI encode the given string, appending it to output. */
+    static void appendUriEncoded(const std::string & str,
+                                 std::string & output);
+
     /** Helper for url-escaping of resource names */
     static std::string escapeResource(const std::string & resource);
 
@@ -121,6 +126,131 @@ struct AwsApi {
 };
 
 
+/*****************************************************************************/
+/* AWS PAYLOAD HASH                                                          */
+/*****************************************************************************/
+
+/** Incremental SHA-256 hash of a request payload, for payloads that are
+    produced or read in pieces (eg large uploads).
+*/
+
+struct AwsPayloadHash {
+    AwsPayloadHash();
+    ~AwsPayloadHash();
+
+    void update(const char * data, size_t size);
+
+    void update(const std::string & data)
+    {
+        update(data.c_str(), data.size());
+    }
+
+    /** Return the hex encoded hash of everything given to update() and
+        start again for a new payload.
+    */
+    std::string hexDigest();
+
+private:
+    struct Itl;
+    std::unique_ptr<Itl> itl;
+};
+
+
+/*****************************************************************************/
+/* AWS SIGNER V4                                                             */
+/*****************************************************************************/
+
+/** Signs requests with signature version 4 for a given set of credentials,
+    region and service.
+
+    Unlike AwsApi::addSignatureV4(), the signing key is derived once per
+    day rather than for every request, the HMAC and hash objects are reused
+    and the canonical request is built in a buffer that is kept between
+    calls.  Thread safe.
+*/
+
+struct AwsSignerV4 {
+    AwsSignerV4();
+    AwsSignerV4(const std::string & accessKeyId,
+                const std::string & accessKey,
+                const std::string & region,
+                const std::string & service);
+    ~AwsSignerV4();
+
+    void init(const std::string & accessKeyId,
+              const std::string & accessKey,
+              const std::string & region,
+              const std::string & service);
+
+    /** Payload hash to use when the payload isn't signed (S3 only). */
+    static const std::string UNSIGNED_PAYLOAD;
+
+    /** Payload hash to use when the payload is sent with the aws-chunked
+        content encoding, each chunk being signed by a ChunkSigner (S3
+        only).
+    */
+    static const std::string STREAMING_PAYLOAD;
+
+    /** Add the X-Amz-Date and Authorization headers to the request, signing
+        it along with the hash of its payload.  Returns the signature.
+    */
+    std::string sign(AwsApi::BasicRequest & request, Date now = Date::now());
+
+    /** As above, but with the given hex encoded payload hash, which can
+        come from an AwsPayloadHash or be one of UNSIGNED_PAYLOAD or
+        STREAMING_PAYLOAD.  S3 also needs the hash passed in the
+        x-amz-content-sha256 header, which is up to the caller.
+    */
+    std::string sign(AwsApi::BasicRequest & request,
+                     const std::string & payloadHash,
+                     Date now = Date::now());
+
+    /** Signs the successive chunks of an aws-chunked payload.  Each chunk
+        is signed along with the signature of the previous one, starting
+        with the signature of the request itself.
+    */
+    struct ChunkSigner {
+        ChunkSigner(AwsSignerV4 * signer,
+                    const std::string & seedSignature,
+                    Date requestDate);
+
+        /** Sign the given chunk and append it to output, framed as
+            "<hex size>;chunk-signature=<signature>\r\n<data>\r\n".  The
+            payload needs to end with an empty chunk.
+        */
+        void appendChunk(const char * data, size_t size,
+                         std::string & output);
+
+        /** Signature of the last chunk. */
+        const std::string & signature() const { return previousSignature; }
+
+    private:
+        AwsSignerV4 * signer;
+        std::string previousSignature;
+        std::string amzDate;
+    };
+
+    /** Start signing the chunks of a request that was signed with
+        STREAMING_PAYLOAD.
+    */
+    ChunkSigner chunkSigner(const std::string & seedSignature,
+                            Date requestDate)
+    {
+        return ChunkSigner(this, seedSignature, requestDate);
+    }
+
+    /** Length on the wire (the Content-Length) of an aws-chunked payload of
+        the given size, cut into chunks of chunkSize bytes.
+    */
+    static uint64_t chunkedContentLength(uint64_t payloadSize,
+                                         size_t chunkSize);
+
+private:
+    struct Itl;
+    std::unique_ptr<Itl> itl;
+};
+
+
 /*****************************************************************************/
 /* AWS BASIC API                                                             */
 /*****************************************************************************/
@@ -149,6 +279,9 @@ struct AwsBasicApi : public AwsApi {
     std::string region;
     std::string serviceUri;
 
+    /** Signer for the credentials, region and service above. */
+    AwsSignerV4 signer;
+
     std::unique_ptr<tinyxml2::XMLDocument>
     perform(const BasicRequest & request,
             double timeoutSeconds,
@@ -0,0 +1,160 @@
+/* block_pool.h                                                    -*- C++ -*-
+   Copyright (c) 2014 Datacratic.  All rights reserved.
+
+   Pool of fixed size memory blocks with per-thread caches.
+*/
+
+#pragma once
+
+#include <mutex>
+#include <vector>
+#include <new>
+#include "jml/arch/spinlock.h"
+
+
+namespace Datacratic {
+
+
+/*****************************************************************************/
+/* BLOCK POOL                                                                */
+/*****************************************************************************/
+
+/** Process-wide pool of memory blocks of BlockSize bytes.
+
+    Each thread allocates from and frees to its own cache without any
+    synchronization.  Caches exchange blocks with a shared depot in batches
+    of BatchSize, so that blocks which are allocated on one thread and
+    freed on another (the normal case for cross-thread messages) only cost
+    a spinlock acquisition every BatchSize operations.
+
+    Blocks are never returned to the system.
+*/
+
+template<size_t BlockSize, size_t BatchSize = 64>
+struct BlockPool {
+
+    static void * allocate()
+    {
+        Cache & cache = threadCache();
+        if (!cache.head)
+            cache.refill();
+        Block * block = cache.head;
+        cache.head = block->next;
+        --cache.size;
+        return block;
+    }
+
+    static void deallocate(void * mem)
+    {
+        if (!mem)
+            return;
+        Cache & cache = threadCache();
+        Block * block = reinterpret_cast<Block *>(mem);
+        block->next = cache.head;
+        cache.head = block;
+        if (++cache.size >= 2 * BatchSize)
+            cache.release(BatchSize);
+    }
+
+private:
+    union Block {
+        Block * next;
+        char data[BlockSize < sizeof(void *) ? sizeof(void *) : BlockSize];
+        long double align;
+    };
+
+    /** A chain of free blocks. */
+    struct Batch {
+        Block * head;
+        size_t size;
+    };
+
+    /** Shared store of batches of free blocks. */
+    struct Depot {
+        ML::Spinlock lock;
+        std::vector<Batch> batches;
+
+        void put(Batch batch)
+        {
+            std::lock_guard<ML::Spinlock> guard(lock);
+            batches.push_back(batch);
+        }
+
+        bool get(Batch & batch)
+        {
+            std::lock_guard<ML::Spinlock> guard(lock);
+            if (batches.empty())
+                return false;
+            batch = batches.back();
+            batches.pop_back();
+            return true;
+        }
+    };
+
+    /** Deliberately leaked, so that threads which exit after static
+        destruction has started can still hand their blocks back.
+    */
+    static Depot & depot()
+    {
+        static Depot * result = new Depot();
+        return *result;
+    }
+
+    struct Cache {
+        Cache()
+            : head(nullptr), size(0)
+        {
+        }
+
+        ~Cache()
+        {
+            if (size)
+                release(size);
+        }
+
+        Block * head;
+        size_t size;
+
+        void refill()
+        {
+            Batch batch;
+            if (depot().get(batch)) {
+                head = batch.head;
+                size = batch.size;
+                return;
+            }
+
+            for (size_t i = 0;  i < BatchSize;  ++i) {
+                Block * block = new Block;
+                block->next = head;
+                head = block;
+            }
+            size = BatchSize;
+        }
+
+        /** Give the given number of blocks from the cache to the depot. */
+        void release(size_t numBlocks)
+        {
+            Batch batch;
+            batch.head = head;
+            batch.size = numBlocks;
+
+            Block * last = head;
+            for (size_t i = 1;  i < numBlocks;  ++i)
+                last = last->next;
+            head = last->next;
+            last->next = nullptr;
+            size -= numBlocks;
+
+            depot().put(batch);
+        }
+    };
+
+    static Cache & threadCache()
+    {
+        static thread_local Cache cache;
+        return cache;
+    }
+};
+
+} // namespace Datacratic
@@ -10,6 +10,7 @@
 #include "jml/arch/backtrace.h"
 #include "jml/utils/guard.h"
 #include "soa/service//endpoint.h"
+#include "soa/service/cpu_accounting.h"
 
 
 using namespace std;
@@ -26,6 +27,15 @@ namespace Datacratic {
 uint32_t ConnectionHandler::created = 0;
 uint32_t ConnectionHandler::destroyed = 0;
 
+CpuAccount *
+ConnectionHandler::
+cpuAccount()
+{
+    if (!cpuAccount_)
+        cpuAccount_ = CpuAccounting::forHandler(typeid(*this));
+    return cpuAccount_;
+}
+
 void
 ConnectionHandler::
 handleInput()
@@ -171,7 +181,10 @@ handleInput()
 
     size_t chunk_size = 8192;
 
-    string buf;
+    // Receive into the connection's buffer to avoid allocating on every
+    // read; it keeps whatever capacity it grew to for the next one.
+    string & buf = transport().receiveBuffer();
+    buf.clear();
     size_t done = 0;
 
     ssize_t bytes_read = 0;
@@ -206,6 +219,7 @@ handleInput()
             if (errno == EINTR) continue; // interrupted
             if (errno == EAGAIN || errno == EWOULDBLOCK) break; // no data
 
+            buf.resize(done);
             if (done) handleData(buf);
             doError("read on " + get_endpoint()->name() + ": " + string(strerror(errno)));
             return;
@@ -229,6 +243,11 @@ handleInput()
         throw;
     }
 
+    // Don't let a single burst of data pin a large buffer to an otherwise
+    // idle connection.
+    if (buf.capacity() > 16 * chunk_size)
+        string().swap(buf);
+
     if (disconnected) {
         handleDisconnect();
     }
@@ -290,7 +309,7 @@ handleOutput()
     if (done == len) {
         //cerr << "SEND FINISHED " << str << endl;
 
-        WriteEntry entry = toWrite.front();
+        WriteEntry entry = std::move(toWrite.front());
         if (entry.onWriteFinished)
             entry.onWriteFinished();
 
@@ -300,20 +319,27 @@ handleOutput()
         if (toWrite.empty())
             stopWriting();
 
-        if (entry.next == NEXT_CONTINUE)
-            return;
+        doNextAction(entry.next);
+    }
+}
 
-        if (!toWrite.empty())
-            throw Exception("CLOSE or RECYCLE with data to write");
+void
+PassiveConnectionHandler::
+doNextAction(NextAction next)
+{
+    if (next == NEXT_CONTINUE)
+        return;
 
-        if (entry.next == NEXT_CLOSE) {
-            closeWhenHandlerFinished();
-        }
-        else if (entry.next == NEXT_RECYCLE) {
-            recycleWhenHandlerFinished();
-        }
-        else throw Exception("invalid next action");
+    if (!toWrite.empty())
+        throw Exception("CLOSE or RECYCLE with data to write");
+
+    if (next == NEXT_CLOSE) {
+        closeWhenHandlerFinished();
     }
+    else if (next == NEXT_RECYCLE) {
+        recycleWhenHandlerFinished();
+    }
+    else throw Exception("invalid next action");
 }
 
 void
@@ -330,19 +356,74 @@ send(const std::string & str,
         return;
     }
 
+    send(str.c_str(), str.length(), next, std::move(onWriteFinished));
+}
+
+void
+PassiveConnectionHandler::
+send(const char * data, size_t size,
+     NextAction next,
+     OnWriteFinished onWriteFinished)
+{
+    // If we're not in the right thread, then set the send up to be
+    // asynchronous.
+    if (!transport().lockedByThisThread()) {
+        std::string str(data, size);
+        doAsync([=] () { this->send(str, next, onWriteFinished); },
+                "deferredSend");
+        return;
+    }
+
     //cerr << "message being sent<" << str << "> on handle" << transport().getHandle() <<  endl;
     transport().assertLockedByThisThread();
 
+    bool triedWrite = false;
+
+    // Nothing is queued: try to write it all straight away, which avoids
+    // copying the data and enabling then disabling write events.
+    if (toWrite.empty() && !inSend) {
+        if (transport().getHandle() == -1) {
+            doError("send: connection closed by peer");
+            return;
+        }
+
+        ssize_t written
+            = ConnectionHandler::
+            send(data, size, MSG_NOSIGNAL | MSG_DONTWAIT);
+
+        if (written == -1) {
+            if (errno != EWOULDBLOCK && errno != EAGAIN) {
+                doError("writing: " + string(strerror(errno)));
+                return;
+            }
+            written = 0;
+        }
+
+        if ((size_t)written == size) {
+            inSend = true;
+            Call_Guard clearInSend([&] () { inSend = false; });
+            if (onWriteFinished)
+                onWriteFinished();
+            doNextAction(next);
+            return;
+        }
+
+        // Queue up the rest for when the socket is writable again
+        data += written;
+        size -= written;
+        triedWrite = true;
+    }
+
     WriteEntry entry;
     entry.date = Date::now();
-    entry.data = str;
+    entry.data.assign(data, size);
     entry.next = next;
-    entry.onWriteFinished = onWriteFinished;
+    entry.onWriteFinished = std::move(onWriteFinished);
 
     //if (str.find("POST") != 0)
     //    cerr << "SEND " << str << endl;
 
-    toWrite.push_back(entry);
+    toWrite.push_back(std::move(entry));
 
     if (toWrite.size() == 1) {
         done = 0;
@@ -356,7 +437,7 @@ send(const std::string & str,
     }
 
     // Don't allow nested invocations of handle_output
-    if (inSend) return;
+    if (inSend || triedWrite) return;
 
     inSend = true;
     Call_Guard clearInSend([&] () { inSend = false; });
@@ -17,6 +17,8 @@
 
 namespace Datacratic {
 
+struct CpuAccount;
+
 
 /*****************************************************************************/
 /* CONNECTION HANDLER                                                        */
@@ -27,7 +29,7 @@ struct ConnectionHandler {
     static uint32_t created, destroyed;
 
     ConnectionHandler()
-        : transport_(0), magic(0x1234)
+        : transport_(0), magic(0x1234), cpuAccount_(0)
     {
         ML::atomic_add(created, 1);
     }
@@ -203,13 +205,18 @@ struct ConnectionHandler {
 
     void checkMagic() const;
 
+    /** Account charged with the time spent by the transport handling the
+        events of the handlers of this type.
+    */
+    CpuAccount * cpuAccount();
+
     /** Run the given function from a worker thread in the context of this
-        handler.
+        handler.  The name needs to have static storage.
     */
-    void doAsync(const std::function<void ()> & callback,
-                 const char * name)
+    template<typename Fn>
+    void doAsync(Fn && callback, const char * name)
     {
-        transport().doAsync(callback, name);
+        transport().doAsync(std::forward<Fn>(callback), name);
     }
 
 private:
@@ -224,6 +231,9 @@ private:
     }
 
     int magic;
+
+    /** Looked up on the first event */
+    CpuAccount * cpuAccount_;
 };
 
 
@@ -267,6 +277,15 @@ struct PassiveConnectionHandler: public ConnectionHandler {
     void send(const std::string & str,
               NextAction action = NEXT_CONTINUE,
               OnWriteFinished onWriteFinished = OnWriteFinished());
+
+    /** Send some data that doesn't live in a string.  If nothing else is
+        waiting to be written and we are in the handler's thread, the data
+        is written straight to the socket and only whatever couldn't be
+        written is copied; the data doesn't need to outlive the call.
+    */
+    void send(const char * data, size_t size,
+              NextAction action,
+              OnWriteFinished onWriteFinished = OnWriteFinished());
     
     /** Function called out to when we got some data */
     virtual void handleData(const std::string & data) = 0;
@@ -285,6 +304,10 @@ struct PassiveConnectionHandler: public ConnectionHandler {
     virtual void handleTimeout(Date time, size_t cookie);
 
     friend class TransportBase;
+
+private:
+    /** Perform the action that goes with a write that has completed. */
+    void doNextAction(NextAction next);
 };
 
 } // namespace Datacratic
@@ -0,0 +1,543 @@
+/* cpu_accounting.cc
+   Copyright (c) 2014 Datacratic.  All rights reserved.
+
+   Accounting of the time spent by event sources and connection handlers.
+*/
+
+#include <errno.h>
+#include <execinfo.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "jml/arch/demangle.h"
+#include "jml/arch/exception.h"
+
+#include "cpu_accounting.h"
+
+using namespace std;
+using namespace Datacratic;
+
+
+namespace {
+
+inline uint64_t
+clockNs(clockid_t clock)
+{
+    struct timespec ts;
+    ::clock_gettime(clock, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+inline uint64_t
+wallTicks()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return clockNs(CLOCK_MONOTONIC);
+#endif
+}
+
+/* Innermost scope of the thread.  The initial-exec model keeps it in the
+   static TLS block, so that the profiler's signal handler can read it
+   without risking an allocation. */
+__thread CpuAccountingScope * currentScope
+    __attribute__((tls_model("initial-exec"))) = nullptr;
+
+/* Invocations of the thread since its last CPU and elapsed time
+   measurements */
+__thread unsigned cpuSampleTick
+    __attribute__((tls_model("initial-exec"))) = 0;
+__thread unsigned wallSampleTick
+    __attribute__((tls_model("initial-exec"))) = 0;
+
+struct Registry {
+    std::mutex lock;
+    std::map<pair<string, string>, std::unique_ptr<CpuAccount> > accounts;
+};
+
+Registry &
+registry()
+{
+    /* leaked, so that accounts outlive any static that caches them */
+    static Registry * result = new Registry();
+    return *result;
+}
+
+
+/* Stacks recorded by the profiler.  Slots are claimed with a CAS on their
+   id by the signal handler and are only cleared when no profile runs. */
+
+enum {
+    MAX_FRAMES = 32,
+    SKIPPED_FRAMES = 2,     ///< the handler and the signal trampoline
+    NUM_STACK_SLOTS = 4096,
+    MAX_PROBES = 32
+};
+
+struct StackSlot {
+    std::atomic<uint64_t> id;
+    std::atomic<uint64_t> samples;
+    std::atomic<bool> ready;
+    CpuAccount * account;
+    int numFrames;
+    void * frames[MAX_FRAMES];
+};
+
+StackSlot stackSlots[NUM_STACK_SLOTS];
+std::atomic<uint64_t> droppedSamples(0);
+std::atomic<uint64_t> unaccountedSamples(0);
+
+std::mutex profilingLock;
+bool profilingOn(false);
+struct sigaction previousAction;
+
+void
+onProfilingSignal(int signum, siginfo_t * info, void * context)
+{
+    CpuAccountingScope * scope = currentScope;
+    if (!scope) {
+        unaccountedSamples.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    int savedErrno = errno;
+
+    CpuAccount * account = scope->account();
+    account->profileSamples.fetch_add(1, std::memory_order_relaxed);
+
+    void * frames[MAX_FRAMES];
+    int numFrames = ::backtrace(frames, MAX_FRAMES);
+
+    /* FNV-1a of the account and the return addresses */
+    uint64_t id = 14695981039346656037ULL;
+    auto hash = [&] (uint64_t value)
+        {
+            id = (id ^ value) * 1099511628211ULL;
+        };
+    hash((uint64_t)account);
+    for (int i = SKIPPED_FRAMES;  i < numFrames;  ++i)
+        hash((uint64_t)frames[i]);
+    id |= 1;  // 0 marks a free slot
+
+    for (unsigned i = 0;  i < MAX_PROBES;  ++i) {
+        StackSlot & slot = stackSlots[(id + i) % NUM_STACK_SLOTS];
+        uint64_t slotId = slot.id.load(std::memory_order_acquire);
+        if (slotId == 0) {
+            if (slot.id.compare_exchange_strong(slotId, id)) {
+                slot.account = account;
+                slot.numFrames = 0;
+                for (int j = SKIPPED_FRAMES;  j < numFrames;  ++j)
+                    slot.frames[slot.numFrames++] = frames[j];
+                slot.ready.store(true, std::memory_order_release);
+                slot.samples.fetch_add(1, std::memory_order_relaxed);
+                errno = savedErrno;
+                return;
+            }
+        }
+        if (slotId == id) {
+            slot.samples.fetch_add(1, std::memory_order_relaxed);
+            errno = savedErrno;
+            return;
+        }
+    }
+
+    droppedSamples.fetch_add(1, std::memory_order_relaxed);
+    errno = savedErrno;
+}
+
+} // file scope
+
+
+/*****************************************************************************/
+/* CPU ACCOUNT                                                               */
+/*****************************************************************************/
+
+CpuAccount::
+CpuAccount(const std::string & category, const std::string & name)
+    : category(category), name(name),
+      invocations(0), wallSamples(0), wallTicks(0), maxWallTicks(0),
+      cpuSamples(0),
+      cpuNs(0), profileSamples(0)
+{
+}
+
+void
+CpuAccount::
+record(bool hasWall, uint64_t wall, bool hasCpu, uint64_t cpu)
+{
+    invocations.fetch_add(1, std::memory_order_relaxed);
+
+    if (hasWall) {
+        wallSamples.fetch_add(1, std::memory_order_relaxed);
+        wallTicks.fetch_add(wall, std::memory_order_relaxed);
+
+        uint64_t max = maxWallTicks.load(std::memory_order_relaxed);
+        while (wall > max
+               && !maxWallTicks.compare_exchange_weak
+                   (max, wall, std::memory_order_relaxed))
+            ;
+    }
+
+    if (hasCpu) {
+        cpuSamples.fetch_add(1, std::memory_order_relaxed);
+        cpuNs.fetch_add(cpu, std::memory_order_relaxed);
+    }
+}
+
+double
+CpuAccount::
+wallSeconds()
+    const
+{
+    uint64_t samples = wallSamples.load(std::memory_order_relaxed);
+    if (samples == 0)
+        return 0.0;
+    return (wallTicks.load(std::memory_order_relaxed)
+            * CpuAccounting::secondsPerWallTick()
+            * invocations.load(std::memory_order_relaxed) / samples);
+}
+
+double
+CpuAccount::
+maxLatency()
+    const
+{
+    return maxWallTicks.load(std::memory_order_relaxed)
+        * CpuAccounting::secondsPerWallTick();
+}
+
+double
+CpuAccount::
+estimatedCpuSeconds()
+    const
+{
+    uint64_t samples = cpuSamples.load(std::memory_order_relaxed);
+    if (samples == 0)
+        return 0.0;
+    return (cpuNs.load(std::memory_order_relaxed) * 1e-9
+            * invocations.load(std::memory_order_relaxed) / samples);
+}
+
+Json::Value
+CpuAccount::
+toJson() const
+{
+    Json::Value result;
+    result["invocations"] = (Json::UInt)invocations.load();
+    result["wallSeconds"] = wallSeconds();
+    result["wallSamples"] = (Json::UInt)wallSamples.load();
+    result["maxLatency"] = maxLatency();
+    result["cpuSeconds"] = estimatedCpuSeconds();
+    result["cpuSamples"] = (Json::UInt)cpuSamples.load();
+    result["profileSamples"] = (Json::UInt)profileSamples.load();
+    return result;
+}
+
+void
+CpuAccount::
+reset()
+{
+    invocations = 0;
+    wallSamples = 0;
+    wallTicks = 0;
+    maxWallTicks = 0;
+    cpuSamples = 0;
+    cpuNs = 0;
+    profileSamples = 0;
+}
+
+
+/*****************************************************************************/
+/* CPU ACCOUNTING                                                            */
+/*****************************************************************************/
+
+std::atomic<bool> CpuAccounting::enabled(true);
+std::atomic<unsigned> CpuAccounting::cpuSamplePeriod(256);
+std::atomic<unsigned> CpuAccounting::wallSamplePeriod(16);
+
+CpuAccount *
+CpuAccounting::
+forSource(const std::string & name)
+{
+    return get("sources", name);
+}
+
+CpuAccount *
+CpuAccounting::
+forHandler(const std::type_info & type)
+{
+    return get("handlers", ML::demangle(type.name()));
+}
+
+CpuAccount *
+CpuAccounting::
+get(const std::string & category, const std::string & name)
+{
+    Registry & reg = registry();
+    std::unique_lock<std::mutex> guard(reg.lock);
+    auto & entry = reg.accounts[make_pair(category, name)];
+    if (!entry)
+        entry.reset(new CpuAccount(category, name));
+    return entry.get();
+}
+
+Json::Value
+CpuAccounting::
+toJson()
+{
+    Registry & reg = registry();
+    std::unique_lock<std::mutex> guard(reg.lock);
+
+    Json::Value result(Json::objectValue);
+    for (const auto & entry: reg.accounts) {
+        const CpuAccount & account = *entry.second;
+        result[account.category][account.name] = account.toJson();
+    }
+    return result;
+}
+
+void
+CpuAccounting::
+reset()
+{
+    Registry & reg = registry();
+    std::unique_lock<std::mutex> guard(reg.lock);
+    for (auto & entry: reg.accounts)
+        entry.second->reset();
+}
+
+void
+CpuAccounting::
+startProfiling(int hz)
+{
+    if (hz <= 0 || hz > 10000)
+        throw ML::Exception("invalid profiling frequency %d", hz);
+
+    std::unique_lock<std::mutex> guard(profilingLock);
+    if (profilingOn)
+        throw ML::Exception("profiling is already started");
+
+    /* backtrace() allocates on its first call, which it can't do from the
+       signal handler */
+    void * frames[MAX_FRAMES];
+    ::backtrace(frames, MAX_FRAMES);
+
+    for (StackSlot & slot: stackSlots) {
+        slot.ready = false;
+        slot.samples = 0;
+        slot.id = 0;
+    }
+    droppedSamples = 0;
+    unaccountedSamples = 0;
+
+    struct sigaction action;
+    ::memset(&action, 0, sizeof(action));
+    action.sa_sigaction = onProfilingSignal;
+    action.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if (::sigaction(SIGPROF, &action, &previousAction) == -1)
+        throw ML::Exception(errno, "sigaction(SIGPROF)");
+
+    struct itimerval timer;
+    timer.it_interval.tv_sec = 0;
+    timer.it_interval.tv_usec = 1000000 / hz;
+    timer.it_value = timer.it_interval;
+    if (::setitimer(ITIMER_PROF, &timer, nullptr) == -1) {
+        int err = errno;
+        ::sigaction(SIGPROF, &previousAction, nullptr);
+        throw ML::Exception(err, "setitimer(ITIMER_PROF)");
+    }
+
+    profilingOn = true;
+}
+
+void
+CpuAccounting::
+stopProfiling()
+{
+    std::unique_lock<std::mutex> guard(profilingLock);
+    if (!profilingOn)
+        return;
+
+    struct itimerval timer;
+    ::memset(&timer, 0, sizeof(timer));
+    ::setitimer(ITIMER_PROF, &timer, nullptr);
+
+    /* a signal that is already pending is discarded by SIG_IGN, rather
+       than killing the process with the default action */
+    struct sigaction action;
+    ::memset(&action, 0, sizeof(action));
+    action.sa_handler = SIG_IGN;
+    ::sigaction(SIGPROF, &action, nullptr);
+
+    profilingOn = false;
+}
+
+bool
+CpuAccounting::
+profiling()
+{
+    std::unique_lock<std::mutex> guard(profilingLock);
+    return profilingOn;
+}
+
+Json::Value
+CpuAccounting::
+stacksToJson(int maxStacks)
+{
+    vector<const StackSlot *> slots;
+    for (const StackSlot & slot: stackSlots) {
+        if (slot.ready.load(std::memory_order_acquire))
+            slots.push_back(&slot);
+    }
+
+    auto compareSamples = [] (const StackSlot * s1, const StackSlot * s2)
+        {
+            return s1->samples.load() > s2->samples.load();
+        };
+    std::sort(slots.begin(), slots.end(), compareSamples);
+    if (slots.size() > (size_t)maxStacks)
+        slots.resize(maxStacks);
+
+    Json::Value result(Json::objectValue);
+    result["droppedSamples"] = (Json::UInt)droppedSamples.load();
+    result["unaccountedSamples"] = (Json::UInt)unaccountedSamples.load();
+
+    Json::Value & stacks = result["stacks"];
+    stacks = Json::Value(Json::arrayValue);
+    for (const StackSlot * slot: slots) {
+        char id[32];
+        ::snprintf(id, sizeof(id), "%016llx", (unsigned long long)slot->id);
+
+        Json::Value stack;
+        stack["id"] = id;
+        stack["samples"] = (Json::UInt)slot->samples.load();
+        stack["account"] = slot->account->category + "/" + slot->account->name;
+
+        Json::Value & frames = stack["frames"];
+        frames = Json::Value(Json::arrayValue);
+        char ** symbols = ::backtrace_symbols(slot->frames, slot->numFrames);
+        for (int i = 0;  i < slot->numFrames;  ++i) {
+            if (symbols)
+                frames.append(symbols[i]);
+            else {
+                char address[32];
+                ::snprintf(address, sizeof(address), "%p", slot->frames[i]);
+                frames.append(address);
+            }
+        }
+        ::free(symbols);
+
+        stacks.append(stack);
+    }
+
+    return result;
+}
+
+
+double
+CpuAccounting::
+secondsPerWallTick()
+{
+    static const double result = [] ()
+        {
+#if defined(__x86_64__) || defined(__i386__)
+            /* Calibrated against CLOCK_MONOTONIC over 10ms the first time
+               the accounts are read */
+            uint64_t ns0 = clockNs(CLOCK_MONOTONIC);
+            uint64_t ticks0 = wallTicks();
+            uint64_t ns1;
+            do {
+                ns1 = clockNs(CLOCK_MONOTONIC);
+            } while (ns1 - ns0 < 10000000);
+            uint64_t ticks1 = wallTicks();
+            return (ns1 - ns0) * 1e-9 / (ticks1 - ticks0);
+#else
+            return 1e-9;
+#endif
+        } ();
+
+    return result;
+}
+
+
+/*****************************************************************************/
+/* CPU ACCOUNTING SCOPE                                                      */
+/*****************************************************************************/
+
+CpuAccountingScope::
+CpuAccountingScope(CpuAccount * account)
+    : account_(nullptr)
+{
+    if (!account || !CpuAccounting::enabled.load(std::memory_order_relaxed))
+        return;
+
+    account_ = account;
+    parent_ = currentScope;
+    childWall_ = 0;
+    childCpu_ = 0;
+
+    /* Nested scopes follow the outer one, so that their times can be
+       taken out of it */
+    if (parent_) {
+        sampleWall_ = parent_->sampleWall_;
+        sampleCpu_ = parent_->sampleCpu_;
+    }
+    else {
+        unsigned wallPeriod
+            = CpuAccounting::wallSamplePeriod.load(std::memory_order_relaxed);
+        sampleWall_ = wallPeriod <= 1 || ++wallSampleTick >= wallPeriod;
+        if (sampleWall_)
+            wallSampleTick = 0;
+
+        unsigned period
+            = CpuAccounting::cpuSamplePeriod.load(std::memory_order_relaxed);
+        sampleCpu_ = period != 0 && ++cpuSampleTick >= period;
+        if (sampleCpu_)
+            cpuSampleTick = 0;
+    }
+
+    currentScope = this;
+    if (sampleCpu_)
+        cpuStart_ = clockNs(CLOCK_THREAD_CPUTIME_ID);
+    if (sampleWall_)
+        wallStart_ = wallTicks();
+}
+
+CpuAccountingScope::
+~CpuAccountingScope()
+{
+    if (!account_)
+        return;
+
+    uint64_t wall = 0;
+    if (sampleWall_)
+        wall = wallTicks() - wallStart_;
+    uint64_t cpu = 0;
+    if (sampleCpu_)
+        cpu = clockNs(CLOCK_THREAD_CPUTIME_ID) - cpuStart_;
+
+    account_->record(sampleWall_,
+                     wall > childWall_ ? wall - childWall_ : 0,
+                     sampleCpu_,
+                     cpu > childCpu_ ? cpu - childCpu_ : 0);
+
+    if (parent_) {
+        parent_->childWall_ += wall;
+        parent_->childCpu_ += cpu;
+    }
+    currentScope = parent_;
+}
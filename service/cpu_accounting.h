@@ -0,0 +1,172 @@
+/* cpu_accounting.h                                                -*- C++ -*-
+   Copyright (c) 2014 Datacratic.  All rights reserved.
+
+   Always-on accounting of the time spent by the sources of the message
+   loops and by the connection handlers of the endpoints, and an optional
+   sampling profiler that attributes stacks to them.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <string>
+#include <typeinfo>
+
+#include "soa/jsoncpp/value.h"
+
+
+namespace Datacratic {
+
+
+/*****************************************************************************/
+/* CPU ACCOUNT                                                               */
+/*****************************************************************************/
+
+/** Counters of one event source or one type of connection handler.
+
+    They are updated with relaxed atomic operations from whatever thread
+    runs the code being accounted for.  Accounts are never destroyed, so
+    that pointers to them can be cached by their users.
+*/
+
+struct CpuAccount {
+    CpuAccount(const std::string & category, const std::string & name);
+
+    const std::string category;
+    const std::string name;
+
+    std::atomic<uint64_t> invocations;
+    std::atomic<uint64_t> wallSamples;  ///< invocations with an elapsed time
+    std::atomic<uint64_t> wallTicks;    ///< elapsed time of those invocations
+    std::atomic<uint64_t> maxWallTicks; ///< longest of those invocations
+    std::atomic<uint64_t> cpuSamples;   ///< invocations with a cpu time
+    std::atomic<uint64_t> cpuNs;        ///< cpu time of those invocations
+    std::atomic<uint64_t> profileSamples; ///< profiler ticks while running
+
+    void record(bool hasWall, uint64_t wallTicks, bool hasCpu, uint64_t cpuNs);
+
+    /** Elapsed time of all the invocations, extrapolated from those which
+        were measured.
+    */
+    double wallSeconds() const;
+
+    /** Longest of the invocations which were measured. */
+    double maxLatency() const;
+
+    /** CPU time of all the invocations, extrapolated from those which were
+        measured.
+    */
+    double estimatedCpuSeconds() const;
+
+    Json::Value toJson() const;
+
+    void reset();
+};
+
+
+/*****************************************************************************/
+/* CPU ACCOUNTING                                                            */
+/*****************************************************************************/
+
+/** Registry of the accounts and settings of the accounting.
+
+    Every invocation is counted.  The elapsed time is measured with the
+    time stamp counter, which is converted to seconds when the accounts are
+    read (or with CLOCK_MONOTONIC on other architectures), once every
+    wallSamplePeriod invocations of each thread, as reading the counter
+    costs more than the rest of a scope on some machines.  The CPU time,
+    which costs a system call to read, is measured with
+    CLOCK_THREAD_CPUTIME_ID once every cpuSamplePeriod invocations of each
+    thread.
+*/
+
+struct CpuAccounting {
+    /** Account of the event sources added to message loops under the given
+        name.
+    */
+    static CpuAccount * forSource(const std::string & name);
+
+    /** Account of the connection handlers of the given type. */
+    static CpuAccount * forHandler(const std::type_info & type);
+
+    static CpuAccount * get(const std::string & category,
+                            const std::string & name);
+
+    /** Accounts by category and name:
+        { "sources": { name: { ... } }, "handlers": { ... } }
+    */
+    static Json::Value toJson();
+
+    /** Zero all of the accounts. */
+    static void reset();
+
+    /** Turns the accounting on and off globally.  It is on by default. */
+    static std::atomic<bool> enabled;
+
+    /** Invocations per thread between two measurements of the CPU time; 0
+        disables the measurements.  Defaults to 256.
+    */
+    static std::atomic<unsigned> cpuSamplePeriod;
+
+    /** Invocations per thread between two measurements of the elapsed
+        time; 0 or 1 measures every invocation.  Defaults to 16.
+    */
+    static std::atomic<unsigned> wallSamplePeriod;
+
+    /** Start the sampling profiler, which records the stack and the account
+        being run by the thread that is interrupted every 1/hz seconds of
+        CPU time of the process (SIGPROF).  Stacks recorded by a previous
+        profile are cleared.
+    */
+    static void startProfiling(int hz = 99);
+
+    static void stopProfiling();
+
+    static bool profiling();
+
+    /** Stacks recorded by the profiler, most sampled first:
+        [ { "id": "...", "samples": n, "account": "sources/name",
+            "frames": [ ... ] } ]
+        The id of a stack is stable for the life of the process.
+    */
+    static Json::Value stacksToJson(int maxStacks = 50);
+
+    /** Seconds per tick of the clock of the elapsed times */
+    static double secondsPerWallTick();
+};
+
+
+/*****************************************************************************/
+/* CPU ACCOUNTING SCOPE                                                      */
+/*****************************************************************************/
+
+/** Charges the time spent until its destruction to an account.  Scopes
+    can be nested; the time of a nested scope is only charged to the inner
+    account.  A null account is not charged.
+*/
+
+struct CpuAccountingScope {
+    CpuAccountingScope(CpuAccount * account);
+    ~CpuAccountingScope();
+
+    CpuAccountingScope(const CpuAccountingScope &) = delete;
+    void operator = (const CpuAccountingScope &) = delete;
+
+    CpuAccount * account() const
+    {
+        return account_;
+    }
+
+private:
+    CpuAccount * account_;
+    CpuAccountingScope * parent_;
+    bool sampleWall_;
+    bool sampleCpu_;
+    uint64_t wallStart_;
+    uint64_t cpuStart_;
+    uint64_t childWall_;
+    uint64_t childCpu_;
+};
+
+} // namespace Datacratic
@@ -0,0 +1,83 @@
+/* cpu_accounting_monitor.h                                        -*- C++ -*-
+   Copyright (c) 2014 Datacratic.  All rights reserved.
+
+   Http interface to the CPU accounting and to its profiler:
+
+       GET /cpu               accounts of the sources and the handlers
+       POST /cpu/reset        zero the accounts
+       GET /cpu/stacks        stacks recorded by the profiler
+       POST /cpu/profile      start the profiler; { "hz": 99 }
+       DELETE /cpu/profile    stop the profiler
+
+   CpuAccountingMonitor monitor("cpu");
+   monitor.start(port);
+*/
+
+#pragma once
+
+#include "soa/jsoncpp/json.h"
+#include "soa/service/http_monitor.h"
+#include "soa/service/cpu_accounting.h"
+
+
+namespace Datacratic {
+
+
+/******************************************************************************/
+/* CPU ACCOUNTING HANDLER                                                     */
+/******************************************************************************/
+
+struct CpuAccountingHandler
+    : public HttpMonitorHandler<CpuAccountingHandler>
+{
+    CpuAccountingHandler(const std::string & name, void * arg)
+        : HttpMonitorHandler<CpuAccountingHandler>(name, arg)
+    {
+    }
+
+    virtual void doGet(const std::string & resource)
+    {
+        if (resource == "/cpu") {
+            Json::Value response = CpuAccounting::toJson();
+            response["profiling"] = CpuAccounting::profiling();
+            sendResponse(response);
+        }
+        else if (resource == "/cpu/stacks")
+            sendResponse(CpuAccounting::stacksToJson());
+        else sendErrorResponse(404, "unknown resource " + resource);
+    }
+
+    virtual void doPost(const std::string & resource,
+                        const std::string & payload)
+    {
+        if (resource == "/cpu/reset") {
+            CpuAccounting::reset();
+            sendResponse(Json::Value("ok"));
+        }
+        else if (resource == "/cpu/profile") {
+            int hz = 99;
+            if (!payload.empty()) {
+                Json::Value params = Json::parse(payload);
+                if (params.isMember("hz"))
+                    hz = params["hz"].asInt();
+            }
+            CpuAccounting::startProfiling(hz);
+            sendResponse(Json::Value("ok"));
+        }
+        else sendErrorResponse(404, "unknown resource " + resource);
+    }
+
+    virtual void doDelete(const std::string & resource,
+                          const std::string & payload)
+    {
+        if (resource == "/cpu/profile") {
+            CpuAccounting::stopProfiling();
+            sendResponse(Json::Value("ok"));
+        }
+        else sendErrorResponse(404, "unknown resource " + resource);
+    }
+};
+
+typedef HttpMonitor<CpuAccountingHandler> CpuAccountingMonitor;
+
+} // namespace Datacratic
@@ -4,7 +4,7 @@
 
 */
 
-#include <sys/timerfd.h>
+#include <sys/eventfd.h>
 
 #include "soa/service//endpoint.h"
 
@@ -22,6 +22,7 @@
 #include "jml/utils/vector_utils.h"
 #include "jml/utils/smart_ptr_utils.h"
 #include "jml/utils/exc_assert.h"
+#include "jml/utils/environment.h"
 #include "jml/arch/rt.h"
 #include <sys/prctl.h>
 #include <sys/epoll.h>
@@ -34,6 +35,9 @@ using namespace ML;
 
 namespace Datacratic {
 
+ML::Env_Option<bool> DIRECT_TRANSPORTS("DIRECT_TRANSPORTS", false);
+
+
 /*****************************************************************************/
 /* ENDPOINT BASE                                                             */
 /*****************************************************************************/
@@ -43,8 +47,10 @@ EndpointBase(const std::string & name)
     : idle(1), modifyIdle(true),
       name_(name),
       threadsActive_(0),
-      numTransports(0), shutdown_(false), disallowTimers_(false),
-      pollingMode_(MIN_CONTEXT_SWITCH_POLLING)
+      numTransports(0), shutdown_(false),
+      pollingMode_(MIN_CONTEXT_SWITCH_POLLING),
+      directTransports_(false),
+      transportAsyncFd_(-1)
 {
     Epoller::init(16384);
     auto wakeupData = make_shared<EpollData>(EpollData::EpollDataType::WAKEUP,
@@ -54,12 +60,45 @@ EndpointBase(const std::string & name)
     Epoller::handleEvent = [&] (epoll_event & event) {
         return this->handleEpollEvent(event);
     };
+
+    auto timersData = make_shared<EpollData>(EpollData::EpollDataType::TIMERS,
+                                             timers_.selectFd());
+    startPolling(timersData);
+
+    if (DIRECT_TRANSPORTS)
+        setDirectTransports(true);
 }
 
 EndpointBase::
 ~EndpointBase()
 {
     shutdown();
+
+    if (transportAsyncFd_ != -1)
+        ::close(transportAsyncFd_);
+}
+
+void
+EndpointBase::
+setDirectTransports(bool direct)
+{
+    if (direct && transportAsyncFd_ == -1)
+        initDirectTransports();
+    directTransports_ = direct;
+}
+
+void
+EndpointBase::
+initDirectTransports()
+{
+    transportAsyncFd_ = eventfd(0, EFD_NONBLOCK);
+    if (transportAsyncFd_ == -1)
+        throw ML::Exception(errno, "eventfd");
+
+    auto asyncData
+        = make_shared<EpollData>(EpollData::EpollDataType::TRANSPORT_ASYNC,
+                                 transportAsyncFd_);
+    startPolling(asyncData);
 }
 
 void
@@ -79,30 +118,9 @@ addPeriodic(double timePeriodSeconds, OnTimer toRun)
     if (!toRun)
         throw ML::Exception("'toRun' cannot be nil");
 
-    int timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
-    if (timerFd == -1)
-        throw ML::Exception(errno, "timerfd_create");
-
-    itimerspec spec;
-    
-    int res = clock_gettime(CLOCK_MONOTONIC, &spec.it_value);
-    if (res == -1)
-        throw ML::Exception(errno, "clock_gettime");
-    uint64_t seconds, nanoseconds;
-    seconds = timePeriodSeconds;
-    nanoseconds = (timePeriodSeconds - seconds) * 1000000000;
-
-    spec.it_interval.tv_sec = spec.it_value.tv_sec = seconds;
-    spec.it_interval.tv_nsec = spec.it_value.tv_nsec = nanoseconds;
-
-    res = timerfd_settime(timerFd, 0, &spec, 0);
-    if (res == -1)
-        throw ML::Exception(errno, "timerfd_settime");
-
-    auto timerData = make_shared<EpollData>(EpollData::EpollDataType::TIMER,
-                                            timerFd);
-    timerData->onTimer = toRun;
-    startPolling(timerData);
+    MutexGuard guard(periodicLock);
+    periodicTimers_.push_back(timers_.schedulePeriodic(timePeriodSeconds,
+                                                       std::move(toRun)));
 }
 
 void
@@ -171,16 +189,13 @@ shutdown()
         }
     }
 
-    disallowTimers_ = true;
-    ML::memory_barrier();
     {
-        /* we remove timer infos separately, as transport infos will be
-           removed via notifyCloseTransport */
-        for (const auto & it: dataSetCopy) {
-            if (it->fdType == EpollData::EpollDataType::TIMER) {
-                stopPolling(it);
-            }
-        }
+        /* the periodic jobs stop here, but the timers stay polled until
+           the threads have exited for the timeouts of the transports */
+        MutexGuard guard(periodicLock);
+        for (auto id: periodicTimers_)
+            timers_.cancel(id);
+        periodicTimers_.clear();
     }
 
     //cerr << "eventThreads = " << eventThreads.get() << endl;
@@ -210,17 +225,6 @@ shutdown()
         ML::futex_wait(threadsActive_, oldValue);
     }
 
-    {
-        /* we can now close the timer fds as we now that they will no longer
-           be listened to */
-        MutexGuard guard(dataSetLock);
-        for (const auto & it: dataSetCopy) {
-            if (it->fdType == EpollData::EpollDataType::TIMER) {
-                ::close(it->fd);
-            }
-        }
-    }
-
     for (auto & th: eventThreads) {
         th.join();
     }
@@ -249,16 +253,19 @@ notifyNewTransport(const std::shared_ptr<TransportBase> & transport)
 
     if (transportMapping.count(transport))
         throw ML::Exception("active set already contains connection");
-    auto epollData
-        = make_shared<EpollData>(EpollData::EpollDataType::TRANSPORT,
-                                 transport->epollFd_);
-    epollData->transport = transport;
-    transportMapping.insert({transport, epollData});
 
     int fd = transport->getHandle();
     if (fd < 0)
         throw Exception("notifyNewTransport: fd %d out of range", fd);
 
+    auto epollData
+        = make_shared<EpollData>(EpollData::EpollDataType::TRANSPORT,
+                                 transport->direct_
+                                 ? fd : transport->epollFd_);
+    epollData->transport = transport;
+    transportMapping.insert({transport, epollData});
+
+    transport->pollData_ = epollData.get();
     startPolling(epollData);
 
     ML::atomic_inc(numTransports);
@@ -285,7 +292,16 @@ startPolling(const shared_ptr<EpollData> & epollData)
     auto inserted = epollDataSet.insert(epollData);
     if (!inserted.second)
         throw ML::Exception("epollData already present");
-    addFdOneShot(epollData->fd, epollData.get());
+
+    if (epollData->fdType == EpollData::EpollDataType::TRANSPORT
+        && epollData->transport->direct_) {
+        // Direct transports are polled for the events they are interested
+        // in on the socket itself
+        TransportBase & transport = *epollData->transport;
+        transport.armedEvents_ = transport.directEpollEvents();
+        addFdOneShot(epollData->fd, transport.armedEvents_, epollData.get());
+    }
+    else addFdOneShot(epollData->fd, epollData.get());
 }
 
 void
@@ -436,19 +452,23 @@ handleEpollEvent(epoll_event & event)
     case EpollData::EpollDataType::TRANSPORT: {
         shared_ptr<TransportBase> transport = epollDataPtr->transport;
         pollStart_ = Date::now();
+        if (transport->direct_) {
+            // re-armed by runDirectTransport once it's safe to do so
+            runDirectTransport(transport, event.events);
+            break;
+        }
         handleTransportEvent(transport);
         if (!transport->isZombie()) {
             this->restartPolling(epollDataPtr);
         }
         break;
     }
-    case EpollData::EpollDataType::TIMER: {
-        handleTimerEvent(epollDataPtr->fd, epollDataPtr->onTimer);
-        if (!disallowTimers_) {
-            this->restartPolling(epollDataPtr);
-        }
+    case EpollData::EpollDataType::TIMERS:
+        handleTimersEvent(epollDataPtr);
+        break;
+    case EpollData::EpollDataType::TRANSPORT_ASYNC:
+        handleTransportAsyncEvent(epollDataPtr);
         break;
-    }
     case EpollData::EpollDataType::WAKEUP:
         // wakeup for shutdown
         return Epoller::SHUTDOWN;
@@ -478,22 +498,148 @@ handleTransportEvent(const shared_ptr<TransportBase> & transport)
 
 void
 EndpointBase::
-handleTimerEvent(int fd, OnTimer toRun)
+scheduleDirectTransport(const std::shared_ptr<TransportBase> & transport)
 {
-    uint64_t numWakeups = 0;
+    bool wasEmpty;
+    {
+        MutexGuard guard(transportQueueLock);
+        wasEmpty = transportQueue_.empty();
+        transportQueue_.push_back(transport);
+    }
+
+    // Whoever drains the queue reads the event fd before taking the
+    // contents, so we only need to signal on the transition to non-empty
+    if (wasEmpty) {
+        int res = eventfd_write(transportAsyncFd_, 1);
+        if (res == -1)
+            throw ML::Exception(errno, "eventfd_write");
+    }
+}
+
+void
+EndpointBase::
+handleTransportAsyncEvent(EpollData * epollDataPtr)
+{
+    eventfd_t val;
+    int res = eventfd_read(epollDataPtr->fd, &val);
+    if (res == -1 && errno != EAGAIN)
+        throw ML::Exception(errno, "eventfd_read");
+
+    vector<shared_ptr<TransportBase> > toRun;
+    {
+        MutexGuard guard(transportQueueLock);
+        toRun.swap(transportQueue_);
+    }
+
+    // Let other threads pick up what gets queued while we run these
+    restartPolling(epollDataPtr);
+
+    for (auto & transport: toRun) {
+        transport->asyncScheduled_ = false;
+        runDirectTransport(transport, 0);
+    }
+}
+
+TimerService::TimerId
+EndpointBase::
+scheduleTransportTimer(const std::shared_ptr<TransportBase> & transport,
+                       Date when, uint64_t generation)
+{
+    std::weak_ptr<TransportBase> weakTransport = transport;
+
+    auto onTimer = [=] (uint64_t)
+        {
+            auto transport = weakTransport.lock();
+            if (!transport || transport->isZombie()
+                || transport->timerGeneration_ != generation)
+                return;  // closed, cancelled or rescheduled
+            transport->firedTimerGeneration_ = generation;
+            runDirectTransport(transport, 0);
+        };
+
+    // Timeouts can be a tick late, which keeps them in the wheel
+    return timers_.scheduleAt(when, std::move(onTimer), timers_.resolution());
+}
+
+void
+EndpointBase::
+cancelTransportTimer(TimerService::TimerId id)
+{
+    timers_.cancel(id);
+}
+
+void
+EndpointBase::
+handleTimersEvent(EpollData * epollDataPtr)
+{
+    vector<TimerService::Expired> expired;
+    timers_.takeExpired(expired);
+
+    // Let other threads pick up the timers that expire while we run these
+    restartPolling(epollDataPtr);
+
+    for (auto & timer: expired)
+        timers_.run(timer);
+}
+
+void
+EndpointBase::
+runDirectTransport(const std::shared_ptr<TransportBase> & transport,
+                   int events)
+{
+    TransportBase & t = *transport;
+
+    if (events)
+        t.pendingEvents_.fetch_or(events);
+
+    // Claim the transport.  If another thread has it, ask that thread to
+    // go around once more; it will pick up our events from pendingEvents_.
+    int state = t.dispatchState_;
     for (;;) {
-        int res = ::read(fd, &numWakeups, 8);
-        if (res == -1 && errno == EINTR) continue;
-        if (res == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
-            break;
-        if (res == -1) {
-            throw ML::Exception(errno, "timerfd read");
+        if (state == TransportBase::DISPATCH_IDLE) {
+            if (t.dispatchState_.compare_exchange_weak
+                (state, TransportBase::DISPATCH_RUNNING))
+                break;
         }
-        else if (res != 8)
-            throw ML::Exception("timerfd read: wrong number of bytes: %d",
-                                res);
-        toRun(numWakeups);
-        break;
+        else if (state == TransportBase::DISPATCH_RERUN
+                 || t.dispatchState_.compare_exchange_weak
+                       (state, TransportBase::DISPATCH_RERUN))
+            return;
+    }
+
+    // Set once an event has come in through epoll, as the socket's
+    // one-shot registration then needs to be re-armed
+    bool consumed = false;
+
+    for (;;) {
+        int toHandle = t.pendingEvents_.exchange(0);
+        if (toHandle)
+            consumed = true;
+
+        int rc = t.handleDirectEvents(toHandle);
+
+        // Closed transports stay claimed so that nobody else runs them
+        if (rc == -1) {
+            t.closePeer();
+            return;
+        }
+        if (t.isZombie())
+            return;
+
+        int wanted = t.directEpollEvents();
+        if (t.pollData_ && (consumed || wanted != t.armedEvents_)) {
+            restartFdOneShot(t.getHandle(), wanted, t.pollData_);
+            t.armedEvents_ = wanted;
+            consumed = false;
+        }
+
+        // Re-arming happens before releasing the transport, so an event
+        // coming in now will either find it idle or ask us to rerun
+        int running = TransportBase::DISPATCH_RUNNING;
+        if (t.dispatchState_.compare_exchange_strong
+            (running, TransportBase::DISPATCH_IDLE))
+            return;
+        t.dispatchState_ = TransportBase::DISPATCH_RUNNING;
     }
 }
 
@@ -20,6 +20,7 @@
 #include "transport.h"
 #include "connection_handler.h"
 #include "soa/service/epoller.h"
+#include "soa/service/timer_service.h"
 #include <map>
 #include <mutex>
 
@@ -75,7 +76,9 @@ struct EndpointBase : public Epoller {
     /** Add a periodic job to be performed to the loop. The number passed to
         the toRun function is the number of timeouts that have elapsed since
         the last call; this is useful to know if something has got behind. It
-        will normally be 1. */
+        will normally be 1.  The job runs in one of the event threads, with
+        the default slack of a periodic timer of the endpoint's timer
+        service, until shutdown. */
     typedef std::function<void (uint64_t)> OnTimer;
     void addPeriodic(double timePeriodSeconds, OnTimer toRun);
 
@@ -129,6 +132,19 @@ struct EndpointBase : public Epoller {
                        : MIN_CONTEXT_SWITCH_POLLING);
     }
 
+    /** Have the transports created from now on register their socket
+        directly with the endpoint's epoll set, rather than each owning a
+        nested epoll fd, a timer fd and an event fd.  Their timeouts are
+        kept in the timer service of the endpoint and their async
+        callbacks are delivered through the endpoint's own queue.
+
+        Should be called before any connections are made.  Defaults to
+        the value of the DIRECT_TRANSPORTS environment variable.
+    */
+    void setDirectTransports(bool direct);
+
+    bool directTransports() const { return directTransports_; }
+
     /** Spin up the threads as part of the initialization.  NOTE: make sure that this is
         only called once; normally it will be done as part of init().  Calling directly is
         only for advanced use where init() is not called.
@@ -140,14 +156,16 @@ struct EndpointBase : public Epoller {
         enum EpollDataType {
             INVALID,
             TRANSPORT,
-            TIMER,
-            WAKEUP
+            TIMERS,             ///< Timer service of the endpoint
+            WAKEUP,
+            TRANSPORT_ASYNC     ///< Queue of direct transports with work
         };
 
         EpollData(EpollData::EpollDataType fdType, int fd)
             : fdType(fdType), fd(fd), transport(nullptr)
         {
-            if (fdType != TRANSPORT && fdType != TIMER && fdType != WAKEUP) {
+            if (fdType != TRANSPORT && fdType != TIMERS && fdType != WAKEUP
+                && fdType != TRANSPORT_ASYNC) {
                 throw ML::Exception("no such fd type");
             }
         }
@@ -156,7 +174,6 @@ struct EndpointBase : public Epoller {
         int fd;
 
         std::shared_ptr<TransportBase> transport; /* TRANSPORT */
-        OnTimer onTimer;                          /* TIMER */
     };
 
     // Get the polling start time for auction handler
@@ -269,7 +286,6 @@ private:
 
     /* Are we shutting down? */
     bool shutdown_;
-    bool disallowTimers_;
 
    //Poll start time
     Date pollStart_;
@@ -281,6 +297,54 @@ private:
 
     std::vector<double> totalSleepTime;
 
+    /* Are new transports direct? */
+    bool directTransports_;
+
+    /* Event fd signalled when transportQueue_ becomes non-empty */
+    int transportAsyncFd_;
+
+    /* Direct transports that have async callbacks to run */
+    std::mutex transportQueueLock;
+    std::vector<std::shared_ptr<TransportBase> > transportQueue_;
+
+    /* Periodic jobs and timeouts of the direct transports */
+    TimerService timers_;
+
+    /* Periodic jobs, cancelled on shutdown */
+    std::mutex periodicLock;
+    std::vector<TimerService::TimerId> periodicTimers_;
+
+    /** Create the fds used to multiplex direct transports. */
+    void initDirectTransports();
+
+    /** Queue a direct transport so that its async callbacks get run from
+        an event thread. */
+    void scheduleDirectTransport(const std::shared_ptr<TransportBase>
+                                 & transport);
+
+    /** Add a timeout for a direct transport to the timer service, and
+        return its id so that the transport can cancel it.  One that has
+        already started to fire when it is cancelled is ignored if the
+        generation of the transport's timer has changed in the meantime.
+    */
+    TimerService::TimerId
+    scheduleTransportTimer(const std::shared_ptr<TransportBase> & transport,
+                           Date when, uint64_t generation);
+
+    /** Cancel a timeout of a direct transport. */
+    void cancelTransportTimer(TimerService::TimerId id);
+
+    /** Run the handlers of a direct transport for the given epoll events,
+        or just for its timers and async callbacks if events is zero.  If
+        another thread is already running it, the events are handed over
+        to that thread instead.
+    */
+    void runDirectTransport(const std::shared_ptr<TransportBase> & transport,
+                            int events);
+
+    void handleTransportAsyncEvent(EpollData * epollDataPtr);
+    void handleTimersEvent(EpollData * epollDataPtr);
+
     /** Run a thread to handle events. */
     void runEventThread(int threadNum, int numThreads);
 
@@ -297,7 +361,6 @@ private:
     Epoller::HandleEventResult handleEpollEvent(epoll_event & event);
     void handleTransportEvent(const std::shared_ptr<TransportBase>
                               & transport);
-    void handleTimerEvent(int fd, OnTimer toRun);
 };
 
 } // namespace Datacratic
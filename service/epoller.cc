@@ -187,6 +187,13 @@ poll() const
 void
 Epoller::
 performAddFd(int fd, void * data, bool oneshot, bool restart)
+{
+    performAddFd(fd, data, oneshot, restart, EPOLLIN);
+}
+
+void
+Epoller::
+performAddFd(int fd, void * data, bool oneshot, bool restart, int events)
 {
     // cerr << (Date::now().print(4)
     //          + " performAddFd: epoll_fd=" + to_string(epoll_fd)
@@ -196,7 +203,7 @@ performAddFd(int fd, void * data, bool oneshot, bool restart)
     //          + "\n");
 
     struct epoll_event event;
-    event.events = EPOLLIN;
+    event.events = events;
     if (oneshot) {
         event.events |= EPOLLONESHOT;
     }
@@ -61,6 +61,21 @@ struct Epoller: public AsyncEventSource {
         performAddFd(fd, data, true, true);
     }
 
+    /** Add the given fd on a one-shot basis, waking up for the given set
+        of epoll events (EPOLLIN, EPOLLOUT, ...) rather than only for
+        input.
+    */
+    void addFdOneShot(int fd, int events, void * data)
+    {
+        performAddFd(fd, data, true, false, events);
+    }
+
+    /** Restart a woken up one-shot fd with the given set of epoll events. */
+    void restartFdOneShot(int fd, int events, void * data)
+    {
+        performAddFd(fd, data, true, true, events);
+    }
+
     /** Remove the given fd from the multiplexer set. */
     void removeFd(int fd);
     
@@ -106,6 +121,8 @@ struct Epoller: public AsyncEventSource {
 private:
     /* Perform the fd addition and modification */
     void performAddFd(int fd, void * data, bool oneShot, bool restart);
+    void performAddFd(int fd, void * data, bool oneShot, bool restart,
+                      int events);
 
     /* Fd for the epoll mechanism. */
     int epoll_fd;
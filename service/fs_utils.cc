@@ -240,6 +240,20 @@ getEtag(const Url & url) const
     return getInfo(url).etag;
 }
 
+bool
+UrlFsHandler::
+eraseMany(const vector<Url> & urls, bool throwException) const
+{
+    bool result(true);
+    for (const Url & url: urls) {
+        if (!erase(url, throwException)) {
+            result = false;
+        }
+    }
+
+    return result;
+}
+
 
 /* registry */
 
@@ -315,6 +329,25 @@ tryEraseUriObject(const std::string & uri)
     return eraseUriObject(uri, false);
 }
 
+bool
+eraseUriObjects(const std::vector<std::string> & uris, bool throwException)
+{
+    map<string, vector<Url> > urlsByScheme;
+    for (const string & uri: uris) {
+        Url realUrl = makeUrl(uri);
+        urlsByScheme[realUrl.scheme()].push_back(realUrl);
+    }
+
+    bool result(true);
+    for (const auto & it: urlsByScheme) {
+        if (!findFsHandler(it.first)->eraseMany(it.second, throwException)) {
+            result = false;
+        }
+    }
+
+    return result;
+}
+
 bool forEachUriObject(const std::string & urlPrefix,
                       const OnUriObject & onObject,
                       const OnUriSubdir & onSubdir,
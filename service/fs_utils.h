@@ -10,6 +10,7 @@
 
 #include <string>
 #include <functional>
+#include <vector>
 
 #include "soa/types/date.h"
 #include "soa/types/url.h"
@@ -79,6 +80,13 @@ struct UrlFsHandler {
     virtual void makeDirectory(const Url & url) const = 0;
     virtual bool erase(const Url & url, bool throwException) const = 0;
 
+    /** Erase all the given objects, which share the scheme of this
+        handler.  Returns true if they were all erased.  The default
+        implementation erases them one by one.
+    */
+    virtual bool eraseMany(const std::vector<Url> & urls,
+                           bool throwException) const;
+
     /** For each object under the given prefix (object or subdirectory),
         call the given callback.
     */
@@ -127,6 +135,11 @@ bool eraseUriObject(const std::string & uri, bool throwException = true);
 // Erase the object at the given uri
 bool tryEraseUriObject(const std::string & uri);
 
+// Erase the objects at the given uris, in bulk where the fs supports it.
+// Returns true if they were all erased.
+bool eraseUriObjects(const std::vector<std::string> & uris,
+                     bool throwException = true);
+
 /** For each file matching the given prefix in the given bucket, call
     the callback.
 
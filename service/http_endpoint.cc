@@ -26,8 +26,31 @@ namespace Datacratic {
 
 HttpConnectionHandler::
 HttpConnectionHandler()
-    : readState(INVALID), httpEndpoint(0)
+    : readState(INVALID), headerBytes(0), httpEndpoint(0)
 {
+    parser.onRequestStart = [=] (const char * method, size_t methodSize,
+                                 const char * url, size_t urlSize,
+                                 const char * version, size_t versionSize)
+        {
+            this->onRequestStart(method, methodSize, url, urlSize,
+                                 version, versionSize);
+        };
+    parser.onHeader = [=] (const char * data, size_t size)
+        {
+            this->onHeader(data, size);
+        };
+    parser.onChunkHeader = [=] (const char * data, size_t size)
+        {
+            this->onChunkHeader(data, size);
+        };
+    parser.onData = [=] (const char * data, size_t size)
+        {
+            this->onData(data, size);
+        };
+    parser.onDone = [=] (bool requireClose)
+        {
+            this->onDone(requireClose);
+        };
 }
 
 void
@@ -57,7 +80,7 @@ handleData(const std::string & data)
    //cerr << "HttpConnectionHandler::handleData: got data <" << data << ">" << endl;
     //httpData.write(data.c_str(), data.length());
 
-    if (headerText == "" && readState == HEADER)
+    if (headerBytes == 0 && readState == HEADER)
         firstData = Date::now();
 
     addActivity("handleData with state %d", readState);
@@ -78,31 +101,57 @@ handleData(const std::string & data)
                 dataSample.c_str());
 #endif
 
-    if (readState == PAYLOAD
-        || readState == CHUNK_HEADER || readState == CHUNK_BODY) {
-        handleHttpData(data);
-        return;
-    }
-    
-    if (readState != HEADER) {
+    if (readState != HEADER && readState != PAYLOAD
+        && readState != CHUNK_HEADER && readState != CHUNK_BODY) {
         throw Exception("invalid read state %d handling data '%s' for %p",
                         readState, data.c_str(), this);
     }
-    
-    headerText += data;
-    // The first time that we see that character sequence, it's the break
-    // between the header and the data.
-    string::size_type breakPos = headerText.find("\r\n\r\n");
-    
 
-    if (breakPos == string::npos)
-    {
-        if (headerText.size() > 16384) {
-            throw ML::Exception("HTTP header exceeds 16kb");
-        }
-        //cerr << "did not find break pos " << endl;
-        return;
-    }
+    if (readState == HEADER)
+        headerBytes += data.size();
+
+    // The parser calls us back as the request line, headers, body or
+    // chunks become complete
+    parser.feed(data.c_str(), data.size());
+
+    if (readState == HEADER && headerBytes > 16384)
+        throw ML::Exception("HTTP header exceeds 16kb");
+}
+
+void
+HttpConnectionHandler::
+onRequestStart(const char * method, size_t methodSize,
+               const char * url, size_t urlSize,
+               const char * version, size_t versionSize)
+{
+    if (readState != HEADER)
+        throw Exception("extra data after HTTP request in state %d",
+                        readState);
+
+    headerText.reserve(1024);
+    headerText.append(method, methodSize);
+    headerText.push_back(' ');
+    headerText.append(url, urlSize);
+    headerText.push_back(' ');
+    headerText.append(version, versionSize);
+    headerText.append("\r\n");
+}
+
+void
+HttpConnectionHandler::
+onHeader(const char * data, size_t size)
+{
+    headerText.append(data, size);
+
+    // The parser reports the empty line ending the header on its own
+    if (size == 2 && data[0] == '\r' && data[1] == '\n')
+        handleHeaderText();
+}
+
+void
+HttpConnectionHandler::
+handleHeaderText()
+{
     // We got a header
     try {
         header.parse(headerText);
@@ -123,13 +172,58 @@ handleData(const std::string & data)
 
     handleHttpHeader(header);
 
-    payload = "";
+    payload.clear();
 
     if (header.isChunked)
         readState = CHUNK_HEADER;
     else readState = PAYLOAD;
+}
 
-    handleHttpData(header.knownData);
+void
+HttpConnectionHandler::
+onChunkHeader(const char * data, size_t size)
+{
+    if (readState != CHUNK_HEADER)
+        throw Exception("invalid state %d: expected chunk header",
+                        readState);
+
+    chunkHeader.assign(data, size);
+    readState = CHUNK_BODY;
+}
+
+void
+HttpConnectionHandler::
+onData(const char * data, size_t size)
+{
+    if (readState == PAYLOAD) {
+        payload.append(data, size);
+    }
+    else if (readState == CHUNK_BODY) {
+        chunkBody.assign(data, size);
+        handleHttpChunk(header, chunkHeader, chunkBody);
+        readState = CHUNK_HEADER;
+    }
+    else throw Exception("invalid state %d: expected payload", readState);
+}
+
+void
+HttpConnectionHandler::
+onDone(bool requireClose)
+{
+    if (readState == PAYLOAD) {
+        addActivityS("got HTTP payload");
+        handleHttpPayload(header, payload);
+    }
+    else if (readState == CHUNK_BODY) {
+        // The last chunk is empty and so wasn't reported as data
+        chunkBody.clear();
+        handleHttpChunk(header, chunkHeader, chunkBody);
+    }
+    else throw Exception("invalid state %d at end of request", readState);
+
+    //cerr << this << " switching to DONE" << endl;
+
+    readState = DONE;
 }
 
 void
@@ -156,129 +250,6 @@ handleHttpHeader(const HttpHeader & header)
     //cerr << "GOT HTTP HEADER[" << header << "]" << endl;
 }
 
-void
-HttpConnectionHandler::
-handleHttpData(const std::string & data)
-{
-    //static const char *fName = "HttpConnectionHandler::handleHttpData:";
-    //cerr << "got HTTP data in state " << readState << " with "
-    //     << data.length() << " characters" << endl;
-    //cerr << "data = [" << data << "]" << endl;
-    //cerr << endl << endl << "---------------------------" << endl;
-    
-    if (readState == PAYLOAD) {
-        //cerr << "handleHttpData" << endl;
-        if (readState != PAYLOAD)
-            throw Exception("invalid state: expected payload");
-
-        payload += data;
-#if 0
-        cerr << "payload = " << payload << endl;
-        cerr << "payload.length() = " << payload.length() << endl;
-        cerr << "header.contentLength = " << header.contentLength << endl;
-#endif
-        if (payload.length() > header.contentLength) {
-            doError("extra data");
-        }
-    
-
-        if (payload.length() == header.contentLength) {
-            addActivityS("got HTTP payload");
-            handleHttpPayload(header, payload);
-
-            //cerr << this << " switching to DONE" << endl;
-
-            readState = DONE;
-        }
-    }
-    if (readState == CHUNK_HEADER || readState == CHUNK_BODY) {
-        const char * current = data.c_str();
-        const char * end = current + data.length();
-
-        //cerr << "processing " << data.length() << " characters" << endl;
-
-        while (current != end) {
-            if (current >= end)
-                throw ML::Exception("current >= end");
-
-            //cerr << (end - current) << " chars left; state "
-            //     << readState << " chunkHeader = " << chunkHeader << endl;
-
-            if (readState == CHUNK_HEADER) {
-                while (current != end) {
-                    char c = *current++;
-                    chunkHeader += c;
-                    if (c == '\n') break;
-                }
-
-                //cerr << "chunkHeader now '" << chunkHeader << "'" << endl;
-
-                // Remove an extra cr/lf if there is one
-                if (chunkHeader == "\r\n") {
-                    chunkHeader = "";
-                    continue;
-                }
-
-                //if (current == end) break;
-
-                //cerr << "chunkHeader now '" << chunkHeader << "'" << endl;
-
-                string::size_type pos = chunkHeader.find("\r\n");
-                if (pos == string::npos) break;
-                current += pos + 2 - chunkHeader.length();  // skip crlf
-                
-                chunkHeader.resize(pos);
-
-                // We got to the end of the chunk header... parse it
-                string::size_type lengthPos = chunkHeader.find(';');
-
-                //cerr << "chunkHeader = " << chunkHeader << endl;
-                //cerr << "lengthPos = " << lengthPos << endl;
-
-                string lengthStr(chunkHeader, 0, lengthPos);
-                //(lengthPos == string::npos
-                //                  ? chunkHeader.length() : lengthPos));
-                //cerr << "lengthStr = " << lengthStr << endl;
-
-                char * endPtr = 0;
-                chunkSize = strtol(lengthStr.c_str(), &endPtr, 16);
-
-                //cerr << "chunkSize = " << chunkSize << endl;
-
-                if (chunkSize == 0) {
-                    //readState = DONE;
-                    //return;
-                }
-
-                if (*endPtr != 0)
-                    throw ML::Exception("invalid chunk length " + lengthStr);
-
-                readState = CHUNK_BODY;
-                chunkBody = "";
-            }
-            if (readState == CHUNK_BODY) {
-                size_t chunkDataLeft = chunkSize - chunkBody.size();
-                size_t dataAvail = end - current;
-                size_t toRead = std::min(chunkDataLeft, dataAvail);
-
-                chunkBody.append(current, current + toRead);
-                current += toRead;
-
-                if (chunkBody.length() == chunkSize) {
-
-                    //cerr << "got chunk " << "-------------" << endl
-                    //     << chunkBody << "--------------" << endl << endl;
-
-                    handleHttpChunk(header, chunkHeader, chunkBody);
-                    chunkBody = "";
-                    chunkHeader = "";
-                    readState = CHUNK_HEADER;
-                }
-            }
-        }
-    }
-}
-
 void
 HttpConnectionHandler::
 handleHttpChunk(const HttpHeader & header,
@@ -321,70 +292,133 @@ onCleanup()
 {
 }
 
+namespace {
+
+/** Per thread buffer that responses are serialized into before being sent,
+    so that building a response doesn't allocate once it has grown to size.
+    send() doesn't keep a reference to it.
+*/
+std::string & responseBuffer()
+{
+    static thread_local std::string buffer;
+    return buffer;
+}
+
+} // file scope
+
 void
 HttpConnectionHandler::
 putResponseOnWire(HttpResponse response,
                   std::function<void ()> onSendFinished,
                   NextAction next)
 {
-    onSendFinished = [=] ()
-        {
-#if 0
-            Date finished = Date::now();
-            double elapsedMs = finished.secondsSince(this->firstData) * 1000;
-            cerr << "send finished in "
-            << elapsedMs << "ms" << endl;
+    if (!onSendFinished) {
+        onSendFinished = [=] ()
+            {
+                this->transport().associateWhenHandlerFinished
+                    (this->makeNewHandlerShared(), "sendFinished");
+            };
+    }
 
+    std::string & responseStr = responseBuffer();
+    responseStr.clear();
+    response.appendTo(responseStr);
 
-            if (elapsedMs > 100) {
-                transport().dumpActivities();
-                abort();
-            }
-#endif
+    //cerr << "sending " << responseStr << endl;
+    
+    send(responseStr.c_str(), responseStr.length(),
+         next,
+         std::move(onSendFinished));
+}
 
-            if (!onSendFinished)
+void
+HttpConnectionHandler::
+putCannedResponseOnWire(const CannedHttpResponse & response,
+                        std::function<void ()> onSendFinished,
+                        NextAction next)
+{
+    if (!onSendFinished) {
+        onSendFinished = [=] ()
+            {
                 this->transport().associateWhenHandlerFinished
                     (this->makeNewHandlerShared(), "sendFinished");
-            else onSendFinished();
-        };
+            };
+    }
 
-    std::string responseStr;
-    responseStr.reserve(1024 + response.body.length());
+    send(response.data.c_str(), response.data.length(),
+         next,
+         std::move(onSendFinished));
+}
 
-    responseStr.append("HTTP/1.1 ");
-    responseStr.append(to_string(response.responseCode));
-    responseStr.append(" ");
-    responseStr.append(response.responseStatus);
-    responseStr.append("\r\n");
 
-    if (response.contentType != "") {
-        responseStr.append("Content-Type: ");
-        responseStr.append(response.contentType);
-        responseStr.append("\r\n");
+/*****************************************************************************/
+/* HTTP RESPONSE                                                             */
+/*****************************************************************************/
+
+void
+HttpResponse::
+appendTo(std::string & output, bool includeDate) const
+{
+    if (responseStatus.empty()) {
+        output.append(getResponseStatusLine(responseCode));
+    }
+    else {
+        output.append("HTTP/1.1 ");
+        output.append(to_string(responseCode));
+        output.append(" ");
+        output.append(responseStatus);
+        output.append("\r\n");
     }
 
-    if (response.sendBody) {
-        responseStr.append("Content-Length: ");
-        responseStr.append(to_string(response.body.length()));
-        responseStr.append("\r\n");
-        responseStr.append("Connection: Keep-Alive\r\n");
+    if (includeDate)
+        output.append(getHttpDateHeader());
+
+    if (contentType != "") {
+        output.append("Content-Type: ");
+        output.append(contentType);
+        output.append("\r\n");
     }
 
-    for (auto & h: response.extraHeaders) {
-        responseStr.append(h.first);
-        responseStr.append(": ");
-        responseStr.append(h.second);
-        responseStr.append("\r\n");
+    if (sendBody) {
+        char buf[64];
+        int len = ::snprintf(buf, sizeof(buf), "Content-Length: %zu\r\n",
+                             body.length());
+        output.append(buf, len);
+        output.append("Connection: Keep-Alive\r\n");
     }
 
-    responseStr.append("\r\n");
-    responseStr.append(response.body);
+    for (auto & h: extraHeaders) {
+        output.append(h.first);
+        output.append(": ");
+        output.append(h.second);
+        output.append("\r\n");
+    }
 
-    //cerr << "sending " << responseStr << endl;
-    
-    send(responseStr,
-         next,
-         onSendFinished);
+    output.append("\r\n");
+    output.append(body);
+}
+
+
+/*****************************************************************************/
+/* CANNED HTTP RESPONSE                                                      */
+/*****************************************************************************/
+
+CannedHttpResponse::
+CannedHttpResponse(const HttpResponse & response)
+    : responseCode(response.responseCode),
+      contentType(response.contentType),
+      body(response.body)
+{
+    response.appendTo(data, false /* includeDate */);
+}
+
+const CannedHttpResponse &
+CannedHttpResponse::
+noContent()
+{
+    static const CannedHttpResponse result
+        (HttpResponse(204, "", { { "Connection", "Keep-Alive" } }));
+    return result;
 }
 
 
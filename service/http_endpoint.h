@@ -11,6 +11,7 @@
 #include "soa/service/passive_endpoint.h"
 #include "soa/types/date.h"
 #include "http_header.h"
+#include "http_parsers.h"
 
 namespace Datacratic {
 
@@ -33,10 +34,9 @@ struct HttpResponse {
                  std::vector<std::pair<std::string, std::string> > extraHeaders
                      = std::vector<std::pair<std::string, std::string> >())
         : responseCode(responseCode),
-          responseStatus(getResponseReasonPhrase(responseCode)),
-          contentType(contentType),
-          body(body),
-          extraHeaders(extraHeaders),
+          contentType(std::move(contentType)),
+          body(std::move(body)),
+          extraHeaders(std::move(extraHeaders)),
           sendBody(true)
     {
     }
@@ -49,9 +49,8 @@ struct HttpResponse {
                  std::vector<std::pair<std::string, std::string> > extraHeaders
                      = std::vector<std::pair<std::string, std::string> >())
         : responseCode(responseCode),
-          responseStatus(getResponseReasonPhrase(responseCode)),
-          contentType(contentType),
-          extraHeaders(extraHeaders),
+          contentType(std::move(contentType)),
+          extraHeaders(std::move(extraHeaders)),
           sendBody(false)
     {
     }
@@ -61,16 +60,27 @@ struct HttpResponse {
                  std::vector<std::pair<std::string, std::string> > extraHeaders
                      = std::vector<std::pair<std::string, std::string> >())
         : responseCode(responseCode),
-          responseStatus(getResponseReasonPhrase(responseCode)),
           contentType("application/json"),
           body(ML::trim(body.toString())),
-          extraHeaders(extraHeaders),
+          extraHeaders(std::move(extraHeaders)),
           sendBody(true)
     {
     }
 
+    /** Append the serialized response (headers and body) to the given
+        buffer.  The status line is precomputed and the Date header is
+        cached, so that this does nothing but copy bytes once the buffer
+        has grown to size.
+    */
+    void appendTo(std::string & output, bool includeDate = true) const;
+
     int responseCode;
+
+    /** Reason phrase for the status line.  If empty, which is the default,
+        the standard phrase for responseCode is used.
+    */
     std::string responseStatus;
+
     std::string contentType;
     std::string body;
     std::vector<std::pair<std::string, std::string> > extraHeaders;
@@ -78,6 +88,33 @@ struct HttpResponse {
 };
 
 
+/*****************************************************************************/
+/* CANNED HTTP RESPONSE                                                      */
+/*****************************************************************************/
+
+/** A response that never changes, serialized once so that it can be sent
+    any number of times without being rebuilt or copied.  As it is fixed,
+    it has no Date header.
+
+    Typically kept as a static, eg for the "204 No Content" answer to a
+    request that is being declined.
+*/
+
+struct CannedHttpResponse {
+    CannedHttpResponse(const HttpResponse & response);
+
+    /** "204 No Content" on a connection that is kept alive. */
+    static const CannedHttpResponse & noContent();
+
+    int responseCode;
+    std::string contentType;
+    std::string body;
+
+    /** The whole response as it is put on the wire. */
+    std::string data;
+};
+
+
 /*****************************************************************************/
 /* HTTP CONNECTION HANDLER                                                   */
 /*****************************************************************************/
@@ -102,18 +139,26 @@ struct HttpConnectionHandler : public PassiveConnectionHandler {
         DONE
     } readState;
 
-    /** Accumulated text for the header. */
+    /** Incremental parser for the request.  It only keeps the bytes of the
+        line or chunk that it is in the middle of between packets, so that
+        each byte received is scanned once.
+    */
+    HttpRequestParser parser;
+
+    /** Accumulated text for the header, as reported by the parser. */
     std::string headerText;
 
+    /** Number of bytes received while reading the header. */
+    size_t headerBytes;
+
     /** The actual header */
     HttpHeader header;
 
     /** The payload we're accumulating. */
     std::string payload;
 
-    /** The chunk header we're accumulating. */
+    /** The current chunk header (size line) and chunk. */
     std::string chunkHeader;
-    size_t chunkSize;
     std::string chunkBody;
 
     /** When we first got data. */
@@ -139,20 +184,14 @@ struct HttpConnectionHandler : public PassiveConnectionHandler {
     */
     virtual void handleHttpHeader(const HttpHeader & header);
 
-    /** Called for each packet of data that comes through.  Default
-        concatenates them together into a payload and calls
-        handleHttpPayload once done.
-    */
-    virtual void handleHttpData(const std::string & data);
-
     /** Called once the entire payload has come through.  Default will
         throw.  Will be called multiple times for chunked encoding.
     */
     virtual void handleHttpPayload(const HttpHeader & header,
                                    const std::string & payload);
 
-    /** Called when a chunk comes through.  Default will call
-        handleHttpPayload.
+    /** Called when a chunk comes through, including the final empty one.
+        Default will call handleHttpPayload.
     */
     virtual void handleHttpChunk(const HttpHeader & header,
                                  const std::string & chunkHeader,
@@ -173,6 +212,24 @@ struct HttpConnectionHandler : public PassiveConnectionHandler {
                                    = std::function<void ()>(),
                                    NextAction next = NEXT_CONTINUE);
 
+    /** Send a canned response.  Same semantics as putResponseOnWire(). */
+    void putCannedResponseOnWire(const CannedHttpResponse & response,
+                                 std::function<void ()> onSendFinished
+                                 = std::function<void ()>(),
+                                 NextAction next = NEXT_CONTINUE);
+
+private:
+    /* Parser callbacks */
+    void onRequestStart(const char * method, size_t methodSize,
+                        const char * url, size_t urlSize,
+                        const char * version, size_t versionSize);
+    void onHeader(const char * data, size_t size);
+    void onChunkHeader(const char * data, size_t size);
+    void onData(const char * data, size_t size);
+    void onDone(bool requireClose);
+
+    /** Called once the whole header has been received. */
+    void handleHeaderText();
 };
 
 
@@ -10,6 +10,7 @@
 #include "jml/db/persistent.h"
 #include "jml/utils/vector_utils.h"
 #include <boost/lexical_cast.hpp>
+#include <time.h>
 
 using namespace std;
 using namespace ML;
@@ -339,4 +340,57 @@ std::string getResponseReasonPhrase(int code)
     }
 }
 
+const std::string & getResponseStatusLine(int code)
+{
+    enum { MIN_CODE = 100, MAX_CODE = 599 };
+
+    static const std::vector<std::string> statusLines = [] ()
+        {
+            std::vector<std::string> result(MAX_CODE + 1);
+            for (int i = MIN_CODE;  i <= MAX_CODE;  ++i)
+                result[i] = ("HTTP/1.1 " + to_string(i) + " "
+                             + getResponseReasonPhrase(i) + "\r\n");
+            return result;
+        } ();
+
+    if (code >= MIN_CODE && code <= MAX_CODE)
+        return statusLines[code];
+
+    static thread_local std::string other;
+    other = ("HTTP/1.1 " + to_string(code) + " "
+             + getResponseReasonPhrase(code) + "\r\n");
+    return other;
+}
+
+const std::string & getHttpDateHeader()
+{
+    static const char * days[] = {
+        "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"
+    };
+    static const char * months[] = {
+        "Jan", "Feb", "Mar", "Apr", "May", "Jun",
+        "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"
+    };
+
+    static thread_local time_t cachedTime = -1;
+    static thread_local std::string cachedHeader;
+
+    time_t now = ::time(nullptr);
+    if (now != cachedTime) {
+        struct tm tm;
+        ::gmtime_r(&now, &tm);
+
+        char buf[64];
+        int len = ::snprintf(buf, sizeof(buf),
+                             "Date: %s, %02d %s %04d %02d:%02d:%02d GMT\r\n",
+                             days[tm.tm_wday], tm.tm_mday, months[tm.tm_mon],
+                             tm.tm_year + 1900,
+                             tm.tm_hour, tm.tm_min, tm.tm_sec);
+        cachedHeader.assign(buf, len);
+        cachedTime = now;
+    }
+
+    return cachedHeader;
+}
+
 } // namespace Datacratic
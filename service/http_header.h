@@ -104,4 +104,15 @@ std::ostream & operator << (std::ostream & stream, const HttpHeader & header);
 */
 std::string getResponseReasonPhrase(int code);
 
+/** Returns the full status line ("HTTP/1.1 <code> <reason>\r\n") for the
+    given code.  These are computed once, so this doesn't allocate.
+*/
+const std::string & getResponseStatusLine(int code);
+
+/** Returns a "Date: <RFC 1123 date>\r\n" header line for the current time.
+    The line is cached per thread and only reformatted when the second
+    changes.
+*/
+const std::string & getHttpDateHeader();
+
 } // namespace Datacratic
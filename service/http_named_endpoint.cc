@@ -263,6 +263,17 @@ sendResponse(int code,
                       onSendFinished);
 }
 
+void
+HttpNamedEndpoint::RestConnectionHandler::
+sendCannedResponse(const CannedHttpResponse & response)
+{
+    std::unique_lock<std::mutex> guard(mutex);
+    if (isZombie)
+        return;
+    // The default completion recycles the connection for a new request
+    putCannedResponseOnWire(response);
+}
+
 void
 HttpNamedEndpoint::RestConnectionHandler::
 sendResponseHeader(int code,
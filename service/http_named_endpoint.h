@@ -90,6 +90,11 @@ struct HttpNamedEndpoint : public NamedEndpoint, public HttpEndpoint {
                                 const std::string & contentType,
                                 RestParams headers = RestParams());
 
+        /** Send a canned response as is.  The endpoint's extra headers are
+            not added, so they need to be part of the response if wanted.
+        */
+        void sendCannedResponse(const CannedHttpResponse & response);
+
         /** Send an HTTP chunk with the appropriate headers back down the
             wire. */
         void sendHttpChunk(const std::string & chunk,
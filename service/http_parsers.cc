@@ -299,6 +299,7 @@ parseChunkedBody(BufferState & state)
             }
         }
 
+        const char * lineEnd = state.data + state.ptr;
         chunkSize = ML::antoi(sizeStart, sizeEnd, 16);
 
         state.ptr += 2;
@@ -306,6 +307,9 @@ parseChunkedBody(BufferState & state)
             return false;
         }
 
+        if (onChunkHeader) {
+            onChunkHeader(sizeStart, lineEnd - sizeStart);
+        }
         if (onData && chunkSize > 0) {
             onData(state.currentDataPtr(), chunkSize);
         }
@@ -426,6 +430,9 @@ parseFirstLine(BufferState & state)
     size_t urlEnd = state.ptr;
     state.ptr++;
 
+    if (state.remaining() < 5) {
+        return false;
+    }
     if (::memcmp(state.currentDataPtr(), "HTTP/", 5) != 0) {
         throw ML::Exception("version must start with 'HTTP/'");
     }
@@ -29,6 +29,12 @@ struct HttpParser {
        invoked when the body is larger than 0 byte. */
     typedef std::function<void (const char *, size_t)> OnData;
 
+    /* Type of callback used when to report the size line of a chunk,
+       without its trailing CRLF, when chunked encoding is in use. Invoked
+       right before the chunk is reported via OnData, as well as for the
+       final empty chunk. */
+    typedef std::function<void (const char *, size_t)> OnChunkHeader;
+
     /* Type of callback used when to report the end of a response */
     typedef std::function<void (bool)> OnDone;
 
@@ -106,6 +112,7 @@ struct HttpParser {
 
     OnHeader onHeader;
     OnData onData;
+    OnChunkHeader onChunkHeader;
     OnDone onDone;
 
 private:
@@ -0,0 +1,136 @@
+/* inline_function.h                                               -*- C++ -*-
+   Copyright (c) 2014 Datacratic.  All rights reserved.
+
+   Type-erased void () callable with inline storage.
+*/
+
+#pragma once
+
+#include <new>
+#include <utility>
+#include <type_traits>
+
+
+namespace Datacratic {
+
+
+/*****************************************************************************/
+/* INLINE FUNCTION                                                           */
+/*****************************************************************************/
+
+/** Holds any void () callable, like std::function<void ()>, but stores
+    callables of up to InlineSize bytes within the object itself instead of
+    allocating them on the heap.  Bigger callables fall back to the heap.
+
+    Not copyable; it is intended to live in pooled nodes that are filled
+    in once with emplace() and reset once the callable has been run.
+*/
+
+template<size_t InlineSize>
+struct InlineFunction {
+
+    InlineFunction()
+        : call_(nullptr), destroy_(nullptr)
+    {
+    }
+
+    InlineFunction(const InlineFunction & other) = delete;
+    InlineFunction & operator = (const InlineFunction & other) = delete;
+
+    ~InlineFunction()
+    {
+        reset();
+    }
+
+    /** Store the given callable, destroying any previous one. */
+    template<typename Fn>
+    void emplace(Fn && fn)
+    {
+        typedef typename std::decay<Fn>::type Stored;
+        reset();
+        typedef std::integral_constant<bool, sizeof(Stored) <= InlineSize
+                                       && alignof(Stored) <= Alignment>
+            FitsInline;
+        doEmplace<Stored>(std::forward<Fn>(fn), FitsInline());
+    }
+
+    /** Destroy the stored callable, if any. */
+    void reset()
+    {
+        if (!destroy_)
+            return;
+        destroy_(&storage_);
+        call_ = nullptr;
+        destroy_ = nullptr;
+    }
+
+    explicit operator bool () const
+    {
+        return call_;
+    }
+
+    void operator () ()
+    {
+        call_(&storage_);
+    }
+
+    /** Whether callables of the given type are stored without allocating. */
+    template<typename Fn>
+    static constexpr bool storedInline()
+    {
+        return sizeof(Fn) <= InlineSize && alignof(Fn) <= Alignment;
+    }
+
+private:
+    static constexpr size_t Alignment = 16;
+
+    typedef void (*Call) (void *);
+    typedef void (*Destroy) (void *);
+
+    Call call_;
+    Destroy destroy_;
+    typename std::aligned_storage<InlineSize, Alignment>::type storage_;
+
+    template<typename Stored, typename Fn>
+    void doEmplace(Fn && fn, std::true_type)
+    {
+        new (&storage_) Stored(std::forward<Fn>(fn));
+        call_ = &callInline<Stored>;
+        destroy_ = &destroyInline<Stored>;
+    }
+
+    template<typename Stored, typename Fn>
+    void doEmplace(Fn && fn, std::false_type)
+    {
+        Stored * stored = new Stored(std::forward<Fn>(fn));
+        new (&storage_) Stored * (stored);
+        call_ = &callHeap<Stored>;
+        destroy_ = &destroyHeap<Stored>;
+    }
+
+    template<typename Stored>
+    static void callInline(void * storage)
+    {
+        (*reinterpret_cast<Stored *>(storage))();
+    }
+
+    template<typename Stored>
+    static void destroyInline(void * storage)
+    {
+        reinterpret_cast<Stored *>(storage)->~Stored();
+    }
+
+    template<typename Stored>
+    static void callHeap(void * storage)
+    {
+        (**reinterpret_cast<Stored **>(storage))();
+    }
+
+    template<typename Stored>
+    static void destroyHeap(void * storage)
+    {
+        delete *reinterpret_cast<Stored **>(storage);
+    }
+};
+
+} // namespace Datacratic
@@ -6,10 +6,21 @@
 */
 
 #include "soa/service/logs.h"
+#include "soa/service/mpsc_queue.h"
+#include "jml/utils/exc_assert.h"
 #include "jml/utils/exc_check.h"
 
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <atomic>
+#include <condition_variable>
+#include <exception>
 #include <iostream>
 #include <mutex>
+#include <thread>
 #include <unordered_map>
 #include <vector>
 
@@ -115,7 +126,6 @@ struct Logging::CategoryData {
     bool enabled;
     char const * name;
     std::shared_ptr<Writer> writer;
-    std::stringstream stream;
 
     CategoryData * parent;
     std::vector<CategoryData *> children;
@@ -303,39 +313,428 @@ void Logging::Category::writeTo(std::shared_ptr<Writer> output, bool recurse) {
     data->writeTo(output, recurse);
 }
 
-// This lock is a quick-fix for the case where a category is used by multiple
-// threads. Note that this lock should either eventually be removed or replaced
-// by a per category lock. Unfortunately the current setup makes it very
-// difficult to pass the header information to the operator& so that everything
-// can be dumped in the stream in one go.
-namespace { std::mutex loggingMutex; }
+namespace {
+
+/** Line waiting to be written by the background thread. */
+struct LogLine : public MpscQueueNode {
+    std::shared_ptr<Logging::Writer> writer;
+    char timestamp[32];
+    std::string name;       // the category may be gone once it is written
+    char const * function;
+    char const * file;
+    int line;
+    std::string body;
+};
+
+/** Header of a line being formatted by a thread. */
+struct LineBuffer {
+    std::stringstream stream;
+    Logging::CategoryData * category;
+    char const * function;
+    char const * file;
+    int line;
+    char timestamp[32];
+};
+
+/** Formatting state of a thread.  The buffers form a stack so that the
+    arguments of a LOG can themselves log.
+*/
+struct ThreadBuffers {
+    ThreadBuffers()
+        : depth(0), second(-1), millisecond(-1), prefixLength(0)
+    {
+    }
+
+    std::vector<std::unique_ptr<LineBuffer> > buffers;
+    size_t depth;
+
+    /* timestamp of the last line, only reformatted when it changes */
+    time_t second;
+    int millisecond;
+    size_t prefixLength;
+    char timestamp[32];
+
+    LineBuffer & push()
+    {
+        if (depth == buffers.size()) {
+            buffers.emplace_back(new LineBuffer());
+        }
+        return *buffers[depth++];
+    }
+
+    LineBuffer & pop()
+    {
+        ExcAssertGreater(depth, 0);
+        return *buffers[--depth];
+    }
+
+    void updateTimestamp()
+    {
+        timeval now;
+        gettimeofday(&now, 0);
+
+        if (now.tv_sec != second) {
+            struct tm tm;
+            localtime_r(&now.tv_sec, &tm);
+            prefixLength = strftime(timestamp, sizeof(timestamp),
+                                    "%Y-%m-%d %H:%M:%S", &tm);
+            second = now.tv_sec;
+            millisecond = -1;
+        }
+
+        int ms = now.tv_usec / 1000;
+        if (ms != millisecond) {
+            sprintf(timestamp + prefixLength, ".%03d", ms);
+            millisecond = ms;
+        }
+    }
+};
+
+ThreadBuffers & threadBuffers()
+{
+    static thread_local ThreadBuffers buffers;
+    return buffers;
+}
+
+void writeLine(const LogLine & line)
+{
+    line.writer->head(line.timestamp, line.name.c_str(), line.function,
+                      line.file, line.line);
+    line.writer->body(line.body);
+}
+
+struct LogWriterThread;
+LogWriterThread & logWriterThread();
+
+/** Lines written by the background thread can lag by up to this period,
+    unless more than WakeupBacklog lines are waiting or Logging::flush() is
+    called.
+*/
+const int WakeupPeriodMs = 10;
+const uint64_t WakeupBacklog = 256;
+
+/** Queue of the lines to write and the thread that writes them. */
+struct LogWriterThread {
+    LogWriterThread()
+        : async(true), running(false), shutdown(false), sleeping(false),
+          numQueued(0), numWritten(0), flushTarget(0)
+    {
+        int res = pthread_atfork(onForkPrepare, onForkParent, onForkChild);
+        if (res != 0) {
+            throw ML::Exception(res, "pthread_atfork");
+        }
+    }
+
+    void enqueue(LogLine * line)
+    {
+        if (!running) {
+            start();
+        }
+        if (!running) {
+            /* logging from static destructors, after the thread is gone */
+            numQueued.fetch_add(1, std::memory_order_relaxed);
+            queue.push(line);
+            drain();
+            return;
+        }
+
+        uint64_t queued = numQueued.fetch_add(1, std::memory_order_relaxed);
+        queue.push(line);
+
+        /* the thread wakes up by itself regularly, so it is only worth
+           waking it up early when lines pile up */
+        uint64_t backlog = queued - numWritten.load(std::memory_order_relaxed);
+        if (backlog >= WakeupBacklog
+            && sleeping.exchange(false, std::memory_order_acq_rel)) {
+            std::lock_guard<std::mutex> guard(lock);
+            wakeup.notify_one();
+        }
+    }
+
+    void start()
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (running || shutdown) {
+            return;
+        }
+        thread = std::thread([&] () { this->run(); });
+        running = true;
+        atexit([] () { logWriterThread().stop(); });
+    }
+
+    void stop()
+    {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            if (!running) {
+                return;
+            }
+            shutdown = true;
+            wakeup.notify_one();
+        }
+        thread.join();
+        running = false;
+        drain();
+    }
+
+    void run()
+    {
+        for (;;) {
+            drain();
+
+            std::unique_lock<std::mutex> guard(lock);
+            if (shutdown) {
+                break;
+            }
+            sleeping.store(true, std::memory_order_release);
+            wakeup.wait_for(guard, std::chrono::milliseconds(WakeupPeriodMs));
+            sleeping.store(false, std::memory_order_relaxed);
+        }
+    }
+
+    /** Write the queued lines.  Normally only called by the thread, except
+        when it is gone or when the process is crashing.
+    */
+    void drain()
+    {
+        std::lock_guard<std::mutex> guard(consumerLock);
+        drainLocked();
+    }
+
+    void drainLocked()
+    {
+        while (LogLine * line = queue.pop()) {
+            try {
+                writeLine(*line);
+            } catch (...) {
+            }
+            delete line;
+            numWritten.fetch_add(1, std::memory_order_release);
+        }
+        if (numWritten.load(std::memory_order_relaxed)
+            >= flushTarget.load(std::memory_order_relaxed)) {
+            std::lock_guard<std::mutex> guard(flushLock);
+            flushed.notify_all();
+        }
+    }
+
+    void flush()
+    {
+        uint64_t target = numQueued.load(std::memory_order_relaxed);
+        if (!running) {
+            drain();
+            return;
+        }
+
+        flushTarget.store(target, std::memory_order_relaxed);
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            wakeup.notify_one();
+        }
+
+        std::unique_lock<std::mutex> guard(flushLock);
+        while (numWritten.load(std::memory_order_acquire) < target
+               && running) {
+            flushed.wait_for(guard, std::chrono::milliseconds(10));
+        }
+    }
+
+    /** Called from the crashing thread: take over the queue from the
+        writer thread, which may well be the one that crashed.
+    */
+    void flushOnCrash()
+    {
+        /* best effort: the writers aren't async-signal-safe */
+        std::unique_lock<std::mutex> guard(consumerLock, std::defer_lock);
+        for (int i = 0;  i < 100 && !guard.try_lock();  ++i) {
+            usleep(1000);
+        }
+        drainLocked();
+    }
+
+    /** Write out what is queued and hold every lock across fork(), so
+        that the child gets a consistent copy of the queue.
+    */
+    static void onForkPrepare()
+    {
+        LogWriterThread & writer = logWriterThread();
+        writer.drain();
+        writer.lock.lock();
+        writer.consumerLock.lock();
+        writer.flushLock.lock();
+        writer.syncLock.lock();
+    }
+
+    static void onForkParent()
+    {
+        LogWriterThread & writer = logWriterThread();
+        writer.syncLock.unlock();
+        writer.flushLock.unlock();
+        writer.consumerLock.unlock();
+        writer.lock.unlock();
+    }
+
+    /** The writer thread doesn't exist in the child, so it writes its lines
+        synchronously, as after stop().  What was pushed between the drain
+        and the fork is the parent's to write; it is dropped, along with
+        any push that was half done, by starting over with an empty queue.
+    */
+    static void onForkChild()
+    {
+        LogWriterThread & writer = logWriterThread();
+        writer.syncLock.unlock();
+        writer.flushLock.unlock();
+        writer.consumerLock.unlock();
+        writer.lock.unlock();
+
+        /* destroying or assigning a joinable thread would terminate */
+        new (&writer.thread) std::thread();
+        new (&writer.queue) MpscQueue<LogLine>();
+        new (&writer.wakeup) std::condition_variable();
+        new (&writer.flushed) std::condition_variable();
+
+        writer.running = false;
+        writer.shutdown = true;
+        writer.sleeping = false;
+        writer.numQueued = 0;
+        writer.numWritten = 0;
+        writer.flushTarget = 0;
+    }
+
+    std::atomic<bool> async;
+    std::atomic<bool> running;
+    bool shutdown;
+
+    MpscQueue<LogLine> queue;
+    std::thread thread;
+
+    std::mutex lock;
+    std::condition_variable wakeup;
+    std::atomic<bool> sleeping;
+
+    std::mutex consumerLock;
+
+    std::atomic<uint64_t> numQueued;
+    std::atomic<uint64_t> numWritten;
+    std::atomic<uint64_t> flushTarget;
+    std::mutex flushLock;
+    std::condition_variable flushed;
+
+    /* used when writing synchronously */
+    std::mutex syncLock;
+};
+
+LogWriterThread & logWriterThread()
+{
+    // Will leak, so that the lines logged by static destructors still go
+    // somewhere.
+    static LogWriterThread * writer = new LogWriterThread;
+    return *writer;
+}
+
+const int crashSignals[] = { SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT };
+
+/** Actions that were installed before ours, to be chained to. */
+struct sigaction previousActions[NSIG];
+
+void onCrashSignal(int signum, siginfo_t * info, void * context)
+{
+    logWriterThread().flushOnCrash();
+
+    /* the signal is blocked until we return, at which point it is delivered
+       again to whatever handled it before us */
+    sigaction(signum, &previousActions[signum], nullptr);
+    raise(signum);
+}
+
+std::terminate_handler previousTerminate;
+
+void onTerminate()
+{
+    logWriterThread().flushOnCrash();
+    if (previousTerminate) {
+        previousTerminate();
+    }
+    abort();
+}
+
+} // namespace anonymous
+
+void Logging::flush() {
+    logWriterThread().flush();
+}
+
+void Logging::flushOnCrash() {
+    static std::once_flag installed;
+    std::call_once(installed, [] () {
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_sigaction = onCrashSignal;
+        action.sa_flags = SA_SIGINFO;
+        sigemptyset(&action.sa_mask);
+        for (int signum: crashSignals) {
+            int res = sigaction(signum, &action, &previousActions[signum]);
+            if (res == -1) {
+                throw ML::Exception(errno, "sigaction");
+            }
+        }
+        previousTerminate = std::set_terminate(onTerminate);
+    });
+}
+
+void Logging::setAsync(bool async) {
+    if (!async) {
+        flush();
+    }
+    logWriterThread().async = async;
+}
 
 std::ostream & Logging::Category::beginWrite(char const * fct, char const * file, int line) {
-    loggingMutex.lock();
+    ThreadBuffers & buffers = threadBuffers();
+    buffers.updateTimestamp();
 
-    timeval now;
-    gettimeofday(&now, 0);
-    char text[64];
-    auto count = strftime(text, sizeof(text), "%Y-%m-%d %H:%M:%S", localtime(&now.tv_sec));
-    int ms = now.tv_usec / 1000;
-    sprintf(text + count, ".%03d", ms);
-    data->writer->head(text, data->name, fct, file, line);
-    return data->stream;
+    LineBuffer & buffer = buffers.push();
+    buffer.category = data;
+    buffer.function = fct;
+    buffer.file = file;
+    buffer.line = line;
+    memcpy(buffer.timestamp, buffers.timestamp, sizeof(buffer.timestamp));
+
+    return buffer.stream;
 }
 
 void Logging::Printer::operator&(std::ostream & stream) {
-    std::stringstream & text = (std::stringstream &) stream;
-    category.getWriter()->body(text.str());
-    text.str("");
-
-    loggingMutex.unlock();
+    LineBuffer & buffer = threadBuffers().pop();
+    ExcAssertEqual(&stream, &buffer.stream);
+
+    std::unique_ptr<LogLine> line(new LogLine());
+    line->writer = buffer.category->writer;
+    memcpy(line->timestamp, buffer.timestamp, sizeof(line->timestamp));
+    line->name = buffer.category->name;
+    line->function = buffer.function;
+    line->file = buffer.file;
+    line->line = buffer.line;
+    line->body = buffer.stream.str();
+    buffer.stream.str("");
+    buffer.stream.clear();
+
+    LogWriterThread & writer = logWriterThread();
+    if (writer.async) {
+        writer.enqueue(line.release());
+    }
+    else {
+        std::lock_guard<std::mutex> guard(writer.syncLock);
+        writeLine(*line);
+    }
 }
 
 void Logging::Thrower::operator&(std::ostream & stream) {
-    std::stringstream & text = (std::stringstream &) stream;
-    std::string message(text.str());
-    text.str("");
-    loggingMutex.unlock();
+    LineBuffer & buffer = threadBuffers().pop();
+    ExcAssertEqual(&stream, &buffer.stream);
+
+    std::string message(buffer.stream.str());
+    buffer.stream.str("");
+    buffer.stream.clear();
 
     throw ML::Exception(message);
 }
@@ -51,8 +51,17 @@
      - FileWriter
      - JsonWriter
 
-  NOTE: Those writers aren't thread-safe at the moment. Use with care
-  accross threads.
+   Lines are formatted into a buffer of the calling thread and handed over
+   to a background thread, which is the only one to call the writers, so
+   that logging from many threads doesn't serialize them.  The lines still
+   queued are written at exit; Logging::flush() writes them on demand and
+   Logging::flushOnCrash() installs handlers that write them when the
+   process dies on a fatal signal or std::terminate.
+
+     int main() {
+       Logging::flushOnCrash();
+       ...
+     }
 
 */
 
@@ -142,6 +151,20 @@ struct Logging
         std::stringstream stream;
     };
 
+    /** Write all the lines logged so far before returning.  Thread-safe. */
+    static void flush();
+
+    /** Flush the pending lines when the process crashes, ie on SIGSEGV,
+        SIGBUS, SIGFPE, SIGILL, SIGABRT and std::terminate, before letting
+        the crash proceed.
+    */
+    static void flushOnCrash();
+
+    /** Whether lines are written by the background thread (the default) or
+        directly by the thread that logs them, under a lock.
+    */
+    static void setAsync(bool async);
+
     struct CategoryData;
 
     struct Category {
@@ -62,6 +62,15 @@ doLoops(uint64_t numTimeouts)
 
         if (load > maxLoad.load) maxLoad.load = load;
         recordLevel(load, loop.first);
+
+        if (metrics) {
+            auto it = gauges.find(loop.first);
+            if (it == gauges.end()) {
+                auto gauge = metrics->gauge(serviceName() + "." + loop.first);
+                it = gauges.insert(make_pair(loop.first, gauge)).first;
+            }
+            it->second.set(load);
+        }
     }
 
     curLoad.packed = maxLoad.packed;
@@ -96,6 +105,16 @@ addCallback(const string& name, const SampleLoadFn& cb)
     ExcCheck(ret.second, "loop already being monitored: " + name);
 }
 
+void
+LoopMonitor::
+exportTo(const shared_ptr<ShmMetrics>& metrics)
+{
+    std::lock_guard<ML::Spinlock> guard(lock);
+
+    this->metrics = metrics;
+    gauges.clear();
+}
+
 void
 LoopMonitor::
 remove(const string& name)
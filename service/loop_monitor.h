@@ -10,6 +10,7 @@
 
 #include "message_loop.h"
 #include "service_base.h"
+#include "shm_metrics.h"
 #include "jml/arch/spinlock.h"
 #include "jml/utils/rng.h"
 
@@ -85,6 +86,12 @@ struct LoopMonitor : public ServiceBase, public MessageLoop
     /** Called whenever the value returned by sampleLoad changes. */
     std::function<void(double load)> onLoadChange;
 
+    /** Also export the load of each loop as a "<name>.<loop>" gauge of the
+        given metrics segment, where they can be sampled by a local agent.
+        Thread-safe.
+     */
+    void exportTo(const std::shared_ptr<ShmMetrics>& metrics);
+
 private:
 
     void doLoops(uint64_t numTimeouts);
@@ -94,6 +101,9 @@ private:
     mutable ML::Spinlock lock;
     std::map<std::string, SampleLoadFn> loops;
 
+    std::shared_ptr<ShmMetrics> metrics;
+    std::map<std::string, ShmMetrics::Gauge> gauges;
+
     LoadSample curLoad;
 };
 
@@ -105,6 +115,9 @@ private:
 /** Simple load shedding that attempts to stabilize the load of the system at
     around a threshold by randomly dropping messages with a probability that
     is adjusted over time with the system's load.
+
+    See AdmissionControl for shedding that reacts within a message to the
+    latency of a queue and that supports priorities.
  */
 struct LoadStabilizer
 {
@@ -20,6 +20,7 @@
 #include "soa/service/logs.h"
 
 #include "message_loop.h"
+#include "cpu_accounting.h"
 
 using namespace std;
 
@@ -79,6 +80,12 @@ init(int numThreads, double maxAddedLatency, int epollTimeout)
        events, without requiring the use of an additional signal fd. */
     addFd(sourceActions_.selectFd(), &sourceActions_);
 
+    /* Likewise for the timers */
+    addFd(timers_.selectFd(), &timers_);
+
+    sourceActions_.cpuAccount_ = CpuAccounting::forSource("_sourceActions");
+    timers_.cpuAccount_ = CpuAccounting::forSource("_timers");
+
     debug_ = false;
 }
 
@@ -121,6 +128,8 @@ void
 MessageLoop::
 shutdown()
 {
+    removeAllPeriodic();
+
     if (shutdown_)
         return;
 
@@ -178,9 +187,47 @@ addPeriodic(const std::string & name,
             std::function<void (uint64_t)> toRun,
             int priority)
 {
-    auto newPeriodic
-        = make_shared<PeriodicEventSource>(timePeriodSeconds, toRun);
-    return addSource(name, newPeriodic, priority);
+    CpuAccount * account = CpuAccounting::forSource(name);
+    auto onTimer = [account, toRun] (uint64_t numWakeups)
+        {
+            CpuAccountingScope accounting(account);
+            toRun(numWakeups);
+        };
+
+    Guard guard(periodicLock);
+    TimerService::TimerId id
+        = timers_.schedulePeriodic(timePeriodSeconds, std::move(onTimer));
+    periodicTimers_.emplace_back(name, id);
+    return true;
+}
+
+bool
+MessageLoop::
+removePeriodic(const std::string & name)
+{
+    bool found = false;
+
+    Guard guard(periodicLock);
+    for (auto it = periodicTimers_.begin();  it != periodicTimers_.end();) {
+        if (it->first == name) {
+            timers_.cancel(it->second);
+            it = periodicTimers_.erase(it);
+            found = true;
+        }
+        else ++it;
+    }
+
+    return found;
+}
+
+void
+MessageLoop::
+removeAllPeriodic()
+{
+    Guard guard(periodicLock);
+    for (auto & entry: periodicTimers_)
+        timers_.cancel(entry.second);
+    periodicTimers_.clear();
 }
 
 bool
@@ -359,7 +406,11 @@ handleEpollEvent(epoll_event & event)
              << Epoller::poll() << endl;
     }
 
-    int res = source->processOne();
+    int res;
+    {
+        CpuAccountingScope accounting(source->cpuAccount_);
+        res = source->processOne();
+    }
 
     if (debug) {
         cerr << "source " << ML::type_name(*source) << " had processOne() result " << res << endl;
@@ -410,7 +461,9 @@ processAddSource(const SourceEntry & entry)
     }
 
     if (debug_) entry.source->debug(true);
+    entry.source->cpuAccount_ = CpuAccounting::forSource(entry.name);
     sources.push_back(entry);
+    entry.source->onAttached(*this);
 
     if (needsPoll) {
         string pollingSources;
@@ -453,9 +506,10 @@ processRemoveSource(const SourceEntry & rmEntry)
     sources.erase(it);
 
     entry.source->parent_ = nullptr;
+    entry.source->onDetached(*this);
     int fd = entry.source->selectFd();
-    if (fd == -1) return;
-    removeFd(fd);
+    if (fd != -1)
+        removeFd(fd);
 
     // Make sure that our and our parent's value of needsPoll is up to date
     bool sourceNeedsPoll = entry.source->needsPoll;
@@ -509,11 +563,20 @@ processOne()
     // NOTE: this is required for some buggy sources that don't have a reliable FD to
     // sleep on.  It shouldn't be substantially less efficient.
     if (needsPoll || true) {
-        more = sourceActions_.processOne();
+        {
+            CpuAccountingScope accounting(sourceActions_.cpuAccount_);
+            more = sourceActions_.processOne();
+        }
+        {
+            CpuAccountingScope accounting(timers_.cpuAccount_);
+            timers_.processOne();
+        }
 
         for (unsigned i = 0;  i < sources.size();  ++i) {
             try {
-                bool hasMore = sources[i].source->processOne();
+                AsyncEventSource & source = *sources[i].source;
+                CpuAccountingScope accounting(source.cpuAccount_);
+                bool hasMore = source.processOne();
                 if (debug_)
                     cerr << "source " << sources[i].name << " has " << hasMore << endl;
                 more = more || hasMore;
@@ -15,6 +15,7 @@
 
 #include "epoller.h"
 #include "async_event_source.h"
+#include "timer_service.h"
 #include "typed_message_channel.h"
 #include "logs.h"
 
@@ -81,15 +82,33 @@ struct MessageLoop : public Epoller {
         since the last call; this is useful to know if something has
         got behind.  It will normally be 1.
 
-        Note that this function call will not take effect immediately. All work
-        is deferred to the main message loop thread.
+        The job is scheduled on the timer service of the loop, with the
+        default slack of a periodic timer, and its time is accounted under
+        the given name.  It runs until it is removed with removePeriodic()
+        or the loop is shut down.  Timers have no priority: the argument is
+        only kept for compatibility and is ignored.
 
-        Returns true if the request was successfully enqueued, false otherwise.
+        Returns true if the job was scheduled.
     */
     bool addPeriodic(const std::string & name,
                      double timePeriodSeconds,
                      std::function<void (uint64_t)> toRun,
                      int priority = 0);
+
+    /** Remove the periodic jobs that were added under the given name.  A
+        job that is running finishes, but is not called again.
+
+        Returns false if there was no such job.
+    */
+    bool removePeriodic(const std::string & name);
+
+    /** Timers of the loop, which share a single timer fd.  Their callbacks
+        are called from the thread of the loop.
+    */
+    TimerService & timers()
+    {
+        return timers_;
+    }
     
     typedef std::function<void (volatile int & shutdown_,
                                 int64_t threadId)> SubordinateThreadFn;
@@ -191,6 +210,16 @@ private:
     TypedMessageQueue<SourceAction> sourceActions_;
     // ML::Wakeup_Fd queueFd;
 
+    /* Timers of the loop and of its periodic sources */
+    TimerService timers_;
+
+    /* Periodic jobs added with addPeriodic(), with their name */
+    Lock periodicLock;
+    std::vector<std::pair<std::string, TimerService::TimerId> >
+        periodicTimers_;
+
+    void removeAllPeriodic();
+
     Lock threadsLock;
     int numThreadsCreated;
     std::vector<std::thread> threads;
@@ -0,0 +1,125 @@
+/* mpsc_queue.h                                                    -*- C++ -*-
+   Copyright (c) 2014 Datacratic.  All rights reserved.
+
+   Intrusive multiple-producer, single-consumer queue.
+*/
+
+#pragma once
+
+#include <atomic>
+
+
+namespace Datacratic {
+
+
+/*****************************************************************************/
+/* MPSC QUEUE                                                                */
+/*****************************************************************************/
+
+/** Base class for the nodes of an MpscQueue. */
+
+struct MpscQueueNode {
+    MpscQueueNode()
+        : next(nullptr)
+    {
+    }
+
+    std::atomic<MpscQueueNode *> next;
+};
+
+/** Intrusive, unbounded multiple-producer single-consumer FIFO queue
+    (Vyukov's algorithm).  Pushing is wait free: a single atomic exchange
+    and a store, with no allocation.  Popping must only ever be done by
+    one thread at a time.
+
+    A push that is in progress may make pop() return null even though
+    empty() is false; producers are expected to wake the consumer up once
+    push() has returned, at which point the node is guaranteed to be
+    visible.
+
+    The queue never owns the nodes; whatever is left in it when it is
+    destroyed needs to be popped by the owner.
+*/
+
+template<typename Node>
+struct MpscQueue {
+
+    MpscQueue()
+        : head_(&stub_), tail_(&stub_)
+    {
+    }
+
+    MpscQueue(const MpscQueue & other) = delete;
+    MpscQueue & operator = (const MpscQueue & other) = delete;
+
+    /** Add a node to the queue.  Thread safe. */
+    void push(Node * node)
+    {
+        pushNode(node);
+    }
+
+    /** Remove the oldest node from the queue, or return null if it is
+        empty.  Only one thread may be popping at a time.
+    */
+    Node * pop()
+    {
+        MpscQueueNode * tail = tail_;
+        MpscQueueNode * next = tail->next.load(std::memory_order_acquire);
+
+        if (tail == &stub_) {
+            if (!next)
+                return nullptr;
+            tail_ = next;
+            tail = next;
+            next = next->next.load(std::memory_order_acquire);
+        }
+
+        if (next) {
+            tail_ = next;
+            return static_cast<Node *>(tail);
+        }
+
+        // A producer has swapped the head but not yet linked its node
+        if (tail != head_.load(std::memory_order_acquire))
+            return nullptr;
+
+        // Last node; put the stub back behind it so that we can take it
+        pushNode(&stub_);
+
+        next = tail->next.load(std::memory_order_acquire);
+        if (next) {
+            tail_ = next;
+            return static_cast<Node *>(tail);
+        }
+
+        return nullptr;
+    }
+
+    /** Is the queue empty?  Can be called from any thread, but is only a
+        snapshot.
+    */
+    bool empty() const
+    {
+        return head_.load(std::memory_order_acquire) == &stub_;
+    }
+
+private:
+    /** Most recently pushed node; producers swap themselves in here. */
+    std::atomic<MpscQueueNode *> head_;
+
+    /** Oldest node; only touched by the consumer. */
+    MpscQueueNode * tail_;
+
+    /** Placeholder node that keeps the list non-empty. */
+    MpscQueueNode stub_;
+
+    void pushNode(MpscQueueNode * node)
+    {
+        node->next.store(nullptr, std::memory_order_relaxed);
+        MpscQueueNode * prev
+            = head_.exchange(node, std::memory_order_acq_rel);
+        prev->next.store(node, std::memory_order_release);
+    }
+};
+
+} // namespace Datacratic
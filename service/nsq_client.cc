@@ -4,8 +4,13 @@
 */
 
 #include <endian.h>
+#include <string.h>
+#include <unistd.h>
 #include <arpa/inet.h>
+#include <sys/timerfd.h>
 
+#include <algorithm>
+#include <cstdlib>
 #include <iostream>
 #include <mutex>
 #include <vector>
@@ -42,128 +47,197 @@ NsqIdentifyPayloadDescription()
 
 /* NSQ CLIENT */
 
+namespace {
+
+/* default bounds of the MPUB batches */
+const size_t DefaultPubMaxMessages(500);
+const size_t DefaultPubMaxBytes(512 * 1024);
+const double DefaultPubMaxDelay(0.005);
+
+/* default RDY control */
+const int DefaultRdyMin(1);
+const int DefaultRdyMax(2500);
+const double DefaultRdyWindow(0.25);
+const int InitialRdy(1000);
+
+/* buffers kept for reuse once written */
+const size_t MaxSpareBuffers(8);
+
+/* frames may start anywhere in the received data */
+uint32_t
+readUInt32(const char * data)
+{
+    uint32_t value;
+    ::memcpy(&value, data, sizeof(value));
+    return ntohl(value);
+}
+
 void
+writeUInt32(char * data, uint32_t value)
+{
+    value = htonl(value);
+    ::memcpy(data, &value, sizeof(value));
+}
+
+void
+appendUInt32(string & buffer, uint32_t value)
+{
+    value = htonl(value);
+    buffer.append((const char *) &value, sizeof(value));
+}
+
+/* size of the frame starting at "data", including its size field */
+size_t
+frameSize(const char * data)
+{
+    uint32_t size = readUInt32(data);
+    if (size < 4) {
+        throw ML::Exception("invalid nsq frame size: %u", size);
+    }
+    return 4 + size;
+}
+
+} // file scope
+
 NsqClient::
-onReceivedData(const char * bufferData, size_t bufferSize)
+NsqClient(OnClosed onClosed, const OnMessage & onMessage)
+    : TcpClient(onClosed, nullptr, nullptr, 0),
+      pubMaxMessages_(DefaultPubMaxMessages),
+      pubMaxBytes_(DefaultPubMaxBytes),
+      pubMaxDelay_(DefaultPubMaxDelay),
+      pubTimerFd_(-1), pubTimerArmed_(false),
+      onMessage_(onMessage),
+      rdyMin_(DefaultRdyMin), rdyMax_(DefaultRdyMax),
+      rdyWindow_(DefaultRdyWindow),
+      rdyCount_(0), rdyReceived_(0), rdyRate_(0.0)
 {
-    const char * data;
-    size_t dataSize;
-    bool fromBuffer;
+    setUseNagle(true);
 
-    if (parserBuffer_.size() > 0) {
-        parserBuffer_.append(bufferData, bufferSize);
-        data = parserBuffer_.c_str();
-        fromBuffer = true;
-        dataSize = parserBuffer_.size();
+    recycleBufferCb_ = [&] (AsyncWriteResult result) {
+        this->recycleBuffer(move(result));
+    };
+
+    pubTimerFd_ = ::timerfd_create(CLOCK_MONOTONIC,
+                                   TFD_NONBLOCK | TFD_CLOEXEC);
+    if (pubTimerFd_ == -1) {
+        throw ML::Exception(errno, "timerfd_create");
     }
-    else {
-        data = bufferData;
-        fromBuffer = false;
-        dataSize = bufferSize;
+    auto handlePubTimerCb = [&] (const ::epoll_event & event) {
+        this->handlePubTimer();
+    };
+    addFd(pubTimerFd_, true, false, handlePubTimerCb);
+}
+
+NsqClient::
+~NsqClient()
+{
+    if (pubTimerFd_ != -1) {
+        removeFd(pubTimerFd_);
+        ::close(pubTimerFd_);
     }
+}
 
-    auto parseUInt32 = [&] (uint32_t & value) {
-        if (dataSize < 4) {
-            if (!fromBuffer) {
-                parserBuffer_.assign(data, dataSize);
-            }
-            return false;
-        }
-        value = ntohl(*(uint32_t *) data);
-        data += 4;
-        dataSize -= 4;
-        parserStep_++;
+void
+NsqClient::
+setPubBatching(size_t maxMessages, size_t maxBytes, double maxDelay)
+{
+    unique_lock<mutex> guard(callbacksLock_);
+    pubMaxMessages_ = maxMessages;
+    pubMaxBytes_ = maxBytes;
+    pubMaxDelay_ = maxDelay;
+}
 
-        return true;
-    };
+void
+NsqClient::
+setRdyControl(int minRdy, int maxRdy, double window)
+{
+    if (minRdy < 1 || maxRdy < minRdy || window <= 0) {
+        throw ML::Exception("invalid rdy control: [%d, %d] over %fs",
+                            minRdy, maxRdy, window);
+    }
+    rdyMin_ = minRdy;
+    rdyMax_ = maxRdy;
+    rdyWindow_ = window;
+}
 
-    int responseHandled(0);
-    while (dataSize > 0) {
-        if (parserStep_ == 0) {
-            if (!parseUInt32(parserRemaining_)) {
-                return;
-            }
+void
+NsqClient::
+onReceivedData(const char * data, size_t size)
+{
+    /* complete the frame left over from the previous reads */
+    while (parserBuffer_.size() > 0 && size > 0) {
+        size_t needed(4);
+        if (parserBuffer_.size() >= 4) {
+            needed = frameSize(parserBuffer_.c_str());
         }
-        if (parserStep_ == 1) {
-            uint32_t responseType;
-            if (!parseUInt32(responseType)) {
-                return;
-            }
-            parserFrame_.type = (NsqFrameType) responseType;
-            parserRemaining_ -= 4;
+        size_t chunkSize = min(needed - parserBuffer_.size(), size);
+        parserBuffer_.append(data, chunkSize);
+        data += chunkSize;
+        size -= chunkSize;
+        if (needed > 4 && parserBuffer_.size() == needed) {
+            handleFrame(parserBuffer_.c_str() + 4, needed - 4);
+            parserBuffer_.clear();
         }
-        if (parserStep_ == 2) {
-            size_t chunkSize = dataSize;
-            if (chunkSize > parserRemaining_) {
-                chunkSize = parserRemaining_;
-            }
-            parserFrame_.data.append(data, chunkSize);
-            parserRemaining_ -= chunkSize;
-            if (parserRemaining_ == 0) {
-                handleFrame();
-                responseHandled++;
-                parserStep_ = 0;
-            }
-            data += chunkSize;
-            dataSize -= chunkSize;
-            if (dataSize > 0) {
-                if (fromBuffer) {
-                    parserBuffer_.assign(data, dataSize);
-                    data = parserBuffer_.c_str();
-                }
-            }
-            else {
-                parserBuffer_.clear();
-                return;
-            }
+    }
+
+    /* the complete frames are handled in place */
+    while (size >= 4) {
+        size_t needed = frameSize(data);
+        if (size < needed) {
+            break;
         }
+        handleFrame(data + 4, needed - 4);
+        data += needed;
+        size -= needed;
+    }
+
+    if (size > 0) {
+        parserBuffer_.append(data, size);
     }
-    cerr << "response handled: " + to_string(responseHandled) + "\n";
 }
 
 void
 NsqClient::
-forceWrite(string data)
+forceWrite(string data, const OnWriteResult & onWriteResult)
 {
-    bool paused(false);
-    while (!write(move(data), nullptr)) {
-        if (!paused) {
-            paused = true;
-            ::fprintf(stderr, "queue is full (%s)...\n", data.c_str());
-        }
-        ML::sleep(0.1);
-    }
-    if (paused) {
-        ::fprintf(stderr, "queue reestablished\n");
+    /* the queue is unbounded (maxMessages = 0), "write" only fails when the
+       connection is closed */
+    if (!write(move(data), onWriteResult)) {
+        throw ML::Exception("nsq write failed");
     }
 }
 
 void
 NsqClient::
-handleFrame()
+handleFrame(const char * data, size_t size)
 {
-    switch (parserFrame_.type) {
+    NsqFrameType type = (NsqFrameType) readUInt32(data);
+    data += 4;
+    size -= 4;
+
+    switch (type) {
     case NsqFrameType::Response:
     case NsqFrameType::Error: {
-        handleCommandFrame();
+        handleCommandFrame(type, data, size);
         break;
     }
     case NsqFrameType::Message: {
-        handleNsqMessage();
+        handleNsqMessage(data, size);
         break;
     }
     default: 
         throw ML::Exception("unhandled response type");
     };
-
-    parserFrame_.data.clear();
 }
 
 void 
 NsqClient::
-handleCommandFrame()
+handleCommandFrame(NsqFrameType type, const char * data, size_t size)
 {
-    if (parserFrame_.data == "_heartbeat_") {
+    static const char heartbeat[] = "_heartbeat_";
+
+    if (size == sizeof(heartbeat) - 1
+        && ::memcmp(data, heartbeat, size) == 0) {
         nop();
     }
     else {
@@ -172,35 +246,85 @@ handleCommandFrame()
         {
             unique_lock<mutex> guard(callbacksLock_);
             ExcAssert(!callbacks_.empty());
-            onFrame = callbacks_.front();
+            onFrame = move(callbacks_.front());
             callbacks_.pop();
         }
 
         if (onFrame) {
-            onFrame(parserFrame_);
+            NsqFrame frame;
+            frame.type = type;
+            frame.data.assign(data, size);
+            onFrame(frame);
         }
     }
 }
 
 void 
 NsqClient::
-handleNsqMessage()
+handleNsqMessage(const char * data, size_t size)
 {
-    const char * data = parserFrame_.data.c_str();
+    if (size < 26) {
+        throw ML::Exception("nsq message too short");
+    }
 
-    uint64_t nanos = be64toh(*(uint64_t *) data);
+    uint64_t nanos;
+    ::memcpy(&nanos, data, sizeof(nanos));
+    nanos = be64toh(nanos);
     double nanoDouble = (double) nanos;
     Date ts = Date::fromSecondsSinceEpoch(nanoDouble / 1000000000);
-    uint16_t attempts = ntohs(*(uint16_t *) (data + 8));
+    uint16_t attempts;
+    ::memcpy(&attempts, data + 8, sizeof(attempts));
+    attempts = ntohs(attempts);
     string messageId(data + 10, 16);
-    string message(data + 26,
-                   parserFrame_.data.size() - 26);
+    string message(data + 26, size - 26);
 
     onMessage(ts, attempts, messageId, message);
 
-    remainingRdy_--;
-    if (remainingRdy_ == 0) {
-        resetRdy();
+    rdyReceived_++;
+    if (rdyReceived_ >= max(rdyCount_ / 4, 1)) {
+        adjustRdy();
+    }
+}
+
+void
+NsqClient::
+startRdy()
+{
+    rdyCount_ = min(max(InitialRdy, rdyMin_), rdyMax_);
+    rdyReceived_ = 0;
+    rdyRate_ = 0.0;
+    rdyLastAdjustment_ = Date::now();
+    rdy(rdyCount_);
+}
+
+void
+NsqClient::
+adjustRdy()
+{
+    Date now = Date::now();
+    double elapsed = now.secondsSince(rdyLastAdjustment_);
+    if (elapsed <= 0) {
+        return;
+    }
+
+    /* The rate is limited either by the consumer or by the RDY count
+       itself. In the latter case, as long as messages are processed in less
+       than "window" seconds, the new count is larger than the current
+       one. */
+    double rate = rdyReceived_ / elapsed;
+    rdyRate_ = (rdyRate_ > 0.0) ? (rdyRate_ + rate) / 2 : rate;
+    rdyReceived_ = 0;
+    rdyLastAdjustment_ = now;
+
+    double target = rdyRate_ * rdyWindow_;
+    int count = max(rdyMin_, (int) min<double>(target, rdyMax_));
+
+    /* avoid sending RDY for small variations */
+    if (abs(count - rdyCount_) * 8 > rdyCount_
+        || (count != rdyCount_
+            && (count == rdyMin_ || count == rdyMax_))) {
+        rdyCount_ = count;
+        rdy(count);
     }
 }
 
@@ -226,6 +350,13 @@ connectSync()
     auto onConnectionResult = [&, this] (TcpConnectionResult newResult) {
         if (newResult.code == TcpConnectionCode::Success) {
             forceWrite("  V2");
+
+            /* batches left over while disconnected are sent within
+               maxDelay */
+            unique_lock<mutex> guard(callbacksLock_);
+            if (hasPendingBatches()) {
+                armPubTimer();
+            }
         }
         result = move(newResult);
         ML::memory_barrier();
@@ -255,6 +386,7 @@ NsqClient::
 cls(const OnFrame & onFrame)
 {
     unique_lock<mutex> guard(callbacksLock_);
+    flushBatches();
     callbacks_.emplace(onFrame);
     forceWrite("CLS\n");
 }
@@ -283,7 +415,7 @@ sub(const string & topic, const string & channel,
     unique_lock<mutex> guard(callbacksLock_);
     callbacks_.emplace(onFrame);
     forceWrite("SUB " + topic + " " + channel + "\n");
-    resetRdy();
+    startRdy();
 }
 
 void
@@ -292,12 +424,186 @@ pub(const string & topic, const string & message,
     const OnFrame & onFrame)
 {
     unique_lock<mutex> guard(callbacksLock_);
-    callbacks_.emplace(onFrame);
-    string pubMsg = "PUB " + topic + "\n";
-    uint32_t dataSize = htonl(message.size());
-    pubMsg.append((char *) &dataSize, sizeof(dataSize));
-    pubMsg.append(message);
-    forceWrite(move(pubMsg));
+
+    if (pubMaxMessages_ <= 1) {
+        callbacks_.emplace(onFrame);
+        string pubMsg = takeBuffer();
+        pubMsg.append("PUB ");
+        pubMsg.append(topic);
+        pubMsg.append(1, '\n');
+        appendUInt32(pubMsg, message.size());
+        pubMsg.append(message);
+        forceWrite(move(pubMsg), recycleBufferCb_);
+        return;
+    }
+
+    PubBatch & batch = pubBatches_[topic];
+    if (batch.numMessages > 0
+        && batch.buffer.size() + 4 + message.size() > pubMaxBytes_) {
+        flushBatch(batch);
+    }
+    if (batch.numMessages == 0) {
+        /* "MPUB topic\n" followed by the body size and the number of
+           messages, which are filled in by flushBatch */
+        batch.buffer = takeBuffer();
+        batch.buffer.append("MPUB ");
+        batch.buffer.append(topic);
+        batch.buffer.append(1, '\n');
+        batch.buffer.append(8, '\0');
+        armPubTimer();
+    }
+
+    appendUInt32(batch.buffer, message.size());
+    batch.buffer.append(message);
+    batch.numMessages++;
+    batch.callbacks.emplace_back(onFrame);
+
+    if (batch.numMessages >= pubMaxMessages_
+        || batch.buffer.size() >= pubMaxBytes_) {
+        flushBatch(batch);
+    }
+}
+
+void
+NsqClient::
+flushPub()
+{
+    unique_lock<mutex> guard(callbacksLock_);
+    flushBatches();
+}
+
+void
+NsqClient::
+flushBatch(PubBatch & batch)
+{
+    if (batch.numMessages == 0) {
+        return;
+    }
+
+    string & buffer = batch.buffer;
+    size_t headerSize = buffer.find('\n') + 1;
+    writeUInt32(&buffer[headerSize], buffer.size() - headerSize - 4);
+    writeUInt32(&buffer[headerSize + 4], batch.numMessages);
+
+    /* one response for the whole batch */
+    vector<OnFrame> callbacks;
+    callbacks.swap(batch.callbacks);
+    bool hasCallbacks(false);
+    for (const auto & callback: callbacks) {
+        if (callback) {
+            hasCallbacks = true;
+            break;
+        }
+    }
+    if (hasCallbacks) {
+        auto onFrame = [callbacks] (const NsqFrame & frame) {
+            for (const auto & callback: callbacks) {
+                if (callback) {
+                    callback(frame);
+                }
+            }
+        };
+        callbacks_.emplace(move(onFrame));
+    }
+    else {
+        callbacks_.emplace(nullptr);
+    }
+
+    batch.numMessages = 0;
+    forceWrite(move(buffer), recycleBufferCb_);
+    buffer.clear();
+}
+
+void
+NsqClient::
+flushBatches()
+{
+    for (auto & it: pubBatches_) {
+        flushBatch(it.second);
+    }
+}
+
+void
+NsqClient::
+armPubTimer()
+{
+    if (pubTimerArmed_) {
+        return;
+    }
+
+    struct itimerspec spec;
+    ::memset(&spec, 0, sizeof(spec));
+    int64_t nsecs = pubMaxDelay_ * 1000000000;
+    if (nsecs <= 0) {
+        nsecs = 1;
+    }
+    spec.it_value.tv_sec = nsecs / 1000000000;
+    spec.it_value.tv_nsec = nsecs % 1000000000;
+    if (::timerfd_settime(pubTimerFd_, 0, &spec, nullptr) == -1) {
+        throw ML::Exception(errno, "timerfd_settime");
+    }
+    pubTimerArmed_ = true;
+}
+
+void
+NsqClient::
+handlePubTimer()
+{
+    uint64_t expirations;
+    ssize_t res = ::read(pubTimerFd_, &expirations, sizeof(expirations));
+    if (res == -1) {
+        if (errno == EAGAIN) {
+            return;
+        }
+        throw ML::Exception(errno, "timerfd read");
+    }
+
+    unique_lock<mutex> guard(callbacksLock_);
+    pubTimerArmed_ = false;
+
+    /* without a connection, the batches are kept until connectSync()
+       arms the timer again */
+    if (queueEnabled()) {
+        flushBatches();
+    }
+}
+
+bool
+NsqClient::
+hasPendingBatches()
+    const
+{
+    for (const auto & it: pubBatches_) {
+        if (it.second.numMessages > 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+string
+NsqClient::
+takeBuffer()
+{
+    unique_lock<mutex> guard(buffersLock_);
+    if (spareBuffers_.empty()) {
+        return string();
+    }
+    string buffer(move(spareBuffers_.back()));
+    spareBuffers_.pop_back();
+    return buffer;
+}
+
+void
+NsqClient::
+recycleBuffer(AsyncWriteResult result)
+{
+    /* the capacity of the written buffer is kept for the next commands */
+    unique_lock<mutex> guard(buffersLock_);
+    if (spareBuffers_.size() < MaxSpareBuffers) {
+        result.written.clear();
+        spareBuffers_.emplace_back(move(result.written));
+    }
 }
 
 void
@@ -9,7 +9,11 @@
 
 #pragma once
 
+#include <map>
+#include <mutex>
+#include <queue>
 #include <string>
+#include <vector>
 
 #include "soa/types/date.h"
 #include "soa/types/value_description.h"
@@ -64,6 +68,17 @@ struct NsqFrame {
 /* NSQ CLIENT                                                               */
 /****************************************************************************/
 
+/* Messages given to "pub" are not sent one by one but gathered per topic
+   into MPUB commands, which are sent when they reach "maxMessages" messages
+   or "maxBytes" bytes, or at the latest "maxDelay" seconds after their first
+   message was published. The callback of each message receives the
+   response to its MPUB command.
+
+   Once subscribed, the RDY count follows the rate at which messages are
+   received: it is set to the number of messages received during "window"
+   seconds, within [minRdy, maxRdy], so that the messages in flight match
+   what the consumer can process. */
+
 struct NsqClient : public TcpClient {
     typedef std::function<void (const NsqFrame &)> OnFrame;
     typedef std::function<void (Date, uint16_t,
@@ -71,13 +86,8 @@ struct NsqClient : public TcpClient {
                                 const std::string &)> OnMessage;
 
     NsqClient(OnClosed onClosed = nullptr,
-              const OnMessage & onMessage = nullptr)
-        : TcpClient(onClosed, nullptr, nullptr, 0),
-          parserStep_(0), parserRemaining_(0),
-          onMessage_(onMessage), remainingRdy_(0)
-    {
-        setUseNagle(true);
-    }
+              const OnMessage & onMessage = nullptr);
+    ~NsqClient();
 
     TcpConnectionResult connectSync();
 
@@ -93,8 +103,24 @@ struct NsqClient : public TcpClient {
     void pub(const std::string & topic, const std::string & message,
              const OnFrame & onFrame = nullptr);
 
+    /* send the messages waiting in the MPUB batches */
+    void flushPub();
+
     void fin(const std::string & messageId);
 
+    /* bounds of the MPUB batches; with "maxMessages" <= 1, each message is
+       sent immediately with PUB */
+    void setPubBatching(size_t maxMessages, size_t maxBytes,
+                        double maxDelay);
+
+    /* bounds of the RDY count and period over which the consumer rate is
+       measured; with "minRdy" == "maxRdy", the RDY count is fixed */
+    void setRdyControl(int minRdy, int maxRdy, double window);
+
+    /* current RDY count */
+    int rdyCount() const
+    { return rdyCount_; }
+
     virtual void onMessage(Date ts, uint16_t attempts,
                            const std::string & messageId,
                            const std::string & message);
@@ -102,29 +128,65 @@ struct NsqClient : public TcpClient {
 private:
     void onReceivedData(const char * buffer, size_t bufferSize);
 
-    void forceWrite(std::string data);
+    void forceWrite(std::string data,
+                    const OnWriteResult & onWriteResult = nullptr);
 
-    void handleFrame();
-    void handleCommandFrame();
-    void handleNsqMessage();
+    void handleFrame(const char * data, size_t size);
+    void handleCommandFrame(NsqFrameType type,
+                            const char * data, size_t size);
+    void handleNsqMessage(const char * data, size_t size);
 
-    void resetRdy()
-    {
-        remainingRdy_ = 1000;
-        rdy(1000);
-    }
-
-    /* response parsing */
-    int parserStep_; /* 0 = size; 1 = type; 2 = message */
-    uint32_t parserRemaining_; /* size missing from message */
+    /* response parsing: frames are handled directly from the received data,
+       only a frame split over several reads is copied here */
     std::string parserBuffer_;
-    NsqFrame parserFrame_;
 
     std::mutex callbacksLock_;
     std::queue<OnFrame> callbacks_;
 
+    /* publishing */
+    struct PubBatch {
+        PubBatch()
+            : numMessages(0)
+        {}
+
+        std::string buffer; /* MPUB command being encoded */
+        size_t numMessages;
+        std::vector<OnFrame> callbacks;
+    };
+
+    std::string takeBuffer();
+    void recycleBuffer(AsyncWriteResult result);
+
+    /* must be called with callbacksLock_ held */
+    void flushBatch(PubBatch & batch);
+    void flushBatches();
+    bool hasPendingBatches() const;
+    void armPubTimer();
+    void handlePubTimer();
+
+    size_t pubMaxMessages_;
+    size_t pubMaxBytes_;
+    double pubMaxDelay_;
+    std::map<std::string, PubBatch> pubBatches_;
+    int pubTimerFd_;
+    bool pubTimerArmed_;
+
+    std::mutex buffersLock_;
+    std::vector<std::string> spareBuffers_;
+    OnWriteResult recycleBufferCb_;
+
+    /* flow control */
+    void startRdy();
+    void adjustRdy();
+
     OnMessage onMessage_;
-    int remainingRdy_;
+    int rdyMin_;
+    int rdyMax_;
+    double rdyWindow_;
+    int rdyCount_;
+    int rdyReceived_; /* since the last adjustment */
+    Date rdyLastAdjustment_;
+    double rdyRate_;
 };
 
 } // namespace Datacratic
@@ -10,6 +10,12 @@
 #include <poll.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <netdb.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include "jml/arch/atomic_ops.h"
 #include "jml/arch/backtrace.h"
 #include "jml/arch/futex.h"
@@ -61,43 +67,29 @@ const Command SELECT("SELECT");
 /*****************************************************************************/
 
 
-ReplyType
-Reply::
-type() const
-{
-    ExcAssert(r_);
-    switch (r_->type) {
-    case REDIS_REPLY_STATUS: return STATUS;
-    case REDIS_REPLY_ERROR: return ERROR;
-    case REDIS_REPLY_INTEGER: return INTEGER;
-    case REDIS_REPLY_NIL: return NIL;
-    case REDIS_REPLY_STRING: return STRING;
-    case REDIS_REPLY_ARRAY: return ARRAY;
-    default:
-        throw ML::Exception("unknown Redis reply type %d", r_->type);
-    };
-}
-
 std::string
 Reply::
 getString() const
 {
-    ExcAssert(r_);
-    return std::string(r_->str, r_->str + r_->len);
+    return std::string(data(), dataLength());
 }
 
 std::string
 Reply::
 asString() const
 {
-    ExcAssert(r_);
-    switch (r_->type) {
-    case REDIS_REPLY_STATUS:
-    case REDIS_REPLY_STRING:
-    case REDIS_REPLY_ERROR: return getString();
-    case REDIS_REPLY_INTEGER: return ML::format("%lli", r_->integer);
-    case REDIS_REPLY_NIL: return "";
-    case REDIS_REPLY_ARRAY: return asJson().toString();
+    const ReplyNode & n = node();
+    switch (n.type) {
+    case STATUS:
+    case STRING:
+    case ERROR: return getString();
+    case INTEGER:
+    case BOOLEAN: return ML::format("%lli", n.integer);
+    case DOUBLE: return ML::format("%.17g", n.number);
+    case NIL: return "";
+    case ARRAY:
+    case MAP:
+    case PUSH: return asJson().toString();
     default:
         throw ML::Exception("unknown Redis reply type");
     };
@@ -107,19 +99,21 @@ long long
 Reply::
 asInt() const
 {
-    ExcAssert(r_);
-    ExcAssertEqual(r_->type, REDIS_REPLY_INTEGER);
-    return r_->integer;
+    const ReplyNode & n = node();
+    if (n.type != BOOLEAN)
+        ExcAssertEqual(n.type, INTEGER);
+    return n.integer;
 }
 
 long long
 Reply::
 asInt(long long defaultIfNotInteger)
 {
-    ExcAssert(r_);
-    switch (r_->type) {
-    case REDIS_REPLY_INTEGER: return r_->integer;
-    case REDIS_REPLY_STRING: {
+    const ReplyNode & n = node();
+    switch (n.type) {
+    case INTEGER:
+    case BOOLEAN: return n.integer;
+    case STRING: {
         std::string s = getString();
         char * end = 0;
         long long result = strtoll(s.c_str(), &end, 10);
@@ -127,10 +121,13 @@ asInt(long long defaultIfNotInteger)
             return defaultIfNotInteger;
         return result;
     }
-    case REDIS_REPLY_STATUS:
-    case REDIS_REPLY_ERROR:
-    case REDIS_REPLY_NIL:
-    case REDIS_REPLY_ARRAY: return defaultIfNotInteger;
+    case STATUS:
+    case ERROR:
+    case NIL:
+    case DOUBLE:
+    case ARRAY:
+    case MAP:
+    case PUSH: return defaultIfNotInteger;
     default:
         throw ML::Exception("unknown Redis reply type");
     };
@@ -141,34 +138,54 @@ Json::Value
 Reply::
 asJson() const
 {
-    ExcAssert(r_);
+    const ReplyNode & n = node();
     Json::Value result;
         
-    switch (r_->type) {
+    switch (n.type) {
 
-    case REDIS_REPLY_STATUS:
+    case STATUS:
         result["status"] = getString();
         return result;
 
-    case REDIS_REPLY_ERROR:
+    case ERROR:
         result["error"] = getString();
         return result;
 
-    case REDIS_REPLY_INTEGER:
-        result = (Json::Value::UInt)r_->integer;
+    case INTEGER:
+        result = (Json::Value::UInt)n.integer;
+        return result;
+
+    case BOOLEAN:
+        result = (bool)n.integer;
+        return result;
+
+    case DOUBLE:
+        result = n.number;
         return result;
 
-    case REDIS_REPLY_NIL:
+    case NIL:
         return result;
 
-    case REDIS_REPLY_STRING:
+    case STRING:
         result = getString();
         return result;
 
-    case REDIS_REPLY_ARRAY:
-        for (unsigned i = 0;  i < r_->elements;  ++i)
-            result[i] = (*this)[i].asJson();
+    case MAP:
+        result = Json::Value(Json::objectValue);
+        for (auto it = begin(), e = end();  it != e;  ++it) {
+            std::string key = (*it).asString();
+            result[key] = (*++it).asJson();
+        }
+        return result;
+
+    case ARRAY:
+    case PUSH: {
+        result = Json::Value(Json::arrayValue);
+        unsigned i = 0;
+        for (Reply element: *this)
+            result[i++] = element.asJson();
         return result;
+    }
                 
     default:
         throw ML::Exception("unknown Redis reply type ");
@@ -178,60 +195,46 @@ asJson() const
 
 Reply
 Reply::
-deepCopy() const
+operator [] (size_t index) const
 {
-    return Reply(doDeepCopy(r_.get()), true);
+    const ReplyNode & n = node();
+    ExcAssertLess(index, length());
+
+    // Elements taking one node each can be looked up directly
+    if (n.flat)
+        return Reply(buffer_, index_ + 1 + index);
+
+    uint32_t element = index_ + 1;
+    for (size_t i = 0;  i < index;  ++i)
+        element += buffer_->nodes[element].skip;
+    return Reply(buffer_, element);
 }
 
-redisReply *
+Reply
 Reply::
-doDeepCopy(redisReply * r)
+deepCopy() const
 {
-    redisReply * result = (redisReply *)malloc(sizeof(redisReply));
-    memset(result, 0, sizeof(redisReply));
-    result->type = r->type;
-
-    try {
-        switch (r->type) {
-
-        case REDIS_REPLY_INTEGER:
-        case REDIS_REPLY_NIL:
-            result->integer = r->integer;
-            break;
-        case REDIS_REPLY_STATUS:
-        case REDIS_REPLY_ERROR:
-        case REDIS_REPLY_STRING: {
-            // Copy the string
-            char * str = (char *)malloc(r->len);
-            result->str = str;
-            result->len = r->len;
-            std::copy(r->str, r->str + r->len, str);
-            break;
-        }
-        case REDIS_REPLY_ARRAY: {
-            // Copy the array
-            redisReply ** arr
-                = (redisReply **)malloc(r->elements * sizeof(redisReply *));
-            for (unsigned i = 0;  i < r->elements;  ++i)
-                arr[i] = 0;
-            result->element = arr;
-            result->elements = 0;
-            for (unsigned i = 0;  i < r->elements;  ++i) {
-                result->element[i] = doDeepCopy(r->element[i]);
-                result->elements = i + 1;
-            }
-            break;
-        }
-            
-        default:
-            throw ML::Exception("unknown Redis reply type %d", r->type);
-        };
-    } catch (...) {
-        freeReplyObject(result);
-        throw;
+    const ReplyNode & root = node();
+    auto first = buffer_->nodes.begin() + index_;
+    auto last = first + root.skip;
+
+    size_t size = 0;
+    for (auto it = first;  it != last;  ++it)
+        if (isString(*it))
+            size += it->length;
+
+    std::shared_ptr<ReplyBuffer> result(new ReplyBuffer(size));
+    result->nodes.assign(first, last);
+    for (ReplyNode & n: result->nodes) {
+        if (!isString(n))
+            continue;
+        std::copy(buffer_->str(n), buffer_->str(n) + n.length,
+                  result->data + result->size);
+        n.offset = result->size;
+        result->size += n.length;
     }
 
-    return result;
+    return Reply(std::move(result), 0);
 }
 
 std::ostream & operator << (std::ostream & stream, const Reply & reply)
@@ -389,8 +392,7 @@ enum {
 size_t requestDataCreated = 0;
 size_t requestDataDestroyed = 0;
 
-struct AsyncConnection::RequestData
-    : std::enable_shared_from_this<AsyncConnection::RequestData> {
+struct AsyncConnection::RequestData {
     RequestData()
     {
         ML::atomic_inc(requestDataCreated);
@@ -411,6 +413,116 @@ struct AsyncConnection::RequestData
     int state;
 };
 
+namespace {
+
+/** Opens a non-blocking socket connected, or connecting, to the given
+    address.  connecting is set if the connection is still in progress.
+*/
+int openSocket(const Address & address, bool & connecting)
+{
+    connecting = false;
+
+    if (address.isUnix()) {
+        string path = address.unixPath();
+
+        sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (path.size() >= sizeof(addr.sun_path))
+            throw ML::Exception("unix socket path is too long: " + path);
+        strcpy(addr.sun_path, path.c_str());
+
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                        0);
+        if (fd == -1)
+            throw ML::Exception(errno, "socket");
+        if (::connect(fd, (sockaddr *)&addr, sizeof(addr)) == -1) {
+            int error = errno;
+            ::close(fd);
+            throw ML::Exception("couldn't connect to Redis at %s: %s",
+                                path.c_str(), strerror(error));
+        }
+        return fd;
+    }
+    else if (address.isTcp()) {
+        string host = address.tcpHost();
+        string port = to_string(address.tcpPort());
+
+        addrinfo hints;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+
+        addrinfo * addrs;
+        int res = getaddrinfo(host.c_str(), port.c_str(), &hints, &addrs);
+        if (res != 0)
+            throw ML::Exception("couldn't resolve Redis host %s: %s",
+                                host.c_str(), gai_strerror(res));
+        Call_Guard freeAddrs([&] () { freeaddrinfo(addrs); });
+
+        int error = 0;
+        for (addrinfo * ai = addrs;  ai;  ai = ai->ai_next) {
+            int fd = socket(ai->ai_family,
+                            SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            if (fd == -1) {
+                error = errno;
+                continue;
+            }
+
+            int flag = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+
+            if (::connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+                return fd;
+            if (errno == EINPROGRESS) {
+                connecting = true;
+                return fd;
+            }
+            error = errno;
+            ::close(fd);
+        }
+
+        throw ML::Exception("couldn't connect to Redis at %s: %s",
+                            address.uri().c_str(), strerror(error));
+    }
+    else throw ML::Exception("cannot connect to address that is neither tcp "
+                             "or unix");
+}
+
+void appendInteger(std::string & out, size_t value)
+{
+    char digits[24];
+    char * end = digits + sizeof(digits), * p = end;
+    do {
+        *--p = '0' + value % 10;
+        value /= 10;
+    } while (value);
+    out.append(p, end);
+}
+
+void appendArg(std::string & out, const std::string & arg)
+{
+    out += '$';
+    appendInteger(out, arg.size());
+    out.append("\r\n", 2);
+    out.append(arg);
+    out.append("\r\n", 2);
+}
+
+/** Writes the command in the Redis protocol, as an array of bulk
+    strings. */
+void appendCommand(std::string & out, const Command & command)
+{
+    out += '*';
+    appendInteger(out, command.argc());
+    out.append("\r\n", 2);
+    appendArg(out, command.formatStr);
+    for (const std::string & arg: command.args)
+        appendArg(out, arg);
+}
+
+} // file scope
+
 size_t eventLoopsCreated = 0;
 size_t eventLoopsDestroyed = 0;
 
@@ -421,31 +533,52 @@ struct AsyncConnection::EventLoop {
     AsyncConnection * connection;
     std::shared_ptr<std::thread> thread;
     pollfd fds[2];
-    volatile int disconnected;
+    bool connecting;
+
+    /* Bytes read and the replies parsed from them.  Once replies have been
+       handed out, they share it and it is left to them; otherwise it is
+       reused.  Replies are parsed from parsePos on, once there are at least
+       parseNeeded bytes there; the parser keeps what it parsed of a reply
+       that is not complete yet. */
+    std::shared_ptr<ReplyBuffer> readBuffer;
+    size_t parsePos;
+    size_t parseNeeded;
+    ReplyParser parser;
+
+    /* Results whose callback is being called, swapped with the connection's
+       replyQueue */
+    std::deque<std::pair<std::shared_ptr<RequestData>, Result> > callbacks;
+
+    enum {
+        ReadSize = 65536,  ///< Size of a new read buffer
+        MinRead = 16384    ///< Space to leave for a read
+    };
 
-    EventLoop(AsyncConnection * connection)
+    EventLoop(AsyncConnection * connection, int fd, bool connecting)
         : wakeupfd(O_NONBLOCK)
         , finished(false)
         , connection(connection)
-        , disconnected(1)
+        , connecting(connecting)
+        , readBuffer(new ReplyBuffer(ReadSize))
+        , parsePos(0)
+        , parseNeeded(1)
     {
         ML::atomic_inc(eventLoopsCreated);
         
         fds[0].fd = wakeupfd.fd();
         fds[0].events = POLLIN;
-        fds[1].fd = connection->context_->c.fd;
-        fds[1].events = 0;
-
-        registerMe(connection->context_);
+        fds[1].fd = fd;
+        fds[1].events = POLLIN | (connecting ? POLLOUT : 0);
 
         thread.reset(new std::thread(std::bind(&EventLoop::run, this)));
     }
 
     ~EventLoop()
     {
-        //cerr << "DESTROYING EVENT LOOP" << endl;
         ML::atomic_inc(eventLoopsDestroyed);
         shutdown();
+        if (fds[1].fd != -1)
+            ::close(fds[1].fd);
     }
 
     void shutdown()
@@ -463,28 +596,9 @@ struct AsyncConnection::EventLoop {
         wakeupfd.signal();
     }
     
-    void registerMe(redisAsyncContext * context)
-    {
-        //cerr << "called registerMe" << endl;
-        redisAsyncSetConnectCallback(context, onConnect);
-        redisAsyncSetDisconnectCallback(context, onDisconnect);
-
-        context->ev.data = context->data = this;
-        context->ev.addRead = startReading;
-        context->ev.delRead = stopReading;
-        context->ev.addWrite = startWriting;
-        context->ev.delWrite = stopWriting;
-        context->ev.cleanup = cleanup;
-    }
-
     void run()
     {
-        //wakeup();
-
-        //cerr << this << " starting run loop" << endl;
-
         while (!finished) {
-            //sleep(1);
             Date now = Date::now();
 
             if (connection->earliestTimeout < now)
@@ -492,206 +606,222 @@ struct AsyncConnection::EventLoop {
 
             double timeLeft = now.secondsUntil(connection->earliestTimeout);
 
-            //cerr << "timeLeft = " << timeLeft << endl;
-            //cerr << "fds[0].events = " << fds[0].events << endl;
-            //cerr << "fds[1].events = " << fds[1].events << endl;
-
             int timeout = std::min(1000.0,
                                    std::max<double>(0, 1000 * timeLeft));
 
             if (connection->earliestTimeout == Date::positiveInfinity())
                 timeout = 1000000;
 
-            //cerr << "looping; fd0 = " << fds[1].fd << " timeout = "
-            //     << timeout << endl;
-
             int res = poll(fds, 2, timeout);
             if (res == -1 && errno != EINTR) {
                 cerr << "poll() error: " << strerror(errno) << endl;
             }
-            if (res == 0) continue;  // just a timeout; loop around again
-
-            //cerr << "poll() returned " << res << endl;
+            if (res <= 0) continue;  // just a timeout; loop around again
 
             if (fds[0].revents & POLLIN) {
-                //cerr << "got wakeup" << endl;
                 wakeupfd.read();
-                //cerr << "woken up with " << res << " messages" << endl;
-            }
-            if ((fds[1].revents & POLLHUP)
-                || (fds[1].revents & POLLERR)) {
-                /* For now, we simply disconnect when we receive a POLLHUP, but eventually
-                 * we should try to reconnect or at least notify the user through a callback
-                 */
-                onDisconnect(REDIS_ERR_IO);
-                break;
             }
 
-            if ((fds[1].revents & POLLOUT)
-                && (fds[1].events & POLLOUT)) {
-                //cerr << "got write on " << fds[1].fd << endl;
+            {
                 std::unique_lock<Lock> guard(connection->lock);
-                redisAsyncHandleWrite(connection->context_);
-            }
-            if ((fds[1].revents & POLLIN)
-                && (fds[1].events & POLLIN)) {
-                //cerr << "got read on " << fds[1].fd << endl;
-                std::unique_lock<Lock> guard(connection->lock);
-                redisAsyncHandleRead(connection->context_);
+                if (fds[1].revents)
+                    handleEvents(fds[1].revents);
+
+                // Write the commands queued by startWriting()
+                if (fds[1].fd != -1 && !connecting
+                    && connection->writePos != connection->writeBuffer.size()) {
+                    fds[1].events |= POLLOUT;
+                    handleWrite();
+                }
+
+                callbacks.swap(connection->replyQueue);
             }
 
-            // Now we don't have the lock anymore, do our callbacks
-            while (!connection->replyQueue.empty()) {
+            // Now we don't have the lock anymore, do our callbacks.  The
+            // request is released first, as its owner may go away as soon
+            // as its callback is called.
+            while (!callbacks.empty()) {
+                OnResult onResult
+                    = std::move(callbacks.front().first->onResult);
+                Result result = std::move(callbacks.front().second);
+                callbacks.pop_front();
                 try {
-                    connection->replyQueue.front()();
+                    onResult(result);
                 } catch (...) {
                     cerr << "warning: redis callback threw" << endl;
-                    //abort();
                 }
-                connection->replyQueue.pop_front();
             }
         }
+    }
 
-        if (!disconnected) {
-            // Disconnect
-            //cerr << this << " calling redisAsyncDisconnect" << endl;
-            redisAsyncDisconnect(connection->context_);
-            //redisAsyncFree(connection->context_);
-            //cerr << this << " done redisAsyncDisconnect" << endl;
+    // Called with the lock held
+    void handleEvents(short revents)
+    {
+        if (connecting) {
+            int error = 0;
+            socklen_t len = sizeof(error);
+            if (getsockopt(fds[1].fd, SOL_SOCKET, SO_ERROR, &error, &len)
+                == -1)
+                error = errno;
+            if (error) {
+                disconnect(string("couldn't connect to Redis: ")
+                           + strerror(error));
+                return;
+            }
+            connecting = false;
+            if (connection->writePos == connection->writeBuffer.size())
+                stopWriting();
         }
-        
-        // Wait until we get the callback
-        while (!disconnected) {
-            futex_wait(disconnected, 0);
+
+        if (revents & POLLIN) {
+            if (!handleRead())
+                return;
+        }
+        else if (revents & (POLLHUP | POLLERR)) {
+            disconnect("connection to Redis lost");
+            return;
         }
 
-        //cerr << this << " now disconnected" << endl;
+        if ((revents & POLLOUT) && (fds[1].events & POLLOUT))
+            handleWrite();
     }
 
-    static void onConnect(const redisAsyncContext * context, int status)
+    /* Make room to read into the buffer */
+    void prepareRead()
     {
-        EventLoop * eventLoop = reinterpret_cast<EventLoop *>(context->data);
-
-        if (status == REDIS_OK)
-            eventLoop->onConnect(status);
-        else {
-            /* This function will be called with an error status if the
-               connection failed.  For us it's like a disconnection, so
-               we call into the disconnect code.
-            */
-            cerr << "onConnect: code = " << status << " err = " << context->err
-                 << " errstr = " << context->errstr << " errno = "
-                 << strerror(errno) << endl;
-            eventLoop->onDisconnect(status);
-        }
-    }
+        ReplyBuffer * buffer = readBuffer.get();
+        size_t remaining = buffer->size - parsePos;
+        size_t wanted = std::max<size_t>(parseNeeded, remaining + MinRead);
+
+        if (readBuffer.use_count() == 1
+            && (buffer->capacity <= 4 * ReadSize || wanted > ReadSize)) {
+            // No reply refers to it anymore: reuse it
+            if (buffer->capacity - parsePos >= wanted) {
+                parser.relocate(buffer->nodes, buffer->nodes, parsePos);
+                return;
+            }
 
-    void onConnect(int status)
-    {
-        //cerr << "connection on fd " << connection->context_->c.fd << endl;
-        //cerr << "status = " << status << endl;
-        fds[1].fd = connection->context_->c.fd;
-        wakeup();
-        disconnected = 0;
-        futex_wake(disconnected);
-    }
+            memmove(buffer->data, buffer->data + parsePos, remaining);
+            buffer->size = remaining;
+            parser.relocate(buffer->nodes, buffer->nodes, 0);
+            parsePos = 0;
+            if (buffer->capacity < wanted)
+                buffer->reserve(std::max(wanted, 2 * buffer->capacity));
+            return;
+        }
 
-    static void onDisconnect(const redisAsyncContext * context, int status)
-    {
-        //cerr << "onDisconnect" << endl;
-        EventLoop * eventLoop = reinterpret_cast<EventLoop *>(context->data);
-        eventLoop->onDisconnect(status);
+        // Start a new one, with the start of the reply being read
+        std::shared_ptr<ReplyBuffer> newBuffer
+            (new ReplyBuffer(std::max<size_t>(ReadSize, wanted)));
+        memcpy(newBuffer->data, buffer->data + parsePos, remaining);
+        newBuffer->size = remaining;
+        parser.relocate(buffer->nodes, newBuffer->nodes, 0);
+        parsePos = 0;
+        readBuffer = std::move(newBuffer);
     }
 
-    void onDisconnect(int status)
+    /* Read and parse what is available.  Returns false if the connection
+       was lost. */
+    bool handleRead()
     {
-        if (status != REDIS_OK) {
-            cerr << "disconnection with status " << status << endl;
-            cerr << "onConnect: code = " << status << " err = "
-                 << connection->context_->err
-                 << " errstr = "
-                 << connection->context_->errstr << " errno = "
-                 << strerror(errno) << endl;
+        prepareRead();
+        ReplyBuffer & buffer = *readBuffer;
+
+        ssize_t res = ::read(fds[1].fd, buffer.data + buffer.size,
+                             buffer.capacity - buffer.size);
+        if (res == 0) {
+            disconnect("connection closed by Redis");
+            return false;
         }
-        disconnected = 1;
-        futex_wake(disconnected);
-    }
+        if (res == -1) {
+            if (errno == EAGAIN || errno == EINTR)
+                return true;
+            disconnect(string("couldn't read from Redis: ")
+                       + strerror(errno));
+            return false;
+        }
+        buffer.size += res;
+
+        while (buffer.size - parsePos >= parseNeeded) {
+            size_t length;
+            try {
+                length = parser.feed(buffer.data + parsePos,
+                                     buffer.size - parsePos,
+                                     parsePos, buffer.nodes, parseNeeded);
+            } catch (const std::exception & exc) {
+                disconnect(exc.what());
+                return false;
+            }
+            if (!length)
+                break;
 
-    static void startReading(void * privData)
-    {
-        EventLoop * eventLoop = reinterpret_cast<EventLoop *>(privData);
-        eventLoop->startReading();
-    }
+            parsePos += length;
+            parseNeeded = 1;
+            connection->onReply(Reply(readBuffer, parser.rootNode()));
+        }
 
-    void startReading()
-    {
-        //cerr << "start reading" << endl;
-        //if (fds[1].events & POLLIN) return;  // already reading
-        fds[1].events |= POLLIN;
-        wakeup();
+        return true;
     }
 
-    static void stopReading(void * privData)
+    void handleWrite()
     {
-        EventLoop * eventLoop = reinterpret_cast<EventLoop *>(privData);
-        eventLoop->stopReading();
-    }
+        std::string & buffer = connection->writeBuffer;
+        size_t & pos = connection->writePos;
+
+        while (pos < buffer.size()) {
+            ssize_t res = ::send(fds[1].fd, buffer.data() + pos,
+                                 buffer.size() - pos, MSG_NOSIGNAL);
+            if (res == -1) {
+                if (errno == EINTR)
+                    continue;
+                if (errno == EAGAIN)
+                    return;
+                disconnect(string("couldn't write to Redis: ")
+                           + strerror(errno));
+                return;
+            }
+            pos += res;
+        }
 
-    void stopReading()
-    {
-        //cerr << "stop reading" << endl;
-        fds[1].events &= ~POLLIN;
+        buffer.clear();
+        pos = 0;
+        stopWriting();
     }
 
-    static void startWriting(void * privData)
+    void disconnect(const std::string & error)
     {
-        EventLoop * eventLoop = reinterpret_cast<EventLoop *>(privData);
-        eventLoop->startWriting();
+        ::close(fds[1].fd);
+        fds[1].fd = -1;
+        fds[1].events = 0;
+        connecting = false;
+        parser.reset();
+        connection->onDisconnect(error);
     }
 
+    /* Called with the lock held, from any thread.  The events are only
+       changed by the thread of the loop, as poll() reads them, once it has
+       been woken up. */
     void startWriting()
     {
-        //cerr << "start writing" << endl;
-        //if (fds[1].events & POLLOUT) return;  // already reading
-        fds[1].events |= POLLOUT;
         wakeup();
     }
 
-    static void stopWriting(void * privData)
-    {
-        EventLoop * eventLoop = reinterpret_cast<EventLoop *>(privData);
-        eventLoop->stopWriting();
-    }
-
     void stopWriting()
     {
-        //cerr << "stop writing" << endl;
         fds[1].events &= ~POLLOUT;
     }
-
-    static void cleanup(void * privData)
-    {
-        EventLoop * eventLoop = reinterpret_cast<EventLoop *>(privData);
-        eventLoop->cleanup();
-    }
-
-    void cleanup()
-    {
-        //cerr << this << " doing cleanup" << endl;
-        //backtrace();
-    }
 };
 
 
 AsyncConnection::
 AsyncConnection()
-    : context_(0), idNum(0)
+    : writePos(0), idNum(0)
 {
 }
 
 AsyncConnection::
 AsyncConnection(const Address & address)
-    : context_(0), idNum(0)
+    : writePos(0), idNum(0)
 {
     connect(address);
 }
@@ -706,24 +836,14 @@ void
 AsyncConnection::
 connect(const Address & address)
 {
-    //cerr << "connecting to redis " << address.uri() << endl;
-
     close();
 
     this->address = address;
 
-    if (address.isTcp()) {
-        context_ = redisAsyncConnect(address.tcpHost().c_str(),
-                                     address.tcpPort());
-    }
-    else if (address.isUnix()) {
-        context_ = redisAsyncConnectUnix(address.unixPath().c_str());
-    }
-    else throw ML::Exception("cannot connect to address that is neither tcp "
-                             "or unix");
-    checkError("connect");
+    bool connecting;
+    int fd = openSocket(address, connecting);
 
-    eventLoop.reset(new EventLoop(this));
+    eventLoop.reset(new EventLoop(this, fd, connecting));
 }
 
 void
@@ -817,86 +937,92 @@ void
 AsyncConnection::
 close()
 {
-    if (!context_) return;
+    if (!eventLoop) return;
 
-    if (eventLoop) {
-        eventLoop->shutdown();
-        eventLoop.reset();
-    }
-    
-    context_ = 0;
+    eventLoop->shutdown();
+    eventLoop.reset();
+
+    std::unique_lock<Lock> guard(lock);
+    pending.clear();
+    replyQueue.clear();
+    writeBuffer.clear();
+    writePos = 0;
+    connectionError.clear();
 }
 
-void
+bool
 AsyncConnection::
-resultCallback(redisAsyncContext * context, void * reply, void * privData)
+isConnected()
 {
-    //cerr << "resultCallback with reply " << reply << " privData "
-    //     << privData << endl;
-    //cerr << "context->err = " << context->err << endl;
-    //cerr << "context->errstr = " << context->errstr << endl;
-    //cerr << "context->c.errstr = " << context->c.errstr << endl;
-
-    ExcAssert(privData);
-
-    // Get a shared pointer to our data so it doesn't go away
-    RequestData * dataRawPtr
-        = reinterpret_cast<RequestData *>(privData);
-    std::shared_ptr<RequestData> data
-        = dataRawPtr->shared_from_this();
-
-    //cerr << "command " << data->command << endl;
-    //cerr << "reply " << reply << endl;
+    std::unique_lock<Lock> guard(lock);
+    return eventLoop && connectionError.empty();
+}
 
-    // Remove from data structures
-    AsyncConnection * c = data->connection;
+void
+AsyncConnection::
+onReply(const Reply & reply)
+{
+    // Out of band data, which we never subscribe to
+    if (reply.type() == PUSH)
+        return;
+
+    if (pending.empty()) {
+        cerr << "warning: reply from Redis without a request: "
+             << reply << endl;
+        return;
+    }
 
-    {
-        std::unique_lock<Lock> guard(c->lock);
-        
-        if (data->requestIterator != c->requests.end()) {
-            c->requests.erase(data->requestIterator);
-            data->requestIterator = c->requests.end();
-        }
-        
-        if (data->timeoutIterator != c->timeouts.end()) {
-            c->timeouts.erase(data->timeoutIterator);
-            data->timeoutIterator = c->timeouts.end();
-            if (c->timeouts.empty())
-                c->earliestTimeout = Date::positiveInfinity();
-            else c->earliestTimeout = c->timeouts.begin()->first;
-        }
+    std::shared_ptr<RequestData> data = std::move(pending.front());
+    pending.pop_front();
 
-        if (data->state != WAITING) return;  // raced; timeout happened
-        data->state = REPLIED;
+    if (reply.type() == ERROR) {
+        // Command error, return it
+        finishRequest(data, Result(reply.asString()));
     }
+    else finishRequest(data, Result(reply));
+}
 
+void
+AsyncConnection::
+onDisconnect(const std::string & error)
+{
+    cerr << "disconnected from Redis at " << address.uri() << ": "
+         << error << endl;
 
-    Result result;
+    connectionError = error;
+    writeBuffer.clear();
+    writePos = 0;
 
-    if (reply) {
-        Reply replyObj((redisReply *)reply, false /* take ownership */);
-        //cerr << "reply = " << replyObj << endl;
-        if (replyObj.type() == ERROR) {
-            // Command error, return it
-            result = Result(replyObj.asString());
-        }
-        else {
-            // Result (success)
-            // We have to take a deep copy since the reply object is owned
-            // by the caller
-            result = Result(replyObj.deepCopy());
-        }
+    for (auto & data: pending)
+        finishRequest(data, Result(error));
+    pending.clear();
+}
+
+void
+AsyncConnection::
+finishRequest(const std::shared_ptr<RequestData> & data, Result result)
+{
+    if (data->requestIterator != requests.end()) {
+        requests.erase(data->requestIterator);
+        data->requestIterator = requests.end();
     }
-    else {
-        // Context encountered an error; return it
-        result = Result(data->connection->context_->errstr);
+        
+    if (data->timeoutIterator != timeouts.end()) {
+        timeouts.erase(data->timeoutIterator);
+        data->timeoutIterator = timeouts.end();
+        if (timeouts.empty())
+            earliestTimeout = Date::positiveInfinity();
+        else earliestTimeout = timeouts.begin()->first;
     }
 
-    // Queue up a reply object so it can be called without the lock held.  If
-    // we call directly from here, then the lock has to be held and so deadlock
-    // is possible.
-    c->replyQueue.push_back(std::bind(data->onResult, result));
+    if (data->state != WAITING) return;  // raced; timeout happened
+    data->state = REPLIED;
+
+    // Queue up the result so that the callback can be called without the
+    // lock held.  If we call directly from here, then the lock has to be
+    // held and so deadlock is possible.
+    if (data->onResult)
+        replyQueue.emplace_back(data, std::move(result));
 }
 
 int64_t
@@ -907,8 +1033,7 @@ queue(const Command & command,
 {
     std::unique_lock<Lock> guard(lock);
 
-    ExcAssert(context_);
-    ExcAssert(!context_->err);
+    ExcAssert(eventLoop);
     
     // Check basics
     if (timeout.expiry.isADate() && Date::now() >= timeout.expiry) {
@@ -919,11 +1044,10 @@ queue(const Command & command,
     int64_t id = idNum++;
     
     // Create data structure to be passed around
-    std::shared_ptr<RequestData> data(new RequestData);
+    auto data = std::make_shared<RequestData>();
     data->onResult = onResult;
     data->timeout = timeout.expiry;
     data->command = command.formatStr;
-    //data->timeout = Date::notADate();
     data->connection = this;
     data->id = id;
     data->requestIterator = requests.end();
@@ -932,8 +1056,6 @@ queue(const Command & command,
 
     ExcAssertEqual(requests.count(id), 0);
 
-    //cerr << "data = " << data << endl;
-
     auto it = requests.insert(make_pair(id, data)).first;
     data->requestIterator = it;
 
@@ -946,22 +1068,28 @@ queue(const Command & command,
         data->timeoutIterator = timeouts.insert(make_pair(timeout.expiry, it));
         earliestTimeout = timeouts.begin()->first;
     }
-    
-    vector<const char *> argv = command.argv();
-    vector<size_t> argl = command.argl();
 
-    int result = redisAsyncCommandArgv(context_, resultCallback, data.get(),
-                                       command.argc(),
-                                       &argv[0],
-                                       &argl[0]);
-    
-    if (result != REDIS_OK) {
-        //cerr << "result not OK" << endl;
-        resultCallback(context_, 0, data.get());
+    if (!connectionError.empty()) {
+        // The failure is reported from the event loop, like a reply
+        finishRequest(data, Result(connectionError));
+        eventLoop->wakeup();
         return -1;
     }
+
+    bool writing = writePos != writeBuffer.size();
+
+    // Don't let what was written accumulate in front of the buffer
+    if (writePos > 65536 && writePos * 2 > writeBuffer.size()) {
+        writeBuffer.erase(0, writePos);
+        writePos = 0;
+    }
+
+    appendCommand(writeBuffer, command);
+    pending.push_back(data);
     
-    if (needWakeup)
+    if (!writing)
+        eventLoop->startWriting();
+    else if (needWakeup)
         eventLoop->wakeup();
     
     return id;
@@ -976,7 +1104,7 @@ exec(const Command & command, Timeout timeout)
 
     auto onResponse = [&] (const Redis::Result & redisResult)
         {
-            result = redisResult.deepCopy();
+            result = redisResult;
             done = 1;
             futex_wake(done);
         };
@@ -1002,7 +1130,7 @@ struct AsyncConnection::MultiAggregator
     // Something succeeded
     void result(int i, const Result & result)
     {
-        at(i) = result.deepCopy();
+        at(i) = result;
         finish();
     }
 
@@ -1088,7 +1216,7 @@ expireTimeouts(Date now)
         data->onResult(Result(Result::timeoutError));
         data->timeoutIterator = end;
 
-        // Let it be cleaned up from hiredis once it's finished
+        // It stays pending until its reply is read
     }
 
     timeouts.erase(timeouts.begin(), it);
@@ -8,9 +8,11 @@
 #ifndef __redis__redis_h__
 #define __redis__redis_h__
 
-#include <hiredis/hiredis.h>
-#include <hiredis/async.h>
 #include <string>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <functional>
 #include "jml/arch/exception.h"
 #include "jml/utils/exc_assert.h"
 #include "jml/utils/string_functions.h"
@@ -18,6 +20,7 @@
 #include "jml/utils/ring_buffer.h"
 #include "soa/jsoncpp/json.h"
 #include "soa/types/date.h"
+#include "soa/service/redis_parser.h"
 #include <deque>
 
 
@@ -27,47 +30,33 @@ namespace Redis {
 using Datacratic::Date;
 
 
-enum ReplyType {
-    STATUS,
-    ERROR,
-    INTEGER,
-    NIL,
-    STRING,
-    ARRAY
-};
-
-
 /*****************************************************************************/
 /* REPLY                                                                     */
 /*****************************************************************************/
 
-struct Reply {
+/** A reply from Redis, or an element of one.  It is a view of the buffer
+    the reply was parsed from, which it shares with the other replies read
+    at the same time; copying it copies no data.
+*/
 
-    static void doDelete(redisReply * reply)
-    {
-        freeReplyObject(reply);
-    }
-    
-    static void noDelete(redisReply * reply)
-    {
-    }
+struct Reply {
 
     Reply()
+        : index_(0)
     {
     }
 
-    Reply(redisReply * reply, bool needDelete)
-        : r_(reply, needDelete ? doDelete : noDelete)
+    Reply(std::shared_ptr<const ReplyBuffer> buffer, uint32_t index)
+        : buffer_(std::move(buffer)), index_(index)
     {
     }
 
-    bool initialized() const { return !!r_; }
+    bool initialized() const { return !!buffer_; }
 
-    /** Makes a deep copy that we have ownership of. */
+    /** Makes a copy of only this reply, which doesn't hold on to the rest
+        of the buffer it was read into. */
     Reply deepCopy() const;
 
-    static redisReply * doDeepCopy(redisReply * r);
-
     operator std::string () const
     {
         return asString();
@@ -83,7 +72,10 @@ struct Reply {
         return asJson();
     }
 
-    ReplyType type() const;
+    ReplyType type() const
+    {
+        return (ReplyType)node().type;
+    }
 
     std::string getString() const;
 
@@ -95,23 +87,99 @@ struct Reply {
 
     Json::Value asJson() const;
 
-    Reply operator [] (size_t index) const
+    /** Bytes of a STATUS, ERROR or STRING reply, in the buffer it was read
+        into.  They are not null terminated. */
+    const char * data() const
     {
-        ExcAssert(r_);
-        ExcAssertLess(index, length());
-        return Reply(r_->element[index], false);
+        const ReplyNode & n = node();
+        ExcAssert(isString(n));
+        return buffer_->str(n);
     }
 
+    size_t dataLength() const
+    {
+        const ReplyNode & n = node();
+        ExcAssert(isString(n));
+        return n.length;
+    }
+
+    Reply operator [] (size_t index) const;
+
+    /** Number of elements of an ARRAY, MAP or PUSH reply.  Those of a
+        MAP are its keys followed by their value. */
     ssize_t length() const
     {
-        ExcAssert(r_);
-        ExcAssertEqual(r_->type, REDIS_REPLY_ARRAY);
-        return r_->elements;
+        const ReplyNode & n = node();
+        ExcAssert(isAggregate(n));
+        return n.length;
+    }
+
+    /** Iteration over the elements of an aggregate, without looking them up
+        one by one. */
+    struct const_iterator
+        : public std::iterator<std::forward_iterator_tag, Reply> {
+        const_iterator(const Reply * parent, uint32_t index)
+            : parent(parent), index(index)
+        {
+        }
+
+        Reply operator * () const
+        {
+            return Reply(parent->buffer_, index);
+        }
+
+        const_iterator & operator ++ ()
+        {
+            index += parent->buffer_->nodes[index].skip;
+            return *this;
+        }
+
+        bool operator == (const const_iterator & other) const
+        {
+            return index == other.index;
+        }
+
+        bool operator != (const const_iterator & other) const
+        {
+            return index != other.index;
+        }
+
+        const Reply * parent;
+        uint32_t index;
+    };
+
+    const_iterator begin() const
+    {
+        ExcAssert(isAggregate(node()));
+        return const_iterator(this, index_ + 1);
+    }
+
+    const_iterator end() const
+    {
+        return const_iterator(this, index_ + node().skip);
     }
 
 private:
-    std::shared_ptr<redisReply> r_;
-    bool needDelete_;
+    const ReplyNode & node() const
+    {
+        ExcAssert(buffer_);
+        return buffer_->nodes[index_];
+    }
+
+    static bool isString(const ReplyNode & node)
+    {
+        return node.type == STATUS || node.type == ERROR
+            || node.type == STRING;
+    }
+
+    static bool isAggregate(const ReplyNode & node)
+    {
+        return node.type == ARRAY || node.type == MAP
+            || node.type == PUSH;
+    }
+
+    std::shared_ptr<const ReplyBuffer> buffer_;
+    uint32_t index_;
 };
 
 std::ostream & operator << (std::ostream & stream, const Reply & reply);
@@ -357,7 +425,10 @@ struct Address {
 /* ASYNC CONNECTION                                                          */
 /*****************************************************************************/
 
-/** Asynchronous connection to Redis. */
+/** Asynchronous connection to Redis.  Commands are written and replies
+    read by a thread of its own; the replies are parsed in place from the
+    buffer they were read into and handed out as views of it.
+*/
 
 struct AsyncConnection {
     
@@ -379,6 +450,11 @@ struct AsyncConnection {
 
     void close();
 
+    /** Whether the connection is up.  Once lost, it stays down until
+        connect() is called again.
+    */
+    bool isConnected();
+
     // Struct to specify a timeout, either absolute or relative
     struct Timeout {
         Timeout() // no timeout
@@ -435,10 +511,6 @@ struct AsyncConnection {
     }
     
 private:
-    std::deque<std::function<void ()> > replyQueue;
-    
-    static void resultCallback(redisAsyncContext * context, void *, void *);
-
     struct RequestData;
 
     typedef std::recursive_mutex Lock;
@@ -450,6 +522,37 @@ private:
     typedef std::multimap<Datacratic::Date, Requests::iterator> Timeouts;
     Timeouts timeouts;
 
+    /** Results waiting to be passed to their callback, which is done
+        without the lock held.
+    */
+    std::deque<std::pair<std::shared_ptr<RequestData>, Result> > replyQueue;
+
+    /** Requests written or waiting to be written, in the order of the
+        replies.
+    */
+    std::deque<std::shared_ptr<RequestData> > pending;
+
+    /** Commands not yet written, from writePos on. */
+    std::string writeBuffer;
+    size_t writePos;
+
+    /** Once the connection is lost, why it was; the commands queued then
+        fail with it.
+    */
+    std::string connectionError;
+
+    /** Called when a reply is parsed; completes the first pending
+        request. */
+    void onReply(const Reply & reply);
+
+    /** Called when the connection is lost; fails the pending requests. */
+    void onDisconnect(const std::string & error);
+
+    /** Remove the request from the requests and timeouts and queue its
+        result, unless it already timed out. */
+    void finishRequest(const std::shared_ptr<RequestData> & data,
+                       Result result);
+
     /** Called when something knows that at least one timeout is expired;
         expire them.
     */
@@ -457,19 +560,7 @@ private:
 
     Datacratic::Date earliestTimeout;
 
-    void checkError(const char * command)
-    {
-        if (!context_)
-            throw ML::Exception("no connection to Redis");
-
-        if (context_->err) {
-            throw ML::Exception("Redis command %s returned error %s",
-                                command, context_->errstr);
-        }
-    }
-
     Address address;
-    redisAsyncContext * context_;
     int64_t idNum;
 
     struct EventLoop;
@@ -0,0 +1,411 @@
+/* redis_parser.cc
+   Copyright (c) 2014 Datacratic.  All rights reserved.
+
+   Parser for the replies of the Redis protocol.
+*/
+
+#include <string.h>
+#include <new>
+#include "jml/arch/exception.h"
+#include "soa/service/redis_parser.h"
+
+
+using namespace std;
+
+
+namespace Redis {
+
+
+/*****************************************************************************/
+/* REPLY BUFFER                                                              */
+/*****************************************************************************/
+
+ReplyBuffer::
+ReplyBuffer(size_t capacity)
+    : data(nullptr), size(0), capacity(0)
+{
+    reserve(capacity);
+}
+
+ReplyBuffer::
+~ReplyBuffer()
+{
+    ::free(data);
+}
+
+void
+ReplyBuffer::
+reserve(size_t newCapacity)
+{
+    if (newCapacity <= capacity)
+        return;
+    char * newData = (char *)::realloc(data, newCapacity);
+    if (!newData)
+        throw std::bad_alloc();
+    data = newData;
+    capacity = newCapacity;
+}
+
+
+/*****************************************************************************/
+/* REPLY PARSER                                                              */
+/*****************************************************************************/
+
+namespace {
+
+struct Parser {
+    Parser(const char * data, size_t size, uint64_t offset,
+           std::vector<ReplyNode> & nodes)
+        : data(data), size(size), offset(offset), nodes(nodes), needed(0)
+    {
+    }
+
+    const char * data;
+    size_t size;
+    uint64_t offset;
+    std::vector<ReplyNode> & nodes;
+    size_t needed;
+
+    /* Reads the line starting at pos, up to its CRLF.  Returns false if it
+       is not complete. */
+    bool readLine(size_t & pos, const char * & line, size_t & length)
+    {
+        const char * cr = (const char *)::memchr(data + pos, '\r', size - pos);
+        if (!cr || cr + 1 == data + size) {
+            needed = size + 1;
+            return false;
+        }
+        if (cr[1] != '\n')
+            throw ML::Exception("Redis protocol error: line not ended by "
+                                "CRLF");
+        line = data + pos;
+        length = cr - line;
+        pos = cr + 2 - data;
+        return true;
+    }
+
+    static long long parseInteger(const char * line, size_t length)
+    {
+        const char * p = line, * end = line + length;
+        bool negative = (p != end && *p == '-');
+        if (negative)
+            ++p;
+        if (p == end)
+            throw ML::Exception("Redis protocol error: empty integer");
+
+        unsigned long long value = 0;
+        for (;  p != end;  ++p) {
+            if (*p < '0' || *p > '9')
+                throw ML::Exception("Redis protocol error: invalid integer "
+                                    "'%s'", string(line, length).c_str());
+            value = value * 10 + (*p - '0');
+        }
+        return negative ? -(long long)value : (long long)value;
+    }
+
+    static uint32_t checkLength(long long length)
+    {
+        if (length < 0 || length > 0x7fffffff)
+            throw ML::Exception("Redis protocol error: invalid length %lld",
+                                length);
+        return length;
+    }
+
+    ReplyNode & addNode(ReplyType type)
+    {
+        nodes.emplace_back();
+        ReplyNode & node = nodes.back();
+        node.type = type;
+        node.flat = false;
+        node.length = 0;
+        node.skip = 1;
+        node.offset = 0;
+        return node;
+    }
+
+    void addString(ReplyType type, const char * str, size_t length)
+    {
+        ReplyNode & node = addNode(type);
+        node.length = length;
+        node.offset = offset + (str - data);
+    }
+
+    enum Parsed {
+        INCOMPLETE,
+        ELEMENT,
+        AGGREGATE,
+        ATTRIBUTE
+    };
+
+    /* Parses the element starting at pos, without the elements of an
+       aggregate, and appends its node.  Returns INCOMPLETE, with pos left
+       as it was, if it is not complete, and sets numElements to the number
+       of elements that follow an aggregate or an attribute. */
+    Parsed parseElement(size_t & pos, uint32_t & numElements)
+    {
+        if (pos == size) {
+            needed = size + 1;
+            return INCOMPLETE;
+        }
+
+        size_t start = pos;
+        char type = data[start];
+        const char * line;
+        size_t length;
+        size_t next = start + 1;
+        if (!readLine(next, line, length))
+            return INCOMPLETE;
+
+        switch (type) {
+        case '+':
+            addString(STATUS, line, length);
+            break;
+
+        case '-':
+            addString(ERROR, line, length);
+            break;
+
+        case ':':
+            addNode(INTEGER).integer = parseInteger(line, length);
+            break;
+
+        case '(':
+            // Big number; left as a string
+            addString(STRING, line, length);
+            break;
+
+        case '_':
+            addNode(NIL);
+            break;
+
+        case '#':
+            if (length != 1 || (line[0] != 't' && line[0] != 'f'))
+                throw ML::Exception("Redis protocol error: invalid boolean");
+            addNode(BOOLEAN).integer = (line[0] == 't');
+            break;
+
+        case ',': {
+            // The number is followed by the CR, which ends it
+            char * end;
+            double number = ::strtod(line, &end);
+            if (end != line + length || length == 0)
+                throw ML::Exception("Redis protocol error: invalid double");
+            addNode(DOUBLE).number = number;
+            break;
+        }
+
+        case '$':
+        case '!':
+        case '=': {
+            long long n = parseInteger(line, length);
+            if (n == -1 && type == '$') {
+                addNode(NIL);
+                break;
+            }
+            uint32_t len = checkLength(n);
+            if (size - next < len + 2) {
+                needed = next + len + 2;
+                return INCOMPLETE;
+            }
+            const char * str = data + next;
+            if (str[len] != '\r' || str[len + 1] != '\n')
+                throw ML::Exception("Redis protocol error: bulk string not "
+                                    "ended by CRLF");
+            next += len + 2;
+
+            if (type == '!')
+                addString(ERROR, str, len);
+            else if (type == '=') {
+                // Verbatim string; skip the "txt:" format prefix
+                if (len < 4 || str[3] != ':')
+                    throw ML::Exception("Redis protocol error: invalid "
+                                        "verbatim string");
+                addString(STRING, str + 4, len - 4);
+            }
+            else addString(STRING, str, len);
+            break;
+        }
+
+        case '*':
+        case '%':
+        case '~':
+        case '>':
+        case '|': {
+            long long n = parseInteger(line, length);
+            if (n == -1 && type == '*') {
+                addNode(NIL);
+                break;
+            }
+            numElements = checkLength(n);
+            if (type == '%' || type == '|') {
+                if (numElements > 0x3fffffff)
+                    throw ML::Exception("Redis protocol error: map too "
+                                        "large");
+                numElements *= 2;
+            }
+
+            ReplyNode & node = addNode(type == '%' || type == '|' ? MAP
+                                       : type == '>' ? PUSH
+                                       : ARRAY);
+            node.length = numElements;
+            pos = next;
+            return type == '|' ? ATTRIBUTE : AGGREGATE;
+        }
+
+        default:
+            throw ML::Exception("Redis protocol error: unknown reply type "
+                                "'%c'", type);
+        }
+
+        pos = next;
+        return ELEMENT;
+    }
+};
+
+} // file scope
+
+ReplyParser::
+ReplyParser()
+    : numElementsParsed(0), started(false), pos(0), offset(0), root(0),
+      depth(0)
+{
+}
+
+size_t
+ReplyParser::
+parse(const char * data, size_t size, uint64_t offset,
+      std::vector<ReplyNode> & nodes, size_t & needed)
+{
+    size_t numNodes = nodes.size();
+    ReplyParser parser;
+
+    size_t length = parser.feed(data, size, offset, nodes, needed);
+    if (!length)
+        nodes.resize(numNodes);
+    return length;
+}
+
+size_t
+ReplyParser::
+feed(const char * data, size_t size, uint64_t offset,
+     std::vector<ReplyNode> & nodes, size_t & needed)
+{
+    if (!started) {
+        started = true;
+        pos = 0;
+        root = nodes.size();
+        depth = 0;
+    }
+    this->offset = offset;
+
+    Parser parser(data, size, offset, nodes);
+
+    for (;;) {
+        size_t element = nodes.size();
+        uint32_t numElements = 0;
+        Parser::Parsed parsed = parser.parseElement(pos, numElements);
+        if (parsed == Parser::INCOMPLETE) {
+            needed = parser.needed;
+            return 0;
+        }
+        ++numElementsParsed;
+
+        if (parsed != Parser::ELEMENT) {
+            if (numElements == 0) {
+                if (parsed == Parser::ATTRIBUTE) {
+                    nodes.resize(element);
+                    continue;
+                }
+                nodes[element].flat = true;
+            }
+            else {
+                if (depth >= MaxDepth)
+                    throw ML::Exception("Redis protocol error: replies "
+                                        "nested too deeply");
+                Frame & frame = stack[depth++];
+                frame.index = element;
+                frame.remaining = numElements;
+                frame.flat = true;
+                frame.attribute = (parsed == Parser::ATTRIBUTE);
+                continue;
+            }
+        }
+
+        if (endElement(nodes, element)) {
+            started = false;
+            needed = 0;
+            return pos;
+        }
+    }
+}
+
+bool
+ReplyParser::
+endElement(std::vector<ReplyNode> & nodes, size_t element)
+{
+    bool flat = nodes[element].skip == 1;
+
+    while (depth > 0) {
+        Frame & frame = stack[depth - 1];
+        frame.flat = frame.flat && flat;
+        if (--frame.remaining)
+            return false;
+        --depth;
+
+        if (frame.attribute) {
+            // Attributes go before the element they are about; skip them
+            nodes.resize(frame.index);
+            return false;
+        }
+
+        ReplyNode & node = nodes[frame.index];
+        node.flat = frame.flat;
+        node.skip = nodes.size() - frame.index;
+        flat = false;
+    }
+
+    return true;
+}
+
+void
+ReplyParser::
+reset()
+{
+    started = false;
+    depth = 0;
+}
+
+void
+ReplyParser::
+relocate(std::vector<ReplyNode> & from, std::vector<ReplyNode> & to,
+         uint64_t newOffset)
+{
+    if (!started) {
+        if (&from == &to)
+            to.clear();
+        return;
+    }
+
+    size_t newRoot;
+    if (&from == &to) {
+        to.erase(to.begin(), to.begin() + root);
+        newRoot = 0;
+    }
+    else {
+        newRoot = to.size();
+        to.insert(to.end(), from.begin() + root, from.end());
+    }
+
+    for (size_t i = newRoot;  i < to.size();  ++i) {
+        ReplyNode & node = to[i];
+        if (node.type == STATUS || node.type == ERROR || node.type == STRING)
+            node.offset = node.offset - offset + newOffset;
+    }
+    for (int i = 0;  i < depth;  ++i)
+        stack[i].index = stack[i].index - root + newRoot;
+
+    root = newRoot;
+    offset = newOffset;
+}
+
+} // namespace Redis
@@ -0,0 +1,170 @@
+/* redis_parser.h                                                  -*- C++ -*-
+   Copyright (c) 2014 Datacratic.  All rights reserved.
+
+   Parser for the replies of the Redis protocol (RESP2 and RESP3), working
+   in place over the buffer the replies were read into.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <vector>
+
+
+namespace Redis {
+
+
+enum ReplyType {
+    STATUS,
+    ERROR,
+    INTEGER,
+    NIL,
+    STRING,
+    ARRAY,
+
+    // RESP3 only
+    DOUBLE,
+    BOOLEAN,
+    MAP,      ///< Elements are keys followed by their values
+    PUSH      ///< Out of band data, not a reply to a command
+};
+
+
+/*****************************************************************************/
+/* REPLY NODE                                                                */
+/*****************************************************************************/
+
+/** A reply, or an element of a reply, as parsed.  The nodes of a reply are
+    stored in a flat array in pre-order: the elements of an aggregate follow
+    it, each followed by its own elements.
+
+    Strings are not copied: their offset within the buffer that was parsed
+    is kept.  Big numbers and verbatim strings of RESP3 are given as
+    STRING, blob errors as ERROR, sets as ARRAY and attributes are
+    skipped.
+*/
+
+struct ReplyNode {
+    uint8_t type;       ///< ReplyType
+    bool flat;          ///< Aggregate whose elements take one node each
+    uint32_t length;    ///< Bytes of a string, elements of an aggregate
+    uint32_t skip;      ///< Number of nodes of the subtree, itself included
+    union {
+        uint64_t offset;     ///< Of a string, in the buffer
+        long long integer;   ///< INTEGER and BOOLEAN
+        double number;       ///< DOUBLE
+    };
+};
+
+
+/*****************************************************************************/
+/* REPLY BUFFER                                                              */
+/*****************************************************************************/
+
+/** Bytes read from a connection and the nodes of the replies parsed from
+    them.  Replies refer to it by node index; once they have been handed
+    out, it is not modified anymore.
+*/
+
+struct ReplyBuffer {
+    ReplyBuffer(size_t capacity = 0);
+    ~ReplyBuffer();
+
+    ReplyBuffer(const ReplyBuffer &) = delete;
+    void operator = (const ReplyBuffer &) = delete;
+
+    /** Make room for at least the given number of bytes. */
+    void reserve(size_t newCapacity);
+
+    const char * str(const ReplyNode & node) const
+    {
+        return data + node.offset;
+    }
+
+    char * data;
+    size_t size;
+    size_t capacity;
+    std::vector<ReplyNode> nodes;
+};
+
+
+/*****************************************************************************/
+/* REPLY PARSER                                                              */
+/*****************************************************************************/
+
+/** Parses the replies read from a connection.  A reply that is not
+    complete yet is parsed a piece at a time as its bytes arrive, carrying
+    on from where the previous piece stopped, so that a large reply read
+    in many pieces is still parsed once.
+*/
+
+struct ReplyParser {
+    ReplyParser();
+
+    /** Parse one reply from the "size" bytes at "data", which are at the
+        given offset in their buffer, and append its nodes.  Returns the
+        number of bytes of the reply, or 0 if it is not complete, in which
+        case nothing is appended and "needed" is set to the number of bytes
+        it takes at least.  Throws on a protocol error.
+    */
+    static size_t parse(const char * data, size_t size, uint64_t offset,
+                        std::vector<ReplyNode> & nodes, size_t & needed);
+
+    /** Parse the reply that starts at "data", or carry on with it if it
+        was started by a previous call, with the same arguments but for
+        "size".  The nodes of its elements are appended as they are parsed
+        and left in "nodes" between the calls.  Returns the number of bytes
+        of the reply once it is complete, after which the next call starts
+        a new one, or 0 with "needed" set to the number of bytes from the
+        start of the reply that it takes at least to go further.  Throws
+        on a protocol error, after which reset() must be called.
+    */
+    size_t feed(const char * data, size_t size, uint64_t offset,
+                std::vector<ReplyNode> & nodes, size_t & needed);
+
+    /** Forget the reply being parsed. */
+    void reset();
+
+    /** The bytes of the reply being parsed were moved to "newOffset" in
+        their buffer or in another one: copy the nodes parsed so far from
+        "from" to the end of "to".  When they are the same, the nodes of
+        the previous replies are removed instead.
+    */
+    void relocate(std::vector<ReplyNode> & from, std::vector<ReplyNode> & to,
+                  uint64_t newOffset);
+
+    /** Index of the first node of the last reply started */
+    size_t rootNode() const
+    {
+        return root;
+    }
+
+    /** Maximum nesting of aggregates */
+    static constexpr int MaxDepth = 64;
+
+    /** Number of elements parsed since the creation of the parser */
+    uint64_t numElementsParsed;
+
+private:
+    /* Aggregate whose elements are being parsed */
+    struct Frame {
+        uint32_t index;       ///< Of its node
+        uint32_t remaining;   ///< Elements left to parse
+        bool flat;
+        bool attribute;       ///< Skipped once parsed
+    };
+
+    /* Account for the element that was just parsed, completing the
+       aggregates it ends.  Returns true if it ends the reply. */
+    bool endElement(std::vector<ReplyNode> & nodes, size_t element);
+
+    bool started;       ///< In the middle of a reply
+    size_t pos;         ///< Bytes of the reply parsed so far
+    uint64_t offset;    ///< Of the reply in its buffer
+    size_t root;
+    int depth;
+    Frame stack[MaxDepth];
+};
+
+} // namespace Redis
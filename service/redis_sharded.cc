@@ -0,0 +1,556 @@
+/* redis_sharded.cc
+   Copyright (c) 2014 Datacratic.  All rights reserved.
+
+   Connection to a set of Redis servers over which the keys are sharded.
+*/
+
+#include <string.h>
+#include <strings.h>
+#include <algorithm>
+#include <iostream>
+#include <functional>
+#include <city.h>
+#include "jml/arch/futex.h"
+#include "soa/service/redis_sharded.h"
+
+
+using namespace std;
+using namespace Datacratic;
+using namespace ML;
+
+
+namespace Redis {
+
+namespace {
+
+uint64_t
+hashKey(const std::string & key)
+{
+    // Hash tag, as in Redis Cluster
+    size_t open = key.find('{');
+    if (open != string::npos) {
+        size_t close = key.find('}', open + 1);
+        if (close != string::npos && close > open + 1)
+            return CityHash64(key.c_str() + open + 1, close - open - 1);
+    }
+    return CityHash64(key.c_str(), key.size());
+}
+
+bool
+isCommand(const Command & command, const char * name)
+{
+    return strcasecmp(command.formatStr.c_str(), name) == 0;
+}
+
+/* Commands that need all their keys on one connection, or have no key */
+const char * const unshardable[] = {
+    "AUTH", "SELECT", "KEYS", "RANDOMKEY", "PING",
+    "MULTI", "EXEC", "DISCARD", "WATCH", "UNWATCH",
+    nullptr
+};
+
+ReplyNode &
+addNode(ReplyBuffer & buffer, ReplyType type)
+{
+    buffer.nodes.emplace_back();
+    ReplyNode & node = buffer.nodes.back();
+    node.type = type;
+    node.flat = false;
+    node.length = 0;
+    node.skip = 1;
+    node.offset = 0;
+    return node;
+}
+
+/* Append a copy of a reply that is not an aggregate to the buffer, which
+   has room for its string */
+void
+appendScalar(ReplyBuffer & buffer, const Reply & reply)
+{
+    ReplyType type = reply.type();
+    switch (type) {
+    case STATUS:
+    case ERROR:
+    case STRING: {
+        ReplyNode & node = addNode(buffer, type);
+        node.length = reply.dataLength();
+        node.offset = buffer.size;
+        memcpy(buffer.data + buffer.size, reply.data(), node.length);
+        buffer.size += node.length;
+        break;
+    }
+    case INTEGER:
+    case BOOLEAN:
+        addNode(buffer, type).integer = reply.asInt();
+        break;
+    case NIL:
+        addNode(buffer, type);
+        break;
+    default:
+        throw ML::Exception("can't reassemble Redis reply of type %d", type);
+    }
+}
+
+} // file scope
+
+
+/*****************************************************************************/
+/* SHARD                                                                     */
+/*****************************************************************************/
+
+struct ShardedConnection::Shard {
+    Shard(const Address & address)
+        : address(address), next(0), up(true), consecutiveFailures(0),
+          numRequests(0), numFailures(0)
+    {
+    }
+
+    Address address;
+
+    /* Connections, replaced by the monitor when lost; null when one
+       couldn't be opened.  Guarded by lock. */
+    std::mutex lock;
+    std::vector<std::shared_ptr<AsyncConnection> > connections;
+    size_t next;
+
+    std::atomic<bool> up;
+    std::atomic<int> consecutiveFailures;
+    std::atomic<uint64_t> numRequests;
+    std::atomic<uint64_t> numFailures;
+
+    /** Next connection of the pool, or null if there is none */
+    std::shared_ptr<AsyncConnection> pick()
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        for (size_t i = 0;  i < connections.size();  ++i) {
+            auto & connection = connections[next++ % connections.size()];
+            if (connection)
+                return connection;
+        }
+        return nullptr;
+    }
+};
+
+
+/*****************************************************************************/
+/* FAN OUT                                                                   */
+/*****************************************************************************/
+
+/** A command split by shard, whose reply is put back together once all the
+    parts are done. */
+
+struct ShardedConnection::FanOut {
+    FanOut(const Command & command, const OnResult & onResult)
+        : command(command.formatStr), numDone(0), onResult(onResult)
+    {
+    }
+
+    std::string command;
+    std::vector<Result> parts;
+
+    /* For each key, its part and its index within it */
+    std::vector<std::pair<int, int> > keys;
+
+    std::atomic<int> numDone;
+    OnResult onResult;
+
+    void result(int part, const Result & result)
+    {
+        parts[part] = result;
+        if (++numDone == (int)parts.size())
+            finish();
+    }
+
+    void finish()
+    {
+        if (!onResult)
+            return;
+
+        for (const Result & part: parts) {
+            if (!part) {
+                onResult(part);
+                return;
+            }
+        }
+
+        Result result;
+        try {
+            result = Result(combine());
+        } catch (const std::exception & exc) {
+            result = Result(string(exc.what()));
+        }
+        onResult(result);
+    }
+
+    Reply combine() const
+    {
+        if (strcasecmp(command.c_str(), "MSET") == 0)
+            return parts[0].reply();
+
+        if (strcasecmp(command.c_str(), "MGET") != 0) {
+            // DEL and EXISTS: the number of keys
+            long long total = 0;
+            for (const Result & part: parts)
+                total += part.reply().asInt();
+            std::shared_ptr<ReplyBuffer> buffer(new ReplyBuffer());
+            addNode(*buffer, INTEGER).integer = total;
+            return Reply(std::move(buffer), 0);
+        }
+
+        // MGET: the values in the order of the keys
+        size_t size = 0;
+        for (auto & key: keys) {
+            Reply value = parts[key.first].reply()[key.second];
+            if (value.type() == STRING)
+                size += value.dataLength();
+        }
+
+        std::shared_ptr<ReplyBuffer> buffer(new ReplyBuffer(size));
+        buffer->nodes.reserve(keys.size() + 1);
+        ReplyNode & root = addNode(*buffer, ARRAY);
+        root.flat = true;
+        root.length = keys.size();
+        root.skip = keys.size() + 1;
+        for (auto & key: keys)
+            appendScalar(*buffer, parts[key.first].reply()[key.second]);
+
+        return Reply(std::move(buffer), 0);
+    }
+};
+
+
+/*****************************************************************************/
+/* SHARDED CONNECTION                                                        */
+/*****************************************************************************/
+
+ShardedConnection::
+ShardedConnection()
+    : maxFailures(3), checkInterval(1.0), shutdown(0)
+{
+}
+
+ShardedConnection::
+ShardedConnection(const std::vector<Address> & shards,
+                  int connectionsPerShard)
+    : maxFailures(3), checkInterval(1.0), shutdown(0)
+{
+    connect(shards, connectionsPerShard);
+}
+
+ShardedConnection::
+~ShardedConnection()
+{
+    close();
+}
+
+void
+ShardedConnection::
+setHealthChecks(int maxFailures, double checkInterval)
+{
+    ExcAssertGreater(maxFailures, 0);
+    ExcAssertGreater(checkInterval, 0);
+    this->maxFailures = maxFailures;
+    this->checkInterval = checkInterval;
+}
+
+void
+ShardedConnection::
+connect(const std::vector<Address> & addresses, int connectionsPerShard)
+{
+    if (addresses.empty())
+        throw ML::Exception("no Redis shard to connect to");
+    if (connectionsPerShard < 1)
+        throw ML::Exception("need at least one connection per Redis shard");
+
+    close();
+
+    for (unsigned i = 0;  i < addresses.size();  ++i) {
+        std::unique_ptr<Shard> shard(new Shard(addresses[i]));
+        string uri = addresses[i].uri();
+
+        for (int j = 0;  j < connectionsPerShard;  ++j) {
+            std::shared_ptr<AsyncConnection> connection;
+            try {
+                connection = std::make_shared<AsyncConnection>(addresses[i]);
+            } catch (const std::exception & exc) {
+                cerr << "couldn't connect to Redis shard " << uri << ": "
+                     << exc.what() << endl;
+                shard->up = false;
+            }
+            shard->connections.push_back(connection);
+        }
+
+        for (int j = 0;  j < VirtualNodes;  ++j) {
+            string point = uri + "-" + to_string(j);
+            ring.emplace_back(CityHash64(point.c_str(), point.size()), i);
+        }
+
+        shards.push_back(std::move(shard));
+    }
+
+    std::sort(ring.begin(), ring.end());
+
+    shutdown = 0;
+    monitor = std::thread(std::bind(&ShardedConnection::runMonitor, this));
+}
+
+void
+ShardedConnection::
+test()
+{
+    for (auto & shard: shards) {
+        std::vector<std::shared_ptr<AsyncConnection> > connections;
+        {
+            std::unique_lock<std::mutex> guard(shard->lock);
+            connections = shard->connections;
+        }
+        for (auto & connection: connections) {
+            if (!connection)
+                throw ML::Exception("no connection to Redis shard "
+                                    + shard->address.uri());
+            connection->test();
+        }
+    }
+}
+
+void
+ShardedConnection::
+close()
+{
+    if (monitor.joinable()) {
+        shutdown = 1;
+        futex_wake(shutdown);
+        monitor.join();
+    }
+
+    shards.clear();
+    ring.clear();
+}
+
+int
+ShardedConnection::
+shardOf(const std::string & key) const
+{
+    ExcAssert(!ring.empty());
+
+    uint64_t hash = hashKey(key);
+    auto it = std::lower_bound(ring.begin(), ring.end(),
+                               std::make_pair(hash, 0));
+    if (it == ring.end())
+        it = ring.begin();
+    return it->second;
+}
+
+void
+ShardedConnection::
+queue(const Command & command, const OnResult & onResult, Timeout timeout)
+{
+    if (shards.empty())
+        throw ML::Exception("not connected to Redis shards");
+
+    if (isCommand(command, "MGET") || isCommand(command, "DEL")
+        || isCommand(command, "EXISTS")) {
+        fanOut(command, 1, onResult, timeout);
+        return;
+    }
+    if (isCommand(command, "MSET")) {
+        fanOut(command, 2, onResult, timeout);
+        return;
+    }
+
+    for (auto name = unshardable;  *name;  ++name) {
+        if (isCommand(command, *name))
+            throw ML::Exception("Redis command %s can't be sharded",
+                                command.formatStr.c_str());
+    }
+    if (command.args.empty())
+        throw ML::Exception("Redis command %s has no key to shard it by",
+                            command.formatStr.c_str());
+
+    send(shardOf(command.args[0]), command, onResult, timeout);
+}
+
+Result
+ShardedConnection::
+exec(const Command & command, Timeout timeout)
+{
+    Result result;
+    int done = 0;
+
+    auto onResponse = [&] (const Redis::Result & redisResult)
+        {
+            result = redisResult;
+            done = 1;
+            futex_wake(done);
+        };
+
+    queue(command, onResponse, timeout);
+
+    while (!done)
+        futex_wait(done, 0);
+
+    return result;
+}
+
+void
+ShardedConnection::
+send(int shardIndex, const Command & command, const OnResult & onResult,
+     Timeout timeout)
+{
+    Shard & shard = *shards[shardIndex];
+
+    std::shared_ptr<AsyncConnection> connection;
+    if (shard.up)
+        connection = shard.pick();
+
+    if (!connection) {
+        if (onResult)
+            onResult(Result("Redis shard " + shard.address.uri()
+                            + " is down"));
+        return;
+    }
+
+    shard.numRequests++;
+
+    AsyncConnection * c = connection.get();
+    auto onShardResult = [this, &shard, c, onResult] (const Result & result)
+        {
+            this->onShardResult(shard, *c, result);
+            if (onResult)
+                onResult(result);
+        };
+    c->queue(command, onShardResult, timeout);
+}
+
+void
+ShardedConnection::
+fanOut(const Command & command, int stride, const OnResult & onResult,
+       Timeout timeout)
+{
+    if (command.args.empty() || command.args.size() % stride != 0)
+        throw ML::Exception("wrong number of arguments for Redis command %s",
+                            command.formatStr.c_str());
+
+    auto fanOut = std::make_shared<FanOut>(command, onResult);
+
+    std::vector<int> partOfShard(shards.size(), -1);
+    std::vector<int> shardOfPart;
+    std::vector<Command> commands;
+
+    for (size_t i = 0;  i < command.args.size();  i += stride) {
+        int shard = shardOf(command.args[i]);
+        int & part = partOfShard[shard];
+        if (part == -1) {
+            part = commands.size();
+            commands.emplace_back(command.formatStr);
+            shardOfPart.push_back(shard);
+        }
+        fanOut->keys.emplace_back(part, commands[part].args.size() / stride);
+        for (int j = 0;  j < stride;  ++j)
+            commands[part].addArg(command.args[i + j]);
+    }
+
+    // All on one shard: nothing to put back together
+    if (commands.size() == 1) {
+        send(shardOfPart[0], command, onResult, timeout);
+        return;
+    }
+
+    fanOut->parts.resize(commands.size());
+    for (unsigned i = 0;  i < commands.size();  ++i) {
+        send(shardOfPart[i], commands[i],
+             std::bind(&FanOut::result, fanOut, i, std::placeholders::_1),
+             timeout);
+    }
+}
+
+void
+ShardedConnection::
+onShardResult(Shard & shard, AsyncConnection & connection,
+              const Result & result)
+{
+    // Errors returned by Redis say nothing about the health of the shard
+    if (result.timedOut() || (!result && !connection.isConnected())) {
+        shard.numFailures++;
+        if (++shard.consecutiveFailures >= maxFailures
+            && shard.up.exchange(false))
+            cerr << "Redis shard " << shard.address.uri() << " is down"
+                 << endl;
+    }
+    else shard.consecutiveFailures = 0;
+}
+
+void
+ShardedConnection::
+runMonitor()
+{
+    // Connections replaced in the previous round.  A queue() may still
+    // have been using one then, and destroying it from its own thread
+    // would deadlock.
+    std::vector<std::shared_ptr<AsyncConnection> > retired;
+
+    while (!shutdown) {
+        futex_wait(shutdown, 0, checkInterval);
+        if (shutdown)
+            break;
+
+        retired.clear();
+
+        for (auto & shardPtr: shards) {
+            Shard & shard = *shardPtr;
+
+            for (size_t i = 0;  i < shard.connections.size();  ++i) {
+                std::shared_ptr<AsyncConnection> connection;
+                {
+                    std::unique_lock<std::mutex> guard(shard.lock);
+                    connection = shard.connections[i];
+                }
+                if (connection && connection->isConnected())
+                    continue;
+
+                std::shared_ptr<AsyncConnection> fresh;
+                try {
+                    fresh = std::make_shared<AsyncConnection>(shard.address);
+                } catch (const std::exception &) {
+                    continue;
+                }
+
+                {
+                    std::unique_lock<std::mutex> guard(shard.lock);
+                    shard.connections[i] = fresh;
+                }
+                retired.push_back(connection);
+            }
+
+            if (shard.up)
+                continue;
+
+            auto connection = shard.pick();
+            if (connection && connection->exec(PING, checkInterval)) {
+                shard.consecutiveFailures = 0;
+                shard.up = true;
+                cerr << "Redis shard " << shard.address.uri() << " is up"
+                     << endl;
+            }
+        }
+    }
+}
+
+std::vector<ShardedConnection::ShardStatus>
+ShardedConnection::
+shardStatus() const
+{
+    std::vector<ShardStatus> result;
+    for (auto & shard: shards) {
+        ShardStatus status;
+        status.address = shard->address;
+        status.up = shard->up;
+        status.consecutiveFailures = shard->consecutiveFailures;
+        status.numRequests = shard->numRequests;
+        status.numFailures = shard->numFailures;
+        result.push_back(status);
+    }
+    return result;
+}
+
+} // namespace Redis
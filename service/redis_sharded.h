@@ -0,0 +1,137 @@
+/* redis_sharded.h                                                 -*- C++ -*-
+   Copyright (c) 2014 Datacratic.  All rights reserved.
+
+   Connection to a set of Redis servers over which the keys are sharded.
+*/
+
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "soa/service/redis.h"
+
+
+namespace Redis {
+
+
+/*****************************************************************************/
+/* SHARDED CONNECTION                                                        */
+/*****************************************************************************/
+
+/** Asynchronous connection to several Redis servers, the shards, each
+    holding the keys that hash to it.
+
+    Keys are placed on a consistent hash ring, so that adding or removing a
+    shard only moves the keys of that shard.  As with Redis Cluster, only
+    the part of a key between the first '{' and the following '}' is
+    hashed when it is not empty, which allows related keys to be kept on
+    the same shard.
+
+    A command goes to the shard of its first argument, except for MGET,
+    MSET, DEL and EXISTS, which are split by shard and whose replies are
+    put back together.  Other commands of several keys must have them on
+    the same shard; transactions and commands without a key can't be
+    sharded.
+
+    Each shard has a pool of connections, used in turn.  A shard is marked
+    as down after a number of consecutive timeouts or connection errors,
+    after which its commands fail right away; a thread reconnects the lost
+    connections and pings the shards that are down until they reply.
+*/
+
+struct ShardedConnection {
+
+    typedef AsyncConnection::Timeout Timeout;
+    typedef AsyncConnection::OnResult OnResult;
+
+    ShardedConnection();
+
+    ShardedConnection(const std::vector<Address> & shards,
+                      int connectionsPerShard = 1);
+
+    ~ShardedConnection();
+
+    /** Set the number of consecutive failures after which a shard is
+        marked as down and the interval between its checks.  To be called
+        before connect().
+    */
+    void setHealthChecks(int maxFailures, double checkInterval);
+
+    void connect(const std::vector<Address> & shards,
+                 int connectionsPerShard = 1);
+
+    /** Ping every connection of every shard.  Throws if one doesn't
+        reply.
+    */
+    void test();
+
+    void close();
+
+    /** Queue an asynchronous command on the shard of its keys. */
+    void queue(const Command & command,
+               const OnResult & onResult = OnResult(),
+               Timeout timeout = Timeout());
+
+    /** Execute synchronously. */
+    Result exec(const Command & command, Timeout timeout = Timeout());
+
+    /** Shard that holds the given key. */
+    int shardOf(const std::string & key) const;
+
+    size_t numShards() const
+    {
+        return shards.size();
+    }
+
+    struct ShardStatus {
+        Address address;
+        bool up;
+        int consecutiveFailures;
+        uint64_t numRequests;
+        uint64_t numFailures;    ///< Timeouts and connection errors
+    };
+
+    std::vector<ShardStatus> shardStatus() const;
+
+    /** Points on the ring per shard */
+    static constexpr int VirtualNodes = 160;
+
+private:
+    struct Shard;
+    struct FanOut;
+
+    std::vector<std::unique_ptr<Shard> > shards;
+
+    /** Hash ring: points sorted by hash, with their shard */
+    std::vector<std::pair<uint64_t, int> > ring;
+
+    int maxFailures;
+    double checkInterval;
+
+    /** Send the command to the given shard, unless it is down */
+    void send(int shard, const Command & command, const OnResult & onResult,
+              Timeout timeout);
+
+    /** Split a command over the shards of its keys, each followed by
+        stride - 1 values.
+    */
+    void fanOut(const Command & command, int stride,
+                const OnResult & onResult, Timeout timeout);
+
+    void onShardResult(Shard & shard, AsyncConnection & connection,
+                       const Result & result);
+
+    /** Reconnects the lost connections and checks the shards that are
+        down, every checkInterval.
+    */
+    void runMonitor();
+
+    std::thread monitor;
+    int shutdown;
+};
+
+} // namespace Redis
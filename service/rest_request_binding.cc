@@ -8,80 +8,117 @@
 
 namespace Datacratic {
 
+/*****************************************************************************/
+/* REST QUERY INDEX                                                          */
+/*****************************************************************************/
+
+int
+RestQueryIndex::
+add(const std::string & name)
+{
+    for (unsigned i = 0;  i < names.size();  ++i)
+        if (names[i] == name)
+            return i;
+    names.push_back(name);
+    return names.size() - 1;
+}
+
+RestQueryValues::
+RestQueryValues(const RestQueryIndex & index, const RestParams & params)
+{
+    const auto & names = index.names;
+    for (unsigned i = 0;  i < names.size();  ++i)
+        values.push_back(nullptr);
+
+    size_t numFound = 0;
+    for (auto & kv: params) {
+        if (numFound == names.size())
+            break;
+        for (unsigned i = 0;  i < names.size();  ++i) {
+            if (!values[i] && kv.first == names[i]) {
+                values[i] = &kv.second;
+                ++numFound;
+                break;
+            }
+        }
+    }
+}
+
+
+/*****************************************************************************/
+/* CREATE PARAMETER EXTRACTOR                                                */
+/*****************************************************************************/
+
 /** These functions turn an argument to the request binding into a function
     that can generate the value required by the handler function.
 
 */
 
-std::function<std::string
-              (const RestServiceEndpoint::ConnectionId & connection,
-               const RestRequest & request,
-               const RestRequestParsingContext & context)>
-createParameterExtractor(Json::Value & argHelp,
+StringPayloadExtractor
+createParameterExtractor(Json::Value & argHelp, RestQueryIndex & queryIndex,
                          const StringPayload & p, void *)
 {
     Json::Value & v = argHelp["payload"];
     v["description"] = p.description;
 
-    return [=] (const RestServiceEndpoint::ConnectionId & connection,
-                const RestRequest & request,
-                const RestRequestParsingContext & context)
-        {
-            return request.payload;
-        };
+    return StringPayloadExtractor();
 }
 
 /** Pass the connection on */
-std::function<const RestServiceEndpoint::ConnectionId &
-                     (const RestServiceEndpoint::ConnectionId & connection,
-                      const RestRequest & request,
-                      const RestRequestParsingContext & context)>
-createParameterExtractor(Json::Value & argHelp,
+PassConnectionIdExtractor
+createParameterExtractor(Json::Value & argHelp, RestQueryIndex & queryIndex,
                          const PassConnectionId &, void *)
 {
-    return [] (const RestServiceEndpoint::ConnectionId & connection,
-                const RestRequest & request,
-                const RestRequestParsingContext & context)
-        -> const RestServiceEndpoint::ConnectionId &
-        {
-            return connection;
-        };
+    return PassConnectionIdExtractor();
 }
 
-/** Pass the connection on */
-std::function<const RestRequestParsingContext &
-                     (const RestServiceEndpoint::ConnectionId & connection,
-                      const RestRequest & request,
-                      const RestRequestParsingContext & context)>
-createParameterExtractor(Json::Value & argHelp,
+/** Pass the parsing context on */
+PassParsingContextExtractor
+createParameterExtractor(Json::Value & argHelp, RestQueryIndex & queryIndex,
                          const PassParsingContext &, void *)
 {
-    return [] (const RestServiceEndpoint::ConnectionId & connection,
-                const RestRequest & request,
-                const RestRequestParsingContext & context)
-        -> const RestRequestParsingContext &
-        {
-            return context;
-        };
+    return PassParsingContextExtractor();
 }
 
-/** Pass the connection on */
-std::function<const RestRequest &
-                     (const RestServiceEndpoint::ConnectionId & connection,
-                      const RestRequest & request,
-                      const RestRequestParsingContext & context)>
-createParameterExtractor(Json::Value & argHelp,
+/** Pass the request on */
+PassRequestExtractor
+createParameterExtractor(Json::Value & argHelp, RestQueryIndex & queryIndex,
                          const PassRequest &, void *)
 {
-    return [] (const RestServiceEndpoint::ConnectionId & connection,
-               const RestRequest & request,
-               const RestRequestParsingContext & context)
-        -> const RestRequest &
-        {
-            return request;
-        };
+    return PassRequestExtractor();
 }
 
 
+/*****************************************************************************/
+/* LEGACY PARAMETER EXTRACTORS                                               */
+/*****************************************************************************/
+
+RestLegacyExtractor<StringPayloadExtractor>::Function
+createParameterExtractor(Json::Value & argHelp,
+                         const StringPayload & p, void *)
+{
+    return createLegacyParameterExtractor(argHelp, p);
+}
+
+RestLegacyExtractor<PassConnectionIdExtractor>::Function
+createParameterExtractor(Json::Value & argHelp,
+                         const PassConnectionId & p, void *)
+{
+    return createLegacyParameterExtractor(argHelp, p);
+}
+
+RestLegacyExtractor<PassParsingContextExtractor>::Function
+createParameterExtractor(Json::Value & argHelp,
+                         const PassParsingContext & p, void *)
+{
+    return createLegacyParameterExtractor(argHelp, p);
+}
+
+RestLegacyExtractor<PassRequestExtractor>::Function
+createParameterExtractor(Json::Value & argHelp,
+                         const PassRequest & p, void *)
+{
+    return createLegacyParameterExtractor(argHelp, p);
+}
 
 } // namespace Datacratic
@@ -15,9 +15,11 @@
 #include <boost/lexical_cast.hpp>
 #include "json_codec.h"
 #include "soa/types/value_description.h"
+#include "soa/types/json_parsing.h"
 #include "soa/types/json_printing.h"
 #include "rest_request_params.h"
 #include "rest_request_params_types.h"
+#include "jml/utils/compact_vector.h"
 
 namespace Datacratic {
 
@@ -74,13 +76,53 @@ partial_bind(const std::function<R (Arg1, Args...)> & fn, Bind1 && bind1)
 }
 
 
+/*****************************************************************************/
+/* REST QUERY INDEX                                                          */
+/*****************************************************************************/
+
+/** Names of the query string parameters that the handler of a route takes,
+    collected when the route is bound.  Each name gets a slot, so that the
+    parameters of a request are looked up in one pass rather than once per
+    name.
+*/
+struct RestQueryIndex {
+    /** Return the slot of the given parameter, adding it if needed. */
+    int add(const std::string & name);
+
+    std::vector<std::string> names;
+};
+
+/** Values of the query string parameters of a request, by slot of a
+    RestQueryIndex.  As with RestParams::getValue(), the first value of a
+    parameter that appears more than once is the one that is used.
+*/
+struct RestQueryValues {
+    RestQueryValues(const RestQueryIndex & index, const RestParams & params);
+
+    /** Return the value of the parameter in the given slot, or null if the
+        request doesn't have it.
+    */
+    const std::string * operator [] (int slot) const
+    {
+        return values[slot];
+    }
+
+private:
+    ML::compact_vector<const std::string *, 8> values;
+};
+
+
 /*****************************************************************************/
 /* CREATE PARAMETER EXTRACTOR                                                */
 /*****************************************************************************/
 
 /** These functions turn an argument to the request binding into a function
-    that can generate the value required by the handler function.
+    object that can generate the value required by the handler function.
 
+    The function objects are called with the connection, the request, its
+    parsing context and the values of its query string parameters.  They
+    are plain structures rather than std::functions, so that the handler
+    can call them directly.
 */
 
 #if 0
@@ -104,47 +146,99 @@ createParameterExtractor(Json::Value & argHelp, const T & p, void * = 0)
 }
 #endif
 
-std::function<std::string
-              (const RestServiceEndpoint::ConnectionId & connection,
-               const RestRequest & request,
-               const RestRequestParsingContext & context)>
-createParameterExtractor(Json::Value & argHelp,
+/** Pass the payload on as a string */
+struct StringPayloadExtractor {
+    std::string
+    operator () (const RestServiceEndpoint::ConnectionId & connection,
+                 const RestRequest & request,
+                 const RestRequestParsingContext & context,
+                 const RestQueryValues & query) const
+    {
+        return request.payload;
+    }
+};
+
+StringPayloadExtractor
+createParameterExtractor(Json::Value & argHelp, RestQueryIndex & queryIndex,
                          const StringPayload & p, void * = 0);
 
 /** Pass the connection on */
-std::function<const RestServiceEndpoint::ConnectionId &
-              (const RestServiceEndpoint::ConnectionId & connection,
-               const RestRequest & request,
-               const RestRequestParsingContext & context)>
-createParameterExtractor(Json::Value & argHelp,
+struct PassConnectionIdExtractor {
+    const RestServiceEndpoint::ConnectionId &
+    operator () (const RestServiceEndpoint::ConnectionId & connection,
+                 const RestRequest & request,
+                 const RestRequestParsingContext & context,
+                 const RestQueryValues & query) const
+    {
+        return connection;
+    }
+};
+
+PassConnectionIdExtractor
+createParameterExtractor(Json::Value & argHelp, RestQueryIndex & queryIndex,
                          const PassConnectionId &, void * = 0);
 
-/** Pass the connection on */
-std::function<const RestRequestParsingContext &
-              (const RestServiceEndpoint::ConnectionId & connection,
-               const RestRequest & request,
-               const RestRequestParsingContext & context)>
-createParameterExtractor(Json::Value & argHelp,
+/** Pass the parsing context on */
+struct PassParsingContextExtractor {
+    const RestRequestParsingContext &
+    operator () (const RestServiceEndpoint::ConnectionId & connection,
+                 const RestRequest & request,
+                 const RestRequestParsingContext & context,
+                 const RestQueryValues & query) const
+    {
+        return context;
+    }
+};
+
+PassParsingContextExtractor
+createParameterExtractor(Json::Value & argHelp, RestQueryIndex & queryIndex,
                          const PassParsingContext &, void * = 0);
 
-/** Pass the connection on */
-std::function<const RestRequest &
-              (const RestServiceEndpoint::ConnectionId & connection,
-               const RestRequest & request,
-               const RestRequestParsingContext & context)>
-createParameterExtractor(Json::Value & argHelp,
+/** Pass the request on */
+struct PassRequestExtractor {
+    const RestRequest &
+    operator () (const RestServiceEndpoint::ConnectionId & connection,
+                 const RestRequest & request,
+                 const RestRequestParsingContext & context,
+                 const RestQueryValues & query) const
+    {
+        return request;
+    }
+};
+
+PassRequestExtractor
+createParameterExtractor(Json::Value & argHelp, RestQueryIndex & queryIndex,
                          const PassRequest &, void * = 0);
 
+/** Extractor for a parameter from the query string, which must be
+    present.
+*/
+template<typename T, typename Codec>
+struct RestParamExtractor {
+    typedef decltype(Codec::decode(std::declval<std::string>())) Result;
+
+    std::string name;
+    int slot;
+
+    Result operator () (const RestServiceEndpoint::ConnectionId & connection,
+                        const RestRequest & request,
+                        const RestRequestParsingContext & context,
+                        const RestQueryValues & query) const
+    {
+        const std::string * value = query[slot];
+        if (!value)
+            throw ML::Exception("key " + name + " not found in RestParams");
+        return Codec::decode(*value);
+    }
+};
+
 /** Free function to be called in order to generate a parameter extractor
     for the given parameter.  See the CreateRestParameterGenerator class for more
     details.
 */
 template<typename T, typename Codec>
-static std::function<decltype(Codec::decode(std::declval<std::string>()))
-                     (const RestServiceEndpoint::ConnectionId & connection,
-                      const RestRequest & request,
-                      const RestRequestParsingContext & context)>
-createParameterExtractor(Json::Value & argHelp,
+static RestParamExtractor<T, Codec>
+createParameterExtractor(Json::Value & argHelp, RestQueryIndex & queryIndex,
                          const RestParam<T, Codec> & p, void * = 0)
 {
     ExcAssertNotEqual(p.name, "");
@@ -158,21 +252,32 @@ createParameterExtractor(Json::Value & argHelp,
     v2["encoding"] = "URI encoded";
     v2["location"] = "query string";
 
-    return [=] (const RestServiceEndpoint::ConnectionId & connection,
-                const RestRequest & request,
-                const RestRequestParsingContext & context)
-        {
-            //std::cerr << "getting value of " << p.name << std::endl;
-            std::string paramValue = request.params.getValue(p.name);
-            return Codec::decode(paramValue);
-        };
+    return RestParamExtractor<T, Codec>{ p.name, queryIndex.add(p.name) };
 }
 
+/** Extractor for a parameter from the query string, which takes a default
+    value when it's missing.
+*/
 template<typename T, typename Codec>
-static std::function<T (const RestServiceEndpoint::ConnectionId & connection,
-                        const RestRequest & request,
-                        const RestRequestParsingContext & context)>
-createParameterExtractor(Json::Value & argHelp,
+struct RestParamDefaultExtractor {
+    T defaultValue;
+    int slot;
+
+    T operator () (const RestServiceEndpoint::ConnectionId & connection,
+                   const RestRequest & request,
+                   const RestRequestParsingContext & context,
+                   const RestQueryValues & query) const
+    {
+        const std::string * value = query[slot];
+        if (value)
+            return Codec::decode(*value);
+        return defaultValue;
+    }
+};
+
+template<typename T, typename Codec>
+static RestParamDefaultExtractor<T, Codec>
+createParameterExtractor(Json::Value & argHelp, RestQueryIndex & queryIndex,
                          const RestParamDefault<T, Codec> & p, void * = 0)
 {
     ExcAssertNotEqual(p.name, "");
@@ -187,30 +292,100 @@ createParameterExtractor(Json::Value & argHelp,
     v2["location"] = "query string";
     v2["defaultValue"] = p.defaultValueStr;
 
-    return [=] (const RestServiceEndpoint::ConnectionId & connection,
-                const RestRequest & request,
-                const RestRequestParsingContext & context)
-        {
-            //std::cerr << "getting value of " << p.name << std::endl;
-            std::string paramValue;
-            T result;
-            if (request.params.hasValue(p.name)) 
-                result = Codec::decode(request.params.getValue(p.name));
-            else result = p.defaultValue;
-            return result;
-        };
+    return RestParamDefaultExtractor<T, Codec>{ p.defaultValue,
+                                                queryIndex.add(p.name) };
 }
 
+/** Decoder of a parameter from the JSON payload.  The default goes through
+    a Json::Value and the JsonCodec of the type.
+*/
+template<typename T, typename Enable = void>
+struct RestJsonParamDecoder {
+    typedef decltype(JsonCodec<T>::decode(std::declval<Json::Value>())) Result;
+
+    static Result decode(const std::string & payload, const std::string & name)
+    {
+        Json::Value parsed = Json::parse(payload);
+        return JsonCodec<T>::decode(name.empty() ? parsed : parsed[name]);
+    }
+};
+
+/** Types with a default description and no fromJson() are parsed straight
+    from the payload, without building a Json::Value.  The other members of
+    the payload are skipped.  A payload that has a member more than once or
+    is followed by anything but whitespace is rejected.
+*/
+template<typename T>
+struct RestJsonParamDecoder<T, typename std::enable_if<!hasFromJson<T>::value, decltype((void)getDefaultDescription((T *)0))>::type> {
+    typedef T Result;
+
+    static T decode(const std::string & payload, const std::string & name)
+    {
+        static auto desc = getDefaultDescriptionShared((T *)0);
+
+        T result;
+        StreamingJsonParsingContext context("request payload",
+                                            payload.c_str(),
+                                            payload.c_str() + payload.size());
+
+        bool found = false;
+        if (name.empty()) {
+            desc->parseJson(&result, context);
+            found = true;
+        }
+        else {
+            ML::compact_vector<std::string, 8> members;
+            auto onMember = [&] ()
+                {
+                    const char * member = context.fieldNamePtr();
+                    for (auto & m: members)
+                        if (m == member)
+                            context.exception("duplicate member " + m);
+                    members.emplace_back(member);
+
+                    if (name == member) {
+                        desc->parseJson(&result, context);
+                        found = true;
+                    }
+                    else context.skip();
+                };
+            context.forEachMember(onMember);
+        }
+
+        skipJsonWhitespace(*context.context);
+        if (!context.context->eof())
+            context.exception("unexpected characters after the payload");
+
+        // A missing member decodes as null, like it did through Json::Value
+        if (!found)
+            return JsonCodec<T>::decode(Json::Value());
+        return result;
+    }
+};
+
+/** Extractor for a parameter from the JSON payload. */
+template<typename T>
+struct JsonParamExtractor {
+    typedef typename RestJsonParamDecoder<T>::Result Result;
+
+    std::string name;
+
+    Result operator () (const RestServiceEndpoint::ConnectionId & connection,
+                        const RestRequest & request,
+                        const RestRequestParsingContext & context,
+                        const RestQueryValues & query) const
+    {
+        return RestJsonParamDecoder<T>::decode(request.payload, name);
+    }
+};
+
 /** Free function to be called in order to generate a parameter extractor
     for the given parameter.  See the CreateRestParameterGenerator class for more
     details.
 */
 template<typename T>
-static std::function<decltype(JsonCodec<T>::decode(std::declval<Json::Value>()))
-                     (const RestServiceEndpoint::ConnectionId & connection,
-                      const RestRequest & request,
-                      const RestRequestParsingContext & context)>
-createParameterExtractor(Json::Value & argHelp,
+static JsonParamExtractor<T>
+createParameterExtractor(Json::Value & argHelp, RestQueryIndex & queryIndex,
                          const JsonParam<T> & p, void * = 0)
 {
     Json::Value & v = argHelp["jsonParams"];
@@ -222,25 +397,50 @@ createParameterExtractor(Json::Value & argHelp,
     v2["encoding"] = "JSON";
     v2["location"] = "Request Body";
 
-    return [=] (const RestServiceEndpoint::ConnectionId & connection,
-                const RestRequest & request,
-                const RestRequestParsingContext & context)
-        {
-            Json::Value parsed = Json::parse(request.payload);
-            return JsonCodec<T>::decode(p.name.empty() ? parsed : parsed[p.name]);
-        };
+    return JsonParamExtractor<T>{ p.name };
 }
 
+/** Extractor for a parameter from the path of the request. */
+template<typename T, typename Codec>
+struct RequestParamExtractor {
+    typedef decltype(Codec::decode(std::declval<std::string>())) Result;
+
+    int index;
+
+    Result operator () (const RestServiceEndpoint::ConnectionId & connection,
+                        const RestRequest & request,
+                        const RestRequestParsingContext & context,
+                        const RestQueryValues & query) const
+    {
+        int index = this->index;
+        //using namespace std;
+        //cerr << "index " << index << " with "
+        //     << context.resources.size() << " resources" << endl;
+        if (index < 0)
+            index = context.resources.size() + index;
+        if (index >= context.resources.size()) {
+            std::string knownResources;
+            for (auto & r: context.resources)
+                knownResources
+                    += (knownResources.empty() ? "":",")
+                    +  r;
+            throw ML::Exception("attempt to access missing resource %d of "
+                                "%zd (known is %s)",
+                                index, context.resources.size(),
+                                knownResources.c_str());
+        }
+
+        return Codec::decode(context.resources.at(index));
+    }
+};
+
 /** Free function to be called in order to generate a parameter extractor
     for the given parameter.  See the CreateRestParameterGenerator class for more
     details.
 */
 template<typename T, typename Codec>
-static std::function<decltype(Codec::decode(std::declval<std::string>()))
-                     (const RestServiceEndpoint::ConnectionId & connection,
-                      const RestRequest & request,
-                      const RestRequestParsingContext & context)>
-createParameterExtractor(Json::Value & argHelp,
+static RequestParamExtractor<T, Codec>
+createParameterExtractor(Json::Value & argHelp, RestQueryIndex & queryIndex,
                          const RequestParam<T, Codec> & p, void * = 0)
 {
     Json::Value & v = argHelp["resourceParams"];
@@ -252,31 +452,7 @@ createParameterExtractor(Json::Value & argHelp,
     v2["encoding"] = "URI encoded";
     v2["location"] = "URI";
 
-    return [=] (const RestServiceEndpoint::ConnectionId & connection,
-                const RestRequest & request,
-                const RestRequestParsingContext & context)
-        {
-            int index = p.index;
-            //using namespace std;
-            //cerr << "index " << index << " with "
-            //     << context.resources.size() << " resources" << endl;
-            if (index < 0)
-                index = context.resources.size() + index;
-            if (index >= context.resources.size()) {
-                std::string knownResources;
-                for (auto & r: context.resources)
-                    knownResources
-                        += (knownResources.empty() ? "":",")
-                        +  r;
-                throw ML::Exception("attempt to access missing resource %d of "
-                                    "%zd (known is %s)",
-                                    index, context.resources.size(),
-                                    knownResources.c_str());
-            }
-
-            std::string paramValue = context.resources.at(index);
-            return Codec::decode(paramValue);
-        };
+    return RequestParamExtractor<T, Codec>{ p.index };
 }
 
 /** Parameter extractor to generate something of the type
@@ -293,39 +469,170 @@ createParameterExtractor(Json::Value & argHelp,
     finish off a request by sending back it's results.
 */
 template<typename Fn, typename Return, typename... Args>
-std::function<std::function<Return (Args...)>
-              (const RestServiceEndpoint::ConnectionId & connection,
-               const RestRequest & request,
-               const RestRequestParsingContext & context)>
+struct CallbackExtractor {
+    Fn fn;
+
+    std::function<Return (Args...)>
+    operator () (const RestServiceEndpoint::ConnectionId & connection,
+                 const RestRequest & request,
+                 const RestRequestParsingContext & context,
+                 const RestQueryValues & query) const
+    {
+        // TODO: deal with more/less than one parameter...
+        return std::bind(fn, std::placeholders::_1, connection, request);
+    }
+};
+
+template<typename Fn, typename Return, typename... Args>
+CallbackExtractor<Fn, Return, Args...>
+createParameterExtractor(Json::Value & argHelp, RestQueryIndex & queryIndex,
+                         const Fn & fn, std::function<Return (Args...)> * = 0)
+{
+    return CallbackExtractor<Fn, Return, Args...>{ fn };
+}
+
+/** Extractor for an object that was put in the parsing context while
+    routing the request.
+*/
+template<typename Object, int Index>
+struct ContextObjectExtractor {
+    Object & operator () (const RestServiceEndpoint::ConnectionId & connection,
+                          const RestRequest & request,
+                          const RestRequestParsingContext & context,
+                          const RestQueryValues & query) const
+    {
+        return context.getObjectAs<Object>(Index);
+    }
+};
+
+template<typename Object, int Index>
+inline static ContextObjectExtractor<Object, Index>
+createParameterExtractor(Json::Value & argHelp, RestQueryIndex & queryIndex,
+                         const ObjectExtractor<Object, Index> & obj,
+                         void * = 0)
+{
+    return ContextObjectExtractor<Object, Index>();
+}
+
+
+/*****************************************************************************/
+/* LEGACY PARAMETER EXTRACTORS                                               */
+/*****************************************************************************/
+
+/** The extractors as they were before the query string parameters were
+    indexed: std::functions of the connection, the request and its parsing
+    context, for the code that creates and calls them itself.  Each one
+    looks its parameter up in the request on every call.
+*/
+
+template<typename Extractor>
+struct RestLegacyExtractor {
+    typedef decltype(std::declval<const Extractor &>()
+                     (std::declval<RestServiceEndpoint::ConnectionId>(),
+                      std::declval<RestRequest>(),
+                      std::declval<RestRequestParsingContext>(),
+                      std::declval<RestQueryValues>())) Result;
+
+    typedef std::function<Result
+                          (const RestServiceEndpoint::ConnectionId & connection,
+                           const RestRequest & request,
+                           const RestRequestParsingContext & context)>
+        Function;
+
+    static Function wrap(const Extractor & extractor,
+                         const RestQueryIndex & queryIndex)
+    {
+        return [=] (const RestServiceEndpoint::ConnectionId & connection,
+                    const RestRequest & request,
+                    const RestRequestParsingContext & context)
+            -> Result
+            {
+                RestQueryValues query(queryIndex, request.params);
+                return extractor(connection, request, context, query);
+            };
+    }
+};
+
+/** Create the extractor of the given parameter with an index of its own,
+    and wrap it.
+*/
+template<typename Param>
+typename RestLegacyExtractor<decltype(createParameterExtractor(std::declval<Json::Value &>(), std::declval<RestQueryIndex &>(), std::declval<const Param &>()))>::Function
+createLegacyParameterExtractor(Json::Value & argHelp, const Param & p)
+{
+    RestQueryIndex queryIndex;
+    auto extractor = createParameterExtractor(argHelp, queryIndex, p);
+    return RestLegacyExtractor<decltype(extractor)>::wrap(extractor,
+                                                          queryIndex);
+}
+
+RestLegacyExtractor<StringPayloadExtractor>::Function
+createParameterExtractor(Json::Value & argHelp,
+                         const StringPayload & p, void * = 0);
+
+RestLegacyExtractor<PassConnectionIdExtractor>::Function
+createParameterExtractor(Json::Value & argHelp,
+                         const PassConnectionId & p, void * = 0);
+
+RestLegacyExtractor<PassParsingContextExtractor>::Function
+createParameterExtractor(Json::Value & argHelp,
+                         const PassParsingContext & p, void * = 0);
+
+RestLegacyExtractor<PassRequestExtractor>::Function
+createParameterExtractor(Json::Value & argHelp,
+                         const PassRequest & p, void * = 0);
+
+template<typename T, typename Codec>
+static typename RestLegacyExtractor<RestParamExtractor<T, Codec> >::Function
+createParameterExtractor(Json::Value & argHelp,
+                         const RestParam<T, Codec> & p, void * = 0)
+{
+    return createLegacyParameterExtractor(argHelp, p);
+}
+
+template<typename T, typename Codec>
+static typename RestLegacyExtractor<RestParamDefaultExtractor<T, Codec> >::Function
+createParameterExtractor(Json::Value & argHelp,
+                         const RestParamDefault<T, Codec> & p, void * = 0)
+{
+    return createLegacyParameterExtractor(argHelp, p);
+}
+
+template<typename T>
+static typename RestLegacyExtractor<JsonParamExtractor<T> >::Function
+createParameterExtractor(Json::Value & argHelp,
+                         const JsonParam<T> & p, void * = 0)
+{
+    return createLegacyParameterExtractor(argHelp, p);
+}
+
+template<typename T, typename Codec>
+static typename RestLegacyExtractor<RequestParamExtractor<T, Codec> >::Function
+createParameterExtractor(Json::Value & argHelp,
+                         const RequestParam<T, Codec> & p, void * = 0)
+{
+    return createLegacyParameterExtractor(argHelp, p);
+}
+
+template<typename Fn, typename Return, typename... Args>
+typename RestLegacyExtractor<CallbackExtractor<Fn, Return, Args...> >::Function
 createParameterExtractor(Json::Value argHelp,
                          const Fn & fn, std::function<Return (Args...)> * = 0)
 {
-    return [=] (const RestServiceEndpoint::ConnectionId & connection,
-                const RestRequest & request,
-                const RestRequestParsingContext & context)
-        {
-            // TODO: deal with more/less than one parameter...
-            return std::bind(fn, std::placeholders::_1, connection, request);
-        };
+    RestQueryIndex queryIndex;
+    return RestLegacyExtractor<CallbackExtractor<Fn, Return, Args...> >
+        ::wrap(createParameterExtractor(argHelp, queryIndex, fn,
+                                        (std::function<Return (Args...)> *)0),
+               queryIndex);
 }
 
 template<typename Object, int Index>
-inline static std::function<Object &
-                            (const RestServiceEndpoint::ConnectionId & connection,
-                             const RestRequest & request,
-                             const RestRequestParsingContext & context)>
+inline static typename RestLegacyExtractor<ContextObjectExtractor<Object, Index> >::Function
 createParameterExtractor(Json::Value & argHelp,
                          const ObjectExtractor<Object, Index> & obj,
                          void * = 0)
 {
-    return [] (const RestServiceEndpoint::ConnectionId & connection,
-               const RestRequest & request,
-               const RestRequestParsingContext & context)
-        -> Object &
-        {
-            
-            return context.getObjectAs<Object>(Index);
-        };
+    return createLegacyParameterExtractor(argHelp, obj);
 }
 
 /// Type of the function to handle an exception in the REST binding
@@ -375,20 +682,23 @@ struct CreateRestParameterGenerator {
 template<int Index, typename Arg, typename Param, typename... Params>
 struct CreateRestParameterGenerator<ML::PositionedDualType<Index, Arg, Param>, Params...> {
 
-    typedef decltype(createParameterExtractor(*(Json::Value *)0, std::declval<typename ML::ExtractArgAtPosition<0, Index, Params...>::type>(), (typename std::decay<Arg>::type *)0)) Generator;
+    typedef decltype(createParameterExtractor(*(Json::Value *)0, *(RestQueryIndex *)0, std::declval<typename ML::ExtractArgAtPosition<0, Index, Params...>::type>(), (typename std::decay<Arg>::type *)0)) Generator;
 
     //typedef std::decay<Arg> Result;
     typedef decltype(std::declval<Generator>()
                      (std::declval<RestServiceEndpoint::ConnectionId>(),
                       std::declval<RestRequest>(),
-                      std::declval<RestRequestParsingContext>())) Result;
+                      std::declval<RestRequestParsingContext>(),
+                      std::declval<RestQueryValues>())) Result;
 
     /** Create the generator */
-    static Generator create(Json::Value & argHelp, Params&&... params)
+    static Generator create(Json::Value & argHelp,
+                            RestQueryIndex & queryIndex,
+                            Params&&... params)
     {
         auto param = ML::ExtractArgAtPosition<0, Index, Params...>
             ::extract(std::forward<Params>(params)...);
-        return createParameterExtractor(argHelp,
+        return createParameterExtractor(argHelp, queryIndex,
                                         param,
                                         (typename std::decay<Arg>::type *)0);
     }
@@ -402,9 +712,10 @@ struct CreateRestParameterGenerator<ML::PositionedDualType<Index, Arg, Param>, P
     static Result apply(const Generators & gens,
                         const RestServiceEndpoint::ConnectionId & connection,
                         const RestRequest & request,
-                        const RestRequestParsingContext & context)
+                        const RestRequestParsingContext & context,
+                        const RestQueryValues & query)
     {
-        return std::get<Index>(gens)(connection, request, context);
+        return std::get<Index>(gens)(connection, request, context, query);
     }
 };
 
@@ -427,10 +738,11 @@ struct RestRequestBinder<ML::TypeList<PositionedDualTypes...> > {
              Params&&... params)
     {
         Json::Value argHelp;
+        RestQueryIndex queryIndex;
 
         // Create a tuple of function objects that we can call with
         auto gens = std::make_tuple(CreateRestParameterGenerator<PositionedDualTypes, Params...>
-                                    ::create(argHelp, std::forward<Params>(params)...)...);
+                                    ::create(argHelp, queryIndex, std::forward<Params>(params)...)...);
         // Necessary to deal with a compiler bug
         auto sharedGens = std::make_shared<decltype(gens)>(std::move(gens));
 
@@ -439,11 +751,12 @@ struct RestRequestBinder<ML::TypeList<PositionedDualTypes...> > {
                    const RestRequest & request,
                    const RestRequestParsingContext & context)
             {
-                auto gens = *sharedGens;
+                const auto & gens = *sharedGens;
+                RestQueryValues query(queryIndex, request.params);
                 try {
                     Obj & obj = *ptr;
                     ((obj).*(pmf))(CreateRestParameterGenerator<PositionedDualTypes, Params...>
-                                   ::apply(gens, connection, request, context)...
+                                   ::apply(gens, connection, request, context, query)...
                                    );
                         
                     connection.sendResponse(200);
@@ -471,10 +784,11 @@ struct RestRequestBinder<ML::TypeList<PositionedDualTypes...> > {
              Params&&... params)
     {
         Json::Value argHelp;
+        RestQueryIndex queryIndex;
 
         // Create a tuple of function objects that we can call with
         auto gens = std::make_tuple(CreateRestParameterGenerator<PositionedDualTypes, Params...>
-                                    ::create(argHelp, std::forward<Params>(params)...)...);
+                                    ::create(argHelp, queryIndex, std::forward<Params>(params)...)...);
         // Necessary to deal with a compiler bug
         auto sharedGens = std::make_shared<decltype(gens)>(std::move(gens));
 
@@ -483,11 +797,12 @@ struct RestRequestBinder<ML::TypeList<PositionedDualTypes...> > {
                    const RestRequest & request,
                    const RestRequestParsingContext & context)
             {
-                auto gens = *sharedGens;
+                const auto & gens = *sharedGens;
+                RestQueryValues query(queryIndex, request.params);
                 try {
                     Obj & obj = *ptr;
                     ((obj).*(pmf))(CreateRestParameterGenerator<PositionedDualTypes, Params...>
-                                   ::apply(gens, connection, request, context)...
+                                   ::apply(gens, connection, request, context, query)...
                                    );
                         
                     connection.sendResponse(200);
@@ -519,10 +834,11 @@ struct RestRequestBinder<ML::TypeList<PositionedDualTypes...> > {
                    Params&&... params)
     {
         Json::Value argHelp;
+        RestQueryIndex queryIndex;
 
         // Create a tuple of function objects that we can call with
         auto gens = std::make_tuple(CreateRestParameterGenerator<PositionedDualTypes, Params...>
-                                    ::create(argHelp, std::forward<Params>(params)...)...);
+                                    ::create(argHelp, queryIndex, std::forward<Params>(params)...)...);
         // Necessary to deal with a compiler bug
         auto sharedGens = std::make_shared<decltype(gens)>(std::move(gens));
 
@@ -531,11 +847,12 @@ struct RestRequestBinder<ML::TypeList<PositionedDualTypes...> > {
                    const RestRequest & request,
                    const RestRequestParsingContext & context)
             {
-                auto gens = *sharedGens;
+                const auto & gens = *sharedGens;
+                RestQueryValues query(queryIndex, request.params);
                 try {
                     Obj & obj = *ptr;
                     auto res = ((obj).*(pmf))(CreateRestParameterGenerator<PositionedDualTypes, Params...>
-                                              ::apply(gens, connection, request, context)...
+                                              ::apply(gens, connection, request, context, query)...
                                               );
                     connection.sendResponse(200, fn(res));
                 } catch (const std::exception & exc) {
@@ -564,10 +881,11 @@ struct RestRequestBinder<ML::TypeList<PositionedDualTypes...> > {
                    Params&&... params)
     {
         Json::Value argHelp;
+        RestQueryIndex queryIndex;
 
         // Create a tuple of function objects that we can call with
         auto gens = std::make_tuple(CreateRestParameterGenerator<PositionedDualTypes, Params...>
-                                    ::create(argHelp, std::forward<Params>(params)...)...);
+                                    ::create(argHelp, queryIndex, std::forward<Params>(params)...)...);
         // Necessary to deal with a compiler bug
         auto sharedGens = std::make_shared<decltype(gens)>(std::move(gens));
 
@@ -576,11 +894,12 @@ struct RestRequestBinder<ML::TypeList<PositionedDualTypes...> > {
                    const RestRequest & request,
                    const RestRequestParsingContext & context)
             {
-                auto gens = *sharedGens;
+                const auto & gens = *sharedGens;
+                RestQueryValues query(queryIndex, request.params);
                 try {
                     Obj & obj = *ptr;
                     auto res = ((obj).*(pmf))(CreateRestParameterGenerator<PositionedDualTypes, Params...>
-                                              ::apply(gens, connection, request, context)...
+                                              ::apply(gens, connection, request, context, query)...
                                               );
                     
                     connection.sendResponse(200, fn(res));
@@ -611,10 +930,11 @@ struct RestRequestBinder<ML::TypeList<PositionedDualTypes...> > {
                          Params&&... params)
     {
         Json::Value argHelp;
+        RestQueryIndex queryIndex;
 
         // Create a tuple of function objects that we can call with
         auto gens = std::make_tuple(CreateRestParameterGenerator<PositionedDualTypes, Params...>
-                                    ::create(argHelp, std::forward<Params>(params)...)...);
+                                    ::create(argHelp, queryIndex, std::forward<Params>(params)...)...);
         // Necessary to deal with a compiler bug
         auto sharedGens = std::make_shared<decltype(gens)>(std::move(gens));
 
@@ -623,11 +943,12 @@ struct RestRequestBinder<ML::TypeList<PositionedDualTypes...> > {
                    const RestRequest & request,
                    const RestRequestParsingContext & context)
             {
-                auto gens = *sharedGens;
+                const auto & gens = *sharedGens;
+                RestQueryValues query(queryIndex, request.params);
                 try {
                     Obj & obj = *ptr;
                     auto res = ((obj).*(pmf))(CreateRestParameterGenerator<PositionedDualTypes, Params...>
-                                              ::apply(gens, connection, request, context)...
+                                              ::apply(gens, connection, request, context, query)...
                                               );
                     connection.sendResponse(res.first, res.second);
                 } catch (const std::exception & exc) {
@@ -654,10 +975,11 @@ struct RestRequestBinder<ML::TypeList<PositionedDualTypes...> > {
                          Params&&... params)
     {
         Json::Value argHelp;
+        RestQueryIndex queryIndex;
 
         // Create a tuple of function objects that we can call with
         auto gens = std::make_tuple(CreateRestParameterGenerator<PositionedDualTypes, Params...>
-                                    ::create(argHelp, std::forward<Params>(params)...)...);
+                                    ::create(argHelp, queryIndex, std::forward<Params>(params)...)...);
         // Necessary to deal with a compiler bug
         auto sharedGens = std::make_shared<decltype(gens)>(std::move(gens));
 
@@ -666,11 +988,12 @@ struct RestRequestBinder<ML::TypeList<PositionedDualTypes...> > {
                    const RestRequest & request,
                    const RestRequestParsingContext & context)
             {
-                auto gens = *sharedGens;
+                const auto & gens = *sharedGens;
+                RestQueryValues query(queryIndex, request.params);
                 try {
                     Obj & obj = *ptr;
                     auto res = ((obj).*(pmf))(CreateRestParameterGenerator<PositionedDualTypes, Params...>
-                                              ::apply(gens, connection, request, context)...
+                                              ::apply(gens, connection, request, context, query)...
                                               );
                     
                     connection.sendResponse(res.first, res.second);
@@ -701,10 +1024,11 @@ struct RestRequestBinder<ML::TypeList<PositionedDualTypes...> > {
               Params&&... params)
     {
         Json::Value argHelp;
+        RestQueryIndex queryIndex;
 
         // Create a tuple of function objects that we can call with
         auto gens = std::make_tuple(CreateRestParameterGenerator<PositionedDualTypes, Params...>
-                                    ::create(argHelp, std::forward<Params>(params)...)...);
+                                    ::create(argHelp, queryIndex, std::forward<Params>(params)...)...);
         // Necessary to deal with a compiler bug
         auto sharedGens = std::make_shared<decltype(gens)>(std::move(gens));
 
@@ -713,11 +1037,12 @@ struct RestRequestBinder<ML::TypeList<PositionedDualTypes...> > {
                    const RestRequest & request,
                    const RestRequestParsingContext & context)
             {
-                auto gens = *sharedGens;
+                const auto & gens = *sharedGens;
+                RestQueryValues query(queryIndex, request.params);
                 try {
                     Obj & obj = *ptr;
                     ((obj).*(pmf))(CreateRestParameterGenerator<PositionedDualTypes, Params...>
-                                   ::apply(gens, connection, request, context)...
+                                   ::apply(gens, connection, request, context, query)...
                                    );
                 } catch (const std::exception & exc) {
                     connection.sendErrorResponse(400, exc.what());
@@ -746,10 +1071,11 @@ struct RestRequestBinder<ML::TypeList<PositionedDualTypes...> > {
                   Params&&... params)
     {
         Json::Value argHelp;
+        RestQueryIndex queryIndex;
 
         // Create a tuple of function objects that we can call with
         auto gens = std::make_tuple(CreateRestParameterGenerator<PositionedDualTypes, Params...>
-                                    ::create(argHelp, std::forward<Params>(params)...)...);
+                                    ::create(argHelp, queryIndex, std::forward<Params>(params)...)...);
         // Necessary to deal with a compiler bug
         auto sharedGens = std::make_shared<decltype(gens)>(std::move(gens));
 
@@ -758,10 +1084,11 @@ struct RestRequestBinder<ML::TypeList<PositionedDualTypes...> > {
                    const RestRequest & request,
                    const RestRequestParsingContext & context) -> RestRequestRouter::MatchResult
             {
-                auto gens = *sharedGens;
+                const auto & gens = *sharedGens;
+                RestQueryValues query(queryIndex, request.params);
                 try {
                     return then(fn(CreateRestParameterGenerator<PositionedDualTypes, Params...>
-                                   ::apply(gens, connection, request, context)...
+                                   ::apply(gens, connection, request, context, query)...
                                    ),
                                 connection, request, context);
                 } catch (const std::exception & exc) {
@@ -146,6 +146,21 @@ sendHttpResponse(int responseCode,
     itl->responseSent = true;
 }
 
+void
+RestServiceEndpoint::ConnectionId::
+sendCannedResponse(const CannedHttpResponse & response) const
+{
+    if (itl->responseSent)
+        throw ML::Exception("response already sent");
+
+    if (itl->endpoint->logResponse)
+        itl->endpoint->logResponse(*this, response.responseCode,
+                                   response.body, response.contentType);
+
+    itl->http->sendCannedResponse(response);
+    itl->responseSent = true;
+}
+
 void
 RestServiceEndpoint::ConnectionId::
 sendHttpResponseHeader(int responseCode,
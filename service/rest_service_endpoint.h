@@ -165,6 +165,12 @@ struct RestServiceEndpoint: public MessageLoop {
                               const std::string & contentType,
                               const RestParams & headers) const;
 
+        /** Send a canned HTTP response, which is put on the wire as is
+            without being rebuilt.  If it's not an HTTP connection, this
+            will fail.
+        */
+        void sendCannedResponse(const CannedHttpResponse & response) const;
+
         enum {
             UNKNOWN_CONTENT_LENGTH = -1,
             CHUNKED_ENCODING = -2
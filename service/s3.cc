@@ -5,7 +5,11 @@
     Code to talk to s3.
 */
 
+#include <algorithm>
 #include <atomic>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
 #include <exception>
 #include <future>
 #include <memory>
@@ -113,18 +117,26 @@ struct S3Globals {
                                              const string & baseHostname
                                              = "s3.amazonaws.com")
     {
-        string hostname = bucket;
-        if (hostname.size() > 0) {
-            hostname += ".";
+        string endpoint;
+        if (baseHostname.find("://") != string::npos) {
+            /* explicit endpoint, for path-style requests */
+            endpoint = baseHostname;
+        }
+        else {
+            string hostname = bucket;
+            if (hostname.size() > 0) {
+                hostname += ".";
+            }
+            hostname += baseHostname;
+            endpoint = "http://" + hostname;
         }
-        hostname += baseHostname;
 
         unique_lock<mutex> guard(clientsLock);
-        auto & client = clients[hostname];
+        auto & client = clients[endpoint];
         if (!client) {
-            client.reset(new HttpClient("http://" + hostname, 30));
+            client.reset(new HttpClient(endpoint, 30));
             client->sendExpect100Continue(false);
-            loop.addSource("s3-client-" + hostname, client);
+            loop.addSource("s3-client-" + endpoint, client);
         }
 
         return client;
@@ -186,6 +198,34 @@ struct S3UrlFsHandler : public UrlFsHandler {
         }
     }
 
+    virtual bool eraseMany(const vector<Url> & urls, bool throwException) const
+    {
+        map<string, vector<string> > objectsByBucket;
+        for (const Url & url: urls) {
+            auto bucketPath = S3Api::parseUri(url.original);
+            objectsByBucket[bucketPath.first].push_back(bucketPath.second);
+        }
+
+        bool result(true);
+        for (const auto & it: objectsByBucket) {
+            auto api = getS3ApiForBucket(it.first);
+            auto errors = api->eraseObjects(it.first, it.second);
+            if (!errors.empty()) {
+                if (throwException) {
+                    const auto & error = *errors.begin();
+                    throw ML::Exception("error erasing %zd objects from "
+                                        "bucket %s, including %s: %s",
+                                        errors.size(), it.first.c_str(),
+                                        error.first.c_str(),
+                                        error.second.c_str());
+                }
+                result = false;
+            }
+        }
+
+        return result;
+    }
+
     virtual bool forEach(const Url & prefix,
                          const OnUriObject & onObject,
                          const OnUriSubdir & onSubdir,
@@ -835,6 +875,7 @@ struct S3RequestState {
     S3RequestState(const S3Api & s3Api, S3Api::Request && rq,
                    const S3Api::OnResponse & onResponse)
         : accessKeyId(s3Api.accessKeyId), accessKey(s3Api.accessKey),
+          serviceUri(s3Api.serviceUri),
           bandwidthToServiceMbps(s3Api.bandwidthToServiceMbps),
           rq(std::move(rq)),
           range(rq.downloadRange),
@@ -871,8 +912,15 @@ struct S3RequestState {
         return 15 + std::max<int>(30, expectedTimeSeconds * 6);
     }
 
+    bool usePathStyle()
+        const
+    {
+        return serviceUri.find("://") != string::npos;
+    }
+
     string accessKeyId;
     string accessKey;
+    string serviceUri;
     double bandwidthToServiceMbps;
 
     S3Api::Request rq;
@@ -919,10 +967,17 @@ private:
 void
 performStateRequest(const shared_ptr<S3RequestState> & state)
 {
-    const auto & client = getS3Globals().getClient(state->rq.bucket);
-
     const S3Api::Request & request = state->rq;
-    string resource = state->rq.makeUrl();
+    string resource = request.makeUrl();
+
+    bool pathStyle = state->usePathStyle();
+    const auto & client
+        = (pathStyle
+           ? getS3Globals().getClient("", state->serviceUri)
+           : getS3Globals().getClient(request.bucket));
+    if (pathStyle) {
+        resource = "/" + request.bucket + resource;
+    }
     auto callbacks = make_shared<S3RequestCallbacks>(state);
     RestParams headers = state->makeHeaders();
     int timeout = state->makeTimeout();
@@ -1129,18 +1184,389 @@ scheduleRestart()
     cerr << ("S3 operation retry in " + to_string(numSeconds) + " seconds: "
              + request.verb + " " + request.resource + "\n");
 
-    auto timer = make_shared<PeriodicEventSource>();
-
     auto state = state_;
-    auto onTimeout = [&, timer, state] (uint64_t ticks) {
-        S3Globals & globals = getS3Globals();
+    auto onTimeout = [state] (uint64_t) {
         performStateRequest(state);
-        globals.loop.removeSource(timer.get());
     };
-    timer->init(numSeconds, std::move(onTimeout));
-    globals.loop.addSource("retry-timer-" + randomString(8), timer);
+    globals.loop.timers().scheduleIn(numSeconds, std::move(onTimeout));
+}
+
+
+/****************************************************************************/
+/* S3 LISTING PARSER                                                        */
+/****************************************************************************/
+
+/** One page of the result of a ListObjects request. */
+struct S3ListingPage {
+    S3ListingPage()
+        : isTruncated(false)
+    {
+    }
+
+    string prefix;
+    bool isTruncated;
+    string nextMarker;
+    vector<S3Api::ObjectInfo> objects;
+    vector<string> commonPrefixes;
+};
+
+void
+appendUtf8(unsigned long codePoint, string & output)
+{
+    if (codePoint < 0x80) {
+        output += char(codePoint);
+    }
+    else if (codePoint < 0x800) {
+        output += char(0xc0 | (codePoint >> 6));
+        output += char(0x80 | (codePoint & 0x3f));
+    }
+    else if (codePoint < 0x10000) {
+        output += char(0xe0 | (codePoint >> 12));
+        output += char(0x80 | ((codePoint >> 6) & 0x3f));
+        output += char(0x80 | (codePoint & 0x3f));
+    }
+    else {
+        output += char(0xf0 | (codePoint >> 18));
+        output += char(0x80 | ((codePoint >> 12) & 0x3f));
+        output += char(0x80 | ((codePoint >> 6) & 0x3f));
+        output += char(0x80 | (codePoint & 0x3f));
+    }
 }
 
+/** Append the xml text between start and end to output, replacing the
+    entities with the characters they stand for. */
+void
+appendXmlText(const char * start, const char * end, string & output)
+{
+    while (start < end) {
+        const char * amp = (const char *) ::memchr(start, '&', end - start);
+        if (!amp) {
+            output.append(start, end);
+            break;
+        }
+        output.append(start, amp);
+
+        const char * semicolon
+            = (const char *) ::memchr(amp, ';', end - amp);
+        if (!semicolon) {
+            throw ML::Exception("unterminated xml entity");
+        }
+        const char * name = amp + 1;
+        size_t length = semicolon - name;
+        if (length > 1 && name[0] == '#') {
+            bool isHex = (name[1] == 'x');
+            char * numberEnd;
+            unsigned long codePoint
+                = ::strtoul(name + (isHex ? 2 : 1), &numberEnd,
+                            isHex ? 16 : 10);
+            if (numberEnd != semicolon) {
+                throw ML::Exception("invalid xml character reference");
+            }
+            appendUtf8(codePoint, output);
+        }
+        else if (length == 3 && ::strncmp(name, "amp", 3) == 0) {
+            output += '&';
+        }
+        else if (length == 2 && ::strncmp(name, "lt", 2) == 0) {
+            output += '<';
+        }
+        else if (length == 2 && ::strncmp(name, "gt", 2) == 0) {
+            output += '>';
+        }
+        else if (length == 4 && ::strncmp(name, "quot", 4) == 0) {
+            output += '"';
+        }
+        else if (length == 4 && ::strncmp(name, "apos", 4) == 0) {
+            output += '\'';
+        }
+        else {
+            throw ML::Exception("unknown xml entity: "
+                                + string(amp, semicolon + 1));
+        }
+        start = semicolon + 1;
+    }
+}
+
+string
+xmlEscape(const string & text)
+{
+    string result;
+    result.reserve(text.size());
+    for (char c: text) {
+        switch (c) {
+        case '&': result += "&amp;"; break;
+        case '<': result += "&lt;"; break;
+        case '>': result += "&gt;"; break;
+        case '"': result += "&quot;"; break;
+        case '\'': result += "&apos;"; break;
+        default: result += c;
+        }
+    }
+
+    return result;
+}
+
+/** Parse the body of a ListObjects response in a single forward pass.
+    Rather than building a document, the elements are recognised by their
+    path as their tags go by and the text of those we need is decoded
+    straight into the page.
+*/
+void
+parseListing(const string & body, S3ListingPage & page)
+{
+    typedef pair<const char *, size_t> Name;
+
+    auto is = [] (const Name & name, const char * expected) {
+        return (name.second == ::strlen(expected)
+                && ::strncmp(name.first, expected, name.second) == 0);
+    };
+
+    vector<Name> path;
+    const char * p = body.c_str();
+    const char * end = p + body.size();
+    const char * textStart = nullptr; /* text of a possible leaf */
+    string text;
+    bool seenRoot(false);
+
+    while (p < end) {
+        const char * lt = (const char *) ::memchr(p, '<', end - p);
+        if (!lt) {
+            break;
+        }
+        if (lt + 1 < end && (lt[1] == '?' || lt[1] == '!')) {
+            /* declaration or comment */
+            const char * close = (lt + 3 < end && lt[2] == '-' && lt[3] == '-'
+                                  ? ::strstr(lt, "-->") : lt);
+            if (!close) {
+                throw ML::Exception("unterminated xml comment");
+            }
+            const char * gt
+                = (const char *) ::memchr(close, '>', end - close);
+            if (!gt) {
+                throw ML::Exception("unterminated xml declaration");
+            }
+            p = gt + 1;
+            continue;
+        }
+
+        const char * gt = (const char *) ::memchr(lt, '>', end - lt);
+        if (!gt) {
+            throw ML::Exception("unterminated xml tag");
+        }
+
+        bool closing = (lt[1] == '/');
+        bool selfClosing = (!closing && gt[-1] == '/');
+        if (!closing) {
+            const char * nameStart = lt + 1;
+            const char * nameEnd = nameStart;
+            while (nameEnd < gt && *nameEnd != ' ' && *nameEnd != '/'
+                   && *nameEnd != '\t' && *nameEnd != '\r'
+                   && *nameEnd != '\n') {
+                nameEnd++;
+            }
+            path.push_back(Name(nameStart, nameEnd - nameStart));
+            textStart = gt + 1;
+
+            size_t depth = path.size();
+            if (depth == 1) {
+                if (seenRoot || !is(path[0], "ListBucketResult")) {
+                    throw ML::Exception("unexpected listing result: "
+                                        + string(nameStart, nameEnd));
+                }
+                seenRoot = true;
+            }
+            else if (depth == 2 && is(path[1], "Contents")) {
+                page.objects.emplace_back();
+            }
+        }
+        else {
+            const char * nameStart = lt + 2;
+            const char * nameEnd = gt;
+            while (nameEnd > nameStart
+                   && (nameEnd[-1] == ' ' || nameEnd[-1] == '\t'
+                       || nameEnd[-1] == '\r' || nameEnd[-1] == '\n')) {
+                nameEnd--;
+            }
+            if (path.empty()
+                || path.back().second != size_t(nameEnd - nameStart)
+                || ::strncmp(path.back().first, nameStart,
+                             nameEnd - nameStart) != 0) {
+                throw ML::Exception("mismatched xml closing tag: "
+                                    + string(nameStart, nameEnd));
+            }
+        }
+
+        if (closing || selfClosing) {
+            size_t depth = path.size();
+            const Name & name = path.back();
+            if (textStart) {
+                /* leaf element */
+                text.clear();
+                if (closing) {
+                    appendXmlText(textStart, lt, text);
+                }
+
+                if (depth == 2) {
+                    if (is(name, "Prefix")) {
+                        page.prefix = text;
+                    }
+                    else if (is(name, "IsTruncated")) {
+                        page.isTruncated = (text == "true");
+                    }
+                    else if (is(name, "NextMarker")) {
+                        page.nextMarker = text;
+                    }
+                }
+                else if (depth == 3 && is(path[1], "Contents")) {
+                    S3Api::ObjectInfo & info = page.objects.back();
+                    if (is(name, "Key")) {
+                        info.key = text;
+                    }
+                    else if (is(name, "Size")) {
+                        info.size = std::stoull(text);
+                    }
+                    else if (is(name, "LastModified")) {
+                        info.lastModified
+                            = Date::parseIso8601DateTime(text);
+                    }
+                    else if (is(name, "ETag")) {
+                        info.etag = text;
+                    }
+                    else if (is(name, "StorageClass")) {
+                        info.storageClass = text;
+                    }
+                }
+                else if (depth == 4 && is(path[1], "Contents")
+                         && is(path[2], "Owner")) {
+                    S3Api::ObjectInfo & info = page.objects.back();
+                    if (is(name, "ID")) {
+                        info.ownerId = text;
+                    }
+                    else if (is(name, "DisplayName")) {
+                        info.ownerName = text;
+                    }
+                }
+                else if (depth == 3 && is(path[1], "CommonPrefixes")
+                         && is(name, "Prefix")) {
+                    page.commonPrefixes.push_back(text);
+                }
+            }
+            else if (depth == 2 && is(name, "Contents")) {
+                page.objects.back().exists = true;
+            }
+
+            path.pop_back();
+            textStart = nullptr;
+        }
+
+        p = gt + 1;
+    }
+
+    if (!seenRoot || !path.empty()) {
+        throw ML::Exception("incomplete listing result");
+    }
+}
+
+
+/****************************************************************************/
+/* S3 RESPONSE QUEUE                                                        */
+/****************************************************************************/
+
+/** Collects the responses to concurrent requests for the thread that
+    issued them, along with a tag identifying each request.  The requests
+    hold it through a shared_ptr, so that those still in flight when the
+    issuing thread gives up (on error or early stop) have somewhere to go.
+*/
+template<typename Tag>
+struct S3ResponseQueue {
+    struct Entry {
+        Tag tag;
+        S3Api::Response response;
+        std::exception_ptr excPtr;
+    };
+
+    static S3Api::OnResponse
+    makeOnResponse(const shared_ptr<S3ResponseQueue> & queue, const Tag & tag)
+    {
+        return [queue, tag] (S3Api::Response && response,
+                             std::exception_ptr excPtr) {
+            queue->push(tag, std::move(response), std::move(excPtr));
+        };
+    }
+
+    void push(const Tag & tag, S3Api::Response && response,
+              std::exception_ptr excPtr)
+    {
+        Entry entry;
+        entry.tag = tag;
+        entry.response = std::move(response);
+        entry.excPtr = std::move(excPtr);
+
+        unique_lock<mutex> guard(lock);
+        entries.push_back(std::move(entry));
+        cond.notify_one();
+    }
+
+    /** Wait for a response and return it, rethrowing the exception of a
+        failed request. */
+    Entry pop()
+    {
+        unique_lock<mutex> guard(lock);
+        while (entries.empty()) {
+            cond.wait(guard);
+        }
+        Entry entry = std::move(entries.front());
+        entries.pop_front();
+        guard.unlock();
+
+        if (entry.excPtr) {
+            std::rethrow_exception(entry.excPtr);
+        }
+
+        return entry;
+    }
+
+private:
+    mutex lock;
+    std::condition_variable cond;
+    std::deque<Entry> entries;
+};
+
+
+/****************************************************************************/
+/* S3 LISTING TASK                                                          */
+/****************************************************************************/
+
+/** A range of the keys under a prefix, listed page by page.  It covers the
+    keys after "marker" up to and including "upTo", or all those after
+    "marker" when "upTo" is empty.
+*/
+struct S3ListingTask {
+    S3ListingTask()
+        : depth(0), canSplit(false)
+    {
+    }
+
+    S3ListingTask(const string & prefix, const string & marker,
+                  const string & upTo, int depth, bool canSplit)
+        : prefix(prefix), marker(marker), upTo(upTo),
+          depth(depth), canSplit(canSplit)
+    {
+    }
+
+    bool isPast(const string & key)
+        const
+    {
+        return !upTo.empty() && key > upTo;
+    }
+
+    string prefix;
+    string marker;
+    string upTo;
+    int depth;
+    bool canSplit;
+};
+
 }
 
 
@@ -1426,6 +1852,22 @@ ObjectInfo(const S3Api::Response & response)
 }
 
 
+/****************************************************************************/
+/* S3 API :: LISTING OPTIONS                                                */
+/****************************************************************************/
+
+S3Api::ListingOptions::
+ListingOptions()
+    : parallelism(8),
+      numPartitions(8),
+      splitChars("0123456789"
+                 "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+                 "abcdefghijklmnopqrstuvwxyz"),
+      maxKeys(0)
+{
+}
+
+
 /****************************************************************************/
 /* S3 API                                                                   */
 /****************************************************************************/
@@ -2034,8 +2476,6 @@ forEachObject(const string & bucket,
               const string & startAt)
     const
 {
-    using namespace tinyxml2;
-
     string marker = startAt;
     // bool firstIter = true;
     do {
@@ -2053,29 +2493,20 @@ forEachObject(const string & bucket,
                                  {}, queryParams);
         if (listingResult.code_ != 200)
             throw ML::Exception("invalid http code returned");
-        auto listingResultXml = makeBodyXml(listingResult);
-        string foundPrefix
-            = extractDef<string>(listingResultXml, "ListBucketResult/Prefix", "");
-        string truncated
-            = extract<string>(listingResultXml, "ListBucketResult/IsTruncated");
-        bool isTruncated = truncated == "true";
-        marker = "";
 
-        auto foundObject
-            = XMLHandle(*listingResultXml)
-            .FirstChildElement("ListBucketResult")
-            .FirstChildElement("Contents")
-            .ToElement();
+        S3ListingPage page;
+        parseListing(listingResult.body_, page);
+        const string & foundPrefix = page.prefix;
+        marker = "";
 
         bool stop = false;
 
-        for (int i = 0; onObject && foundObject;
-             foundObject = foundObject->NextSiblingElement("Contents"), ++i) {
-            ObjectInfo info(foundObject);
+        for (const ObjectInfo & info: page.objects) {
+            ExcAssertNotEqual(info.key, marker);
+            marker = info.key;
 
-            string key = info.key;
-            ExcAssertNotEqual(key, marker);
-            marker = key;
+            if (!onObject)
+                continue;
 
             ExcAssertEqual(info.key.find(foundPrefix), 0);
             // cerr << "info.key: " + info.key + "; foundPrefix: " +foundPrefix + "\n";
@@ -2089,15 +2520,9 @@ forEachObject(const string & bucket,
 
         if (stop) return;
 
-        auto foundDir
-            = XMLHandle(*listingResultXml)
-            .FirstChildElement("ListBucketResult")
-            .FirstChildElement("CommonPrefixes")
-            .ToElement();
-
-        for (; onSubdir && foundDir;
-             foundDir = foundDir->NextSiblingElement("CommonPrefixes")) {
-            string dirName = extract<string>(foundDir, "Prefix");
+        for (string dirName: page.commonPrefixes) {
+            if (!onSubdir)
+                break;
 
             // Strip off the delimiter
             if (dirName.rfind(delimiter) == dirName.size() - delimiter.size()) {
@@ -2113,8 +2538,13 @@ forEachObject(const string & bucket,
             }
         }
 
+        /* With a delimiter, the page can end with a common prefix that
+           the last key doesn't account for. */
+        if (!page.nextMarker.empty())
+            marker = page.nextMarker;
+
         // firstIter = false;
-        if (!isTruncated)
+        if (!page.isTruncated)
             break;
     } while (marker != "");
 
@@ -2149,6 +2579,162 @@ forEachObject(const string & uriPrefix,
     forEachObject(bucket, objectPrefix, onObject2, onSubdir, delimiter, depth, startAt);
 }
 
+void
+S3Api::
+forEachObjectParallel(const string & bucket,
+                      const string & prefix,
+                      const OnObject & onObject,
+                      const OnSubdir & onSubdir,
+                      const string & delimiter,
+                      const ListingOptions & options,
+                      int depth,
+                      const string & startAt)
+    const
+{
+    if (options.parallelism < 1) {
+        throw ML::Exception("listing parallelism must be at least 1");
+    }
+
+    typedef S3ResponseQueue<S3ListingTask> Queue;
+    auto responses = make_shared<Queue>();
+
+    std::deque<S3ListingTask> tasks;
+    tasks.emplace_back(prefix, startAt, "", depth, true);
+    int inFlight(0);
+
+    auto listTask = [&] (const S3ListingTask & task) {
+        Request request;
+        request.verb = "GET";
+        request.bucket = bucket;
+        request.resource = "/";
+        request.downloadRange = Range::Full;
+        if (task.prefix != "")
+            request.queryParams.push_back({"prefix", task.prefix});
+        if (delimiter != "")
+            request.queryParams.push_back({"delimiter", delimiter});
+        if (task.marker != "")
+            request.queryParams.push_back({"marker", task.marker});
+        if (options.maxKeys > 0)
+            request.queryParams.push_back({"max-keys",
+                                           to_string(options.maxKeys)});
+
+        perform(std::move(request), Queue::makeOnResponse(responses, task));
+        inFlight++;
+    };
+
+    /* Split what remains of a prefix after the given marker into ranges
+       that start at the split characters. */
+    auto splitTask = [&] (const S3ListingTask & task, const string & marker) {
+        vector<string> bounds;
+        size_t numChars = options.splitChars.size();
+        for (int i = 1;  i < options.numPartitions;  ++i) {
+            char c = options.splitChars[i * numChars / options.numPartitions];
+            if (!delimiter.empty() && c == delimiter[0]) {
+                /* the common prefix that starts with the delimiter would
+                   be equal to the bound, and reported twice */
+                continue;
+            }
+            string bound = task.prefix + c;
+            if (bound > marker && !task.isPast(bound)) {
+                bounds.push_back(bound);
+            }
+        }
+        std::sort(bounds.begin(), bounds.end());
+        bounds.erase(std::unique(bounds.begin(), bounds.end()), bounds.end());
+
+        string start = marker;
+        for (const string & bound: bounds) {
+            tasks.emplace_back(task.prefix, start, bound, task.depth, false);
+            start = bound;
+        }
+        tasks.emplace_back(task.prefix, start, task.upTo, task.depth, false);
+    };
+
+    for (;;) {
+        while (inFlight < options.parallelism && !tasks.empty()) {
+            listTask(tasks.front());
+            tasks.pop_front();
+        }
+        if (inFlight == 0) {
+            break;
+        }
+
+        /* The requests still in flight when this throws or returns
+           complete into the queue, which they keep alive. */
+        Queue::Entry entry = responses->pop();
+        inFlight--;
+        if (entry.response.code_ != 200) {
+            throw ML::Exception("invalid http code returned");
+        }
+
+        S3ListingPage page;
+        parseListing(entry.response.body_, page);
+        const S3ListingTask & task = entry.tag;
+
+        /* the keys and common prefixes are each sorted, but interleaved */
+        bool pastEnd(false);
+        string lastName;
+
+        for (const ObjectInfo & info: page.objects) {
+            if (task.isPast(info.key)) {
+                pastEnd = true;
+                break;
+            }
+            lastName = std::max(lastName, info.key);
+
+            if (!onObject)
+                continue;
+
+            ExcAssertEqual(info.key.find(task.prefix), 0);
+            string basename(info.key, task.prefix.length());
+            if (!onObject(task.prefix, basename, info, task.depth)) {
+                return;
+            }
+        }
+
+        for (const string & commonPrefix: page.commonPrefixes) {
+            if (task.isPast(commonPrefix)) {
+                pastEnd = true;
+                break;
+            }
+            lastName = std::max(lastName, commonPrefix);
+
+            if (!onSubdir)
+                continue;
+
+            string dirName = commonPrefix;
+            // Strip off the delimiter
+            if (dirName.rfind(delimiter) == dirName.size() - delimiter.size()) {
+                dirName = string(dirName, 0, dirName.size() - delimiter.size());
+                ExcAssertEqual(dirName.find(task.prefix), 0);
+                dirName = string(dirName, task.prefix.size());
+            }
+            if (onSubdir(task.prefix, dirName, task.depth)) {
+                tasks.emplace_back(task.prefix + dirName + delimiter, "", "",
+                                   task.depth + 1, true);
+            }
+        }
+
+        if (!page.isTruncated || pastEnd) {
+            continue;
+        }
+
+        string marker = (page.nextMarker.empty()
+                         ? lastName : page.nextMarker);
+        if (marker.empty()) {
+            throw ML::Exception("truncated listing without a marker");
+        }
+
+        if (task.canSplit && options.numPartitions > 1) {
+            splitTask(task, marker);
+        }
+        else {
+            tasks.emplace_back(task.prefix, marker, task.upTo, task.depth,
+                               false);
+        }
+    }
+}
+
 S3Api::ObjectInfo
 S3Api::
 getObjectInfo(const string & bucket, const string & object,
@@ -2340,6 +2926,77 @@ tryEraseObject(const string & uri)
     return tryEraseObject(bucket, object);
 }
 
+map<string, string>
+S3Api::
+eraseObjects(const string & bucket,
+             const vector<string> & objects,
+             int parallelism)
+{
+    /* S3 takes up to 1000 keys per request */
+    static const size_t batchSize(1000);
+
+    if (parallelism < 1) {
+        throw ML::Exception("erase parallelism must be at least 1");
+    }
+
+    typedef S3ResponseQueue<int> Queue;
+    auto responses = make_shared<Queue>();
+
+    auto eraseBatch = [&] (size_t start, size_t end) {
+        string body = ("<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+                       "<Delete><Quiet>true</Quiet>");
+        for (size_t i = start;  i < end;  ++i) {
+            body += "<Object><Key>" + xmlEscape(objects[i]) + "</Key></Object>";
+        }
+        body += "</Delete>";
+
+        Request request;
+        request.verb = "POST";
+        request.bucket = bucket;
+        request.resource = "/";
+        request.subResource = "delete";
+        request.contentMD5
+            = AwsApi::base64EncodeDigest(AwsApi::md5Digest(body));
+        request.content = HttpRequest::Content(body, "application/xml");
+
+        perform(std::move(request), Queue::makeOnResponse(responses, 0));
+    };
+
+    map<string, string> errors;
+
+    size_t next(0);
+    int inFlight(0);
+    for (;;) {
+        while (inFlight < parallelism && next < objects.size()) {
+            size_t end = std::min(next + batchSize, objects.size());
+            eraseBatch(next, end);
+            next = end;
+            inFlight++;
+        }
+        if (inFlight == 0) {
+            break;
+        }
+
+        Queue::Entry entry = responses->pop();
+        inFlight--;
+        auto resultXml = makeBodyXml(entry.response);
+
+        /* in quiet mode, only the keys that failed are reported */
+        auto error
+            = tinyxml2::XMLHandle(*resultXml)
+            .FirstChildElement("DeleteResult")
+            .FirstChildElement("Error")
+            .ToElement();
+        for (; error; error = error->NextSiblingElement("Error")) {
+            errors[extract<string>(error, "Key")]
+                = (extract<string>(error, "Code") + ": "
+                   + extractDef<string>(error, "Message", ""));
+        }
+    }
+
+    return errors;
+}
+
 string
 S3Api::
 getPublicUri(const string & uri,
@@ -94,6 +94,12 @@ struct S3Api : public AwsApi {
     std::string accessKeyId;
     std::string accessKey;
     std::string defaultProtocol;
+
+    /** Base hostname of the service, the bucket being prefixed to it.  When
+        given with a scheme (eg "http://localhost:9000"), requests are sent
+        to that endpoint with the bucket in the path instead, as needed for
+        S3-compatible services.
+    */
     std::string serviceUri;
     double bandwidthToServiceMbps;
 
@@ -356,6 +362,46 @@ struct S3Api : public AwsApi {
                        int depth = 1,
                        const std::string & startAt = "") const;
 
+    /** Options of forEachObjectParallel(). */
+    struct ListingOptions {
+        ListingOptions();
+
+        /** Maximum number of ListObjects requests in flight. */
+        int parallelism;
+
+        /** Number of key ranges into which the rest of a prefix is split
+            when its first page is truncated, the ranges being listed
+            concurrently.  1 disables the splitting, leaving the
+            subdirectories as the only source of parallelism.
+        */
+        int numPartitions;
+
+        /** Characters after the prefix at which the key ranges start, in
+            increasing order.  The partitions are only balanced when the
+            keys are spread over these.
+        */
+        std::string splitChars;
+
+        /** Number of keys per page, or 0 for the S3 default (1000). */
+        int maxKeys;
+    };
+
+    /** Same as forEachObject(), but lists the subdirectories that are
+        recursed into and the key ranges of large prefixes concurrently.
+        The callbacks are called from the calling thread, one at a time,
+        but the objects and subdirectories of different ranges come in no
+        particular order.  Returning false from onObject stops the listing.
+    */
+    void forEachObjectParallel(const std::string & bucket,
+                               const std::string & prefix = "",
+                               const OnObject & onObject = OnObject(),
+                               const OnSubdir & onSubdir = OnSubdir(),
+                               const std::string & delimiter = "/",
+                               const ListingOptions & options
+                               = ListingOptions(),
+                               int depth = 1,
+                               const std::string & startAt = "") const;
+
     /** Value for the "delimiter" parameter in forEachObject for when we
         don't want any subdirectories.  It is equal to the empty string.
     */
@@ -396,6 +442,17 @@ struct S3Api : public AwsApi {
     */
     bool tryEraseObject(const std::string & uri);
 
+    /** Erase the given objects (keys without a leading '/') with
+        multi-object delete requests of up to 1000 keys, up to parallelism
+        requests being in flight.  Throws if a request fails.  Returns the
+        objects that could not be erased, with the error reported for
+        each.
+    */
+    std::map<std::string, std::string>
+    eraseObjects(const std::string & bucket,
+                 const std::vector<std::string> & objects,
+                 int parallelism = 4);
+
     /** Return the public URI that should be used to access a public object. */
     static std::string getPublicUri(const std::string & uri,
                                     const std::string & protocol);
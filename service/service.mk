@@ -3,10 +3,11 @@
 
 
 LIBOPSTATS_SOURCES := \
-	statsd_connector.cc carbon_connector.cc stat_aggregator.cc process_stats.cc
+	statsd_connector.cc carbon_connector.cc stat_aggregator.cc process_stats.cc \
+	shm_metrics.cc
 
 LIBOPSTATS_LINK := \
-	ACE arch utils boost_thread types
+	ACE arch utils boost_thread types rt
 
 $(eval $(call library,opstats,$(LIBOPSTATS_SOURCES),$(LIBOPSTATS_LINK)))
 
@@ -37,7 +38,10 @@ LIBSERVICES_SOURCES := \
 	port_range_service.cc \
 	service_base.cc \
 	message_loop.cc \
+	timer_service.cc \
+	cpu_accounting.cc \
 	loop_monitor.cc \
+	admission_control.cc \
 	named_endpoint.cc \
 	async_event_source.cc \
 	async_writer_source.cc \
@@ -84,7 +88,9 @@ LIBCLOUD_SOURCES := \
 	s3.cc \
 	sns.cc \
 	aws.cc \
-	sqs.cc
+	sqs.cc \
+	sqs_engine.cc \
+	sftp_engine.cc
 
 LIBCLOUD_LINK := crypto++ utils arch types tinyxml2 services ssh2 value_description
 
@@ -93,9 +99,11 @@ $(eval $(call library,cloud,$(LIBCLOUD_SOURCES),$(LIBCLOUD_LINK)))
 
 
 LIBREDIS_SOURCES := \
-	redis.cc
+	redis.cc \
+	redis_parser.cc \
+	redis_sharded.cc
 
-LIBREDIS_LINK := hiredis utils types
+LIBREDIS_LINK := utils types cityhash
 
 $(eval $(call library,redis,$(LIBREDIS_SOURCES),$(LIBREDIS_LINK)))
 
@@ -106,6 +114,7 @@ $(eval $(call program,s3_multipart_cmd,cloud boost_program_options utils))
 $(eval $(call program,syslog_trace,services))
 $(eval $(call program,s3cat,cloud boost_program_options utils))
 $(eval $(call program,sns_send,cloud boost_program_options utils))
+$(eval $(call program,shm_metrics_agent,opstats boost_program_options))
 
 $(eval $(call include_sub_make,service_testing,testing,service_testing.mk))
 
@@ -8,6 +8,7 @@
 #include <mutex>
 #include <boost/iostreams/stream_buffer.hpp>
 #include "soa/service/sftp.h"
+#include "soa/service/sftp_engine.h"
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netdb.h>
@@ -415,7 +416,8 @@ downloadTo(const std::string & filename) const
 
 SftpConnection::
 SftpConnection()
-    : sftp_session(0)
+    : sftp_session(0),
+      pipelinedTransfers(false)
 {
 }
 
@@ -425,6 +427,26 @@ SftpConnection::
     close();
 }
 
+SftpEngine &
+SftpConnection::
+transferEngine()
+{
+    std::unique_lock<std::mutex> guard(engineLock_);
+
+    if (!engine_) {
+        if (!connectEngine_) {
+            throw ML::Exception("the sftp connection must be connected "
+                                "before streaming");
+        }
+        std::unique_ptr<SftpEngine> engine(new SftpEngine());
+        connectEngine_(*engine);
+        engine->start();
+        engine_ = std::move(engine);
+    }
+
+    return *engine_;
+}
+
 void
 SftpConnection::
 connectPasswordAuth(const std::string & hostname,
@@ -435,6 +457,11 @@ connectPasswordAuth(const std::string & hostname,
     SshConnection::connect(hostname, port);
     SshConnection::passwordAuth(username, password);
 
+    /* streams are transferred over a session of their own */
+    connectEngine_ = [=] (SftpEngine & engine) {
+        engine.connectPasswordAuth(hostname, username, password, port);
+    };
+
     sftp_session = libssh2_sftp_init(session);
  
     if (!sftp_session) {
@@ -455,6 +482,11 @@ connectPublicKeyAuth(const std::string & hostname,
     SshConnection::connect(hostname, port);
     SshConnection::publicKeyAuth(username, publicKeyFile, privateKeyFile);
 
+    connectEngine_ = [=] (SftpEngine & engine) {
+        engine.connectPublicKeyAuth(hostname, username,
+                                    publicKeyFile, privateKeyFile, port);
+    };
+
     sftp_session = libssh2_sftp_init(session);
  
     if (!sftp_session) {
@@ -509,6 +541,11 @@ void
 SftpConnection::
 close()
 {
+    {
+        std::unique_lock<std::mutex> guard(engineLock_);
+        engine_.reset();
+    }
+
     if (sftp_session) {
         libssh2_sftp_shutdown(sftp_session);
         sftp_session = 0;
@@ -838,6 +875,10 @@ SftpConnection::
 streamingUploadStreambuf(const std::string & path,
                          const ML::OnUriHandlerException & onException)
 {
+    if (pipelinedTransfers) {
+        return transferEngine().streamingUploadStreambuf(path, onException);
+    }
+
     std::unique_ptr<std::streambuf> result;
     result.reset(new boost::iostreams::stream_buffer<SftpStreamingUploadSource>
                  (SftpStreamingUploadSource(this, path, onException),
@@ -860,6 +901,10 @@ std::unique_ptr<std::streambuf>
 SftpConnection::
 streamingDownloadStreambuf(const std::string & path)
 {
+    if (pipelinedTransfers) {
+        return transferEngine().streamingDownloadStreambuf(path);
+    }
+
     std::unique_ptr<std::streambuf> result;
     result.reset(new boost::iostreams::stream_buffer<SftpStreamingDownloadSource>
                  (SftpStreamingDownloadSource(this, path),
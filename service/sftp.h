@@ -12,11 +12,14 @@
 #include <libssh2_sftp.h>
 #include <functional>
 #include <memory>
+#include <mutex>
 #include "jml/utils/filter_streams.h"
 #include "jml/arch/exception.h"
 
 namespace Datacratic {
 
+struct SftpEngine;
+
 
 /*****************************************************************************/
 /* SOCKET CONNECTION                                                         */
@@ -159,6 +162,22 @@ struct SftpConnection : public SshConnection {
     int unlink(const std::string & path);
 
     void close();
+
+    /** Transfer the streams through the pipelined transferEngine()
+        rather than with one blocking request at a time.  Off by default
+        until the engine has been proven against real servers.
+    */
+    bool pipelinedTransfers;
+
+    /** Engine through which the streams are transferred when
+        pipelinedTransfers is set, connected to the same host on first use.
+    */
+    SftpEngine & transferEngine();
+
+private:
+    std::function<void (SftpEngine &)> connectEngine_;
+    std::mutex engineLock_;
+    std::unique_ptr<SftpEngine> engine_;
 };
 
 
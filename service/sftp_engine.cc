@@ -0,0 +1,697 @@
+/* sftp_engine.cc
+   Copyright (c) 2014 Datacratic.  All rights reserved.
+
+   Pipelined SFTP transfers over a non-blocking libssh2 session.
+*/
+
+#include <string.h>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+#include <boost/iostreams/stream_buffer.hpp>
+
+#include "jml/arch/exception.h"
+#include "sftp_engine.h"
+
+using namespace std;
+using namespace Datacratic;
+
+
+namespace Datacratic {
+
+/*****************************************************************************/
+/* SFTP ENGINE :: TRANSFER                                                   */
+/*****************************************************************************/
+
+struct SftpEngine::Transfer : public std::enable_shared_from_this<Transfer> {
+    enum State {
+        OPENING,
+        ACTIVE,
+        CLOSING,
+        DONE
+    };
+
+    Transfer(SftpEngine * engine, const string & path, bool upload)
+        : engine(engine), path(path), upload(upload),
+          handle(nullptr), registered(false), writeOffset(0),
+          state(OPENING), bufferedBytes(0), eof(false),
+          closeRequested(false), readOffset(0)
+    {
+    }
+
+    /** Have the engine look at the transfer again.  Called with the lock
+        held. */
+    void wakeEngine()
+    {
+        if (engine) {
+            engine->notify(shared_from_this());
+        }
+    }
+
+    /** Change the state and wake up the stream.  Called with the lock
+        held. */
+    void setState(State newState)
+    {
+        state = newState;
+        cond.notify_all();
+    }
+
+    /** Record an error, dropping the data that was buffered.  Called with
+        the lock held. */
+    void fail(const string & message)
+    {
+        if (error.empty()) {
+            error = message;
+        }
+        chunks.clear();
+        bufferedBytes = 0;
+        setState(handle ? CLOSING : DONE);
+    }
+
+    SftpEngine * engine;  /* null once the engine is shut down */
+    string path;
+    bool upload;
+
+    /* engine thread only */
+    LIBSSH2_SFTP_HANDLE * handle;
+    bool registered;
+    string readBuffer;
+    size_t writeOffset;   /* bytes of the first chunk already written */
+
+    /* shared, under the lock */
+    std::mutex lock;
+    std::condition_variable cond;
+    State state;
+    std::deque<string> chunks;
+    size_t bufferedBytes;
+    bool eof;
+    bool closeRequested;
+    string error;
+
+    /* stream only */
+    size_t readOffset;    /* bytes of the first chunk already consumed */
+    string pending;       /* bytes written but not yet submitted */
+};
+
+} // namespace Datacratic
+
+
+namespace {
+
+/*****************************************************************************/
+/* SFTP ENGINE DOWNLOAD SOURCE                                               */
+/*****************************************************************************/
+
+struct SftpEngineDownloadSource {
+    typedef SftpEngine::Transfer Transfer;
+
+    SftpEngineDownloadSource(const shared_ptr<Transfer> & transfer,
+                             size_t maxBufferedBytes)
+        : transfer(transfer), maxBufferedBytes(maxBufferedBytes)
+    {
+    }
+
+    typedef char char_type;
+    struct category
+        : public boost::iostreams::input,
+          public boost::iostreams::device_tag,
+          public boost::iostreams::closable_tag
+    { };
+
+    std::streamsize read(char_type * s, std::streamsize n)
+    {
+        Transfer & t = *transfer;
+
+        unique_lock<mutex> guard(t.lock);
+        while (t.chunks.empty() && !t.eof && t.error.empty()) {
+            t.cond.wait(guard);
+        }
+        if (!t.error.empty()) {
+            throw ML::Exception("sftp download of " + t.path + ": "
+                                + t.error);
+        }
+        if (t.chunks.empty()) {
+            return -1;
+        }
+
+        const string & chunk = t.chunks.front();
+        size_t toCopy = std::min<size_t>(n, chunk.size() - t.readOffset);
+        ::memcpy(s, chunk.c_str() + t.readOffset, toCopy);
+        t.readOffset += toCopy;
+
+        if (t.readOffset == chunk.size()) {
+            bool wasFull = (t.bufferedBytes >= maxBufferedBytes);
+            t.bufferedBytes -= chunk.size();
+            t.chunks.pop_front();
+            t.readOffset = 0;
+            if (wasFull && t.bufferedBytes < maxBufferedBytes) {
+                t.wakeEngine();
+            }
+        }
+
+        return toCopy;
+    }
+
+    bool is_open() const
+    {
+        return !!transfer;
+    }
+
+    void close()
+    {
+        if (!transfer) {
+            return;
+        }
+
+        /* stop reading ahead; the engine closes the handle */
+        unique_lock<mutex> guard(transfer->lock);
+        transfer->closeRequested = true;
+        transfer->chunks.clear();
+        transfer->bufferedBytes = 0;
+        transfer->wakeEngine();
+        guard.unlock();
+
+        transfer.reset();
+    }
+
+    shared_ptr<Transfer> transfer;
+    size_t maxBufferedBytes;
+};
+
+
+/*****************************************************************************/
+/* SFTP ENGINE UPLOAD SINK                                                   */
+/*****************************************************************************/
+
+struct SftpEngineUploadSink {
+    typedef SftpEngine::Transfer Transfer;
+
+    SftpEngineUploadSink(const shared_ptr<Transfer> & transfer,
+                         size_t requestSize,
+                         size_t maxBufferedBytes,
+                         const ML::OnUriHandlerException & onException)
+        : transfer(transfer),
+          requestSize(requestSize), maxBufferedBytes(maxBufferedBytes),
+          onException(onException)
+    {
+    }
+
+    typedef char char_type;
+    struct category
+        : public boost::iostreams::output,
+          public boost::iostreams::device_tag,
+          public boost::iostreams::closable_tag
+    { };
+
+    std::streamsize write(const char_type * s, std::streamsize n)
+    {
+        transfer->pending.append(s, n);
+        if (transfer->pending.size() >= requestSize) {
+            submit();
+        }
+
+        return n;
+    }
+
+    bool is_open() const
+    {
+        return !!transfer;
+    }
+
+    void close()
+    {
+        if (!transfer) {
+            return;
+        }
+
+        Transfer & t = *transfer;
+        if (!t.pending.empty()) {
+            submit();
+        }
+
+        unique_lock<mutex> guard(t.lock);
+        t.closeRequested = true;
+        t.wakeEngine();
+        while (t.state != Transfer::DONE) {
+            t.cond.wait(guard);
+        }
+        string error = t.error;
+        guard.unlock();
+
+        auto done = std::move(transfer);
+        if (!error.empty()) {
+            fail(done->path, error);
+        }
+    }
+
+private:
+    /** Hand the pending bytes over to the engine, waiting for room if too
+        much is buffered already. */
+    void submit()
+    {
+        Transfer & t = *transfer;
+
+        unique_lock<mutex> guard(t.lock);
+        while (t.bufferedBytes >= maxBufferedBytes && t.error.empty()) {
+            t.cond.wait(guard);
+        }
+        if (!t.error.empty()) {
+            string error = t.error;
+            guard.unlock();
+            fail(t.path, error);
+        }
+
+        t.bufferedBytes += t.pending.size();
+        t.chunks.emplace_back(std::move(t.pending));
+        t.pending = string();
+        t.pending.reserve(requestSize);
+        t.wakeEngine();
+    }
+
+    void fail(const string & path, const string & error)
+    {
+        if (onException) {
+            onException();
+        }
+        throw ML::Exception("sftp upload of " + path + ": " + error);
+    }
+
+    shared_ptr<Transfer> transfer;
+    size_t requestSize;
+    size_t maxBufferedBytes;
+    ML::OnUriHandlerException onException;
+};
+
+} // file scope
+
+
+namespace Datacratic {
+
+/*****************************************************************************/
+/* SFTP ENGINE                                                               */
+/*****************************************************************************/
+
+SftpEngine::Config::
+Config()
+    : requestSize(1024 * 1024),
+      maxBufferedBytes(8 * 1024 * 1024)
+{
+}
+
+SftpEngine::
+SftpEngine(const Config & config)
+    : EpollLoop(nullptr),
+      config(config),
+      running_(false),
+      notifications_([&] () { this->registerTransfers(); }),
+      blockDirections_(0),
+      progress_(false),
+      socketWatched_(false),
+      numTransfers_(0)
+{
+}
+
+SftpEngine::
+~SftpEngine()
+{
+    shutdown();
+}
+
+void
+SftpEngine::
+connectPasswordAuth(const string & hostname,
+                    const string & username,
+                    const string & password,
+                    const string & port)
+{
+    connection_.connectPasswordAuth(hostname, username, password, port);
+}
+
+void
+SftpEngine::
+connectPublicKeyAuth(const string & hostname,
+                     const string & username,
+                     const string & publicKeyFile,
+                     const string & privateKeyFile,
+                     const string & port)
+{
+    connection_.connectPublicKeyAuth(hostname, username,
+                                     publicKeyFile, privateKeyFile, port);
+}
+
+void
+SftpEngine::
+start()
+{
+    if (!connection_.sftp_session) {
+        throw ML::Exception("the sftp engine must be connected first");
+    }
+    if (running_) {
+        throw ML::Exception("the sftp engine is already running");
+    }
+
+    libssh2_session_set_blocking(connection_.session, 0);
+
+    auto onNotification = [&] (const ::epoll_event & event) {
+        notifications_.processOne();
+    };
+    addFd(notifications_.selectFd(), true, false, onNotification);
+
+    /* the socket is only watched to wake up the thread, which then gives
+       all the transfers a chance to progress */
+    auto onSocket = [&] (const ::epoll_event & event) {
+    };
+    registerFdCallback(connection_.sock, onSocket);
+
+    running_ = true;
+    thread_ = std::thread([&] () { this->runThread(); });
+}
+
+void
+SftpEngine::
+shutdown()
+{
+    if (!running_) {
+        return;
+    }
+    running_ = false;
+    thread_.join();
+
+    if (socketWatched_) {
+        removeFd(connection_.sock);
+        socketWatched_ = false;
+    }
+    removeFd(notifications_.selectFd());
+    unregisterFdCallback(connection_.sock, false);
+    unregisterFdCallback(notifications_.selectFd(), false);
+
+    /* fail what remains, and close the handles in blocking mode */
+    registerTransfers();
+    libssh2_session_set_blocking(connection_.session, 1);
+    for (auto & transfer: transfers_) {
+        if (transfer->handle) {
+            libssh2_sftp_close(transfer->handle);
+            transfer->handle = nullptr;
+        }
+        unique_lock<mutex> guard(transfer->lock);
+        transfer->engine = nullptr;
+        transfer->fail("the sftp engine was shut down");
+        transfer->setState(Transfer::DONE);
+    }
+    transfers_.clear();
+    numTransfers_ = 0;
+}
+
+unique_ptr<streambuf>
+SftpEngine::
+streamingUploadStreambuf(const string & path,
+                         const ML::OnUriHandlerException & onException)
+{
+    if (!running_) {
+        throw ML::Exception("the sftp engine is not running");
+    }
+
+    auto transfer = make_shared<Transfer>(this, path, true);
+    numTransfers_++;
+    notify(transfer);
+
+    unique_ptr<streambuf> result;
+    result.reset(new boost::iostreams::stream_buffer<SftpEngineUploadSink>
+                 (SftpEngineUploadSink(transfer, config.requestSize,
+                                       config.maxBufferedBytes,
+                                       onException),
+                  131072));
+    return result;
+}
+
+unique_ptr<streambuf>
+SftpEngine::
+streamingDownloadStreambuf(const string & path)
+{
+    if (!running_) {
+        throw ML::Exception("the sftp engine is not running");
+    }
+
+    auto transfer = make_shared<Transfer>(this, path, false);
+    numTransfers_++;
+    notify(transfer);
+
+    unique_ptr<streambuf> result;
+    result.reset(new boost::iostreams::stream_buffer<SftpEngineDownloadSource>
+                 (SftpEngineDownloadSource(transfer, config.maxBufferedBytes),
+                  131072));
+    return result;
+}
+
+ML::filter_ostream
+SftpEngine::
+streamingUpload(const string & path)
+{
+    ML::filter_ostream result;
+    auto onException = [&] { result.notifyException(); };
+    auto sb = streamingUploadStreambuf(path, onException);
+    result.openFromStreambuf(sb.release(), true, path);
+
+    return result;
+}
+
+ML::filter_istream
+SftpEngine::
+streamingDownload(const string & path)
+{
+    ML::filter_istream result;
+    auto sb = streamingDownloadStreambuf(path);
+    result.openFromStreambuf(sb.release(), true, path);
+
+    return result;
+}
+
+void
+SftpEngine::
+notify(const shared_ptr<Transfer> & transfer)
+{
+    if (!notifications_.push_back(transfer)) {
+        throw ML::Exception("sftp engine notification queue is full");
+    }
+}
+
+void
+SftpEngine::
+registerTransfers()
+{
+    for (auto & transfer: notifications_.pop_front(0)) {
+        if (!transfer->registered) {
+            transfer->registered = true;
+            transfers_.emplace_back(std::move(transfer));
+        }
+    }
+}
+
+void
+SftpEngine::
+runThread()
+{
+    while (running_) {
+        /* a reply that another transfer's call took off the socket doesn't
+           wake us up, hence the short timeout while transfers are active */
+        loop(-1, transfers_.empty() ? 100 : 10);
+        processTransfers();
+        updateSocketInterest();
+    }
+}
+
+void
+SftpEngine::
+processTransfers()
+{
+    blockDirections_ = 0;
+
+    do {
+        progress_ = false;
+        for (size_t i = 0;  i < transfers_.size();) {
+            if (processTransfer(*transfers_[i])) {
+                transfers_[i] = std::move(transfers_.back());
+                transfers_.pop_back();
+                numTransfers_--;
+            }
+            else {
+                i++;
+            }
+        }
+    } while (progress_);
+}
+
+bool
+SftpEngine::
+processTransfer(Transfer & transfer)
+{
+    typedef Transfer T;
+
+    if (transfer.state == T::OPENING) {
+        unsigned long flags;
+        long mode;
+        if (transfer.upload) {
+            flags = LIBSSH2_FXF_WRITE|LIBSSH2_FXF_CREAT|LIBSSH2_FXF_TRUNC;
+            mode = (LIBSSH2_SFTP_S_IRUSR|LIBSSH2_SFTP_S_IWUSR|
+                    LIBSSH2_SFTP_S_IRGRP|LIBSSH2_SFTP_S_IROTH);
+        }
+        else {
+            flags = LIBSSH2_FXF_READ;
+            mode = 0;
+        }
+        transfer.handle
+            = libssh2_sftp_open_ex(connection_.sftp_session,
+                                   transfer.path.c_str(),
+                                   transfer.path.length(),
+                                   flags, mode, LIBSSH2_SFTP_OPENFILE);
+        if (!transfer.handle) {
+            if (libssh2_session_last_errno(connection_.session)
+                == LIBSSH2_ERROR_EAGAIN) {
+                onWouldBlock();
+                return false;
+            }
+            unique_lock<mutex> guard(transfer.lock);
+            transfer.fail("couldn't open path: " + connection_.lastError());
+            return true;
+        }
+
+        progress_ = true;
+        unique_lock<mutex> guard(transfer.lock);
+        transfer.setState(T::ACTIVE);
+    }
+
+    if (transfer.state == T::ACTIVE && !transfer.upload) {
+        for (;;) {
+            {
+                unique_lock<mutex> guard(transfer.lock);
+                if (transfer.closeRequested) {
+                    transfer.setState(T::CLOSING);
+                    break;
+                }
+                if (transfer.bufferedBytes >= config.maxBufferedBytes) {
+                    break;
+                }
+            }
+
+            /* the same size has to be passed again after EAGAIN */
+            transfer.readBuffer.resize(config.requestSize);
+            ssize_t res = libssh2_sftp_read(transfer.handle,
+                                            &transfer.readBuffer[0],
+                                            config.requestSize);
+            if (res == LIBSSH2_ERROR_EAGAIN) {
+                onWouldBlock();
+                break;
+            }
+            progress_ = true;
+
+            unique_lock<mutex> guard(transfer.lock);
+            if (res < 0) {
+                transfer.fail("read(): " + connection_.lastError());
+                break;
+            }
+            if (res == 0) {
+                transfer.eof = true;
+                transfer.setState(T::CLOSING);
+                break;
+            }
+            transfer.readBuffer.resize(res);
+            transfer.bufferedBytes += res;
+            transfer.chunks.emplace_back(std::move(transfer.readBuffer));
+            transfer.readBuffer = string();
+            transfer.cond.notify_all();
+        }
+    }
+
+    if (transfer.state == T::ACTIVE && transfer.upload) {
+        for (;;) {
+            const string * chunk;
+            {
+                unique_lock<mutex> guard(transfer.lock);
+                if (transfer.chunks.empty()) {
+                    if (transfer.closeRequested) {
+                        transfer.setState(T::CLOSING);
+                    }
+                    break;
+                }
+                /* elements of a deque stay in place when others are added */
+                chunk = &transfer.chunks.front();
+            }
+
+            ssize_t res = libssh2_sftp_write(transfer.handle,
+                                             chunk->c_str()
+                                             + transfer.writeOffset,
+                                             chunk->size()
+                                             - transfer.writeOffset);
+            if (res == LIBSSH2_ERROR_EAGAIN) {
+                onWouldBlock();
+                break;
+            }
+            progress_ = true;
+
+            unique_lock<mutex> guard(transfer.lock);
+            if (res < 0) {
+                transfer.fail("couldn't upload file: "
+                              + connection_.lastError());
+                break;
+            }
+            transfer.writeOffset += res;
+            if (transfer.writeOffset == chunk->size()) {
+                transfer.bufferedBytes -= chunk->size();
+                transfer.chunks.pop_front();
+                transfer.writeOffset = 0;
+                transfer.cond.notify_all();
+            }
+        }
+    }
+
+    if (transfer.state == T::CLOSING) {
+        int res = libssh2_sftp_close(transfer.handle);
+        if (res == LIBSSH2_ERROR_EAGAIN) {
+            onWouldBlock();
+            return false;
+        }
+        progress_ = true;
+        transfer.handle = nullptr;
+
+        unique_lock<mutex> guard(transfer.lock);
+        if (res < 0 && transfer.error.empty()) {
+            /* for uploads, this is where a write error can show up */
+            transfer.error = "close(): " + connection_.lastError();
+        }
+        transfer.setState(T::DONE);
+    }
+
+    return transfer.state == T::DONE;
+}
+
+void
+SftpEngine::
+onWouldBlock()
+{
+    blockDirections_ |= libssh2_session_block_directions(connection_.session);
+}
+
+void
+SftpEngine::
+updateSocketInterest()
+{
+    bool reading = (blockDirections_ & LIBSSH2_SESSION_BLOCK_INBOUND);
+    bool writing = (blockDirections_ & LIBSSH2_SESSION_BLOCK_OUTBOUND);
+
+    if (reading || writing) {
+        if (socketWatched_) {
+            modifyFd(connection_.sock, reading, writing);
+        }
+        else {
+            addFd(connection_.sock, reading, writing);
+            socketWatched_ = true;
+        }
+    }
+    else if (socketWatched_) {
+        removeFd(connection_.sock);
+        socketWatched_ = false;
+    }
+}
+
+} // namespace Datacratic
@@ -0,0 +1,148 @@
+/* sftp_engine.h                                                   -*- C++ -*-
+   Copyright (c) 2014 Datacratic.  All rights reserved.
+
+   Pipelined SFTP transfers over a non-blocking libssh2 session.
+*/
+
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <streambuf>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "soa/service/epoll_loop.h"
+#include "soa/service/typed_message_channel.h"
+#include "sftp.h"
+
+
+namespace Datacratic {
+
+
+/*****************************************************************************/
+/* SFTP ENGINE                                                               */
+/*****************************************************************************/
+
+/** Transfers files over a dedicated SFTP session, with many requests
+    outstanding per file and many files transferred at once.
+
+    The session is switched to non-blocking mode and driven from the
+    engine's thread, which waits on its socket in the directions that
+    libssh2 reports it is blocked in.  Every read or write on a file is
+    given Config::requestSize bytes at a time, which libssh2 cuts into
+    SFTP requests that are all sent before the first reply is awaited.
+    Downloads read ahead of the consumer and uploads are written behind
+    the producer, up to Config::maxBufferedBytes per file, so that the
+    pipeline stays full while the streams are being used.
+
+    The streambufs can be used from any thread, a different one for each
+    file.
+*/
+
+struct SftpEngine : public EpollLoop {
+
+    struct Config {
+        Config();
+
+        /** Number of bytes given to each libssh2 read or write call, which
+            is split into SFTP requests of up to 30000 bytes that are all
+            in flight at the same time.
+        */
+        size_t requestSize;
+
+        /** Maximum number of bytes buffered per file, ahead of the reader
+            for downloads or behind the writer for uploads.
+        */
+        size_t maxBufferedBytes;
+    };
+
+    SftpEngine(const Config & config = Config());
+
+    ~SftpEngine();
+
+    /** Open the session of the engine. */
+    void connectPasswordAuth(const std::string & hostname,
+                             const std::string & username,
+                             const std::string & password,
+                             const std::string & port = "ssh");
+
+    void connectPublicKeyAuth(const std::string & hostname,
+                              const std::string & username,
+                              const std::string & publicKeyFile,
+                              const std::string & privateKeyFile,
+                              const std::string & port = "ssh");
+
+    /** Start the thread that drives the session.  The session can't be
+        used in blocking mode anymore afterwards.
+    */
+    void start();
+
+    /** Stop the thread.  The transfers still in progress fail, so the
+        streams should be closed beforehand.
+    */
+    void shutdown();
+
+    std::unique_ptr<std::streambuf>
+    streamingUploadStreambuf(const std::string & path,
+                             const ML::OnUriHandlerException & onException);
+
+    std::unique_ptr<std::streambuf>
+    streamingDownloadStreambuf(const std::string & path);
+
+    ML::filter_ostream streamingUpload(const std::string & path);
+    ML::filter_istream streamingDownload(const std::string & path);
+
+    /** Number of files being transferred. */
+    size_t numTransfers() const
+    {
+        return numTransfers_;
+    }
+
+    const Config config;
+
+    /** State of a file being transferred, shared by its stream and the
+        engine thread.
+    */
+    struct Transfer;
+
+private:
+    /** Have the engine thread look at the given transfer again, eg
+        because data was produced or consumed.
+    */
+    void notify(const std::shared_ptr<Transfer> & transfer);
+
+    /** Take over the transfers that were notified for the first time. */
+    void registerTransfers();
+
+    void runThread();
+
+    /** Advance the given transfer as far as it goes without blocking.
+        Returns true if it is finished.
+    */
+    bool processTransfer(Transfer & transfer);
+    void processTransfers();
+
+    /** Record that a libssh2 call would block. */
+    void onWouldBlock();
+
+    /** Wait on the socket in the directions that libssh2 is blocked in. */
+    void updateSocketInterest();
+
+    SftpConnection connection_;
+    std::thread thread_;
+    std::atomic<bool> running_;
+
+    TypedMessageQueue<std::shared_ptr<Transfer> > notifications_;
+
+    /* state of the engine thread */
+    std::vector<std::shared_ptr<Transfer> > transfers_;
+    int blockDirections_;
+    bool progress_;
+    bool socketWatched_;
+
+    std::atomic<size_t> numTransfers_;
+};
+
+} // namespace Datacratic
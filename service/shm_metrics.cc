@@ -0,0 +1,541 @@
+/* shm_metrics.cc
+   Copyright (c) 2014 Datacratic.  All rights reserved.
+
+   Metrics exported through a shared memory segment.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <new>
+
+#include "jml/arch/exception.h"
+#include "jml/utils/exc_check.h"
+#include "shm_metrics.h"
+
+using namespace std;
+using namespace ML;
+
+
+namespace Datacratic {
+
+/*****************************************************************************/
+/* SHM METRICS SEGMENT                                                       */
+/*****************************************************************************/
+
+const uint64_t ShmMetricsSegment::Magic;
+
+int
+ShmMetricsSegment::
+bucketOf(double value)
+{
+    if (!(value >= 1.0)) {
+        return 0;
+    }
+    int bucket = ilogb(value) + 1;
+    return bucket < NumBuckets ? bucket : NumBuckets - 1;
+}
+
+
+/*****************************************************************************/
+/* SHM METRICS                                                               */
+/*****************************************************************************/
+
+ShmMetrics::
+ShmMetrics(const string & name, size_t capacity)
+    : name("metrics." + name),
+      size(ShmMetricsSegment::segmentSize(capacity))
+{
+    /* A segment left over by a previous instance is replaced rather than
+       reused, since its readers may still have it mapped. */
+    shm_unlink(this->name.c_str());
+
+    fd = shm_open(this->name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+    ExcCheckErrno(fd >= 0, "shm_open failed");
+
+    int res = ftruncate(fd, size);
+    ExcCheckErrno(!res, "failed to resize the file.");
+
+    void * addr = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ExcCheckErrno(addr != MAP_FAILED, "failed to map the shm file");
+
+    /* the pages are zeroed, which is a valid state for the slots */
+    segment = reinterpret_cast<ShmMetricsSegment *>(addr);
+    segment->capacity = capacity;
+    segment->pid = getpid();
+    segment->startTime = Date::now().secondsSinceEpoch();
+    segment->magic.store(ShmMetricsSegment::Magic, std::memory_order_release);
+}
+
+ShmMetrics::
+~ShmMetrics()
+{
+    munmap(segment, size);
+    close(fd);
+}
+
+void
+ShmMetrics::
+unlink()
+{
+    shm_unlink(name.c_str());
+}
+
+ShmMetrics::Slot *
+ShmMetrics::
+getSlot(const string & metricName, ShmMetricType type)
+{
+    std::unique_lock<std::mutex> guard(lock);
+
+    auto it = metrics.find(metricName);
+    if (it != metrics.end()) {
+        if (it->second->type != type) {
+            throw ML::Exception("metric '" + metricName
+                                + "' registered with another type");
+        }
+        return it->second;
+    }
+
+    if (metricName.size() > ShmMetricsSegment::MaxNameLength) {
+        throw ML::Exception("metric name too long: " + metricName);
+    }
+    uint32_t index = segment->numMetrics.load(std::memory_order_relaxed);
+    if (index >= segment->capacity) {
+        throw ML::Exception("no room left in metrics segment " + name);
+    }
+
+    Slot * slot = &segment->slots[index];
+    ::memcpy(slot->name, metricName.c_str(), metricName.size());
+    slot->type.store(type, std::memory_order_release);
+    segment->numMetrics.store(index + 1, std::memory_order_release);
+    metrics[metricName] = slot;
+
+    return slot;
+}
+
+ShmMetrics::Counter
+ShmMetrics::
+counter(const string & name)
+{
+    return Counter(getSlot(name, SHM_METRIC_COUNTER));
+}
+
+ShmMetrics::Gauge
+ShmMetrics::
+gauge(const string & name)
+{
+    return Gauge(getSlot(name, SHM_METRIC_GAUGE));
+}
+
+ShmMetrics::Histogram
+ShmMetrics::
+histogram(const string & name)
+{
+    return Histogram(getSlot(name, SHM_METRIC_HISTOGRAM));
+}
+
+void
+ShmMetrics::Histogram::
+record(double value)
+{
+    /* take the seqlock, which makes the sequence odd */
+    uint64_t seq = slot->sequence.load(std::memory_order_relaxed);
+    for (;;) {
+        if (!(seq & 1)
+            && slot->sequence.compare_exchange_weak(seq, seq + 1,
+                                                    std::memory_order_acquire))
+            break;
+        __builtin_ia32_pause();
+        seq = slot->sequence.load(std::memory_order_relaxed);
+    }
+
+    auto relaxed = std::memory_order_relaxed;
+    uint64_t count = slot->count.load(relaxed);
+    if (count == 0 || value < slot->min.load(relaxed)) {
+        slot->min.store(value, relaxed);
+    }
+    if (count == 0 || value > slot->max.load(relaxed)) {
+        slot->max.store(value, relaxed);
+    }
+    slot->count.store(count + 1, relaxed);
+    slot->sum.store(slot->sum.load(relaxed) + value, relaxed);
+    auto & bucket = slot->buckets[ShmMetricsSegment::bucketOf(value)];
+    bucket.store(bucket.load(relaxed) + 1, relaxed);
+
+    slot->sequence.store(seq + 2, std::memory_order_release);
+}
+
+
+/*****************************************************************************/
+/* SHM METRICS READER                                                        */
+/*****************************************************************************/
+
+ShmMetricsReader::
+ShmMetricsReader(const string & name)
+    : name("metrics." + name), statFd(-1)
+{
+    fd = shm_open(this->name.c_str(), O_RDONLY, 0);
+    ExcCheckErrno(fd >= 0, "shm_open failed");
+
+    struct stat stats;
+    int res = fstat(fd, &stats);
+    ExcCheckErrno(!res, "failed to get the file size");
+    size = stats.st_size;
+    if (size < sizeof(ShmMetricsSegment)) {
+        close(fd);
+        throw ML::Exception("metrics segment " + this->name + " is truncated");
+    }
+
+    void * addr = mmap(0, size, PROT_READ, MAP_SHARED, fd, 0);
+    ExcCheckErrno(addr != MAP_FAILED, "failed to map the shm file");
+    segment = reinterpret_cast<const ShmMetricsSegment *>(addr);
+
+    if (segment->magic.load(std::memory_order_acquire)
+        != ShmMetricsSegment::Magic
+        || ShmMetricsSegment::segmentSize(segment->capacity) > size) {
+        munmap(addr, size);
+        close(fd);
+        throw ML::Exception("metrics segment " + this->name
+                            + " is not initialized");
+    }
+
+    string statFile = "/proc/" + to_string(segment->pid) + "/stat";
+    statFd = open(statFile.c_str(), O_RDONLY);
+}
+
+ShmMetricsReader::
+~ShmMetricsReader()
+{
+    if (statFd != -1) {
+        close(statFd);
+    }
+    munmap((void *) segment, size);
+    close(fd);
+}
+
+bool
+ShmMetricsReader::
+ownerAlive() const
+{
+    return ::kill(segment->pid, 0) == 0 || errno != ESRCH;
+}
+
+vector<ShmMetricsReader::Reading>
+ShmMetricsReader::
+read() const
+{
+    auto relaxed = std::memory_order_relaxed;
+
+    /* An update takes tens of nanoseconds, so a sequence that stays odd
+       for that many spins (a few milliseconds) belongs to a writer that was
+       preempted or killed in the middle of one; and there is no point in
+       spinning at all once the owner is gone. */
+    enum {
+        MaxOddSpins = 100000,
+        MaxAttempts = 1000
+    };
+    int ownerState = -1;    // unknown until a histogram is found locked
+
+    vector<Reading> readings;
+    uint32_t numMetrics = segment->numMetrics.load(std::memory_order_acquire);
+    numMetrics = std::min(numMetrics, segment->capacity);
+    readings.reserve(numMetrics);
+
+    for (uint32_t i = 0;  i < numMetrics;  ++i) {
+        const ShmMetricsSegment::Slot & slot = segment->slots[i];
+
+        Reading reading;
+        reading.type = ShmMetricType(slot.type.load(std::memory_order_acquire));
+        if (reading.type == SHM_METRIC_NONE) {
+            continue;
+        }
+        reading.name.assign(slot.name,
+                            strnlen(slot.name,
+                                    ShmMetricsSegment::MaxNameLength));
+        reading.value = 0.0;
+        reading.count = 0;
+        reading.sum = reading.min = reading.max = 0.0;
+        reading.stale = false;
+
+        if (reading.type == SHM_METRIC_COUNTER) {
+            reading.value = slot.count.load(relaxed);
+        }
+        else if (reading.type == SHM_METRIC_GAUGE) {
+            reading.value = slot.value.load(relaxed);
+        }
+        else {
+            reading.buckets.resize(ShmMetricsSegment::NumBuckets);
+            uint64_t oddSeq = 0;
+            int oddSpins = 0;
+            for (int attempt = 0;;) {
+                uint64_t seq = slot.sequence.load(std::memory_order_acquire);
+                if (seq & 1) {
+                    if (seq != oddSeq) {
+                        oddSeq = seq;
+                        oddSpins = 0;
+                    }
+                    if (ownerState == -1) {
+                        ownerState = ownerAlive();
+                    }
+                    if (!ownerState || ++oddSpins > MaxOddSpins) {
+                        reading.stale = true;
+                        break;
+                    }
+                    __builtin_ia32_pause();
+                    continue;
+                }
+                if (++attempt > MaxAttempts) {
+                    reading.stale = true;
+                    break;
+                }
+                reading.count = slot.count.load(relaxed);
+                reading.sum = slot.sum.load(relaxed);
+                reading.min = slot.min.load(relaxed);
+                reading.max = slot.max.load(relaxed);
+                for (int j = 0;  j < ShmMetricsSegment::NumBuckets;  ++j) {
+                    reading.buckets[j] = slot.buckets[j].load(relaxed);
+                }
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if (slot.sequence.load(relaxed) == seq) {
+                    break;
+                }
+            }
+
+            if (reading.stale) {
+                reading.count = 0;
+                reading.sum = reading.min = reading.max = 0.0;
+                std::fill(reading.buckets.begin(), reading.buckets.end(), 0);
+            }
+        }
+
+        readings.emplace_back(std::move(reading));
+    }
+
+    return readings;
+}
+
+bool
+ShmMetricsReader::
+readProcess(vector<Reading> & readings) const
+{
+    if (statFd == -1) {
+        return false;
+    }
+
+    char buffer[1024];
+    ssize_t res = pread(statFd, buffer, sizeof(buffer) - 1, 0);
+    if (res <= 0) {
+        return false;
+    }
+    buffer[res] = 0;
+
+    /* the command name can contain spaces, so fields are counted from the
+       parenthesis that closes it, which is followed by field 3 */
+    const char * p = strrchr(buffer, ')');
+    if (!p) {
+        return false;
+    }
+    p++;
+
+    enum {
+        STAT_MINFLT = 10,
+        STAT_MAJFLT = 12,
+        STAT_UTIME = 14,
+        STAT_STIME = 15,
+        STAT_NUM_THREADS = 20,
+        STAT_VSIZE = 23,
+        STAT_RSS = 24
+    };
+    uint64_t fields[STAT_RSS + 1];
+    for (int field = 3;  field <= STAT_RSS;  ++field) {
+        while (*p == ' ') {
+            p++;
+        }
+        if (field == 3) {
+            /* state, a single letter */
+            fields[field] = *p;
+            p++;
+            continue;
+        }
+        char * end;
+        fields[field] = strtoll(p, &end, 10);
+        if (end == p) {
+            return false;
+        }
+        p = end;
+    }
+
+    static const double ticks = sysconf(_SC_CLK_TCK);
+    static const double pageSize = getpagesize();
+
+    auto add = [&] (const char * name, ShmMetricType type, double value) {
+        Reading reading;
+        reading.name = name;
+        reading.type = type;
+        reading.value = value;
+        reading.count = 0;
+        reading.sum = reading.min = reading.max = 0.0;
+        reading.stale = false;
+        readings.emplace_back(std::move(reading));
+    };
+
+    add("process.timeUser", SHM_METRIC_COUNTER, fields[STAT_UTIME] / ticks);
+    add("process.timeSystem", SHM_METRIC_COUNTER, fields[STAT_STIME] / ticks);
+    add("process.faultsMinor", SHM_METRIC_COUNTER, fields[STAT_MINFLT]);
+    add("process.faultsMajor", SHM_METRIC_COUNTER, fields[STAT_MAJFLT]);
+    add("process.threads", SHM_METRIC_GAUGE, fields[STAT_NUM_THREADS]);
+    add("process.memVirtual", SHM_METRIC_GAUGE, fields[STAT_VSIZE]);
+    add("process.memResident", SHM_METRIC_GAUGE,
+        fields[STAT_RSS] * pageSize);
+
+    return true;
+}
+
+
+/*****************************************************************************/
+/* SHM METRICS ROLLUP                                                        */
+/*****************************************************************************/
+
+namespace {
+
+/** Upper bound of the values in a histogram bucket. */
+double bucketLimit(int bucket)
+{
+    return ldexp(1.0, bucket);
+}
+
+} // file scope
+
+ShmMetricsRollup::
+ShmMetricsRollup(const vector<double> & periods)
+{
+    for (double period: periods) {
+        Level level;
+        level.period = period;
+        levels.emplace_back(std::move(level));
+    }
+}
+
+void
+ShmMetricsRollup::
+sample(const vector<Reading> & readings, Date now)
+{
+    for (Level & level: levels) {
+        if (level.start == Date()) {
+            level.start = now;
+        }
+
+        for (const Reading & reading: readings) {
+            if (reading.stale) {
+                continue;
+            }
+
+            auto it = level.accums.find(reading.name);
+            if (it == level.accums.end()) {
+                it = level.accums.insert({reading.name, Accum()}).first;
+                it->second.first = reading;
+            }
+
+            Accum & accum = it->second;
+            if (reading.type == SHM_METRIC_GAUGE) {
+                if (accum.numSamples == 0
+                    || reading.value < accum.min) {
+                    accum.min = reading.value;
+                }
+                if (accum.numSamples == 0
+                    || reading.value > accum.max) {
+                    accum.max = reading.value;
+                }
+                accum.sum += reading.value;
+            }
+            accum.numSamples++;
+            accum.last = reading;
+        }
+
+        if (now.secondsSince(level.start) >= level.period) {
+            report(level, now);
+        }
+    }
+}
+
+void
+ShmMetricsRollup::
+report(Level & level, Date now)
+{
+    double elapsed = now.secondsSince(level.start);
+    vector<StatReading> values;
+
+    for (auto & it: level.accums) {
+        const string & name = it.first;
+        Accum & accum = it.second;
+        if (accum.numSamples == 0) {
+            continue;
+        }
+
+        const Reading & first = accum.first;
+        const Reading & last = accum.last;
+
+        if (last.type == SHM_METRIC_COUNTER) {
+            double delta = last.value - first.value;
+            values.emplace_back(name + ".count", delta, now);
+            values.emplace_back(name + ".rate",
+                                elapsed > 0 ? delta / elapsed : 0.0, now);
+        }
+        else if (last.type == SHM_METRIC_GAUGE) {
+            values.emplace_back(name + ".mean",
+                                accum.sum / accum.numSamples, now);
+            values.emplace_back(name + ".min", accum.min, now);
+            values.emplace_back(name + ".max", accum.max, now);
+        }
+        else if (last.type == SHM_METRIC_HISTOGRAM) {
+            uint64_t count = last.count - first.count;
+            values.emplace_back(name + ".count", count, now);
+            if (count > 0) {
+                values.emplace_back(name + ".mean",
+                                    (last.sum - first.sum) / count, now);
+
+                /* percentiles are estimated by the upper bound of the bucket
+                   they fall in, which is never beyond the maximum */
+                vector<uint64_t> deltas(last.buckets.size());
+                for (size_t i = 0;  i < deltas.size();  ++i) {
+                    deltas[i] = (last.buckets[i]
+                                 - (first.buckets.empty()
+                                    ? 0 : first.buckets[i]));
+                }
+                auto percentile = [&] (double fraction) {
+                    uint64_t rank = ceil(fraction * count);
+                    uint64_t seen = 0;
+                    for (size_t i = 0;  i < deltas.size();  ++i) {
+                        seen += deltas[i];
+                        if (seen >= rank) {
+                            return std::min(bucketLimit(i), last.max);
+                        }
+                    }
+                    return last.max;
+                };
+                values.emplace_back(name + ".p50", percentile(0.50), now);
+                values.emplace_back(name + ".p90", percentile(0.90), now);
+                values.emplace_back(name + ".p99", percentile(0.99), now);
+                values.emplace_back(name + ".max", percentile(1.0), now);
+            }
+        }
+
+        accum.first = accum.last;
+        accum.numSamples = 0;
+        accum.sum = accum.min = accum.max = 0.0;
+    }
+
+    level.start = now;
+    if (onRollup) {
+        onRollup(level.period, values);
+    }
+}
+
+} // namespace Datacratic
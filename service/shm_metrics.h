@@ -0,0 +1,282 @@
+/* shm_metrics.h                                                   -*- C++ -*-
+   Copyright (c) 2014 Datacratic.  All rights reserved.
+
+   Metrics exported through a shared memory segment, and rolled up by a
+   separate process.
+*/
+
+#pragma once
+
+#include <sys/types.h>
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "soa/types/date.h"
+#include "stat_aggregator.h"
+
+
+namespace Datacratic {
+
+
+enum ShmMetricType {
+    SHM_METRIC_NONE = 0,
+    SHM_METRIC_COUNTER = 1,
+    SHM_METRIC_GAUGE = 2,
+    SHM_METRIC_HISTOGRAM = 3
+};
+
+
+/*****************************************************************************/
+/* SHM METRICS SEGMENT                                                       */
+/*****************************************************************************/
+
+/** Layout of the shared memory segment.  Slots are only ever appended, so
+    that a reader can walk them without synchronizing with the writer
+    beyond the release of "numMetrics".
+*/
+
+struct ShmMetricsSegment {
+    static const uint64_t Magic = 0x53484d4d45545231ULL;  // "SHMMETR1"
+
+    enum {
+        MaxNameLength = 111,
+        NumBuckets = 64
+    };
+
+    struct Slot {
+        std::atomic<uint32_t> type;
+        uint32_t unused;
+        char name[MaxNameLength + 1];
+
+        /* odd while a histogram is being updated */
+        std::atomic<uint64_t> sequence;
+
+        std::atomic<uint64_t> count;     // counters and histograms
+        std::atomic<double> value;       // gauges
+        std::atomic<double> sum;
+        std::atomic<double> min;
+        std::atomic<double> max;
+
+        /* bucket 0 counts values below 1, bucket i values in
+           [2^(i-1), 2^i) */
+        std::atomic<uint64_t> buckets[NumBuckets];
+    } __attribute__((__aligned__(64)));
+
+    std::atomic<uint64_t> magic;
+    uint32_t capacity;
+    std::atomic<uint32_t> numMetrics;
+    pid_t pid;
+    double startTime;
+
+    Slot slots[0];
+
+    static size_t segmentSize(size_t capacity)
+    {
+        return sizeof(ShmMetricsSegment) + capacity * sizeof(Slot);
+    }
+
+    static int bucketOf(double value);
+};
+
+
+/*****************************************************************************/
+/* SHM METRICS                                                               */
+/*****************************************************************************/
+
+/** Writer side of a metrics segment, named "metrics.<name>" under
+    /dev/shm.
+
+    Updates are plain atomic operations on the mapped memory, with no system
+    call and no formatting, so that they can be done on the hot path and
+    sampled by the reader as often as wanted.  Counters and gauges can be
+    updated from any number of threads; histograms too, but concurrent
+    updates of the same histogram are serialized by its seqlock.
+*/
+
+struct ShmMetrics {
+    ShmMetrics(const std::string & name, size_t capacity = 1024);
+    ~ShmMetrics();
+
+    ShmMetrics(const ShmMetrics & other) = delete;
+    void operator = (const ShmMetrics & other) = delete;
+
+    typedef ShmMetricsSegment::Slot Slot;
+
+    /** Monotonic count, reported as a rate. */
+    struct Counter {
+        Counter(Slot * slot = nullptr) : slot(slot) {}
+
+        void inc(uint64_t n = 1)
+        {
+            slot->count.fetch_add(n, std::memory_order_relaxed);
+        }
+
+        Slot * slot;
+    };
+
+    /** Instantaneous level, reported as min, mean and max of the samples. */
+    struct Gauge {
+        Gauge(Slot * slot = nullptr) : slot(slot) {}
+
+        void set(double value)
+        {
+            slot->value.store(value, std::memory_order_relaxed);
+        }
+
+        Slot * slot;
+    };
+
+    /** Distribution of values, reported with percentiles. */
+    struct Histogram {
+        Histogram(Slot * slot = nullptr) : slot(slot) {}
+
+        void record(double value);
+
+        Slot * slot;
+    };
+
+    /** Return the metric with the given name, registering it the first
+        time.  Registration takes a lock; the handles should be kept by the
+        callers rather than looked up on every update.
+    */
+    Counter counter(const std::string & name);
+    Gauge gauge(const std::string & name);
+    Histogram histogram(const std::string & name);
+
+    /** Remove the segment name, which stays mapped until destruction. */
+    void unlink();
+
+    const std::string name;
+
+private:
+    Slot * getSlot(const std::string & name, ShmMetricType type);
+
+    int fd;
+    size_t size;
+    ShmMetricsSegment * segment;
+
+    std::mutex lock;
+    std::unordered_map<std::string, Slot *> metrics;
+};
+
+
+/*****************************************************************************/
+/* SHM METRICS READER                                                        */
+/*****************************************************************************/
+
+/** Read-only view of the segment of another (or the same) process. */
+
+struct ShmMetricsReader {
+    ShmMetricsReader(const std::string & name);
+    ~ShmMetricsReader();
+
+    ShmMetricsReader(const ShmMetricsReader & other) = delete;
+    void operator = (const ShmMetricsReader & other) = delete;
+
+    struct Reading {
+        Reading()
+            : type(SHM_METRIC_NONE), value(0.0), count(0),
+              sum(0.0), min(0.0), max(0.0), stale(false)
+        {
+        }
+
+        std::string name;
+        ShmMetricType type;
+        double value;           // count of counters, level of gauges
+        uint64_t count;         // histograms
+        double sum;
+        double min;
+        double max;
+        std::vector<uint64_t> buckets;
+        bool stale;             // histogram left in the middle of an update
+    };
+
+    /** Consistent copy of every metric registered so far.  A histogram
+        that stays in the middle of an update, because its writer was
+        preempted or died there, is returned empty and marked as stale
+        rather than waited for.
+    */
+    std::vector<Reading> read() const;
+
+    /** Append the counters and gauges of the process that owns the
+        segment, read from /proc without going through the process.
+        Returns false if the process has gone away.
+    */
+    bool readProcess(std::vector<Reading> & readings) const;
+
+    pid_t pid() const
+    {
+        return segment->pid;
+    }
+
+    /** Whether the process that owns the segment is still running. */
+    bool ownerAlive() const;
+
+    const std::string name;
+
+private:
+    int fd;
+    int statFd;
+    size_t size;
+    const ShmMetricsSegment * segment;
+};
+
+
+/*****************************************************************************/
+/* SHM METRICS ROLLUP                                                        */
+/*****************************************************************************/
+
+/** Aggregates samples of a segment over several periods at once, for
+    example 1, 10 and 60 seconds, each level being reported when its period
+    has elapsed.
+*/
+
+struct ShmMetricsRollup {
+    typedef ShmMetricsReader::Reading Reading;
+
+    ShmMetricsRollup(const std::vector<double> & periods = { 1, 10, 60 });
+
+    /** Called with the period of a level and its rolled up values, which
+        are named after the metrics, eg "requests.rate" or "latency.p99".
+    */
+    typedef std::function<void (double period,
+                                const std::vector<StatReading> & values)>
+        OnRollup;
+    OnRollup onRollup;
+
+    /** Add a sample taken at the given time.  Stale readings are
+        skipped.
+    */
+    void sample(const std::vector<Reading> & readings, Date now);
+
+private:
+    struct Accum {
+        Accum()
+            : numSamples(0), sum(0.0), min(0.0), max(0.0)
+        {
+        }
+
+        Reading first;     // cumulative values when the level started
+        Reading last;
+        size_t numSamples;
+        double sum;        // of the gauge samples
+        double min;
+        double max;
+    };
+
+    struct Level {
+        double period;
+        Date start;
+        std::unordered_map<std::string, Accum> accums;
+    };
+
+    void report(Level & level, Date now);
+
+    std::vector<Level> levels;
+};
+
+} // namespace Datacratic
@@ -0,0 +1,107 @@
+/* shm_metrics_agent.cc
+   Copyright (c) 2014 Datacratic.  All rights reserved.
+
+   Samples the metrics segment of a local process, rolls the samples up over
+   several periods and writes them out in carbon's plaintext format, ready
+   to be sent to carbon with netcat or read directly.
+*/
+
+#include <signal.h>
+#include <iostream>
+#include <thread>
+#include <boost/program_options/options_description.hpp>
+#include <boost/program_options/parsers.hpp>
+#include <boost/program_options/positional_options.hpp>
+#include <boost/program_options/variables_map.hpp>
+
+#include "soa/service/shm_metrics.h"
+
+namespace po = boost::program_options;
+
+using namespace std;
+using namespace Datacratic;
+
+
+int main(int argc, char ** argv)
+{
+    string name;
+    string prefix;
+    double sampleRate = 100.0;
+    vector<double> periods;
+    bool noProcess = false;
+
+    po::options_description desc("Main options");
+    desc.add_options()
+        ("name,n", po::value(&name), "Name of the metrics segment")
+        ("prefix,p", po::value(&prefix), "Prefix of the metric names")
+        ("sample-rate,r", po::value(&sampleRate),
+         "Number of samples per second (100)")
+        ("period,P", po::value(&periods),
+         "Rollup period in seconds, can be repeated (1, 10 and 60)")
+        ("no-process", po::bool_switch(&noProcess),
+         "Don't sample the process statistics from /proc")
+        ("help,h", "Produce help message");
+
+    po::positional_options_description pos;
+    pos.add("name", 1);
+    po::variables_map vm;
+    bool showHelp = false;
+
+    try {
+        po::store(po::command_line_parser(argc, argv)
+                  .options(desc)
+                  .positional(pos)
+                  .run(),
+                  vm);
+        po::notify(vm);
+    }
+    catch (const std::exception & exc) {
+        cerr << "command line parsing error: " << exc.what() << endl;
+        showHelp = true;
+    }
+
+    if (showHelp || vm.count("help") || name.empty() || sampleRate <= 0) {
+        cerr << desc << endl;
+        return showHelp ? 1 : 0;
+    }
+
+    if (periods.empty()) {
+        periods = { 1, 10, 60 };
+    }
+    if (!prefix.empty()) {
+        prefix += ".";
+    }
+
+    ShmMetricsReader reader(name);
+    ShmMetricsRollup rollup(periods);
+    rollup.onRollup = [&] (double period, const vector<StatReading> & values) {
+        string levelPrefix = prefix + to_string(int(period)) + "s.";
+        for (const StatReading & value: values) {
+            cout << levelPrefix << value.name << " " << value.value
+                 << " " << int64_t(value.timestamp.secondsSinceEpoch())
+                 << "\n";
+        }
+        cout.flush();
+    };
+
+    auto interval = std::chrono::nanoseconds(int64_t(1e9 / sampleRate));
+    auto next = std::chrono::steady_clock::now();
+
+    for (;;) {
+        if (!reader.ownerAlive()) {
+            cerr << "process " << reader.pid() << " has exited" << endl;
+            break;
+        }
+
+        auto readings = reader.read();
+        if (!noProcess) {
+            reader.readProcess(readings);
+        }
+        rollup.sample(readings, Date::now());
+
+        next += interval;
+        std::this_thread::sleep_until(next);
+    }
+
+    return 0;
+}
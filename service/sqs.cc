@@ -14,67 +14,6 @@ using namespace std;
 using namespace ML;
 
 
-namespace {
-
-using namespace Datacratic;
-
-
-SqsApi::Message
-extractMessage(const tinyxml2::XMLNode * messageNode)
-{
-    SqsApi::Message message;
-
-    message.body = extract<string>(messageNode, "Body");
-    message.bodyMd5 = extract<string>(messageNode,
-                                      "MD5OfBody");
-    message.messageId = extract<string>(messageNode,
-                                        "MessageId");
-    message.receiptHandle = extract<string>(messageNode,
-                                            "ReceiptHandle");
-
-    // xml->Print();
-
-    const tinyxml2::XMLElement * p = extractNode(messageNode, "Attribute")->ToElement();
-    while (p && strcmp(p->Name(), "Attribute") == 0) {
-        const tinyxml2::XMLNode * name = extractNode(p, "Name");
-        const tinyxml2::XMLNode * value = extractNode(p, "Value");
-        if (name && value) {
-            string attrName(name->FirstChild()->ToText()->Value());
-            string attrValue(value->FirstChild()->ToText()->Value());
-            if (value) {
-                if (attrName == "SenderId") {
-                    message.senderId = attrValue;
-                }
-                else if (attrName == "ApproximateFirstReceiveTimestamp") {
-                    long long ms = stoll(attrValue);
-                    double seconds = (double)ms / 1000;
-                    message.approximateFirstReceiveTimestamp
-                        = Date::fromSecondsSinceEpoch(seconds);
-                }
-                else if (attrName == "SentTimestamp") {
-                    long long ms = stoll(attrValue);
-                    double seconds = (double)ms / 1000;
-                    message.sentTimestamp
-                        = Date::fromSecondsSinceEpoch(seconds);
-                }
-                else if (attrName == "ApproximateReceiveCount") {
-                    message.approximateReceiveCount = stoi(attrValue);
-                }
-                else {
-                    throw ML::Exception("unexpected attribute name: "
-                                        + attrName);
-                }
-            }
-        }
-        p = p->NextSiblingElement();
-    }
-
-    return message;
-}
-
-}
-
-
 namespace Datacratic {
 
 
@@ -331,6 +270,60 @@ sendMessageBatch(const string & queueUri,
     performPost(std::move(queryParams), getQueueResource(queueUri));
 }
 
+SqsApi::Message
+SqsApi::
+extractMessage(const tinyxml2::XMLNode * messageNode)
+{
+    Message message;
+
+    message.body = extract<string>(messageNode, "Body");
+    message.bodyMd5 = extract<string>(messageNode,
+                                      "MD5OfBody");
+    message.messageId = extract<string>(messageNode,
+                                        "MessageId");
+    message.receiptHandle = extract<string>(messageNode,
+                                            "ReceiptHandle");
+
+    // xml->Print();
+
+    const tinyxml2::XMLElement * p = extractNode(messageNode, "Attribute")->ToElement();
+    while (p && strcmp(p->Name(), "Attribute") == 0) {
+        const tinyxml2::XMLNode * name = extractNode(p, "Name");
+        const tinyxml2::XMLNode * value = extractNode(p, "Value");
+        if (name && value) {
+            string attrName(name->FirstChild()->ToText()->Value());
+            string attrValue(value->FirstChild()->ToText()->Value());
+            if (value) {
+                if (attrName == "SenderId") {
+                    message.senderId = attrValue;
+                }
+                else if (attrName == "ApproximateFirstReceiveTimestamp") {
+                    long long ms = stoll(attrValue);
+                    double seconds = (double)ms / 1000;
+                    message.approximateFirstReceiveTimestamp
+                        = Date::fromSecondsSinceEpoch(seconds);
+                }
+                else if (attrName == "SentTimestamp") {
+                    long long ms = stoll(attrValue);
+                    double seconds = (double)ms / 1000;
+                    message.sentTimestamp
+                        = Date::fromSecondsSinceEpoch(seconds);
+                }
+                else if (attrName == "ApproximateReceiveCount") {
+                    message.approximateReceiveCount = stoi(attrValue);
+                }
+                else {
+                    throw ML::Exception("unexpected attribute name: "
+                                        + attrName);
+                }
+            }
+        }
+        p = p->NextSiblingElement();
+    }
+
+    return message;
+}
+
 SqsApi::Message
 SqsApi::
 receiveMessage(const std::string & queueUri,
@@ -14,6 +14,10 @@
 #include "soa/types/string.h"
 
 
+namespace tinyxml2 {
+class XMLNode;
+} // namespace tinyxml2
+
 namespace Datacratic {
 
 
@@ -150,6 +154,11 @@ struct SqsApi : public AwsBasicApi {
         JML_IMPLEMENT_OPERATOR_BOOL(!isNull());
     };
 
+    /** Extract a message from the corresponding node of a ReceiveMessage
+        response.
+    */
+    static Message extractMessage(const tinyxml2::XMLNode * messageNode);
+
     Message receiveMessage(const std::string & queueUri,
                            int visibilityTimeout = -1,
                            int waitTimeSeconds = -1);
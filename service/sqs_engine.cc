@@ -0,0 +1,826 @@
+/* sqs_engine.cc
+   Copyright (c) 2014 Datacratic.  All rights reserved.
+
+   Asynchronous, batching client for a single SQS queue.
+*/
+
+#include <math.h>
+#include <string.h>
+
+#include "jml/arch/exception.h"
+#include "soa/types/url.h"
+#include "xml_helpers.h"
+#include "sqs_engine.h"
+
+using namespace std;
+using namespace Datacratic;
+
+
+namespace {
+
+/* Limits of the SQS batch actions */
+const size_t maxBatchEntries = 10;
+const size_t maxBatchBytes = 256 * 1024;
+
+const string contentType("application/x-www-form-urlencoded; charset=utf-8");
+
+/** Parse the response to a batch action, returning the value of the given
+    field for the entries that succeeded and the error for those that
+    failed.  Entries have been given their index as id.
+*/
+vector<pair<string, string> >
+parseBatchResponse(const string & body,
+                   const char * resultName,
+                   const char * valueName,
+                   size_t numEntries)
+{
+    vector<pair<string, string> > results(numEntries);
+
+    tinyxml2::XMLDocument xml;
+    xml.Parse(body.c_str());
+    if (!xml.RootElement()) {
+        throw ML::Exception("invalid batch response");
+    }
+
+    auto result = extractNode(xml.RootElement(), resultName);
+    for (auto p = result->FirstChildElement();  p;
+         p = p->NextSiblingElement()) {
+        size_t index = stoi(extract<string>(p, "Id"));
+        if (index >= numEntries) {
+            throw ML::Exception("batch response has unknown id %zd", index);
+        }
+        if (strcmp(p->Name(), "BatchResultErrorEntry") == 0) {
+            results[index].second = (extract<string>(p, "Code") + ": "
+                                     + extractDef<string>(p, "Message", ""));
+        }
+        else {
+            results[index].first = (valueName
+                                    ? extract<string>(p, valueName)
+                                    : "ok");
+        }
+    }
+
+    for (auto & r: results) {
+        if (r.first.empty() && r.second.empty()) {
+            r.second = "no result in batch response";
+        }
+    }
+
+    return results;
+}
+
+} // file scope
+
+
+namespace Datacratic {
+
+/*****************************************************************************/
+/* SQS ENGINE                                                                */
+/*****************************************************************************/
+
+SqsEngine::Config::
+Config()
+    : numReceivers(2),
+      waitTimeSeconds(20),
+      prefetchSize(100),
+      visibilityTimeout(60),
+      extendMargin(20.0),
+      maxBatchDelay(0.01),
+      maxPendingSends(10000),
+      numAttempts(3),
+      retryDelay(0.1),
+      maxRetryDelay(10.0),
+      numConnections(16)
+{
+}
+
+SqsEngine::
+SqsEngine(const std::string & queueUri,
+          const std::string & accessKeyId,
+          const std::string & accessKey,
+          const std::string & region,
+          const Config & config)
+    : MessageLoop(1, 0, -1),
+      config(config),
+      signer(accessKeyId, accessKey, region, "sqs"),
+      pendingSendBytes(0), sendsInProgress(0),
+      deletesInProgress(0),
+      receiving(false), receivesInProgress(0), receiveFailures(0),
+      receiveSlots(0), tickTimer(0),
+      running(false)
+{
+    if (config.extendMargin >= config.visibilityTimeout) {
+        throw ML::Exception("the extension margin must be lower than the"
+                            " visibility timeout");
+    }
+
+    Url url(queueUri);
+    host = url.host();
+    if (url.port() > 0) {
+        host += ":" + to_string(url.port());
+    }
+    resource = url.path();
+    if (resource.size() < 2) {
+        throw ML::Exception("no queue in uri '%s'", queueUri.c_str());
+    }
+
+    client = make_shared<HttpClient>(url.scheme() + "://" + host,
+                                     config.numConnections);
+    addSource("SqsEngine::client", client);
+}
+
+SqsEngine::
+~SqsEngine()
+{
+    shutdown();
+}
+
+void
+SqsEngine::
+start()
+{
+    MessageLoop::start();
+    running = true;
+}
+
+void
+SqsEngine::
+shutdown()
+{
+    stopReceiving();
+    if (running) {
+        drain();
+        running = false;
+    }
+    MessageLoop::shutdown();
+}
+
+bool
+SqsEngine::
+send(std::string body, const OnSent & onSent, int delaySeconds)
+{
+    if (body.size() > maxBatchBytes) {
+        throw ML::Exception("message of %zd bytes is over the %zd bytes"
+                            " accepted by SQS", body.size(), maxBatchBytes);
+    }
+
+    vector<SendEntry> batch;
+
+    {
+        unique_lock<mutex> guard(lock);
+
+        if (int(pendingSends.size()) + sendsInProgress
+            >= config.maxPendingSends) {
+            return false;
+        }
+        if (pendingSendBytes + body.size() > maxBatchBytes) {
+            batch = takePendingSends();
+        }
+        if (pendingSends.empty()) {
+            firstPendingSend = Date::now();
+            scheduleTick(firstPendingSend.plusSeconds(config.maxBatchDelay));
+        }
+        pendingSendBytes += body.size();
+        pendingSends.emplace_back(SendEntry{std::move(body), delaySeconds,
+                                            onSent});
+        if (pendingSends.size() == maxBatchEntries) {
+            batch = takePendingSends();
+        }
+    }
+
+    if (!batch.empty()) {
+        sendBatch(std::move(batch));
+    }
+
+    return true;
+}
+
+void
+SqsEngine::
+deleteMessage(const std::string & receiptHandle, const OnDeleted & onDeleted)
+{
+    vector<DeleteEntry> batch;
+
+    {
+        unique_lock<mutex> guard(lock);
+
+        inFlightMessages.erase(receiptHandle);
+        if (pendingDeletes.empty()) {
+            firstPendingDelete = Date::now();
+            scheduleTick(firstPendingDelete.plusSeconds(config.maxBatchDelay));
+        }
+        pendingDeletes.emplace_back(DeleteEntry{receiptHandle, onDeleted});
+        if (pendingDeletes.size() == maxBatchEntries) {
+            batch = takePendingDeletes();
+        }
+    }
+
+    if (!batch.empty()) {
+        deleteBatch(std::move(batch));
+    }
+}
+
+void
+SqsEngine::
+release(const std::string & receiptHandle)
+{
+    unique_lock<mutex> guard(lock);
+    inFlightMessages.erase(receiptHandle);
+}
+
+void
+SqsEngine::
+flush()
+{
+    vector<SendEntry> sends;
+    vector<DeleteEntry> deletes;
+
+    {
+        unique_lock<mutex> guard(lock);
+        sends = takePendingSends();
+        deletes = takePendingDeletes();
+    }
+
+    if (!sends.empty()) {
+        sendBatch(std::move(sends));
+    }
+    if (!deletes.empty()) {
+        deleteBatch(std::move(deletes));
+    }
+}
+
+bool
+SqsEngine::
+drain(double timeoutSeconds)
+{
+    flush();
+
+    unique_lock<mutex> guard(lock);
+    auto isIdle = [&] () {
+        return (pendingSends.empty() && sendsInProgress == 0
+                && pendingDeletes.empty() && deletesInProgress == 0);
+    };
+
+    return idleCond.wait_for(guard,
+                             std::chrono::duration<double>(timeoutSeconds),
+                             isIdle);
+}
+
+void
+SqsEngine::
+startReceiving()
+{
+    {
+        unique_lock<mutex> guard(lock);
+        receiving = true;
+    }
+    checkReceivers();
+}
+
+void
+SqsEngine::
+stopReceiving()
+{
+    unique_lock<mutex> guard(lock);
+    receiving = false;
+}
+
+SqsApi::Message
+SqsEngine::
+pop(double timeoutSeconds)
+{
+    SqsApi::Message message;
+
+    {
+        unique_lock<mutex> guard(lock);
+
+        if (prefetchBuffer.empty() && timeoutSeconds > 0) {
+            prefetchCond.wait_for(guard,
+                                  std::chrono::duration<double>(timeoutSeconds),
+                                  [&] () { return !prefetchBuffer.empty(); });
+        }
+        if (prefetchBuffer.empty()) {
+            return message;
+        }
+
+        message = std::move(prefetchBuffer.front());
+        prefetchBuffer.pop_front();
+    }
+
+    // There is room for more now
+    checkReceivers();
+
+    return message;
+}
+
+size_t
+SqsEngine::
+prefetched()
+    const
+{
+    unique_lock<mutex> guard(lock);
+    return prefetchBuffer.size();
+}
+
+size_t
+SqsEngine::
+inFlight()
+    const
+{
+    unique_lock<mutex> guard(lock);
+    return inFlightMessages.size();
+}
+
+SqsEngine::Stats
+SqsEngine::
+getStats()
+    const
+{
+    unique_lock<mutex> guard(lock);
+    return stats;
+}
+
+void
+SqsEngine::
+perform(const RestParams & params, int timeoutSeconds,
+        const OnResponse & onResponse)
+{
+    auto payload = make_shared<string>();
+    for (const auto & p: params) {
+        if (!payload->empty()) {
+            *payload += '&';
+        }
+        *payload += p.first;
+        *payload += '=';
+        AwsApi::appendUriEncoded(p.second, *payload);
+    }
+
+    perform(payload, timeoutSeconds, onResponse, 1);
+}
+
+void
+SqsEngine::
+perform(const std::shared_ptr<std::string> & payload,
+        int timeoutSeconds, const OnResponse & onResponse,
+        int attempt)
+{
+    AwsApi::BasicRequest request;
+    request.method = "POST";
+    request.relativeUri = resource.substr(1);
+    request.headers.push_back({"Host", host});
+    request.headers.push_back({"Content-Type", contentType});
+    request.payload = *payload;
+    signer.sign(request);
+
+    /* The http client sends the host and content type headers by itself,
+       so only the ones added by the signer are passed along. */
+    RestParams headers;
+    for (size_t i = 2;  i < request.headers.size();  ++i) {
+        headers.push_back(std::move(request.headers[i]));
+    }
+
+    auto onDone = [=] (const HttpRequest & rq, HttpClientError error,
+                       int code, string && responseHeaders, string && body) {
+        string errorMessage;
+        bool recoverable(false);
+
+        if (error != HttpClientError::None) {
+            errorMessage = ("http client error: "
+                            + HttpClientCallbacks::errorMessage(error));
+            recoverable = true;
+        }
+        else if (code != 200) {
+            errorMessage = "HTTP status code " + to_string(code) + ": " + body;
+            recoverable = (code >= 500);
+        }
+
+        if (recoverable && attempt < config.numAttempts) {
+            auto retry = [=] (uint64_t) {
+                perform(payload, timeoutSeconds, onResponse, attempt + 1);
+            };
+            timers().scheduleIn(retryDelay(attempt), retry);
+        }
+        else {
+            onResponse(errorMessage, std::move(body));
+        }
+    };
+
+    auto callbacks = make_shared<HttpClientSimpleCallbacks>(onDone);
+    if (!client->post(resource, callbacks,
+                      HttpRequest::Content(*payload, contentType),
+                      RestParams(), headers, timeoutSeconds)) {
+        onResponse("the http client could not enqueue the request", "");
+    }
+}
+
+vector<SqsEngine::SendEntry>
+SqsEngine::
+takePendingSends()
+{
+    vector<SendEntry> batch;
+    batch.swap(pendingSends);
+    pendingSendBytes = 0;
+    sendsInProgress += batch.size();
+    return batch;
+}
+
+vector<SqsEngine::DeleteEntry>
+SqsEngine::
+takePendingDeletes()
+{
+    vector<DeleteEntry> batch;
+    batch.swap(pendingDeletes);
+    deletesInProgress += batch.size();
+    return batch;
+}
+
+void
+SqsEngine::
+sendBatch(std::vector<SendEntry> && batch)
+{
+    RestParams params;
+    params.push_back({"Action", "SendMessageBatch"});
+    params.push_back({"Version", "2012-11-05"});
+
+    for (size_t i = 0;  i < batch.size();  ++i) {
+        string prefix = "SendMessageBatchRequestEntry." + to_string(i + 1);
+        params.push_back({prefix + ".Id", to_string(i)});
+        params.push_back({prefix + ".MessageBody", batch[i].body});
+        if (batch[i].delaySeconds > -1) {
+            params.push_back({prefix + ".DelaySeconds",
+                              to_string(batch[i].delaySeconds)});
+        }
+    }
+
+    auto entries = make_shared<vector<SendEntry> >(std::move(batch));
+    auto onResponse = [=] (const string & error, string && body) {
+        vector<pair<string, string> > results(entries->size());
+        string batchError(error);
+        if (batchError.empty()) {
+            try {
+                results = parseBatchResponse(body, "SendMessageBatchResult",
+                                             "MessageId", entries->size());
+            } catch (const std::exception & exc) {
+                batchError = exc.what();
+            }
+        }
+        if (!batchError.empty()) {
+            for (auto & r: results) {
+                r.first.clear();
+                r.second = batchError;
+            }
+        }
+
+        size_t numSent(0);
+        for (const auto & r: results) {
+            if (r.second.empty()) {
+                numSent++;
+            }
+        }
+
+        /* The callbacks are called before the entries stop counting as in
+           progress, so that they have all run once drain() returns. */
+        for (size_t i = 0;  i < entries->size();  ++i) {
+            const OnSent & onSent = (*entries)[i].onSent;
+            if (onSent) {
+                onSent(results[i].first, results[i].second);
+            }
+        }
+
+        {
+            unique_lock<mutex> guard(lock);
+            sendsInProgress -= entries->size();
+            stats.sendRequests++;
+            stats.messagesSent += numSent;
+            stats.sendErrors += entries->size() - numSent;
+        }
+        idleCond.notify_all();
+    };
+
+    perform(params, 10, onResponse);
+}
+
+void
+SqsEngine::
+deleteBatch(std::vector<DeleteEntry> && batch)
+{
+    RestParams params;
+    params.push_back({"Action", "DeleteMessageBatch"});
+    params.push_back({"Version", "2012-11-05"});
+
+    for (size_t i = 0;  i < batch.size();  ++i) {
+        string prefix = "DeleteMessageBatchRequestEntry." + to_string(i + 1);
+        params.push_back({prefix + ".Id", to_string(i)});
+        params.push_back({prefix + ".ReceiptHandle", batch[i].receiptHandle});
+    }
+
+    auto entries = make_shared<vector<DeleteEntry> >(std::move(batch));
+    auto onResponse = [=] (const string & error, string && body) {
+        vector<pair<string, string> > results(entries->size());
+        string batchError(error);
+        if (batchError.empty()) {
+            try {
+                results = parseBatchResponse(body, "DeleteMessageBatchResult",
+                                             nullptr, entries->size());
+            } catch (const std::exception & exc) {
+                batchError = exc.what();
+            }
+        }
+        if (!batchError.empty()) {
+            for (auto & r: results) {
+                r.second = batchError;
+            }
+        }
+
+        size_t numDeleted(0);
+        for (const auto & r: results) {
+            if (r.second.empty()) {
+                numDeleted++;
+            }
+        }
+
+        for (size_t i = 0;  i < entries->size();  ++i) {
+            const OnDeleted & onDeleted = (*entries)[i].onDeleted;
+            if (onDeleted) {
+                onDeleted(results[i].second);
+            }
+        }
+
+        {
+            unique_lock<mutex> guard(lock);
+            deletesInProgress -= entries->size();
+            stats.deleteRequests++;
+            stats.messagesDeleted += numDeleted;
+            stats.deleteErrors += entries->size() - numDeleted;
+        }
+        idleCond.notify_all();
+    };
+
+    perform(params, 10, onResponse);
+}
+
+void
+SqsEngine::
+checkReceivers()
+{
+    vector<int> toReceive;
+
+    {
+        unique_lock<mutex> guard(lock);
+
+        /* After errors, receivers are restarted by the tick scheduled for
+           receiveRetryAt. */
+        if (receiveFailures > 0 && Date::now() < receiveRetryAt) {
+            return;
+        }
+
+        while (receiving && receivesInProgress < config.numReceivers) {
+            int room = (config.prefetchSize - int(prefetchBuffer.size())
+                        - receiveSlots);
+            if (room <= 0) {
+                break;
+            }
+            int maxMessages = std::min<int>(room, maxBatchEntries);
+            receivesInProgress++;
+            receiveSlots += maxMessages;
+            toReceive.push_back(maxMessages);
+        }
+    }
+
+    for (int maxMessages: toReceive) {
+        receive(maxMessages);
+    }
+}
+
+void
+SqsEngine::
+receive(int maxMessages)
+{
+    RestParams params;
+    params.push_back({"Action", "ReceiveMessage"});
+    params.push_back({"Version", "2012-11-05"});
+    params.push_back({"AttributeName.1", "All"});
+    params.push_back({"MaxNumberOfMessages", to_string(maxMessages)});
+    params.push_back({"VisibilityTimeout",
+                      to_string(config.visibilityTimeout)});
+    params.push_back({"WaitTimeSeconds", to_string(config.waitTimeSeconds)});
+
+    auto onResponse = [=] (const string & error, string && body) {
+        vector<SqsApi::Message> messages;
+        string receiveError(error);
+        if (receiveError.empty()) {
+            try {
+                tinyxml2::XMLDocument xml;
+                xml.Parse(body.c_str());
+                if (!xml.RootElement()) {
+                    throw ML::Exception("invalid receive response");
+                }
+                auto result = extractNode(xml.RootElement(),
+                                          "ReceiveMessageResult");
+                for (auto p = result->FirstChildElement("Message");  p;
+                     p = p->NextSiblingElement("Message")) {
+                    messages.emplace_back(SqsApi::extractMessage(p));
+                }
+            } catch (const std::exception & exc) {
+                receiveError = exc.what();
+            }
+        }
+
+        {
+            unique_lock<mutex> guard(lock);
+
+            receivesInProgress--;
+            receiveSlots -= maxMessages;
+            stats.receiveRequests++;
+            if (!receiveError.empty()) {
+                stats.receiveErrors++;
+                receiveFailures++;
+                receiveRetryAt = Date::now().plusSeconds(
+                    retryDelay(receiveFailures));
+                scheduleTick(receiveRetryAt);
+            }
+            else {
+                receiveFailures = 0;
+            }
+
+            Date now = Date::now();
+            Date visibleAt = now.plusSeconds(config.visibilityTimeout);
+            for (auto & message: messages) {
+                inFlightMessages[message.receiptHandle] = visibleAt;
+                prefetchBuffer.emplace_back(std::move(message));
+            }
+            stats.messagesReceived += messages.size();
+            if (!messages.empty()) {
+                scheduleTick(std::max(now, lastExtension.plusSeconds(1.0)));
+            }
+        }
+        if (!messages.empty()) {
+            prefetchCond.notify_all();
+        }
+
+        /* After an error, the receiver is restarted by the tick scheduled
+           above rather than right away. */
+        if (receiveError.empty()) {
+            checkReceivers();
+        }
+    };
+
+    perform(params, config.waitTimeSeconds + 5, onResponse);
+}
+
+void
+SqsEngine::
+extendVisibility()
+{
+    vector<string> handles;
+
+    {
+        unique_lock<mutex> guard(lock);
+
+        Date now = Date::now();
+        Date limit = now.plusSeconds(config.extendMargin);
+        Date visibleAt = now.plusSeconds(config.visibilityTimeout);
+        for (auto & m: inFlightMessages) {
+            if (m.second < limit) {
+                handles.push_back(m.first);
+                m.second = visibleAt;
+            }
+        }
+    }
+
+    for (size_t start = 0;  start < handles.size();
+         start += maxBatchEntries) {
+        size_t end = std::min(start + maxBatchEntries, handles.size());
+
+        RestParams params;
+        params.push_back({"Action", "ChangeMessageVisibilityBatch"});
+        params.push_back({"Version", "2012-11-05"});
+        for (size_t i = start;  i < end;  ++i) {
+            string prefix = ("ChangeMessageVisibilityBatchRequestEntry."
+                             + to_string(i - start + 1));
+            params.push_back({prefix + ".Id", to_string(i - start)});
+            params.push_back({prefix + ".ReceiptHandle", handles[i]});
+            params.push_back({prefix + ".VisibilityTimeout",
+                              to_string(config.visibilityTimeout)});
+        }
+
+        size_t numEntries = end - start;
+        auto onResponse = [=] (const string & error, string && body) {
+            /* Failures are expected for messages that were deleted in the
+               meantime, and are otherwise harmless since the message will
+               simply be delivered again. */
+            size_t numExtended(0);
+            if (error.empty()) {
+                try {
+                    auto results = parseBatchResponse(
+                        body, "ChangeMessageVisibilityBatchResult",
+                        nullptr, numEntries);
+                    for (const auto & r: results) {
+                        if (r.second.empty()) {
+                            numExtended++;
+                        }
+                    }
+                } catch (const std::exception &) {
+                }
+            }
+
+            unique_lock<mutex> guard(lock);
+            stats.visibilityRequests++;
+            stats.visibilityExtensions += numExtended;
+        };
+
+        perform(params, 10, onResponse);
+    }
+}
+
+double
+SqsEngine::
+retryDelay(int numFailures)
+    const
+{
+    double delay = ldexp(config.retryDelay, std::min(numFailures, 32) - 1);
+    return std::min(delay, config.maxRetryDelay);
+}
+
+void
+SqsEngine::
+scheduleTick(Date when)
+{
+    if (tickTimer != 0) {
+        if (nextTick <= when) {
+            return;
+        }
+        timers().cancel(tickTimer);
+    }
+
+    nextTick = when;
+    auto onTimer = [=] (uint64_t) { this->onTick(when); };
+    tickTimer = timers().scheduleAt(when, onTimer, config.maxBatchDelay / 2);
+}
+
+void
+SqsEngine::
+onTick(Date scheduledAt)
+{
+    Date now = Date::now();
+    Date limit = now.plusSeconds(-config.maxBatchDelay);
+    vector<SendEntry> sends;
+    vector<DeleteEntry> deletes;
+    bool mustExtend(false);
+
+    {
+        unique_lock<mutex> guard(lock);
+
+        /* A timer that was replaced by an earlier one may still run, and
+           must then leave the other one in place. */
+        if (tickTimer != 0 && nextTick == scheduledAt) {
+            tickTimer = 0;
+        }
+
+        if (!pendingSends.empty() && firstPendingSend <= limit) {
+            sends = takePendingSends();
+        }
+        if (!pendingDeletes.empty() && firstPendingDelete <= limit) {
+            deletes = takePendingDeletes();
+        }
+        if (now >= lastExtension.plusSeconds(1.0)) {
+            lastExtension = now;
+            mustExtend = !inFlightMessages.empty();
+        }
+
+        /* Wake up again only for what is still pending. */
+        Date next = Date::positiveInfinity();
+        if (!pendingSends.empty()) {
+            next = std::min(next,
+                            firstPendingSend.plusSeconds(config.maxBatchDelay));
+        }
+        if (!pendingDeletes.empty()) {
+            next = std::min(next,
+                            firstPendingDelete.plusSeconds(config.maxBatchDelay));
+        }
+        if (!inFlightMessages.empty()) {
+            next = std::min(next, lastExtension.plusSeconds(1.0));
+        }
+        if (receiving && receiveFailures > 0 && now < receiveRetryAt) {
+            next = std::min(next, receiveRetryAt);
+        }
+        if (next != Date::positiveInfinity()) {
+            scheduleTick(next);
+        }
+    }
+
+    if (!sends.empty()) {
+        sendBatch(std::move(sends));
+    }
+    if (!deletes.empty()) {
+        deleteBatch(std::move(deletes));
+    }
+
+    checkReceivers();
+
+    if (mustExtend) {
+        extendVisibility();
+    }
+}
+
+} // namespace Datacratic
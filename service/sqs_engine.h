@@ -0,0 +1,317 @@
+/* sqs_engine.h                                                    -*- C++ -*-
+   Copyright (c) 2014 Datacratic.  All rights reserved.
+
+   Asynchronous, batching client for a single SQS queue.
+*/
+
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "soa/service/message_loop.h"
+#include "soa/service/http_client.h"
+#include "sqs.h"
+
+
+namespace Datacratic {
+
+
+/*****************************************************************************/
+/* SQS ENGINE                                                                */
+/*****************************************************************************/
+
+/** Asynchronous producer and consumer for a single SQS queue, running over
+    an HttpClient in its own message loop.
+
+    - Messages passed to send() and receipt handles passed to
+      deleteMessage() are accumulated and sent in batches of up to 10
+      entries, a batch going out as soon as it is full or after
+      Config::maxBatchDelay.
+
+    - Once startReceiving() is called, Config::numReceivers long-polling
+      ReceiveMessage requests are kept in flight, which fill a prefetch
+      buffer that is emptied by pop().  No new receive is issued unless the
+      buffer has room for the messages it could return, which gives
+      backpressure when the consumer is slow.
+
+    - Received messages are in flight until they are deleted or released.
+      Their visibility timeout is extended in batches before it expires, so
+      that they don't get delivered twice because they took long to
+      process.
+
+    - Requests that fail with a network or server error are retried after
+      an exponentially growing delay, and receivers that failed are only
+      restarted after such a delay too.
+
+    The engine has no timer running while it has nothing to do: it wakes
+    up for a partial batch, for the visibility of the in flight messages or
+    to restart receivers.
+
+    All the methods are thread safe.  The callbacks are called from the
+    engine's message loop thread.
+*/
+
+struct SqsEngine : public MessageLoop {
+
+    struct Config {
+        Config();
+
+        /** Number of concurrent ReceiveMessage requests. */
+        int numReceivers;
+
+        /** Long polling time of ReceiveMessage requests. */
+        int waitTimeSeconds;
+
+        /** Maximum number of received messages waiting for pop(). */
+        int prefetchSize;
+
+        /** Visibility timeout given to received messages, and to which
+            their visibility is extended while they are in flight.
+        */
+        int visibilityTimeout;
+
+        /** Extend the visibility of an in flight message once less than
+            this number of seconds is left before it expires.
+        */
+        double extendMargin;
+
+        /** Maximum time that a message or deletion waits for its batch to
+            fill up before being sent anyway.
+        */
+        double maxBatchDelay;
+
+        /** Maximum number of messages waiting to be sent or being sent,
+            after which send() refuses new ones.
+        */
+        int maxPendingSends;
+
+        /** Number of times that a request is attempted before its failure
+            is reported.
+        */
+        int numAttempts;
+
+        /** Delay before the first retry of a failed request, which doubles
+            with each further failure up to maxRetryDelay.
+        */
+        double retryDelay;
+        double maxRetryDelay;
+
+        /** Number of parallel connections of the http client. */
+        int numConnections;
+    };
+
+    /** Create an engine for the queue with the given URI, eg
+        "https://sqs.us-east-1.amazonaws.com/123456789012/queue".  The
+        region needs to be the one of the queue since it is part of the
+        signature.
+    */
+    SqsEngine(const std::string & queueUri,
+              const std::string & accessKeyId,
+              const std::string & accessKey,
+              const std::string & region = "us-east-1",
+              const Config & config = Config());
+
+    ~SqsEngine();
+
+    /** Start the message loop that handles the requests. */
+    void start();
+
+    /** Stop receiving, send everything that is pending and stop the
+        message loop.
+    */
+    void shutdown();
+
+    /** Called once a message has been sent, with the id given to it by SQS
+        or with an error message.
+    */
+    typedef std::function<void (const std::string & messageId,
+                                const std::string & error)> OnSent;
+
+    /** Called once a message has been deleted or with an error message. */
+    typedef std::function<void (const std::string & error)> OnDeleted;
+
+    /** Queue a message for sending.  Returns false, without calling
+        onSent, if Config::maxPendingSends messages are already waiting.
+        Throws if the body is over the 256KB that SQS accepts.
+    */
+    bool send(std::string body,
+              const OnSent & onSent = nullptr,
+              int delaySeconds = -1);
+
+    /** Queue the deletion of the message with the given receipt handle,
+        which also stops extending its visibility.
+    */
+    void deleteMessage(const std::string & receiptHandle,
+                       const OnDeleted & onDeleted = nullptr);
+
+    /** Stop extending the visibility of the given message, which makes it
+        available to other consumers once its visibility timeout expires.
+    */
+    void release(const std::string & receiptHandle);
+
+    /** Send the pending batches right away. */
+    void flush();
+
+    /** Flush and wait for all pending sends and deletes to be done, and
+        their callbacks to have been called.  Returns false if they weren't
+        all done within the given time.
+    */
+    bool drain(double timeoutSeconds = 10.0);
+
+    /** Start and stop the receivers.  Requests that are in flight when
+        stopReceiving() is called still add their messages to the prefetch
+        buffer.
+    */
+    void startReceiving();
+    void stopReceiving();
+
+    /** Return the next received message, waiting for up to the given
+        number of seconds for one to come.  Returns a null message if
+        there was none.
+    */
+    SqsApi::Message pop(double timeoutSeconds = 0.0);
+
+    /** Number of received messages waiting for pop(). */
+    size_t prefetched() const;
+
+    /** Number of received messages that aren't deleted or released yet,
+        including those waiting for pop().
+    */
+    size_t inFlight() const;
+
+    struct Stats {
+        Stats()
+            : messagesSent(0), sendRequests(0), sendErrors(0),
+              messagesReceived(0), receiveRequests(0), receiveErrors(0),
+              messagesDeleted(0), deleteRequests(0), deleteErrors(0),
+              visibilityExtensions(0), visibilityRequests(0)
+        {
+        }
+
+        uint64_t messagesSent;
+        uint64_t sendRequests;
+        uint64_t sendErrors;
+        uint64_t messagesReceived;
+        uint64_t receiveRequests;
+        uint64_t receiveErrors;
+        uint64_t messagesDeleted;
+        uint64_t deleteRequests;
+        uint64_t deleteErrors;
+        uint64_t visibilityExtensions;
+        uint64_t visibilityRequests;
+    };
+
+    Stats getStats() const;
+
+    const Config config;
+
+private:
+    typedef std::function<void (const std::string & error,
+                                std::string && body)> OnResponse;
+
+    struct SendEntry {
+        std::string body;
+        int delaySeconds;
+        OnSent onSent;
+    };
+
+    struct DeleteEntry {
+        std::string receiptHandle;
+        OnDeleted onDeleted;
+    };
+
+    /** Sign and perform an Action API request, retrying it up to
+        Config::numAttempts times on network or server errors.
+    */
+    void perform(const RestParams & params, int timeoutSeconds,
+                 const OnResponse & onResponse);
+    void perform(const std::shared_ptr<std::string> & payload,
+                 int timeoutSeconds, const OnResponse & onResponse,
+                 int attempt);
+
+    /** Take the pending batches out, to be sent.  Called with the lock
+        held.
+    */
+    std::vector<SendEntry> takePendingSends();
+    std::vector<DeleteEntry> takePendingDeletes();
+
+    /** Send batches that were taken out of the pending ones. */
+    void sendBatch(std::vector<SendEntry> && batch);
+    void deleteBatch(std::vector<DeleteEntry> && batch);
+
+    /** Issue as many receive requests as there is room for. */
+    void checkReceivers();
+    void receive(int maxMessages);
+
+    /** Extend the visibility of the in flight messages that need it. */
+    void extendVisibility();
+
+    /** Delay before retrying after the given number of failures in a
+        row.
+    */
+    double retryDelay(int numFailures) const;
+
+    /** Make sure that onTick() is called at the given date at the latest.
+        Called with the lock held.
+    */
+    void scheduleTick(Date when);
+
+    /** Send the batches that waited long enough, extend the visibility of
+        the messages that need it and restart the receivers, then schedule
+        the next tick if there is still something to wait for.  Called by
+        the timer that was scheduled for the given date.
+    */
+    void onTick(Date scheduledAt);
+
+    std::string host;
+    std::string resource;
+
+    AwsSignerV4 signer;
+    std::shared_ptr<HttpClient> client;
+
+    mutable std::mutex lock;
+    std::condition_variable prefetchCond;
+    std::condition_variable idleCond;
+
+    std::vector<SendEntry> pendingSends;
+    size_t pendingSendBytes;
+    Date firstPendingSend;
+    int sendsInProgress;
+
+    std::vector<DeleteEntry> pendingDeletes;
+    Date firstPendingDelete;
+    int deletesInProgress;
+
+    bool receiving;
+    int receivesInProgress;
+
+    /** Receives that failed in a row, and when to restart them. */
+    int receiveFailures;
+    Date receiveRetryAt;
+
+    /** Room reserved in the prefetch buffer by the receives in progress. */
+    int receiveSlots;
+    std::deque<SqsApi::Message> prefetchBuffer;
+
+    /** Time at which each in flight message will become visible again,
+        by receipt handle.
+    */
+    std::map<std::string, Date> inFlightMessages;
+    Date lastExtension;
+
+    /** Timer of the next tick, if there is one. */
+    TimerService::TimerId tickTimer;
+    Date nextTick;
+
+    bool running;
+    Stats stats;
+};
+
+} // namespace Datacratic
@@ -8,6 +8,12 @@
 #include "ace/INET_Addr.h"
 #include "jml/arch/exception.h"
 #include "jml/arch/format.h"
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#include <functional>
 #include <iostream>
 
 
@@ -16,18 +22,60 @@ using namespace ML;
 
 namespace Datacratic {
 
+namespace {
+
+/* State of the xorshift64* generator of the calling thread, which is used
+   for the sampling instead of random() as the latter takes a global lock.
+*/
+__thread uint64_t rngState = 0;
+
+/* Uniform random number in [0, 1) */
+double sampleRandom()
+{
+    uint64_t x = rngState;
+    if (!x) {
+        timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        x = ((uint64_t)syscall(SYS_gettid) << 32)
+            ^ (now.tv_sec * 1000000000ULL + now.tv_nsec) ^ 1;
+    }
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    rngState = x;
+
+    return ((x * 2685821657736338717ULL) >> 11) * (1.0 / (1ULL << 53));
+}
+
+bool sampled(float sampleRate)
+{
+    return sampleRate >= 1.0 || sampleRandom() < sampleRate;
+}
+
+/* Maximum number of datagrams sent in one sendmmsg() call */
+enum { SEND_BATCH = 64 };
+
+} // file scope
+
 
 /*****************************************************************************/
 /* STATSD CONNECTOR                                                          */
 /*****************************************************************************/
 
 StatsdConnector::
-StatsdConnector()
+StatsdConnector(double flushInterval, size_t maxPacketSize)
+    : flushInterval(flushInterval), maxPacketSize(maxPacketSize),
+      numMetrics(0), numPackets(0), numSendCalls(0), numSendErrors(0),
+      numDropped(0), doShutdown(false), isOpen(false)
 {
 }
 
 StatsdConnector::
-StatsdConnector(const string& statsdAddr)
+StatsdConnector(const string& statsdAddr,
+                double flushInterval, size_t maxPacketSize)
+    : flushInterval(flushInterval), maxPacketSize(maxPacketSize),
+      numMetrics(0), numPackets(0), numSendCalls(0), numSendErrors(0),
+      numDropped(0), doShutdown(false), isOpen(false)
 {
     open(statsdAddr);
 }
@@ -35,6 +83,7 @@ StatsdConnector(const string& statsdAddr)
 StatsdConnector::
 ~StatsdConnector()
 {
+    shutdown();
     sckt.close();
 }
 
@@ -42,55 +91,239 @@ void
 StatsdConnector::
 open(const string& statsdAddr)
 {
+    // What was recorded so far goes to the previous address
+    shutdown();
+
     sckt.close();
     addr = ACE_INET_Addr(statsdAddr.c_str());
 
-    if(sckt.open(addr) == -1)
+    if(sckt.open(ACE_Addr::sap_any, addr.get_type()) == -1)
         throw Exception("could not create statsd udp socket");
+
+    doShutdown = false;
+    flushThread.reset
+        (new std::thread(std::bind(&StatsdConnector::runFlushThread, this)));
+    isOpen = true;
 }
-    
+
 void
 StatsdConnector::
-incrementCounter(const char* counterName, float sampleRate, int value)
+shutdown()
 {
-    if (sampleRate < 1.0 && ((random() % 10000) / 10000.0) >= sampleRate)
+    if (!flushThread)
         return;
 
-    char msgBuf[1024];
-    int res = snprintf(msgBuf, 1024, "%s:%d|c|@%.2f", counterName, value,
-                       sampleRate);
-    if (res >= 1024) {
-        cerr << "invalid statsd counter name: " << counterName << endl;
-        return;
+    isOpen = false;
+
+    {
+        std::unique_lock<std::mutex> guard(m);
+        doShutdown = true;
     }
-    
-    int sendRes = sckt.send(msgBuf, res, addr, MSG_DONTWAIT);
-    if (sendRes == -1) {
-        cerr << "statsd message failure: " << strerror(errno)
-             << endl;
+    cond.notify_all();
+
+    flushThread->join();
+    flushThread.reset();
+}
+
+StatsdConnector::ThreadTable &
+StatsdConnector::
+threadTable()
+{
+    ThreadTablePtr * table = threadTable_.get();
+    if (!table) {
+        table = new ThreadTablePtr(std::make_shared<ThreadTable>());
+        threadTable_.reset(table);
+
+        std::unique_lock<std::mutex> guard(tablesLock);
+        tables.push_back(*table);
     }
+    return **table;
+}
+
+void
+StatsdConnector::
+incrementCounter(const char* counterName, float sampleRate, int value)
+{
+    if (!isOpen.load(std::memory_order_relaxed)) {
+        numDropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    if (!sampled(sampleRate))
+        return;
+
+    ThreadTable & table = threadTable();
+    std::lock_guard<ML::Spinlock> guard(table.lock);
+
+    table.scratch.name.assign(counterName);
+    table.scratch.sampleRate = sampleRate;
+
+    auto it = table.counters.find(table.scratch);
+    if (it == table.counters.end())
+        table.counters.insert(make_pair(table.scratch, value));
+    else it->second += value;
 }
 
 void
 StatsdConnector::
 recordGauge(const char* counterName, float sampleRate, float value)
 {
-    if (sampleRate < 1.0 && ((random() % 10000) / 10000.0) >= sampleRate)
+    if (!isOpen.load(std::memory_order_relaxed)) {
+        numDropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    if (!sampled(sampleRate))
         return;
 
-    char msgBuf[1024];
-    int res = snprintf(msgBuf, 1024, "%s:%f|ms", counterName, value);
+    ThreadTable & table = threadTable();
+    std::lock_guard<ML::Spinlock> guard(table.lock);
 
-    if (res >= 1024) {
-        cerr << "invalid statsd counter name: " << counterName << endl;
+    table.scratch.name.assign(counterName);
+
+    auto it = table.timings.find(table.scratch.name);
+    if (it == table.timings.end())
+        it = table.timings.insert(make_pair(table.scratch.name,
+                                            vector<float>())).first;
+    it->second.push_back(value);
+}
+
+void
+StatsdConnector::
+flush()
+{
+    std::unique_lock<std::mutex> flushGuard(flushLock);
+
+    Counters counters;
+    Timings timings;
+
+    {
+        std::unique_lock<std::mutex> guard(tablesLock);
+
+        for (auto it = tables.begin();  it != tables.end();  /* no inc */) {
+            ThreadTable & table = **it;
+
+            Counters threadCounters;
+            Timings threadTimings;
+            {
+                std::lock_guard<ML::Spinlock> tableGuard(table.lock);
+                threadCounters.swap(table.counters);
+                threadTimings.swap(table.timings);
+            }
+
+            for (auto & c: threadCounters)
+                counters[c.first] += c.second;
+            for (auto & t: threadTimings) {
+                vector<float> & values = timings[t.first];
+                values.insert(values.end(),
+                              t.second.begin(), t.second.end());
+            }
+
+            // Only we hold the table once its thread has exited
+            if (it->use_count() == 1)
+                it = tables.erase(it);
+            else ++it;
+        }
+    }
+
+    if (!counters.empty() || !timings.empty())
+        send(counters, timings);
+}
+
+void
+StatsdConnector::
+send(const Counters & counters, const Timings & timings)
+{
+    if (sckt.get_handle() == ACE_INVALID_HANDLE)
         return;
+
+    // Pack the metrics, one per line, in as few datagrams as possible
+    vector<string> packets;
+    string packet;
+    uint64_t metrics = 0;
+
+    auto addLine = [&] (const string & line)
+        {
+            if (line.size() > maxPacketSize) {
+                cerr << "statsd metric too long: " << line << endl;
+                return;
+            }
+            if (!packet.empty()
+                && packet.size() + 1 + line.size() > maxPacketSize) {
+                packets.push_back(std::move(packet));
+                packet.clear();
+            }
+            if (!packet.empty())
+                packet += '\n';
+            packet += line;
+            ++metrics;
+        };
+
+    for (auto & c: counters)
+        addLine(ML::format("%s:%lld|c|@%.2f", c.first.name.c_str(),
+                           (long long)c.second, c.first.sampleRate));
+
+    for (auto & t: timings)
+        for (float value: t.second)
+            addLine(ML::format("%s:%f|ms", t.first.c_str(), value));
+
+    if (!packet.empty())
+        packets.push_back(std::move(packet));
+
+    for (size_t start = 0;  start < packets.size();  /* no inc */) {
+        size_t n = std::min<size_t>(packets.size() - start, SEND_BATCH);
+
+        mmsghdr msgs[SEND_BATCH];
+        iovec iovs[SEND_BATCH];
+        for (size_t i = 0;  i < n;  ++i) {
+            const string & p = packets[start + i];
+            iovs[i].iov_base = (void *)p.c_str();
+            iovs[i].iov_len = p.size();
+
+            msghdr & hdr = msgs[i].msg_hdr;
+            memset(&hdr, 0, sizeof(hdr));
+            hdr.msg_name = addr.get_addr();
+            hdr.msg_namelen = addr.get_size();
+            hdr.msg_iov = &iovs[i];
+            hdr.msg_iovlen = 1;
+            msgs[i].msg_len = 0;
+        }
+
+        int res = sendmmsg(sckt.get_handle(), msgs, n, 0);
+        numSendCalls += 1;
+
+        if (res == -1) {
+            if (errno == EINTR)
+                continue;
+            cerr << "statsd message failure: " << strerror(errno)
+                 << endl;
+            numSendErrors += 1;
+            break;
+        }
+
+        numPackets += res;
+        start += res;
     }
-    
-    int sendRes = sckt.send(msgBuf, res, addr, MSG_DONTWAIT);
-    if (sendRes == -1) {
-        cerr << "statsd message failure: " << strerror(errno)
-             << endl;
+
+    numMetrics += metrics;
+}
+
+void
+StatsdConnector::
+runFlushThread()
+{
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> guard(m);
+            auto interval = std::chrono::microseconds
+                ((int64_t)(flushInterval * 1000000));
+            if (cond.wait_for(guard, interval, [&] { return doShutdown; }))
+                break;
+        }
+
+        flush();
     }
+
+    // Send what was recorded before the shutdown
+    flush();
 }
 
 } // namespace Datacratic
@@ -4,8 +4,18 @@
 
 #pragma once
 
+#include <boost/thread/tss.hpp>
+
 #include "ace/SOCK_Dgram.h"
+#include "jml/arch/spinlock.h"
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
 namespace Datacratic {
 
@@ -15,6 +25,16 @@ namespace Datacratic {
 /*****************************************************************************/
 
 /** Class that sends UDP packets to statsd for monitoring purposes.
+
+    The metrics are not sent as they are recorded: each thread aggregates
+    them in its own table, and a background thread collects the tables
+    every flushInterval seconds and sends them packed in as few datagrams
+    of at most maxPacketSize bytes as possible, with one sendmmsg() call
+    for up to 64 datagrams.  Counters are summed per name and sample rate;
+    timings are all kept and sent one per line.
+
+    Nothing flushes the tables before open() or after shutdown(), so the
+    metrics recorded then are dropped rather than kept without bound.
 */
 
 class StatsdConnector {
@@ -22,14 +42,101 @@ class StatsdConnector {
     ACE_INET_Addr addr;
 
 public:
-    StatsdConnector();
-    StatsdConnector(const std::string & statsdAddr);
+    StatsdConnector(double flushInterval = 1.0,
+                    size_t maxPacketSize = 1432);
+    StatsdConnector(const std::string & statsdAddr,
+                    double flushInterval = 1.0,
+                    size_t maxPacketSize = 1432);
     ~StatsdConnector();
 
     void open(const std::string & statsdAddr);
 
     void incrementCounter(const char* counterName, float sampleRate, int value=1 );
     void recordGauge(const char* counterName, float sampleRate, float gauge );
+
+    /** Send what has been recorded so far, synchronously. */
+    void flush();
+
+    /** Stop the flushing thread after a last flush. */
+    void shutdown();
+
+    /** Seconds between two flushes.  A change is taken into account after
+        the next flush.
+    */
+    double flushInterval;
+
+    /** Largest payload of a datagram.  The default fits in an ethernet
+        frame; 512 is safer when the path to statsd goes over the internet.
+    */
+    size_t maxPacketSize;
+
+    /** Counts of what was sent */
+    std::atomic<uint64_t> numMetrics;     ///< Lines sent
+    std::atomic<uint64_t> numPackets;     ///< Datagrams sent
+    std::atomic<uint64_t> numSendCalls;   ///< sendmmsg() calls
+    std::atomic<uint64_t> numSendErrors;  ///< Failed sendmmsg() calls
+    std::atomic<uint64_t> numDropped;     ///< Recorded while not open
+
+private:
+    struct CounterKey {
+        std::string name;
+        float sampleRate;
+
+        bool operator == (const CounterKey & other) const
+        {
+            return sampleRate == other.sampleRate && name == other.name;
+        }
+    };
+
+    struct CounterKeyHash {
+        size_t operator () (const CounterKey & key) const
+        {
+            return std::hash<std::string>()(key.name)
+                ^ std::hash<float>()(key.sampleRate);
+        }
+    };
+
+    typedef std::unordered_map<CounterKey, int64_t, CounterKeyHash> Counters;
+    typedef std::unordered_map<std::string, std::vector<float> > Timings;
+
+    /** Metrics recorded by one thread since the last flush.  The lock is
+        only contended when the flushing thread takes the metrics.
+    */
+    struct ThreadTable {
+        ML::Spinlock lock;
+        Counters counters;
+        Timings timings;
+        CounterKey scratch;   ///< Avoids an allocation per lookup
+    };
+
+    typedef std::shared_ptr<ThreadTable> ThreadTablePtr;
+
+    /** Table of the calling thread, registered the first time it records
+        something.
+    */
+    ThreadTable & threadTable();
+
+    // Each thread's table, shared with the list of tables so that what a
+    // thread recorded is still sent after it exits.
+    boost::thread_specific_ptr<ThreadTablePtr> threadTable_;
+
+    std::mutex tablesLock;
+    std::vector<ThreadTablePtr> tables;
+
+    /** Thread that flushes every flushInterval. */
+    void runFlushThread();
+
+    /** Format the metrics into datagrams and send them. */
+    void send(const Counters & counters, const Timings & timings);
+
+    std::mutex flushLock;   ///< Serializes the flushes
+    std::unique_ptr<std::thread> flushThread;
+    std::condition_variable cond;
+    std::mutex m;
+    bool doShutdown;
+
+    /** Set while the flushing thread runs. */
+    std::atomic<bool> isOpen;
 };
 
 
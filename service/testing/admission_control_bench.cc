@@ -0,0 +1,246 @@
+/* admission_control_bench.cc
+   Copyright (c) 2014 Datacratic.  All rights reserved.
+
+   Simulation of a queue served by a single consumer under a step in the
+   offered load, comparing the latency and the shedding obtained without
+   shedding, with the duty cycle based policy of LoadStabilizer and with
+   AdmissionControl.
+*/
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <deque>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "soa/service/admission_control.h"
+
+using namespace std;
+using namespace Datacratic;
+
+
+namespace {
+
+enum Policy {
+    NO_SHEDDING,
+    LOAD_STABILIZER,
+    ADMISSION_CONTROL,        // shedding when dequeuing only
+    ADMISSION_CONTROL_EARLY   // also rejecting messages before queueing
+};
+
+const char * policyNames[] = {
+    "none", "loadStabilizer", "admissionControl", "admissionControlEarly"
+};
+
+const double serviceTime = 0.00001;   // 100k messages per second
+const double dropTime = 0.0000002;    // cost of dropping a dequeued message
+const int numClasses = 3;
+
+/* offered load, relative to capacity, for each phase of the simulation */
+struct Phase {
+    double start;
+    double load;
+};
+const vector<Phase> phases = {
+    { 0.0, 0.5 }, { 1.0, 1.5 }, { 3.0, 0.5 }, { 5.0, 0.0 }
+};
+
+size_t phaseOf(double time)
+{
+    size_t phase = 0;
+    while (phase + 1 < phases.size() && phases[phase + 1].start <= time) {
+        phase++;
+    }
+    return phase;
+}
+
+struct PhaseStats {
+    PhaseStats()
+        : numOffered(numClasses), numShed(numClasses),
+          firstShed(-1), lastShed(-1)
+    {
+    }
+
+    vector<double> latencies;
+    vector<uint64_t> numOffered;
+    vector<uint64_t> numShed;
+    double firstShed;
+    double lastShed;
+
+    void shed(double now, int priority)
+    {
+        numShed[priority]++;
+        if (firstShed < 0) {
+            firstShed = now;
+        }
+        lastShed = now;
+    }
+};
+
+struct Message {
+    double arrival;
+    int priority;
+};
+
+void simulate(Policy policy)
+{
+    mt19937 rng(42);
+    exponential_distribution<double> serviceDist(1.0 / serviceTime);
+    uniform_int_distribution<int> classDist(0, numClasses - 1);
+    uniform_real_distribution<double> uniform(0.0, 1.0);
+
+    vector<PhaseStats> stats(phases.size() - 1);
+
+    AdmissionControl::Config config;
+    config.target = 0.0005;
+    config.interval = 0.005;
+    config.numClasses = numClasses;
+    AdmissionControl admission(config);
+
+    /* state of the LoadStabilizer policy, updated every second from the
+       duty cycle of the consumer */
+    const double updatePeriod = 1.0;
+    double nextUpdate = updatePeriod;
+    double busyTime = 0.0;
+    double shedProb = 0.0;
+
+    auto nextArrival = [&] (double now) {
+        for (;;) {
+            size_t phase = phaseOf(now);
+            double load = phases[phase].load;
+            if (load == 0.0) {
+                return phases.back().start;
+            }
+            exponential_distribution<double> dist(load / serviceTime);
+            double next = now + dist(rng);
+            if (phase + 1 < phases.size() && next >= phases[phase + 1].start) {
+                now = phases[phase + 1].start;
+                continue;
+            }
+            return next;
+        }
+    };
+
+    deque<Message> queue;
+    double arrival = nextArrival(0.0);
+    double serverFree = 0.0;
+    double end = phases.back().start;
+
+    for (;;) {
+        if (!queue.empty() && serverFree <= arrival) {
+            double now = serverFree;
+            Message msg = queue.front();
+            queue.pop_front();
+
+            PhaseStats & phase = stats[phaseOf(msg.arrival)];
+            if (policy >= ADMISSION_CONTROL
+                && admission.onDequeue(msg.arrival, msg.priority, now)) {
+                phase.shed(now, msg.priority);
+                serverFree = now + dropTime;
+                continue;
+            }
+
+            double service = serviceDist(rng);
+            serverFree = now + service;
+            busyTime += service;
+            phase.latencies.push_back(serverFree - msg.arrival);
+            continue;
+        }
+
+        if (arrival >= end) {
+            if (queue.empty()) {
+                break;
+            }
+            /* drain what is left */
+            arrival = INFINITY;
+            continue;
+        }
+
+        double now = arrival;
+        arrival = nextArrival(now);
+
+        Message msg { now, classDist(rng) };
+        PhaseStats & phase = stats[phaseOf(now)];
+        phase.numOffered[msg.priority]++;
+
+        while (now >= nextUpdate) {
+            double load = std::min(1.0, busyTime / updatePeriod);
+            if (load < 0.9) {
+                shedProb = std::max(0.01, shedProb - 0.01);
+            }
+            else {
+                shedProb = std::min(1.0, shedProb + 0.05);
+            }
+            busyTime = 0.0;
+            nextUpdate += updatePeriod;
+        }
+
+        bool shed = false;
+        if (policy == LOAD_STABILIZER) {
+            shed = shedProb > 0.01 && uniform(rng) < shedProb;
+        }
+        else if (policy == ADMISSION_CONTROL_EARLY) {
+            shed = admission.shedMessage(msg.priority, now);
+        }
+
+        if (shed) {
+            phase.shed(now, msg.priority);
+            continue;
+        }
+
+        if (queue.empty() && serverFree < now) {
+            serverFree = now;
+        }
+        queue.push_back(msg);
+    }
+
+    for (size_t i = 0;  i < stats.size();  ++i) {
+        PhaseStats & phase = stats[i];
+
+        double p99 = 0.0, maxLatency = 0.0;
+        if (!phase.latencies.empty()) {
+            auto & l = phase.latencies;
+            size_t rank = l.size() * 99 / 100;
+            std::nth_element(l.begin(), l.begin() + rank, l.end());
+            p99 = l[rank];
+            maxLatency = *std::max_element(l.begin(), l.end());
+        }
+
+        ::printf("%s,%.1f-%.1f,%.1f,%zd,%.3f,%.3f",
+                 policyNames[policy], phases[i].start, phases[i + 1].start,
+                 phases[i].load, phase.latencies.size(),
+                 p99 * 1000, maxLatency * 1000);
+        for (int c = 0;  c < numClasses;  ++c) {
+            ::printf(",%.1f", (phase.numOffered[c]
+                               ? 100.0 * phase.numShed[c] / phase.numOffered[c]
+                               : 0.0));
+        }
+        ::printf(",%.1f,%.1f\n",
+                 phase.firstShed < 0 ? -1 : (phase.firstShed - phases[i].start)
+                 * 1000,
+                 phase.lastShed < 0 ? -1 : (phase.lastShed - phases[i].start)
+                 * 1000);
+    }
+}
+
+} // file scope
+
+
+int main(int argc, char ** argv)
+{
+    ::printf("policy,phase,load,processed,p99 ms,max ms");
+    for (int c = 0;  c < numClasses;  ++c) {
+        ::printf(",shed%% class %d", c);
+    }
+    ::printf(",first shed ms,last shed ms\n");
+
+    simulate(NO_SHEDDING);
+    simulate(LOAD_STABILIZER);
+    simulate(ADMISSION_CONTROL);
+    simulate(ADMISSION_CONTROL_EARLY);
+
+    return 0;
+}
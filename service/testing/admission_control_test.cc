@@ -0,0 +1,96 @@
+/* admission_control_test.cc
+   Copyright (c) 2014 Datacratic.  All rights reserved.
+
+   Tests of the queue latency based admission control.
+*/
+
+#define BOOST_TEST_MAIN
+#define BOOST_TEST_DYN_LINK
+
+#include <boost/test/unit_test.hpp>
+
+#include "jml/arch/exception.h"
+#include "soa/service/admission_control.h"
+
+using namespace std;
+using namespace Datacratic;
+
+
+BOOST_AUTO_TEST_CASE( test_admission_control_standing_queue )
+{
+    AdmissionControl::Config config;
+    config.target = 0.001;
+    config.interval = 0.010;
+    AdmissionControl admission(config);
+
+    /* a burst waiting up to the interval goes through */
+    double now = 100.0;
+    BOOST_CHECK(!admission.onDequeue(now - 0.0001, 0, now));
+    for (int i = 0;  i < 9;  ++i) {
+        now += 0.001;
+        BOOST_CHECK(!admission.onDequeue(now - 0.005, 0, now));
+    }
+    BOOST_CHECK(admission.onDequeue(now - 0.011, 0, now));
+    BOOST_CHECK(!admission.shedMessage(0, now));
+
+    /* standing above the target for a whole interval */
+    now += 0.002;
+    BOOST_CHECK(admission.onDequeue(now - 0.002, 0, now));
+    BOOST_CHECK(!admission.onDequeue(now - 0.0005, 0, now));
+    BOOST_CHECK_CLOSE(admission.lastSojourn(), 0.0005, 0.001);
+
+    /* a single message below the target ends it */
+    now += 0.0002;
+    BOOST_CHECK(!admission.onDequeue(now - 0.002, 0, now));
+    BOOST_CHECK_EQUAL(admission.numShed(0), 2U);
+
+    BOOST_CHECK_THROW(admission.onDequeue(now, 1, now), ML::Exception);
+}
+
+BOOST_AUTO_TEST_CASE( test_admission_control_classes )
+{
+    AdmissionControl::Config config;
+    config.target = 0.001;
+    config.interval = 0.010;
+    config.numClasses = 3;
+    config.classTargetFactor = 4.0;
+    AdmissionControl admission(config);
+
+    /* stand between the targets of the classes 0 and 1 */
+    double now = 100.0;
+    for (int i = 0;  i <= 20;  ++i, now += 0.001) {
+        admission.onDequeue(now - 0.002, 2, now);
+    }
+
+    BOOST_CHECK(admission.onDequeue(now - 0.002, 0, now));
+    BOOST_CHECK(!admission.onDequeue(now - 0.002, 1, now));
+    BOOST_CHECK(!admission.onDequeue(now - 0.002, 2, now));
+
+    /* the producers reject part of class 0 only */
+    int numRejected[3] = { 0, 0, 0 };
+    for (int i = 0;  i < 1000;  ++i) {
+        admission.onDequeue(now - 0.002, 0, now);
+        for (int c = 0;  c < 3;  ++c) {
+            numRejected[c] += admission.shedMessage(c, now);
+        }
+    }
+    BOOST_CHECK_GT(numRejected[0], 850);
+    BOOST_CHECK_EQUAL(numRejected[1], 0);
+    BOOST_CHECK_EQUAL(numRejected[2], 0);
+
+    /* nothing is rejected once the queue has been idle for an interval */
+    BOOST_CHECK(!admission.shedMessage(0, now + 0.011));
+}
+
+BOOST_AUTO_TEST_CASE( test_timestamped )
+{
+    AdmissionControl admission;
+
+    double before = AdmissionControl::now();
+    Timestamped<string> msg("hello", 0);
+    BOOST_CHECK_EQUAL(msg.message, "hello");
+    BOOST_CHECK_GE(msg.enqueued, before);
+    BOOST_CHECK_LE(msg.enqueued, AdmissionControl::now());
+
+    BOOST_CHECK(!admission.onDequeue(msg.enqueued, msg.priority));
+}
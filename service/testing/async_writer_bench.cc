@@ -1,4 +1,9 @@
-/* async_writer_bench */
+/* async_writer_bench
+
+   Message and byte rates of an AsyncWriterSource writing to a pipe, a unix
+   socket and a TCP socket. The benchmark options are taken from the
+   environment (see soa/utils/benchmarks.h).
+*/
 
 #include <fcntl.h>
 #include <unistd.h>
@@ -14,6 +19,7 @@
 #include "jml/utils/file_functions.h"
 #include "soa/service/message_loop.h"
 #include "soa/service/async_writer_source.h"
+#include "soa/utils/benchmarks.h"
 #include "soa/utils/print_utils.h"
 
 using namespace std;
@@ -116,10 +122,12 @@ pair<int, int> makeTcpSocketPair()
     return {writer, reader};
 }
 
-void doBench(const string & label,
+void doBench(BenchmarkState & state,
              int writerFd, int readerFd,
              int numMessages, size_t msgSize)
 {
+    state.pause();
+
     string message = randomString(msgSize);
     MessageLoop writerLoop, readerLoop;
 
@@ -146,14 +154,10 @@ void doBench(const string & label,
 
     /* reader setup */
     readerLoop.start();
-    Date lastRead;
     size_t totalBytes = msgSize * numMessages;
     size_t bytesRead(0);
     auto onReaderData = [&] (const char * data, size_t size) {
         bytesRead += size;
-        if (bytesRead == totalBytes) {
-            lastRead = Date::now();
-        }
     };
     auto reader = make_shared<ReaderSource>(readerFd, onReaderData, 262144);
     readerLoop.addSource("reader", reader);
@@ -161,6 +165,7 @@ void doBench(const string & label,
     writer->waitConnectionState(AsyncEventSource::CONNECTED);
     reader->waitConnectionState(AsyncEventSource::CONNECTED);
 
+    state.resume();
     Date start = Date::now();
     ML::memory_barrier();
     for (numWritten = 0 ; numWritten < numMessages;) {
@@ -180,44 +185,44 @@ void doBench(const string & label,
     }
 
     while (bytesRead < totalBytes) {
-        ML::sleep(1.0);
+        ML::sleep(0.001);
     }
+    state.pause();
 
-    double totalTime = lastRead - start;
-    ::printf("%s,%d,%lu,%lu,%d,%f,%f,%f,%f,%f\n",
-             label.c_str(),
-             numMessages, msgSize, bytesRead, numMissed,
-             (lastWrite - start),
-             (lastWriteResult - start),
-             totalTime,
-             (double(numMessages) / totalTime),
-             (double(totalBytes) / totalTime));
+    state.setItems(numMessages);
+    state.setBytes(totalBytes);
+    state.addMetric("missed", numMissed);
+    state.addMetric("lastWrite", lastWrite - start);
+    state.addMetric("lastWritten", lastWriteResult - start);
 
     readerLoop.shutdown();
     writerLoop.shutdown();
 }
 
-void benchFunction(const string & label,
+void benchFunction(BenchmarkSuite & suite, const string & label,
                    std::function<pair<int, int> ()> f)
 {
     int multiplier(1);
     for (int i = 0; i < 4; i++) {
         multiplier *= 10;
-        auto fds = f();
-        doBench(label, fds.first, fds.second,
-                10000000 / multiplier, 50 * multiplier);
+        int numMessages = 10000000 / multiplier;
+        size_t msgSize = 50 * multiplier;
+        auto run = [&] (BenchmarkState & state) {
+            state.pause();
+            auto fds = f();
+            doBench(state, fds.first, fds.second, numMessages, msgSize);
+        };
+        suite.run(label + " " + to_string(msgSize), run);
     }
 }
 
 int main()
 {
-    ::printf("label,msgs_count,msg_size,bytes_xfer,miss_count,"
-             "delta_last_write,delta_last_written,delta_last_read,"
-             "msg_rate,byte_rate\n");
+    BenchmarkSuite suite("async_writer_bench");
 
-    benchFunction("pipe", makePipePair);
-    benchFunction("unix", makeUnixSocketPair);
-    benchFunction("tcp4", makeTcpSocketPair);
+    benchFunction(suite, "pipe", makePipePair);
+    benchFunction(suite, "unix", makeUnixSocketPair);
+    benchFunction(suite, "tcp4", makeTcpSocketPair);
 
-    return 0;
+    return suite.finish() == 0 ? 0 : 1;
 }
@@ -0,0 +1,80 @@
+/* aws_sign_bench.cc
+   Copyright (c) 2014 Datacratic.  All rights reserved.
+
+   Benchmark of signature version 4 request signing, comparing
+   AwsApi::addSignatureV4() with the caching AwsSignerV4.
+*/
+
+#include <stdio.h>
+#include <string>
+
+#include "soa/service/aws.h"
+#include "soa/types/date.h"
+
+using namespace std;
+using namespace Datacratic;
+
+
+/* A typical SQS SendMessage request. */
+AwsApi::BasicRequest makeRequest()
+{
+    AwsApi::BasicRequest request;
+    request.method = "POST";
+    request.relativeUri = "123456789012/queue";
+    request.headers.push_back({"Host", "sqs.us-east-1.amazonaws.com"});
+    request.headers.push_back({"Content-Type", "application/x-www-form-urlencoded; charset=utf-8"});
+    request.payload = ("Action=SendMessage&Version=2012-11-05&MessageBody="
+                       + string(256, 'x'));
+    return request;
+}
+
+template<typename Fn>
+void bench(const char * name, int numRequests, Fn && sign)
+{
+    AwsApi::BasicRequest request = makeRequest();
+    size_t numHeaders = request.headers.size();
+
+    Date before = Date::now();
+    for (int i = 0;  i < numRequests;  ++i) {
+        request.headers.resize(numHeaders);
+        sign(request);
+    }
+    double elapsed = Date::now().secondsSince(before);
+
+    ::printf("%s,%d,%f,%f\n", name, numRequests, elapsed,
+             numRequests / elapsed);
+}
+
+int main(int argc, char ** argv)
+{
+    int numRequests = 100000;
+    string accessKeyId = "AKIDEXAMPLE";
+    string accessKey = "wJalrXUtnFEMI/K7MDENG+bPxRfiCYEXAMPLEKEY";
+
+    ::printf("mode,requests,seconds,requests/s\n");
+
+    bench("addSignatureV4", numRequests,
+          [&] (AwsApi::BasicRequest & request)
+          {
+              AwsApi::addSignatureV4(request, "sqs", "us-east-1",
+                                     accessKeyId, accessKey);
+          });
+
+    AwsSignerV4 signer(accessKeyId, accessKey, "us-east-1", "sqs");
+    bench("signer", numRequests,
+          [&] (AwsApi::BasicRequest & request)
+          {
+              signer.sign(request);
+          });
+
+    AwsPayloadHash payloadHash;
+    payloadHash.update(makeRequest().payload);
+    string hash = payloadHash.hexDigest();
+    bench("signer-prehashed", numRequests,
+          [&] (AwsApi::BasicRequest & request)
+          {
+              signer.sign(request, hash);
+          });
+
+    return 0;
+}
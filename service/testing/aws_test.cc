@@ -266,3 +266,82 @@ BOOST_AUTO_TEST_CASE( check_canonical_request_v4 )
 
     BOOST_CHECK_EQUAL(auth, "AWS4-HMAC-SHA256 Credential=AKIDEXAMPLE/20110909/us-east-1/iam/aws4_request, SignedHeaders=content-type;host;x-amz-date, Signature=ced6826de92d2bdeed8f846f0bf508e8559e98e4b0199114b84c54174deb456c");
 }
+
+BOOST_AUTO_TEST_CASE( check_signer_v4 )
+{
+    // Same request as above; the signer must give the same result, also
+    // when reusing the cached signing key for a second request
+    AwsSignerV4 signer("AKIDEXAMPLE",
+                       "wJalrXUtnFEMI/K7MDENG+bPxRfiCYEXAMPLEKEY",
+                       "us-east-1", "iam");
+
+    for (unsigned i = 0;  i < 2;  ++i) {
+        AwsApi::BasicRequest request;
+        request.method = "POST";
+        request.relativeUri = "";
+        request.headers.push_back({"host", "iam.amazonaws.com"});
+        request.headers.push_back({"Content-Type", "application/x-www-form-urlencoded; charset=utf-8"});
+        request.payload = "Action=ListUsers&Version=2010-05-08";
+
+        string signature = signer.sign(request, Date(2011,9,9,23,36,00));
+        BOOST_CHECK_EQUAL(signature, "ced6826de92d2bdeed8f846f0bf508e8559e98e4b0199114b84c54174deb456c");
+
+        string auth;
+        for (auto h: request.headers)
+            if (h.first == "Authorization")
+                auth = h.second;
+
+        BOOST_CHECK_EQUAL(auth, "AWS4-HMAC-SHA256 Credential=AKIDEXAMPLE/20110909/us-east-1/iam/aws4_request, SignedHeaders=content-type;host;x-amz-date, Signature=ced6826de92d2bdeed8f846f0bf508e8559e98e4b0199114b84c54174deb456c");
+    }
+}
+
+BOOST_AUTO_TEST_CASE( check_signer_v4_streaming )
+{
+    // Example from
+    // http://docs.aws.amazon.com/AmazonS3/latest/API/sigv4-streaming.html
+
+    AwsSignerV4 signer(accessKeyId, accessKey, "us-east-1", "s3");
+    Date date(2013,5,24,0,0,0);
+
+    AwsApi::BasicRequest request;
+    request.method = "PUT";
+    request.relativeUri = "examplebucket/chunkObject.txt";
+    request.headers.push_back({"Host", "s3.amazonaws.com"});
+    request.headers.push_back({"x-amz-storage-class", "REDUCED_REDUNDANCY"});
+    request.headers.push_back({"x-amz-content-sha256", AwsSignerV4::STREAMING_PAYLOAD});
+    request.headers.push_back({"Content-Encoding", "aws-chunked"});
+    request.headers.push_back({"x-amz-decoded-content-length", "66560"});
+    request.headers.push_back({"Content-Length", "66824"});
+
+    string seedSignature
+        = signer.sign(request, AwsSignerV4::STREAMING_PAYLOAD, date);
+    BOOST_CHECK_EQUAL(seedSignature, "4f232c4386841ef735655705268965c44a0e4690baa4adea153f7db9fa80a0a9");
+
+    string payload(65536 + 1024, 'a');
+    string body;
+    auto chunkSigner = signer.chunkSigner(seedSignature, date);
+
+    chunkSigner.appendChunk(payload.c_str(), 65536, body);
+    BOOST_CHECK_EQUAL(chunkSigner.signature(), "ad80c730a21e5b8d04586a2213dd63b9a0e99e0e2307b0ade35a65485a288648");
+    BOOST_CHECK_EQUAL(body.substr(0, 88), "10000;chunk-signature=ad80c730a21e5b8d04586a2213dd63b9a0e99e0e2307b0ade35a65485a288648\r\n");
+
+    chunkSigner.appendChunk(payload.c_str() + 65536, 1024, body);
+    BOOST_CHECK_EQUAL(chunkSigner.signature(), "0055627c9e194cb4542bae2aa5492e3c1575bbb81b612b7d234b86a503ef5497");
+
+    chunkSigner.appendChunk(nullptr, 0, body);
+    BOOST_CHECK_EQUAL(chunkSigner.signature(), "b6c6ea8a5354eaf15b3cb7646744f4275b71ea724fed81ceb9323e279d449df9");
+
+    BOOST_CHECK_EQUAL(body.size(), 66824U);
+    BOOST_CHECK_EQUAL(AwsSignerV4::chunkedContentLength(66560, 65536), 66824U);
+}
+
+BOOST_AUTO_TEST_CASE( check_payload_hash )
+{
+    AwsPayloadHash hash;
+    hash.update("ab", 2);
+    hash.update(string("c"));
+    BOOST_CHECK_EQUAL(hash.hexDigest(), "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad");
+    BOOST_CHECK_EQUAL(hash.hexDigest(), "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855");
+
+    BOOST_CHECK_EQUAL(AwsApi::uriEncode("a b/~\xc3\xa9"), "a%20b%2F~%C3%A9");
+}
@@ -0,0 +1,185 @@
+/* cpu_accounting_test.cc
+   Copyright (c) 2014 Datacratic.  All rights reserved.
+
+   Tests for the CPU accounting of event sources and handlers.
+*/
+
+#define BOOST_TEST_MAIN
+#define BOOST_TEST_DYN_LINK
+
+#include <time.h>
+#include <unistd.h>
+#include <atomic>
+#include <boost/test/unit_test.hpp>
+
+#include "jml/arch/exception.h"
+#include "jml/arch/timers.h"
+#include "soa/service/cpu_accounting.h"
+#include "soa/service/message_loop.h"
+
+using namespace std;
+using namespace Datacratic;
+
+
+namespace {
+
+/* Burns the given number of seconds of CPU time of the thread */
+void burn(double seconds)
+{
+    struct timespec ts;
+    ::clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    double start = ts.tv_sec + ts.tv_nsec * 1e-9;
+    volatile uint64_t n = 0;
+    for (;;) {
+        for (int i = 0;  i < 10000;  ++i)
+            n = n + i;
+        ::clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+        if (ts.tv_sec + ts.tv_nsec * 1e-9 - start >= seconds)
+            break;
+    }
+}
+
+} // file scope
+
+
+BOOST_AUTO_TEST_CASE( test_nested_scopes )
+{
+    CpuAccounting::cpuSamplePeriod = 1;
+    CpuAccounting::wallSamplePeriod = 1;
+
+    CpuAccount * outer = CpuAccounting::get("tests", "outer");
+    CpuAccount * inner = CpuAccounting::get("tests", "inner");
+    BOOST_CHECK_EQUAL(CpuAccounting::get("tests", "outer"), outer);
+
+    for (int i = 0;  i < 3;  ++i) {
+        CpuAccountingScope outerScope(outer);
+        burn(0.01);
+        {
+            CpuAccountingScope innerScope(inner);
+            burn(0.02);
+            ::usleep(10000);
+        }
+        CpuAccountingScope ignored(nullptr);
+    }
+
+    BOOST_CHECK_EQUAL(outer->invocations, 3);
+    BOOST_CHECK_EQUAL(inner->invocations, 3);
+    BOOST_CHECK_EQUAL(outer->cpuSamples, 3);
+
+    /* the time of the inner scope is only charged to the inner account */
+    BOOST_CHECK_CLOSE(outer->estimatedCpuSeconds(), 0.03, 30);
+    BOOST_CHECK_CLOSE(inner->estimatedCpuSeconds(), 0.06, 30);
+    BOOST_CHECK_GE(inner->wallSeconds(), 0.09);
+    BOOST_CHECK_LT(outer->wallSeconds(), 0.06);
+    BOOST_CHECK_GE(inner->maxLatency(), 0.03);
+
+    Json::Value json = CpuAccounting::toJson();
+    BOOST_CHECK_EQUAL(json["tests"]["outer"]["invocations"].asInt(), 3);
+
+    CpuAccounting::reset();
+    BOOST_CHECK_EQUAL(outer->invocations, 0);
+    BOOST_CHECK_EQUAL(inner->maxWallTicks, 0);
+
+    /* disabled accounting doesn't charge anything */
+    CpuAccounting::enabled = false;
+    {
+        CpuAccountingScope scope(outer);
+    }
+    CpuAccounting::enabled = true;
+    BOOST_CHECK_EQUAL(outer->invocations, 0);
+
+    CpuAccounting::cpuSamplePeriod = 256;
+    CpuAccounting::wallSamplePeriod = 16;
+}
+
+BOOST_AUTO_TEST_CASE( test_cpu_sample_period )
+{
+    CpuAccounting::cpuSamplePeriod = 4;
+    CpuAccount * account = CpuAccounting::get("tests", "sampled");
+    for (int i = 0;  i < 100;  ++i) {
+        CpuAccountingScope scope(account);
+    }
+    BOOST_CHECK_EQUAL(account->invocations, 100);
+    BOOST_CHECK_EQUAL(account->cpuSamples, 25);
+    CpuAccounting::cpuSamplePeriod = 256;
+}
+
+BOOST_AUTO_TEST_CASE( test_wall_sample_period )
+{
+    CpuAccounting::wallSamplePeriod = 4;
+    CpuAccount * account = CpuAccounting::get("tests", "wall sampled");
+    for (int i = 0;  i < 100;  ++i) {
+        CpuAccountingScope scope(account);
+        ::usleep(100);
+    }
+    BOOST_CHECK_EQUAL(account->invocations, 100);
+    BOOST_CHECK_EQUAL(account->wallSamples, 25);
+
+    /* the elapsed time is extrapolated to all of the invocations */
+    BOOST_CHECK_GE(account->wallSeconds(), 0.01);
+    CpuAccounting::wallSamplePeriod = 16;
+}
+
+BOOST_AUTO_TEST_CASE( test_message_loop_sources )
+{
+    CpuAccounting::wallSamplePeriod = 1;
+
+    MessageLoop loop;
+    loop.start();
+
+    std::atomic<int> numTicks(0);
+    auto onTimeout = [&] (uint64_t)
+        {
+            burn(0.001);
+            numTicks++;
+        };
+    loop.addPeriodic("cpu_accounting_test_periodic", 0.01, onTimeout);
+
+    auto source = make_shared<PeriodicEventSource>(0.01, onTimeout);
+    loop.addSource("cpu_accounting_test_source", source);
+
+    while (numTicks < 20)
+        ML::sleep(0.01);
+
+    loop.removeSourceSync(source.get());
+    loop.shutdown();
+
+    Json::Value sources = CpuAccounting::toJson()["sources"];
+    for (const char * name: { "cpu_accounting_test_periodic",
+                              "cpu_accounting_test_source" }) {
+        BOOST_CHECK_GT(sources[name]["invocations"].asInt(), 0);
+        BOOST_CHECK_GT(sources[name]["wallSeconds"].asDouble(), 0.0);
+    }
+
+    CpuAccounting::wallSamplePeriod = 16;
+}
+
+BOOST_AUTO_TEST_CASE( test_profiling )
+{
+    CpuAccount * account = CpuAccounting::get("tests", "profiled");
+
+    CpuAccounting::startProfiling(1000);
+    BOOST_CHECK(CpuAccounting::profiling());
+    BOOST_CHECK_THROW(CpuAccounting::startProfiling(1000), ML::Exception);
+    {
+        CpuAccountingScope scope(account);
+        burn(0.2);
+    }
+    CpuAccounting::stopProfiling();
+    BOOST_CHECK(!CpuAccounting::profiling());
+
+    BOOST_CHECK_GT(account->profileSamples, 0);
+
+    Json::Value stacks = CpuAccounting::stacksToJson();
+    BOOST_REQUIRE_GT(stacks["stacks"].size(), 0);
+    bool found = false;
+    for (unsigned i = 0;  i < stacks["stacks"].size();  ++i) {
+        const Json::Value & stack = stacks["stacks"][i];
+        if (stack["account"].asString() == "tests/profiled") {
+            found = true;
+            BOOST_CHECK_GT(stack["frames"].size(), 0);
+            BOOST_CHECK_EQUAL(stack["id"].asString().size(), 16);
+        }
+    }
+    BOOST_CHECK(found);
+}
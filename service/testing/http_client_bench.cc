@@ -11,6 +11,7 @@
 #include "jml/arch/exception.h"
 #include "soa/types/date.h"
 #include "soa/types/value_description.h"
+#include "soa/utils/benchmarks.h"
 #include "soa/utils/print_utils.h"
 #include "soa/service/http_client.h"
 #include "soa/service/http_endpoint.h"
@@ -24,6 +25,25 @@
 using namespace std;
 using namespace Datacratic;
 
+
+/* Count of the allocations made by the process (client and server), so
+   that we can report allocations per request. */
+static std::atomic<uint64_t> numAllocs(0);
+
+void * operator new (size_t size)
+{
+    numAllocs.fetch_add(1, std::memory_order_relaxed);
+    void * result = malloc(size);
+    if (!result)
+        throw std::bad_alloc();
+    return result;
+}
+
+void operator delete (void * ptr) noexcept
+{
+    free(ptr);
+}
+
 enum HttpMethod {
     GET,
     POST,
@@ -32,11 +52,14 @@ enum HttpMethod {
 
 /* bench methods */
 
-double
-AsyncModelBench(HttpMethod method,
-                const string & baseUrl, const string & payload,
+void
+AsyncModelBench(BenchmarkState & state, HttpMethod method,
+                const string & baseUrl, const string & resource,
+                const string & payload,
                 int maxReqs, int concurrency)
 {
+    state.pause();
+
     int numReqs, numResponses(0), numMissed(0);
     MessageLoop loop(1, 0, -1);
     loop.start();
@@ -60,8 +83,8 @@ AsyncModelBench(HttpMethod method,
     HttpRequest::Content content(payload, "application/binary");
 
     auto & clientRef = *client.get();
-    string url("/");
-    Date start = Date::now();
+    const string & url = resource;
+    state.resume();
     for (numReqs = 0; numReqs < maxReqs;) {
         bool result;
         if (method == GET) {
@@ -94,19 +117,18 @@ AsyncModelBench(HttpMethod method,
         int old(numResponses);
         ML::futex_wait(numResponses, old);
     }
-    Date end = Date::now();
+    state.pause();
 
     loop.removeSource(client.get());
     client->waitConnectionState(AsyncEventSource::DISCONNECTED);
 
-    cerr << "num misses: "  + to_string(numMissed) + "\n";
-
-    return end - start;
+    state.addMetric("misses", numMissed);
 }
 
-double
-ThreadedModelBench(HttpMethod method,
-                   const string & baseUrl, const string & payload,
+void
+ThreadedModelBench(BenchmarkState & state, HttpMethod method,
+                   const string & baseUrl, const string & resource,
+                   const string & payload,
                    int maxReqs, int concurrency)
 {
     vector<thread> threads;
@@ -118,18 +140,17 @@ ThreadedModelBench(HttpMethod method,
         HttpRestProxy client(baseUrl);
         for (i = 0; i < nReqs; i++) {
             if (method == GET) {
-                auto response = client.get("/");
+                auto response = client.get(resource);
             }
             else if (method == POST) {
-                auto response = client.post("/", content);
+                auto response = client.post(resource, content);
             }
             else if (method == PUT) {
-                auto response = client.put("/", content);
+                auto response = client.put(resource, content);
             }
         }
     };
 
-    Date start = Date::now();
     int slice(maxReqs / concurrency);
     for (int i = 0; i < concurrency; i++) {
         // cerr << "doing slice: "  + to_string(slice) + "\n";
@@ -138,8 +159,6 @@ ThreadedModelBench(HttpMethod method,
     for (int i = 0; i < concurrency; i++) {
         threads[i].join();
     }
-
-    return Date::now() - start;
 }
 
 int main(int argc, char *argv[])
@@ -151,11 +170,14 @@ int main(int argc, char *argv[])
     int model(0);
     unsigned int maxReqs(0);
     string method("GET");
+    string resource("/");
     unsigned int payloadSize(0);
 
     string serveriface("127.0.0.1");
     string clientiface(serveriface);
 
+    BenchmarkOptions benchOptions = BenchmarkOptions::fromEnvironment();
+
     options_description all_opt;
     all_opt.add_options()
         ("client-iface,C", value(&clientiface),
@@ -166,6 +188,9 @@ int main(int argc, char *argv[])
          "Number of server worker threads (defaults to \"concurrency\")")
         ("method,M", value(&method),
          "Method to use (\"GET\"*, \"PUT\", \"POST\")")
+        ("resource,R", value(&resource),
+         "Resource to request (\"/\"*; \"/no-content\" for canned 204"
+         " responses)")
         ("model,m", value(&model),
          "Type of concurrency model (1 for async, 2 for threaded))")
         ("requests,r", value(&maxReqs),
@@ -174,6 +199,14 @@ int main(int argc, char *argv[])
          "size of the response body")
         ("server-iface,S", value(&serveriface),
          "server address (\"none\" for no server)")
+        ("warmup", value(&benchOptions.warmup),
+         "number of untimed runs")
+        ("repetitions", value(&benchOptions.repetitions),
+         "number of timed runs")
+        ("output", value(&benchOptions.outputDir),
+         "directory where to write the results")
+        ("baseline", value(&benchOptions.baselineDir),
+         "directory of the results to compare with")
         ("help,H", "show help");
 
     if (argc == 1) {
@@ -242,8 +275,6 @@ int main(int argc, char *argv[])
             baseUrl = "http://" + clientiface;
         }
 
-        ::printf("model\tconc.\treqs\tsize\ttime_secs\tBps\tqps\n");
-
         HttpMethod httpMethod;
         if (method == "GET") {
             httpMethod = GET;
@@ -258,20 +289,34 @@ int main(int argc, char *argv[])
             throw ML::Exception("unknown method: "  + method);
         }
 
-        double delta;
-        if (model == 1) {
-            delta = AsyncModelBench(httpMethod, baseUrl, payload, maxReqs, concurrency);
-        }
-        else if (model == 2) {
-            delta = ThreadedModelBench(httpMethod, baseUrl, payload, maxReqs, concurrency);
-        }
-        else {
+        if (model != 1 && model != 2) {
             throw ML::Exception("invalid 'model'");
         }
-        double qps = maxReqs / delta;
-        double bps = double(maxReqs * payload.size()) / delta;
-        ::printf("%d\t%u\t%u\t%u\t%f\t%f\t%f\n",
-                 model, concurrency, maxReqs, payloadSize, delta, bps, qps);
+
+        auto run = [&] (BenchmarkState & state) {
+            uint64_t allocsBefore = numAllocs;
+            if (model == 1) {
+                AsyncModelBench(state, httpMethod, baseUrl, resource,
+                                payload, maxReqs, concurrency);
+            }
+            else {
+                ThreadedModelBench(state, httpMethod, baseUrl, resource,
+                                   payload, maxReqs, concurrency);
+            }
+            state.setItems(maxReqs);
+            state.setBytes(uint64_t(maxReqs) * payload.size());
+            state.addMetric("allocsPerRequest",
+                            double(numAllocs - allocsBefore) / maxReqs);
+        };
+
+        BenchmarkSuite suite("http_client_bench", benchOptions);
+        suite.run(string(model == 1 ? "async" : "threaded")
+                  + " " + method + " c" + to_string(concurrency)
+                  + " " + to_string(payloadSize) + "B",
+                  run);
+        if (suite.finish() != 0) {
+            return 1;
+        }
     }
     else {
         while (1) {
@@ -195,6 +195,11 @@ BOOST_AUTO_TEST_CASE( http_parser_chunked_encoding_test )
         bodyChunks.emplace_back(data, size);
     };
 
+    vector<string> chunkHeaders;
+    parser.onChunkHeader = [&] (const char * data, size_t size) {
+        chunkHeaders.emplace_back(data, size);
+    };
+
     parser.feed("HTTP/1.1 200 This is some blabla\r\n"
                 "Header1: value1\r\n"
                 "Transfer-Encoding: chunked\r\n"
@@ -225,6 +230,12 @@ BOOST_AUTO_TEST_CASE( http_parser_chunked_encoding_test )
     parser.feed(feedData.c_str(), feedData.size());
     BOOST_CHECK_EQUAL(bodyChunks.size(), 4);
 
+    /* chunk headers are reported as is, including the last one */
+    BOOST_CHECK_EQUAL(chunkHeaders.size(), 5);
+    BOOST_CHECK_EQUAL(chunkHeaders[1], "A;someext");
+    BOOST_CHECK_EQUAL(chunkHeaders[3], "100;otherext=value");
+    BOOST_CHECK_EQUAL(chunkHeaders[4], "0000");
+
     BOOST_CHECK_EQUAL(numResponses, 1);
 
     /* another response can be fed */
@@ -299,7 +310,9 @@ BOOST_AUTO_TEST_CASE( http_request_parser_test )
     BOOST_CHECK_EQUAL(statusLine, "");
     parser.feed("T /poiltruc?bla");
     BOOST_CHECK_EQUAL(statusLine, "");
-    parser.feed("blabla HTTP/1.1");
+    parser.feed("blabla HT");
+    BOOST_CHECK_EQUAL(statusLine, "");
+    parser.feed("TP/1.1");
     BOOST_CHECK_EQUAL(statusLine, "");
     parser.feed("\r");
     BOOST_CHECK_EQUAL(statusLine, "");
@@ -0,0 +1,85 @@
+/* logs_bench.cc
+   Copyright (c) 2014 Datacratic.  All rights reserved.
+
+   Number of lines per second that can be logged from 1 to 32 threads, with a
+   writer that discards them so that only the cost of logging is measured.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "soa/service/logs.h"
+
+using namespace std;
+using namespace Datacratic;
+
+
+namespace {
+
+struct NullWriter : public Logging::Writer {
+    void head(char const * timestamp,
+              char const * name,
+              char const * function,
+              char const * file,
+              int line) {
+    }
+
+    void body(std::string const & content) {
+        numLines++;
+    }
+
+    std::atomic<size_t> numLines { 0 };
+};
+
+Logging::Category bench("bench");
+
+/** Returns the number of lines per second, counting until they have all
+    been handed to the writer. */
+double logLines(int numThreads, size_t numLines)
+{
+    vector<thread> threads;
+    Date start = Date::now();
+    for (int i = 0;  i < numThreads;  ++i) {
+        threads.emplace_back([&, i] () {
+            for (size_t j = 0;  j < numLines;  ++j) {
+                LOG(bench) << "thread " << i << " line " << j
+                           << " value " << j * 0.5 << endl;
+            }
+        });
+    }
+    for (auto & th: threads) {
+        th.join();
+    }
+    Logging::flush();
+
+    return numThreads * numLines / Date::now().secondsSince(start);
+}
+
+} // file scope
+
+
+int main(int argc, char ** argv)
+{
+    size_t numLines = 100000;
+    if (argc > 1) {
+        numLines = atoi(argv[1]);
+    }
+
+    auto writer = make_shared<NullWriter>();
+    bench.writeTo(writer);
+
+    ::printf("mode,threads,lines/s\n");
+
+    for (bool async: { false, true }) {
+        Logging::setAsync(async);
+        for (int numThreads: { 1, 2, 4, 8, 16, 32 }) {
+            ::printf("%s,%d,%.0f\n", async ? "async" : "sync", numThreads,
+                     logLines(numThreads, numLines));
+        }
+    }
+
+    return 0;
+}
@@ -9,8 +9,14 @@
 #define BOOST_TEST_DYN_LINK
 
 #include "soa/service/logs.h"
+#include "jml/arch/exception.h"
 
 #include <boost/test/unit_test.hpp>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <mutex>
+#include <thread>
+#include <vector>
 
 using namespace std;
 using namespace Datacratic;
@@ -46,3 +52,128 @@ BOOST_AUTO_TEST_CASE(blah)
     BOOST_CHECK(!d.isEnabled());
     BOOST_CHECK(!e.isEnabled());
 }
+
+namespace {
+
+struct CapturingWriter : public Logging::Writer {
+    void head(char const * timestamp,
+              char const * name,
+              char const * function,
+              char const * file,
+              int line) {
+        ++numHeads;
+        lastName = name;
+        lastTimestamp = timestamp;
+    }
+
+    void body(std::string const & content) {
+        std::lock_guard<std::mutex> guard(lock);
+        lines.push_back(content);
+    }
+
+    std::mutex lock;
+    int numHeads = 0;
+    std::string lastName;
+    std::string lastTimestamp;
+    std::vector<std::string> lines;
+};
+
+} // file scope
+
+BOOST_AUTO_TEST_CASE(test_async_logging)
+{
+    auto writer = std::make_shared<CapturingWriter>();
+    Logging::Category g("g");
+    g.writeTo(writer);
+    g.activate();
+
+    const int numThreads = 8;
+    const int numLines = 10000;
+
+    std::vector<std::thread> threads;
+    for (int i = 0;  i < numThreads;  ++i) {
+        threads.emplace_back([&, i] () {
+            for (int j = 0;  j < numLines;  ++j) {
+                LOG(g) << i << " " << j << endl;
+            }
+        });
+    }
+    for (auto & th: threads) {
+        th.join();
+    }
+
+    Logging::flush();
+
+    BOOST_CHECK_EQUAL(writer->lines.size(), numThreads * numLines);
+    BOOST_CHECK_EQUAL(writer->numHeads, numThreads * numLines);
+    BOOST_CHECK_EQUAL(writer->lastName, "g");
+    BOOST_CHECK_EQUAL(writer->lastTimestamp.size(), 23);
+
+    /* the lines of each thread come out in order */
+    std::vector<int> next(numThreads);
+    for (auto & line: writer->lines) {
+        int i, j;
+        BOOST_REQUIRE_EQUAL(sscanf(line.c_str(), "%d %d", &i, &j), 2);
+        BOOST_CHECK_EQUAL(j, next[i]);
+        next[i] = j + 1;
+    }
+
+    /* a line formatted while formatting another one */
+    writer->lines.clear();
+    auto inner = [&] () {
+        LOG(g) << "inner" << endl;
+        return "outer";
+    };
+    LOG(g) << inner() << endl;
+    Logging::flush();
+
+    BOOST_REQUIRE_EQUAL(writer->lines.size(), 2);
+    BOOST_CHECK_EQUAL(writer->lines[0], "inner\n");
+    BOOST_CHECK_EQUAL(writer->lines[1], "outer\n");
+
+    /* synchronous mode writes before returning */
+    writer->lines.clear();
+    Logging::setAsync(false);
+    LOG(g) << "sync" << endl;
+    BOOST_REQUIRE_EQUAL(writer->lines.size(), 1);
+    BOOST_CHECK_EQUAL(writer->lines[0], "sync\n");
+    Logging::setAsync(true);
+
+    BOOST_CHECK_THROW(THROW(g) << "error" << endl, ML::Exception);
+    LOG(g) << "after" << endl;
+    Logging::flush();
+    BOOST_CHECK_EQUAL(writer->lines.back(), "after\n");
+}
+
+BOOST_AUTO_TEST_CASE(test_logging_after_fork)
+{
+    auto writer = std::make_shared<CapturingWriter>();
+    Logging::Category h("h");
+    h.writeTo(writer);
+    h.activate();
+
+    LOG(h) << "parent" << endl;
+
+    pid_t pid = fork();
+    BOOST_REQUIRE_NE(pid, -1);
+    if (pid == 0) {
+        /* the child has no writer thread: its lines are written right away,
+           and the parent's aren't written again */
+        size_t before = writer->lines.size();
+        LOG(h) << "child" << endl;
+        bool ok = (writer->lines.size() == before + 1
+                   && writer->lines.back() == "child\n");
+        Logging::flush();
+        ok = ok && writer->lines.size() == before + 1;
+        _exit(ok ? 0 : 1);
+    }
+
+    int status;
+    BOOST_REQUIRE_EQUAL(waitpid(pid, &status, 0), pid);
+    BOOST_CHECK(WIFEXITED(status));
+    BOOST_CHECK_EQUAL(WEXITSTATUS(status), 0);
+
+    Logging::flush();
+    BOOST_REQUIRE_EQUAL(writer->lines.size(), 1);
+    BOOST_CHECK_EQUAL(writer->lines[0], "parent\n");
+}
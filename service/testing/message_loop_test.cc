@@ -2,6 +2,7 @@
 #define BOOST_TEST_DYN_LINK
 
 #include <iostream>
+#include <poll.h>
 
 #include <boost/test/unit_test.hpp>
 
@@ -10,6 +11,7 @@
 
 #include "soa/service/typed_message_channel.h"
 #include "soa/service/message_loop.h"
+#include "soa/service/async_event_source.h"
 
 using namespace std;
 using namespace Datacratic;
@@ -102,3 +104,67 @@ BOOST_AUTO_TEST_CASE( test_addSource_after_before_start )
         }
     }
 }
+
+/* This test ensures that periodic jobs can be removed, and are removed when
+ * the loop is shut down. */
+BOOST_AUTO_TEST_CASE( test_addPeriodic_remove )
+{
+    ML::Watchdog wd(5);
+    MessageLoop loop;
+
+    int numCalls(0);
+    loop.addPeriodic("periodic", 0.01, [&] (uint64_t) { numCalls++; });
+    /* the priority is ignored */
+    BOOST_CHECK(loop.addPeriodic("priority", 0.01, [] (uint64_t) {}, 1));
+    BOOST_CHECK(loop.removePeriodic("priority"));
+    loop.start();
+
+    ML::sleep(0.1);
+    BOOST_CHECK(loop.removePeriodic("periodic"));
+    BOOST_CHECK(!loop.removePeriodic("periodic"));
+    BOOST_CHECK_GT(numCalls, 0);
+
+    ML::sleep(0.02);
+    int numCallsAfterRemove(numCalls);
+    ML::sleep(0.1);
+    BOOST_CHECK_EQUAL(numCalls, numCallsAfterRemove);
+
+    loop.addPeriodic("other", 0.01, [] (uint64_t) {});
+    BOOST_CHECK_EQUAL(loop.timers().size(), 1);
+    loop.shutdown();
+    BOOST_CHECK_EQUAL(loop.timers().size(), 0);
+}
+
+/* This test ensures that a periodic source fires from its own fd when it is
+ * not in a loop, and only from the timers of the loop while it is. */
+BOOST_AUTO_TEST_CASE( test_periodic_source_standalone )
+{
+    ML::Watchdog wd(5);
+
+    int numCalls(0);
+    PeriodicEventSource source(0.01, [&] (uint64_t) { numCalls++; });
+
+    pollfd fd = { source.selectFd(), POLLIN, 0 };
+    BOOST_REQUIRE_EQUAL(::poll(&fd, 1, 1000), 1);
+    source.processOne();
+    BOOST_CHECK_EQUAL(numCalls, 1);
+
+    MessageLoop loop;
+    loop.addSource("periodic", source);
+    loop.start();
+    source.waitConnectionState(AsyncEventSource::CONNECTED);
+
+    ML::sleep(0.1);
+    BOOST_CHECK_GT(numCalls, 1);
+    BOOST_CHECK_EQUAL(::poll(&fd, 1, 0), 0);
+
+    loop.removeSource(&source);
+    source.waitConnectionState(AsyncEventSource::DISCONNECTED);
+
+    int numCallsAfterRemove(numCalls);
+    BOOST_REQUIRE_EQUAL(::poll(&fd, 1, 1000), 1);
+    source.processOne();
+    BOOST_CHECK_EQUAL(numCalls, numCallsAfterRemove + 1);
+
+    loop.shutdown();
+}
@@ -0,0 +1,131 @@
+/* mpsc_queue_test.cc
+   Copyright (c) 2014 Datacratic.  All rights reserved.
+
+   Tests for the MPSC queue, the block pool and the inline function.
+*/
+
+#define BOOST_TEST_MAIN
+#define BOOST_TEST_DYN_LINK
+
+#include <boost/test/unit_test.hpp>
+#include <thread>
+#include <vector>
+#include <memory>
+#include "soa/service/mpsc_queue.h"
+#include "soa/service/block_pool.h"
+#include "soa/service/inline_function.h"
+
+using namespace std;
+using namespace Datacratic;
+
+
+struct TestNode : public MpscQueueNode {
+    int producer;
+    int value;
+};
+
+BOOST_AUTO_TEST_CASE( test_mpsc_queue_single_thread )
+{
+    MpscQueue<TestNode> queue;
+    BOOST_CHECK(queue.empty());
+    BOOST_CHECK(queue.pop() == nullptr);
+
+    TestNode nodes[3];
+    for (int i = 0;  i < 3;  ++i) {
+        nodes[i].value = i;
+        queue.push(&nodes[i]);
+    }
+    BOOST_CHECK(!queue.empty());
+
+    for (int i = 0;  i < 3;  ++i) {
+        TestNode * node = queue.pop();
+        BOOST_REQUIRE(node);
+        BOOST_CHECK_EQUAL(node->value, i);
+    }
+    BOOST_CHECK(queue.pop() == nullptr);
+    BOOST_CHECK(queue.empty());
+
+    // The queue is reusable once drained
+    queue.push(&nodes[1]);
+    BOOST_CHECK_EQUAL(queue.pop(), &nodes[1]);
+    BOOST_CHECK(queue.empty());
+}
+
+BOOST_AUTO_TEST_CASE( test_mpsc_queue_multiple_producers )
+{
+    typedef BlockPool<sizeof(TestNode)> Pool;
+
+    enum { numProducers = 4, numMessages = 100000 };
+
+    MpscQueue<TestNode> queue;
+
+    vector<std::thread> producers;
+    for (int i = 0;  i < numProducers;  ++i) {
+        producers.emplace_back([&queue, i] () {
+                for (int j = 0;  j < numMessages;  ++j) {
+                    TestNode * node = new (Pool::allocate()) TestNode();
+                    node->producer = i;
+                    node->value = j;
+                    queue.push(node);
+                }
+            });
+    }
+
+    // Each producer's messages must come out in the order they went in
+    vector<int> nextValue(numProducers, 0);
+    int received = 0;
+    while (received < numProducers * numMessages) {
+        TestNode * node = queue.pop();
+        if (!node) {
+            std::this_thread::yield();
+            continue;
+        }
+        BOOST_REQUIRE_EQUAL(node->value, nextValue[node->producer]);
+        ++nextValue[node->producer];
+        ++received;
+        node->~TestNode();
+        Pool::deallocate(node);
+    }
+
+    for (auto & th: producers)
+        th.join();
+
+    BOOST_CHECK(queue.pop() == nullptr);
+    BOOST_CHECK(queue.empty());
+}
+
+BOOST_AUTO_TEST_CASE( test_inline_function )
+{
+    typedef InlineFunction<32> Function;
+
+    int calls = 0;
+    Function fn;
+    BOOST_CHECK(!fn);
+
+    fn.emplace([&] () { ++calls; });
+    BOOST_CHECK(fn);
+    fn();
+    BOOST_CHECK_EQUAL(calls, 1);
+
+    // Captured state is destroyed on reset and on replacement
+    auto state = std::make_shared<int>(0);
+    fn.emplace([state, &calls] () { calls += 10; });
+    BOOST_CHECK_EQUAL(state.use_count(), 2);
+    fn();
+    BOOST_CHECK_EQUAL(calls, 11);
+    fn.reset();
+    BOOST_CHECK_EQUAL(state.use_count(), 1);
+    BOOST_CHECK(!fn);
+
+    // Captures too big to fit go to the heap but behave the same way
+    char big[64] = { 0 };
+    big[63] = 5;
+    auto bigFn = [big, state, &calls] () { calls += big[63]; };
+    BOOST_CHECK(!Function::storedInline<decltype(bigFn)>());
+    fn.emplace(bigFn);
+    BOOST_CHECK_EQUAL(state.use_count(), 3);
+    fn();
+    BOOST_CHECK_EQUAL(calls, 16);
+    fn.emplace([] () {});
+    BOOST_CHECK_EQUAL(state.use_count(), 2);
+}
@@ -0,0 +1,180 @@
+/* nsq_client_bench.cc
+   Copyright (c) 2014 Datacratic.  All rights reserved.
+
+   Publishing and consuming rates of NsqClient, with a PUB per message and
+   with MPUB batching, against a local nsqd or, by default, a stand-in.
+
+   Usage: nsq_client_bench [numMessages [messageSize [host:port]]]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "jml/arch/exception.h"
+#include "jml/arch/futex.h"
+#include "jml/arch/timers.h"
+
+#include "soa/service/message_loop.h"
+#include "soa/service/nsq_client.h"
+#include "nsqd_stand_in.h"
+
+using namespace std;
+using namespace Datacratic;
+
+
+namespace {
+
+struct BenchClient {
+    BenchClient(const string & host, int port,
+                const NsqClient::OnMessage & onMessage = nullptr)
+        : closed(false)
+    {
+        loop.start();
+
+        auto onClosed = [&] (bool fromPeer,
+                             const std::vector<std::string> & msgs) {
+            closed = true;
+            ML::futex_wake(closed);
+        };
+        client.reset(new NsqClient(onClosed, onMessage));
+        loop.addSource("client", client);
+        client->init(host, port);
+        auto result = client->connectSync();
+        if (result.code != TcpConnectionCode::Success) {
+            throw ML::Exception("connection error");
+        }
+    }
+
+    ~BenchClient()
+    {
+        client->requestClose();
+        while (!closed) {
+            int old = closed;
+            ML::futex_wait(closed, old);
+        }
+        loop.shutdown();
+    }
+
+    MessageLoop loop;
+    std::shared_ptr<NsqClient> client;
+    int closed;
+};
+
+void
+benchPub(const char * name, const string & host, int port,
+         int numMessages, const string & message, size_t maxMessages)
+{
+    BenchClient bench(host, port);
+    NsqClient & client = *bench.client;
+    client.setPubBatching(maxMessages, 512 * 1024, 0.005);
+
+    int numDone(0);
+    auto onPub = [&] (const NsqFrame & frame) {
+        if (++numDone == numMessages) {
+            ML::futex_wake(numDone);
+        }
+    };
+
+    Date start = Date::now();
+    for (int i = 0; i < numMessages; i++) {
+        client.pub("bench-topic", message, onPub);
+    }
+    client.flushPub();
+    double pubTime = Date::now().secondsSince(start);
+
+    while (numDone < numMessages) {
+        int old = numDone;
+        ML::futex_wait(numDone, old, 0.1);
+    }
+    double elapsed = Date::now().secondsSince(start);
+
+    printf("%-16s %12.0f %12.0f %10.0f\n",
+           name, numMessages / elapsed, numMessages / pubTime,
+           elapsed * 1e9 / numMessages);
+}
+
+void
+benchSub(const char * name, const string & host, int port,
+         int numMessages, int minRdy, int maxRdy)
+{
+    int numReceived(0);
+    NsqClient * clientPtr(nullptr);
+    auto onMessage = [&] (Date ts, uint16_t attempts,
+                          const string & messageId,
+                          const string & message) {
+        clientPtr->fin(messageId);
+        if (++numReceived == numMessages) {
+            ML::futex_wake(numReceived);
+        }
+    };
+
+    BenchClient bench(host, port, onMessage);
+    NsqClient & client = *bench.client;
+    clientPtr = &client;
+    client.setRdyControl(minRdy, maxRdy, 0.25);
+
+    Date start = Date::now();
+    client.sub("bench-topic", "bench-channel");
+    while (numReceived < numMessages) {
+        int old = numReceived;
+        ML::futex_wait(numReceived, old, 0.1);
+    }
+    double elapsed = Date::now().secondsSince(start);
+
+    printf("%-16s %12.0f %12s %10.0f   final RDY %d\n",
+           name, numMessages / elapsed, "",
+           elapsed * 1e9 / numMessages, client.rdyCount());
+}
+
+} // file scope
+
+
+int main(int argc, char ** argv)
+{
+    int numMessages = argc > 1 ? atoi(argv[1]) : 200000;
+    int messageSize = argc > 2 ? atoi(argv[2]) : 100;
+    string address = argc > 3 ? argv[3] : "";
+
+    string message(messageSize, 'x');
+
+    printf("%d messages of %d bytes to %s\n", numMessages, messageSize,
+           address.empty() ? "a stand-in nsqd" : address.c_str());
+    printf("%-16s %12s %12s %10s\n",
+           "client", "msgs/s", "pub calls/s", "ns/msg");
+
+    auto run = [&] (const std::function<void (const string &, int)> & fn,
+                    int numToDeliver)
+        {
+            if (address.empty()) {
+                NsqdStandIn nsqd(numToDeliver);
+                fn("127.0.0.1", nsqd.port);
+            }
+            else {
+                size_t colon = address.rfind(':');
+                fn(address.substr(0, colon),
+                   atoi(address.c_str() + colon + 1));
+            }
+        };
+
+    /* PUB is limited by the round trip of each command, use fewer */
+    int numUnbatched = min(numMessages, 50000);
+    run([&] (const string & host, int port) {
+            benchPub("pub", host, port, numUnbatched, message, 1);
+        }, 0);
+    run([&] (const string & host, int port) {
+            benchPub("mpub", host, port, numMessages, message, 500);
+        }, 0);
+
+    run([&] (const string & host, int port) {
+            benchSub("sub rdy 1", host, port, numUnbatched, 1, 1);
+        }, numUnbatched);
+    run([&] (const string & host, int port) {
+            benchSub("sub adaptive", host, port, numMessages, 1, 2500);
+        }, numMessages);
+
+    return 0;
+}
@@ -0,0 +1,257 @@
+/* nsq_client_protocol_test.cc
+   Copyright (c) 2014 Datacratic.  All rights reserved.
+
+   Tests of NsqClient against a stand-in for nsqd: MPUB batching, split
+   frames and RDY control.
+*/
+
+#define BOOST_TEST_MAIN
+#define BOOST_TEST_DYN_LINK
+
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+#include <boost/test/unit_test.hpp>
+
+#include "jml/arch/futex.h"
+#include "jml/arch/timers.h"
+
+#include "soa/service/message_loop.h"
+#include "soa/service/nsq_client.h"
+#include "nsqd_stand_in.h"
+
+using namespace std;
+using namespace Datacratic;
+
+
+namespace {
+
+/* A client connected to a stand-in, with its own message loop */
+struct TestClient {
+    TestClient(const NsqdStandIn & nsqd,
+               const NsqClient::OnMessage & onMessage = nullptr,
+               bool connectNow = true)
+        : closed(false)
+    {
+        loop.start();
+
+        auto onClosed = [&] (bool fromPeer,
+                             const std::vector<std::string> & msgs) {
+            closed = true;
+            ML::futex_wake(closed);
+        };
+        client.reset(new NsqClient(onClosed, onMessage));
+        loop.addSource("client", client);
+        client->init("127.0.0.1", nsqd.port);
+        if (connectNow) {
+            connect();
+        }
+    }
+
+    void connect()
+    {
+        auto result = client->connectSync();
+        if (result.code != TcpConnectionCode::Success) {
+            throw ML::Exception("connection error");
+        }
+    }
+
+    ~TestClient()
+    {
+        client->requestClose();
+        while (!closed) {
+            int old = closed;
+            ML::futex_wait(closed, old);
+        }
+        loop.shutdown();
+    }
+
+    MessageLoop loop;
+    std::shared_ptr<NsqClient> client;
+    int closed;
+};
+
+/* Waits up to "timeout" seconds for "condition" */
+template<typename Condition>
+bool
+waitFor(const Condition & condition, double timeout = 10.0)
+{
+    Date limit = Date::now().plusSeconds(timeout);
+    while (!condition()) {
+        if (Date::now() > limit) {
+            return false;
+        }
+        ML::sleep(0.001);
+    }
+    return true;
+}
+
+} // file scope
+
+
+BOOST_AUTO_TEST_CASE( test_nsq_client_mpub )
+{
+    NsqdStandIn nsqd(0, 0, true);
+    TestClient test(nsqd);
+    NsqClient & client = *test.client;
+    client.setPubBatching(100, 1024 * 1024, 10.0);
+
+    const int numMessages(2000);
+    int numOk(0);
+    auto onPub = [&] (const NsqFrame & frame) {
+        BOOST_CHECK_EQUAL(frame.type, NsqFrameType::Response);
+        BOOST_CHECK_EQUAL(frame.data, "OK");
+        numOk++;
+    };
+
+    for (int i = 0; i < numMessages; i++) {
+        client.pub("a-topic", "message nr " + to_string(i), onPub);
+    }
+
+    BOOST_CHECK(waitFor([&] { return numOk == numMessages; }));
+    BOOST_CHECK_EQUAL(nsqd.numPubCommands.load(), numMessages / 100);
+
+    unique_lock<mutex> guard(nsqd.lock);
+    BOOST_REQUIRE_EQUAL(nsqd.published.size(), numMessages);
+    for (int i = 0; i < numMessages; i++) {
+        BOOST_CHECK_EQUAL(nsqd.published[i], "message nr " + to_string(i));
+    }
+}
+
+/* batches are sent when they reach the byte limit, which may be exceeded
+   by a single message */
+BOOST_AUTO_TEST_CASE( test_nsq_client_mpub_bytes )
+{
+    NsqdStandIn nsqd(0, 0, true);
+    TestClient test(nsqd);
+    NsqClient & client = *test.client;
+    client.setPubBatching(1000, 1000, 10.0);
+
+    client.pub("a-topic", string(400, 'a'));
+    client.pub("a-topic", string(400, 'b'));
+    client.pub("a-topic", string(400, 'c'));
+    client.pub("a-topic", string(4000, 'd'));
+    client.flushPub();
+
+    BOOST_CHECK(waitFor([&] { return nsqd.numPublished == 4; }));
+    BOOST_CHECK_EQUAL(nsqd.numPubCommands.load(), 3);
+
+    unique_lock<mutex> guard(nsqd.lock);
+    BOOST_REQUIRE_EQUAL(nsqd.published.size(), 4);
+    BOOST_CHECK_EQUAL(nsqd.published[3], string(4000, 'd'));
+}
+
+/* a batch that does not fill up is sent after maxDelay */
+BOOST_AUTO_TEST_CASE( test_nsq_client_mpub_delay )
+{
+    NsqdStandIn nsqd;
+    TestClient test(nsqd);
+    NsqClient & client = *test.client;
+    client.setPubBatching(1000, 1024 * 1024, 0.05);
+
+    int numOk(0);
+    auto onPub = [&] (const NsqFrame & frame) {
+        numOk++;
+    };
+    Date start = Date::now();
+    client.pub("a-topic", "first", onPub);
+    client.pub("another-topic", "second", onPub);
+
+    BOOST_CHECK(waitFor([&] { return numOk == 2; }, 5.0));
+    double delay = Date::now().secondsSince(start);
+    BOOST_CHECK_GE(delay, 0.04);
+    BOOST_CHECK_LT(delay, 1.0);
+    BOOST_CHECK_EQUAL(nsqd.numPubCommands.load(), 2);
+}
+
+/* a batch whose delay expires while there is no connection is sent within
+   maxDelay of the connection, without waiting for another "pub" */
+BOOST_AUTO_TEST_CASE( test_nsq_client_mpub_delay_disconnected )
+{
+    NsqdStandIn nsqd;
+    TestClient test(nsqd, nullptr, false);
+    NsqClient & client = *test.client;
+    client.setPubBatching(1000, 1024 * 1024, 0.05);
+
+    int numOk(0);
+    auto onPub = [&] (const NsqFrame & frame) {
+        numOk++;
+    };
+    client.pub("a-topic", "first", onPub);
+    ML::sleep(0.2);
+    BOOST_CHECK_EQUAL(numOk, 0);
+
+    test.connect();
+    Date start = Date::now();
+    BOOST_CHECK(waitFor([&] { return numOk == 1; }, 5.0));
+    BOOST_CHECK_LT(Date::now().secondsSince(start), 1.0);
+    BOOST_CHECK_EQUAL(nsqd.numPubCommands.load(), 1);
+}
+
+BOOST_AUTO_TEST_CASE( test_nsq_client_pub_unbatched )
+{
+    NsqdStandIn nsqd(0, 0, true);
+    TestClient test(nsqd);
+    NsqClient & client = *test.client;
+    client.setPubBatching(1, 0, 0.0);
+
+    int numOk(0);
+    auto onPub = [&] (const NsqFrame & frame) {
+        numOk++;
+    };
+    for (int i = 0; i < 100; i++) {
+        client.pub("a-topic", "message nr " + to_string(i), onPub);
+    }
+
+    BOOST_CHECK(waitFor([&] { return numOk == 100; }));
+    BOOST_CHECK_EQUAL(nsqd.numPubCommands.load(), 100);
+}
+
+/* messages written 7 bytes at a time, so that most frames are split */
+BOOST_AUTO_TEST_CASE( test_nsq_client_sub )
+{
+    const int numMessages(20000);
+    NsqdStandIn nsqd(numMessages, 7);
+
+    int numReceived(0);
+    set<string> ids;
+    bool contentsOk(true);
+    NsqClient * clientPtr(nullptr);
+
+    auto onMessage = [&] (Date ts, uint16_t attempts,
+                          const string & messageId,
+                          const string & message) {
+        if (message != "message nr " + to_string(numReceived)
+            || attempts != 1) {
+            contentsOk = false;
+        }
+        numReceived++;
+        ids.insert(messageId);
+        clientPtr->fin(messageId);
+    };
+
+    TestClient test(nsqd, onMessage);
+    NsqClient & client = *test.client;
+    clientPtr = &client;
+    client.setRdyControl(10, 500, 0.1);
+
+    bool subscribed(false);
+    client.sub("a-topic", "a-channel",
+               [&] (const NsqFrame & frame) { subscribed = true; });
+
+    BOOST_CHECK(waitFor([&] { return numReceived == numMessages; }, 30.0));
+    BOOST_CHECK(subscribed);
+    BOOST_CHECK(contentsOk);
+    BOOST_CHECK_EQUAL(ids.size(), numMessages);
+    BOOST_CHECK(waitFor([&] { return nsqd.numFinished == numMessages; }));
+
+    unique_lock<mutex> guard(nsqd.lock);
+    BOOST_REQUIRE(nsqd.rdys.size() > 0);
+    /* the initial count is clamped to maxRdy */
+    BOOST_CHECK_EQUAL(nsqd.rdys.front(), 500);
+    for (int rdy: nsqd.rdys) {
+        BOOST_CHECK_GE(rdy, 10);
+        BOOST_CHECK_LE(rdy, 500);
+    }
+}
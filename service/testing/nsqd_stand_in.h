@@ -0,0 +1,304 @@
+/* nsqd_stand_in.h                                                 -*- C++ -*-
+   Copyright (c) 2014 Datacratic.  All rights reserved.
+
+   A minimal nsqd speaking the TCP protocol, for testing NsqClient without a
+   running nsqd.  It serves one connection at a time, acknowledges IDENTIFY,
+   PUB, MPUB and SUB, and delivers a given number of messages to the
+   subscriber while the number in flight is below the last RDY count.
+*/
+
+#pragma once
+
+#include <endian.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "jml/arch/exception.h"
+#include "jml/arch/format.h"
+
+
+namespace Datacratic {
+
+/****************************************************************************/
+/* NSQD STAND IN                                                            */
+/****************************************************************************/
+
+struct NsqdStandIn {
+    /* "numMessages" are delivered to the first subscriber, written in
+       chunks of "chunkSize" bytes to split the frames over several reads
+       (0 for no chunking); the published messages are kept when
+       "keepMessages" is set */
+    NsqdStandIn(int numMessages = 0, size_t chunkSize = 0,
+                bool keepMessages = false)
+        : numPublished(0), numPubCommands(0), numFinished(0),
+          numMessages_(numMessages), chunkSize_(chunkSize),
+          keepMessages_(keepMessages), nextId_(0), shutdown_(false),
+          connectionFd_(-1)
+    {
+        listenFd_ = ::socket(AF_INET, SOCK_STREAM, 0);
+        if (listenFd_ == -1) {
+            throw ML::Exception(errno, "socket");
+        }
+
+        sockaddr_in addr;
+        ::memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (::bind(listenFd_, (sockaddr *) &addr, sizeof(addr)) == -1) {
+            throw ML::Exception(errno, "bind");
+        }
+        socklen_t len = sizeof(addr);
+        ::getsockname(listenFd_, (sockaddr *) &addr, &len);
+        port = ntohs(addr.sin_port);
+
+        if (::listen(listenFd_, 16) == -1) {
+            throw ML::Exception(errno, "listen");
+        }
+
+        thread_ = std::thread([&] () { this->run(); });
+    }
+
+    ~NsqdStandIn()
+    {
+        shutdown_ = true;
+        ::shutdown(listenFd_, SHUT_RDWR);
+        int fd = connectionFd_;
+        if (fd != -1) {
+            ::shutdown(fd, SHUT_RDWR);
+        }
+        thread_.join();
+        ::close(listenFd_);
+    }
+
+    std::string address() const
+    {
+        return ML::format("127.0.0.1:%d", port);
+    }
+
+    int port;
+
+    std::atomic<uint64_t> numPublished;   /* messages */
+    std::atomic<uint64_t> numPubCommands; /* PUB and MPUB commands */
+    std::atomic<uint64_t> numFinished;    /* FIN commands */
+
+    /* published messages and RDY counts received, under "lock" */
+    std::mutex lock;
+    std::vector<std::string> published;
+    std::vector<int> rdys;
+
+private:
+    static uint32_t readUInt32(const char * data)
+    {
+        uint32_t value;
+        ::memcpy(&value, data, sizeof(value));
+        return ntohl(value);
+    }
+
+    static void appendUInt32(std::string & buffer, uint32_t value)
+    {
+        value = htonl(value);
+        buffer.append((const char *) &value, sizeof(value));
+    }
+
+    static void appendFrame(std::string & out, int type,
+                            const std::string & data)
+    {
+        appendUInt32(out, 4 + data.size());
+        appendUInt32(out, type);
+        out.append(data);
+    }
+
+    void appendMessage(std::string & out)
+    {
+        uint64_t id = nextId_++;
+        std::string body = "message nr " + std::to_string(id);
+
+        appendUInt32(out, 4 + 26 + body.size());
+        appendUInt32(out, 2);
+        uint64_t nanos = htobe64(uint64_t(1400000000) * 1000000000);
+        out.append((const char *) &nanos, sizeof(nanos));
+        uint16_t attempts = htons(1);
+        out.append((const char *) &attempts, sizeof(attempts));
+        out.append(ML::format("%016llx", (unsigned long long) id));
+        out.append(body);
+    }
+
+    void run()
+    {
+        while (!shutdown_) {
+            int fd = ::accept(listenFd_, nullptr, nullptr);
+            if (fd == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                break;
+            }
+            connectionFd_ = fd;
+            serve(fd);
+            connectionFd_ = -1;
+            ::close(fd);
+        }
+    }
+
+    /* parse the commands in "in", returns the number of bytes used */
+    size_t handleCommands(const std::string & in, std::string & out)
+    {
+        size_t pos(0);
+
+        while (pos < in.size()) {
+            size_t eol = in.find('\n', pos);
+            if (eol == std::string::npos) {
+                break;
+            }
+            std::string line = in.substr(pos, eol - pos);
+            size_t next = eol + 1;
+
+            bool hasBody = (line == "IDENTIFY"
+                            || line.compare(0, 4, "PUB ") == 0
+                            || line.compare(0, 5, "MPUB ") == 0);
+            const char * body(nullptr);
+            size_t bodySize(0);
+            if (hasBody) {
+                if (in.size() < next + 4) {
+                    break;
+                }
+                bodySize = readUInt32(in.c_str() + next);
+                if (in.size() < next + 4 + bodySize) {
+                    break;
+                }
+                body = in.c_str() + next + 4;
+                next += 4 + bodySize;
+            }
+
+            if (line == "IDENTIFY") {
+                appendFrame(out, 0, "OK");
+            }
+            else if (line.compare(0, 4, "PUB ") == 0) {
+                addPublished(std::string(body, bodySize));
+                numPublished++;
+                numPubCommands++;
+                appendFrame(out, 0, "OK");
+            }
+            else if (line.compare(0, 5, "MPUB ") == 0) {
+                uint32_t count = readUInt32(body);
+                size_t offset(4);
+                for (uint32_t i = 0; i < count; i++) {
+                    uint32_t size = readUInt32(body + offset);
+                    addPublished(std::string(body + offset + 4, size));
+                    offset += 4 + size;
+                }
+                if (offset != bodySize) {
+                    throw ML::Exception("bad MPUB body");
+                }
+                numPublished += count;
+                numPubCommands++;
+                appendFrame(out, 0, "OK");
+            }
+            else if (line.compare(0, 4, "SUB ") == 0) {
+                subscribed_ = true;
+                appendFrame(out, 0, "OK");
+            }
+            else if (line.compare(0, 4, "RDY ") == 0) {
+                rdy_ = std::stoi(line.substr(4));
+                std::unique_lock<std::mutex> guard(lock);
+                rdys.push_back(rdy_);
+            }
+            else if (line.compare(0, 4, "FIN ") == 0) {
+                inFlight_--;
+                numFinished++;
+            }
+            else if (line == "CLS") {
+                appendFrame(out, 0, "CLOSE_WAIT");
+            }
+            else if (line != "NOP") {
+                appendFrame(out, 1, "E_INVALID " + line);
+            }
+
+            pos = next;
+        }
+
+        return pos;
+    }
+
+    void addPublished(std::string message)
+    {
+        if (keepMessages_) {
+            std::unique_lock<std::mutex> guard(lock);
+            published.emplace_back(std::move(message));
+        }
+    }
+
+    void serve(int fd)
+    {
+        subscribed_ = false;
+        rdy_ = 0;
+        inFlight_ = 0;
+
+        std::string in, out;
+        char buffer[65536];
+        bool magic(false);
+
+        while (true) {
+            ssize_t res = ::read(fd, buffer, sizeof(buffer));
+            if (res <= 0) {
+                break;
+            }
+            in.append(buffer, res);
+
+            if (!magic) {
+                if (in.size() < 4) {
+                    continue;
+                }
+                if (in.compare(0, 4, "  V2") != 0) {
+                    throw ML::Exception("bad protocol magic");
+                }
+                in.erase(0, 4);
+                magic = true;
+            }
+            in.erase(0, handleCommands(in, out));
+
+            while (subscribed_ && numMessages_ > 0 && inFlight_ < rdy_) {
+                appendMessage(out);
+                numMessages_--;
+                inFlight_++;
+            }
+
+            size_t chunkSize = chunkSize_ ? chunkSize_ : out.size();
+            for (size_t pos = 0; pos < out.size(); pos += chunkSize) {
+                size_t size = std::min(chunkSize, out.size() - pos);
+                if (::send(fd, out.c_str() + pos, size, MSG_NOSIGNAL)
+                    != (ssize_t) size) {
+                    return;
+                }
+            }
+            out.clear();
+        }
+    }
+
+    int listenFd_;
+    std::thread thread_;
+
+    int numMessages_;
+    size_t chunkSize_;
+    bool keepMessages_;
+    uint64_t nextId_;
+    std::atomic<bool> shutdown_;
+    std::atomic<int> connectionFd_;
+
+    /* state of the connection */
+    bool subscribed_;
+    int rdy_;
+    int inFlight_;
+};
+
+} // namespace Datacratic
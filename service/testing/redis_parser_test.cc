@@ -0,0 +1,329 @@
+/* redis_parser_test.cc
+   Copyright (c) 2014 Datacratic.  All rights reserved.
+
+   Tests of the parser of Redis replies and of the replies it gives.
+*/
+
+#define BOOST_TEST_MAIN
+#define BOOST_TEST_DYN_LINK
+
+#include <string.h>
+#include <cmath>
+#include <memory>
+#include <string>
+#include <boost/test/unit_test.hpp>
+
+#include "soa/service/redis.h"
+
+using namespace std;
+using namespace Redis;
+
+
+namespace {
+
+/* Parses the first reply of "data", which must be complete */
+Reply
+parseReply(const string & data)
+{
+    std::shared_ptr<ReplyBuffer> buffer(new ReplyBuffer(data.size()));
+    memcpy(buffer->data, data.c_str(), data.size());
+    buffer->size = data.size();
+
+    size_t needed;
+    size_t length = ReplyParser::parse(buffer->data, buffer->size, 0,
+                                       buffer->nodes, needed);
+    BOOST_REQUIRE_EQUAL(length, data.size());
+    BOOST_CHECK_EQUAL(needed, 0);
+    return Reply(buffer, 0);
+}
+
+bool
+isProtocolError(const string & data)
+{
+    vector<ReplyNode> nodes;
+    size_t needed;
+    try {
+        ReplyParser::parse(data.c_str(), data.size(), 0, nodes, needed);
+    }
+    catch (const ML::Exception & exc) {
+        return true;
+    }
+    return false;
+}
+
+} // file scope
+
+
+BOOST_AUTO_TEST_CASE( test_redis_parser_resp2 )
+{
+    Reply status = parseReply("+OK\r\n");
+    BOOST_CHECK_EQUAL(status.type(), STATUS);
+    BOOST_CHECK_EQUAL(status.asString(), "OK");
+
+    Reply error = parseReply("-ERR unknown command\r\n");
+    BOOST_CHECK_EQUAL(error.type(), ERROR);
+    BOOST_CHECK_EQUAL(error.asString(), "ERR unknown command");
+
+    Reply integer = parseReply(":-1234\r\n");
+    BOOST_CHECK_EQUAL(integer.type(), INTEGER);
+    BOOST_CHECK_EQUAL(integer.asInt(), -1234);
+
+    Reply nil = parseReply("$-1\r\n");
+    BOOST_CHECK_EQUAL(nil.type(), NIL);
+    BOOST_CHECK_EQUAL(parseReply("*-1\r\n").type(), NIL);
+
+    /* bulk strings can hold anything, CRLF included */
+    Reply str = parseReply(string("$6\r\na\r\nb\0c\r\n", 12));
+    BOOST_CHECK_EQUAL(str.type(), STRING);
+    BOOST_CHECK_EQUAL(str.getString(), string("a\r\nb\0c", 6));
+    BOOST_CHECK_EQUAL(str.dataLength(), 6);
+    BOOST_CHECK_EQUAL(parseReply("$0\r\n\r\n").asString(), "");
+
+    Reply array = parseReply("*3\r\n$3\r\nfoo\r\n$-1\r\n:42\r\n");
+    BOOST_CHECK_EQUAL(array.type(), ARRAY);
+    BOOST_REQUIRE_EQUAL(array.length(), 3);
+    BOOST_CHECK_EQUAL(array[0].asString(), "foo");
+    BOOST_CHECK_EQUAL(array[1].type(), NIL);
+    BOOST_CHECK_EQUAL(array[2].asInt(), 42);
+    BOOST_CHECK_EQUAL(parseReply("*0\r\n").length(), 0);
+}
+
+BOOST_AUTO_TEST_CASE( test_redis_parser_nested )
+{
+    /* elements that are aggregates themselves are found by skipping over
+       the ones before */
+    Reply reply = parseReply("*4\r\n"
+                             "*2\r\n:1\r\n*1\r\n+a\r\n"
+                             "*0\r\n"
+                             "$1\r\nb\r\n"
+                             "*2\r\n:2\r\n:3\r\n");
+    BOOST_REQUIRE_EQUAL(reply.length(), 4);
+    BOOST_CHECK_EQUAL(reply[0].length(), 2);
+    BOOST_CHECK_EQUAL(reply[0][0].asInt(), 1);
+    BOOST_CHECK_EQUAL(reply[0][1][0].asString(), "a");
+    BOOST_CHECK_EQUAL(reply[1].length(), 0);
+    BOOST_CHECK_EQUAL(reply[2].asString(), "b");
+    BOOST_CHECK_EQUAL(reply[3][1].asInt(), 3);
+    BOOST_CHECK_EQUAL(reply.asJson()[3][0].asInt(), 2);
+
+    int n = 0;
+    for (Reply element: reply) {
+        BOOST_CHECK_EQUAL(element.asString(), reply[n].asString());
+        n++;
+    }
+    BOOST_CHECK_EQUAL(n, 4);
+}
+
+BOOST_AUTO_TEST_CASE( test_redis_parser_resp3 )
+{
+    BOOST_CHECK_EQUAL(parseReply("_\r\n").type(), NIL);
+
+    Reply boolean = parseReply("#t\r\n");
+    BOOST_CHECK_EQUAL(boolean.type(), BOOLEAN);
+    BOOST_CHECK_EQUAL(boolean.asInt(), 1);
+    BOOST_CHECK_EQUAL(parseReply("#f\r\n").asInt(), 0);
+
+    Reply number = parseReply(",3.25\r\n");
+    BOOST_CHECK_EQUAL(number.type(), DOUBLE);
+    BOOST_CHECK_EQUAL(number.asJson().asDouble(), 3.25);
+    BOOST_CHECK(std::isinf(parseReply(",-inf\r\n").asJson().asDouble()));
+
+    Reply big = parseReply("(3492890328409238509324850943850943825024385\r\n");
+    BOOST_CHECK_EQUAL(big.type(), STRING);
+    BOOST_CHECK_EQUAL(big.asString(),
+                      "3492890328409238509324850943850943825024385");
+
+    Reply verbatim = parseReply("=15\r\ntxt:Some string\r\n");
+    BOOST_CHECK_EQUAL(verbatim.type(), STRING);
+    BOOST_CHECK_EQUAL(verbatim.asString(), "Some string");
+
+    Reply blobError = parseReply("!21\r\nSYNTAX invalid syntax\r\n");
+    BOOST_CHECK_EQUAL(blobError.type(), ERROR);
+    BOOST_CHECK_EQUAL(blobError.asString(), "SYNTAX invalid syntax");
+
+    Reply map = parseReply("%2\r\n+first\r\n:1\r\n+second\r\n*1\r\n:2\r\n");
+    BOOST_CHECK_EQUAL(map.type(), MAP);
+    BOOST_REQUIRE_EQUAL(map.length(), 4);
+    BOOST_CHECK_EQUAL(map[2].asString(), "second");
+    BOOST_CHECK_EQUAL(map[3][0].asInt(), 2);
+    BOOST_CHECK_EQUAL(map.asJson()["first"].asInt(), 1);
+
+    Reply set = parseReply("~2\r\n$1\r\na\r\n$1\r\nb\r\n");
+    BOOST_CHECK_EQUAL(set.type(), ARRAY);
+    BOOST_CHECK_EQUAL(set[1].asString(), "b");
+
+    Reply push = parseReply(">2\r\n+message\r\n+hello\r\n");
+    BOOST_CHECK_EQUAL(push.type(), PUSH);
+    BOOST_CHECK_EQUAL(push.length(), 2);
+
+    /* attributes are skipped, the reply is what follows them */
+    Reply withAttribute
+        = parseReply("|1\r\n+key-popularity\r\n%1\r\n$1\r\na\r\n,0.1923\r\n"
+                     "*2\r\n:2039123\r\n:9543892\r\n");
+    BOOST_CHECK_EQUAL(withAttribute.type(), ARRAY);
+    BOOST_CHECK_EQUAL(withAttribute[1].asInt(), 9543892);
+}
+
+/* replies are only parsed once they are complete, whatever the point they
+   are split at */
+BOOST_AUTO_TEST_CASE( test_redis_parser_incomplete )
+{
+    string data = "*3\r\n$5\r\nhello\r\n*2\r\n:1\r\n$-1\r\n+OK\r\n"
+        "$10\r\n0123456789\r\n";
+    size_t firstLength = data.size() - strlen("$10\r\n0123456789\r\n");
+
+    for (size_t size = 0;  size < data.size();  ++size) {
+        vector<ReplyNode> nodes;
+        size_t needed;
+        size_t length = ReplyParser::parse(data.c_str(), size, 0, nodes,
+                                           needed);
+        if (size < firstLength) {
+            BOOST_CHECK_EQUAL(length, 0);
+            BOOST_CHECK_EQUAL(nodes.size(), 0);
+            BOOST_CHECK_GT(needed, size);
+            BOOST_CHECK_LE(needed, firstLength);
+        }
+        else {
+            BOOST_CHECK_EQUAL(length, firstLength);
+            BOOST_CHECK_EQUAL(nodes.size(), 6);
+        }
+    }
+
+    /* the second reply, at an offset in its buffer */
+    const char * second = data.c_str() + firstLength;
+    vector<ReplyNode> nodes;
+    size_t needed;
+    BOOST_CHECK_EQUAL(ReplyParser::parse(second, 6, firstLength, nodes,
+                                         needed), 0);
+    /* the size of the bulk string is known as soon as its header is read */
+    BOOST_CHECK_EQUAL(needed, 17);
+    BOOST_CHECK_EQUAL(ReplyParser::parse(second, 17, firstLength, nodes,
+                                         needed), 17);
+    BOOST_REQUIRE_EQUAL(nodes.size(), 1);
+    BOOST_CHECK_EQUAL(nodes[0].offset, firstLength + 5);
+    BOOST_CHECK_EQUAL(nodes[0].length, 10);
+}
+
+/* a large reply read in small pieces is parsed once, whatever the buffer
+   its bytes end up in */
+BOOST_AUTO_TEST_CASE( test_redis_parser_feed )
+{
+    int numElements = 20000;
+    string data = "*" + to_string(numElements) + "\r\n";
+    for (int i = 0;  i < numElements;  ++i) {
+        // Some of the elements are pairs of an integer and a string
+        if (i % 100 == 0)
+            data += "*2\r\n:" + to_string(i) + "\r\n";
+        string value = "value" + to_string(i);
+        data += "$" + to_string(value.size()) + "\r\n" + value + "\r\n";
+    }
+    data += "+OK\r\n";
+
+    ReplyParser parser;
+    std::shared_ptr<ReplyBuffer> buffer(new ReplyBuffer(64));
+    size_t pos = 0;          // Of the reply in the buffer
+    size_t needed = 1;
+    size_t numFeeds = 0;
+    size_t parsed = 0;
+    int numReplies = 0;
+
+    for (size_t done = 0;  done < data.size();  /* no inc */) {
+        size_t chunk = std::min<size_t>(7, data.size() - done);
+        if (buffer->size + chunk > buffer->capacity) {
+            // Move what is left of the reply to the start of a new buffer
+            std::shared_ptr<ReplyBuffer> newBuffer
+                (new ReplyBuffer(2 * buffer->capacity));
+            memcpy(newBuffer->data, buffer->data + pos, buffer->size - pos);
+            newBuffer->size = buffer->size - pos;
+            parser.relocate(buffer->nodes, newBuffer->nodes, 0);
+            buffer = newBuffer;
+            pos = 0;
+        }
+        memcpy(buffer->data + buffer->size, data.c_str() + done, chunk);
+        buffer->size += chunk;
+        done += chunk;
+
+        while (buffer->size - pos >= needed) {
+            ++numFeeds;
+            size_t length = parser.feed(buffer->data + pos,
+                                        buffer->size - pos,
+                                        pos, buffer->nodes, needed);
+            if (!length)
+                break;
+
+            Reply reply(buffer, parser.rootNode());
+            if (numReplies++ == 0) {
+                BOOST_REQUIRE_EQUAL(reply.length(), numElements);
+                BOOST_CHECK_EQUAL(reply[100].length(), 2);
+                BOOST_CHECK_EQUAL(reply[100][0].asInt(), 100);
+                BOOST_CHECK_EQUAL(reply[100][1].asString(), "value100");
+                BOOST_CHECK_EQUAL(reply[numElements - 1].asString(),
+                                  "value" + to_string(numElements - 1));
+            }
+            else BOOST_CHECK_EQUAL(reply.asString(), "OK");
+
+            pos += length;
+            parsed += length;
+            needed = 1;
+        }
+    }
+
+    BOOST_CHECK_EQUAL(numReplies, 2);
+    BOOST_CHECK_EQUAL(parsed, data.size());
+
+    // Each element was parsed once, rather than once per feed
+    BOOST_CHECK_GT(numFeeds, numElements);
+    // The two replies, the strings and the pairs with their integers
+    BOOST_CHECK_EQUAL(parser.numElementsParsed, 2 + numElements + 2 * 200);
+}
+
+/* attributes that follow each other are skipped without recursing */
+BOOST_AUTO_TEST_CASE( test_redis_parser_attributes )
+{
+    string data;
+    for (int i = 0;  i < 100000;  ++i)
+        data += "|1\r\n+key\r\n:1\r\n";
+    data += ":2\r\n";
+    Reply reply = parseReply(data);
+    BOOST_CHECK_EQUAL(reply.type(), INTEGER);
+    BOOST_CHECK_EQUAL(reply.asInt(), 2);
+
+    // but count in the nesting of the aggregates they are in
+    string deep;
+    for (int i = 0;  i <= ReplyParser::MaxDepth;  ++i)
+        deep += "|1\r\n";
+    deep += "+key\r\n:1\r\n";
+    BOOST_CHECK(isProtocolError(deep));
+}
+
+BOOST_AUTO_TEST_CASE( test_redis_parser_errors )
+{
+    BOOST_CHECK(isProtocolError("?\r\n"));
+    BOOST_CHECK(isProtocolError("+OK\rX"));
+    BOOST_CHECK(isProtocolError(":12a\r\n"));
+    BOOST_CHECK(isProtocolError(":\r\n"));
+    BOOST_CHECK(isProtocolError("$-2\r\n"));
+    BOOST_CHECK(isProtocolError("$3\r\nfoobar\r\n"));
+    BOOST_CHECK(isProtocolError("#x\r\n"));
+    BOOST_CHECK(isProtocolError(",abc\r\n"));
+    BOOST_CHECK(isProtocolError("=3\r\ntxt\r\n"));
+
+    string deep;
+    for (int i = 0;  i <= ReplyParser::MaxDepth;  ++i)
+        deep += "*1\r\n";
+    deep += ":1\r\n";
+    BOOST_CHECK(isProtocolError(deep));
+}
+
+/* a deep copy holds only the bytes of its reply */
+BOOST_AUTO_TEST_CASE( test_redis_reply_deep_copy )
+{
+    Reply reply = parseReply("*2\r\n*2\r\n$3\r\nfoo\r\n:5\r\n$3\r\nbar\r\n");
+    Reply copy = reply[0].deepCopy();
+
+    BOOST_REQUIRE_EQUAL(copy.length(), 2);
+    BOOST_CHECK_EQUAL(copy[0].asString(), "foo");
+    BOOST_CHECK_EQUAL(copy[1].asInt(), 5);
+    BOOST_CHECK(copy[0].data() != reply[0][0].data());
+    BOOST_CHECK_EQUAL(reply.deepCopy().asString(), reply.asString());
+}
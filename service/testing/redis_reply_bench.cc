@@ -0,0 +1,163 @@
+/* redis_reply_bench.cc
+   Copyright (c) 2014 Datacratic.  All rights reserved.
+
+   Replies per second of the Redis reply parser on its own, and of an
+   AsyncConnection with a window of pipelined GET and MGET commands against
+   a temporary redis-server, with the heap allocations per reply.
+
+   The allocations are those of the whole process, counted by wrapping
+   malloc(); those of a command (its Command, request data and callback)
+   are included.
+
+   Usage: redis_reply_bench [numReplies [valueSize [mgetKeys]]]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include "jml/arch/futex.h"
+#include "soa/service/redis.h"
+#include "soa/service/testing/redis_temporary_server.h"
+
+using namespace std;
+using namespace Datacratic;
+using namespace Redis;
+
+
+namespace {
+
+std::atomic<uint64_t> numAllocations(0);
+
+/* Parse a buffer of replies over and over, touching each element */
+void
+benchParser(const char * name, const string & reply, int numReplies)
+{
+    int repliesPerBuffer = std::max<int>(1, 65536 / reply.size());
+    string data;
+    for (int i = 0;  i < repliesPerBuffer;  ++i)
+        data += reply;
+
+    std::shared_ptr<ReplyBuffer> buffer(new ReplyBuffer(data.size()));
+    memcpy(buffer->data, data.c_str(), data.size());
+    buffer->size = data.size();
+
+    size_t totalLength = 0;
+    uint64_t allocations = numAllocations;
+    Date start = Date::now();
+    for (int done = 0;  done < numReplies;  done += repliesPerBuffer) {
+        buffer->nodes.clear();
+        size_t pos = 0, needed;
+        while (pos < buffer->size) {
+            uint32_t root = buffer->nodes.size();
+            pos += ReplyParser::parse(buffer->data + pos, buffer->size - pos,
+                                      pos, buffer->nodes, needed);
+            Reply parsed(buffer, root);
+            if (parsed.type() == ARRAY) {
+                for (Reply element: parsed)
+                    if (element.type() == STRING)
+                        totalLength += element.dataLength();
+            }
+            else totalLength += parsed.dataLength();
+        }
+    }
+    double elapsed = Date::now().secondsSince(start);
+    allocations = numAllocations - allocations;
+
+    int parsed = (numReplies + repliesPerBuffer - 1) / repliesPerBuffer
+        * repliesPerBuffer;
+    printf("%-16s %12.0f %10.0f %12.2f\n", name, parsed / elapsed,
+           elapsed * 1e9 / parsed, (double)allocations / parsed);
+    if (!totalLength)
+        printf("no values\n");
+}
+
+/* Keep "window" commands in flight until "numReplies" have been read */
+void
+benchConnection(const char * name, AsyncConnection & connection,
+                const Command & command, int numReplies, int window)
+{
+    int numSent(0), numDone(0), numErrors(0);
+    AsyncConnection::OnResult onResult;
+    onResult = [&] (const Result & result)
+        {
+            if (!result)
+                numErrors++;
+            if (numSent < numReplies) {
+                numSent++;
+                connection.queue(command, onResult);
+            }
+            if (++numDone == numReplies)
+                ML::futex_wake(numDone);
+        };
+
+    uint64_t allocations = numAllocations;
+    Date start = Date::now();
+    for (;  numSent < window && numSent < numReplies;  numSent++)
+        connection.queue(command, onResult);
+    while (numDone < numReplies) {
+        int old = numDone;
+        ML::futex_wait(numDone, old, 0.1);
+    }
+    double elapsed = Date::now().secondsSince(start);
+    allocations = numAllocations - allocations;
+
+    printf("%-16s %12.0f %10.0f %12.2f\n", name, numReplies / elapsed,
+           elapsed * 1e9 / numReplies, (double)allocations / numReplies);
+    if (numErrors)
+        printf("%d errors\n", numErrors);
+}
+
+} // file scope
+
+extern "C" void * __libc_malloc(size_t size);
+
+extern "C" void * malloc(size_t size)
+{
+    numAllocations.fetch_add(1, std::memory_order_relaxed);
+    return __libc_malloc(size);
+}
+
+
+int main(int argc, char ** argv)
+{
+    int numReplies = argc > 1 ? atoi(argv[1]) : 500000;
+    int valueSize = argc > 2 ? atoi(argv[2]) : 100;
+    int mgetKeys = argc > 3 ? atoi(argv[3]) : 20;
+
+    string value(valueSize, 'v');
+
+    string getReply = ML::format("$%d\r\n%s\r\n", valueSize, value.c_str());
+    string mgetReply = ML::format("*%d\r\n", mgetKeys);
+    for (int i = 0;  i < mgetKeys;  ++i)
+        mgetReply += (i % 5 == 4 ? string("$-1\r\n") : getReply);
+
+    printf("%d replies, values of %d bytes, MGET of %d keys\n",
+           numReplies, valueSize, mgetKeys);
+    printf("%-16s %12s %10s %12s\n",
+           "bench", "replies/s", "ns/reply", "allocs/reply");
+
+    benchParser("parse GET", getReply, numReplies);
+    benchParser("parse MGET", mgetReply, numReplies);
+
+    RedisTemporaryServer redis;
+    AsyncConnection connection(redis);
+    connection.test();
+
+    Command mget(MGET);
+    for (int i = 0;  i < mgetKeys;  ++i) {
+        string key = "key" + to_string(i);
+        if (i % 5 != 4)
+            connection.exec(SET(key, value));
+        mget.addArg(key);
+    }
+
+    benchConnection("GET 1", connection, GET("key0"), numReplies / 10, 1);
+    benchConnection("GET 100", connection, GET("key0"), numReplies, 100);
+    benchConnection("MGET 100", connection, mget, numReplies / 4, 100);
+
+    return 0;
+}
@@ -0,0 +1,133 @@
+/* redis_sharded_bench.cc
+   Copyright (c) 2014 Datacratic.  All rights reserved.
+
+   Commands per second of a ShardedConnection against 1, 2, 4... temporary
+   redis-servers, with a window of pipelined GET and SET of random keys and
+   MGET of keys spread over all the shards.
+
+   Usage: redis_sharded_bench [numCommands [maxShards [connectionsPerShard]]]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "jml/arch/futex.h"
+#include "soa/service/redis_sharded.h"
+#include "soa/service/testing/redis_temporary_server.h"
+
+using namespace std;
+using namespace Datacratic;
+using namespace Redis;
+
+
+namespace {
+
+/* Keep "window" commands in flight until "numCommands" have been done */
+double
+bench(ShardedConnection & redis,
+      const std::function<Command (int)> & makeCommand,
+      int numCommands, int window)
+{
+    int numSent(0), numDone(0), numErrors(0);
+    std::mutex lock;
+
+    ShardedConnection::OnResult onResult;
+    onResult = [&] (const Result & result)
+        {
+            int next = -1;
+            {
+                std::unique_lock<std::mutex> guard(lock);
+                if (!result)
+                    numErrors++;
+                if (numSent < numCommands)
+                    next = numSent++;
+            }
+            if (next != -1)
+                redis.queue(makeCommand(next), onResult);
+            if (__sync_add_and_fetch(&numDone, 1) == numCommands)
+                ML::futex_wake(numDone);
+        };
+
+    Date start = Date::now();
+    for (int i = 0;  i < window;  ++i) {
+        int next;
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            if (numSent == numCommands)
+                break;
+            next = numSent++;
+        }
+        redis.queue(makeCommand(next), onResult);
+    }
+    while (numDone < numCommands) {
+        int old = numDone;
+        ML::futex_wait(numDone, old, 0.1);
+    }
+    double elapsed = Date::now().secondsSince(start);
+
+    if (numErrors)
+        printf("%d errors\n", numErrors);
+    return numCommands / elapsed;
+}
+
+} // file scope
+
+
+int main(int argc, char ** argv)
+{
+    int numCommands = argc > 1 ? atoi(argv[1]) : 200000;
+    int maxShards = argc > 2 ? atoi(argv[2]) : 4;
+    int connectionsPerShard = argc > 3 ? atoi(argv[3]) : 2;
+
+    int numKeys = 10000;
+    int window = 400;
+    int mgetKeys = 20;
+    string value(100, 'v');
+
+    printf("%d commands, %d connections per shard, window of %d\n",
+           numCommands, connectionsPerShard, window);
+    printf("%-8s %12s %12s %12s\n", "shards", "GET/s", "SET/s", "MGET/s");
+
+    std::vector<std::unique_ptr<RedisTemporaryServer> > servers;
+    std::vector<Address> addresses;
+
+    for (int numShards = 1;  numShards <= maxShards;  numShards *= 2) {
+        while (servers.size() < numShards) {
+            servers.emplace_back(new RedisTemporaryServer());
+            addresses.push_back(*servers.back());
+        }
+
+        ShardedConnection redis(addresses, connectionsPerShard);
+        redis.test();
+
+        auto key = [&] (int i)
+            {
+                return "key" + to_string((i * 7919u) % numKeys);
+            };
+
+        double sets = bench(redis,
+                            [&] (int i) { return SET(key(i), value); },
+                            numCommands, window);
+        double gets = bench(redis,
+                            [&] (int i) { return GET(key(i)); },
+                            numCommands, window);
+        double mgets = bench(redis,
+                             [&] (int i)
+                             {
+                                 Command mget(MGET);
+                                 for (int j = 0;  j < mgetKeys;  ++j)
+                                     mget.addArg(key(i * mgetKeys + j));
+                                 return mget;
+                             },
+                             numCommands / 10, window / 10);
+
+        printf("%-8d %12.0f %12.0f %12.0f\n", numShards, gets, sets, mgets);
+    }
+
+    return 0;
+}
@@ -0,0 +1,275 @@
+/* redis_sharded_test.cc
+   Copyright (c) 2014 Datacratic.  All rights reserved.
+
+   Test for the sharded Redis connection.
+*/
+
+#define BOOST_TEST_MAIN
+#define BOOST_TEST_DYN_LINK
+
+#include <iostream>
+#include <memory>
+#include "soa/service/redis_sharded.h"
+#include "soa/service/testing/redis_temporary_server.h"
+#include <boost/test/unit_test.hpp>
+#include "jml/arch/timers.h"
+
+using namespace std;
+using namespace Datacratic;
+using namespace Redis;
+
+
+namespace {
+
+struct Servers {
+    Servers(int numServers)
+    {
+        for (int i = 0;  i < numServers;  ++i)
+            add();
+    }
+
+    void add()
+    {
+        servers.emplace_back(new RedisTemporaryServer());
+        addresses.push_back(*servers.back());
+        connections.emplace_back(new AsyncConnection(*servers.back()));
+    }
+
+    std::vector<std::unique_ptr<RedisTemporaryServer> > servers;
+    std::vector<Address> addresses;
+
+    /* Direct connections, to see where the keys went */
+    std::vector<std::unique_ptr<AsyncConnection> > connections;
+};
+
+} // file scope
+
+
+BOOST_AUTO_TEST_CASE( test_sharded_placement )
+{
+    Servers servers(3);
+    ShardedConnection redis(servers.addresses, 2);
+    redis.test();
+
+    BOOST_CHECK_EQUAL(redis.numShards(), 3);
+
+    int numKeys = 300;
+    std::vector<int> perShard(3);
+    for (int i = 0;  i < numKeys;  ++i) {
+        string key = "key" + to_string(i);
+        Result result = redis.exec(SET(key, to_string(i)));
+        BOOST_REQUIRE(result);
+        BOOST_CHECK_EQUAL(result.reply().asString(), "OK");
+
+        int shard = redis.shardOf(key);
+        perShard[shard]++;
+
+        // The key is on its shard only
+        for (int j = 0;  j < 3;  ++j) {
+            Result direct = servers.connections[j]->exec(GET(key));
+            BOOST_REQUIRE(direct);
+            if (j == shard)
+                BOOST_CHECK_EQUAL(direct.reply().asString(), to_string(i));
+            else BOOST_CHECK_EQUAL(direct.reply().type(), NIL);
+        }
+
+        result = redis.exec(GET(key));
+        BOOST_REQUIRE(result);
+        BOOST_CHECK_EQUAL(result.reply().asString(), to_string(i));
+    }
+
+    // Roughly balanced
+    for (int n: perShard) {
+        cerr << "keys on shard: " << n << endl;
+        BOOST_CHECK_GT(n, numKeys / 6);
+    }
+
+    // Keys with the same hash tag go together
+    int shard = redis.shardOf("{user1000}.name");
+    BOOST_CHECK_EQUAL(redis.shardOf("{user1000}.email"), shard);
+    BOOST_CHECK_EQUAL(redis.shardOf("user1000"), shard);
+    BOOST_CHECK_EQUAL(redis.shardOf("x{user1000}y{z}"), shard);
+
+    auto status = redis.shardStatus();
+    BOOST_REQUIRE_EQUAL(status.size(), 3);
+    uint64_t numRequests = 0;
+    for (auto & s: status) {
+        BOOST_CHECK(s.up);
+        BOOST_CHECK_EQUAL(s.numFailures, 0);
+        numRequests += s.numRequests;
+    }
+    BOOST_CHECK_EQUAL(numRequests, 2 * numKeys);
+
+    // No key to shard by, or a command that needs a single server
+    BOOST_CHECK_THROW(redis.queue(KEYS("*")), ML::Exception);
+    BOOST_CHECK_THROW(redis.queue(PING), ML::Exception);
+    BOOST_CHECK_THROW(redis.queue(MULTI), ML::Exception);
+}
+
+BOOST_AUTO_TEST_CASE( test_sharded_fan_out )
+{
+    Servers servers(3);
+    ShardedConnection redis(servers.addresses);
+
+    // MSET over all the shards
+    Command mset(MSET);
+    int numKeys = 30;
+    for (int i = 0;  i < numKeys;  ++i) {
+        mset.addArg("key" + to_string(i));
+        mset.addArg("value" + to_string(i));
+    }
+    Result result = redis.exec(mset);
+    BOOST_REQUIRE(result);
+    BOOST_CHECK_EQUAL(result.reply().asString(), "OK");
+
+    for (int i = 0;  i < numKeys;  ++i) {
+        string key = "key" + to_string(i);
+        Result direct = servers.connections[redis.shardOf(key)]->exec(GET(key));
+        BOOST_CHECK_EQUAL(direct.reply().asString(), "value" + to_string(i));
+    }
+
+    // MGET with missing keys, in order
+    Command mget(MGET);
+    for (int i = 0;  i < numKeys + 10;  ++i)
+        mget.addArg("key" + to_string(i % 2 ? i : numKeys + i));
+    result = redis.exec(mget);
+    BOOST_REQUIRE(result);
+    Reply reply = result.reply();
+    BOOST_REQUIRE_EQUAL(reply.type(), ARRAY);
+    BOOST_REQUIRE_EQUAL(reply.length(), numKeys + 10);
+    for (int i = 0;  i < numKeys + 10;  ++i) {
+        if (i % 2 && i < numKeys)
+            BOOST_CHECK_EQUAL(reply[i].asString(), "value" + to_string(i));
+        else BOOST_CHECK_EQUAL(reply[i].type(), NIL);
+    }
+
+    // The reply outlives the replies it was put together from
+    Reply copy = reply.deepCopy();
+    BOOST_CHECK_EQUAL(copy[1].asString(), "value1");
+
+    // Keys that are all on one shard go as they are
+    Command tagged(MGET);
+    tagged.addArg("{tag}1");
+    tagged.addArg("{tag}2");
+    result = redis.exec(tagged);
+    BOOST_REQUIRE(result);
+    BOOST_CHECK_EQUAL(result.reply().length(), 2);
+
+    // EXISTS and DEL count over all the shards
+    Command exists(EXISTS);
+    Command del(DEL);
+    for (int i = 0;  i < numKeys;  ++i) {
+        exists.addArg("key" + to_string(i * 2));
+        del.addArg("key" + to_string(i * 2));
+    }
+    result = redis.exec(exists);
+    BOOST_REQUIRE(result);
+    BOOST_CHECK_EQUAL(result.reply().asInt(), numKeys / 2);
+
+    result = redis.exec(del);
+    BOOST_REQUIRE(result);
+    BOOST_CHECK_EQUAL(result.reply().asInt(), numKeys / 2);
+
+    result = redis.exec(exists);
+    BOOST_REQUIRE(result);
+    BOOST_CHECK_EQUAL(result.reply().asInt(), 0);
+
+    // An MSET with a key and no value
+    Command odd(MSET);
+    odd.addArg("key");
+    BOOST_CHECK_THROW(redis.queue(odd), ML::Exception);
+}
+
+BOOST_AUTO_TEST_CASE( test_sharded_add_shard )
+{
+    Servers servers(3);
+    ShardedConnection redis(servers.addresses);
+
+    int numKeys = 1000;
+    std::vector<int> before;
+    for (int i = 0;  i < numKeys;  ++i)
+        before.push_back(redis.shardOf("key" + to_string(i)));
+
+    servers.add();
+    redis.connect(servers.addresses);
+    BOOST_CHECK_EQUAL(redis.numShards(), 4);
+
+    // Only the keys of the new shard move
+    int numMoved = 0;
+    for (int i = 0;  i < numKeys;  ++i) {
+        int shard = redis.shardOf("key" + to_string(i));
+        if (shard != before[i]) {
+            BOOST_CHECK_EQUAL(shard, 3);
+            ++numMoved;
+        }
+    }
+    cerr << numMoved << " keys of " << numKeys << " moved" << endl;
+    BOOST_CHECK_GT(numMoved, numKeys / 8);
+    BOOST_CHECK_LT(numMoved, numKeys / 2);
+}
+
+BOOST_AUTO_TEST_CASE( test_sharded_health )
+{
+    Servers servers(2);
+    ShardedConnection redis;
+    redis.setHealthChecks(2, 0.1);
+    redis.connect(servers.addresses);
+    redis.test();
+
+    string key0, key1;
+    for (int i = 0;  key0.empty() || key1.empty();  ++i) {
+        string key = "key" + to_string(i);
+        (redis.shardOf(key) == 0 ? key0 : key1) = key;
+    }
+
+    servers.servers[1]->suspend();
+
+    // Timeouts until the shard is marked down
+    for (int i = 0;  i < 2;  ++i) {
+        Result result = redis.exec(SET(key1, "value"), 0.1);
+        BOOST_CHECK(result.timedOut());
+    }
+    BOOST_CHECK(!redis.shardStatus()[1].up);
+    BOOST_CHECK_EQUAL(redis.shardStatus()[1].numFailures, 2);
+
+    // Then failures right away; the other shard still works
+    Date start = Date::now();
+    Result result = redis.exec(SET(key1, "value"), 10.0);
+    BOOST_CHECK(!result);
+    BOOST_CHECK(!result.timedOut());
+    BOOST_CHECK_LT(Date::now().secondsSince(start), 0.05);
+
+    result = redis.exec(SET(key0, "value"));
+    BOOST_CHECK(result);
+
+    Command mget(MGET);
+    mget.addArg(key0);
+    mget.addArg(key1);
+    result = redis.exec(mget);
+    BOOST_CHECK(!result);
+
+    // Back up once it replies again
+    servers.servers[1]->resume();
+    for (int i = 0;  i < 50 && !redis.shardStatus()[1].up;  ++i)
+        ML::sleep(0.1);
+    BOOST_REQUIRE(redis.shardStatus()[1].up);
+
+    result = redis.exec(SET(key1, "value"));
+    BOOST_CHECK(result);
+    result = redis.exec(mget);
+    BOOST_REQUIRE(result);
+    BOOST_CHECK_EQUAL(result.reply()[1].asString(), "value");
+
+    // Lost connections are replaced
+    servers.servers[0]->shutdown();
+    result = redis.exec(GET(key0), 1.0);
+    BOOST_CHECK(!result);
+    servers.servers[0]->start();
+    for (int i = 0;  i < 50;  ++i) {
+        result = redis.exec(GET(key0), 1.0);
+        if (result)
+            break;
+        ML::sleep(0.1);
+    }
+    BOOST_CHECK(result);
+}
@@ -0,0 +1,124 @@
+/* rest_request_binding_bench.cc
+   Copyright (c) 2014 Datacratic.  All rights reserved.
+
+   Calls per second of a bound POST route with query string and JSON body
+   parameters, and of the decoding of its body through a Json::Value and
+   straight from the payload.
+
+   Usage: rest_request_binding_bench [numCalls]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+
+#include "jml/arch/timers.h"
+#include "soa/types/value_description.h"
+#include "soa/types/basic_value_descriptions.h"
+#include "soa/service/rest_request_binding.h"
+
+using namespace std;
+using namespace Datacratic;
+
+
+namespace {
+
+struct Item {
+    Item()
+        : price(0.0), quantity(0)
+    {
+    }
+
+    string id;
+    double price;
+    int quantity;
+    vector<string> tags;
+};
+
+CREATE_STRUCTURE_DESCRIPTION(Item);
+
+ItemDescription::
+ItemDescription()
+{
+    addField("id", &Item::id, "Id of the item");
+    addField("price", &Item::price, "Price of the item");
+    addField("quantity", &Item::quantity, "Quantity in stock");
+    addField("tags", &Item::tags, "Tags of the item");
+}
+
+struct ItemService {
+    ItemService()
+        : numItems(0), totalQuantity(0)
+    {
+    }
+
+    void postItem(const RestServiceEndpoint::ConnectionId & connection,
+                  int shard, const string & mode, const Item & item)
+    {
+        ++numItems;
+        totalQuantity += item.quantity + shard + mode.size();
+    }
+
+    size_t numItems;
+    size_t totalQuantity;
+};
+
+template<typename Fn>
+void time(const char * name, int numCalls, const Fn & fn)
+{
+    ML::Timer timer;
+    for (int i = 0;  i < numCalls;  ++i)
+        fn();
+    double elapsed = timer.elapsed_wall();
+    printf("%-24s %12.0f calls/s\n", name, numCalls / elapsed);
+}
+
+} // file scope
+
+
+int main(int argc, char ** argv)
+{
+    int numCalls = argc > 1 ? atoi(argv[1]) : 200000;
+
+    ItemService service;
+    RestRequestRouter router;
+    addRouteAsync(router, "/items", { "POST" }, "Add an item",
+                  &ItemService::postItem, &service,
+                  PassConnectionId(),
+                  RestParam<int>("shard", "Shard of the item"),
+                  RestParamDefault<string>("mode", "Write mode", "sync"),
+                  JsonParam<Item>("", "Item to add"));
+
+    string payload = "{\"id\":\"sku-123456\",\"price\":12.5,\"quantity\":3,"
+        "\"tags\":[\"blue\",\"large\",\"sale\"]}";
+    RestParams params;
+    params.push_back({ "user", "alice" });
+    params.push_back({ "trace", "0" });
+    params.push_back({ "shard", "4" });
+    RestRequest request("POST", "/items", params, payload);
+    RestServiceEndpoint::ConnectionId connection;
+
+    printf("%d calls\n", numCalls);
+
+    time("route", numCalls, [&] ()
+         {
+             RestRequestParsingContext context(request);
+             router.processRequest(connection, request, context);
+         });
+
+    time("body via Json::Value", numCalls, [&] ()
+         {
+             Item item = jsonDecode(Json::parse(payload), (Item *)0);
+             service.totalQuantity += item.quantity;
+         });
+
+    time("body streamed", numCalls, [&] ()
+         {
+             Item item = RestJsonParamDecoder<Item>::decode(payload, "");
+             service.totalQuantity += item.quantity;
+         });
+
+    if (service.numItems != numCalls)
+        fprintf(stderr, "route was called %zd times\n", service.numItems);
+}
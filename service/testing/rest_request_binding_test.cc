@@ -0,0 +1,174 @@
+/* rest_request_binding_test.cc
+   Copyright (c) 2014 Datacratic.  All rights reserved.
+
+   Tests for the extraction of the parameters of bound REST routes.
+*/
+
+#define BOOST_TEST_MAIN
+#define BOOST_TEST_DYN_LINK
+
+#include <string>
+#include <vector>
+#include <boost/test/unit_test.hpp>
+#include "soa/types/value_description.h"
+#include "soa/types/basic_value_descriptions.h"
+#include "soa/service/rest_request_binding.h"
+
+using namespace std;
+using namespace Datacratic;
+
+
+namespace {
+
+struct Point {
+    Point()
+        : x(0), y(0)
+    {
+    }
+
+    int x;
+    int y;
+};
+
+CREATE_STRUCTURE_DESCRIPTION(Point);
+
+PointDescription::
+PointDescription()
+{
+    addField("x", &Point::x, "X coordinate");
+    addField("y", &Point::y, "Y coordinate");
+}
+
+struct Recorder {
+    void record(const RestServiceEndpoint::ConnectionId & connection,
+                int count, const string & mode, const Point & point)
+    {
+        calls.push_back(to_string(count) + " " + mode + " "
+                        + to_string(point.x) + "," + to_string(point.y));
+    }
+
+    void recordMember(const RestServiceEndpoint::ConnectionId & connection,
+                      const Point & point, const Json::Value & extra)
+    {
+        calls.push_back(to_string(point.x) + "," + to_string(point.y)
+                        + " " + extra["a"].asString());
+    }
+
+    vector<string> calls;
+};
+
+RestRequestRouter::MatchResult
+call(RestRequestRouter & router, const string & resource,
+     const RestParams & params, const string & payload)
+{
+    RestRequest request("POST", resource, params, payload);
+    RestRequestParsingContext context(request);
+    RestServiceEndpoint::ConnectionId connection;
+    return router.processRequest(connection, request, context);
+}
+
+} // file scope
+
+
+BOOST_AUTO_TEST_CASE( test_query_index )
+{
+    RestQueryIndex index;
+    BOOST_CHECK_EQUAL(index.add("a"), 0);
+    BOOST_CHECK_EQUAL(index.add("b"), 1);
+    BOOST_CHECK_EQUAL(index.add("a"), 0);
+
+    RestParams params;
+    params.push_back({ "c", "0" });
+    params.push_back({ "a", "1" });
+    params.push_back({ "a", "2" });
+
+    /* the first value wins, like with RestParams::getValue() */
+    RestQueryValues values(index, params);
+    BOOST_REQUIRE(values[0]);
+    BOOST_CHECK_EQUAL(*values[0], "1");
+    BOOST_CHECK(!values[1]);
+}
+
+BOOST_AUTO_TEST_CASE( test_bound_route )
+{
+    Recorder recorder;
+    RestRequestRouter router;
+    addRouteAsync(router, "/points", { "POST" }, "Record a point",
+                  &Recorder::record, &recorder,
+                  PassConnectionId(),
+                  RestParam<int>("count", "Count"),
+                  RestParamDefault<string>("mode", "Mode", "slow"),
+                  JsonParam<Point>("", "Point"));
+    addRouteAsync(router, "/members", { "POST" }, "Record a member",
+                  &Recorder::recordMember, &recorder,
+                  PassConnectionId(),
+                  JsonParam<Point>("point", "Point"),
+                  JsonParam<Json::Value>("extra", "Anything"));
+
+    RestParams params;
+    params.push_back({ "count", "3" });
+    auto res = call(router, "/points", params, "{\"y\": 2, \"x\": 1}");
+    BOOST_CHECK_EQUAL(res, RestRequestRouter::MR_YES);
+
+    params.push_back({ "mode", "fast" });
+    call(router, "/points", params, " {\"x\":-4,\"y\":5} ");
+
+    call(router, "/members", {},
+         "{\"other\":[1,{\"x\":9}],\"point\":{\"x\":7,\"y\":8},"
+         "\"extra\":{\"a\":\"b\"}}");
+
+    BOOST_REQUIRE_EQUAL(recorder.calls.size(), 3);
+    BOOST_CHECK_EQUAL(recorder.calls[0], "3 slow 1,2");
+    BOOST_CHECK_EQUAL(recorder.calls[1], "3 fast -4,5");
+    BOOST_CHECK_EQUAL(recorder.calls[2], "7,8 b");
+}
+
+BOOST_AUTO_TEST_CASE( test_json_param_decoder )
+{
+    typedef RestJsonParamDecoder<Point> Decoder;
+
+    Point point = Decoder::decode("{\"a\":{\"x\":1},\"b\":{\"x\":2,\"y\":3}}",
+                                  "b");
+    BOOST_CHECK_EQUAL(point.x, 2);
+    BOOST_CHECK_EQUAL(point.y, 3);
+
+    /* a missing member decodes as null */
+    point = Decoder::decode("{\"a\":{\"x\":1}}", "b");
+    BOOST_CHECK_EQUAL(point.x, 0);
+
+    BOOST_CHECK_THROW(Decoder::decode("{\"x\":\"one\"}", ""), std::exception);
+    BOOST_CHECK_THROW(Decoder::decode("[1,2]", "b"), std::exception);
+
+    /* members given twice and trailing characters are rejected */
+    BOOST_CHECK_THROW(Decoder::decode("{\"b\":{\"x\":1},\"b\":{\"x\":2}}", "b"),
+                      std::exception);
+    BOOST_CHECK_THROW(Decoder::decode("{\"a\":1,\"a\":2,\"b\":{}}", "b"),
+                      std::exception);
+    BOOST_CHECK_THROW(Decoder::decode("{\"x\":1} x", ""), std::exception);
+    BOOST_CHECK_THROW(Decoder::decode("{\"b\":{\"x\":1}}}", "b"),
+                      std::exception);
+    BOOST_CHECK_EQUAL(Decoder::decode("{\"b\":{\"x\":1}}\n", "b").x, 1);
+}
+
+BOOST_AUTO_TEST_CASE( test_legacy_extractors )
+{
+    Json::Value help;
+    auto count = createParameterExtractor(help, RestParam<int>("count",
+                                                               "Count"));
+    auto mode = createParameterExtractor(help, RestParamDefault<string>
+                                         ("mode", "Mode", "slow"));
+    auto point = createParameterExtractor(help, JsonParam<Point>("", "Point"));
+    auto payload = createParameterExtractor(help, StringPayload("Payload"));
+    BOOST_CHECK_EQUAL(help["requestParams"].size(), 2);
+
+    RestParams params;
+    params.push_back({ "count", "3" });
+    RestRequest request("POST", "/points", params, "{\"x\":1,\"y\":2}");
+    RestRequestParsingContext context(request);
+    RestServiceEndpoint::ConnectionId connection;
+
+    BOOST_CHECK_EQUAL(count(connection, request, context), 3);
+    BOOST_CHECK_EQUAL(mode(connection, request, context), "slow");
+    BOOST_CHECK_EQUAL(point(connection, request, context).y, 2);
+    BOOST_CHECK_EQUAL(payload(connection, request, context), request.payload);
+}
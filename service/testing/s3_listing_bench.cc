@@ -0,0 +1,99 @@
+/* s3_listing_bench.cc
+   Copyright (c) 2014 Datacratic.  All rights reserved.
+
+   Benchmark of the sequential and parallel listings of S3 objects, and of
+   single against multi-object deletes, using an in-memory S3 service that
+   simulates the latency of the real one.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+
+#include "soa/service/s3.h"
+#include "test_http_services.h"
+
+using namespace std;
+using namespace Datacratic;
+
+
+void report(const char * mode, int parallelism, const char * operation,
+            size_t numObjects, Date start)
+{
+    double elapsed = Date::now().secondsSince(start);
+    ::printf("%s,%d,%s,%zd,%f,%f\n",
+             mode, parallelism, operation, numObjects, elapsed,
+             numObjects / elapsed);
+}
+
+int main(int argc, char ** argv)
+{
+    size_t numObjects = 50000;
+    double requestDelay = 0.02;
+    if (argc > 1) {
+        numObjects = atoi(argv[1]);
+    }
+    if (argc > 2) {
+        requestDelay = atof(argv[2]);
+    }
+
+    auto proxies = make_shared<ServiceProxies>();
+    S3MockService service(proxies);
+    service.requestDelay = requestDelay;
+    service.start("127.0.0.1", 32);
+
+    const string chars("0123456789abcdef");
+    vector<string> keys;
+    for (size_t i = 0;  i < numObjects;  ++i) {
+        string key;
+        for (size_t n = i * 2654435761UL, j = 0;  j < 8;  ++j, n >>= 4) {
+            key += chars[n & 15];
+        }
+        key += "/part-" + to_string(i);
+        keys.push_back(key);
+        service.addObject(key, i);
+    }
+
+    S3Api api("id", "key", 20.0, "http", service.serviceUri());
+
+    size_t numListed(0);
+    auto onObject = [&] (const string & prefix, const string & objectName,
+                         const S3Api::ObjectInfo & info, int depth) {
+        numListed++;
+        return true;
+    };
+
+    ::printf("mode,parallelism,operation,objects,seconds,objects/s\n");
+
+    Date start = Date::now();
+    api.forEachObject(service.bucket, "", onObject, nullptr,
+                      S3Api::NO_SUBDIRS);
+    report("sequential", 1, "list", numListed, start);
+
+    for (int parallelism: { 1, 2, 4, 8, 16, 32 }) {
+        S3Api::ListingOptions options;
+        options.parallelism = parallelism;
+        options.numPartitions = parallelism;
+        numListed = 0;
+        start = Date::now();
+        api.forEachObjectParallel(service.bucket, "", onObject, nullptr,
+                                  S3Api::NO_SUBDIRS, options);
+        report("parallel", parallelism, "list", numListed, start);
+    }
+
+    /* deletes: one at a time for a sample, then all in bulk */
+    size_t numSingle = std::min<size_t>(500, keys.size());
+    start = Date::now();
+    for (size_t i = 0;  i < numSingle;  ++i) {
+        api.eraseObject(service.bucket, "/" + keys[i]);
+    }
+    report("single", 1, "erase", numSingle, start);
+
+    vector<string> remaining(keys.begin() + numSingle, keys.end());
+    start = Date::now();
+    api.eraseObjects(service.bucket, remaining, 8);
+    report("bulk", 8, "erase", remaining.size(), start);
+
+    return 0;
+}
@@ -0,0 +1,207 @@
+/* s3_listing_test.cc
+   Copyright (c) 2014 Datacratic.  All rights reserved.
+
+   Tests of the parallel listing and bulk deletion of S3 objects, against
+   an in-memory S3 service.
+*/
+
+#define BOOST_TEST_MAIN
+#define BOOST_TEST_DYN_LINK
+
+#include <boost/test/unit_test.hpp>
+#include <map>
+#include <set>
+
+#include "jml/utils/testing/watchdog.h"
+#include "soa/service/s3.h"
+#include "test_http_services.h"
+
+using namespace std;
+using namespace Datacratic;
+
+
+namespace {
+
+const string splitChars("0123456789"
+                        "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+                        "abcdefghijklmnopqrstuvwxyz");
+
+set<string>
+listSequential(const S3Api & api, const string & bucket,
+               const string & delimiter)
+{
+    set<string> keys;
+    auto onObject = [&] (const string & prefix, const string & objectName,
+                         const S3Api::ObjectInfo & info, int depth) {
+        BOOST_CHECK(keys.insert(prefix + objectName).second);
+        return true;
+    };
+    auto onSubdir = [&] (const string & prefix, const string & dirName,
+                         int depth) {
+        return true;
+    };
+    api.forEachObject(bucket, "", onObject, onSubdir, delimiter);
+
+    return keys;
+}
+
+} // file scope
+
+
+BOOST_AUTO_TEST_CASE( test_s3_listing_parallel_flat )
+{
+    ML::Watchdog watchdog(30);
+
+    auto proxies = make_shared<ServiceProxies>();
+    S3MockService service(proxies);
+    service.start("127.0.0.1", 4);
+
+    size_t numKeys(2000);
+    for (size_t i = 0;  i < numKeys;  ++i) {
+        service.addObject(splitChars[i % splitChars.size()]
+                          + string("-object-") + to_string(i), i);
+    }
+
+    S3Api api("id", "key", 20.0, "http", service.serviceUri());
+
+    S3Api::ListingOptions options;
+    options.parallelism = 4;
+    options.numPartitions = 8;
+    options.maxKeys = 50;
+
+    map<string, uint64_t> keys;
+    auto onObject = [&] (const string & prefix, const string & objectName,
+                         const S3Api::ObjectInfo & info, int depth) {
+        BOOST_CHECK_EQUAL(depth, 1);
+        BOOST_CHECK(info.exists);
+        BOOST_CHECK_EQUAL(info.etag, "\"0123456789abcdef\"");
+        BOOST_CHECK_EQUAL(info.storageClass, "STANDARD");
+        BOOST_CHECK_EQUAL(info.ownerName, "Owner");
+        BOOST_CHECK(keys.insert({prefix + objectName, info.size}).second);
+        return true;
+    };
+    api.forEachObjectParallel(service.bucket, "", onObject, nullptr,
+                              S3Api::NO_SUBDIRS, options);
+
+    BOOST_CHECK_EQUAL(keys.size(), numKeys);
+    BOOST_CHECK_EQUAL(keys["z-object-61"], 61U);
+
+    /* same objects as the sequential listing */
+    auto sequential = listSequential(api, service.bucket, S3Api::NO_SUBDIRS);
+    BOOST_CHECK_EQUAL(sequential.size(), numKeys);
+    for (const auto & it: keys) {
+        BOOST_CHECK_EQUAL(sequential.count(it.first), 1U);
+    }
+
+    /* early stop */
+    int numCalls(0);
+    auto onObjectStop = [&] (const string & prefix, const string & objectName,
+                             const S3Api::ObjectInfo & info, int depth) {
+        return ++numCalls < 10;
+    };
+    api.forEachObjectParallel(service.bucket, "", onObjectStop, nullptr,
+                              S3Api::NO_SUBDIRS, options);
+    BOOST_CHECK_EQUAL(numCalls, 10);
+}
+
+BOOST_AUTO_TEST_CASE( test_s3_listing_parallel_subdirs )
+{
+    ML::Watchdog watchdog(30);
+
+    auto proxies = make_shared<ServiceProxies>();
+    S3MockService service(proxies);
+    service.start("127.0.0.1", 4);
+
+    for (int i = 0;  i < 30;  ++i) {
+        service.addObject("dir1/object-" + to_string(i));
+        service.addObject("dir1/sub/object-" + to_string(i));
+        service.addObject("dir2/object-" + to_string(i));
+    }
+    service.addObject("top & <escaped> 'key'");
+    service.addObject("skipped/object");
+
+    S3Api api("id", "key", 20.0, "http", service.serviceUri());
+
+    S3Api::ListingOptions options;
+    options.parallelism = 3;
+    options.maxKeys = 7;
+
+    map<string, int> objects;
+    map<string, int> subdirs;
+    auto onObject = [&] (const string & prefix, const string & objectName,
+                         const S3Api::ObjectInfo & info, int depth) {
+        BOOST_CHECK(objects.insert({prefix + objectName, depth}).second);
+        return true;
+    };
+    auto onSubdir = [&] (const string & prefix, const string & dirName,
+                         int depth) {
+        BOOST_CHECK(subdirs.insert({prefix + dirName, depth}).second);
+        return dirName != "skipped";
+    };
+    api.forEachObjectParallel(service.bucket, "", onObject, onSubdir, "/",
+                              options);
+
+    BOOST_CHECK_EQUAL(objects.size(), 91U);
+    BOOST_CHECK_EQUAL(objects["top & <escaped> 'key'"], 1);
+    BOOST_CHECK_EQUAL(objects["dir1/object-12"], 2);
+    BOOST_CHECK_EQUAL(objects["dir1/sub/object-29"], 3);
+    BOOST_CHECK_EQUAL(objects.count("skipped/object"), 0U);
+
+    BOOST_CHECK_EQUAL(subdirs.size(), 4U);
+    BOOST_CHECK_EQUAL(subdirs["dir1"], 1);
+    BOOST_CHECK_EQUAL(subdirs["dir1/sub"], 2);
+    BOOST_CHECK_EQUAL(subdirs["dir2"], 1);
+    BOOST_CHECK_EQUAL(subdirs["skipped"], 1);
+
+    /* the sequential listing sees the same objects */
+    auto sequential = listSequential(api, service.bucket, "/");
+    BOOST_CHECK_EQUAL(sequential.size(), 92U);
+    for (const auto & it: objects) {
+        BOOST_CHECK_EQUAL(sequential.count(it.first), 1U);
+    }
+}
+
+BOOST_AUTO_TEST_CASE( test_s3_erase_objects )
+{
+    ML::Watchdog watchdog(30);
+
+    auto proxies = make_shared<ServiceProxies>();
+    S3MockService service(proxies);
+    service.start("127.0.0.1", 4);
+
+    vector<string> keys;
+    for (int i = 0;  i < 2500;  ++i) {
+        keys.push_back("object-" + to_string(i) + (i % 100 ? "" : " & co"));
+    }
+    keys.push_back("protected/object");
+    for (const string & key: keys) {
+        service.addObject(key);
+    }
+
+    S3Api api("id", "key", 20.0, "http", service.serviceUri());
+
+    /* 3 requests of up to 1000 keys */
+    auto errors = api.eraseObjects(service.bucket, keys, 2);
+    BOOST_CHECK_EQUAL(service.numRequests("POST"), 3U);
+    BOOST_CHECK_EQUAL(service.numObjects(), 1U);
+    BOOST_REQUIRE_EQUAL(errors.size(), 1U);
+    BOOST_CHECK_EQUAL(errors.begin()->first, "protected/object");
+    BOOST_CHECK_EQUAL(errors.begin()->second, "AccessDenied: Access Denied");
+
+    /* the same through the fs functions */
+    registerS3Bucket(service.bucket, "id", "key", 20.0, "http",
+                     service.serviceUri());
+    service.addObject("object-1");
+    service.addObject("object-2");
+    vector<string> uris = {
+        "s3://" + service.bucket + "/object-1",
+        "s3://" + service.bucket + "/object-2"
+    };
+    BOOST_CHECK(eraseUriObjects(uris));
+    BOOST_CHECK_EQUAL(service.numObjects(), 1U);
+
+    uris.push_back("s3://" + service.bucket + "/protected/object");
+    BOOST_CHECK(!eraseUriObjects(uris, false));
+    BOOST_CHECK_THROW(eraseUriObjects(uris), ML::Exception);
+    BOOST_CHECK_EQUAL(service.numObjects(), 1U);
+}
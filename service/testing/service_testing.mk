@@ -6,27 +6,40 @@ $(eval $(call test,epoll_wait_test,services,boost manual))
 $(eval $(call test,message_channel_test,services,boost))
 
 $(eval $(call test,aws_test,cloud,boost))
+$(eval $(call program,aws_sign_bench,cloud))
 
 $(eval $(call test,redis_async_test,redis,boost))
 $(eval $(call test,redis_commands_test,redis,boost))
+$(eval $(call test,redis_parser_test,redis,boost))
+$(eval $(call program,redis_reply_bench,redis))
+$(eval $(call test,redis_sharded_test,redis,boost))
+$(eval $(call program,redis_sharded_bench,redis))
 
 $(eval $(call test,statsd_connector_test,opstats,boost  manual))
+$(eval $(call program,statsd_connector_bench,opstats))
 $(eval $(call test,carbon_connector_test,opstats endpoint,boost manual))
 
 $(eval $(call test,endpoint_unit_test,endpoint,boost))
 $(eval $(call test,test_active_endpoint_nothing_listening,endpoint,boost manual))
 $(eval $(call test,test_active_endpoint_not_responding,endpoint,boost manual))
 $(eval $(call test,test_endpoint_ping_pong,endpoint,boost manual))
-$(eval $(call test,test_endpoint_connection_speed,endpoint,boost manual))
-$(eval $(call test,test_endpoint_accept_speed,endpoint,boost))
+$(eval $(call test,test_endpoint_connection_speed,endpoint test_utils,boost manual))
+$(eval $(call test,test_endpoint_accept_speed,endpoint test_utils,boost))
 $(eval $(call test,endpoint_periodic_test,endpoint,boost))
 $(eval $(call test,endpoint_closed_connection_test,endpoint,boost))
 $(eval $(call test,http_long_header_test,endpoint,boost manual))
 $(eval $(call test,http_header_test,endpoint,boost manual))
 $(eval $(call test,http_rest_proxy_stress_test,services,boost manual))
+$(eval $(call test,rest_request_binding_test,services,boost))
+$(eval $(call program,rest_request_binding_bench,services))
 $(eval $(call test,service_proxies_test,endpoint,boost manual))
 
 $(eval $(call test,message_loop_test,services,boost))
+$(eval $(call test,timer_wheel_test,types,boost))
+$(eval $(call test,timer_service_test,services,boost))
+$(eval $(call test,cpu_accounting_test,services,boost))
+$(eval $(call program,timer_service_bench,services))
+$(eval $(call test,mpsc_queue_test,,boost))
 
 $(eval $(call program,runner_test_helper,utils))
 $(eval $(call test,runner_test,services,boost))
@@ -38,20 +51,33 @@ $(eval $(call test,nprobe_test,services,boost manual))
 
 $(eval $(call library,test_services,test_http_services.cc,services))
 
-$(eval $(call program,async_writer_bench,services))
+$(eval $(call program,async_writer_bench,services test_utils))
+$(eval $(call program,transport_async_bench,endpoint))
 
 # nsq_client_test is "manual" because of dependency on nsqd */
 $(eval $(call test,nsq_client_test,cloud,boost manual))
+$(eval $(call test,nsq_client_protocol_test,cloud,boost))
+$(eval $(call program,nsq_client_bench,cloud))
 
 $(eval $(call test,http_client_test_v1,services test_services,boost))
 $(eval $(call test,http_client_test_v2,services test_services,boost manual))
 $(eval $(call test,http_client_online_test,services test_services,boost manual))
-$(eval $(call test,http_client_bench,boost_program_options services test_services,boost manual))
+$(eval $(call test,http_client_bench,boost_program_options services test_services test_utils,boost manual))
 $(eval $(call test,http_parsers_test,services test_services,boost valgrind))
 
 $(eval $(call test,logs_test,services,boost))
+$(eval $(call program,logs_bench,services))
 
 $(eval $(call test,sns_mock_test,cloud services,boost))
+$(eval $(call test,sqs_engine_test,cloud services test_services,boost))
+$(eval $(call program,sqs_engine_bench,cloud services test_services))
+$(eval $(call test,s3_listing_test,cloud services test_services,boost))
+$(eval $(call program,s3_listing_bench,cloud services test_services))
+$(eval $(call test,sftp_engine_test,cloud,boost manual))
+$(eval $(call test,shm_metrics_test,opstats,boost))
+$(eval $(call program,shm_metrics_bench,opstats))
+$(eval $(call test,admission_control_test,services,boost))
+$(eval $(call program,admission_control_bench,services))
 $(eval $(call test,sns_parsing_test,cloud services,boost))
 
 $(eval $(call test,event_handler_test,cloud services,boost manual))
@@ -0,0 +1,117 @@
+/* sftp_engine_test.cc
+   Copyright (c) 2014 Datacratic.  All rights reserved.
+
+   Transfers through the pipelined sftp engine, against a real ssh server.
+   The server is taken from the SFTP_TEST_HOST, SFTP_TEST_USER,
+   SFTP_TEST_PUBKEY, SFTP_TEST_PRIVKEY and SFTP_TEST_DIR environment
+   variables, for example a local sshd with the current user's keys.
+*/
+
+#define BOOST_TEST_MAIN
+#define BOOST_TEST_DYN_LINK
+
+#include <stdlib.h>
+#include <iostream>
+#include <thread>
+#include <vector>
+#include <boost/test/unit_test.hpp>
+
+#include "jml/utils/testing/watchdog.h"
+#include "soa/service/sftp_engine.h"
+#include "soa/types/date.h"
+
+using namespace std;
+using namespace Datacratic;
+
+
+namespace {
+
+string getEnv(const char * name, const string & defaultValue = "")
+{
+    const char * value = ::getenv(name);
+    return value ? value : defaultValue;
+}
+
+string makeContents(size_t size, int seed)
+{
+    string contents;
+    contents.reserve(size);
+    for (size_t i = 0;  i < size;  ++i) {
+        contents += char((i * 2654435761UL + seed) >> 13);
+    }
+
+    return contents;
+}
+
+} // file scope
+
+
+BOOST_AUTO_TEST_CASE( test_sftp_engine_parallel_transfers )
+{
+    string host = getEnv("SFTP_TEST_HOST", "localhost");
+    string user = getEnv("SFTP_TEST_USER", getEnv("USER"));
+    string home = getEnv("HOME");
+    string pubKey = getEnv("SFTP_TEST_PUBKEY", home + "/.ssh/id_rsa.pub");
+    string privKey = getEnv("SFTP_TEST_PRIVKEY", home + "/.ssh/id_rsa");
+    string dir = getEnv("SFTP_TEST_DIR", "/tmp");
+
+    ML::Watchdog watchdog(300);
+
+    SftpEngine engine;
+    engine.connectPublicKeyAuth(host, user, pubKey, privKey);
+    engine.start();
+
+    const size_t fileSize(64 * 1024 * 1024);
+    const int numFiles(4);
+
+    vector<string> contents;
+    for (int i = 0;  i < numFiles;  ++i) {
+        contents.push_back(makeContents(fileSize, i));
+    }
+    auto path = [&] (int i) {
+        return dir + "/sftp_engine_test_" + to_string(i);
+    };
+
+    auto transferAll = [&] (const function<void (int)> & transfer) {
+        vector<thread> threads;
+        Date start = Date::now();
+        for (int i = 0;  i < numFiles;  ++i) {
+            threads.emplace_back(transfer, i);
+        }
+        for (auto & th: threads) {
+            th.join();
+        }
+        return (fileSize * numFiles / 1000000.0
+                / Date::now().secondsSince(start));
+    };
+
+    double uploadRate = transferAll([&] (int i) {
+        auto stream = engine.streamingUpload(path(i));
+        for (size_t pos = 0;  pos < fileSize;  pos += 65536) {
+            stream.write(contents[i].c_str() + pos, 65536);
+        }
+        stream.close();
+    });
+    cerr << numFiles << " uploads: " << uploadRate << " MB/s" << endl;
+
+    vector<string> downloaded(numFiles);
+    double downloadRate = transferAll([&] (int i) {
+        auto stream = engine.streamingDownload(path(i));
+        char buffer[65536];
+        while (stream) {
+            stream.read(buffer, sizeof(buffer));
+            downloaded[i].append(buffer, stream.gcount());
+        }
+    });
+    cerr << numFiles << " downloads: " << downloadRate << " MB/s" << endl;
+
+    for (int i = 0;  i < numFiles;  ++i) {
+        BOOST_CHECK(downloaded[i] == contents[i]);
+    }
+
+    /* errors are reported through the streambufs */
+    auto sb = engine.streamingDownloadStreambuf(dir + "/does/not/exist");
+    BOOST_CHECK_THROW(sb->sgetc(), ML::Exception);
+
+    engine.shutdown();
+}
@@ -0,0 +1,101 @@
+/* shm_metrics_bench.cc
+   Copyright (c) 2014 Datacratic.  All rights reserved.
+
+   Cost of updating shared memory metrics from several threads while a
+   reader samples them at 100Hz, compared with sampling the process
+   statistics from within the process.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <atomic>
+#include <functional>
+#include <thread>
+#include <vector>
+
+#include "soa/service/process_stats.h"
+#include "soa/service/shm_metrics.h"
+
+using namespace std;
+using namespace Datacratic;
+
+
+/** Returns the average time taken by an operation on each of the threads,
+    in nanoseconds. */
+double timeOp(int numThreads, size_t numOps,
+              const function<void (size_t)> & op)
+{
+    vector<thread> threads;
+    Date start = Date::now();
+    for (int i = 0;  i < numThreads;  ++i) {
+        threads.emplace_back([&] () {
+            for (size_t j = 0;  j < numOps;  ++j) {
+                op(j);
+            }
+        });
+    }
+    for (auto & th: threads) {
+        th.join();
+    }
+
+    return Date::now().secondsSince(start) * 1e9 / numOps;
+}
+
+int main(int argc, char ** argv)
+{
+    size_t numOps = 10000000;
+    if (argc > 1) {
+        numOps = atoi(argv[1]);
+    }
+
+    string name = "shm_metrics_bench." + to_string(getpid());
+    ShmMetrics metrics(name);
+    ShmMetricsReader reader(name);
+
+    auto counter = metrics.counter("counter");
+    auto gauge = metrics.gauge("gauge");
+    auto histogram = metrics.histogram("histogram");
+
+    /* sample at 100Hz, as the agent would */
+    std::atomic<bool> done(false);
+    size_t numSamples(0);
+    thread sampler([&] () {
+        ShmMetricsRollup rollup;
+        while (!done) {
+            auto readings = reader.read();
+            reader.readProcess(readings);
+            rollup.sample(readings, Date::now());
+            numSamples++;
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+    });
+
+    ::printf("operation,threads,ns/op\n");
+
+    for (int numThreads: { 1, 2, 4, 8 }) {
+        ::printf("counter.inc,%d,%f\n", numThreads,
+                 timeOp(numThreads, numOps, [&] (size_t i) { counter.inc(); }));
+        ::printf("gauge.set,%d,%f\n", numThreads,
+                 timeOp(numThreads, numOps, [&] (size_t i) { gauge.set(i); }));
+        ::printf("histogram.record,%d,%f\n", numThreads,
+                 timeOp(numThreads, numOps,
+                        [&] (size_t i) { histogram.record(i & 1023); }));
+    }
+
+    done = true;
+    sampler.join();
+
+    /* what the same sampling costs when done within the process */
+    size_t numStats = 10000;
+    ::printf("ProcessStats.sample,1,%f\n",
+             timeOp(1, numStats, [&] (size_t i) { ProcessStats stats; }));
+    ::printf("ShmMetricsReader.read,1,%f\n",
+             timeOp(1, numStats, [&] (size_t i) { reader.read(); }));
+
+    ::fprintf(stderr, "%zd samples taken during the updates\n", numSamples);
+
+    metrics.unlink();
+
+    return 0;
+}
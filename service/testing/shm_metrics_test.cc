@@ -0,0 +1,273 @@
+/* shm_metrics_test.cc
+   Copyright (c) 2014 Datacratic.  All rights reserved.
+
+   Tests of the shared memory metrics and of their rollups.
+*/
+
+#define BOOST_TEST_MAIN
+#define BOOST_TEST_DYN_LINK
+
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <atomic>
+#include <map>
+#include <thread>
+#include <vector>
+#include <boost/test/unit_test.hpp>
+
+#include "jml/arch/exception.h"
+#include "jml/utils/testing/watchdog.h"
+#include "soa/service/shm_metrics.h"
+
+using namespace std;
+using namespace Datacratic;
+
+
+namespace {
+
+string segmentName()
+{
+    return "shm_metrics_test." + to_string(getpid());
+}
+
+const ShmMetricsReader::Reading &
+findReading(const vector<ShmMetricsReader::Reading> & readings,
+            const string & name)
+{
+    for (const auto & reading: readings) {
+        if (reading.name == name) {
+            return reading;
+        }
+    }
+    throw ML::Exception("no reading for " + name);
+}
+
+} // file scope
+
+
+BOOST_AUTO_TEST_CASE( test_shm_metrics_read )
+{
+    ShmMetrics metrics(segmentName(), 4);
+
+    auto counter = metrics.counter("requests");
+    auto gauge = metrics.gauge("queue");
+    auto histogram = metrics.histogram("latency");
+
+    BOOST_CHECK_EQUAL(metrics.counter("requests").slot, counter.slot);
+    BOOST_CHECK_THROW(metrics.gauge("requests"), ML::Exception);
+
+    counter.inc();
+    counter.inc(41);
+    gauge.set(3.5);
+    for (double value: { 0.5, 1.0, 3.0, 3.5, 1000.0 }) {
+        histogram.record(value);
+    }
+
+    ShmMetricsReader reader(segmentName());
+    BOOST_CHECK_EQUAL(reader.pid(), getpid());
+
+    auto readings = reader.read();
+    BOOST_REQUIRE_EQUAL(readings.size(), 3U);
+
+    BOOST_CHECK_EQUAL(findReading(readings, "requests").type,
+                      SHM_METRIC_COUNTER);
+    BOOST_CHECK_EQUAL(findReading(readings, "requests").value, 42.0);
+    BOOST_CHECK_EQUAL(findReading(readings, "queue").value, 3.5);
+
+    const auto & latency = findReading(readings, "latency");
+    BOOST_CHECK_EQUAL(latency.count, 5U);
+    BOOST_CHECK_EQUAL(latency.sum, 1008.0);
+    BOOST_CHECK_EQUAL(latency.min, 0.5);
+    BOOST_CHECK_EQUAL(latency.max, 1000.0);
+    BOOST_CHECK_EQUAL(latency.buckets[0], 1U);
+    BOOST_CHECK_EQUAL(latency.buckets[1], 1U);
+    BOOST_CHECK_EQUAL(latency.buckets[2], 2U);
+    BOOST_CHECK_EQUAL(latency.buckets[10], 1U);
+
+    /* capacity of 4 */
+    metrics.counter("fourth");
+    BOOST_CHECK_THROW(metrics.counter("fifth"), ML::Exception);
+
+    BOOST_CHECK(reader.readProcess(readings));
+    BOOST_CHECK(findReading(readings, "process.memResident").value > 0);
+    BOOST_CHECK(findReading(readings, "process.threads").value >= 1);
+
+    metrics.unlink();
+    BOOST_CHECK_THROW(ShmMetricsReader reader2(segmentName()),
+                      ML::Exception);
+}
+
+BOOST_AUTO_TEST_CASE( test_shm_metrics_concurrent_histogram )
+{
+    ML::Watchdog watchdog(30);
+
+    ShmMetrics metrics(segmentName());
+    ShmMetricsReader reader(segmentName());
+
+    auto histogram = metrics.histogram("values");
+    const int numThreads(4), numValues(200000);
+
+    std::atomic<bool> done(false);
+    auto readThread = [&] () {
+        while (!done) {
+            /* every snapshot is consistent */
+            auto reading = reader.read().at(0);
+            if (reading.stale) {
+                continue;
+            }
+            uint64_t total(0);
+            for (uint64_t count: reading.buckets) {
+                total += count;
+            }
+            BOOST_REQUIRE_EQUAL(total, reading.count);
+            BOOST_REQUIRE_EQUAL(reading.sum, reading.count * 2.0);
+        }
+    };
+    thread reader1(readThread);
+
+    vector<thread> writers;
+    for (int i = 0;  i < numThreads;  ++i) {
+        writers.emplace_back([&] () {
+            for (int j = 0;  j < numValues;  ++j) {
+                histogram.record(2.0);
+            }
+        });
+    }
+    for (auto & th: writers) {
+        th.join();
+    }
+    done = true;
+    reader1.join();
+
+    auto reading = reader.read().at(0);
+    BOOST_CHECK_EQUAL(reading.count, numThreads * numValues);
+    BOOST_CHECK_EQUAL(reading.buckets[2], numThreads * numValues);
+
+    metrics.unlink();
+}
+
+BOOST_AUTO_TEST_CASE( test_shm_metrics_stuck_histogram )
+{
+    ML::Watchdog watchdog(30);
+
+    /* a writer stopped in the middle of an update leaves the sequence odd */
+    ShmMetrics metrics(segmentName());
+    auto counter = metrics.counter("requests");
+    auto histogram = metrics.histogram("latency");
+    counter.inc();
+    histogram.record(2.0);
+    histogram.slot->sequence++;
+
+    ShmMetricsReader reader(segmentName());
+    Date start = Date::now();
+    auto readings = reader.read();
+    BOOST_CHECK_LT(Date::now().secondsSince(start), 1.0);
+    BOOST_CHECK(!findReading(readings, "requests").stale);
+    BOOST_CHECK_EQUAL(findReading(readings, "requests").value, 1.0);
+    BOOST_CHECK(findReading(readings, "latency").stale);
+    BOOST_CHECK_EQUAL(findReading(readings, "latency").count, 0U);
+
+    /* stale readings are left out of the rollups */
+    ShmMetricsRollup rollup({ 1 });
+    vector<StatReading> values;
+    rollup.onRollup = [&] (double, const vector<StatReading> & v) {
+        values = v;
+    };
+    rollup.sample(readings, Date::fromSecondsSinceEpoch(1000));
+    rollup.sample(readings, Date::fromSecondsSinceEpoch(1001));
+    BOOST_REQUIRE_EQUAL(values.size(), 2U);
+    BOOST_CHECK_EQUAL(values[0].name.find("requests."), 0U);
+
+    /* and once the update is over, the histogram reads again */
+    histogram.slot->sequence++;
+    BOOST_CHECK(!findReading(reader.read(), "latency").stale);
+    BOOST_CHECK_EQUAL(findReading(reader.read(), "latency").count, 1U);
+    metrics.unlink();
+
+    /* a process that died in the middle of an update isn't waited for */
+    string childName = segmentName() + ".child";
+    pid_t pid = fork();
+    BOOST_REQUIRE(pid != -1);
+    if (pid == 0) {
+        ShmMetrics childMetrics(childName);
+        auto childHistogram = childMetrics.histogram("latency");
+        childHistogram.record(2.0);
+        childHistogram.slot->sequence++;
+        _exit(0);
+    }
+    int status;
+    BOOST_REQUIRE_EQUAL(waitpid(pid, &status, 0), pid);
+
+    ShmMetricsReader childReader(childName);
+    BOOST_CHECK(!childReader.ownerAlive());
+    start = Date::now();
+    BOOST_CHECK(findReading(childReader.read(), "latency").stale);
+    BOOST_CHECK_LT(Date::now().secondsSince(start), 0.001);
+    shm_unlink(childReader.name.c_str());
+}
+
+BOOST_AUTO_TEST_CASE( test_shm_metrics_rollup )
+{
+    typedef ShmMetricsReader::Reading Reading;
+
+    auto makeReading = [] (const string & name, ShmMetricType type,
+                           double value) {
+        Reading reading;
+        reading.name = name;
+        reading.type = type;
+        reading.value = value;
+        reading.count = 0;
+        reading.sum = reading.min = reading.max = 0.0;
+        return reading;
+    };
+
+    ShmMetricsRollup rollup({ 1, 3 });
+
+    map<double, vector<map<string, float> > > reports;
+    rollup.onRollup = [&] (double period, const vector<StatReading> & values) {
+        map<string, float> report;
+        for (const auto & value: values) {
+            report[value.name] = value.value;
+        }
+        reports[period].push_back(report);
+    };
+
+    Date start = Date::fromSecondsSinceEpoch(1000);
+    for (int i = 0;  i <= 30;  ++i) {
+        /* 10 samples per second, counting 5 per sample and a gauge going up
+           by one per second */
+        Reading histogram = makeReading("latency", SHM_METRIC_HISTOGRAM, 0);
+        histogram.buckets.resize(ShmMetricsSegment::NumBuckets);
+        histogram.count = i * 10;
+        histogram.sum = i * 10 * 3.0;
+        histogram.buckets[2] = i * 9;
+        histogram.buckets[7] = i;
+        histogram.max = 100.0;
+
+        rollup.sample({ makeReading("requests", SHM_METRIC_COUNTER, i * 5),
+                        makeReading("level", SHM_METRIC_GAUGE, i / 10),
+                        histogram },
+                      start.plusSeconds(i * 0.1));
+    }
+
+    BOOST_REQUIRE_EQUAL(reports[1].size(), 3U);
+    BOOST_REQUIRE_EQUAL(reports[3].size(), 1U);
+
+    auto & second = reports[1][1];
+    BOOST_CHECK_CLOSE(second["requests.count"], 50.0, 0.001);
+    BOOST_CHECK_CLOSE(second["requests.rate"], 50.0, 0.001);
+    BOOST_CHECK_EQUAL(second["level.min"], 1.0);
+    BOOST_CHECK_EQUAL(second["level.max"], 2.0);
+    BOOST_CHECK_EQUAL(second["latency.count"], 100.0);
+    BOOST_CHECK_EQUAL(second["latency.p50"], 4.0);
+    BOOST_CHECK_EQUAL(second["latency.p90"], 4.0);
+    BOOST_CHECK_EQUAL(second["latency.p99"], 100.0);
+
+    auto & total = reports[3][0];
+    BOOST_CHECK_CLOSE(total["requests.count"], 150.0, 0.001);
+    BOOST_CHECK_CLOSE(total["requests.rate"], 50.0, 0.001);
+    BOOST_CHECK_EQUAL(total["level.min"], 0.0);
+    BOOST_CHECK_EQUAL(total["level.max"], 3.0);
+    BOOST_CHECK_EQUAL(total["latency.count"], 300.0);
+}
@@ -0,0 +1,123 @@
+/* sqs_engine_bench.cc
+   Copyright (c) 2014 Datacratic.  All rights reserved.
+
+   Benchmark of the synchronous SqsApi against the batching SqsEngine, both
+   talking to an in-memory SQS service.
+*/
+
+#include <stdio.h>
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include "soa/service/sqs.h"
+#include "soa/service/sqs_engine.h"
+#include "test_http_services.h"
+
+using namespace std;
+using namespace Datacratic;
+
+
+void report(const char * mode, const char * operation,
+            int numMessages, Date start)
+{
+    double elapsed = Date::now().secondsSince(start);
+    ::printf("%s,%s,%d,%f,%f\n",
+             mode, operation, numMessages, elapsed, numMessages / elapsed);
+}
+
+void benchSqsApi(SqsMockService & service, int numMessages)
+{
+    SqsApi sqs;
+    sqs.setCredentials("id", "key");
+    sqs.serviceHost = "127.0.0.1:" + to_string(service.port());
+    sqs.serviceUri = "http://" + sqs.serviceHost + "/";
+    sqs.proxy.init(sqs.serviceUri);
+
+    string queueUri = service.queueUri();
+    string body(200, 'x');
+
+    Date start = Date::now();
+    for (int i = 0;  i < numMessages;  ++i) {
+        sqs.sendMessage(queueUri, body);
+    }
+    report("SqsApi", "send", numMessages, start);
+
+    start = Date::now();
+    int numReceived(0);
+    while (numReceived < numMessages) {
+        auto messages = sqs.receiveMessageBatch(queueUri, 10, -1, 0);
+        vector<string> handles;
+        for (const auto & message: messages) {
+            handles.push_back(message.receiptHandle);
+        }
+        if (!handles.empty()) {
+            sqs.deleteMessageBatch(queueUri, handles);
+        }
+        numReceived += messages.size();
+    }
+    report("SqsApi", "receive+delete", numMessages, start);
+}
+
+void benchSqsEngine(SqsMockService & service, int numMessages)
+{
+    SqsEngine::Config config;
+    config.waitTimeSeconds = 1;
+    config.numReceivers = 4;
+    config.prefetchSize = 200;
+    config.maxPendingSends = numMessages;
+
+    SqsEngine engine(service.queueUri(), "id", "key", "us-east-1", config);
+    engine.start();
+
+    string body(200, 'x');
+    std::atomic<int> numErrors(0);
+    auto onSent = [&] (const string & messageId, const string & error) {
+        if (!error.empty()) {
+            numErrors++;
+        }
+    };
+
+    Date start = Date::now();
+    for (int i = 0;  i < numMessages;  ++i) {
+        engine.send(body, onSent);
+    }
+    engine.drain(60.0);
+    report("SqsEngine", "send", numMessages, start);
+
+    start = Date::now();
+    engine.startReceiving();
+    for (int i = 0;  i < numMessages;  ++i) {
+        SqsApi::Message message = engine.pop(5.0);
+        if (!message) {
+            ::fprintf(stderr, "timeout receiving message %d\n", i);
+            break;
+        }
+        engine.deleteMessage(message.receiptHandle);
+    }
+    engine.stopReceiving();
+    engine.drain(60.0);
+    report("SqsEngine", "receive+delete", numMessages, start);
+
+    if (numErrors > 0) {
+        ::fprintf(stderr, "%d send errors\n", int(numErrors));
+    }
+
+    engine.shutdown();
+}
+
+int main(int argc, char ** argv)
+{
+    int numMessages = 10000;
+
+    auto proxies = make_shared<ServiceProxies>();
+    SqsMockService service(proxies);
+    service.start("127.0.0.1", 8);
+
+    ::printf("mode,operation,messages,seconds,messages/s\n");
+
+    benchSqsApi(service, numMessages);
+    benchSqsEngine(service, numMessages);
+
+    return 0;
+}
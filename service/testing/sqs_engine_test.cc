@@ -0,0 +1,264 @@
+/* sqs_engine_test.cc
+   Copyright (c) 2014 Datacratic.  All rights reserved.
+
+   Tests of the batching SQS engine against an in-memory SQS service.
+*/
+
+#define BOOST_TEST_MAIN
+#define BOOST_TEST_DYN_LINK
+
+#include <boost/test/unit_test.hpp>
+#include <set>
+
+#include "jml/arch/timers.h"
+#include "jml/utils/testing/watchdog.h"
+#include "soa/service/sqs_engine.h"
+#include "test_http_services.h"
+
+using namespace std;
+using namespace Datacratic;
+
+
+namespace {
+
+SqsEngine::Config
+testConfig()
+{
+    SqsEngine::Config config;
+    config.waitTimeSeconds = 1;
+    config.maxBatchDelay = 1.0;
+    return config;
+}
+
+} // file scope
+
+
+BOOST_AUTO_TEST_CASE( test_sqs_engine_send_receive_delete )
+{
+    ML::Watchdog watchdog(30);
+
+    auto proxies = make_shared<ServiceProxies>();
+    SqsMockService service(proxies);
+    service.start("127.0.0.1", 4);
+
+    SqsEngine engine(service.queueUri(), "id", "key", "us-east-1",
+                     testConfig());
+    engine.start();
+
+    /* 25 messages go out in 3 batches, the last one on drain() */
+    size_t numMessages(25);
+    vector<string> messageIds(numMessages);
+    for (size_t i = 0;  i < numMessages;  ++i) {
+        auto onSent = [&, i] (const string & messageId, const string & error) {
+            BOOST_CHECK_EQUAL(error, "");
+            messageIds[i] = messageId;
+        };
+        BOOST_CHECK(engine.send("message " + to_string(i), onSent));
+    }
+    BOOST_CHECK(engine.drain());
+    BOOST_CHECK_EQUAL(service.numMessagesSent, numMessages);
+    BOOST_CHECK_EQUAL(service.numRequests("SendMessageBatch"), 3U);
+    set<string> uniqueIds(messageIds.begin(), messageIds.end());
+    BOOST_CHECK_EQUAL(uniqueIds.size(), numMessages);
+    BOOST_CHECK(uniqueIds.count("") == 0);
+
+    /* receive them all back and delete them */
+    engine.startReceiving();
+    set<string> bodies;
+    size_t numDeleted(0);
+    for (size_t i = 0;  i < numMessages;  ++i) {
+        SqsApi::Message message = engine.pop(5.0);
+        BOOST_REQUIRE(message);
+        bodies.insert(message.body);
+        engine.deleteMessage(message.receiptHandle,
+                             [&] (const string & error) {
+                                 BOOST_CHECK_EQUAL(error, "");
+                                 numDeleted++;
+                             });
+    }
+    engine.stopReceiving();
+    BOOST_CHECK(engine.drain());
+    BOOST_CHECK_EQUAL(bodies.size(), numMessages);
+    BOOST_CHECK_EQUAL(bodies.count("message 12"), 1U);
+    BOOST_CHECK_EQUAL(numDeleted, numMessages);
+    BOOST_CHECK_EQUAL(service.numMessagesDeleted, numMessages);
+    BOOST_CHECK_EQUAL(service.numRequests("DeleteMessageBatch"), 3U);
+    BOOST_CHECK_EQUAL(engine.inFlight(), 0U);
+
+    auto stats = engine.getStats();
+    BOOST_CHECK_EQUAL(stats.messagesSent, numMessages);
+    BOOST_CHECK_EQUAL(stats.messagesReceived, numMessages);
+    BOOST_CHECK_EQUAL(stats.messagesDeleted, numMessages);
+    BOOST_CHECK_EQUAL(stats.sendErrors + stats.deleteErrors, 0U);
+
+    /* deleting a message that doesn't exist reports an error */
+    string deleteError;
+    engine.deleteMessage("unknown-handle",
+                         [&] (const string & error) { deleteError = error; });
+    BOOST_CHECK(engine.drain());
+    BOOST_CHECK_EQUAL(deleteError.find("ReceiptHandleIsInvalid"), 0U);
+
+    engine.shutdown();
+}
+
+BOOST_AUTO_TEST_CASE( test_sqs_engine_backpressure )
+{
+    ML::Watchdog watchdog(30);
+
+    auto proxies = make_shared<ServiceProxies>();
+    SqsMockService service(proxies);
+    service.start("127.0.0.1", 4);
+
+    SqsEngine::Config config = testConfig();
+    config.prefetchSize = 15;
+    config.maxPendingSends = 50;
+    SqsEngine engine(service.queueUri(), "id", "key", "us-east-1", config);
+
+    /* sends are refused once too many are pending; as the engine isn't
+       started yet, none of them can complete */
+    int numAccepted(0);
+    for (int i = 0;  i < 100;  ++i) {
+        if (engine.send("message")) {
+            numAccepted++;
+        }
+    }
+    BOOST_CHECK_EQUAL(numAccepted, 50);
+
+    engine.start();
+    BOOST_CHECK(engine.drain());
+    BOOST_CHECK_EQUAL(service.numMessagesSent, 50U);
+
+    /* the prefetch buffer stops the receivers once full */
+    engine.startReceiving();
+    ML::sleep(0.5);
+    BOOST_CHECK_EQUAL(engine.prefetched(), 15U);
+    BOOST_CHECK_EQUAL(service.numMessagesReceived, 15U);
+
+    /* and they resume once there is room */
+    for (int i = 0;  i < 5;  ++i) {
+        BOOST_CHECK(engine.pop());
+    }
+    ML::sleep(0.5);
+    BOOST_CHECK_EQUAL(engine.prefetched(), 15U);
+    BOOST_CHECK_EQUAL(service.numMessagesReceived, 20U);
+    BOOST_CHECK_EQUAL(engine.inFlight(), 20U);
+
+    engine.shutdown();
+}
+
+BOOST_AUTO_TEST_CASE( test_sqs_engine_visibility_extension )
+{
+    ML::Watchdog watchdog(30);
+
+    auto proxies = make_shared<ServiceProxies>();
+    SqsMockService service(proxies);
+    service.start("127.0.0.1", 4);
+
+    SqsEngine::Config config = testConfig();
+    config.visibilityTimeout = 2;
+    config.extendMargin = 1.5;
+    SqsEngine engine(service.queueUri(), "id", "key", "us-east-1", config);
+    engine.start();
+
+    for (int i = 0;  i < 3;  ++i) {
+        engine.send("message " + to_string(i));
+    }
+    BOOST_CHECK(engine.drain());
+
+    engine.startReceiving();
+    SqsApi::Message first = engine.pop(5.0);
+    SqsApi::Message second = engine.pop(5.0);
+    SqsApi::Message third = engine.pop(5.0);
+    BOOST_REQUIRE(first && second && third);
+
+    /* released and deleted messages are not extended */
+    engine.release(first.receiptHandle);
+    engine.deleteMessage(second.receiptHandle);
+    BOOST_CHECK(engine.drain());
+    BOOST_CHECK_EQUAL(engine.inFlight(), 1U);
+
+    ML::sleep(2.5);
+    auto stats = engine.getStats();
+    BOOST_CHECK(stats.visibilityExtensions >= 1);
+    BOOST_CHECK(service.numVisibilityChanges >= 1);
+
+    engine.shutdown();
+}
+
+BOOST_AUTO_TEST_CASE( test_sqs_engine_retries )
+{
+    ML::Watchdog watchdog(30);
+
+    auto proxies = make_shared<ServiceProxies>();
+    SqsMockService service(proxies);
+    service.start("127.0.0.1", 4);
+
+    SqsEngine::Config config = testConfig();
+    config.maxBatchDelay = 0.01;
+    config.retryDelay = 0.2;
+    SqsEngine engine(service.queueUri(), "id", "key", "us-east-1", config);
+    engine.start();
+
+    /* a message over the SQS limit is rejected right away */
+    BOOST_CHECK_THROW(engine.send(string(256 * 1024 + 1, 'a')),
+                      ML::Exception);
+
+    /* two failures are retried after 0.2 then 0.4 seconds */
+    service.numFailures = 2;
+    string sendError("not sent");
+    Date start = Date::now();
+    engine.send("message",
+                [&] (const string & messageId, const string & error) {
+                    sendError = error;
+                });
+    BOOST_CHECK(engine.drain());
+    BOOST_CHECK_EQUAL(sendError, "");
+    BOOST_CHECK_EQUAL(service.numRequests("SendMessageBatch"), 3U);
+    BOOST_CHECK_GE(Date::now().secondsSince(start), 0.6);
+
+    /* and the error is reported once all the attempts failed */
+    service.numFailures = 3;
+    engine.send("message",
+                [&] (const string & messageId, const string & error) {
+                    sendError = error;
+                });
+    BOOST_CHECK(engine.drain());
+    BOOST_CHECK_EQUAL(sendError.find("HTTP status code 500"), 0U);
+    BOOST_CHECK_EQUAL(service.numRequests("SendMessageBatch"), 6U);
+    BOOST_CHECK_EQUAL(service.numMessagesSent, 1U);
+
+    /* nothing is pending, so no tick is scheduled anymore */
+    ML::sleep(0.1);
+    BOOST_CHECK_EQUAL(engine.timers().size(), 0U);
+
+    engine.shutdown();
+}
+
+BOOST_AUTO_TEST_CASE( test_sqs_engine_receive_backoff )
+{
+    ML::Watchdog watchdog(30);
+
+    auto proxies = make_shared<ServiceProxies>();
+    SqsMockService service(proxies);
+    service.start("127.0.0.1", 4);
+
+    SqsEngine::Config config = testConfig();
+    config.maxBatchDelay = 0.01;
+    config.numReceivers = 1;
+    config.numAttempts = 1;
+    config.retryDelay = 0.2;
+    SqsEngine engine(service.queueUri(), "id", "key", "us-east-1", config);
+    engine.start();
+
+    /* failed receives are restarted after 0.2, then 0.4 seconds */
+    service.numFailures = 3;
+    engine.startReceiving();
+    ML::sleep(0.5);
+    BOOST_CHECK_EQUAL(service.numRequests("ReceiveMessage"), 2U);
+
+    ML::sleep(1.2);
+    BOOST_CHECK_EQUAL(engine.getStats().receiveErrors, 3U);
+    BOOST_CHECK_GT(service.numRequests("ReceiveMessage"), 3U);
+
+    engine.shutdown();
+}
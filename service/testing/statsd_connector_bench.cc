@@ -0,0 +1,278 @@
+/* statsd_connector_bench.cc
+   Copyright (c) 2014 Datacratic.  All rights reserved.
+
+   Rate, send syscalls and CPU time of recording statsd metrics from several
+   threads, with a datagram sent per metric as the connector used to do and
+   with the aggregating StatsdConnector, against a local UDP listener that
+   runs in a child process.
+
+   Usage: statsd_connector_bench [numThreads [seconds [numNames]]]
+*/
+
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include <atomic>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "jml/arch/exception.h"
+#include "jml/arch/format.h"
+#include "soa/service/statsd_connector.h"
+
+using namespace std;
+using namespace Datacratic;
+
+
+namespace {
+
+double processCpuSeconds()
+{
+    timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+double monotonicSeconds()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Child process counting the datagrams and bytes sent to a local port,
+   until it gets SIGTERM. */
+struct Listener {
+    Listener()
+    {
+        fd = socket(AF_INET, SOCK_DGRAM, 0);
+        if (fd == -1)
+            throw ML::Exception(errno, "socket");
+
+        int size = 16 * 1024 * 1024;
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+
+        sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (bind(fd, (sockaddr *)&addr, sizeof(addr)) == -1)
+            throw ML::Exception(errno, "bind");
+        socklen_t len = sizeof(addr);
+        getsockname(fd, (sockaddr *)&addr, &len);
+        port = ntohs(addr.sin_port);
+
+        int fds[2];
+        if (pipe(fds) == -1)
+            throw ML::Exception(errno, "pipe");
+
+        pid = fork();
+        if (pid == -1)
+            throw ML::Exception(errno, "fork");
+
+        if (pid == 0) {
+            ::close(fds[0]);
+            run(fds[1]);
+            _exit(0);
+        }
+
+        ::close(fds[1]);
+        resultFd = fds[0];
+        ::close(fd);
+    }
+
+    static volatile sig_atomic_t finished;
+
+    void run(int out)
+    {
+        signal(SIGTERM, [] (int) { finished = 1; });
+
+        uint64_t counts[2] = { 0, 0 };
+        char buf[65536];
+        while (!finished) {
+            pollfd pfd = { fd, POLLIN, 0 };
+            if (poll(&pfd, 1, 10) != 1)
+                continue;
+            ssize_t res;
+            while ((res = recv(fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+                counts[0] += 1;
+                counts[1] += res;
+            }
+        }
+
+        if (write(out, counts, sizeof(counts)) != sizeof(counts))
+            _exit(1);
+    }
+
+    /* Stops the child and returns the datagrams and bytes received */
+    pair<uint64_t, uint64_t> stop()
+    {
+        // Let the last datagrams arrive
+        usleep(100000);
+        kill(pid, SIGTERM);
+
+        uint64_t counts[2] = { 0, 0 };
+        if (read(resultFd, counts, sizeof(counts)) != sizeof(counts))
+            throw ML::Exception("listener failed");
+        waitpid(pid, 0, 0);
+        ::close(resultFd);
+
+        return make_pair(counts[0], counts[1]);
+    }
+
+    string address() const
+    {
+        return ML::format("127.0.0.1:%d", port);
+    }
+
+    int fd;
+    int port;
+    pid_t pid;
+    int resultFd;
+};
+
+volatile sig_atomic_t Listener::finished = 0;
+
+/* The connector as it was: one datagram per metric */
+struct DirectSender {
+    DirectSender(int port)
+        : numSends(0)
+    {
+        fd = socket(AF_INET, SOCK_DGRAM, 0);
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port = htons(port);
+    }
+
+    ~DirectSender()
+    {
+        ::close(fd);
+    }
+
+    void incrementCounter(const char * name, float sampleRate, int value)
+    {
+        if (sampleRate < 1.0
+            && ((random() % 10000) / 10000.0) >= sampleRate)
+            return;
+
+        char msgBuf[1024];
+        int res = snprintf(msgBuf, 1024, "%s:%d|c|@%.2f", name, value,
+                           sampleRate);
+        sendto(fd, msgBuf, res, MSG_DONTWAIT, (sockaddr *)&addr,
+               sizeof(addr));
+        numSends.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    int fd;
+    sockaddr_in addr;
+    std::atomic<uint64_t> numSends;
+};
+
+typedef std::function<void (const char *, float)> RecordFn;
+
+/* Runs the threads and prints a line of results.  "sends" returns the
+   number of send syscalls made so far, once everything recorded has been
+   sent. */
+void run(const char * name, int numThreads, double seconds,
+         const vector<string> & names, float sampleRate,
+         const RecordFn & record, const std::function<uint64_t ()> & sends,
+         Listener & listener)
+{
+    std::atomic<bool> finished(false);
+    std::atomic<uint64_t> numCalls(0);
+
+    double cpuBefore = processCpuSeconds();
+    double start = monotonicSeconds();
+    uint64_t sendsBefore = sends();
+
+    vector<std::thread> threads;
+    for (int i = 0;  i < numThreads;  ++i) {
+        threads.emplace_back([&, i] ()
+            {
+                uint64_t calls = 0;
+                size_t n = i;
+                while (!finished) {
+                    for (int j = 0;  j < 100;  ++j, ++n)
+                        record(names[n % names.size()].c_str(), sampleRate);
+                    calls += 100;
+                }
+                numCalls += calls;
+            });
+    }
+
+    usleep(seconds * 1000000);
+    finished = true;
+    for (auto & t: threads)
+        t.join();
+
+    double elapsed = monotonicSeconds() - start;
+    uint64_t numSends = sends() - sendsBefore;
+    double cpu = processCpuSeconds() - cpuBefore;
+    auto received = listener.stop();
+
+    printf("%-12s %5.2f %12.0f %12.0f %10.1f %12.0f %10.0f\n",
+           name, sampleRate, numCalls / elapsed, numSends / elapsed,
+           cpu * 1e9 / numCalls, received.first / elapsed,
+           received.first ? (double)received.second / received.first : 0.0);
+}
+
+} // file scope
+
+
+int main(int argc, char ** argv)
+{
+    int numThreads = argc > 1 ? atoi(argv[1]) : 4;
+    double seconds = argc > 2 ? atof(argv[2]) : 3.0;
+    int numNames = argc > 3 ? atoi(argv[3]) : 100;
+
+    vector<string> names;
+    for (int i = 0;  i < numNames;  ++i)
+        names.push_back(ML::format("bench.statsd.component%d.event", i));
+
+    printf("%d threads over %.1fs, %d metric names\n",
+           numThreads, seconds, numNames);
+    printf("%-12s %5s %12s %12s %10s %12s %10s\n",
+           "sender", "rate", "calls/s", "syscalls/s", "cpu ns/call",
+           "datagrams/s", "bytes/dgram");
+
+    for (float sampleRate: { 1.0f, 0.1f }) {
+        {
+            Listener listener;
+            DirectSender sender(listener.port);
+            auto record = [&] (const char * name, float rate)
+                {
+                    sender.incrementCounter(name, rate, 1);
+                };
+            run("direct", numThreads, seconds, names, sampleRate,
+                record, [&] () { return sender.numSends.load(); },
+                listener);
+        }
+
+        {
+            Listener listener;
+            StatsdConnector connector(listener.address());
+            auto record = [&] (const char * name, float rate)
+                {
+                    connector.incrementCounter(name, rate, 1);
+                };
+            auto sends = [&] ()
+                {
+                    connector.flush();
+                    return connector.numSendCalls.load();
+                };
+            run("aggregated", numThreads, seconds, names, sampleRate,
+                record, sends, listener);
+        }
+    }
+
+    return 0;
+}
@@ -8,7 +8,14 @@
 #define BOOST_TEST_MAIN
 #define BOOST_TEST_DYN_LINK
 
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <thread>
 #include <boost/test/unit_test.hpp>
+#include "jml/arch/exception.h"
+#include "jml/utils/string_functions.h"
 #include "soa/service/statsd_connector.h"
 
 
@@ -23,3 +30,151 @@ BOOST_AUTO_TEST_CASE( test_statsd_connector )
     for(int i=0; i<300; i++) x.recordGauge("testGauge", 0.1, 5.2);
     BOOST_CHECK_EQUAL(2, 2);
 }
+
+
+/* Local statsd socket, on an ephemeral port */
+struct UdpListener {
+    UdpListener()
+    {
+        fd = socket(AF_INET, SOCK_DGRAM, 0);
+        if (fd == -1)
+            throw ML::Exception(errno, "socket");
+
+        sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (bind(fd, (sockaddr *)&addr, sizeof(addr)) == -1)
+            throw ML::Exception(errno, "bind");
+
+        socklen_t len = sizeof(addr);
+        getsockname(fd, (sockaddr *)&addr, &len);
+        port = ntohs(addr.sin_port);
+    }
+
+    ~UdpListener()
+    {
+        ::close(fd);
+    }
+
+    string address() const
+    {
+        return ML::format("127.0.0.1:%d", port);
+    }
+
+    /* Datagrams received until none comes for 100ms */
+    vector<string> receive()
+    {
+        vector<string> result;
+        for (;;) {
+            pollfd pfd = { fd, POLLIN, 0 };
+            if (poll(&pfd, 1, 100) != 1)
+                return result;
+            char buf[65536];
+            ssize_t res = recv(fd, buf, sizeof(buf), 0);
+            if (res == -1)
+                throw ML::Exception(errno, "recv");
+            result.push_back(string(buf, res));
+        }
+    }
+
+    int fd;
+    int port;
+};
+
+BOOST_AUTO_TEST_CASE( test_statsd_aggregation )
+{
+    UdpListener listener;
+
+    // Long flush interval, so that only our flushes send anything
+    StatsdConnector connector(listener.address(), 1000.0, 100);
+
+    for (int i = 0;  i < 1000;  ++i)
+        connector.incrementCounter("test", 1.0);
+
+    // Counters of all of the threads are aggregated
+    vector<std::thread> threads;
+    for (int i = 0;  i < 3;  ++i)
+        threads.emplace_back([&] ()
+                             {
+                                 for (int j = 0;  j < 100;  ++j)
+                                     connector.incrementCounter("test", 1.0);
+                             });
+    for (auto & t: threads)
+        t.join();
+
+    connector.flush();
+
+    vector<string> received = listener.receive();
+    BOOST_REQUIRE_EQUAL(received.size(), 1);
+    BOOST_CHECK_EQUAL(received[0], "test:1300|c|@1.00");
+    BOOST_CHECK_EQUAL(connector.numSendCalls, 1);
+
+    // Timings are each sent, packed in datagrams of at most 100 bytes
+    for (int i = 0;  i < 30;  ++i)
+        connector.recordGauge("testGauge", 1.0, 5.2);
+    connector.flush();
+
+    received = listener.receive();
+    BOOST_CHECK_GT(received.size(), 1);
+    int numLines = 0;
+    for (auto & packet: received) {
+        BOOST_CHECK_LE(packet.size(), 100);
+        for (auto & line: ML::split(packet, '\n')) {
+            BOOST_CHECK_EQUAL(line, "testGauge:5.200000|ms");
+            ++numLines;
+        }
+    }
+    BOOST_CHECK_EQUAL(numLines, 30);
+    BOOST_CHECK_EQUAL(connector.numSendCalls, 2);
+    BOOST_CHECK_EQUAL(connector.numMetrics, 31);
+
+    // Nothing recorded, nothing sent
+    connector.flush();
+    BOOST_CHECK_EQUAL(listener.receive().size(), 0);
+}
+
+BOOST_AUTO_TEST_CASE( test_statsd_sampling )
+{
+    UdpListener listener;
+    StatsdConnector connector(listener.address(), 1000.0);
+
+    for (int i = 0;  i < 10000;  ++i)
+        connector.incrementCounter("sampled", 0.1);
+    connector.flush();
+
+    vector<string> received = listener.receive();
+    BOOST_REQUIRE_EQUAL(received.size(), 1);
+
+    int count = 0;
+    BOOST_REQUIRE_EQUAL(sscanf(received[0].c_str(), "sampled:%d|c|@0.10",
+                               &count), 1);
+    BOOST_CHECK_GT(count, 800);
+    BOOST_CHECK_LT(count, 1200);
+}
+
+BOOST_AUTO_TEST_CASE( test_statsd_not_open )
+{
+    UdpListener listener;
+
+    // Nothing would flush what is recorded before open(), so it is dropped
+    StatsdConnector connector(1000.0);
+    for (int i = 0;  i < 1000;  ++i) {
+        connector.incrementCounter("early", 1.0);
+        connector.recordGauge("earlyGauge", 1.0, 1.0);
+    }
+    BOOST_CHECK_EQUAL(connector.numDropped, 2000);
+
+    connector.open(listener.address());
+    connector.incrementCounter("late", 1.0);
+    connector.flush();
+
+    vector<string> received = listener.receive();
+    BOOST_REQUIRE_EQUAL(received.size(), 1);
+    BOOST_CHECK_EQUAL(received[0], "late:1|c|@1.00");
+
+    // Nor is anything flushed after a shutdown
+    connector.shutdown();
+    connector.incrementCounter("after", 1.0);
+    BOOST_CHECK_EQUAL(connector.numDropped, 2001);
+}
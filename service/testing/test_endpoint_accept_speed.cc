@@ -21,14 +21,17 @@
 #include "ping_pong.h"
 #include <poll.h>
 #include "jml/utils/exc_assert.h"
+#include "soa/utils/benchmarks.h"
 
 
 using namespace std;
 using namespace ML;
 using namespace Datacratic;
 
-void runAcceptSpeedTest()
+void runAcceptSpeedTest(BenchmarkState & state)
 {
+    state.pause();
+
     string connectionError;
 
     PassiveEndpointT<SocketTransport> acceptor("acceptor");
@@ -46,7 +49,7 @@ void runAcceptSpeedTest()
 
     int nconnections = 100;
 
-    Date before = Date::now();
+    state.resume();
 
     vector<int> sockets;
 
@@ -89,9 +92,8 @@ void runAcceptSpeedTest()
         }
     }
 
-    Date after = Date::now();
-
-    BOOST_CHECK_LT(after.secondsSince(before), 1);
+    state.pause();
+    state.setItems(nconnections);
 
     BOOST_CHECK_EQUAL(sockets.size(), nconnections);
 
@@ -117,12 +119,19 @@ BOOST_AUTO_TEST_CASE( test_accept_speed )
 
     Watchdog watchdog(50.0);
 
-    int ntests = 1;
-    //ntests = 1000;  // stress test
-
-    for (unsigned i = 0;  i < ntests;  ++i) {
-        runAcceptSpeedTest();
+    /* A single run as a test; BENCHMARK_REPETITIONS=1000 turns this into
+       a stress test */
+    BenchmarkOptions options = BenchmarkOptions::fromEnvironment();
+    if (!getenv("BENCHMARK_REPETITIONS")) {
+        options.warmup = 0;
+        options.repetitions = 1;
     }
+    BenchmarkSuite suite("endpoint_accept_speed", options);
+    auto & result = suite.run("100 connections", runAcceptSpeedTest);
+
+    // Every repetition, not only most of them
+    BOOST_CHECK_LT(result.stats.max, 1);
+    BOOST_CHECK_EQUAL(suite.finish(), 0);
 
     BOOST_CHECK_EQUAL(TransportBase::created, TransportBase::destroyed);
     BOOST_CHECK_EQUAL(ConnectionHandler::created,
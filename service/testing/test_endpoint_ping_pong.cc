@@ -12,6 +12,7 @@
 #include "soa/service/http_endpoint.h"
 #include "soa/service/active_endpoint.h"
 #include "soa/service/passive_endpoint.h"
+#include "soa/service/cpu_accounting.h"
 #include <sys/socket.h>
 #include "jml/utils/guard.h"
 #include "jml/arch/exception_handler.h"
@@ -19,12 +20,34 @@
 #include "jml/utils/testing/fd_exhauster.h"
 #include "test_connection_error.h"
 #include "ping_pong.h"
+#include <sys/resource.h>
+#include <dirent.h>
+#include <math.h>
+#include <algorithm>
 
 using namespace std;
 using namespace ML;
 using namespace Datacratic;
 
-BOOST_AUTO_TEST_CASE( test_ping_pong )
+/* Number of file descriptors currently open by the process. */
+int countOpenFds()
+{
+    DIR * dir = opendir("/proc/self/fd");
+    if (!dir)
+        throw Exception(errno, "opendir /proc/self/fd");
+    int result = 0;
+    while (readdir(dir))
+        ++result;
+    closedir(dir);
+    return result - 3;  // ".", ".." and the directory itself
+}
+
+/* Runs 1000 ping/pong round trips over a single connection and reports
+   the latency, the number of fds used and the context switches per round
+   trip.  Syscalls per round trip can be compared by running the test
+   under "strace -c -f".  Returns the microseconds per round trip.
+*/
+double testPingPong(bool direct)
 {
     BOOST_REQUIRE_EQUAL(TransportBase::created, TransportBase::destroyed);
     BOOST_REQUIRE_EQUAL(ConnectionHandler::created,
@@ -34,7 +57,10 @@ BOOST_AUTO_TEST_CASE( test_ping_pong )
 
     string connectionError;
 
+    int fdsBefore = countOpenFds();
+
     PassiveEndpointT<SocketTransport> acceptor("acceptor");
+    acceptor.setDirectTransports(direct);
     
     acceptor.onMakeNewHandler = [&] ()
         {
@@ -48,6 +74,7 @@ BOOST_AUTO_TEST_CASE( test_ping_pong )
     BOOST_CHECK_EQUAL(acceptor.numConnections(), 0);
 
     ActiveEndpointT<SocketTransport> connector("connector");
+    connector.setDirectTransports(direct);
     int nconnections = 1;
     connector.init(port, "localhost", nconnections);
 
@@ -85,12 +112,35 @@ BOOST_AUTO_TEST_CASE( test_ping_pong )
     BOOST_CHECK_EQUAL(connector.numActiveConnections(), 1);
     BOOST_CHECK_EQUAL(connector.numInactiveConnections(), 0);
 
+    int fdsDuring = countOpenFds();
+
+    rusage usageBefore;
+    getrusage(RUSAGE_SELF, &usageBefore);
+    Date before = Date::now();
+
     waitUntil = Date::now().plusSeconds(5.0).toAce();
     semWaitRes = finishedTestSem.acquire(waitUntil);
     
+    Date after = Date::now();
+    rusage usageAfter;
+    getrusage(RUSAGE_SELF, &usageAfter);
+
     BOOST_CHECK_EQUAL(semWaitRes, 0);
     BOOST_CHECK_EQUAL(connectionError, "");
 
+    int roundTrips = 1000;
+    double usPerRoundTrip = after.secondsSince(before) * 1000000 / roundTrips;
+    long ctxSwitches
+        = (usageAfter.ru_nvcsw + usageAfter.ru_nivcsw)
+        - (usageBefore.ru_nvcsw + usageBefore.ru_nivcsw);
+
+    cerr << (direct ? "direct" : "nested") << " transports: "
+         << usPerRoundTrip
+         << "us per round trip; "
+         << double(ctxSwitches) / roundTrips
+         << " context switches per round trip; "
+         << fdsDuring - fdsBefore << " fds for both endpoints" << endl;
+
     acceptor.closePeer();
 
     connector.sleepUntilIdle();
@@ -102,4 +152,76 @@ BOOST_AUTO_TEST_CASE( test_ping_pong )
     BOOST_CHECK_EQUAL(TransportBase::created, TransportBase::destroyed);
     BOOST_CHECK_EQUAL(ConnectionHandler::created,
                       ConnectionHandler::destroyed);
+
+    return usPerRoundTrip;
+}
+
+BOOST_AUTO_TEST_CASE( test_ping_pong )
+{
+    testPingPong(false);
+}
+
+BOOST_AUTO_TEST_CASE( test_ping_pong_direct )
+{
+    testPingPong(true);
+}
+
+/* Round trips with and without the CPU accounting of the handlers, which
+   should cost less than 1%.
+
+   Round trips vary by several percent from one run to the next, so the
+   bound is checked on the cost of the scopes that a round trip goes
+   through, measured separately; the comparison of the fastest runs with
+   and without accounting is only checked within that noise.
+*/
+BOOST_AUTO_TEST_CASE( test_ping_pong_accounting_overhead )
+{
+    const int numRuns = 5;
+    const int roundTrips = 1000;
+
+    CpuAccount * scopeAccount = CpuAccounting::get("test", "scope");
+    const int numScopes = 1000000;
+    Date start = Date::now();
+    for (int i = 0;  i < numScopes;  ++i) {
+        CpuAccountingScope accounting(scopeAccount);
+    }
+    double usPerScope = Date::now().secondsSince(start) * 1000000 / numScopes;
+
+    for (bool direct: { false, true }) {
+        CpuAccounting::reset();
+
+        double withAccounting(INFINITY), withoutAccounting(INFINITY);
+        for (int i = 0;  i < numRuns;  ++i) {
+            CpuAccounting::enabled = false;
+            withoutAccounting = std::min(withoutAccounting,
+                                         testPingPong(direct));
+            CpuAccounting::enabled = true;
+            withAccounting = std::min(withAccounting, testPingPong(direct));
+        }
+
+        Json::Value handlers = CpuAccounting::toJson()["handlers"];
+        double numInvocations = 0;
+        bool foundPing = false;
+        for (const string & name: handlers.getMemberNames()) {
+            numInvocations += handlers[name]["invocations"].asDouble();
+            if (name.find("PingConnectionHandler") != string::npos) {
+                foundPing = true;
+                BOOST_CHECK_GT(handlers[name]["invocations"].asInt(), 0);
+            }
+        }
+        BOOST_CHECK(foundPing);
+
+        double scopesPerRoundTrip = numInvocations / (numRuns * roundTrips);
+        double estimated = scopesPerRoundTrip * usPerScope / withoutAccounting;
+        double measured = withAccounting / withoutAccounting - 1.0;
+
+        cerr << (direct ? "direct" : "nested") << " transports: "
+             << scopesPerRoundTrip << " scopes of " << usPerScope * 1000
+             << "ns per round trip of " << withoutAccounting << "us: "
+             << "accounting overhead " << estimated * 100.0
+             << "% estimated, " << measured * 100.0 << "% measured" << endl;
+
+        BOOST_CHECK_LT(estimated, 0.01);
+        BOOST_CHECK_LT(measured, 0.01 + 0.05);
+    }
 }
@@ -1,9 +1,107 @@
+#include <unistd.h>
+#include <algorithm>
 #include "test_http_services.h"
 
 using namespace std;
 using namespace Datacratic;
 
 
+namespace {
+
+/* Decode an application/x-www-form-urlencoded string */
+string
+formDecode(const char * start, const char * end)
+{
+    string result;
+    result.reserve(end - start);
+    while (start < end) {
+        char c = *start++;
+        if (c == '+') {
+            result += ' ';
+        }
+        else if (c == '%' && end - start >= 2) {
+            result += (char)stoi(string(start, 2), nullptr, 16);
+            start += 2;
+        }
+        else {
+            result += c;
+        }
+    }
+
+    return result;
+}
+
+void
+parseForm(const string & form, RestParams & params)
+{
+    const char * p = form.c_str();
+    const char * end = p + form.size();
+    while (p < end) {
+        const char * fieldEnd = std::find(p, end, '&');
+        const char * equal = std::find(p, fieldEnd, '=');
+        string key = formDecode(p, equal);
+        string value = (equal < fieldEnd
+                        ? formDecode(equal + 1, fieldEnd)
+                        : "");
+        params.push_back(make_pair(key, value));
+        p = fieldEnd + 1;
+    }
+}
+
+string
+xmlEscape(const string & text)
+{
+    string result;
+    for (char c: text) {
+        if (c == '&') {
+            result += "&amp;";
+        }
+        else if (c == '<') {
+            result += "&lt;";
+        }
+        else if (c == '>') {
+            result += "&gt;";
+        }
+        else {
+            result += c;
+        }
+    }
+
+    return result;
+}
+
+string
+xmlUnescape(const string & text)
+{
+    static const vector<pair<string, char> > entities = {
+        { "&amp;", '&' }, { "&lt;", '<' }, { "&gt;", '>' },
+        { "&quot;", '"' }, { "&apos;", '\'' }
+    };
+
+    string result;
+    for (size_t i = 0;  i < text.size();) {
+        bool found(false);
+        if (text[i] == '&') {
+            for (const auto & entity: entities) {
+                if (text.compare(i, entity.first.size(), entity.first) == 0) {
+                    result += entity.second;
+                    i += entity.first.size();
+                    found = true;
+                    break;
+                }
+            }
+        }
+        if (!found) {
+            result += text[i++];
+        }
+    }
+
+    return result;
+}
+
+} // file scope
+
+
 HttpService::
 HttpService(const shared_ptr<ServiceProxies> & proxies)
     : ServiceBase("http-test-service", proxies),
@@ -89,6 +187,9 @@ handleHttpPayload(HttpTestConnHandler & handler,
         string body = header.queryParams.uriEscaped();
         handler.sendResponse(200, body, "text/plain");
     }
+    else if (header.resource == "/no-content") {
+        handler.putCannedResponseOnWire(CannedHttpResponse::noContent());
+    }
     else if (header.resource == "/connection-close") {
         handler.send("HTTP/1.1 204 No contents\r\nConnection: close\r\n\r\n",
                      PassiveConnectionHandler::NextAction::NEXT_CLOSE);
@@ -149,3 +250,432 @@ handleHttpPayload(HttpTestConnHandler & handler,
 
     handler.sendResponse(200, response.toString(), "application/json");
 }
+
+SqsMockService::
+SqsMockService(const shared_ptr<ServiceProxies> & proxies)
+    : HttpService(proxies),
+      numMessagesSent(0), numMessagesReceived(0),
+      numMessagesDeleted(0), numVisibilityChanges(0),
+      numFailures(0),
+      counter_(0)
+{}
+
+string
+SqsMockService::
+queueUri()
+    const
+{
+    return "http://127.0.0.1:" + to_string(port()) + "/123456789012/test";
+}
+
+size_t
+SqsMockService::
+numRequests(const string & action)
+    const
+{
+    lock_guard<mutex> guard(lock);
+    auto it = requests_.find(action);
+    return it == requests_.end() ? 0 : it->second;
+}
+
+void
+SqsMockService::
+handleHttpPayload(HttpTestConnHandler & handler,
+                  const HttpHeader & header,
+                  const string & payload)
+{
+    numReqs++;
+
+    RestParams params = header.queryParams;
+    parseForm(payload, params);
+
+    /* Values of the numbered entries ("Prefix.N.Field") of a batch */
+    auto getEntries = [&] (const string & prefix, const string & field) {
+        vector<string> entries;
+        for (int i = 1;;  ++i) {
+            string key = prefix + "." + to_string(i) + "." + field;
+            if (!params.hasValue(key)) {
+                break;
+            }
+            entries.push_back(params.getValue(key));
+        }
+        return entries;
+    };
+    auto getEntryIds = [&] (const string & prefix) {
+        return getEntries(prefix, "Id");
+    };
+
+    string action = params.getValue("Action");
+    {
+        lock_guard<mutex> guard(lock);
+        requests_[action]++;
+    }
+
+    int failures = numFailures;
+    while (failures > 0
+           && !numFailures.compare_exchange_weak(failures, failures - 1)) {
+    }
+    if (failures > 0) {
+        handler.sendResponse(500, "<ErrorResponse><Error><Code>"
+                             "InternalError</Code></Error></ErrorResponse>",
+                             "text/xml");
+        return;
+    }
+
+    string body = "<" + action + "Response>";
+    if (action == "SendMessage") {
+        body += ("<SendMessageResult>"
+                 + sendResult(params.getValue("MessageBody"))
+                 + "</SendMessageResult>");
+    }
+    else if (action == "SendMessageBatch") {
+        string prefix = "SendMessageBatchRequestEntry";
+        auto ids = getEntryIds(prefix);
+        auto bodies = getEntries(prefix, "MessageBody");
+        body += "<SendMessageBatchResult>";
+        for (size_t i = 0;  i < ids.size();  ++i) {
+            body += ("<SendMessageBatchResultEntry>"
+                     "<Id>" + ids[i] + "</Id>"
+                     + sendResult(bodies[i])
+                     + "</SendMessageBatchResultEntry>");
+        }
+        body += "</SendMessageBatchResult>";
+    }
+    else if (action == "ReceiveMessage") {
+        int maxMessages = 1;
+        if (params.hasValue("MaxNumberOfMessages")) {
+            maxMessages = stoi(params.getValue("MaxNumberOfMessages"));
+        }
+        double waitTime = 0.0;
+        if (params.hasValue("WaitTimeSeconds")) {
+            waitTime = stoi(params.getValue("WaitTimeSeconds"));
+        }
+        body += ("<ReceiveMessageResult>"
+                 + receiveMessages(maxMessages, waitTime)
+                 + "</ReceiveMessageResult>");
+    }
+    else if (action == "DeleteMessage" || action == "DeleteMessageBatch") {
+        vector<string> handles;
+        vector<string> ids;
+        if (action == "DeleteMessage") {
+            handles.push_back(params.getValue("ReceiptHandle"));
+        }
+        else {
+            string prefix = "DeleteMessageBatchRequestEntry";
+            ids = getEntryIds(prefix);
+            handles = getEntries(prefix, "ReceiptHandle");
+            body += "<DeleteMessageBatchResult>";
+        }
+
+        for (size_t i = 0;  i < handles.size();  ++i) {
+            bool found;
+            {
+                lock_guard<mutex> guard(lock);
+                found = received_.erase(handles[i]);
+            }
+            if (found) {
+                numMessagesDeleted++;
+            }
+            if (ids.empty()) {
+                continue;
+            }
+            if (found) {
+                body += ("<DeleteMessageBatchResultEntry><Id>" + ids[i]
+                         + "</Id></DeleteMessageBatchResultEntry>");
+            }
+            else {
+                body += ("<BatchResultErrorEntry><Id>" + ids[i] + "</Id>"
+                         "<Code>ReceiptHandleIsInvalid</Code>"
+                         "<SenderFault>true</SenderFault>"
+                         "</BatchResultErrorEntry>");
+            }
+        }
+
+        if (!ids.empty()) {
+            body += "</DeleteMessageBatchResult>";
+        }
+    }
+    else if (action == "ChangeMessageVisibilityBatch") {
+        auto ids = getEntryIds("ChangeMessageVisibilityBatchRequestEntry");
+        body += "<ChangeMessageVisibilityBatchResult>";
+        for (const string & id: ids) {
+            numVisibilityChanges++;
+            body += ("<ChangeMessageVisibilityBatchResultEntry><Id>" + id
+                     + "</Id></ChangeMessageVisibilityBatchResultEntry>");
+        }
+        body += "</ChangeMessageVisibilityBatchResult>";
+    }
+    else {
+        handler.sendResponse(400, "<ErrorResponse><Error><Code>"
+                             "InvalidAction</Code></Error></ErrorResponse>",
+                             "text/xml");
+        return;
+    }
+    body += "</" + action + "Response>";
+
+    handler.sendResponse(200, body, "text/xml");
+}
+
+string
+SqsMockService::
+sendResult(const string & body)
+{
+    string messageId;
+    {
+        lock_guard<mutex> guard(lock);
+        messageId = "message-" + to_string(++counter_);
+        messages_.emplace_back(messageId, body);
+    }
+    numMessagesSent++;
+
+    return ("<MessageId>" + messageId + "</MessageId>"
+            "<MD5OfMessageBody>0</MD5OfMessageBody>");
+}
+
+string
+SqsMockService::
+receiveMessages(int maxMessages, double waitTime)
+{
+    string result;
+    Date deadline = Date::now().plusSeconds(waitTime);
+
+    /* Long polling: wait until there are messages or the deadline is past */
+    for (;;) {
+        {
+            lock_guard<mutex> guard(lock);
+            for (int i = 0;  i < maxMessages && !messages_.empty();  ++i) {
+                auto message = messages_.front();
+                messages_.pop_front();
+                string handle = "handle-" + message.first;
+                received_[handle] = message.second;
+                result += ("<Message>"
+                           "<MessageId>" + message.first + "</MessageId>"
+                           "<ReceiptHandle>" + handle + "</ReceiptHandle>"
+                           "<MD5OfBody>0</MD5OfBody>"
+                           "<Body>" + xmlEscape(message.second) + "</Body>"
+                           "<Attribute><Name>SenderId</Name>"
+                           "<Value>123456789012</Value></Attribute>"
+                           "<Attribute><Name>ApproximateReceiveCount</Name>"
+                           "<Value>1</Value></Attribute>"
+                           "</Message>");
+                numMessagesReceived++;
+            }
+        }
+        if (!result.empty() || Date::now() >= deadline) {
+            break;
+        }
+        ::usleep(5000);
+    }
+
+    return result;
+}
+
+
+S3MockService::
+S3MockService(const shared_ptr<ServiceProxies> & proxies,
+              const string & bucket)
+    : HttpService(proxies), bucket(bucket), requestDelay(0.0)
+{}
+
+string
+S3MockService::
+serviceUri()
+    const
+{
+    return "http://127.0.0.1:" + to_string(port());
+}
+
+void
+S3MockService::
+addObject(const string & key, uint64_t size)
+{
+    lock_guard<mutex> guard(lock);
+    objects_[key] = size;
+}
+
+size_t
+S3MockService::
+numObjects()
+    const
+{
+    lock_guard<mutex> guard(lock);
+    return objects_.size();
+}
+
+size_t
+S3MockService::
+numRequests(const string & verb)
+    const
+{
+    lock_guard<mutex> guard(lock);
+    auto it = requests_.find(verb);
+    return it == requests_.end() ? 0 : it->second;
+}
+
+void
+S3MockService::
+handleHttpPayload(HttpTestConnHandler & handler,
+                  const HttpHeader & header,
+                  const string & payload)
+{
+    numReqs++;
+    {
+        lock_guard<mutex> guard(lock);
+        requests_[header.verb]++;
+    }
+    if (requestDelay > 0.0) {
+        ::usleep(requestDelay * 1000000);
+    }
+
+    string bucketPath = "/" + bucket + "/";
+    if (header.resource.compare(0, bucketPath.size(), bucketPath) != 0) {
+        handler.sendResponse(404,
+                             "<Error><Code>NoSuchBucket</Code>"
+                             "<Message>no such bucket</Message></Error>",
+                             "application/xml");
+        return;
+    }
+    string key(header.resource, bucketPath.size());
+
+    if (header.verb == "GET" && key.empty()) {
+        handler.sendResponse(200, listObjects(header.queryParams),
+                             "application/xml");
+    }
+    else if (header.verb == "POST" && key.empty()
+             && header.queryParams.hasValue("delete")) {
+        handler.sendResponse(200, deleteObjects(payload), "application/xml");
+    }
+    else if (header.verb == "DELETE" && !key.empty()) {
+        key = formDecode(key.c_str(), key.c_str() + key.size());
+        lock_guard<mutex> guard(lock);
+        objects_.erase(key);
+        handler.sendResponse(204, "", "application/xml");
+    }
+    else {
+        handler.sendResponse(400,
+                             "<Error><Code>InvalidRequest</Code>"
+                             "<Message>unsupported request</Message></Error>",
+                             "application/xml");
+    }
+}
+
+string
+S3MockService::
+listObjects(const RestParams & params)
+{
+    auto getParam = [&] (const string & key) {
+        return params.hasValue(key) ? params.getValue(key) : string();
+    };
+    string prefix = getParam("prefix");
+    string delimiter = getParam("delimiter");
+    string marker = getParam("marker");
+    size_t maxKeys = (params.hasValue("max-keys")
+                      ? stoi(params.getValue("max-keys")) : 1000);
+
+    string contents;
+    string commonPrefixes;
+    string lastCommonPrefix;
+    string nextMarker;
+    size_t numEntries(0);
+    bool isTruncated(false);
+
+    lock_guard<mutex> guard(lock);
+    auto it = objects_.upper_bound(marker);
+    if (prefix > marker) {
+        it = objects_.lower_bound(prefix);
+    }
+    for (; it != objects_.end();  ++it) {
+        const string & key = it->first;
+        if (key.compare(0, prefix.size(), prefix) != 0) {
+            break;
+        }
+
+        string commonPrefix;
+        if (!delimiter.empty()) {
+            size_t pos = key.find(delimiter, prefix.size());
+            if (pos != string::npos) {
+                commonPrefix = string(key, 0, pos + delimiter.size());
+                if (commonPrefix == lastCommonPrefix
+                    || commonPrefix <= marker) {
+                    continue;
+                }
+            }
+        }
+
+        if (numEntries == maxKeys) {
+            isTruncated = true;
+            break;
+        }
+        numEntries++;
+
+        if (!commonPrefix.empty()) {
+            commonPrefixes += ("<CommonPrefixes><Prefix>"
+                               + xmlEscape(commonPrefix)
+                               + "</Prefix></CommonPrefixes>");
+            lastCommonPrefix = commonPrefix;
+            nextMarker = commonPrefix;
+        }
+        else {
+            contents += ("<Contents>"
+                         "<Key>" + xmlEscape(key) + "</Key>"
+                         "<LastModified>2014-01-01T00:00:00.000Z"
+                         "</LastModified>"
+                         "<ETag>&quot;0123456789abcdef&quot;</ETag>"
+                         "<Size>" + to_string(it->second) + "</Size>"
+                         "<Owner><ID>owner</ID>"
+                         "<DisplayName>Owner</DisplayName></Owner>"
+                         "<StorageClass>STANDARD</StorageClass>"
+                         "</Contents>");
+            nextMarker = key;
+        }
+    }
+
+    string result = ("<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+                     "<ListBucketResult"
+                     " xmlns=\"http://s3.amazonaws.com/doc/2006-03-01/\">"
+                     "<Name>" + bucket + "</Name>"
+                     "<Prefix>" + xmlEscape(prefix) + "</Prefix>"
+                     "<Marker>" + xmlEscape(marker) + "</Marker>"
+                     "<MaxKeys>" + to_string(maxKeys) + "</MaxKeys>");
+    if (!delimiter.empty()) {
+        result += "<Delimiter>" + xmlEscape(delimiter) + "</Delimiter>";
+    }
+    result += (string("<IsTruncated>") + (isTruncated ? "true" : "false")
+               + "</IsTruncated>");
+    /* like S3, only give the next marker when there is a delimiter */
+    if (isTruncated && !delimiter.empty()) {
+        result += "<NextMarker>" + xmlEscape(nextMarker) + "</NextMarker>";
+    }
+    result += contents + commonPrefixes + "</ListBucketResult>";
+
+    return result;
+}
+
+string
+S3MockService::
+deleteObjects(const string & payload)
+{
+    string errors;
+
+    lock_guard<mutex> guard(lock);
+    for (size_t pos = payload.find("<Key>");  pos != string::npos;
+         pos = payload.find("<Key>", pos)) {
+        pos += 5;
+        size_t end = payload.find("</Key>", pos);
+        string key = xmlUnescape(string(payload, pos, end - pos));
+        if (key.compare(0, 10, "protected/") == 0) {
+            errors += ("<Error><Key>" + xmlEscape(key) + "</Key>"
+                       "<Code>AccessDenied</Code>"
+                       "<Message>Access Denied</Message></Error>");
+        }
+        else {
+            objects_.erase(key);
+        }
+    }
+
+    /* quiet mode: only the errors are reported */
+    return ("<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+            "<DeleteResult"
+            " xmlns=\"http://s3.amazonaws.com/doc/2006-03-01/\">"
+            + errors + "</DeleteResult>");
+}
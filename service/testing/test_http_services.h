@@ -1,8 +1,10 @@
 #pragma once
 
 #include <atomic>
+#include <deque>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <string>
 
 #include "soa/service/http_endpoint.h"
@@ -69,4 +71,77 @@ struct HttpUploadService : public HttpService
                            const std::string & payload);
 };
 
+/* A minimal in-memory SQS queue, answering the actions used by SqsApi and
+   SqsEngine.  Visibility timeouts are not enforced: received messages stay
+   invisible until they are deleted. */
+struct SqsMockService : public HttpService
+{
+    SqsMockService(const std::shared_ptr<ServiceProxies> & proxies);
+
+    void handleHttpPayload(HttpTestConnHandler & handler,
+                           const HttpHeader & header,
+                           const std::string & payload);
+
+    /* URI of the queue, once the service is listening */
+    std::string queueUri() const;
+
+    /* Number of requests received for the given action */
+    size_t numRequests(const std::string & action) const;
+
+    std::atomic<size_t> numMessagesSent;
+    std::atomic<size_t> numMessagesReceived;
+    std::atomic<size_t> numMessagesDeleted;
+    std::atomic<size_t> numVisibilityChanges;
+
+    /* Number of the next requests that fail with an internal error */
+    std::atomic<int> numFailures;
+
+private:
+    std::string sendResult(const std::string & body);
+    std::string receiveMessages(int maxMessages, double waitTime);
+
+    mutable std::mutex lock;
+    std::map<std::string, size_t> requests_;
+    std::deque<std::pair<std::string, std::string> > messages_;
+    std::map<std::string, std::string> received_;
+    size_t counter_;
+};
+
+/* A minimal in-memory S3 service for a single bucket, answering path-style
+   object listings and deletes (single and multi-object).  Keys starting
+   with "protected/" can't be deleted. */
+struct S3MockService : public HttpService
+{
+    S3MockService(const std::shared_ptr<ServiceProxies> & proxies,
+                  const std::string & bucket = "test-bucket");
+
+    void handleHttpPayload(HttpTestConnHandler & handler,
+                           const HttpHeader & header,
+                           const std::string & payload);
+
+    /* Endpoint to give as the serviceUri of S3Api, once the service is
+       listening */
+    std::string serviceUri() const;
+
+    void addObject(const std::string & key, uint64_t size = 0);
+    size_t numObjects() const;
+
+    /* Number of requests received with the given verb */
+    size_t numRequests(const std::string & verb) const;
+
+    std::string bucket;
+
+    /* Time taken to answer each request, to simulate the latency of the
+       real service */
+    double requestDelay;
+
+private:
+    std::string listObjects(const RestParams & params);
+    std::string deleteObjects(const std::string & payload);
+
+    mutable std::mutex lock;
+    std::map<std::string, size_t> requests_;
+    std::map<std::string, uint64_t> objects_;
+};
+
 } // namespace Datacratic
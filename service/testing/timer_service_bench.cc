@@ -0,0 +1,215 @@
+/* timer_service_bench.cc
+   Copyright (c) 2014 Datacratic.  All rights reserved.
+
+   Wakeups and accuracy of many periodic timers served by one timer fd
+   each, and by the timer service with several amounts of slack, while
+   other threads keep the CPU busy.
+
+   Usage: timer_service_bench [numTimers [seconds [numLoadThreads]]]
+*/
+
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <algorithm>
+#include <atomic>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "jml/arch/exception.h"
+#include "soa/service/timer_service.h"
+
+using namespace std;
+using namespace Datacratic;
+
+
+namespace {
+
+struct Result {
+    Result()
+        : numWakeups(0), numFired(0)
+    {
+    }
+
+    uint64_t numWakeups;
+    uint64_t numFired;
+    vector<double> lateness;
+
+    void print(const char * name, double seconds)
+    {
+        std::sort(lateness.begin(), lateness.end());
+        auto percentile = [&] (double p)
+            {
+                if (lateness.empty())
+                    return 0.0;
+                return lateness[(lateness.size() - 1) * p] * 1000000.0;
+            };
+
+        printf("%-16s %10.0f %10.0f %10.0f %10.0f %10.0f\n",
+               name, numWakeups / seconds, numFired / seconds,
+               percentile(0.5), percentile(0.99), percentile(1.0));
+    }
+};
+
+/* Periods of the timers, between 10ms and 100ms */
+vector<double> makePeriods(int numTimers)
+{
+    std::mt19937 rng(42);
+    std::uniform_real_distribution<double> dist(0.010, 0.100);
+    vector<double> periods;
+    for (int i = 0;  i < numTimers;  ++i)
+        periods.push_back(dist(rng));
+    return periods;
+}
+
+/* One timer fd per timer, all in an epoll set */
+Result runTimerFds(const vector<double> & periods, double seconds)
+{
+    Result result;
+
+    int epollFd = epoll_create1(0);
+    if (epollFd == -1)
+        throw ML::Exception(errno, "epoll_create1");
+
+    Date start = Date::now();
+    vector<int> fds;
+    vector<Date> deadlines;
+    for (unsigned i = 0;  i < periods.size();  ++i) {
+        int fd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK);
+        if (fd == -1)
+            throw ML::Exception(errno, "timerfd_create");
+
+        Date first = start.plusSeconds(periods[i]);
+        itimerspec spec;
+        spec.it_value.tv_sec = first.wholeSecondsSinceEpoch();
+        spec.it_value.tv_nsec = first.fractionalSeconds() * 1000000000.0;
+        spec.it_interval.tv_sec = periods[i];
+        spec.it_interval.tv_nsec
+            = (periods[i] - spec.it_interval.tv_sec) * 1000000000.0;
+        int res = timerfd_settime(fd, TFD_TIMER_ABSTIME, &spec, 0);
+        if (res == -1)
+            throw ML::Exception(errno, "timerfd_settime");
+
+        epoll_event event;
+        event.events = EPOLLIN;
+        event.data.u32 = i;
+        res = epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event);
+        if (res == -1)
+            throw ML::Exception(errno, "epoll_ctl");
+
+        fds.push_back(fd);
+        deadlines.push_back(first);
+    }
+
+    Date end = start.plusSeconds(seconds);
+    epoll_event events[256];
+    while (Date::now() < end) {
+        int n = epoll_wait(epollFd, events, 256, 10);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1)
+            throw ML::Exception(errno, "epoll_wait");
+        if (n > 0)
+            ++result.numWakeups;
+
+        Date now = Date::now();
+        for (int i = 0;  i < n;  ++i) {
+            int timer = events[i].data.u32;
+            uint64_t numExpirations;
+            int res = ::read(fds[timer], &numExpirations, 8);
+            if (res != 8)
+                continue;
+            result.lateness.push_back(now.secondsSince(deadlines[timer]));
+            deadlines[timer]
+                = deadlines[timer].plusSeconds(numExpirations
+                                               * periods[timer]);
+            ++result.numFired;
+        }
+    }
+
+    for (int fd: fds)
+        ::close(fd);
+    ::close(epollFd);
+
+    return result;
+}
+
+/* All of the timers in one timer service */
+Result runTimerService(const vector<double> & periods, double seconds,
+                       double slack)
+{
+    Result result;
+    TimerService timers;
+
+    Date start = Date::now();
+    vector<Date> deadlines(periods.size());
+    for (unsigned i = 0;  i < periods.size();  ++i) {
+        // The first deadline is one period after the timer is scheduled
+        deadlines[i] = Date::now().plusSeconds(periods[i]);
+        auto onTimer = [&, i] (uint64_t numExpirations)
+            {
+                Date now = Date::now();
+                result.lateness.push_back(now.secondsSince(deadlines[i]));
+                deadlines[i] = deadlines[i].plusSeconds(numExpirations
+                                                        * periods[i]);
+            };
+        timers.schedulePeriodic(periods[i], onTimer, slack);
+    }
+
+    Date end = start.plusSeconds(seconds);
+    while (Date::now() < end) {
+        pollfd fd = { timers.selectFd(), POLLIN, 0 };
+        int res = ::poll(&fd, 1, 10);
+        if (res == 1)
+            timers.processOne();
+    }
+
+    result.numWakeups = timers.numWakeups();
+    result.numFired = timers.numFired();
+    return result;
+}
+
+} // file scope
+
+
+int main(int argc, char ** argv)
+{
+    int numTimers = argc > 1 ? atoi(argv[1]) : 1000;
+    double seconds = argc > 2 ? atof(argv[2]) : 5.0;
+    int numLoadThreads = argc > 3 ? atoi(argv[3]) : 1;
+
+    // Threads that compete with us for the CPU
+    std::atomic<bool> shutdown(false);
+    vector<std::thread> load;
+    for (int i = 0;  i < numLoadThreads;  ++i) {
+        load.emplace_back([&] ()
+                          {
+                              volatile uint64_t n = 0;
+                              while (!shutdown)
+                                  ++n;
+                          });
+    }
+
+    vector<double> periods = makePeriods(numTimers);
+
+    printf("%d timers over %.1fs with %d load threads\n",
+           numTimers, seconds, numLoadThreads);
+    printf("%-16s %10s %10s %10s %10s %10s\n",
+           "", "wakeups/s", "fired/s", "late p50us", "p99us", "maxus");
+
+    runTimerFds(periods, seconds).print("timerfd each", seconds);
+    runTimerService(periods, seconds, 0.0)
+        .print("service slack 0", seconds);
+    runTimerService(periods, seconds, 0.001)
+        .print("service 1ms", seconds);
+    runTimerService(periods, seconds, 0.010)
+        .print("service 10ms", seconds);
+
+    shutdown = true;
+    for (auto & t: load)
+        t.join();
+}
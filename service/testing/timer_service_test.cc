@@ -0,0 +1,171 @@
+/* timer_service_test.cc
+   Copyright (c) 2014 Datacratic.  All rights reserved.
+
+   Tests for the timer service.
+*/
+
+#define BOOST_TEST_MAIN
+#define BOOST_TEST_DYN_LINK
+
+#include <boost/test/unit_test.hpp>
+#include <poll.h>
+#include <vector>
+#include "soa/service/timer_service.h"
+
+using namespace std;
+using namespace Datacratic;
+
+
+namespace {
+
+/* Run the timers as they expire for the given number of seconds */
+void runFor(TimerService & timers, double seconds)
+{
+    Date end = Date::now().plusSeconds(seconds);
+    for (Date now = Date::now();  now < end;  now = Date::now()) {
+        pollfd fd = { timers.selectFd(), POLLIN, 0 };
+        int timeout = std::max<int>(1, now.secondsUntil(end) * 1000);
+        if (::poll(&fd, 1, timeout) == 1)
+            timers.processOne();
+    }
+}
+
+} // file scope
+
+
+BOOST_AUTO_TEST_CASE( test_timer_service_one_shot )
+{
+    TimerService timers;
+
+    Date deadline = Date::now().plusSeconds(0.020);
+    Date fired;
+    int numFired = 0;
+    timers.scheduleAt(deadline, [&] (uint64_t n)
+                      {
+                          fired = Date::now();
+                          numFired += n;
+                      });
+
+    auto cancelled = timers.scheduleIn(0.010, [&] (uint64_t) { numFired += 100; });
+    BOOST_CHECK_EQUAL(timers.size(), 2);
+    BOOST_CHECK(timers.cancel(cancelled));
+    BOOST_CHECK(!timers.cancel(cancelled));
+
+    runFor(timers, 0.050);
+
+    BOOST_CHECK_EQUAL(numFired, 1);
+    BOOST_CHECK_GE(fired, deadline);
+    BOOST_CHECK_LT(fired, deadline.plusSeconds(0.010));
+    BOOST_CHECK_EQUAL(timers.size(), 0);
+}
+
+BOOST_AUTO_TEST_CASE( test_timer_service_periodic )
+{
+    TimerService timers;
+
+    uint64_t numTicks = 0;
+    TimerService::TimerId id = 0;
+    id = timers.schedulePeriodic(0.010, [&] (uint64_t n)
+                                 {
+                                     numTicks += n;
+                                     if (numTicks >= 5)
+                                         timers.cancel(id);
+                                 });
+
+    runFor(timers, 0.100);
+    BOOST_CHECK_EQUAL(numTicks, 5);
+    BOOST_CHECK_EQUAL(timers.size(), 0);
+
+    /* a periodic timer that is running isn't taken again, and the periods
+       that went by in the meantime are counted */
+    id = timers.schedulePeriodic(0.010, [&] (uint64_t n) { numTicks = n; });
+
+    vector<TimerService::Expired> expired;
+    Date now = Date::now();
+    timers.takeExpired(expired, now.plusSeconds(0.015));
+    BOOST_REQUIRE_EQUAL(expired.size(), 1);
+    BOOST_CHECK_EQUAL(expired[0].numExpirations, 1);
+
+    vector<TimerService::Expired> expired2;
+    timers.takeExpired(expired2, now.plusSeconds(0.050));
+    BOOST_CHECK(expired2.empty());
+
+    /* once it has run it goes back in the wheel, overdue */
+    timers.run(expired[0]);
+    BOOST_CHECK_EQUAL(numTicks, 1);
+    timers.takeExpired(expired2, now.plusSeconds(0.055));
+    BOOST_REQUIRE_EQUAL(expired2.size(), 1);
+    BOOST_CHECK_GE(expired2[0].numExpirations, 3);
+}
+
+BOOST_AUTO_TEST_CASE( test_timer_service_coalescing )
+{
+    /* 64 timers with deadlines spread over 32ms */
+    auto scheduleAll = [] (TimerService & timers, double slack, int & numFired)
+        {
+            Date start = Date::now().plusSeconds(0.010);
+            for (int i = 0;  i < 64;  ++i) {
+                timers.scheduleAt(start.plusSeconds(i * 0.0005),
+                                  [&] (uint64_t) { ++numFired; },
+                                  slack);
+            }
+        };
+
+    TimerService exact;
+    int numFiredExact = 0;
+    scheduleAll(exact, 0.0, numFiredExact);
+    runFor(exact, 0.080);
+    BOOST_CHECK_EQUAL(numFiredExact, 64);
+
+    TimerService coalesced;
+    int numFiredCoalesced = 0;
+    scheduleAll(coalesced, 0.032, numFiredCoalesced);
+    runFor(coalesced, 0.080);
+    BOOST_CHECK_EQUAL(numFiredCoalesced, 64);
+
+    cerr << "wakeups: exact " << exact.numWakeups()
+         << " coalesced " << coalesced.numWakeups() << endl;
+    BOOST_CHECK_GE(exact.numWakeups(), 10);
+    BOOST_CHECK_LE(coalesced.numWakeups(), 2);
+}
+
+BOOST_AUTO_TEST_CASE( test_timer_service_precise )
+{
+    /* timers with no slack fire at their deadline, not on the next tick */
+    TimerService timers(0.010);
+
+    Date deadline = Date::now().plusSeconds(0.012);
+    Date fired;
+    timers.scheduleAt(deadline, [&] (uint64_t) { fired = Date::now(); });
+
+    /* nothing is due before the deadline */
+    vector<TimerService::Expired> expired;
+    timers.takeExpired(expired, deadline.plusSeconds(-0.001));
+    BOOST_CHECK(expired.empty());
+
+    runFor(timers, 0.040);
+    BOOST_CHECK_GE(fired, deadline);
+    BOOST_CHECK_LT(fired, deadline.plusSeconds(0.008));
+}
+
+BOOST_AUTO_TEST_CASE( test_timer_service_reschedule )
+{
+    /* a timeout that is rescheduled over and over, as those of the
+       transports are */
+    TimerService timers;
+
+    int numFired = 0;
+    TimerService::TimerId id = 0;
+    for (int i = 0;  i < 10000;  ++i) {
+        if (id)
+            BOOST_CHECK(timers.cancel(id));
+        id = timers.scheduleIn(0.020 + i * 0.000001,
+                               [&] (uint64_t) { ++numFired; },
+                               0.001);
+    }
+    BOOST_CHECK_EQUAL(timers.size(), 1);
+
+    runFor(timers, 0.060);
+    BOOST_CHECK_EQUAL(numFired, 1);
+    BOOST_CHECK_EQUAL(timers.size(), 0);
+}
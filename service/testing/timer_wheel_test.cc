@@ -0,0 +1,126 @@
+/* timer_wheel_test.cc
+   Copyright (c) 2014 Datacratic.  All rights reserved.
+
+   Tests for the timer wheel.
+*/
+
+#define BOOST_TEST_MAIN
+#define BOOST_TEST_DYN_LINK
+
+#include <boost/test/unit_test.hpp>
+#include <map>
+#include <random>
+#include <set>
+#include <vector>
+#include "soa/service/timer_wheel.h"
+
+using namespace std;
+using namespace Datacratic;
+
+
+BOOST_AUTO_TEST_CASE( test_timer_wheel_ordering )
+{
+    TimerWheel<int> wheel(0.001, 16);
+
+    Date start = Date::now();
+
+    BOOST_CHECK(wheel.empty());
+    BOOST_CHECK_EQUAL(wheel.nextExpiry(), Date::positiveInfinity());
+
+    wheel.insert(start.plusSeconds(0.010), 10);
+    wheel.insert(start.plusSeconds(0.005), 5);
+    // more than one revolution away
+    wheel.insert(start.plusSeconds(0.050), 50);
+
+    BOOST_CHECK_EQUAL(wheel.size(), 3);
+    BOOST_CHECK_GE(wheel.nextExpiry(), start.plusSeconds(0.005));
+    BOOST_CHECK_LT(wheel.nextExpiry(), start.plusSeconds(0.007));
+
+    vector<int> expired;
+    auto onExpired = [&] (int key) { expired.push_back(key); };
+
+    // Nothing is due yet
+    BOOST_CHECK_EQUAL(wheel.expire(start.plusSeconds(0.002), onExpired), 0);
+    BOOST_CHECK(expired.empty());
+
+    BOOST_CHECK_EQUAL(wheel.expire(start.plusSeconds(0.007), onExpired), 1);
+    BOOST_CHECK(expired == vector<int>({ 5 }));
+
+    BOOST_CHECK_GE(wheel.nextExpiry(), start.plusSeconds(0.010));
+    BOOST_CHECK_LT(wheel.nextExpiry(), start.plusSeconds(0.012));
+
+    // Entry 50 shares a slot with entries of the current revolution but
+    // must not fire until its own
+    BOOST_CHECK_EQUAL(wheel.expire(start.plusSeconds(0.020), onExpired), 1);
+    BOOST_CHECK(expired == vector<int>({ 5, 10 }));
+    BOOST_CHECK_GE(wheel.nextExpiry(), start.plusSeconds(0.050));
+
+    // Falling behind by several revolutions still expires everything once
+    BOOST_CHECK_EQUAL(wheel.expire(start.plusSeconds(1.0), onExpired), 1);
+    BOOST_CHECK(expired == vector<int>({ 5, 10, 50 }));
+    BOOST_CHECK(wheel.empty());
+}
+
+BOOST_AUTO_TEST_CASE( test_timer_wheel_past_deadline )
+{
+    TimerWheel<int> wheel(0.001, 16);
+
+    Date now = Date::now();
+    wheel.expire(now, [] (int) {});
+
+    // Deadlines in the past fire on the next expiry
+    wheel.insert(now.plusSeconds(-10), 1);
+
+    int numExpired = 0;
+    wheel.expire(now.plusSeconds(0.001), [&] (int) { ++numExpired; });
+    BOOST_CHECK_EQUAL(numExpired, 1);
+    BOOST_CHECK(wheel.empty());
+}
+
+BOOST_AUTO_TEST_CASE( test_timer_wheel_levels )
+{
+    // Three levels of 8 slots cover 512 ticks; anything further away waits
+    // in the top level
+    TimerWheel<int> wheel(0.001, 8, 3);
+
+    Date start = Date::fromSecondsSinceEpoch(1000000.0);
+    wheel.expire(start, [] (int) {});
+
+    mt19937 rng(1);
+    uniform_int_distribution<int> delay(1, 2000);
+
+    multimap<int, int> expected;
+    for (int i = 0;  i < 2000;  ++i) {
+        int ticks = delay(rng);
+        expected.insert({ ticks, i });
+        wheel.insert(start.plusSeconds(ticks * 0.001), i);
+    }
+
+    // Expire in steps of various sizes, checking against the deadlines
+    int done = 0;
+    for (int now = 0;  now <= 2100;) {
+        if (!expected.empty()) {
+            int next = expected.begin()->first;
+            BOOST_REQUIRE_CLOSE(wheel.nextExpiry().secondsSinceEpoch(),
+                                start.secondsSinceEpoch() + next * 0.001,
+                                1e-9);
+        }
+
+        auto end = expected.upper_bound(now);
+        set<int> due;
+        for (auto it = expected.begin();  it != end;  ++it)
+            due.insert(it->second);
+        expected.erase(expected.begin(), end);
+
+        set<int> expired;
+        wheel.expire(start.plusSeconds(now * 0.001 + 0.0001),
+                     [&] (int key) { expired.insert(key); });
+        BOOST_REQUIRE(expired == due);
+        done += expired.size();
+
+        now += 1 + now % 37;
+    }
+
+    BOOST_CHECK_EQUAL(done, 2000);
+    BOOST_CHECK(wheel.empty());
+}
@@ -0,0 +1,180 @@
+/* transport_async_bench.cc
+   Copyright (c) 2014 Datacratic.  All rights reserved.
+
+   Benchmark of cross-thread async dispatches, both through the raw
+   pooled MPSC queue and end to end through TransportBase::doAsync().
+*/
+
+#include <thread>
+#include <atomic>
+#include <vector>
+
+#include "jml/arch/futex.h"
+#include "jml/arch/timers.h"
+#include "jml/utils/smart_ptr_utils.h"
+#include "soa/service/active_endpoint.h"
+#include "soa/service/passive_endpoint.h"
+#include "soa/service/mpsc_queue.h"
+#include "soa/service/block_pool.h"
+#include "soa/service/inline_function.h"
+
+using namespace std;
+using namespace Datacratic;
+
+
+/* Node that looks like a TransportBase::AsyncNode. */
+struct BenchNode : public MpscQueueNode {
+    InlineFunction<96> callback;
+    const char * name;
+};
+
+typedef BlockPool<sizeof(BenchNode)> BenchNodePool;
+
+/* numProducers threads each push numMessages pooled nodes to a single
+   consumer thread, which runs and frees them. */
+void benchQueue(int numProducers, int numMessages)
+{
+    MpscQueue<BenchNode> queue;
+    uint64_t total = uint64_t(numProducers) * numMessages;
+    uint64_t done = 0;
+    std::atomic<bool> start(false);
+
+    std::thread consumer([&] () {
+            while (done < total) {
+                BenchNode * node = queue.pop();
+                if (!node) {
+                    std::this_thread::yield();
+                    continue;
+                }
+                node->callback();
+                node->~BenchNode();
+                BenchNodePool::deallocate(node);
+            }
+        });
+
+    vector<std::thread> producers;
+    for (int i = 0;  i < numProducers;  ++i) {
+        producers.emplace_back([&] () {
+                while (!start) ;
+                for (int j = 0;  j < numMessages;  ++j) {
+                    BenchNode * node
+                        = new (BenchNodePool::allocate()) BenchNode();
+                    node->name = "bench";
+                    node->callback.emplace([&done] () { ++done; });
+                    queue.push(node);
+                }
+            });
+    }
+
+    Date before = Date::now();
+    start = true;
+    for (auto & th: producers)
+        th.join();
+    consumer.join();
+    double elapsed = Date::now().secondsSince(before);
+
+    ::printf("queue,%d,%llu,%f,%f\n",
+             numProducers, (unsigned long long)total, elapsed,
+             total / elapsed);
+}
+
+struct NullHandler : public ConnectionHandler {
+    virtual void doError(const std::string & error)
+    {
+        cerr << "error: " << error << endl;
+    }
+};
+
+/* numProducers threads each call doAsync() numMessages times on a
+   connection, whose endpoint thread runs the callbacks. */
+void benchTransport(bool direct, int numProducers, int numMessages)
+{
+    PassiveEndpointT<SocketTransport> acceptor("acceptor");
+    acceptor.setDirectTransports(direct);
+    acceptor.onMakeNewHandler = [&] ()
+        {
+            return ML::make_std_sp(new NullHandler());
+        };
+    int port = acceptor.init();
+
+    ActiveEndpointT<SocketTransport> connector("connector");
+    connector.setDirectTransports(direct);
+    connector.init(port, "localhost", 1);
+
+    std::shared_ptr<TransportBase> transport;
+    int gotConnection = 0;
+
+    auto onNewConnection = [&] (std::shared_ptr<TransportBase> newTransport)
+        {
+            newTransport->associate(ML::make_std_sp(new NullHandler()));
+            transport = newTransport;
+            gotConnection = 1;
+            ML::futex_wake(gotConnection);
+        };
+    auto onConnectionError = [&] (const std::string & error)
+        {
+            throw ML::Exception("connection error: " + error);
+        };
+    connector.getConnection(onNewConnection, onConnectionError, 1.0);
+    while (!gotConnection)
+        ML::futex_wait(gotConnection, 0);
+
+    int total = numProducers * numMessages;
+    int done = 0;
+    std::atomic<bool> start(false);
+
+    auto onDispatch = [&] ()
+        {
+            // Only ever run in the transport's handler context
+            if (++done == total)
+                ML::futex_wake(done);
+        };
+
+    vector<std::thread> producers;
+    for (int i = 0;  i < numProducers;  ++i) {
+        producers.emplace_back([&] () {
+                while (!start) ;
+                for (int j = 0;  j < numMessages;  ++j)
+                    transport->doAsync(onDispatch, "bench");
+            });
+    }
+
+    Date before = Date::now();
+    start = true;
+    for (auto & th: producers)
+        th.join();
+    while (done < total) {
+        int old = done;
+        ML::futex_wait(done, old, 0.1);
+    }
+    double elapsed = Date::now().secondsSince(before);
+
+    ::printf("%s,%d,%d,%f,%f\n",
+             direct ? "direct" : "nested",
+             numProducers, total, elapsed, total / elapsed);
+
+    transport->closeAsync();
+    transport.reset();
+
+    acceptor.closePeer();
+    connector.sleepUntilIdle();
+    connector.shutdown();
+    acceptor.shutdown();
+}
+
+int main(int argc, char ** argv)
+{
+    int numMessages = 1000000;
+
+    ::printf("mode,producers,dispatches,seconds,dispatches/s\n");
+
+    for (int producers: { 1, 2, 4, 8 })
+        benchQueue(producers, numMessages);
+
+    for (int producers: { 1, 2, 4, 8 }) {
+        benchTransport(false, producers, numMessages / 10);
+        benchTransport(true, producers, numMessages / 10);
+    }
+
+    return 0;
+}
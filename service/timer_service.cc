@@ -0,0 +1,306 @@
+/* timer_service.cc
+   Copyright (c) 2014 Datacratic.  All rights reserved.
+
+   Timers multiplexed onto a single timer fd.
+*/
+
+#include <math.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+#include <iostream>
+
+#include "jml/arch/exception.h"
+#include "timer_service.h"
+
+using namespace std;
+
+
+namespace Datacratic {
+
+
+/*****************************************************************************/
+/* TIMER SERVICE                                                             */
+/*****************************************************************************/
+
+struct TimerService::Timer {
+    Timer(TimerId id, Date deadline, double period, double slack,
+          OnTimer onTimer)
+        : id(id), deadline(deadline), period(period), slack(slack),
+          onTimer(std::move(onTimer)), cancelled(false), queued(false)
+    {
+    }
+
+    TimerId id;
+
+    /** Next deadline; for periodic timers, the deadlines follow each other
+        by exactly one period so that they don't drift. */
+    Date deadline;
+    double period;        ///< zero for one-shot timers
+    double slack;
+    OnTimer onTimer;
+    std::atomic<bool> cancelled;
+
+    /** Whether the timer is in the wheel or with the precise timers, and
+        the date at which it expires there.  Guarded by the lock of the
+        service. */
+    bool queued;
+    Date expiry;
+};
+
+constexpr double TimerService::DefaultMaxSlack;
+
+TimerService::
+TimerService(double resolution)
+    : timerFd_(-1), nextId_(1), wheel_(resolution), numStale_(0),
+      armed_(Date::positiveInfinity()),
+      numWakeups_(0), numFired_(0)
+{
+    timerFd_ = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timerFd_ == -1)
+        throw ML::Exception(errno, "timerfd_create");
+}
+
+TimerService::
+~TimerService()
+{
+    int res = ::close(timerFd_);
+    if (res == -1)
+        cerr << "warning: close on timerfd: " << strerror(errno) << endl;
+}
+
+TimerService::TimerId
+TimerService::
+scheduleAt(Date when, OnTimer onTimer, double slack)
+{
+    if (!onTimer)
+        throw ML::Exception("'onTimer' cannot be nil");
+
+    std::unique_lock<std::mutex> guard(lock);
+    TimerId id = nextId_++;
+    auto timer = std::make_shared<Timer>(id, when, 0.0, slack,
+                                         std::move(onTimer));
+    timers_[id] = timer;
+    insert(*timer);
+    return id;
+}
+
+TimerService::TimerId
+TimerService::
+schedulePeriodic(double period, OnTimer onTimer, double slack)
+{
+    if (!onTimer)
+        throw ML::Exception("'onTimer' cannot be nil");
+    if (period <= 0.0)
+        throw ML::Exception("timer period must be positive");
+    if (slack < 0.0)
+        slack = std::min(period * 0.01, DefaultMaxSlack);
+
+    std::unique_lock<std::mutex> guard(lock);
+    TimerId id = nextId_++;
+    auto timer = std::make_shared<Timer>(id, Date::now().plusSeconds(period),
+                                         period, slack, std::move(onTimer));
+    timers_[id] = timer;
+    insert(*timer);
+    return id;
+}
+
+bool
+TimerService::
+cancel(TimerId id)
+{
+    std::unique_lock<std::mutex> guard(lock);
+    auto it = timers_.find(id);
+    if (it == timers_.end())
+        return false;
+
+    Timer & timer = *it->second;
+    timer.cancelled = true;
+    bool stale = false;
+    if (timer.queued) {
+        if (timer.slack < wheel_.resolution())
+            precise_.erase(std::make_pair(timer.expiry, id));
+        else stale = true;
+    }
+    timers_.erase(it);
+
+    // Timers that are rescheduled over and over (timeouts) would otherwise
+    // leave as many entries in the wheel as were scheduled over the time
+    // it takes them to expire
+    if (stale && ++numStale_ > 1024 && numStale_ > 2 * timers_.size())
+        compact();
+
+    return true;
+}
+
+size_t
+TimerService::
+size() const
+{
+    std::unique_lock<std::mutex> guard(lock);
+    return timers_.size();
+}
+
+Date
+TimerService::
+coalesce(Date deadline, double slack) const
+{
+    double resolution = wheel_.resolution();
+    if (slack < 2 * resolution)
+        return deadline;
+
+    // Largest power of two multiple of the resolution within the slack
+    double grid = resolution * exp2(floor(log2(slack / resolution)));
+    double seconds = ceil(deadline.secondsSinceEpoch() / grid) * grid;
+    return Date::fromSecondsSinceEpoch(seconds);
+}
+
+void
+TimerService::
+insert(Timer & timer)
+{
+    Date when = coalesce(timer.deadline, timer.slack);
+    if (timer.slack < wheel_.resolution())
+        precise_.insert(std::make_pair(when, timer.id));
+    else wheel_.insert(when, timer.id);
+    timer.queued = true;
+    timer.expiry = when;
+
+    if (when < armed_)
+        arm(nextExpiry());
+}
+
+Date
+TimerService::
+nextExpiry() const
+{
+    Date result = wheel_.nextExpiry();
+    if (!precise_.empty() && precise_.begin()->first < result)
+        result = precise_.begin()->first;
+    return result;
+}
+
+void
+TimerService::
+compact()
+{
+    TimerWheel<TimerId> wheel(wheel_.resolution());
+    for (auto & entry: timers_) {
+        const Timer & timer = *entry.second;
+        if (timer.queued && timer.slack >= wheel_.resolution())
+            wheel.insert(timer.expiry, timer.id);
+    }
+    wheel_ = std::move(wheel);
+    numStale_ = 0;
+}
+
+void
+TimerService::
+arm(Date when)
+{
+    armed_ = when;
+
+    itimerspec spec = { { 0, 0 }, { 0, 0 } };
+    if (when != Date::positiveInfinity()) {
+        spec.it_value.tv_sec = when.wholeSecondsSinceEpoch();
+        spec.it_value.tv_nsec = when.fractionalSeconds() * 1000000000.0;
+
+        // A zero it_value would disarm the timer
+        if (spec.it_value.tv_sec == 0 && spec.it_value.tv_nsec == 0)
+            spec.it_value.tv_nsec = 1;
+    }
+
+    int res = timerfd_settime(timerFd_, TFD_TIMER_ABSTIME, &spec, 0);
+    if (res == -1)
+        throw ML::Exception(errno, "timerfd_settime");
+}
+
+void
+TimerService::
+takeExpired(std::vector<Expired> & expired, Date now)
+{
+    std::unique_lock<std::mutex> guard(lock);
+
+    // Nothing is due before the timer fd fires.  The loops that poll us on
+    // each iteration then don't pay for a read().
+    if (now < armed_)
+        return;
+
+    uint64_t numWakeups = 0;
+    int res = ::read(timerFd_, &numWakeups, 8);
+    if (res == -1 && errno != EAGAIN && errno != EINTR)
+        throw ML::Exception(errno, "timerfd read");
+    if (res == 8)
+        ++numWakeups_;
+
+    auto onExpired = [&] (TimerId id)
+        {
+            auto it = timers_.find(id);
+            if (it == timers_.end()) {
+                --numStale_;  // cancelled
+                return;
+            }
+
+            const shared_ptr<Timer> & timer = it->second;
+            timer->queued = false;
+            Expired entry;
+            entry.timer = timer;
+            entry.numExpirations = 1;
+
+            if (timer->period > 0.0) {
+                // Count the periods that went by while we were late
+                double late = now.secondsSince(timer->deadline);
+                if (late > 0.0)
+                    entry.numExpirations += floor(late / timer->period);
+                timer->deadline
+                    = timer->deadline.plusSeconds(entry.numExpirations
+                                                  * timer->period);
+            }
+            else timers_.erase(it);
+
+            expired.push_back(std::move(entry));
+        };
+
+    wheel_.expire(now, onExpired);
+
+    while (!precise_.empty() && precise_.begin()->first <= now) {
+        TimerId id = precise_.begin()->second;
+        precise_.erase(precise_.begin());
+        onExpired(id);
+    }
+
+    // Rearm even if the next expiry is the same, as the timer fd has fired
+    // and won't fire again for it
+    arm(nextExpiry());
+}
+
+void
+TimerService::
+run(const Expired & expired)
+{
+    Timer & timer = *expired.timer;
+    if (timer.cancelled)
+        return;
+
+    ++numFired_;
+    timer.onTimer(expired.numExpirations);
+
+    if (timer.period > 0.0) {
+        std::unique_lock<std::mutex> guard(lock);
+        if (!timer.cancelled)
+            insert(timer);
+    }
+}
+
+bool
+TimerService::
+processOne()
+{
+    std::vector<Expired> expired;
+    takeExpired(expired);
+    for (auto & entry: expired)
+        run(entry);
+    return false;
+}
+
+} // namespace Datacratic
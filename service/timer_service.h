@@ -0,0 +1,182 @@
+/* timer_service.h                                                 -*- C++ -*-
+   Copyright (c) 2014 Datacratic.  All rights reserved.
+
+   Timers multiplexed onto a single timer fd.
+*/
+
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <unordered_map>
+#include <vector>
+
+#include "soa/types/date.h"
+#include "async_event_source.h"
+#include "timer_wheel.h"
+
+
+namespace Datacratic {
+
+
+/*****************************************************************************/
+/* TIMER SERVICE                                                             */
+/*****************************************************************************/
+
+/** Any number of one-shot and periodic timers, kept in a timer wheel and
+    served by a single timer fd that is armed for the earliest of them.
+
+    Each timer can be given a slack: the number of seconds that it is
+    allowed to be late.  Its deadline is then rounded up to a multiple of
+    the largest power of two of the resolution that fits in the slack, so
+    that the timers with nearby deadlines and a similar slack expire at the
+    same time, for a single wakeup.  Timers with less slack than the
+    resolution are kept out of the wheel, in order of their exact
+    deadline, so that they are not rounded up to the next tick.
+
+    Timers can be scheduled and cancelled from any thread.  The callbacks
+    are run by processOne(), or by run() for the loops that take the
+    expired timers with takeExpired() to run them from several threads; a
+    periodic timer is only rescheduled once its callback has returned, so
+    that it never runs concurrently with itself.
+*/
+
+struct TimerService : public AsyncEventSource {
+
+    typedef uint64_t TimerId;
+
+    /** Callback of a timer.  The argument is the number of deadlines that
+        have passed since the last call, which is 1 unless a periodic
+        timer got behind.
+    */
+    typedef std::function<void (uint64_t)> OnTimer;
+
+    TimerService(double resolution = 0.001);
+
+    ~TimerService();
+
+    /** Call onTimer once at the given date, or up to slack seconds later.
+        Returns an id that can be used to cancel the timer.
+    */
+    TimerId scheduleAt(Date when, OnTimer onTimer, double slack = 0.0);
+
+    TimerId scheduleIn(double secondsFromNow, OnTimer onTimer,
+                       double slack = 0.0)
+    {
+        return scheduleAt(Date::now().plusSeconds(secondsFromNow),
+                          std::move(onTimer), slack);
+    }
+
+    /** Call onTimer every period seconds, starting one period from now.
+        A negative slack means a hundredth of the period, but no more than
+        DefaultMaxSlack.
+    */
+    TimerId schedulePeriodic(double period, OnTimer onTimer,
+                             double slack = -1.0);
+
+    /** Maximum slack given by default to periodic timers. */
+    static constexpr double DefaultMaxSlack = 0.010;
+
+    /** Cancel the timer.  Its callback will not be called anymore, unless
+        it has already started.  Returns false if the timer had already
+        expired or been cancelled.
+    */
+    bool cancel(TimerId id);
+
+    /** Number of timers that are scheduled. */
+    size_t size() const;
+
+    /** Resolution of the wheel, under which timers are not coalesced. */
+    double resolution() const
+    {
+        return wheel_.resolution();
+    }
+
+    /** Number of times that the timer fd woke us up. */
+    uint64_t numWakeups() const
+    {
+        return numWakeups_;
+    }
+
+    /** Number of callbacks that were called. */
+    uint64_t numFired() const
+    {
+        return numFired_;
+    }
+
+    struct Timer;
+
+    /** Timer that is due, with the number of its deadlines that passed. */
+    struct Expired {
+        std::shared_ptr<Timer> timer;
+        uint64_t numExpirations;
+    };
+
+    /** Take the timers that are due at the given date and rearm the timer
+        fd for the next one.  The caller then needs to call run() for each
+        of them.  Returns right away, without reading the timer fd, when
+        the date it is armed for hasn't come yet.
+    */
+    void takeExpired(std::vector<Expired> & expired, Date now = Date::now());
+
+    /** Call the callback of an expired timer and reschedule it if it is
+        periodic.
+    */
+    void run(const Expired & expired);
+
+    virtual int selectFd() const
+    {
+        return timerFd_;
+    }
+
+    virtual bool processOne();
+
+private:
+    int timerFd_;
+
+    mutable std::mutex lock;
+    TimerId nextId_;
+    std::unordered_map<TimerId, std::shared_ptr<Timer> > timers_;
+
+    /** Ids of the timers, by the date at which they expire.  Cancelled
+        timers stay in it until then, unless they come to outnumber the
+        timers that are scheduled, in which case it is rebuilt.
+    */
+    TimerWheel<TimerId> wheel_;
+    size_t numStale_;
+
+    /** Ids of the timers with less slack than the resolution, by their
+        exact deadline.
+    */
+    std::set<std::pair<Date, TimerId> > precise_;
+
+    /** Date for which the timer fd is armed. */
+    Date armed_;
+
+    std::atomic<uint64_t> numWakeups_;
+    std::atomic<uint64_t> numFired_;
+
+    /** Date at which a timer with the given deadline and slack expires. */
+    Date coalesce(Date deadline, double slack) const;
+
+    /** Put the timer in the wheel, or with the precise timers.  Must be
+        called with lock held. */
+    void insert(Timer & timer);
+
+    /** Date at which the next timer expires.  Must be called with lock
+        held. */
+    Date nextExpiry() const;
+
+    /** Rebuild the wheel without the cancelled timers.  Must be called with
+        lock held. */
+    void compact();
+
+    /** Arm the timer fd for the given date.  Must be called with lock
+        held. */
+    void arm(Date when);
+};
+
+} // namespace Datacratic
@@ -0,0 +1,255 @@
+/* timer_wheel.h                                                   -*- C++ -*-
+   Copyright (c) 2014 Datacratic.  All rights reserved.
+
+   Hierarchical timing wheel, used to multiplex a large number of timeouts
+   onto a single timer.
+*/
+
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <math.h>
+#include "soa/types/date.h"
+#include "jml/arch/exception.h"
+
+
+namespace Datacratic {
+
+
+/*****************************************************************************/
+/* TIMER WHEEL                                                               */
+/*****************************************************************************/
+
+/** Hierarchical timing wheel.  Deadlines are rounded up to a tick of the
+    given resolution.  The wheel has numLevels levels of numSlots slots,
+    each slot of a level covering a whole revolution of the level below, so
+    that the ticks are counted in base numSlots, one digit per level.  An
+    entry goes into the level of the highest digit where its tick differs
+    from the current one, and is moved down a level each time the current
+    tick reaches the start of its slot, which is when the digits above
+    match.  Insertion is O(1), and expiry only looks at the slots that have
+    become due since the last call.  Deadlines that are further away than
+    the top level can hold stay in it until they get within range.
+
+    There is no removal: owners are expected to cancel lazily by tagging
+    their keys (for example with a generation number) and ignoring stale
+    entries when they expire.
+
+    Not thread safe; the caller needs to provide locking.
+*/
+
+template<typename Key>
+struct TimerWheel {
+
+    TimerWheel(double resolution = 0.001, int numSlots = 256,
+               int numLevels = 4)
+        : resolution_(resolution), levels_(numLevels),
+          currentTick_(-1), size_(0),
+          nextTick_(-1), nextTickValid_(true)
+    {
+        if (resolution <= 0.0)
+            throw ML::Exception("TimerWheel: resolution must be positive");
+        if (numSlots < 2 || (numSlots & (numSlots - 1)) != 0)
+            throw ML::Exception("TimerWheel: number of slots must be a "
+                                "power of two");
+        if (numLevels < 2 || numLevels * log2(numSlots) > 48)
+            throw ML::Exception("TimerWheel: invalid number of levels");
+
+        bits_ = __builtin_ctz(numSlots);
+        mask_ = numSlots - 1;
+        for (auto & level: levels_)
+            level.resize(numSlots);
+    }
+
+    /** Number of entries in the wheel, including cancelled entries that
+        have not yet expired. */
+    size_t size() const { return size_; }
+
+    bool empty() const { return size_ == 0; }
+
+    double resolution() const { return resolution_; }
+
+    /** Insert a key that will expire at the given date.  Dates in the past
+        expire on the next call to expire().
+    */
+    void insert(Date when, const Key & key)
+    {
+        int64_t tick = ceilTick(when);
+        if (currentTick_ == -1)
+            currentTick_ = floorTick(Date::now());
+        if (tick <= currentTick_)
+            tick = currentTick_ + 1;
+
+        place(Entry(tick, key), currentTick_);
+        ++size_;
+
+        if (nextTickValid_ && (nextTick_ == -1 || tick < nextTick_))
+            nextTick_ = tick;
+    }
+
+    /** Call onExpired(key) for every entry whose deadline is at or before
+        the given date, removing them from the wheel.  Returns the number
+        of entries that expired.
+    */
+    template<typename OnExpired>
+    size_t expire(Date now, OnExpired && onExpired)
+    {
+        int64_t nowTick = floorTick(now);
+        if (currentTick_ == -1 || nowTick <= currentTick_) {
+            if (currentTick_ == -1)
+                currentTick_ = nowTick;
+            return 0;
+        }
+
+        size_t numExpired = 0;
+
+        while (currentTick_ < nowTick) {
+            if (!size_) {
+                currentTick_ = nowTick;
+                break;
+            }
+
+            int64_t tick = currentTick_ + 1;
+            if ((tick & mask_) == 0)
+                cascade(tick);
+
+            // Everything in the slot of the lowest level is due now
+            auto & slot = levels_[0][tick & mask_];
+            while (!slot.empty()) {
+                Key key = std::move(slot.back().key);
+                slot.pop_back();
+                --size_;
+                ++numExpired;
+                currentTick_ = tick;
+                onExpired(key);
+            }
+            currentTick_ = tick;
+
+            // Skip the empty slots up to the next cascade
+            int64_t limit = std::min(tick | mask_, nowTick);
+            while (currentTick_ < limit
+                   && levels_[0][(currentTick_ + 1) & mask_].empty())
+                ++currentTick_;
+        }
+
+        if (numExpired)
+            nextTickValid_ = false;
+
+        return numExpired;
+    }
+
+    /** Return the date at which the earliest entry in the wheel expires,
+        or Date::positiveInfinity() if the wheel is empty.
+    */
+    Date nextExpiry() const
+    {
+        if (!size_)
+            return Date::positiveInfinity();
+        if (!nextTickValid_) {
+            nextTick_ = findNextTick();
+            nextTickValid_ = true;
+        }
+        return Date::fromSecondsSinceEpoch(nextTick_ * resolution_);
+    }
+
+private:
+    struct Entry {
+        Entry(int64_t tick, const Key & key)
+            : tick(tick), key(key)
+        {
+        }
+
+        int64_t tick;
+        Key key;
+    };
+
+    typedef std::vector<Entry> Slot;
+
+    double resolution_;
+    int bits_;
+    int64_t mask_;
+    std::vector<std::vector<Slot> > levels_;
+
+    /** All ticks up to and including this one have been expired. */
+    int64_t currentTick_;
+    size_t size_;
+
+    /** Cached earliest tick in the wheel. */
+    mutable int64_t nextTick_;
+    mutable bool nextTickValid_;
+
+    int64_t floorTick(Date date) const
+    {
+        return floor(date.secondsSinceEpoch() / resolution_);
+    }
+
+    int64_t ceilTick(Date date) const
+    {
+        return ceil(date.secondsSinceEpoch() / resolution_);
+    }
+
+    int digit(int64_t tick, int level) const
+    {
+        return (tick >> (level * bits_)) & mask_;
+    }
+
+    /** Put the entry in the level of the highest digit where its tick
+        differs from the reference tick, or in the top level if it's out of
+        range of the wheel.
+    */
+    void place(Entry && entry, int64_t reference)
+    {
+        int64_t diff = entry.tick ^ reference;
+        int level = 0;
+        while (level + 1 < (int)levels_.size()
+               && (diff >> ((level + 1) * bits_)) != 0)
+            ++level;
+        levels_[level][digit(entry.tick, level)].push_back(std::move(entry));
+    }
+
+    /** Move down the entries of the slots that start at the given tick,
+        from the highest level down so that entries can go down more than
+        one level.
+    */
+    void cascade(int64_t tick)
+    {
+        int top = 1;
+        while (top + 1 < (int)levels_.size() && digit(tick, top) == 0)
+            ++top;
+
+        Slot entries;
+        for (int level = top;  level > 0;  --level) {
+            entries.clear();
+            entries.swap(levels_[level][digit(tick, level)]);
+            for (Entry & entry: entries)
+                place(std::move(entry), tick);
+        }
+    }
+
+    /** The entries of a level are all later than those of the levels
+        below, and within a level below the top they are in the slots after
+        the current one in order.  The top level can also hold the entries
+        that are out of range, so it is scanned fully.
+    */
+    int64_t findNextTick() const
+    {
+        for (int level = 0;  level < (int)levels_.size();  ++level) {
+            bool top = (level == (int)levels_.size() - 1);
+            int first = top ? 0 : digit(currentTick_, level) + 1;
+            int64_t result = -1;
+            for (int i = first;  i <= mask_;  ++i) {
+                for (const Entry & entry: levels_[level][i])
+                    if (result == -1 || entry.tick < result)
+                        result = entry.tick;
+                if (result != -1 && !top)
+                    return result;
+            }
+            if (result != -1)
+                return result;
+        }
+        return -1;
+    }
+};
+
+} // namespace Datacratic
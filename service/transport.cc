@@ -8,6 +8,7 @@
 #include "transport.h"
 
 #include "soa/service//http_endpoint.h"
+#include "soa/service/cpu_accounting.h"
 #include "jml/arch/cmp_xchg.h"
 #include "jml/arch/atomic_ops.h"
 #include "jml/arch/format.h"
@@ -50,10 +51,14 @@ TransportBase()
 TransportBase::
 TransportBase(EndpointBase * endpoint)
     : lockThread(0), lockActivity(0), debug(DEBUG_TRANSPORTS),
-      asyncHead_(0),
       endpoint_(endpoint),
       recycle_(0), close_(0), flags_(0),
-      hasConnection_(false), zombie_(false)
+      epollFd_(-1), timerFd_(-1), eventFd_(-1),
+      hasConnection_(false), handlePolled_(false), direct_(false),
+      dispatchState_(DISPATCH_IDLE), pendingEvents_(0),
+      armedEvents_(0), pollData_(0), asyncScheduled_(false),
+      timerId_(0), timerGeneration_(0), firedTimerGeneration_(0),
+      zombie_(false)
 {
     atomic_add(created, 1);
 
@@ -64,6 +69,11 @@ TransportBase(EndpointBase * endpoint)
 
     addActivityS("created");
 
+    // Direct transports are multiplexed onto the endpoint's own fds
+    direct_ = endpoint->directTransports();
+    if (direct_)
+        return;
+
     epollFd_ = epoll_create(1024);
     if (epollFd_ == -1)
         throw ML::Exception(errno, "couldn't create epoll fd");
@@ -94,17 +104,21 @@ TransportBase(EndpointBase * endpoint)
 TransportBase::
 ~TransportBase()
 {
-    int res = close(epollFd_);
-    if (res == -1)
-        cerr << "closing epoll fd: " << strerror(errno) << endl;
-    res = close(timerFd_);
-    if (res == -1)
-        cerr << "closing timer fd: " << strerror(errno) << endl;
-    res = close(eventFd_);
-    if (res == -1)
-        cerr << "closing event fd: " << strerror(errno) << endl;
+    if (!direct_) {
+        int res = close(epollFd_);
+        if (res == -1)
+            cerr << "closing epoll fd: " << strerror(errno) << endl;
+        res = close(timerFd_);
+        if (res == -1)
+            cerr << "closing timer fd: " << strerror(errno) << endl;
+        res = close(eventFd_);
+        if (res == -1)
+            cerr << "closing event fd: " << strerror(errno) << endl;
+    }
+
+    while (AsyncNode * node = popAsync())
+        freeAsync(node);
 
-    popAsync();
     assertNotLockedByAnotherThread();
     checkMagic();
     atomic_add(destroyed, 1);
@@ -250,8 +264,7 @@ handleError(const std::string & error)
 
 int
 TransportBase::
-handleAsync(const std::function<void ()> & callback, const char * name,
-            Date dateSet)
+handleAsync(AsyncCallback & callback, const char * name, Date dateSet)
 {
     Date now = Date::now();
 
@@ -488,13 +501,18 @@ doError(const std::string & error)
     slave().doError(error);
 }
 
+/* Times the handling of an event by a transport, whose time is charged to
+   the type of its connection handler. */
+
 struct TransportTimer {
     TransportTimer(TransportBase * transport,
                    const char * event,
                    double maxTime = 0.0)
         : start(maxTime == 0.0 ? Date() : Date::now()),
           transport(transport), event(event),
-          maxTime(maxTime)
+          maxTime(maxTime),
+          accounting(transport->hasSlave()
+                     ? transport->slave().cpuAccount() : nullptr)
     {
         if (maxTime != 0.0)
             statusBefore = transport->status();
@@ -517,6 +535,7 @@ struct TransportTimer {
     const char * event;
     double maxTime;
     std::string statusBefore;
+    CpuAccountingScope accounting;
 };
 
 int pollFlagsToEpoll(int flags)
@@ -541,6 +560,42 @@ hasConnection()
     if (getHandle() < 0)
         throw ML::Exception("hasConnection without a connection");
 
+    // The endpoint registers the socket of a direct transport itself
+    if (direct_) {
+        hasConnection_ = true;
+        return;
+    }
+
+    if (!handlePolled_)
+        pollHandle();
+
+    hasConnection_ = true;
+
+    //cerr << "transport " << getHandle() << " "
+    //     << status() << " has a connection" << endl;
+}
+
+void
+TransportBase::
+watchConnect()
+{
+    addActivity("watchConnect; handle %d; epoll fd %d",
+                getHandle(), epollFd_);
+
+    if (getHandle() < 0)
+        throw ML::Exception("watchConnect without a socket");
+
+    // Direct transports are polled by the endpoint from the start
+    if (direct_ || handlePolled_)
+        return;
+
+    pollHandle();
+}
+
+void
+TransportBase::
+pollHandle()
+{
     struct epoll_event data;
     data.data.u64 = 0;
     data.data.fd = getHandle();
@@ -549,10 +604,7 @@ hasConnection()
     if (res == -1)
         throw ML::Exception(errno, "epoll_ctl ADD getHandle()");
 
-    hasConnection_ = true;
-
-    //cerr << "transport " << getHandle() << " "
-    //     << status() << " has a connection" << endl;
+    handlePolled_ = true;
 }
 
 std::string
@@ -684,55 +736,17 @@ handleEvents()
             rc = handlePeerShutdown();
         }
 
-        if (hasAsync() && rc != -1) {
-            std::vector<AsyncEntry> async
-                = popAsync();
-            
-            for (unsigned i = 0;  i < async.size();  ++i) {
-                //cerr << "    got async " << async[i].name << endl;
-                TransportTimer timer(this, async[i].name.c_str());
-                rc = handleAsync(async[i].callback,
-                                 async[i].name.c_str(),
-                                 async[i].date);
-                if (rc == -1) break;
-            }
-        }
+        if (hasAsync() && rc != -1)
+            rc = runAsync();
     }
 
     //cerr << "finished handling events for " << this << " with rc " << rc
     //     << endl;
 
     if (rc == -1) {
-
-        //cerr << "    closing connection" << endl;
-        std::shared_ptr<TransportBase> tr
-            = shared_from_this();
-    
-        {
-            InHandlerGuard guard(this, "close");
-
-            addActivityS("close");
-
-            if (hasSlave()) {
-                cerr << "    slave" << endl;
-                slave().onCleanup();
-                slave_.reset();
-            }
-        }
-
-        if (hasConnection_) {
-            int res = epoll_ctl(epollFd_, EPOLL_CTL_DEL, getHandle(), 0);
-            if (res == -1)
-                throw ML::Exception("TransportBase::close(): epoll_ctl DEL %d: %s",
-                                    getHandle(), strerror(errno));
-        }
-        cancelTimer();
-
-        //closePeer();
-        
-        endpoint_->notifyCloseTransport(tr);
+        handleClose();
     }
-    else if (hasConnection_) {
+    else if (handlePolled_) {
         // Change the epoll event set
 
         struct epoll_event data;
@@ -752,6 +766,119 @@ handleEvents()
     return rc;
 }
 
+void
+TransportBase::
+handleClose()
+{
+    //cerr << "    closing connection" << endl;
+    std::shared_ptr<TransportBase> tr
+        = shared_from_this();
+    
+    {
+        InHandlerGuard guard(this, "close");
+
+        addActivityS("close");
+
+        if (hasSlave()) {
+            cerr << "    slave" << endl;
+            slave().onCleanup();
+            slave_.reset();
+        }
+    }
+
+    if (handlePolled_) {
+        int res = epoll_ctl(epollFd_, EPOLL_CTL_DEL, getHandle(), 0);
+        if (res == -1)
+            throw ML::Exception("TransportBase::close(): epoll_ctl DEL %d: %s",
+                                getHandle(), strerror(errno));
+    }
+    cancelTimer();
+
+    //closePeer();
+        
+    endpoint_->notifyCloseTransport(tr);
+}
+
+int
+TransportBase::
+directEpollEvents() const
+{
+    return pollFlagsToEpoll(flags_);
+}
+
+int
+TransportBase::
+handleDirectEvents(int epollEvents)
+{
+    int rc = 0;
+
+    if (isZombie())
+        return 0;
+
+    if (debug)
+        addActivity("handleDirectEvents %s", epollFlags(epollEvents).c_str());
+
+    if (epollEvents & EPOLLERR) {
+        // Connection finished or has an error; check which one
+        int error = 0;
+        socklen_t error_len = sizeof(int);
+        int res = getsockopt(getHandle(), SOL_SOCKET, SO_ERROR,
+                             &error, &error_len);
+        if (res == -1 || error_len != sizeof(int))
+            throw ML::Exception(errno, "getsockopt(SO_ERROR)");
+            
+        TransportTimer timer(this, "error");
+        rc = handleError(strerror(error));
+    }
+    if (rc != -1) {
+        // Timer that fired in the endpoint's timer service; ignore it if it
+        // was cancelled or rescheduled in the meantime
+        uint64_t fired = firedTimerGeneration_.exchange(0);
+        if (fired && fired == timerGeneration_ && timeout_.isSet()) {
+            TransportTimer timer(this, "timeout");
+            rc = handleTimeout();
+        }
+    }
+    if (rc != -1
+        && (epollEvents & EPOLLIN)
+        && (flags_ & POLLIN)) {
+        TransportTimer timer(this, "input");
+        rc = handleInput();
+    }
+    if (rc != -1
+        && (epollEvents & EPOLLOUT)
+        && (flags_ & POLLOUT)) {
+        TransportTimer timer(this, "output");
+        rc = handleOutput();
+    }
+    if (rc != -1
+        && (epollEvents & EPOLLRDHUP)
+        && (flags_ & POLLRDHUP)) {
+        TransportTimer timer(this, "peerShutdown");
+        rc = handlePeerShutdown();
+    }
+    if (rc != -1
+        && (epollEvents & EPOLLHUP)
+        && !(epollEvents & (EPOLLERR | EPOLLIN | EPOLLRDHUP))) {
+        // Epoll always reports a hangup, and as nobody is reading to
+        // notice it the condition would never clear
+        TransportTimer timer(this, "error");
+        rc = handleError("connection hung up");
+    }
+
+    // Async callbacks queued from within our handlers (including by other
+    // async callbacks) are run here too as nobody will wake us up for them.
+    // A node that is still being pushed by another thread will be
+    // scheduled by that thread.
+    if (rc != -1)
+        rc = runAsync();
+
+    if (rc == -1)
+        handleClose();
+
+    return rc;
+}
+
 std::string
 TransportBase::
 status() const
@@ -806,6 +933,15 @@ scheduleTimerAbsolute(Date timeout, size_t cookie,
                       void (*freecookie) (size_t))
 {
     timeout_.set(timeout, cookie, freecookie);
+
+    if (direct_) {
+        cancelDirectTimer();
+        timerId_ = endpoint_->scheduleTransportTimer(shared_from_this(),
+                                                     timeout,
+                                                     timerGeneration_);
+        return;
+    }
+
     long seconds = timeout.wholeSecondsSinceEpoch();
     long nanoseconds = timeout.fractionalSeconds() * 1000000000.0;
     itimerspec spec = { { 0, 0 }, { seconds, nanoseconds } };
@@ -826,8 +962,17 @@ scheduleTimerRelative(double secondsFromNow,
         throw ML::Exception("attempting to schedule timer in the past: %f",
                             secondsFromNow);
 
-    timeout_.set(Date::now().plusSeconds(secondsFromNow),
-                 cookie, freecookie);
+    Date timeout = Date::now().plusSeconds(secondsFromNow);
+    timeout_.set(timeout, cookie, freecookie);
+
+    if (direct_) {
+        cancelDirectTimer();
+        timerId_ = endpoint_->scheduleTransportTimer(shared_from_this(),
+                                                     timeout,
+                                                     timerGeneration_);
+        return;
+    }
+
     long seconds = secondsFromNow;
     long nanoseconds = 1000000000.0 * (secondsFromNow - seconds);
     itimerspec spec = { { 0, 0 }, { seconds, nanoseconds } };
@@ -842,6 +987,11 @@ cancelTimer()
 {
     timeout_.cancel();
 
+    if (direct_) {
+        cancelDirectTimer();
+        return;
+    }
+
     itimerspec spec = { { 0, 0 }, { 0, 0 } };
     int res = timerfd_settime(timerFd_, 0, &spec, 0);
     if (res == -1)
@@ -850,57 +1000,60 @@ cancelTimer()
 
 void
 TransportBase::
-doAsync(const std::function<void ()> & callback, const std::string & name)
+cancelDirectTimer()
 {
-    addActivity("doAsync: %s lockedByThisThread %d", name.c_str(),
-                lockedByThisThread());
-    pushAsync(callback, name);
+    // Ignore the current timer if it is already firing; the new one gets
+    // the new generation
+    ++timerGeneration_;
+
+    uint64_t id = timerId_.exchange(0);
+    if (id)
+        endpoint_->cancelTransportTimer(id);
 }
 
 void
 TransportBase::
-pushAsync(const std::function<void ()> & fn, const std::string & name)
+pushAsync(AsyncNode * node)
 {
-    std::auto_ptr<AsyncNode> node(new AsyncNode(fn, name));
-    
-    AsyncNode * current = asyncHead_;
-    
-    for (;;) {
-        node->next = current;
-        if (ML::cmp_xchg(asyncHead_, current, node.get())) break;
-    }
+    addActivity("doAsync: %s lockedByThisThread %d", node->name,
+                lockedByThisThread());
 
-    node.release();
+    node->date = Date::now();
+    asyncQueue_.push(node);
     
-    if (!lockedByThisThread())
-        eventfd_write(eventFd_, 1);
+    if (!lockedByThisThread()) {
+        if (!direct_)
+            eventfd_write(eventFd_, 1);
+        else if (!asyncScheduled_.exchange(true))
+            endpoint_->scheduleDirectTransport(shared_from_this());
+    }
 }
 
-/** Return the current async list in order and reset it to empty.  Thread safe and lock
-    free. */
-std::vector<TransportBase::AsyncEntry>
+TransportBase::AsyncNode *
 TransportBase::
 popAsync()
 {
-    AsyncNode * current = asyncHead_;
-    
-    for (;;) {
-        if (ML::cmp_xchg(asyncHead_, current, (AsyncNode *)0)) break;
-    }
-    
-    std::vector<AsyncEntry> result;
-    
-    for (; current; ) {
-        result.push_back(*current);
-        auto next = current->next;
-        delete current;
-        current = next;
+    return asyncQueue_.pop();
+}
+
+int
+TransportBase::
+runAsync()
+{
+    int rc = 0;
+
+    while (rc != -1) {
+        AsyncNode * node = popAsync();
+        if (!node) break;
+
+        Call_Guard freeNode([&] () { freeAsync(node); });
+
+        //cerr << "    got async " << node->name << endl;
+        TransportTimer timer(this, node->name);
+        rc = handleAsync(node->callback, node->name, node->date);
     }
-    
-    // TODO: should just iterate in reverse order...
-    std::reverse(result.begin(), result.end());
-    
-    return result;
+
+    return rc;
 }
 
 TransportBase::Activities::
@@ -9,6 +9,7 @@
 #define __rtb__transport_h__
 
 #include <mutex>
+#include <atomic>
 #include <boost/utility.hpp>
 #include <ace/SOCK_Stream.h>
 #include <ace/Synch.h>
@@ -21,6 +22,9 @@
 #include "jml/arch/spinlock.h"
 #include "soa/types/date.h"
 #include "soa/jsoncpp/json.h"
+#include "soa/service/inline_function.h"
+#include "soa/service/mpsc_queue.h"
+#include "soa/service/block_pool.h"
 #include <boost/type_traits/is_convertible.hpp>
 
 namespace Datacratic {
@@ -53,7 +57,9 @@ struct TransportBase : public std::enable_shared_from_this<TransportBase> {
     virtual int handlePeerShutdown();
     virtual int handleTimeout();
     virtual int handleError(const std::string & error);
-    virtual int handleAsync(const std::function<void ()> & callback,
+    typedef InlineFunction<96> AsyncCallback;
+
+    virtual int handleAsync(AsyncCallback & callback,
                             const char * name, Date dateSet);
 
     virtual ssize_t send(const char * buf, size_t len, int flags) = 0;
@@ -122,15 +128,42 @@ struct TransportBase : public std::enable_shared_from_this<TransportBase> {
     void cancelTimer();
 
     /** Run the given function from a worker thread in the context of this
-        handler.
+        handler.  The name needs to be a string with static storage (it
+        is used for debugging and latency reporting).
+
+        Callables of up to sizeof(AsyncCallback) bytes (which includes a
+        std::function) are stored in a pooled node without allocating.
     */
-    void doAsync(const std::function<void ()> & callback,
-                 const std::string & name);
+    template<typename Fn>
+    void doAsync(Fn && callback, const char * name)
+    {
+        AsyncNode * node = new (AsyncNodePool::allocate()) AsyncNode(name);
+        try {
+            node->callback.emplace(std::forward<Fn>(callback));
+        } catch (...) {
+            freeAsync(node);
+            throw;
+        }
+        pushAsync(node);
+    }
 
 
     /** Return the hostname of the connected entity. */
     virtual std::string getPeerName() const = 0;
 
+    /** Is this a direct transport, ie one whose socket is registered with
+        the endpoint's epoll set and which doesn't own any epoll, timer or
+        event fd of its own?  See EndpointBase::setDirectTransports().
+    */
+    bool isDirect() const { return direct_; }
+
+    /** Buffer for handlers to receive data into.  It lives as long as the
+        connection, so that its memory is reused across reads and across
+        the handlers that are associated with the connection in turn.
+        Only to be used from within a handler.
+    */
+    std::string & receiveBuffer() { return receiveBuffer_; }
+
 protected:
     long long lockThread;   ///< For debug for the moment
     const char * lockActivity;
@@ -344,52 +377,52 @@ public:
         const char * where;
     };
 
-    struct AsyncEntry {
-        AsyncEntry()
-            : name("none")
-        {
-        }
-
-        AsyncEntry(const std::function<void ()> & callback,
-                   const std::string & name)
-            : callback(callback), name(name), date(Date::now())
+    /** A node in the queue of things to do asynchronously. */
+    struct AsyncNode : public MpscQueueNode {
+        AsyncNode(const char * name)
+            : name(name)
         {
         }
 
-        std::function<void ()> callback;
-        std::string name;
+        AsyncCallback callback;
+        const char * name;
         Date date;
     };
 
-    /** A node in the list of things to do asynchronously. */
-    struct AsyncNode : public AsyncEntry {
-        AsyncNode(const std::function<void ()> & callback,
-                  const std::string & name)
-            : AsyncEntry(callback, name), next(0)
-        {
-        }
-
-        AsyncNode * next;
-    };
+    typedef BlockPool<sizeof(AsyncNode)> AsyncNodePool;
 
     bool hasAsync() const
     {
-        return asyncHead_;
+        return !asyncQueue_.empty();
     }
 
-    /** Head of list of asynchronous entry nodes. */
-    AsyncNode * asyncHead_;
+    /** Queue of asynchronous entry nodes. */
+    MpscQueue<AsyncNode> asyncQueue_;
+
+    /** Push an asynchronous entry onto the queue and wake up the handler
+        if necessary.  Thread safe and lock free.
+    */
+    void pushAsync(AsyncNode * node);
 
-    /** Push an asynchronous entry onto the list.  Thread safe and lock
-        free.
+    /** Return the oldest entry in the async queue, or null if there is
+        none.  Lock free, but must only be called by the thread handling
+        the transport.  The node needs to be given to freeAsync() once
+        done with.
     */
-    void pushAsync(const std::function<void ()> & fn,
-                   const std::string & name);
+    AsyncNode * popAsync();
 
-    /** Return the current async list in order and reset it to empty.
-        Thread safe and lock free.
+    /** Destroy an async node and give it back to the pool. */
+    static void freeAsync(AsyncNode * node)
+    {
+        node->~AsyncNode();
+        AsyncNodePool::deallocate(node);
+    }
+
+    /** Run and free all of the async entries that are queued.  Returns -1
+        if one of them caused the connection to be closed, in which case
+        the rest are left in the queue.
     */
-    std::vector<AsyncEntry> popAsync();
+    int runAsync();
     
     bool isZombie() const { return zombie_; }
 
@@ -457,7 +490,17 @@ public:
     */
     void hasConnection();
 
+    /** Called by something that is connecting the transport, so that the
+        end of the connect (or its failure) wakes up the transport rather
+        than waiting for its timeout.  hasConnection() must still be
+        called once it is connected.
+    */
+    void watchConnect();
+
 private:
+    /** Add the handle to epollFd_ with the current flags. */
+    void pollHandle();
+
     std::shared_ptr<ConnectionHandler> slave_;
     EndpointBase * endpoint_;
 
@@ -487,9 +530,66 @@ private:
     /** FD used for events */
     int eventFd_;
 
+    /** See receiveBuffer(). */
+    std::string receiveBuffer_;
+
     /** Do we have a connection at the moment? */
     bool hasConnection_;
 
+    /** Is the handle in epollFd_?  It is from watchConnect() or
+        hasConnection(), whichever comes first.
+    */
+    bool handlePolled_;
+
+    /** If true, we have no per-connection fds and are driven directly by
+        the endpoint's event loop through handleDirectEvents().
+    */
+    bool direct_;
+
+    /** Dispatch state for direct transports, used to make sure that only
+        one thread is running the transport's handlers at a time.
+    */
+    enum {
+        DISPATCH_IDLE,     ///< Nobody is running the transport
+        DISPATCH_RUNNING,  ///< A thread is running the transport
+        DISPATCH_RERUN     ///< Running, and needs to go around once more
+    };
+    std::atomic<int> dispatchState_;
+
+    /** Epoll events for a direct transport that were delivered to a thread
+        that couldn't claim it; they are picked up by the running thread.
+    */
+    std::atomic<int> pendingEvents_;
+
+    /** Epoll events that the socket is currently armed with (direct). */
+    int armedEvents_;
+
+    /** Endpoint's polling data for the socket (direct). */
+    void * pollData_;
+
+    /** Set while the transport is in the endpoint's queue waiting for its
+        async callbacks to be run (direct).
+    */
+    std::atomic<bool> asyncScheduled_;
+
+    /** Id of the current timer in the endpoint's timer service, or zero
+        (direct).  It is cancelled there when the timer is rescheduled or
+        cancelled.
+    */
+    std::atomic<uint64_t> timerId_;
+
+    /** Generation of the current timer and of the last timer that fired
+        in the endpoint's timer service (direct).  The generation is bumped
+        when the timer is rescheduled or cancelled, so that a timer that
+        was already firing at the time is ignored.
+    */
+    std::atomic<uint64_t> timerGeneration_;
+    std::atomic<uint64_t> firedTimerGeneration_;
+
+    /** Cancel the current timer in the endpoint's timer service, if any
+        (direct). */
+    void cancelDirectTimer();
+
     /** Structure to hold a timeout value. */
     struct Timeout {
         Timeout()
@@ -577,6 +677,24 @@ private:
         Returns -1 if the connection should be closed.
     */
     int handleEvents();
+
+    /** Direct version of handleEvents().  The epoll events on the socket
+        are passed in by the endpoint rather than polled for, and fired
+        timers and async callbacks are picked up from the flags set by the
+        endpoint.  Called with the transport claimed through
+        dispatchState_.
+
+        Returns -1 if the connection was closed.
+    */
+    int handleDirectEvents(int epollEvents);
+
+    /** Return the epoll events corresponding to the current flags. */
+    int directEpollEvents() const;
+
+    /** Clean up and notify the endpoint once a handler has decided that
+        the connection needs to be closed.
+    */
+    void handleClose();
 };
 
 
@@ -1,10 +1,644 @@
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#include <algorithm>
+#include <fstream>
+
+#include "jml/arch/exception.h"
+
 #include "benchmarks.h"
 
 using namespace std;
 using namespace Datacratic;
 
 
-/* BENCHMARKS */
+namespace {
+
+string
+formatSeconds(double seconds)
+{
+    char buf[32];
+    if (seconds < 1e-6)
+        snprintf(buf, sizeof(buf), "%.1fns", seconds * 1e9);
+    else if (seconds < 1e-3)
+        snprintf(buf, sizeof(buf), "%.2fus", seconds * 1e6);
+    else if (seconds < 1.0)
+        snprintf(buf, sizeof(buf), "%.2fms", seconds * 1e3);
+    else snprintf(buf, sizeof(buf), "%.3fs", seconds);
+    return buf;
+}
+
+string
+formatNumber(double value)
+{
+    char buf[32];
+    if (value >= 1e9)
+        snprintf(buf, sizeof(buf), "%.2fG", value * 1e-9);
+    else if (value >= 1e6)
+        snprintf(buf, sizeof(buf), "%.2fM", value * 1e-6);
+    else if (value >= 1e3)
+        snprintf(buf, sizeof(buf), "%.2fk", value * 1e-3);
+    else snprintf(buf, sizeof(buf), "%.2f", value);
+    return buf;
+}
+
+Json::Value
+statsMapToJson(const map<string, BenchmarkStats> & stats)
+{
+    Json::Value result(Json::objectValue);
+    for (const auto & entry: stats)
+        result[entry.first] = entry.second.toJson();
+    return result;
+}
+
+map<string, BenchmarkStats>
+statsMapFromJson(const Json::Value & json)
+{
+    map<string, BenchmarkStats> result;
+    if (json.isObject()) {
+        for (const string & name: json.getMemberNames())
+            result[name] = BenchmarkStats::fromJson(json[name]);
+    }
+    return result;
+}
+
+const char *
+getEnv(const char * name)
+{
+    const char * value = ::getenv(name);
+    return (value && *value) ? value : nullptr;
+}
+
+} // file scope
+
+
+/****************************************************************************/
+/* BENCHMARK CLOCK                                                          */
+/****************************************************************************/
+
+BenchmarkClock::
+BenchmarkClock(bool useTsc)
+    : useTsc(useTsc),
+      secondsPerTick(useTsc ? 1.0 / tscTicksPerSecond() : 1e-9)
+{
+}
+
+uint64_t
+BenchmarkClock::
+monotonicNs()
+{
+    struct timespec ts;
+    ::clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+uint64_t
+BenchmarkClock::
+tsc()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return monotonicNs();
+#endif
+}
+
+double
+BenchmarkClock::
+tscTicksPerSecond()
+{
+    static const double result = [] ()
+        {
+#if defined(__x86_64__) || defined(__i386__)
+            /* Calibrated over 20ms; the error of the measurement of the
+               interval is far below 0.1% */
+            uint64_t ns0 = monotonicNs();
+            uint64_t ticks0 = tsc();
+            uint64_t ns1;
+            do {
+                ns1 = monotonicNs();
+            } while (ns1 - ns0 < 20000000);
+            uint64_t ticks1 = tsc();
+            return (ticks1 - ticks0) * 1e9 / (ns1 - ns0);
+#else
+            return 1e9;
+#endif
+        } ();
+
+    return result;
+}
+
+
+/****************************************************************************/
+/* BENCHMARK STATS                                                          */
+/****************************************************************************/
+
+BenchmarkStats::
+BenchmarkStats()
+    : count(0), min(0), max(0), mean(0), median(0), p90(0), p99(0),
+      stddev(0)
+{
+}
+
+BenchmarkStats
+BenchmarkStats::
+compute(vector<double> samples)
+{
+    BenchmarkStats result;
+    if (samples.empty())
+        return result;
+
+    std::sort(samples.begin(), samples.end());
+
+    result.count = samples.size();
+    result.min = samples.front();
+    result.max = samples.back();
+    result.median = percentile(samples, 0.5);
+    result.p90 = percentile(samples, 0.9);
+    result.p99 = percentile(samples, 0.99);
+
+    double total = 0.0;
+    for (double sample: samples)
+        total += sample;
+    result.mean = total / samples.size();
+
+    if (samples.size() > 1) {
+        double squares = 0.0;
+        for (double sample: samples)
+            squares += (sample - result.mean) * (sample - result.mean);
+        result.stddev = sqrt(squares / (samples.size() - 1));
+    }
+
+    return result;
+}
+
+double
+BenchmarkStats::
+percentile(const vector<double> & sorted, double p)
+{
+    if (sorted.empty())
+        return 0.0;
+
+    double pos = p * (sorted.size() - 1);
+    size_t index = pos;
+    if (index + 1 >= sorted.size())
+        return sorted.back();
+    double frac = pos - index;
+    return sorted[index] + frac * (sorted[index + 1] - sorted[index]);
+}
+
+Json::Value
+BenchmarkStats::
+toJson() const
+{
+    Json::Value result;
+    result["count"] = (Json::UInt)count;
+    result["min"] = min;
+    result["max"] = max;
+    result["mean"] = mean;
+    result["median"] = median;
+    result["p90"] = p90;
+    result["p99"] = p99;
+    result["stddev"] = stddev;
+    return result;
+}
+
+BenchmarkStats
+BenchmarkStats::
+fromJson(const Json::Value & json)
+{
+    BenchmarkStats result;
+    result.count = json["count"].asUInt();
+    result.min = json["min"].asDouble();
+    result.max = json["max"].asDouble();
+    result.mean = json["mean"].asDouble();
+    result.median = json["median"].asDouble();
+    result.p90 = json["p90"].asDouble();
+    result.p99 = json["p99"].asDouble();
+    result.stddev = json["stddev"].asDouble();
+    return result;
+}
+
+
+/****************************************************************************/
+/* BENCHMARK COUNTERS                                                       */
+/****************************************************************************/
+
+BenchmarkCounters::
+BenchmarkCounters()
+{
+    static const struct {
+        const char * name;
+        uint64_t config;
+    } events[] = {
+        { "cycles", PERF_COUNT_HW_CPU_CYCLES },
+        { "instructions", PERF_COUNT_HW_INSTRUCTIONS },
+        { "cacheMisses", PERF_COUNT_HW_CACHE_MISSES },
+        { "branchMisses", PERF_COUNT_HW_BRANCH_MISSES }
+    };
+
+    for (const auto & event: events) {
+        struct perf_event_attr attr;
+        ::memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = event.config;
+        attr.inherit = 1;
+        attr.read_format = (PERF_FORMAT_TOTAL_TIME_ENABLED
+                            | PERF_FORMAT_TOTAL_TIME_RUNNING);
+
+        int fd = ::syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+        if (fd == -1 && (errno == EACCES || errno == EPERM)) {
+            /* perf_event_paranoid only lets us count in user space */
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            fd = ::syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+        }
+        if (fd == -1) {
+            error = (string("perf_event_open ") + event.name + ": "
+                     + strerror(errno));
+            continue;
+        }
+
+        fds_.push_back(fd);
+        names_.push_back(event.name);
+    }
+}
+
+BenchmarkCounters::
+~BenchmarkCounters()
+{
+    for (int fd: fds_)
+        ::close(fd);
+}
+
+vector<double>
+BenchmarkCounters::
+read() const
+{
+    vector<double> result;
+    result.reserve(fds_.size());
+
+    for (int fd: fds_) {
+        uint64_t values[3];
+        ssize_t res = ::read(fd, values, sizeof(values));
+        if (res != sizeof(values))
+            throw ML::Exception(errno, "read of perf counter");
+        /* values[1] is the time enabled, values[2] the time spent on the
+           PMU when it had to be shared */
+        double value = values[0];
+        if (values[2] != 0 && values[2] != values[1])
+            value *= double(values[1]) / values[2];
+        result.push_back(value);
+    }
+
+    return result;
+}
+
+
+/****************************************************************************/
+/* BENCHMARK OPTIONS                                                        */
+/****************************************************************************/
+
+BenchmarkOptions::
+BenchmarkOptions()
+    : warmup(1), repetitions(5), useTsc(false), hardwareCounters(true),
+      tolerance(0.1)
+{
+}
+
+BenchmarkOptions
+BenchmarkOptions::
+fromEnvironment()
+{
+    BenchmarkOptions result;
+
+    if (const char * value = getEnv("BENCHMARK_WARMUP"))
+        result.warmup = atoi(value);
+    if (const char * value = getEnv("BENCHMARK_REPETITIONS"))
+        result.repetitions = std::max(atoi(value), 1);
+    if (const char * value = getEnv("BENCHMARK_TSC"))
+        result.useTsc = atoi(value) != 0;
+    if (const char * value = getEnv("BENCHMARK_COUNTERS"))
+        result.hardwareCounters = atoi(value) != 0;
+    if (const char * value = getEnv("BENCHMARK_OUTPUT"))
+        result.outputDir = value;
+    if (const char * value = getEnv("BENCHMARK_BASELINE"))
+        result.baselineDir = value;
+    if (const char * value = getEnv("BENCHMARK_TOLERANCE"))
+        result.tolerance = atof(value);
+
+    return result;
+}
+
+
+/****************************************************************************/
+/* BENCHMARK STATE                                                          */
+/****************************************************************************/
+
+BenchmarkState::
+BenchmarkState(const BenchmarkClock & clock,
+               const BenchmarkCounters * counters,
+               int repetition)
+    : repetition(repetition), items(0), bytes(0),
+      clock_(clock), counters_(counters),
+      running_(false), started_(0), elapsed_(0)
+{
+    if (counters_)
+        counted_.resize(counters_->names().size());
+}
+
+void
+BenchmarkState::
+pause()
+{
+    if (!running_)
+        return;
+
+    uint64_t now = clock_.now();
+    elapsed_ += now - started_;
+    if (counters_) {
+        vector<double> values = counters_->read();
+        for (unsigned i = 0;  i < values.size();  ++i)
+            counted_[i] += values[i] - countersStarted_[i];
+    }
+    running_ = false;
+}
+
+void
+BenchmarkState::
+resume()
+{
+    if (running_)
+        return;
+
+    running_ = true;
+    if (counters_)
+        countersStarted_ = counters_->read();
+    started_ = clock_.now();
+}
+
+double
+BenchmarkState::
+elapsedSeconds()
+    const
+{
+    uint64_t elapsed = elapsed_;
+    if (running_)
+        elapsed += clock_.now() - started_;
+    return clock_.toSeconds(elapsed);
+}
+
+
+/****************************************************************************/
+/* BENCHMARK RESULT                                                         */
+/****************************************************************************/
+
+BenchmarkResult::
+BenchmarkResult()
+    : items(0), bytes(0)
+{
+}
+
+double
+BenchmarkResult::
+itemsPerSecond()
+    const
+{
+    return stats.median > 0 ? items / stats.median : 0.0;
+}
+
+double
+BenchmarkResult::
+bytesPerSecond()
+    const
+{
+    return stats.median > 0 ? bytes / stats.median : 0.0;
+}
+
+Json::Value
+BenchmarkResult::
+toJson() const
+{
+    Json::Value result;
+    result["name"] = name;
+    result["seconds"] = stats.toJson();
+    Json::Value & samples = result["samples"];
+    samples = Json::Value(Json::arrayValue);
+    for (double sample: seconds)
+        samples.append(sample);
+    result["items"] = (Json::UInt)items;
+    result["bytes"] = (Json::UInt)bytes;
+    result["itemsPerSecond"] = itemsPerSecond();
+    result["bytesPerSecond"] = bytesPerSecond();
+    result["counters"] = statsMapToJson(counters);
+    result["metrics"] = statsMapToJson(metrics);
+    return result;
+}
+
+BenchmarkResult
+BenchmarkResult::
+fromJson(const Json::Value & json)
+{
+    BenchmarkResult result;
+    result.name = json["name"].asString();
+    result.stats = BenchmarkStats::fromJson(json["seconds"]);
+    const Json::Value & samples = json["samples"];
+    for (unsigned i = 0;  i < samples.size();  ++i)
+        result.seconds.push_back(samples[i].asDouble());
+    result.items = json["items"].asUInt();
+    result.bytes = json["bytes"].asUInt();
+    result.counters = statsMapFromJson(json["counters"]);
+    result.metrics = statsMapFromJson(json["metrics"]);
+    return result;
+}
+
+
+/****************************************************************************/
+/* BENCHMARK SUITE                                                          */
+/****************************************************************************/
+
+BenchmarkSuite::
+BenchmarkSuite(const string & name, const BenchmarkOptions & options)
+    : name(name), options(options), clock(options.useTsc)
+{
+    if (options.hardwareCounters) {
+        counters_.reset(new BenchmarkCounters());
+        if (!counters_->available()) {
+            cerr << (name + ": no hardware counters ("
+                     + counters_->error + ")\n");
+            counters_.reset();
+        }
+    }
+}
+
+const BenchmarkResult &
+BenchmarkSuite::
+run(const string & benchName, const BenchmarkFn & fn, ostream & out)
+{
+    BenchmarkResult result;
+    result.name = benchName;
+
+    size_t numCounters = counters_ ? counters_->names().size() : 0;
+    vector<vector<double> > counterSamples(numCounters);
+    map<string, vector<double> > metricSamples;
+
+    for (int i = -options.warmup;  i < options.repetitions;  ++i) {
+        BenchmarkState state(clock, counters_.get(), i);
+        state.resume();
+        fn(state);
+        state.pause();
+
+        if (state.isWarmup())
+            continue;
+
+        result.seconds.push_back(state.elapsedSeconds());
+        result.items = state.items;
+        result.bytes = state.bytes;
+        double divisor = state.items ? state.items : 1;
+        for (unsigned j = 0;  j < numCounters;  ++j)
+            counterSamples[j].push_back(state.counted()[j] / divisor);
+        for (const auto & metric: state.metrics)
+            metricSamples[metric.first].push_back(metric.second);
+    }
+
+    result.stats = BenchmarkStats::compute(result.seconds);
+    for (unsigned j = 0;  j < numCounters;  ++j) {
+        result.counters[counters_->names()[j]]
+            = BenchmarkStats::compute(counterSamples[j]);
+    }
+    for (auto & samples: metricSamples) {
+        result.metrics[samples.first]
+            = BenchmarkStats::compute(std::move(samples.second));
+    }
+
+    const BenchmarkStats & stats = result.stats;
+    string line = (name + "." + benchName + ": median "
+                   + formatSeconds(stats.median)
+                   + " p90 " + formatSeconds(stats.p90)
+                   + " min " + formatSeconds(stats.min)
+                   + " max " + formatSeconds(stats.max));
+    if (stats.mean > 0) {
+        char buf[32];
+        snprintf(buf, sizeof(buf), " sd %.1f%%",
+                 100.0 * stats.stddev / stats.mean);
+        line += buf;
+    }
+    if (result.items)
+        line += " " + formatNumber(result.itemsPerSecond()) + " items/s";
+    if (result.bytes)
+        line += " " + formatNumber(result.bytesPerSecond()) + "B/s";
+    const char * per = result.items ? "/item" : "";
+    for (const auto & counter: result.counters) {
+        line += (" " + counter.first + " "
+                 + formatNumber(counter.second.median) + per);
+    }
+    for (const auto & metric: result.metrics) {
+        line += (" " + metric.first + " "
+                 + formatNumber(metric.second.median));
+    }
+    out << line + "\n";
+
+    results.emplace_back(std::move(result));
+    return results.back();
+}
+
+int
+BenchmarkSuite::
+finish(ostream & out)
+{
+    if (!options.outputDir.empty()) {
+        string filename = options.outputDir + "/" + name + ".json";
+        std::ofstream stream(filename);
+        stream << toJson().toStyledString();
+        if (!stream)
+            throw ML::Exception("couldn't write benchmark results to "
+                                + filename);
+    }
+
+    if (options.baselineDir.empty())
+        return 0;
+
+    string filename = options.baselineDir + "/" + name + ".json";
+    std::ifstream stream(filename);
+    if (!stream) {
+        out << (name + ": no baseline in " + filename + "\n");
+        return 0;
+    }
+
+    return compare(resultsFromJson(Json::parse(stream)), out);
+}
+
+int
+BenchmarkSuite::
+compare(const vector<BenchmarkResult> & baseline, ostream & out)
+    const
+{
+    int numRegressions(0);
+
+    for (const BenchmarkResult & result: results) {
+        auto it = std::find_if(baseline.begin(), baseline.end(),
+                               [&] (const BenchmarkResult & base)
+                               { return base.name == result.name; });
+        if (it == baseline.end() || it->stats.median <= 0)
+            continue;
+
+        double change = result.stats.median / it->stats.median - 1.0;
+        bool regressed = change > options.tolerance;
+        if (regressed)
+            numRegressions++;
+
+        char buf[32];
+        snprintf(buf, sizeof(buf), "%+.1f%%", change * 100.0);
+        out << (name + "." + result.name + ": median "
+                + formatSeconds(result.stats.median) + " vs "
+                + formatSeconds(it->stats.median) + " (" + buf + ")"
+                + (regressed ? " REGRESSION" : "") + "\n");
+    }
+
+    return numRegressions;
+}
+
+Json::Value
+BenchmarkSuite::
+toJson() const
+{
+    Json::Value result;
+    result["suite"] = name;
+    result["clock"] = clock.useTsc ? "tsc" : "monotonic";
+    result["warmup"] = options.warmup;
+    result["repetitions"] = options.repetitions;
+    Json::Value & benchmarks = result["benchmarks"];
+    benchmarks = Json::Value(Json::arrayValue);
+    for (const BenchmarkResult & benchResult: results)
+        benchmarks.append(benchResult.toJson());
+    return result;
+}
+
+vector<BenchmarkResult>
+BenchmarkSuite::
+resultsFromJson(const Json::Value & json)
+{
+    vector<BenchmarkResult> result;
+    const Json::Value & benchmarks = json["benchmarks"];
+    for (unsigned i = 0;  i < benchmarks.size();  ++i)
+        result.push_back(BenchmarkResult::fromJson(benchmarks[i]));
+    return result;
+}
+
+
+/****************************************************************************/
+/* BENCHMARKS                                                               */
+/****************************************************************************/
 
 void
 Benchmarks::
@@ -12,10 +646,8 @@ collectBenchmark(const vector<string> & tags, double delta)
     noexcept
 {
     Guard lock(dataLock_);
-    // fprintf(stderr, "benchmark: %s took %f s.\n",
-    //         label.c_str(), delta);
     for (const string & tag: tags) {
-        data_[tag] += delta;
+        data_[tag].push_back(delta);
     }
 }
 
@@ -27,9 +659,17 @@ dumpTotals(ostream & out)
 
     string result("Benchmark totals:\n");
     for (const auto & entry: data_) {
+        double total(0.0);
+        for (double delta: entry.second)
+            total += delta;
+        BenchmarkStats stats = BenchmarkStats::compute(entry.second);
         result += ("  " + entry.first
-                   + ": " + to_string(entry.second)
-                   + " s.\n");
+                   + ": " + to_string(total) + " s."
+                   + " (" + to_string(stats.count) + " times, median "
+                   + formatSeconds(stats.median)
+                   + ", p99 " + formatSeconds(stats.p99)
+                   + ", stddev " + formatSeconds(stats.stddev)
+                   + ")\n");
     }
 
     out << result;
@@ -2,21 +2,29 @@
     Wolfgang Sourdeau, 13 April 2014
     Copyright (c) 2014 Datacratic Inc.  All rights reserved.
 
-    Simple utility class to benchmark operations easily.
+    Utility classes to benchmark operations easily.
 
-    Possible improvements:
-    - statistics
+    BenchmarkSuite runs each benchmark a number of times after some
+    warmup runs and reports the distribution of the measurements, the
+    hardware counters of the runs when the kernel lets us have them, and
+    how they compare with the results of an earlier run.
+
+    Benchmarks and Benchmark collect the time spent in tagged sections of
+    code.
 */
 
 #pragma once
 
+#include <stdint.h>
+#include <functional>
 #include <iostream>
 #include <map>
+#include <memory>
 #include <mutex>
 #include <string>
 #include <vector>
 
-#include "soa/types/date.h"
+#include "soa/jsoncpp/json.h"
 
 
 namespace Datacratic {
@@ -24,17 +32,296 @@ namespace Datacratic {
 struct Benchmark;
 
 
+/****************************************************************************/
+/* BENCHMARK CLOCK                                                          */
+/****************************************************************************/
+
+/* Source of the timings of the benchmarks: either CLOCK_MONOTONIC or, when
+   "useTsc" is set, the time stamp counter of the CPU, which is cheaper to
+   read and calibrated against CLOCK_MONOTONIC the first time it is used.
+   The TSC should only be used on machines where it is invariant. */
+
+struct BenchmarkClock {
+    BenchmarkClock(bool useTsc = false);
+
+    uint64_t now() const
+    {
+        return useTsc ? tsc() : monotonicNs();
+    }
+
+    double toSeconds(uint64_t ticks) const
+    {
+        return ticks * secondsPerTick;
+    }
+
+    static uint64_t monotonicNs();
+    static uint64_t tsc();
+    static double tscTicksPerSecond();
+
+    bool useTsc;
+    double secondsPerTick;
+};
+
+
+/****************************************************************************/
+/* BENCHMARK STATS                                                          */
+/****************************************************************************/
+
+/* Summary of a set of samples. */
+
+struct BenchmarkStats {
+    BenchmarkStats();
+
+    static BenchmarkStats compute(std::vector<double> samples);
+
+    /* Value at the "p" quantile (0 to 1) of sorted samples, interpolated
+       between the two closest samples. */
+    static double percentile(const std::vector<double> & sorted, double p);
+
+    Json::Value toJson() const;
+    static BenchmarkStats fromJson(const Json::Value & json);
+
+    size_t count;
+    double min;
+    double max;
+    double mean;
+    double median;
+    double p90;
+    double p99;
+    double stddev;
+};
+
+
+/****************************************************************************/
+/* BENCHMARK COUNTERS                                                       */
+/****************************************************************************/
+
+/* Hardware counters (cycles, instructions, cache and branch misses) opened
+   with perf_event_open for the calling thread and the threads it creates
+   while they are open. Counts of threads that are still running when the
+   counters are read are not included.
+
+   When the kernel refuses to open them (no PMU, perf_event_paranoid, a
+   container...), "available()" returns false and nothing is counted. */
+
+struct BenchmarkCounters {
+    BenchmarkCounters();
+    ~BenchmarkCounters();
+
+    BenchmarkCounters(const BenchmarkCounters &) = delete;
+    BenchmarkCounters & operator = (const BenchmarkCounters &) = delete;
+
+    bool available() const
+    {
+        return !fds_.empty();
+    }
+
+    /* Names of the counters that could be opened */
+    const std::vector<std::string> & names() const
+    {
+        return names_;
+    }
+
+    /* Current value of each counter, scaled for the time it was not
+       scheduled on the PMU */
+    std::vector<double> read() const;
+
+    /* Reason why the counters are not available */
+    std::string error;
+
+private:
+    std::vector<int> fds_;
+    std::vector<std::string> names_;
+};
+
+
+/****************************************************************************/
+/* BENCHMARK OPTIONS                                                        */
+/****************************************************************************/
+
+struct BenchmarkOptions {
+    BenchmarkOptions();
+
+    /* Options overridden from the BENCHMARK_WARMUP, BENCHMARK_REPETITIONS,
+       BENCHMARK_TSC, BENCHMARK_COUNTERS, BENCHMARK_OUTPUT,
+       BENCHMARK_BASELINE and BENCHMARK_TOLERANCE environment variables, so
+       that benchmarks run as tests can be tuned from "make". */
+    static BenchmarkOptions fromEnvironment();
+
+    int warmup;                 ///< Untimed runs before the repetitions
+    int repetitions;            ///< Timed runs
+    bool useTsc;                ///< Time with the TSC instead of the clock
+    bool hardwareCounters;      ///< Collect the counters when possible
+
+    /* Directory where "<suite>.json" is written with the results */
+    std::string outputDir;
+
+    /* Directory where the "<suite>.json" of an earlier run is read from,
+       to compare the medians with */
+    std::string baselineDir;
+
+    /* Relative increase of the median time over the baseline after which
+       a benchmark is reported as a regression */
+    double tolerance;
+};
+
+
+/****************************************************************************/
+/* BENCHMARK STATE                                                          */
+/****************************************************************************/
+
+/* Passed to each run of a benchmark. The whole run is timed unless parts
+   of it are excluded with pause() and resume(). */
+
+struct BenchmarkState {
+    BenchmarkState(const BenchmarkClock & clock,
+                   const BenchmarkCounters * counters,
+                   int repetition);
+
+    /* Stop timing the run, for setup and teardown */
+    void pause();
+
+    /* Start timing the run again */
+    void resume();
+
+    /* Number of items (requests, messages...) and bytes processed by the
+       run, from which rates are reported */
+    void setItems(uint64_t items)
+    {
+        this->items = items;
+    }
+
+    void setBytes(uint64_t bytes)
+    {
+        this->bytes = bytes;
+    }
+
+    /* Records a custom value for the run */
+    void addMetric(const std::string & name, double value)
+    {
+        metrics[name] = value;
+    }
+
+    bool isWarmup() const
+    {
+        return repetition < 0;
+    }
+
+    /* Negative for warmup runs */
+    int repetition;
+
+    uint64_t items;
+    uint64_t bytes;
+    std::map<std::string, double> metrics;
+
+    /* Time and counts of the timed parts of the run so far */
+    double elapsedSeconds() const;
+    const std::vector<double> & counted() const
+    {
+        return counted_;
+    }
+
+private:
+    const BenchmarkClock & clock_;
+    const BenchmarkCounters * counters_;
+    bool running_;
+    uint64_t started_;
+    uint64_t elapsed_;
+    std::vector<double> countersStarted_;
+    std::vector<double> counted_;
+};
+
+
+/****************************************************************************/
+/* BENCHMARK RESULT                                                         */
+/****************************************************************************/
+
+struct BenchmarkResult {
+    BenchmarkResult();
+
+    std::string name;
+
+    std::vector<double> seconds;        ///< Time of each repetition
+    BenchmarkStats stats;               ///< Of "seconds"
+    uint64_t items;                     ///< Per repetition
+    uint64_t bytes;                     ///< Per repetition
+
+    /* Per item when items were set, per repetition otherwise */
+    std::map<std::string, BenchmarkStats> counters;
+    std::map<std::string, BenchmarkStats> metrics;
+
+    double itemsPerSecond() const;
+    double bytesPerSecond() const;
+
+    Json::Value toJson() const;
+    static BenchmarkResult fromJson(const Json::Value & json);
+};
+
+
+/****************************************************************************/
+/* BENCHMARK SUITE                                                          */
+/****************************************************************************/
+
+/* Runs a set of benchmarks and reports their results.
+
+   BenchmarkSuite suite("async_writer");
+   suite.run("pipe 50", [&] (BenchmarkState & state) {
+       state.pause();
+       ... setup ...
+       state.resume();
+       ... work ...
+       state.setItems(numMessages);
+   });
+   return suite.finish() == 0 ? 0 : 1;
+*/
+
+struct BenchmarkSuite {
+    typedef std::function<void (BenchmarkState &)> BenchmarkFn;
+
+    BenchmarkSuite(const std::string & name,
+                   const BenchmarkOptions & options
+                       = BenchmarkOptions::fromEnvironment());
+
+    /* Runs the warmup runs and the repetitions of "fn", prints a line
+       with its results to "out" and returns them */
+    const BenchmarkResult & run(const std::string & name,
+                                const BenchmarkFn & fn,
+                                std::ostream & out = std::cerr);
+
+    /* Writes the results to the output directory, compares them with the
+       baseline and returns the number of regressions */
+    int finish(std::ostream & out = std::cerr);
+
+    /* Medians of the results slower than those of "baseline" by more than
+       the tolerance, each reported to "out" */
+    int compare(const std::vector<BenchmarkResult> & baseline,
+                std::ostream & out = std::cerr) const;
+
+    Json::Value toJson() const;
+    static std::vector<BenchmarkResult> resultsFromJson(const Json::Value &);
+
+    std::string name;
+    BenchmarkOptions options;
+    BenchmarkClock clock;
+    std::vector<BenchmarkResult> results;
+
+private:
+    std::unique_ptr<BenchmarkCounters> counters_;
+};
+
+
 /****************************************************************************/
 /* BENCHMARKS                                                               */
 /****************************************************************************/
 
-/* A simple collector class that registers a set of tags and accumulate time
-   deltas. */
+/* A simple collector class that registers a set of tags and accumulates
+   the time deltas measured for each of them. */
 
 struct Benchmarks {
     void collectBenchmark(const std::vector<std::string> & tags,
                           double delta) noexcept;
 
+    /* Total, count and distribution of the deltas of each tag */
     void dumpTotals(std::ostream & ostream = std::cerr);
     void clear();
 
@@ -42,7 +329,7 @@ struct Benchmarks {
     typedef std::unique_lock<Lock> Guard;
 
     Lock dataLock_;
-    std::map<std::string, double> data_;
+    std::map<std::string, std::vector<double> > data_;
 };
 
 
@@ -58,16 +345,19 @@ struct Benchmarks {
 
 struct Benchmark {
     Benchmark(Benchmarks & bInstance, const std::string & tag)
-        : bInstance_(bInstance), tags_({tag}), start_(Date::now())
+        : bInstance_(bInstance), tags_({tag}),
+          start_(BenchmarkClock::monotonicNs())
     {}
 
     Benchmark(Benchmarks & bInstance, const std::vector<std::string> & tags)
-        : bInstance_(bInstance), tags_(tags), start_(Date::now())
+        : bInstance_(bInstance), tags_(tags),
+          start_(BenchmarkClock::monotonicNs())
     {}
 
     Benchmark(Benchmarks & bInstance,
               const std::initializer_list<std::string> & tags)
-        : bInstance_(bInstance), tags_(tags), start_(Date::now())
+        : bInstance_(bInstance), tags_(tags),
+          start_(BenchmarkClock::monotonicNs())
     {}
 
     ~Benchmark()
@@ -77,13 +367,13 @@ struct Benchmark {
 
     void reportBm() noexcept
     {
-        double delta = Date::now() - start_;
+        double delta = (BenchmarkClock::monotonicNs() - start_) * 1e-9;
         bInstance_.collectBenchmark(tags_, delta);
     }
 
     Benchmarks & bInstance_;
     std::vector<std::string> tags_;
-    Date start_;
+    uint64_t start_;
 };
 
 } // namespace Datacratic
@@ -0,0 +1,218 @@
+/* string_coding.cc
+   Copyright (c) 2014 Datacratic Inc.  All rights reserved.
+
+   Table driven hexadecimal and base64 coding.
+*/
+
+#include "string_coding.h"
+
+
+namespace {
+
+const char * hexDigitsUpper = "0123456789ABCDEF";
+const char * hexDigitsLower = "0123456789abcdef";
+
+const char * base64Digits =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+/* The tables are constants rather than being built at startup, so that
+   they can be used during static initialization. */
+
+const unsigned char hexValue[256] = {
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+    0x08, 0x09, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff
+};
+
+const unsigned char base64Value[256] = {
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0x3e, 0xff, 0xff, 0xff, 0x3f,
+    0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x3b,
+    0x3c, 0x3d, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06,
+    0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e,
+    0x0f, 0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16,
+    0x17, 0x18, 0x19, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f, 0x20,
+    0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27, 0x28,
+    0x29, 0x2a, 0x2b, 0x2c, 0x2d, 0x2e, 0x2f, 0x30,
+    0x31, 0x32, 0x33, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff
+};
+
+} // file scope
+
+
+namespace Datacratic {
+
+
+/*****************************************************************************/
+/* HEX CODING                                                                */
+/*****************************************************************************/
+
+size_t
+hexEncode(const void * data, size_t length, char * out, bool upperCase)
+{
+    const unsigned char * p = (const unsigned char *)data;
+    const char * digits = upperCase ? hexDigitsUpper : hexDigitsLower;
+
+    for (size_t i = 0;  i < length;  ++i) {
+        out[i * 2] = digits[p[i] >> 4];
+        out[i * 2 + 1] = digits[p[i] & 15];
+    }
+
+    return length * 2;
+}
+
+ssize_t
+hexDecode(const char * data, size_t length, void * out)
+{
+    if (length % 2)
+        return -1;
+
+    const unsigned char * p = (const unsigned char *)data;
+    unsigned char * o = (unsigned char *)out;
+
+    // Invalid characters map to 0xff, so a single test at the end covers
+    // all of them
+    unsigned char invalid = 0;
+    for (size_t i = 0;  i < length / 2;  ++i) {
+        unsigned char high = hexValue[p[i * 2]];
+        unsigned char low = hexValue[p[i * 2 + 1]];
+        invalid |= high | low;
+        o[i] = (high << 4) | low;
+    }
+
+    if (invalid & 0x80)
+        return -1;
+    return length / 2;
+}
+
+
+/*****************************************************************************/
+/* BASE64 CODING                                                             */
+/*****************************************************************************/
+
+size_t
+base64Encode(const void * data, size_t length, char * out)
+{
+    const unsigned char * p = (const unsigned char *)data;
+    char * o = out;
+
+    size_t i = 0;
+    for (;  i + 3 <= length;  i += 3, o += 4) {
+        unsigned v = (p[i] << 16) | (p[i + 1] << 8) | p[i + 2];
+        o[0] = base64Digits[v >> 18];
+        o[1] = base64Digits[(v >> 12) & 63];
+        o[2] = base64Digits[(v >> 6) & 63];
+        o[3] = base64Digits[v & 63];
+    }
+
+    if (i < length) {
+        unsigned v = p[i] << 16;
+        if (i + 1 < length)
+            v |= p[i + 1] << 8;
+        o[0] = base64Digits[v >> 18];
+        o[1] = base64Digits[(v >> 12) & 63];
+        o[2] = (i + 1 < length) ? base64Digits[(v >> 6) & 63] : '=';
+        o[3] = '=';
+        o += 4;
+    }
+
+    return o - out;
+}
+
+ssize_t
+base64Decode(const char * data, size_t length, void * out)
+{
+    const unsigned char * p = (const unsigned char *)data;
+    unsigned char * o = (unsigned char *)out;
+
+    if (length % 4 == 0 && length > 0 && p[length - 1] == '=') {
+        --length;
+        if (p[length - 1] == '=')
+            --length;
+    }
+    if (length % 4 == 1)
+        return -1;
+
+    unsigned char invalid = 0;
+    size_t i = 0;
+    for (;  i + 4 <= length;  i += 4, o += 3) {
+        unsigned char a = base64Value[p[i]];
+        unsigned char b = base64Value[p[i + 1]];
+        unsigned char c = base64Value[p[i + 2]];
+        unsigned char d = base64Value[p[i + 3]];
+        invalid |= a | b | c | d;
+        unsigned v = (a << 18) | (b << 12) | (c << 6) | d;
+        o[0] = v >> 16;
+        o[1] = v >> 8;
+        o[2] = v;
+    }
+
+    // Two or three characters left, for one or two bytes
+    if (i < length) {
+        unsigned char a = base64Value[p[i]];
+        unsigned char b = base64Value[p[i + 1]];
+        unsigned char c = (i + 2 < length) ? base64Value[p[i + 2]] : 0;
+        invalid |= a | b | c;
+        unsigned v = (a << 18) | (b << 12) | (c << 6);
+        *o++ = v >> 16;
+        if (i + 2 < length)
+            *o++ = v >> 8;
+    }
+
+    if (invalid & 0x80)
+        return -1;
+    return o - (unsigned char *)out;
+}
+
+} // namespace Datacratic
@@ -0,0 +1,62 @@
+/* string_coding.h                                                 -*- C++ -*-
+   Copyright (c) 2014 Datacratic Inc.  All rights reserved.
+
+   Table driven hexadecimal and base64 coding into buffers supplied by the
+   caller.
+*/
+
+#pragma once
+
+#include <stddef.h>
+#include <sys/types.h>
+
+
+namespace Datacratic {
+
+
+/*****************************************************************************/
+/* HEX CODING                                                                */
+/*****************************************************************************/
+
+inline size_t hexEncodedLength(size_t length)
+{
+    return length * 2;
+}
+
+/** Write the hexadecimal representation of the data to out, which needs to
+    have room for hexEncodedLength(length) characters.  Returns the number
+    of characters written.
+*/
+size_t hexEncode(const void * data, size_t length, char * out,
+                 bool upperCase = true);
+
+/** Decode the hexadecimal characters, in either case, to out, which needs
+    to have room for length / 2 bytes.  Returns the number of bytes written,
+    or -1 if the length is odd or if a character isn't hexadecimal.
+*/
+ssize_t hexDecode(const char * data, size_t length, void * out);
+
+
+/*****************************************************************************/
+/* BASE64 CODING                                                             */
+/*****************************************************************************/
+
+inline size_t base64EncodedLength(size_t length)
+{
+    return (length + 2) / 3 * 4;
+}
+
+/** Write the padded base64 representation of the data, using the standard
+    alphabet of RFC 4648, to out, which needs to have room for
+    base64EncodedLength(length) characters.  Returns the number of
+    characters written.
+*/
+size_t base64Encode(const void * data, size_t length, char * out);
+
+/** Decode base64, with or without its padding, to out, which needs to have
+    room for length / 4 * 3 + 2 bytes.  Returns the number of bytes written,
+    or -1 if the input isn't valid base64.
+*/
+ssize_t base64Decode(const char * data, size_t length, void * out);
+
+} // namespace Datacratic
@@ -5,17 +5,260 @@
 */
 
 #include "string_encryption.h"
+#include "string_coding.h"
+#include "jml/arch/exception.h"
 #include "cryptopp/modes.h"
 #include "cryptopp/crc.h"
 #include "cryptopp/osrng.h"
 #include "cryptopp/aes.h"
-#include <iostream>
+#include <string.h>
+#include <vector>
+
+#if defined(__x86_64__)
+#include <cpuid.h>
+#include <wmmintrin.h>
+#define STRING_ENCRYPTION_AESNI 1
+#endif
 
 using namespace std; 
 using namespace CryptoPP;
 
+
+namespace {
+
+const size_t BlockSize = 16;
+
+/** Number of contexts that each thread keeps for the keys it uses. */
+const size_t ContextCacheSize = 8;
+
+/** Passbacks up to this size are processed on the stack. */
+const size_t StackBufferSize = 1024;
+
+#if STRING_ENCRYPTION_AESNI
+
+bool cpuHasAesNi()
+{
+    unsigned eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+        return false;
+    return ecx & bit_AES;
+}
+
+const bool hasAesNi = cpuHasAesNi();
+
+inline __m128i expandKeyStep(__m128i key, __m128i assist)
+{
+    assist = _mm_shuffle_epi32(assist, 0xff);
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+    return _mm_xor_si128(key, assist);
+}
+
+void aesNiExpandKey(const byte * key, __m128i * rk)
+{
+    rk[0] = _mm_loadu_si128((const __m128i *)key);
+
+    // The round constant needs to be an immediate
+#define EXPAND_KEY(i, rcon) \
+    rk[i] = expandKeyStep(rk[i - 1], _mm_aeskeygenassist_si128(rk[i - 1], rcon))
+
+    EXPAND_KEY(1, 0x01);
+    EXPAND_KEY(2, 0x02);
+    EXPAND_KEY(3, 0x04);
+    EXPAND_KEY(4, 0x08);
+    EXPAND_KEY(5, 0x10);
+    EXPAND_KEY(6, 0x20);
+    EXPAND_KEY(7, 0x40);
+    EXPAND_KEY(8, 0x80);
+    EXPAND_KEY(9, 0x1b);
+    EXPAND_KEY(10, 0x36);
+
+#undef EXPAND_KEY
+}
+
+inline __m128i aesNiEncryptBlock(__m128i block, const __m128i * rk)
+{
+    block = _mm_xor_si128(block, rk[0]);
+    for (int i = 1;  i < 10;  ++i)
+        block = _mm_aesenc_si128(block, rk[i]);
+    return _mm_aesenclast_si128(block, rk[10]);
+}
+
+/** Xor the first length bytes of the keystream block into out. */
+inline void xorPartialBlock(__m128i keystream, const byte * in, size_t length,
+                            byte * out)
+{
+    byte ks[BlockSize];
+    _mm_storeu_si128((__m128i *)ks, keystream);
+    for (size_t i = 0;  i < length;  ++i)
+        out[i] = in[i] ^ ks[i];
+}
+
+#endif // STRING_ENCRYPTION_AESNI
+
+} // file scope
+
+
 namespace Datacratic {
 
+/*****************************************************************************/
+/* PASSBACK ENCRYPTION CONTEXT                                               */
+/*****************************************************************************/
+
+struct StringEncryption::Context::Impl {
+    Impl(const string & key, const string & iv)
+        : key(key), iv(iv)
+    {
+        if (key.size() < AES::DEFAULT_KEYLENGTH)
+            throw ML::Exception("passback encryption key is too short");
+        if (iv.size() < BlockSize)
+            throw ML::Exception("passback encryption IV is too short");
+
+        const byte * bk = reinterpret_cast<const byte *>(key.c_str());
+
+#if STRING_ENCRYPTION_AESNI
+        if (hasAesNi) {
+            aesNiExpandKey(bk, roundKeys);
+            return;
+        }
+#endif
+
+        cipher.reset(new AES::Encryption(bk, AES::DEFAULT_KEYLENGTH));
+    }
+
+    /* kept to find the context again */
+    string key;
+    string iv;
+
+#if STRING_ENCRYPTION_AESNI
+    __m128i roundKeys[11];
+#endif
+
+    /* Crypto++ is used when there is no AES-NI */
+    unique_ptr<AES::Encryption> cipher;
+};
+
+StringEncryption::Context::
+Context(const string & key, const string & iv)
+    : impl(new Impl(key, iv))
+{
+}
+
+bool
+StringEncryption::Context::
+hardwareAccelerated() const
+{
+    return !impl->cipher;
+}
+
+/* In CFB mode, each block is xored with the encryption of the previous
+   block of ciphertext, starting with the IV, and the last block can be
+   partial. */
+
+void
+StringEncryption::Context::
+encrypt(const byte * in, size_t length, byte * out) const
+{
+    const byte * biv = reinterpret_cast<const byte *>(impl->iv.c_str());
+
+#if STRING_ENCRYPTION_AESNI
+    if (!impl->cipher) {
+        const __m128i * rk = impl->roundKeys;
+        __m128i feedback = _mm_loadu_si128((const __m128i *)biv);
+        size_t i = 0;
+        for (;  i + BlockSize <= length;  i += BlockSize) {
+            __m128i block = _mm_loadu_si128((const __m128i *)(in + i));
+            feedback = _mm_xor_si128(block, aesNiEncryptBlock(feedback, rk));
+            _mm_storeu_si128((__m128i *)(out + i), feedback);
+        }
+        if (i < length)
+            xorPartialBlock(aesNiEncryptBlock(feedback, rk),
+                            in + i, length - i, out + i);
+        return;
+    }
+#endif
+
+    byte feedback[BlockSize];
+    memcpy(feedback, biv, BlockSize);
+    for (size_t i = 0;  i < length;  i += BlockSize) {
+        byte ks[BlockSize];
+        impl->cipher->ProcessBlock(feedback, ks);
+        size_t n = std::min(BlockSize, length - i);
+        for (size_t j = 0;  j < n;  ++j)
+            feedback[j] = out[i + j] = in[i + j] ^ ks[j];
+    }
+}
+
+void
+StringEncryption::Context::
+decrypt(const byte * in, size_t length, byte * out) const
+{
+    const byte * biv = reinterpret_cast<const byte *>(impl->iv.c_str());
+
+#if STRING_ENCRYPTION_AESNI
+    if (!impl->cipher) {
+        const __m128i * rk = impl->roundKeys;
+        __m128i feedback = _mm_loadu_si128((const __m128i *)biv);
+        size_t i = 0;
+
+        // The ciphertext is all known, so four blocks go through the
+        // pipeline of the AES unit at once
+        for (;  i + 4 * BlockSize <= length;  i += 4 * BlockSize) {
+            const __m128i * c = (const __m128i *)(in + i);
+            __m128i c0 = _mm_loadu_si128(c);
+            __m128i c1 = _mm_loadu_si128(c + 1);
+            __m128i c2 = _mm_loadu_si128(c + 2);
+            __m128i c3 = _mm_loadu_si128(c + 3);
+            __m128i k0 = _mm_xor_si128(feedback, rk[0]);
+            __m128i k1 = _mm_xor_si128(c0, rk[0]);
+            __m128i k2 = _mm_xor_si128(c1, rk[0]);
+            __m128i k3 = _mm_xor_si128(c2, rk[0]);
+            for (int r = 1;  r < 10;  ++r) {
+                k0 = _mm_aesenc_si128(k0, rk[r]);
+                k1 = _mm_aesenc_si128(k1, rk[r]);
+                k2 = _mm_aesenc_si128(k2, rk[r]);
+                k3 = _mm_aesenc_si128(k3, rk[r]);
+            }
+            k0 = _mm_aesenclast_si128(k0, rk[10]);
+            k1 = _mm_aesenclast_si128(k1, rk[10]);
+            k2 = _mm_aesenclast_si128(k2, rk[10]);
+            k3 = _mm_aesenclast_si128(k3, rk[10]);
+            __m128i * p = (__m128i *)(out + i);
+            _mm_storeu_si128(p, _mm_xor_si128(c0, k0));
+            _mm_storeu_si128(p + 1, _mm_xor_si128(c1, k1));
+            _mm_storeu_si128(p + 2, _mm_xor_si128(c2, k2));
+            _mm_storeu_si128(p + 3, _mm_xor_si128(c3, k3));
+            feedback = c3;
+        }
+        for (;  i + BlockSize <= length;  i += BlockSize) {
+            __m128i block = _mm_loadu_si128((const __m128i *)(in + i));
+            _mm_storeu_si128((__m128i *)(out + i),
+                             _mm_xor_si128(block,
+                                           aesNiEncryptBlock(feedback, rk)));
+            feedback = block;
+        }
+        if (i < length)
+            xorPartialBlock(aesNiEncryptBlock(feedback, rk),
+                            in + i, length - i, out + i);
+        return;
+    }
+#endif
+
+    byte feedback[BlockSize];
+    memcpy(feedback, biv, BlockSize);
+    for (size_t i = 0;  i < length;  i += BlockSize) {
+        byte ks[BlockSize];
+        impl->cipher->ProcessBlock(feedback, ks);
+        size_t n = std::min(BlockSize, length - i);
+        for (size_t j = 0;  j < n;  ++j) {
+            feedback[j] = in[i + j];
+            out[i + j] = in[i + j] ^ ks[j];
+        }
+    }
+}
+
+
 /*****************************************************************************/
 /* PASSBACK ENCRYPTION                                                       */
 /*****************************************************************************/
@@ -24,88 +267,132 @@ namespace Datacratic {
  * Used to encrypt and decrypt passbacks in exchange connector
 */
 
-StringEncryption::StringEncryption() : hexEncoder(), hexDecoder() {
+StringEncryption::StringEncryption() {
+}
+
+const StringEncryption::Context &
+StringEncryption::context(const string & key, const string & iv) {
+    static thread_local vector<Context> contexts;
+    static thread_local size_t next = 0;
+    contexts.reserve(ContextCacheSize);
+
+    for (const Context & context: contexts) {
+        if (context.impl->key == key && context.impl->iv == iv)
+            return context;
+    }
+
+    Context context(key, iv);
+    if (contexts.size() < ContextCacheSize) {
+        contexts.push_back(context);
+        return contexts.back();
+    }
+
+    size_t i = next++ % ContextCacheSize;
+    contexts[i] = context;
+    return contexts[i];
 }
 
 string
 StringEncryption::encrypt(const string & passback, const string & key, const string & iv) {
-    const byte * bk = reinterpret_cast<const byte *>(key.c_str());
-    const byte * biv =  reinterpret_cast<const byte *>(iv.c_str());
-
-    CFB_Mode<AES>::Encryption e(bk, AES::DEFAULT_KEYLENGTH, biv);
-    StreamTransformationFilter stfE(e);
-    stfE.Put((const byte *) passback.c_str(), passback.size());
-    byte pEnc[passback.size()];
-    stfE.Get(pEnc, passback.size());
-    string cipher(pEnc, pEnc + passback.size());
-    return addDigest(cipher);
+    return encrypt(context(key, iv), passback);
 }
 
 string
 StringEncryption::decrypt(const string & passback, const string & key, const string & iv) {
-    const byte * bk = reinterpret_cast<const byte *>(key.c_str());
-    const byte * biv =  reinterpret_cast<const byte *>(iv.c_str());
+    return decrypt(context(key, iv), passback);
+}
+
+string
+StringEncryption::encrypt(const Context & context, const string & passback) {
+    string result;
+    encrypt(context, passback, result);
+    return result;
+}
 
-    string noDigest = removeDigest(hexDecode(passback));
-    if (noDigest == "")
-        return "";
+string
+StringEncryption::decrypt(const Context & context, const string & passback) {
+    string result;
+    decrypt(context, passback, result);
+    return result;
+}
 
-    CFB_Mode<AES>::Decryption d(bk, AES::DEFAULT_KEYLENGTH, biv);
-    StreamTransformationFilter stfD(d);
-    stfD.Put((const byte *) noDigest.c_str(), noDigest.size());
-    byte pDec[noDigest.size()];
-    stfD.Get(pDec, noDigest.size());
-    string recovered(pDec, pDec + noDigest.size());
-    return recovered;
+void
+StringEncryption::encrypt(const Context & context,
+                          const string * passbacks, size_t n,
+                          string * out) {
+    for (size_t i = 0;  i < n;  ++i)
+        encrypt(context, passbacks[i], out[i]);
 }
 
-string StringEncryption::addDigest(const string & encrypted) {
-    return hexEncode(encrypted) + hexEncode(digest(encrypted));
+void
+StringEncryption::decrypt(const Context & context,
+                          const string * passbacks, size_t n,
+                          string * out) {
+    for (size_t i = 0;  i < n;  ++i)
+        decrypt(context, passbacks[i], out[i]);
 }
 
-string StringEncryption::removeDigest(const string & digested) {
-    if (digested.size() <= CRC32::DIGESTSIZE) {
-        return "";
+void
+StringEncryption::encrypt(const Context & context, const string & passback,
+                          string & out) {
+    size_t size = passback.size();
+    byte stackBuf[StackBufferSize + CRC32::DIGESTSIZE];
+    vector<byte> heapBuf;
+    byte * cipher = stackBuf;
+    if (size > StackBufferSize) {
+        heapBuf.resize(size + CRC32::DIGESTSIZE);
+        cipher = &heapBuf[0];
     }
 
-    const string digestStr = digested.substr(digested.size() - CRC32::DIGESTSIZE); 
-    const string encrypted = digested.substr(0, digested.size() - CRC32::DIGESTSIZE);
+    context.encrypt((const byte *) passback.c_str(), size, cipher);
+    digest(cipher, size, cipher + size);
 
-    if (digestStr == digest(encrypted))
-        return encrypted;
-    else
-        return "";
+    out.resize(hexEncodedLength(size + CRC32::DIGESTSIZE));
+    Datacratic::hexEncode(cipher, size + CRC32::DIGESTSIZE, &out[0]);
 }
 
-string StringEncryption::digest(const string & encrypted) {
-    int size = CRC32::DIGESTSIZE;
-    byte digest[size];
-    const byte * bencrypt = reinterpret_cast<const byte *>(encrypted.c_str());
+void
+StringEncryption::decrypt(const Context & context, const string & passback,
+                          string & out) {
+    out.clear();
+
+    size_t size = passback.size() / 2;
+    if (size <= CRC32::DIGESTSIZE)
+        return;
+
+    byte stackBuf[StackBufferSize + CRC32::DIGESTSIZE];
+    vector<byte> heapBuf;
+    byte * cipher = stackBuf;
+    if (size > StackBufferSize + CRC32::DIGESTSIZE) {
+        heapBuf.resize(size);
+        cipher = &heapBuf[0];
+    }
+
+    if (Datacratic::hexDecode(passback.c_str(), passback.size(), cipher) == -1)
+        return;
+
+    size -= CRC32::DIGESTSIZE;
+    byte dig[CRC32::DIGESTSIZE];
+    digest(cipher, size, dig);
+    if (memcmp(dig, cipher + size, CRC32::DIGESTSIZE) != 0)
+        return;
+
+    out.resize(size);
+    context.decrypt(cipher, size, (byte *) &out[0]);
+}
+
+void
+StringEncryption::digest(const byte * encrypted, size_t length, byte * digest) {
     CRC32 crc;
-    crc.CalculateDigest(digest, bencrypt, encrypted.size());
-    string dig(digest, digest + size);
-    return dig;
+    crc.CalculateDigest(digest, encrypted, length);
 }
 
 string
 StringEncryption::hexEncode(const string & decoded) {
-    hexEncoder.Put((const byte *)decoded.c_str(), decoded.size());
-    size_t dLen = decoded.size() * 2;
-    byte outBuf[dLen];
-    hexEncoder.Get(outBuf, dLen);
-    string encoded(outBuf, outBuf + dLen);
+    string encoded(hexEncodedLength(decoded.size()), 0);
+    Datacratic::hexEncode(decoded.c_str(), decoded.size(), &encoded[0]);
     return encoded;
 }
-    
-string
-StringEncryption::hexDecode(const string & encoded) {
-    hexDecoder.Put((const byte *)encoded.c_str(), encoded.size());
-    size_t eLen = encoded.size() / 2;
-    byte outBuf[eLen];
-    hexDecoder.Get(outBuf, eLen);
-    string decoded(outBuf, outBuf + eLen);
-    return decoded;
-}
 
 string
 StringEncryption::generateKey() {
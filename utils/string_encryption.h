@@ -6,8 +6,9 @@
 
 #pragma once
 
+#include <stddef.h>
+#include <memory>
 #include <string>
-#include "cryptopp/hex.h"
 
 namespace Datacratic {
 
@@ -17,11 +18,37 @@ namespace Datacratic {
 
 /**
  * Used to encrypt and decrypt passbacks in exchange connector
+ *
+ * Passbacks are encrypted with AES-128 in CFB mode, using the first 16
+ * bytes of the key and of the IV, and are followed by the CRC32 of the
+ * ciphertext, the whole being hex encoded.
 */
 
 struct StringEncryption {
 
     typedef unsigned char byte;
+
+    /** Cipher prepared once for a key and an IV.  It is immutable once
+        built, so a single one can be used from any number of threads.
+        Uses AES-NI when the CPU has it.
+    */
+    struct Context {
+        Context(const std::string & key, const std::string & iv);
+
+        /** Encrypt or decrypt length bytes of in to out, which can be the
+            same buffer.
+        */
+        void encrypt(const byte * in, size_t length, byte * out) const;
+        void decrypt(const byte * in, size_t length, byte * out) const;
+
+        bool hardwareAccelerated() const;
+
+        struct Impl;
+
+    private:
+        friend struct StringEncryption;
+        std::shared_ptr<const Impl> impl;
+    };
     
     StringEncryption();
 
@@ -29,6 +56,9 @@ struct StringEncryption {
 
     std::string generateIV();
     
+    /** Encrypt or decrypt using a context kept for the key and IV by the
+        calling thread.
+    */
     std::string encrypt(const std::string & passback,
                         const std::string & key,
                         const std::string & iv);
@@ -36,22 +66,45 @@ struct StringEncryption {
     std::string decrypt(const std::string & passback,
                         const std::string & key,
                         const std::string & iv);
-private: 
 
-    CryptoPP::HexEncoder hexEncoder;
-    CryptoPP::HexDecoder hexDecoder;
+    /** Encrypt or decrypt with the given context.  Decryption returns an
+        empty string if the passback is corrupt.
+    */
+    static std::string encrypt(const Context & context,
+                               const std::string & passback);
 
-    std::string digest(const std::string & encrypted);
+    static std::string decrypt(const Context & context,
+                               const std::string & passback);
 
-    std::string addDigest(const std::string & encrypted);
+    /** Encrypt or decrypt the n passbacks starting at passbacks into the n
+        strings starting at out, reusing their memory.
+    */
+    static void encrypt(const Context & context,
+                        const std::string * passbacks, size_t n,
+                        std::string * out);
 
-    std::string removeDigest(const std::string & digested);
+    static void decrypt(const Context & context,
+                        const std::string * passbacks, size_t n,
+                        std::string * out);
 
-    std::string byteToStr(byte * encode, size_t size);
+private: 
 
-    std::string hexEncode(const std::string & decoded);
+    /** Context of the calling thread for the key and IV. */
+    static const Context & context(const std::string & key,
+                                   const std::string & iv);
+
+    static void encrypt(const Context & context,
+                        const std::string & passback,
+                        std::string & out);
 
-    std::string hexDecode(const std::string & encoded);
+    static void decrypt(const Context & context,
+                        const std::string & passback,
+                        std::string & out);
+
+    /** CRC32 of the ciphertext, written to digest[4]. */
+    static void digest(const byte * encrypted, size_t length, byte * digest);
+
+    std::string hexEncode(const std::string & decoded);
 };
 
 } // namespace Datacratic
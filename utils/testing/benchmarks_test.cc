@@ -0,0 +1,132 @@
+/* benchmarks_test.cc
+   Copyright (c) 2014 Datacratic.  All rights reserved.
+
+   Tests for the benchmark suite.
+*/
+
+#define BOOST_TEST_MAIN
+#define BOOST_TEST_DYN_LINK
+
+#include <unistd.h>
+#include <sstream>
+#include <boost/test/unit_test.hpp>
+
+#include "soa/utils/benchmarks.h"
+
+using namespace std;
+using namespace Datacratic;
+
+
+namespace {
+
+BenchmarkOptions
+testOptions()
+{
+    BenchmarkOptions options;
+    options.warmup = 2;
+    options.repetitions = 3;
+    options.hardwareCounters = false;
+    return options;
+}
+
+} // file scope
+
+
+BOOST_AUTO_TEST_CASE( test_stats )
+{
+    BenchmarkStats stats = BenchmarkStats::compute({ 4, 1, 3, 2, 5 });
+    BOOST_CHECK_EQUAL(stats.count, 5);
+    BOOST_CHECK_EQUAL(stats.min, 1);
+    BOOST_CHECK_EQUAL(stats.max, 5);
+    BOOST_CHECK_EQUAL(stats.median, 3);
+    BOOST_CHECK_EQUAL(stats.mean, 3);
+    BOOST_CHECK_CLOSE(stats.p90, 4.6, 0.001);
+    BOOST_CHECK_CLOSE(stats.stddev, 1.5811, 0.01);
+
+    stats = BenchmarkStats::compute({ 1, 2 });
+    BOOST_CHECK_EQUAL(stats.median, 1.5);
+
+    stats = BenchmarkStats::compute({});
+    BOOST_CHECK_EQUAL(stats.count, 0);
+    BOOST_CHECK_EQUAL(stats.median, 0);
+}
+
+BOOST_AUTO_TEST_CASE( test_suite_run )
+{
+    for (bool useTsc: { false, true }) {
+        BenchmarkOptions options = testOptions();
+        options.useTsc = useTsc;
+        BenchmarkSuite suite("test", options);
+
+        int numRuns(0);
+        int numWarmups(0);
+        auto & result = suite.run("sleep", [&] (BenchmarkState & state)
+            {
+                numRuns++;
+                if (state.isWarmup())
+                    numWarmups++;
+
+                /* only the 10ms sleep is timed */
+                state.pause();
+                ::usleep(20000);
+                state.resume();
+                ::usleep(10000);
+                state.setItems(10);
+                state.addMetric("runs", numRuns);
+            });
+
+        BOOST_CHECK_EQUAL(numRuns, 5);
+        BOOST_CHECK_EQUAL(numWarmups, 2);
+        BOOST_CHECK_EQUAL(result.seconds.size(), 3);
+        BOOST_CHECK_GE(result.stats.min, 0.010);
+        BOOST_CHECK_LT(result.stats.median, 0.020);
+        BOOST_CHECK_EQUAL(result.items, 10);
+        BOOST_CHECK_CLOSE(result.itemsPerSecond(),
+                          10 / result.stats.median, 0.001);
+        BOOST_CHECK_EQUAL(result.metrics.at("runs").median, 4);
+    }
+}
+
+BOOST_AUTO_TEST_CASE( test_json_and_baseline )
+{
+    BenchmarkSuite suite("test", testOptions());
+    suite.run("fast", [&] (BenchmarkState & state) { ::usleep(1000); });
+    suite.run("slow", [&] (BenchmarkState & state) { ::usleep(1000); });
+
+    auto results = BenchmarkSuite::resultsFromJson(suite.toJson());
+    BOOST_REQUIRE_EQUAL(results.size(), 2);
+    BOOST_CHECK_EQUAL(results[0].name, "fast");
+    BOOST_CHECK(results[0].seconds == suite.results[0].seconds);
+    BOOST_CHECK_EQUAL(results[0].stats.median,
+                      suite.results[0].stats.median);
+    BOOST_CHECK_EQUAL(suite.compare(results), 0);
+
+    /* "slow" is now twice as slow as the baseline */
+    results[1].stats.median /= 2;
+    ostringstream out;
+    BOOST_CHECK_EQUAL(suite.compare(results, out), 1);
+    BOOST_CHECK(out.str().find("slow") != string::npos);
+    BOOST_CHECK(out.str().find("REGRESSION") != string::npos);
+}
+
+BOOST_AUTO_TEST_CASE( test_counters )
+{
+    /* the counters are often not available in virtual machines and
+       containers */
+    BenchmarkCounters counters;
+    if (!counters.available()) {
+        cerr << "no hardware counters: " << counters.error << endl;
+        return;
+    }
+
+    auto before = counters.read();
+    volatile int n = 0;
+    for (int i = 0;  i < 1000000;  ++i)
+        n = n + i;
+    auto after = counters.read();
+
+    for (unsigned i = 0;  i < counters.names().size();  ++i) {
+        if (counters.names()[i] == "instructions")
+            BOOST_CHECK_GT(after[i] - before[i], 1000000);
+    }
+}
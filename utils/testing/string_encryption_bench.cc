@@ -0,0 +1,193 @@
+/* string_encryption_bench.cc
+   Copyright (c) 2014 Datacratic Inc.  All rights reserved.
+
+   Passbacks encrypted and decrypted per second, with a cipher built by
+   Crypto++ for each call and hex coded through Crypto++ filters, as
+   StringEncryption used to do, and with StringEncryption itself, through
+   its per-thread contexts, with an explicit context and in batches.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+
+#include "cryptopp/aes.h"
+#include "cryptopp/crc.h"
+#include "cryptopp/hex.h"
+#include "cryptopp/modes.h"
+#include "soa/types/date.h"
+#include "soa/utils/string_encryption.h"
+
+using namespace std;
+using namespace Datacratic;
+using namespace CryptoPP;
+
+
+namespace {
+
+/* what StringEncryption used to do */
+struct LegacyEncryption {
+
+    string encrypt(const string & passback, const string & key,
+                   const string & iv)
+    {
+        CFB_Mode<AES>::Encryption e((const byte *)key.c_str(),
+                                    AES::DEFAULT_KEYLENGTH,
+                                    (const byte *)iv.c_str());
+        StreamTransformationFilter stfE(e);
+        stfE.Put((const byte *)passback.c_str(), passback.size());
+        string cipher(passback.size(), 0);
+        stfE.Get((byte *)&cipher[0], cipher.size());
+        return hexEncode(cipher) + hexEncode(digest(cipher));
+    }
+
+    string decrypt(const string & passback, const string & key,
+                   const string & iv)
+    {
+        string digested = hexDecode(passback);
+        if (digested.size() <= CRC32::DIGESTSIZE)
+            return "";
+        string cipher = digested.substr(0, digested.size() - CRC32::DIGESTSIZE);
+        if (digested.substr(cipher.size()) != digest(cipher))
+            return "";
+
+        CFB_Mode<AES>::Decryption d((const byte *)key.c_str(),
+                                    AES::DEFAULT_KEYLENGTH,
+                                    (const byte *)iv.c_str());
+        StreamTransformationFilter stfD(d);
+        stfD.Put((const byte *)cipher.c_str(), cipher.size());
+        string recovered(cipher.size(), 0);
+        stfD.Get((byte *)&recovered[0], recovered.size());
+        return recovered;
+    }
+
+    string digest(const string & data)
+    {
+        byte result[CRC32::DIGESTSIZE];
+        CRC32 crc;
+        crc.CalculateDigest(result, (const byte *)data.c_str(),
+                            data.size());
+        return string(result, result + sizeof(result));
+    }
+
+    string hexEncode(const string & decoded)
+    {
+        hexEncoder.Put((const byte *)decoded.c_str(), decoded.size());
+        string encoded(decoded.size() * 2, 0);
+        hexEncoder.Get((byte *)&encoded[0], encoded.size());
+        return encoded;
+    }
+
+    string hexDecode(const string & encoded)
+    {
+        hexDecoder.Put((const byte *)encoded.c_str(), encoded.size());
+        string decoded(encoded.size() / 2, 0);
+        hexDecoder.Get((byte *)&decoded[0], decoded.size());
+        return decoded;
+    }
+
+    HexEncoder hexEncoder;
+    HexDecoder hexDecoder;
+};
+
+template<typename Fn>
+void run(const char * name, size_t numOps, Fn && fn)
+{
+    Date start = Date::now();
+    size_t check = fn();
+    double elapsed = Date::now().secondsSince(start);
+    ::printf("%-24s %12.0f ops/s  (%zd)\n", name, numOps / elapsed, check);
+}
+
+} // file scope
+
+
+int main(int argc, char ** argv)
+{
+    size_t numOps = argc > 1 ? atoi(argv[1]) : 1000000;
+    size_t passbackSize = argc > 2 ? atoi(argv[2]) : 60;
+
+    string key = "0123456789ABCDEF0123456789ABCD";
+    string iv = "FEDCBA9876543210FEDCBA98765432";
+
+    vector<string> passbacks(1000);
+    for (unsigned i = 0;  i < passbacks.size();  ++i) {
+        passbacks[i] = to_string(i);
+        passbacks[i].resize(passbackSize, 'x');
+    }
+
+    LegacyEncryption legacy;
+    StringEncryption encryption;
+    StringEncryption::Context context(key, iv);
+
+    vector<string> encrypted(passbacks.size());
+    StringEncryption::encrypt(context, &passbacks[0], passbacks.size(),
+                              &encrypted[0]);
+
+    /* the sizes of the results are printed, to check that they agree */
+    for (int decrypt = 0;  decrypt < 2;  ++decrypt) {
+        const vector<string> & input = decrypt ? encrypted : passbacks;
+        const char * op = decrypt ? "decrypt" : "encrypt";
+        string name;
+
+        name = string(op) + " legacy";
+        run(name.c_str(), numOps, [&] ()
+            {
+                size_t total = 0;
+                for (size_t i = 0;  i < numOps;  ++i) {
+                    const string & in = input[i % input.size()];
+                    total += (decrypt
+                              ? legacy.decrypt(in, key, iv)
+                              : legacy.encrypt(in, key, iv)).size();
+                }
+                return total;
+            });
+
+        name = string(op) + " per key";
+        run(name.c_str(), numOps, [&] ()
+            {
+                size_t total = 0;
+                for (size_t i = 0;  i < numOps;  ++i) {
+                    const string & in = input[i % input.size()];
+                    total += (decrypt
+                              ? encryption.decrypt(in, key, iv)
+                              : encryption.encrypt(in, key, iv)).size();
+                }
+                return total;
+            });
+
+        name = string(op) + " context";
+        run(name.c_str(), numOps, [&] ()
+            {
+                size_t total = 0;
+                for (size_t i = 0;  i < numOps;  ++i) {
+                    const string & in = input[i % input.size()];
+                    total += (decrypt
+                              ? StringEncryption::decrypt(context, in)
+                              : StringEncryption::encrypt(context, in)).size();
+                }
+                return total;
+            });
+
+        name = string(op) + " batch";
+        vector<string> output(input.size());
+        run(name.c_str(), numOps, [&] ()
+            {
+                size_t total = 0;
+                for (size_t i = 0;  i < numOps;  i += input.size()) {
+                    size_t n = std::min(input.size(), numOps - i);
+                    if (decrypt)
+                        StringEncryption::decrypt(context, &input[0], n,
+                                                  &output[0]);
+                    else StringEncryption::encrypt(context, &input[0], n,
+                                                   &output[0]);
+                    for (size_t j = 0;  j < n;  ++j)
+                        total += output[j].size();
+                }
+                return total;
+            });
+    }
+
+    return 0;
+}
@@ -0,0 +1,153 @@
+/* string_encryption_test.cc
+   Copyright (c) 2014 Datacratic Inc.  All rights reserved.
+
+   Tests of the passback encryption and of the hex and base64 coding.
+*/
+
+#define BOOST_TEST_MAIN
+#define BOOST_TEST_DYN_LINK
+
+#include <boost/test/unit_test.hpp>
+#include <string>
+#include <vector>
+
+#include "jml/arch/exception.h"
+#include "soa/utils/string_coding.h"
+#include "soa/utils/string_encryption.h"
+
+using namespace std;
+using namespace Datacratic;
+
+
+namespace {
+
+typedef unsigned char byte;
+
+string fromHex(const string & hex)
+{
+    string result(hex.size() / 2, 0);
+    BOOST_REQUIRE_EQUAL(hexDecode(hex.c_str(), hex.size(), &result[0]),
+                        (ssize_t)result.size());
+    return result;
+}
+
+string toHex(const string & data, bool upperCase = true)
+{
+    string result(hexEncodedLength(data.size()), 0);
+    hexEncode(data.c_str(), data.size(), &result[0], upperCase);
+    return result;
+}
+
+/* CFB128-AES128 vectors of NIST SP 800-38A, F.3.13 */
+const string nistKey = fromHex("2b7e151628aed2a6abf7158809cf4f3c");
+const string nistIv = fromHex("000102030405060708090a0b0c0d0e0f");
+const string nistPlaintext = fromHex(
+    "6bc1bee22e409f96e93d7e117393172a"
+    "ae2d8a571e03ac9c9eb76fac45af8e51"
+    "30c81c46a35ce411e5fbc1191a0a52ef"
+    "f69f2445df4f9b17ad2b417be66c3710");
+const string nistCiphertext = fromHex(
+    "3b3fd92eb72dad20333449f8e83cfb4a"
+    "c8a64537a0b3a93fcde3cdad9f1ce58b"
+    "26751f67a3cbb140b1808cf187a4f4df"
+    "c04b05357c5d1c0eeac4c66f9ff7f2e6");
+
+} // file scope
+
+
+BOOST_AUTO_TEST_CASE( test_hex_coding )
+{
+    BOOST_CHECK_EQUAL(toHex(string("\x01\xab\xff", 3)), "01ABFF");
+    BOOST_CHECK_EQUAL(toHex(string("\x01\xab\xff", 3), false), "01abff");
+    BOOST_CHECK_EQUAL(fromHex("01abFF"), string("\x01\xab\xff", 3));
+
+    char out[8];
+    BOOST_CHECK_EQUAL(hexDecode("abc", 3, out), -1);
+    BOOST_CHECK_EQUAL(hexDecode("ag", 2, out), -1);
+    BOOST_CHECK_EQUAL(hexDecode("", 0, out), 0);
+}
+
+BOOST_AUTO_TEST_CASE( test_base64_coding )
+{
+    /* vectors of RFC 4648 */
+    vector<pair<string, string> > vectors = {
+        { "", "" }, { "f", "Zg==" }, { "fo", "Zm8=" }, { "foo", "Zm9v" },
+        { "foob", "Zm9vYg==" }, { "fooba", "Zm9vYmE=" },
+        { "foobar", "Zm9vYmFy" }
+    };
+
+    for (auto & v: vectors) {
+        char encoded[16], decoded[16];
+        size_t n = base64Encode(v.first.c_str(), v.first.size(), encoded);
+        BOOST_CHECK_EQUAL(n, base64EncodedLength(v.first.size()));
+        BOOST_CHECK_EQUAL(string(encoded, n), v.second);
+
+        ssize_t m = base64Decode(v.second.c_str(), v.second.size(), decoded);
+        BOOST_REQUIRE_GE(m, 0);
+        BOOST_CHECK_EQUAL(string(decoded, m), v.first);
+    }
+
+    char out[16];
+    BOOST_CHECK_EQUAL(base64Decode("Zm9vYg", 6, out), 4);
+    BOOST_CHECK_EQUAL(base64Decode("Zm9vY", 5, out), -1);
+    BOOST_CHECK_EQUAL(base64Decode("Zm9*", 4, out), -1);
+}
+
+BOOST_AUTO_TEST_CASE( test_cfb_vectors )
+{
+    StringEncryption::Context context(nistKey, nistIv);
+
+    /* every length, to go through the whole and the partial blocks */
+    for (size_t n = 0;  n <= nistPlaintext.size();  ++n) {
+        string cipher(n, 0), plain(n, 0);
+        context.encrypt((const byte *)nistPlaintext.c_str(), n,
+                        (byte *)&cipher[0]);
+        BOOST_CHECK_EQUAL(toHex(cipher), toHex(nistCiphertext.substr(0, n)));
+
+        context.decrypt((const byte *)cipher.c_str(), n, (byte *)&plain[0]);
+        BOOST_CHECK_EQUAL(toHex(plain), toHex(nistPlaintext.substr(0, n)));
+    }
+
+    BOOST_CHECK_THROW(StringEncryption::Context("short", nistIv),
+                      ML::Exception);
+}
+
+BOOST_AUTO_TEST_CASE( test_passback_encryption )
+{
+    StringEncryption encryption;
+    string key = "0123456789ABCDEF0123456789ABCD";
+    string iv = "FEDCBA9876543210FEDCBA98765432";
+
+    string passback = "{\"account\":\"hello:world\",\"price\":1234}";
+    string encrypted = encryption.encrypt(passback, key, iv);
+    BOOST_CHECK_EQUAL(encrypted.size(), (passback.size() + 4) * 2);
+    BOOST_CHECK_EQUAL(encryption.decrypt(encrypted, key, iv), passback);
+
+    /* the passback is followed by its checksum */
+    string corrupt = encrypted;
+    corrupt[4] = (corrupt[4] == '0' ? '1' : '0');
+    BOOST_CHECK_EQUAL(encryption.decrypt(corrupt, key, iv), "");
+    BOOST_CHECK_EQUAL(encryption.decrypt("", key, iv), "");
+    BOOST_CHECK_EQUAL(encryption.decrypt("XYZ", key, iv), "");
+
+    /* the ciphertext is AES-128-CFB of the passback */
+    string nist = StringEncryption::encrypt(
+            StringEncryption::Context(nistKey, nistIv), nistPlaintext);
+    BOOST_CHECK_EQUAL(nist.substr(0, nistCiphertext.size() * 2),
+                      toHex(nistCiphertext));
+
+    /* batches */
+    StringEncryption::Context context(key, iv);
+    vector<string> passbacks = { "", "a", passback, string(1000, 'x') };
+    vector<string> encrypteds(passbacks.size()), decrypteds(passbacks.size());
+    StringEncryption::encrypt(context, &passbacks[0], passbacks.size(),
+                              &encrypteds[0]);
+    StringEncryption::decrypt(context, &encrypteds[0], encrypteds.size(),
+                              &decrypteds[0]);
+    for (unsigned i = 0;  i < passbacks.size();  ++i) {
+        BOOST_CHECK_EQUAL(encrypteds[i], encryption.encrypt(passbacks[i],
+                                                            key, iv));
+        if (!passbacks[i].empty())
+            BOOST_CHECK_EQUAL(decrypteds[i], passbacks[i]);
+    }
+}
@@ -12,12 +12,13 @@ LIB_TEST_UTILS_SOURCES := \
         threaded_test.cc
 
 LIB_TEST_UTILS_LINK := \
-	arch utils boost_filesystem
+	arch utils jsoncpp boost_filesystem
 
 $(eval $(call library,test_utils,$(LIB_TEST_UTILS_SOURCES),$(LIB_TEST_UTILS_LINK)))
 
 $(eval $(call library,variadic_hash,variadic_hash.cc,cityhash))
-$(eval $(call library,string_encryption,string_encryption.cc,crypto++))
+$(eval $(call library,string_encryption,string_encryption.cc string_coding.cc,crypto++ arch))
+$(eval $(call set_compile_option,string_encryption.cc,-maes))
 $(eval $(call program,string_encryption_keygen,string_encryption))
 
 ifeq ($(PYTHON_ENABLED),1)